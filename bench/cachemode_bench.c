@@ -0,0 +1,160 @@
+/*
+ * Measures the throughput and latency of random writes and reads for each
+ * cache mode. The image is overwritten, so only run this on scratch images.
+ *
+ * usage: cachemode_bench <path> [format] [requests]
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "diskimage.h"
+
+/* The size of each request. */
+#define REQUEST_SIZE 4096
+/* The number of writes between each flush. */
+#define FLUSH_INTERVAL 32
+
+struct mode {
+	const char *name;
+	enum diskimage_cache_mode mode;
+};
+
+static struct mode modes[] = {
+	{"none", LDI_CACHE_NONE},
+	{"writethrough", LDI_CACHE_WRITETHROUGH},
+	{"writeback", LDI_CACHE_WRITEBACK},
+	{"unsafe", LDI_CACHE_UNSAFE},
+	{NULL, 0}
+};
+
+/*
+ * Returns the current time in microseconds.
+ */
+static double
+now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int
+compare_double(const void *a, const void *b)
+{
+	double da = *(const double *)a, db = *(const double *)b;
+
+	return (da > db) - (da < db);
+}
+
+/*
+ * Prints throughput, average and 99th percentile latency for the run.
+ */
+static void
+report(const char *what, double *latencies, int count, double total_us)
+{
+	double sum = 0;
+	int i;
+
+	for (i = 0; i < count; i++)
+		sum += latencies[i];
+	qsort(latencies, count, sizeof(double), compare_double);
+
+	printf("  %-6s %9.1f MB/s %9.1f us avg %9.1f us p99\n", what,
+	    (double)count * REQUEST_SIZE / total_us,
+	    sum / count, latencies[count * 99 / 100]);
+}
+
+/*
+ * Runs the random write and read workload with the given cache mode.
+ */
+static void
+run(char *path, char *format, struct mode *mode, int requests)
+{
+	struct diskimage_options options;
+	struct diskimage *di;
+	struct logger logger = {.write = NULL};
+	double *latencies, start, t;
+	off_t *offsets;
+	size_t sectors;
+	char *buf;
+	int i;
+	LDI_ERROR res;
+
+	bzero(&options, sizeof(options));
+	options.cache_mode = mode->mode;
+
+	res = diskimage_open_options(path, format, options, logger, &di);
+	if (res.code != LDI_ERR_NOERROR)
+		errx(1, "Failed to open %s: %d", path, res.code);
+
+	/* Direct I/O wants aligned buffers. */
+	if (posix_memalign((void **)&buf, REQUEST_SIZE, REQUEST_SIZE) != 0)
+		err(1, "posix_memalign");
+	memset(buf, 0xA5, REQUEST_SIZE);
+	latencies = malloc(requests * sizeof(double));
+	offsets = malloc(requests * sizeof(off_t));
+	if (latencies == NULL || offsets == NULL)
+		err(1, "malloc");
+
+	/* Use the same offsets for all modes. */
+	srandom(1);
+	sectors = diskimage_diskinfo(di).disksize / REQUEST_SIZE;
+	for (i = 0; i < requests; i++)
+		offsets[i] = (off_t)(random() % sectors) * REQUEST_SIZE;
+
+	printf("%s:\n", mode->name);
+
+	start = now_us();
+	for (i = 0; i < requests; i++) {
+		t = now_us();
+		res = diskimage_write(di, buf, REQUEST_SIZE, offsets[i]);
+		if (res.code == LDI_ERR_NOERROR && (i + 1) % FLUSH_INTERVAL == 0)
+			res = diskimage_flush(di);
+		if (res.code != LDI_ERR_NOERROR)
+			errx(1, "Write failed: %d", res.code);
+		latencies[i] = now_us() - t;
+	}
+	report("write", latencies, requests, now_us() - start);
+
+	start = now_us();
+	for (i = 0; i < requests; i++) {
+		t = now_us();
+		res = diskimage_read(di, buf, REQUEST_SIZE, offsets[requests - i - 1]);
+		if (res.code != LDI_ERR_NOERROR)
+			errx(1, "Read failed: %d", res.code);
+		latencies[i] = now_us() - t;
+	}
+	report("read", latencies, requests, now_us() - start);
+
+	diskimage_destroy(&di);
+	free(offsets);
+	free(latencies);
+	free(buf);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char *format = "vhd";
+	int requests = 10000;
+	int i;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <path> [format] [requests]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (argc > 2)
+		format = argv[2];
+	if (argc > 3)
+		requests = atoi(argv[3]);
+
+	for (i = 0; modes[i].name; i++)
+		run(argv[1], format, &modes[i], requests);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,120 @@
+/*
+ * Measures how long it takes to provision thin clones of a template image
+ * with diskimage_create_child, and how much disk space the clones use.
+ * The clones are created in the given directory and removed afterwards.
+ *
+ * usage: clone_bench <template> <directory> [format] [clones]
+ */
+
+#include <sys/stat.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "diskimage.h"
+
+/*
+ * Returns the current time in microseconds.
+ */
+static double
+now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int
+compare_double(const void *a, const void *b)
+{
+	double da = *(const double *)a, db = *(const double *)b;
+
+	return (da > db) - (da < db);
+}
+
+/*
+ * Returns the number of bytes allocated on disk for the file.
+ */
+static off_t
+disk_usage(const char *path)
+{
+	struct stat sb;
+
+	if (stat(path, &sb) == -1)
+		err(1, "stat %s", path);
+	return sb.st_blocks * 512;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct logger logger = {.write = NULL};
+	struct diskimage *di;
+	char *format = "vhd";
+	char **paths;
+	double *latencies, start, total_us;
+	off_t usage;
+	int clones = 1000;
+	int i;
+	LDI_ERROR res;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s <template> <directory> [format] [clones]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (argc > 3)
+		format = argv[3];
+	if (argc > 4)
+		clones = atoi(argv[4]);
+
+	paths = calloc(clones, sizeof(char *));
+	latencies = malloc(clones * sizeof(double));
+	if (paths == NULL || latencies == NULL)
+		err(1, "malloc");
+	for (i = 0; i < clones; i++) {
+		if (asprintf(&paths[i], "%s/clone%d.%s", argv[2], i, format) == -1)
+			err(1, "asprintf");
+	}
+
+	start = now_us();
+	for (i = 0; i < clones; i++) {
+		latencies[i] = now_us();
+		res = diskimage_create_child(argv[1], paths[i], format, logger);
+		if (res.code != LDI_ERR_NOERROR)
+			errx(1, "Failed to create %s: %d", paths[i], res.code);
+		latencies[i] = now_us() - latencies[i];
+	}
+	total_us = now_us() - start;
+
+	/* Check that the clones can be opened by the library. */
+	res = diskimage_open(paths[clones - 1], format, logger, &di);
+	if (res.code == LDI_ERR_NOERROR)
+		diskimage_destroy(&di);
+	else
+		warnx("Failed to open %s: %d", paths[clones - 1], res.code);
+
+	usage = 0;
+	for (i = 0; i < clones; i++)
+		usage += disk_usage(paths[i]);
+	qsort(latencies, clones, sizeof(double), compare_double);
+
+	printf("%d clones in %.1f ms\n", clones, total_us / 1e3);
+	printf("  %9.1f us avg %9.1f us p99\n", total_us / clones,
+	    latencies[clones * 99 / 100]);
+	printf("  %9.1f KB per clone, template %.1f KB\n",
+	    (double)usage / clones / 1024, (double)disk_usage(argv[1]) / 1024);
+
+	for (i = 0; i < clones; i++) {
+		unlink(paths[i]);
+		free(paths[i]);
+	}
+	free(paths);
+	free(latencies);
+
+	return EXIT_SUCCESS;
+}
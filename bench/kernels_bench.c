@@ -0,0 +1,156 @@
+/*
+ * Measures the throughput of the byte sum, big endian uint32 and zero
+ * detection kernels for each instruction set supported by the CPU, and
+ * the speedup compared to the scalar kernels.
+ *
+ * usage: kernels_bench [megabytes]
+ *
+ * The default buffer of 1 MB fits in the caches, like a BAT being decoded;
+ * larger buffers mostly measure the memory bandwidth.
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "kernels.h"
+
+/* The number of times each kernel is run over the buffer. */
+#define ITERATIONS 20
+/* The size of a VHD footer, the common case for the byte sum. */
+#define FOOTER_SIZE 512
+
+enum kernel {
+	BYTESUM,
+	FOOTER_BYTESUM,
+	BE32DEC,
+	BE32ENC,
+	ZERO_PREFIX,
+	ZERO_SUFFIX,
+	KERNEL_COUNT
+};
+
+static const char *kernel_names[KERNEL_COUNT] = {
+	"bytesum",
+	"bytesum (512B)",
+	"be32dec_array",
+	"be32enc_array",
+	"zero_prefix",
+	"zero_suffix",
+};
+
+/* Prevents the compiler from removing the kernel calls. */
+static volatile uint64_t sink;
+
+/*
+ * Returns the current time in seconds.
+ */
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Runs the kernel over the buffer and returns the throughput in GB/s.
+ */
+static double
+run(enum kernel kernel, char *buf, char *zeros, uint32_t *words, size_t size)
+{
+	double start;
+	size_t pos;
+	int i;
+
+	start = now();
+	for (i = 0; i < ITERATIONS; i++) {
+		switch (kernel) {
+		case BYTESUM:
+			sink += kernel_bytesum(buf, size);
+			break;
+		case FOOTER_BYTESUM:
+			for (pos = 0; pos + FOOTER_SIZE <= size; pos += FOOTER_SIZE)
+				sink += kernel_bytesum(buf + pos, FOOTER_SIZE);
+			break;
+		case BE32DEC:
+			kernel_be32dec_array(words, buf, size / 4);
+			sink += words[i];
+			break;
+		case BE32ENC:
+			kernel_be32enc_array(buf, words, size / 4);
+			sink += buf[i];
+			break;
+		case ZERO_PREFIX:
+			sink += kernel_zero_prefix(zeros, size);
+			break;
+		case ZERO_SUFFIX:
+			sink += kernel_zero_suffix(zeros, size);
+			break;
+		default:
+			break;
+		}
+	}
+
+	return (double)size * ITERATIONS / (now() - start) / 1e9;
+}
+
+int
+main(int argc, char *argv[])
+{
+	double results[KERNEL_ISA_COUNT][KERNEL_COUNT];
+	uint32_t *words;
+	char *buf, *zeros;
+	size_t size = 1;
+	size_t i;
+	int isa, kernel;
+
+	if (argc > 1)
+		size = atoi(argv[1]);
+	size *= 1024 * 1024;
+
+	buf = malloc(size);
+	zeros = calloc(1, size);
+	words = malloc(size);
+	if (buf == NULL || zeros == NULL || words == NULL)
+		err(1, "malloc");
+	for (i = 0; i < size; i++)
+		buf[i] = (char)(i * 31 + 7);
+
+	printf("%-16s", "kernel");
+	for (isa = 0; isa < KERNEL_ISA_COUNT; isa++)
+		printf("%18s", kernel_isa_name(isa));
+	printf("\n");
+
+	for (isa = 0; isa < KERNEL_ISA_COUNT; isa++) {
+		if (!kernel_set_isa(isa))
+			continue;
+		for (kernel = 0; kernel < KERNEL_COUNT; kernel++) {
+			/* Warm up the caches and page in the buffers. */
+			run(kernel, buf, zeros, words, size);
+			results[isa][kernel] = run(kernel, buf, zeros, words, size);
+		}
+	}
+
+	for (kernel = 0; kernel < KERNEL_COUNT; kernel++) {
+		printf("%-16s", kernel_names[kernel]);
+		for (isa = 0; isa < KERNEL_ISA_COUNT; isa++) {
+			if (!kernel_isa_supported(isa)) {
+				printf("%18s", "-");
+				continue;
+			}
+			printf("%7.2f GB/s %5.1fx", results[isa][kernel],
+			    results[isa][kernel] / results[KERNEL_ISA_SCALAR][kernel]);
+		}
+		printf("\n");
+	}
+
+	free(words);
+	free(zeros);
+	free(buf);
+
+	return EXIT_SUCCESS;
+}
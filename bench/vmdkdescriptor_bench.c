@@ -0,0 +1,151 @@
+/*
+ * Measures how long it takes to parse the descriptor of a split VMDK with
+ * many extents, and to open such an image with diskimage_open. The image
+ * is created in the given directory and removed afterwards. Only the first
+ * extent file is created, since the others are opened when first read.
+ *
+ * usage: vmdkdescriptor_bench <directory> [extents] [iterations]
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "diskimage.h"
+#include "vmdkdescriptorfile.h"
+
+/* The sectors in each extent of a twoGbMaxExtentFlat image. */
+#define EXTENT_SECTORS 4194304
+
+/*
+ * Returns the current time in microseconds.
+ */
+static double
+now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/*
+ * Returns a descriptor for a split image with the given number of extents.
+ */
+static char *
+make_descriptor(int extents, size_t *length)
+{
+	char *descriptor;
+	size_t capacity, pos;
+	int i;
+
+	capacity = 256 + (size_t)extents * 64;
+	descriptor = malloc(capacity);
+	if (descriptor == NULL)
+		err(1, "malloc");
+
+	pos = snprintf(descriptor, capacity,
+	    "# Disk DescriptorFile\n"
+	    "version=1\n"
+	    "CID=fffffffe\n"
+	    "parentCID=ffffffff\n"
+	    "createType=\"twoGbMaxExtentFlat\"\n"
+	    "\n"
+	    "# Extent description\n");
+	for (i = 0; i < extents; i++) {
+		pos += snprintf(descriptor + pos, capacity - pos,
+		    "RW %d FLAT \"bench-f%06d.vmdk\" 0\n", EXTENT_SECTORS, i + 1);
+	}
+	pos += snprintf(descriptor + pos, capacity - pos,
+	    "\n"
+	    "# The Disk Data Base\n"
+	    "#DDB\n"
+	    "\n"
+	    "ddb.adapterType = \"lsilogic\"\n");
+
+	*length = pos;
+	return descriptor;
+}
+
+/*
+ * Writes length bytes of data to a new file at path.
+ */
+static void
+write_file(char *path, char *data, size_t length)
+{
+	FILE *f;
+
+	f = fopen(path, "w");
+	if (f == NULL)
+		err(1, "fopen %s", path);
+	if (fwrite(data, 1, length, f) != length)
+		err(1, "fwrite %s", path);
+	fclose(f);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct logger logger = {.write = NULL};
+	struct vmdkdescriptorfile *descriptorfile;
+	struct diskimage *di;
+	char *descriptor, *path, *extent_path;
+	double start, parse_us, open_us;
+	size_t length;
+	int extents = 10000;
+	int iterations = 100;
+	int i;
+	LDI_ERROR res;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <directory> [extents] [iterations]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (argc > 2)
+		extents = atoi(argv[2]);
+	if (argc > 3)
+		iterations = atoi(argv[3]);
+
+	descriptor = make_descriptor(extents, &length);
+	if (asprintf(&path, "%s/bench.vmdk", argv[1]) == -1 ||
+	    asprintf(&extent_path, "%s/bench-f000001.vmdk", argv[1]) == -1)
+		err(1, "asprintf");
+	write_file(path, descriptor, length);
+	write_file(extent_path, "", 0);
+
+	start = now_us();
+	for (i = 0; i < iterations; i++) {
+		res = vmdkdescriptorfile_new(descriptor, &descriptorfile, length, logger);
+		if (res.code != LDI_ERR_NOERROR)
+			errx(1, "Failed to parse the descriptor: %d", res.code);
+		if (descriptorfile->numextents != extents)
+			errx(1, "Parsed %d extents", descriptorfile->numextents);
+		vmdkdescriptorfile_destroy(&descriptorfile);
+	}
+	parse_us = (now_us() - start) / iterations;
+
+	start = now_us();
+	for (i = 0; i < iterations; i++) {
+		res = diskimage_open(path, "vmdk", logger, &di);
+		if (res.code != LDI_ERR_NOERROR)
+			errx(1, "Failed to open %s: %d", path, res.code);
+		diskimage_destroy(&di);
+	}
+	open_us = (now_us() - start) / iterations;
+
+	printf("%d extents, %zu byte descriptor\n", extents, length);
+	printf("  parse %10.1f us %8.1f MB/s %8.1f ns per extent\n", parse_us,
+	    length / parse_us, parse_us * 1e3 / extents);
+	printf("  open  %10.1f us\n", open_us);
+
+	unlink(extent_path);
+	unlink(path);
+	free(extent_path);
+	free(path);
+	free(descriptor);
+
+	return EXIT_SUCCESS;
+}
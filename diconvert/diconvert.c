@@ -0,0 +1,83 @@
+#include <err.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "diskimage.h"
+
+#define DEFAULT_FORMAT "ldz"
+
+/* The highest levels that are logged, warnings or with -v information. */
+#define LOG_LEVEL 2
+#define LOG_LEVEL_VERBOSE 3
+
+static void
+log_write(int level, void *privarg, char *fmt, ...)
+{
+	va_list args;
+
+	if (level > *(int *)privarg) {
+		return;
+	}
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-v] [-f format] [-O format] source destination\n",
+	    getprogname());
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct diskimage *di;
+	char *source_format, *format;
+	struct logger logger = {
+		.write = log_write
+	};
+	LDI_ERROR res;
+	int ch, level;
+
+	source_format = LDI_FORMAT_AUTO;
+	format = DEFAULT_FORMAT;
+	level = LOG_LEVEL;
+	logger.privarg = &level;
+	while ((ch = getopt(argc, argv, "f:O:v")) != -1) {
+		switch (ch) {
+		case 'f':
+			source_format = optarg;
+			break;
+		case 'O':
+			format = optarg;
+			break;
+		case 'v':
+			level = LOG_LEVEL_VERBOSE;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 2)
+		usage();
+
+	res = diskimage_open(argv[0], source_format, logger, &di);
+	if (res.code != LDI_ERR_NOERROR)
+		errx(EXIT_FAILURE, "Error opening disk: %s", argv[0]);
+
+	res = diskimage_convert(di, argv[1], format, logger);
+	diskimage_destroy(&di);
+	if (res.code == LDI_ERR_FILENOTSUP)
+		errx(EXIT_FAILURE, "Can't convert to %s", format);
+	if (res.code != LDI_ERR_NOERROR)
+		errx(EXIT_FAILURE, "Error converting disk: %s", argv[1]);
+
+	return (EXIT_SUCCESS);
+}
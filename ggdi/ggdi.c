@@ -106,12 +106,24 @@ once_again:
 			break;
 
 		case BIO_DELETE:
+			result = diskimage_discard(di, ggio.gctl_length,
+			    ggio.gctl_offset);
+			if (result.code != LDI_ERR_NOERROR) 
+				error = EIO;
+			break;
+
 		case BIO_WRITE:
 			result = diskimage_write(di, ggio.gctl_data, 
 			    ggio.gctl_length, ggio.gctl_offset);
 			if (result.code != LDI_ERR_NOERROR) 
 				error = errno;
 			break;
+
+		case BIO_FLUSH:
+			result = diskimage_flush(di);
+			if (result.code != LDI_ERR_NOERROR)
+				error = EIO;
+			break;
 		default:
 			error = EOPNOTSUPP;
 		}
@@ -143,7 +155,7 @@ ggdi_create(char *path)
 	struct logger logger = {
 		.write = log_write
 	};
-	res = diskimage_open(path, "vhd", logger, &di);
+	res = diskimage_open(path, LDI_FORMAT_AUTO, logger, &di);
 	if (res.code != LDI_ERR_NOERROR) {
 		printf("Error opening disk: %s\n", path);
 		exit(-1);
@@ -0,0 +1,248 @@
+
+#include <sys/types.h>
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blockcache.h"
+#include "internal.h"
+
+/*
+ * A cached block. Entries are both in a hash chain and in the LRU list.
+ */
+struct entry {
+	uint64_t block;
+	void   *data;
+	size_t	length;
+	/* The next entry in the same hash bucket. */
+	struct entry *next;
+	/* The neighbours in the LRU list. */
+	struct entry *newer;
+	struct entry *older;
+};
+
+struct blockcache {
+	size_t	capacity;
+	size_t	count;
+	/* The hash buckets, about twice as many as the capacity. */
+	struct entry **buckets;
+	size_t	nbuckets;
+	/* The ends of the LRU list. */
+	struct entry *newest;
+	struct entry *oldest;
+	/* Protects all of the above. */
+	pthread_mutex_t lock;
+};
+
+/*
+ * Creates a cache that holds at most capacity blocks.
+ */
+LDI_ERROR
+blockcache_create(size_t capacity, struct blockcache **cache)
+{
+	*cache = malloc(sizeof(struct blockcache));
+	if (*cache == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	(*cache)->capacity = capacity;
+	(*cache)->count = 0;
+	(*cache)->nbuckets = capacity * 2 + 1;
+	(*cache)->newest = NULL;
+	(*cache)->oldest = NULL;
+	(*cache)->buckets = calloc((*cache)->nbuckets, sizeof(struct entry *));
+	if ((*cache)->buckets == NULL) {
+		free(*cache);
+		*cache = NULL;
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	pthread_mutex_init(&(*cache)->lock, NULL);
+
+	return NO_ERROR;
+}
+
+/*
+ * Frees the cache and all cached blocks and sets the pointer to NULL.
+ */
+void
+blockcache_destroy(struct blockcache **cache)
+{
+	struct entry *entry, *older;
+
+	for (entry = (*cache)->newest; entry != NULL; entry = older) {
+		older = entry->older;
+		free(entry->data);
+		free(entry);
+	}
+	free((*cache)->buckets);
+	pthread_mutex_destroy(&(*cache)->lock);
+	free(*cache);
+	*cache = NULL;
+}
+
+/*
+ * Returns the hash bucket of the block.
+ */
+static struct entry **
+bucket(struct blockcache *cache, uint64_t block)
+{
+	/* Spread consecutive blocks over the buckets. */
+	return &cache->buckets[(block * 0x9E3779B97F4A7C15ULL >> 32) % cache->nbuckets];
+}
+
+/*
+ * Removes the entry from the LRU list.
+ */
+static void
+unlink_entry(struct blockcache *cache, struct entry *entry)
+{
+	if (entry->newer != NULL) {
+		entry->newer->older = entry->older;
+	} else {
+		cache->newest = entry->older;
+	}
+	if (entry->older != NULL) {
+		entry->older->newer = entry->newer;
+	} else {
+		cache->oldest = entry->newer;
+	}
+}
+
+/*
+ * Adds the entry to the front of the LRU list.
+ */
+static void
+push_entry(struct blockcache *cache, struct entry *entry)
+{
+	entry->newer = NULL;
+	entry->older = cache->newest;
+	if (cache->newest != NULL) {
+		cache->newest->newer = entry;
+	} else {
+		cache->oldest = entry;
+	}
+	cache->newest = entry;
+}
+
+/*
+ * Returns the entry of the block, or NULL if it is not cached.
+ */
+static struct entry *
+find_entry(struct blockcache *cache, uint64_t block)
+{
+	struct entry *entry;
+
+	for (entry = *bucket(cache, block); entry != NULL; entry = entry->next) {
+		if (entry->block == block) {
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Removes the entry from the cache and frees it.
+ */
+static void
+remove_entry(struct blockcache *cache, struct entry *entry)
+{
+	struct entry **link;
+
+	unlink_entry(cache, entry);
+	for (link = bucket(cache, entry->block); *link != entry; link = &(*link)->next)
+		;
+	*link = entry->next;
+	cache->count--;
+
+	free(entry->data);
+	free(entry);
+}
+
+/*
+ * Removes the least recently used block from the cache.
+ */
+static void
+evict(struct blockcache *cache)
+{
+	remove_entry(cache, cache->oldest);
+}
+
+/*
+ * Copies nbytes at offset in the block into the buffer, if it is cached.
+ */
+bool
+blockcache_get(struct blockcache *cache, uint64_t block, void *buf, size_t offset, size_t nbytes)
+{
+	struct entry *entry;
+	bool found = false;
+
+	pthread_mutex_lock(&cache->lock);
+	entry = find_entry(cache, block);
+	if (entry != NULL && offset + nbytes <= entry->length) {
+		memcpy(buf, (char *)entry->data + offset, nbytes);
+		/* Move the block to the front of the LRU list. */
+		unlink_entry(cache, entry);
+		push_entry(cache, entry);
+		found = true;
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	return found;
+}
+
+/*
+ * Adds a block to the cache, which takes ownership of the data.
+ */
+void
+blockcache_put(struct blockcache *cache, uint64_t block, void *data, size_t length)
+{
+	struct entry *entry, **head;
+
+	pthread_mutex_lock(&cache->lock);
+	if (cache->capacity == 0 || find_entry(cache, block) != NULL) {
+		/* Another reader added the block first. */
+		pthread_mutex_unlock(&cache->lock);
+		free(data);
+		return;
+	}
+
+	entry = malloc(sizeof(struct entry));
+	if (entry == NULL) {
+		/* The cache is only an optimization. */
+		pthread_mutex_unlock(&cache->lock);
+		free(data);
+		return;
+	}
+	if (cache->count == cache->capacity) {
+		evict(cache);
+	}
+
+	entry->block = block;
+	entry->data = data;
+	entry->length = length;
+	head = bucket(cache, block);
+	entry->next = *head;
+	*head = entry;
+	push_entry(cache, entry);
+	cache->count++;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+ * Removes the block from the cache, if it is cached.
+ */
+void
+blockcache_remove(struct blockcache *cache, uint64_t block)
+{
+	struct entry *entry;
+
+	pthread_mutex_lock(&cache->lock);
+	entry = find_entry(cache, block);
+	if (entry != NULL) {
+		remove_entry(cache, entry);
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
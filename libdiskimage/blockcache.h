@@ -0,0 +1,47 @@
+#ifndef _BLOCKCACHE_H_
+#define _BLOCKCACHE_H_
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "diskimage.h"
+
+/*
+ * A bounded cache of fixed size blocks of a file, indexed by block number.
+ * The least recently used block is evicted when the cache is full. Safe to
+ * use from several threads.
+ */
+struct blockcache;
+
+/*
+ * Creates a cache that holds at most capacity blocks.
+ */
+LDI_ERROR blockcache_create(size_t capacity, struct blockcache **cache);
+
+/*
+ * Frees the cache and all cached blocks and sets the pointer to NULL.
+ */
+void	blockcache_destroy(struct blockcache **cache);
+
+/*
+ * Copies nbytes at offset in the block into the buffer. Returns false,
+ * without copying anything, if the block is not cached or is shorter.
+ */
+bool	blockcache_get(struct blockcache *cache, uint64_t block, void *buf, size_t offset, size_t nbytes);
+
+/*
+ * Adds a block of length bytes to the cache. The cache takes ownership of
+ * the data, which must have been allocated with malloc or posix_memalign.
+ * The data is freed if the block is already cached or if there is no
+ * memory to add it.
+ */
+void	blockcache_put(struct blockcache *cache, uint64_t block, void *data, size_t length);
+
+/*
+ * Removes the block from the cache, so that it has to be read again.
+ * Does nothing if the block is not cached.
+ */
+void	blockcache_remove(struct blockcache *cache, uint64_t block);
+
+#endif					/* _BLOCKCACHE_H_ */
@@ -0,0 +1,115 @@
+
+#include <sys/types.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "bouncepool.h"
+#include "internal.h"
+
+struct bouncepool {
+	/* The size of each buffer. */
+	size_t	size;
+	/* The number of buffers owned by the pool. */
+	int	count;
+	/* The buffers currently available, free[0..available-1]. */
+	char  **free;
+	int	available;
+	/* Protects the free list. */
+	pthread_mutex_t lock;
+	/* Signaled when a buffer is returned to the pool. */
+	pthread_cond_t returned;
+};
+
+/*
+ * Creates a pool with count buffers of the given size.
+ */
+LDI_ERROR
+bouncepool_create(int count, size_t size, size_t alignment, struct bouncepool **pool)
+{
+	void *buffer;
+
+	*pool = malloc(sizeof(struct bouncepool));
+	if (*pool == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	(*pool)->size = size;
+	(*pool)->count = count;
+	(*pool)->available = 0;
+	(*pool)->free = calloc(count, sizeof(char *));
+	if ((*pool)->free == NULL) {
+		free(*pool);
+		*pool = NULL;
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	pthread_mutex_init(&(*pool)->lock, NULL);
+	pthread_cond_init(&(*pool)->returned, NULL);
+
+	/* Allocate all the buffers up front. */
+	while ((*pool)->available < count) {
+		if (posix_memalign(&buffer, alignment, size) != 0) {
+			bouncepool_destroy(pool);
+			return ERROR(LDI_ERR_NOMEM);
+		}
+		(*pool)->free[(*pool)->available++] = buffer;
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Frees the pool and all its buffers and sets the pointer to NULL.
+ */
+void
+bouncepool_destroy(struct bouncepool **pool)
+{
+	int i;
+
+	for (i = 0; i < (*pool)->available; i++) {
+		free((*pool)->free[i]);
+	}
+	free((*pool)->free);
+	pthread_cond_destroy(&(*pool)->returned);
+	pthread_mutex_destroy(&(*pool)->lock);
+	free(*pool);
+	*pool = NULL;
+}
+
+/*
+ * Takes a buffer from the pool.
+ */
+char *
+bouncepool_get(struct bouncepool *pool)
+{
+	char *buffer;
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->available == 0) {
+		pthread_cond_wait(&pool->returned, &pool->lock);
+	}
+	buffer = pool->free[--pool->available];
+	pthread_mutex_unlock(&pool->lock);
+
+	return buffer;
+}
+
+/*
+ * Returns a buffer to the pool.
+ */
+void
+bouncepool_put(struct bouncepool *pool, char *buffer)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->free[pool->available++] = buffer;
+	pthread_cond_signal(&pool->returned);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Returns the size of each buffer in the pool.
+ */
+size_t
+bouncepool_buffersize(struct bouncepool *pool)
+{
+	return pool->size;
+}
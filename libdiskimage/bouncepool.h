@@ -0,0 +1,42 @@
+#ifndef _BOUNCEPOOL_H_
+#define _BOUNCEPOOL_H_
+
+#include <sys/types.h>
+
+#include "diskimage.h"
+
+/*
+ * A fixed set of preallocated, aligned buffers. Used to do direct I/O on
+ * behalf of callers whose buffers, offsets or lengths are not aligned.
+ */
+struct bouncepool;
+
+/*
+ * Creates a pool with count buffers of the given size. The buffers are
+ * aligned to alignment, which must be a power of two.
+ */
+LDI_ERROR bouncepool_create(int count, size_t size, size_t alignment, struct bouncepool **pool);
+
+/*
+ * Frees the pool and all its buffers and sets the pointer to NULL. All
+ * buffers must have been returned to the pool.
+ */
+void	bouncepool_destroy(struct bouncepool **pool);
+
+/*
+ * Takes a buffer from the pool. Waits until a buffer is returned if all
+ * buffers are in use.
+ */
+char   *bouncepool_get(struct bouncepool *pool);
+
+/*
+ * Returns a buffer to the pool.
+ */
+void	bouncepool_put(struct bouncepool *pool, char *buffer);
+
+/*
+ * Returns the size of each buffer in the pool.
+ */
+size_t	bouncepool_buffersize(struct bouncepool *pool);
+
+#endif					/* _BOUNCEPOOL_H_ */
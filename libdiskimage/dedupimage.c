@@ -0,0 +1,670 @@
+
+#include <sys/param.h>
+#include <sys/endian.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "dedupimage.h"
+#include "dedupstore.h"
+#include "diskimage.h"
+#include "fileinterface.h"
+#include "internal.h"
+#include "kernels.h"
+#include "log.h"
+
+/*
+ * Images are made of a header and a map, with an entry for each block of
+ * the disk. The entries hold the number of the block in the store plus
+ * one, or 0 for blocks of zeros. The store is found with a path in the
+ * header, relative to the directory of the image. All numbers are little
+ * endian.
+ */
+#define IMAGE_MAGIC "ldidedup"
+#define IMAGE_MAGIC_SIZE 8
+#define IMAGE_VERSION 1
+#define IMAGE_HEADER_SIZE 4096
+
+/* Defines the offsets used in the header. */
+#define IMAGE_VERSION_OFFSET 8
+#define IMAGE_BLOCK_SIZE_OFFSET 12
+#define IMAGE_DISK_SIZE_OFFSET 16
+#define IMAGE_CHECKSUM_OFFSET 24
+#define IMAGE_STORE_PATH_OFFSET 64
+
+/* The room for the path of the store, including the terminating NUL. */
+#define IMAGE_STORE_PATH_SIZE (IMAGE_HEADER_SIZE - IMAGE_STORE_PATH_OFFSET)
+
+/* The size of each entry in the map, and of the parts of it written. */
+#define MAP_ENTRY_SIZE 8
+#define MAP_PAGE_SIZE 4096
+#define MAP_PAGE_ENTRIES (MAP_PAGE_SIZE / MAP_ENTRY_SIZE)
+
+struct dedupimage {
+	struct file *file;
+	struct dedupstore *store;
+	uint32_t block_size;
+	uint64_t disk_size;
+	uint64_t block_count;
+	/* The entries of the map. */
+	uint64_t *map;
+	/* The pages of the map that have changed since the last flush. */
+	bool   *dirty;
+	/* The blocks of the store the image stopped using since then. */
+	uint64_t *released;
+	size_t	nreleased;
+	size_t	released_capacity;
+	/* Counters reported through dedupimage_stats. */
+	struct diskstats stats;
+	/* Protects the fields above that change. */
+	pthread_mutex_t lock;
+	/*
+	 * Serializes writes, discards and flushes, so that blocks that are
+	 * partly written are read and written whole, and so that flushes
+	 * see no writes in progress.
+	 */
+	pthread_mutex_t write_lock;
+	/* Holds the data of blocks that are partly written. */
+	char   *block;
+	/* Used for logging. */
+	struct logger logger;
+};
+
+/*
+ * Returns true if source starts a deduplicated image.
+ */
+bool
+dedupimage_magic_valid(void *source)
+{
+	return memcmp(source, IMAGE_MAGIC, IMAGE_MAGIC_SIZE) == 0;
+}
+
+/*
+ * Returns the checksum of the header, which is the CRC-32 of all of it
+ * with the checksum itself set to zero.
+ */
+static uint32_t
+header_checksum(uint8_t *bytes)
+{
+	uint8_t zeros[4] = {0, 0, 0, 0};
+	uint32_t crc;
+
+	crc = crc32(crc32(0, NULL, 0), bytes, IMAGE_CHECKSUM_OFFSET);
+	crc = crc32(crc, zeros, sizeof(zeros));
+
+	return crc32(crc, bytes + IMAGE_CHECKSUM_OFFSET + sizeof(zeros),
+	    IMAGE_HEADER_SIZE - IMAGE_CHECKSUM_OFFSET - sizeof(zeros));
+}
+
+/*
+ * Returns the offset of the entry of the block in the file.
+ */
+static off_t
+entry_offset(uint64_t block)
+{
+	return IMAGE_HEADER_SIZE + block * MAP_ENTRY_SIZE;
+}
+
+/*
+ * Creates a new image at path.
+ */
+LDI_ERROR
+dedupimage_create(struct fileinterface *fi, char *path, uint64_t disk_size, struct logger logger)
+{
+	struct dedupstore *store;
+	struct file *file;
+	uint8_t header[IMAGE_HEADER_SIZE];
+	char   *directory, *store_path;
+	uint32_t block_size;
+	LDI_ERROR result;
+
+	result = file_create_new(fi, path, &file);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	directory = file_getdirectory(file);
+	if (directory == NULL) {
+		result = ERROR(LDI_ERR_NOMEM);
+	} else {
+		result = fileinterface_getpath(fi, directory, DEDUPIMAGE_STORE_NAME, &store_path);
+		free(directory);
+	}
+	if (!IS_ERROR(result)) {
+		result = dedupstore_open(store_path, LDI_CACHE_WRITEBACK, true, &store, logger);
+		free(store_path);
+	}
+	if (!IS_ERROR(result)) {
+		block_size = dedupstore_block_size(store);
+		dedupstore_close(&store);
+
+		bzero(header, sizeof(header));
+		memcpy(header, IMAGE_MAGIC, IMAGE_MAGIC_SIZE);
+		le32enc(header + IMAGE_VERSION_OFFSET, IMAGE_VERSION);
+		le32enc(header + IMAGE_BLOCK_SIZE_OFFSET, block_size);
+		le64enc(header + IMAGE_DISK_SIZE_OFFSET, disk_size);
+		strcpy((char *)header + IMAGE_STORE_PATH_OFFSET, DEDUPIMAGE_STORE_NAME);
+		le32enc(header + IMAGE_CHECKSUM_OFFSET, header_checksum(header));
+
+		/* The map is all zeros, so all blocks read as zeros. */
+		result = file_setsize(file, entry_offset(howmany(disk_size, block_size)));
+	}
+	if (!IS_ERROR(result)) {
+		result = file_write(file, header, sizeof(header), 0, logger);
+	}
+	if (!IS_ERROR(result)) {
+		result = file_sync(file);
+	}
+	file_close(&file);
+	if (IS_ERROR(result)) {
+		/* Don't leave a partial image behind. */
+		file_remove(fi, path);
+	}
+
+	return result;
+}
+
+/*
+ * Reads the header, and opens the store it points to.
+ */
+static LDI_ERROR
+read_header(struct dedupimage *image, struct fileinterface *fi, struct diskimage_options options)
+{
+	uint8_t header[IMAGE_HEADER_SIZE];
+	char   *store_path, *directory;
+	char   *path;
+	LDI_ERROR result;
+
+	result = file_read(image->file, header, sizeof(header), 0, image->logger);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+	if (!dedupimage_magic_valid(header) ||
+	    le32dec(header + IMAGE_CHECKSUM_OFFSET) != header_checksum(header) ||
+	    strnlen((char *)header + IMAGE_STORE_PATH_OFFSET, IMAGE_STORE_PATH_SIZE) == IMAGE_STORE_PATH_SIZE) {
+		LOG_ERROR(image->logger, "The header of the deduplicated image is invalid.\n");
+		return ERROR(LDI_ERR_PARSEERROR);
+	}
+	if (le32dec(header + IMAGE_VERSION_OFFSET) != IMAGE_VERSION) {
+		return ERROR(LDI_ERR_FILENOTSUP);
+	}
+	image->block_size = le32dec(header + IMAGE_BLOCK_SIZE_OFFSET);
+	image->disk_size = le64dec(header + IMAGE_DISK_SIZE_OFFSET);
+
+	/* Relative paths are relative to the directory of the image. */
+	path = (char *)header + IMAGE_STORE_PATH_OFFSET;
+	if (path[0] == '/') {
+		store_path = strdup(path);
+		result = store_path == NULL ? ERROR(LDI_ERR_NOMEM) : NO_ERROR;
+	} else {
+		directory = file_getdirectory(image->file);
+		if (directory == NULL) {
+			return ERROR(LDI_ERR_NOMEM);
+		}
+		result = fileinterface_getpath(fi, directory, path, &store_path);
+		free(directory);
+	}
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	LOG_VERBOSE(image->logger, "Opening the store %s\n", store_path);
+	result = dedupstore_open(store_path, options.cache_mode, false, &image->store,
+	    image->logger);
+	free(store_path);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+	if (dedupstore_block_size(image->store) != image->block_size) {
+		LOG_ERROR(image->logger, "The block size of the image is not the one of the store.\n");
+		return ERROR(LDI_ERR_PARSEERROR);
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Reads the map into memory, and checks that all entries are blocks of
+ * the store.
+ */
+static LDI_ERROR
+read_map(struct dedupimage *image)
+{
+	uint64_t block;
+	size_t	size;
+	LDI_ERROR result;
+
+	image->block_count = howmany(image->disk_size, image->block_size);
+	result = file_getsize(image->file, &size);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+	if (size < entry_offset(image->block_count)) {
+		LOG_ERROR(image->logger, "The map of the deduplicated image is truncated.\n");
+		return ERROR(LDI_ERR_PARSEERROR);
+	}
+
+	image->map = malloc(MAX(image->block_count, 1) * sizeof(uint64_t));
+	image->dirty = calloc(howmany(image->block_count, MAP_PAGE_ENTRIES) + 1, sizeof(bool));
+	if (image->map == NULL || image->dirty == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	result = file_read(image->file, image->map, image->block_count * MAP_ENTRY_SIZE,
+	    entry_offset(0), image->logger);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	for (block = 0; block < image->block_count; block++) {
+		image->map[block] = le64dec(&image->map[block]);
+		if (image->map[block] != 0 &&
+		    !dedupstore_has_chunk(image->store, image->map[block] - 1)) {
+			LOG_ERROR(image->logger, "The map entry of block %ju is invalid.\n",
+			    (uintmax_t)block);
+			return ERROR(LDI_ERR_PARSEERROR);
+		}
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Opens the image at path, and its store.
+ */
+LDI_ERROR
+dedupimage_open(struct fileinterface *fi, char *path, struct diskimage_options options, struct dedupimage **image, struct logger logger)
+{
+	LDI_ERROR result;
+
+	*image = calloc(1, sizeof(struct dedupimage));
+	if (*image == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	(*image)->logger = logger;
+	pthread_mutex_init(&(*image)->lock, NULL);
+	pthread_mutex_init(&(*image)->write_lock, NULL);
+
+	result = file_open(fi, path, &(*image)->file);
+	if (!IS_ERROR(result)) {
+		result = read_header(*image, fi, options);
+	}
+	if (!IS_ERROR(result)) {
+		result = read_map(*image);
+	}
+	if (!IS_ERROR(result)) {
+		(*image)->block = malloc((*image)->block_size);
+		if ((*image)->block == NULL) {
+			result = ERROR(LDI_ERR_NOMEM);
+		}
+	}
+	if (IS_ERROR(result)) {
+		dedupimage_destroy(image);
+		return result;
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Flushes the image, closes it and its store and frees it.
+ */
+void
+dedupimage_destroy(struct dedupimage **image)
+{
+	if ((*image)->map != NULL && (*image)->block != NULL) {
+		dedupimage_flush(*image);
+	}
+	if ((*image)->store != NULL) {
+		dedupstore_close(&(*image)->store);
+	}
+	if ((*image)->file != NULL) {
+		file_close(&(*image)->file);
+	}
+	free((*image)->map);
+	free((*image)->dirty);
+	free((*image)->released);
+	free((*image)->block);
+	pthread_mutex_destroy(&(*image)->lock);
+	pthread_mutex_destroy(&(*image)->write_lock);
+	free(*image);
+	*image = NULL;
+}
+
+/*
+ * Returns the number of bytes in the disk.
+ */
+uint64_t
+dedupimage_size(struct dedupimage *image)
+{
+	return image->disk_size;
+}
+
+/*
+ * Reads nbytes at offset on the disk into the buffer.
+ */
+LDI_ERROR
+dedupimage_read(struct dedupimage *image, char *buf, size_t nbytes, off_t offset)
+{
+	uint64_t block, entry;
+	size_t	offset_in_block, length;
+	LDI_ERROR result;
+
+	while (nbytes > 0) {
+		block = offset / image->block_size;
+		offset_in_block = offset % image->block_size;
+		length = MIN(image->block_size - offset_in_block, nbytes);
+
+		pthread_mutex_lock(&image->lock);
+		entry = image->map[block];
+		pthread_mutex_unlock(&image->lock);
+
+		if (entry == 0) {
+			memset(buf, 0, length);
+		} else {
+			result = dedupstore_read(image->store, entry - 1, buf, length, offset_in_block);
+			if (IS_ERROR(result)) {
+				return result;
+			}
+		}
+
+		buf += length;
+		offset += length;
+		nbytes -= length;
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Points the entry of the block at entry, and remembers the block of the
+ * store it pointed at so that it is released at the next flush.
+ */
+static void
+set_entry(struct dedupimage *image, uint64_t block, uint64_t entry)
+{
+	uint64_t old;
+
+	pthread_mutex_lock(&image->lock);
+	old = image->map[block];
+	image->map[block] = entry;
+	image->dirty[block / MAP_PAGE_ENTRIES] = true;
+	if (old != 0) {
+		/* There is room, since set_block made it. */
+		image->released[image->nreleased++] = old - 1;
+	}
+	pthread_mutex_unlock(&image->lock);
+}
+
+/*
+ * Makes room for one more released block.
+ */
+static LDI_ERROR
+reserve_release(struct dedupimage *image)
+{
+	uint64_t *released;
+	size_t	capacity;
+	LDI_ERROR result;
+
+	result = NO_ERROR;
+	pthread_mutex_lock(&image->lock);
+	if (image->nreleased == image->released_capacity) {
+		capacity = MAX(2 * image->released_capacity, MAP_PAGE_ENTRIES);
+		released = realloc(image->released, capacity * sizeof(uint64_t));
+		if (released == NULL) {
+			result = ERROR(LDI_ERR_NOMEM);
+		} else {
+			image->released = released;
+			image->released_capacity = capacity;
+		}
+	}
+	pthread_mutex_unlock(&image->lock);
+
+	return result;
+}
+
+/*
+ * Maps the block to a block of the store with the data, or to zeros.
+ * Must be called with the write lock held.
+ */
+static LDI_ERROR
+set_block(struct dedupimage *image, uint64_t block, char *data)
+{
+	uint64_t chunk;
+	bool	found;
+	LDI_ERROR result;
+
+	result = reserve_release(image);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	if (kernel_iszero(data, image->block_size)) {
+		set_entry(image, block, 0);
+		pthread_mutex_lock(&image->lock);
+		image->stats.zero_bytes_elided += image->block_size;
+		image->stats.zero_blocks_elided++;
+		pthread_mutex_unlock(&image->lock);
+		return NO_ERROR;
+	}
+
+	result = dedupstore_put(image->store, data, &chunk, &found);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+	set_entry(image, block, chunk + 1);
+	if (found) {
+		pthread_mutex_lock(&image->lock);
+		image->stats.deduplicated_blocks++;
+		pthread_mutex_unlock(&image->lock);
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Writes length bytes of data, or zeros if data is NULL, at offset in the
+ * block. Must be called with the write lock held.
+ */
+static LDI_ERROR
+write_block(struct dedupimage *image, uint64_t block, char *data, size_t length, size_t offset)
+{
+	LDI_ERROR result;
+
+	if (length == image->block_size && data != NULL) {
+		return set_block(image, block, data);
+	}
+
+	/* Partly written blocks are read first. The last block may be short. */
+	bzero(image->block, image->block_size);
+	result = dedupimage_read(image, image->block,
+	    MIN(image->block_size, image->disk_size - block * image->block_size),
+	    (off_t)block * image->block_size);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+	if (data != NULL) {
+		memcpy(image->block + offset, data, length);
+	} else {
+		memset(image->block + offset, 0, length);
+	}
+
+	return set_block(image, block, image->block);
+}
+
+/*
+ * Writes nbytes from the buffer at offset on the disk.
+ */
+LDI_ERROR
+dedupimage_write(struct dedupimage *image, char *buf, size_t nbytes, off_t offset)
+{
+	size_t	offset_in_block, length;
+	LDI_ERROR result;
+
+	result = NO_ERROR;
+	pthread_mutex_lock(&image->write_lock);
+	while (nbytes > 0 && !IS_ERROR(result)) {
+		offset_in_block = offset % image->block_size;
+		length = MIN(image->block_size - offset_in_block, nbytes);
+		result = write_block(image, offset / image->block_size, buf, length,
+		    offset_in_block);
+
+		buf += length;
+		offset += length;
+		nbytes -= length;
+	}
+	pthread_mutex_unlock(&image->write_lock);
+
+	return result;
+}
+
+/*
+ * Writes the pages of the map that have changed, and syncs the file.
+ * Must be called with the write lock held.
+ */
+static LDI_ERROR
+write_map(struct dedupimage *image)
+{
+	uint8_t page[MAP_PAGE_SIZE];
+	uint64_t first, count, i;
+	size_t	pages, p;
+	LDI_ERROR result;
+
+	pages = howmany(image->block_count, MAP_PAGE_ENTRIES);
+	for (p = 0; p < pages; p++) {
+		pthread_mutex_lock(&image->lock);
+		if (!image->dirty[p]) {
+			pthread_mutex_unlock(&image->lock);
+			continue;
+		}
+		image->dirty[p] = false;
+		first = p * MAP_PAGE_ENTRIES;
+		count = MIN(MAP_PAGE_ENTRIES, image->block_count - first);
+		for (i = 0; i < count; i++) {
+			le64enc(page + i * MAP_ENTRY_SIZE, image->map[first + i]);
+		}
+		pthread_mutex_unlock(&image->lock);
+
+		result = file_write(image->file, page, count * MAP_ENTRY_SIZE, entry_offset(first),
+		    image->logger);
+		if (IS_ERROR(result)) {
+			/* Write the page again at the next flush. */
+			pthread_mutex_lock(&image->lock);
+			image->dirty[p] = true;
+			pthread_mutex_unlock(&image->lock);
+			return result;
+		}
+	}
+
+	return file_sync(image->file);
+}
+
+/*
+ * Makes all data written so far durable.
+ */
+LDI_ERROR
+dedupimage_flush(struct dedupimage *image)
+{
+	uint64_t *released;
+	size_t	nreleased;
+	LDI_ERROR result;
+
+	pthread_mutex_lock(&image->write_lock);
+
+	/*
+	 * The blocks the map points to must be durable before the map, and
+	 * blocks are only released once the map no longer points to them.
+	 * A crash then never loses data, it only leaves references that
+	 * keep blocks from being reused.
+	 */
+	result = dedupstore_flush(image->store);
+	if (!IS_ERROR(result)) {
+		result = write_map(image);
+	}
+	if (!IS_ERROR(result)) {
+		pthread_mutex_lock(&image->lock);
+		released = image->released;
+		nreleased = image->nreleased;
+		image->nreleased = 0;
+		pthread_mutex_unlock(&image->lock);
+
+		/* Writes are locked out, so nothing is added to the list. */
+		dedupstore_release(image->store, released, nreleased);
+	}
+
+	pthread_mutex_unlock(&image->write_lock);
+
+	return result;
+}
+
+/*
+ * Makes nbytes at offset read as zeros.
+ */
+LDI_ERROR
+dedupimage_discard(struct dedupimage *image, size_t nbytes, off_t offset)
+{
+	size_t	offset_in_block, length;
+	LDI_ERROR result;
+
+	result = NO_ERROR;
+	pthread_mutex_lock(&image->write_lock);
+	while (nbytes > 0 && !IS_ERROR(result)) {
+		offset_in_block = offset % image->block_size;
+		length = MIN(image->block_size - offset_in_block, nbytes);
+		if (length == image->block_size ||
+		    (offset_in_block == 0 && offset + length == image->disk_size)) {
+			/* Whole blocks only need their entries changed. */
+			result = reserve_release(image);
+			if (!IS_ERROR(result)) {
+				set_entry(image, offset / image->block_size, 0);
+			}
+		} else {
+			result = write_block(image, offset / image->block_size, NULL, length,
+			    offset_in_block);
+		}
+
+		offset += length;
+		nbytes -= length;
+	}
+	pthread_mutex_unlock(&image->write_lock);
+
+	return result;
+}
+
+/*
+ * Finds out if the data at offset is stored, and how much of the data
+ * after it is stored alike.
+ */
+LDI_ERROR
+dedupimage_map(struct dedupimage *image, size_t nbytes, off_t offset, bool *allocated, size_t *length)
+{
+	uint64_t block, last;
+
+	block = offset / image->block_size;
+	last = (offset + nbytes - 1) / image->block_size;
+
+	pthread_mutex_lock(&image->lock);
+	*allocated = image->map[block] != 0;
+	while (block < last && (image->map[block + 1] != 0) == *allocated) {
+		block++;
+	}
+	pthread_mutex_unlock(&image->lock);
+
+	*length = MIN((block + 1) * image->block_size - offset, nbytes);
+
+	return NO_ERROR;
+}
+
+/*
+ * Adds the counters of the image to stats.
+ */
+void
+dedupimage_stats(struct dedupimage *image, struct diskstats *stats)
+{
+	pthread_mutex_lock(&image->lock);
+	stats->zero_bytes_elided += image->stats.zero_bytes_elided;
+	stats->zero_blocks_elided += image->stats.zero_blocks_elided;
+	stats->deduplicated_blocks += image->stats.deduplicated_blocks;
+	pthread_mutex_unlock(&image->lock);
+}
@@ -0,0 +1,87 @@
+#ifndef _DEDUPIMAGE_H_
+#define _DEDUPIMAGE_H_
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "diskimage.h"
+#include "fileinterface.h"
+
+/*
+ * A deduplicated image, whose blocks are kept in a store that is shared
+ * with other images. The image itself only maps each block of the disk to
+ * a block of the store. Blocks of zeros are not stored at all. Blocks are
+ * never changed in the store, instead each write finds or adds a block
+ * with the new data and maps the disk block to it.
+ */
+struct dedupimage;
+
+/* The name of the store of new images, in the directory of the image. */
+#define DEDUPIMAGE_STORE_NAME "dedup.store"
+
+/*
+ * Returns true if source, which must hold 8 bytes, starts a deduplicated
+ * image.
+ */
+bool	dedupimage_magic_valid(void *source);
+
+/*
+ * Creates a new image at path with disk_size bytes of zeros. The image
+ * uses the store DEDUPIMAGE_STORE_NAME next to it, which is created if it
+ * doesn't exist. Fails if path already exists.
+ */
+LDI_ERROR dedupimage_create(struct fileinterface *fi, char *path, uint64_t disk_size, struct logger logger);
+
+/*
+ * Opens the image at path, and its store.
+ */
+LDI_ERROR dedupimage_open(struct fileinterface *fi, char *path, struct diskimage_options options, struct dedupimage **image, struct logger logger);
+
+/*
+ * Flushes the image, closes it and its store, frees it and sets the
+ * pointer to NULL.
+ */
+void	dedupimage_destroy(struct dedupimage **image);
+
+/*
+ * Returns the number of bytes in the disk.
+ */
+uint64_t dedupimage_size(struct dedupimage *image);
+
+/*
+ * Reads nbytes at offset on the disk into the buffer.
+ */
+LDI_ERROR dedupimage_read(struct dedupimage *image, char *buf, size_t nbytes, off_t offset);
+
+/*
+ * Writes nbytes from the buffer at offset on the disk. Blocks that are
+ * partly written are read first.
+ */
+LDI_ERROR dedupimage_write(struct dedupimage *image, char *buf, size_t nbytes, off_t offset);
+
+/*
+ * Makes all data written so far durable. The store is flushed before the
+ * map of the image, and the blocks the image no longer uses are released
+ * after it.
+ */
+LDI_ERROR dedupimage_flush(struct dedupimage *image);
+
+/*
+ * Makes nbytes at offset read as zeros, and releases the blocks that are
+ * no longer used by the image.
+ */
+LDI_ERROR dedupimage_discard(struct dedupimage *image, size_t nbytes, off_t offset);
+
+/*
+ * Finds out if the data at offset is stored, and sets length to the
+ * number of bytes, up to nbytes, that are stored alike.
+ */
+LDI_ERROR dedupimage_map(struct dedupimage *image, size_t nbytes, off_t offset, bool *allocated, size_t *length);
+
+/*
+ * Adds the counters of the image to stats.
+ */
+void	dedupimage_stats(struct dedupimage *image, struct diskstats *stats);
+
+#endif					/* _DEDUPIMAGE_H_ */
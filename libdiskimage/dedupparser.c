@@ -0,0 +1,210 @@
+#include <sys/param.h>
+
+#include <stdlib.h>
+#include <strings.h>
+
+#include "dedupimage.h"
+#include "diskimage.h"
+#include "fileinterface.h"
+#include "internal.h"
+#include "log.h"
+#include "parser.h"
+
+/* The number of bytes of the source that are imported at once. */
+#define IMPORT_BATCH_SIZE (4 * 1024 * 1024)
+
+void	dedupparser_destroy(void **parser);
+
+/*
+ * Returns true if head starts a deduplicated image.
+ */
+bool
+dedupparser_probe(void *head, void *tail)
+{
+	return dedupimage_magic_valid(head);
+}
+
+/*
+ * Creates the parser state, which is the image itself.
+ */
+LDI_ERROR
+dedupparser_new(struct fileinterface *fi, char *path, struct diskimage_options options, void **parser, struct logger logger)
+{
+	return dedupimage_open(fi, path, options, (struct dedupimage **)parser, logger);
+}
+
+/*
+ * Deallocates the parser state and sets the pointer to NULL.
+ */
+void
+dedupparser_destroy(void **parser)
+{
+	dedupimage_destroy((struct dedupimage **)parser);
+}
+
+/*
+ * Returns a diskinfo struct with properties for the disk.
+ */
+struct diskinfo
+dedupparser_diskinfo(void *parser)
+{
+	struct diskinfo result;
+
+	result.disksize = dedupimage_size(parser);
+
+	return result;
+}
+
+/*
+ * Reads nbytes at offset into the buffer.
+ */
+LDI_ERROR
+dedupparser_read(void *parser, char *buf, size_t nbytes, off_t offset)
+{
+	return dedupimage_read(parser, buf, nbytes, offset);
+}
+
+/*
+ * Writes nbytes from the buffer into the diskimage at the specified offset.
+ */
+LDI_ERROR
+dedupparser_write(void *parser, char *buf, size_t nbytes, off_t offset)
+{
+	return dedupimage_write(parser, buf, nbytes, offset);
+}
+
+/*
+ * Makes all data written to the diskimage durable.
+ */
+LDI_ERROR
+dedupparser_flush(void *parser)
+{
+	return dedupimage_flush(parser);
+}
+
+/*
+ * Makes nbytes at offset in the diskimage read as zeros.
+ */
+LDI_ERROR
+dedupparser_discard(void *parser, size_t nbytes, off_t offset)
+{
+	return dedupimage_discard(parser, nbytes, offset);
+}
+
+/*
+ * Finds out if nbytes at offset in the diskimage are allocated.
+ */
+LDI_ERROR
+dedupparser_map(void *parser, size_t nbytes, off_t offset, bool *allocated, size_t *length)
+{
+	return dedupimage_map(parser, nbytes, offset, allocated, length);
+}
+
+/*
+ * Adds the counters of the image to stats.
+ */
+void
+dedupparser_stats(void *parser, struct diskstats *stats)
+{
+	dedupimage_stats(parser, stats);
+}
+
+/*
+ * Writes all data of source into the image.
+ */
+static LDI_ERROR
+import(struct dedupimage *image, struct diskimage *source)
+{
+	uint64_t offset, disk_size;
+	size_t	nbytes;
+	char   *buffer;
+	LDI_ERROR result;
+
+	buffer = malloc(IMPORT_BATCH_SIZE);
+	if (buffer == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+
+	result = NO_ERROR;
+	disk_size = dedupimage_size(image);
+	for (offset = 0; offset < disk_size && !IS_ERROR(result); offset += nbytes) {
+		nbytes = MIN(IMPORT_BATCH_SIZE, disk_size - offset);
+		result = parser_read_source(source, buffer, nbytes, offset);
+		if (!IS_ERROR(result)) {
+			result = dedupimage_write(image, buffer, nbytes, offset);
+		}
+	}
+	free(buffer);
+
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	return dedupimage_flush(image);
+}
+
+/*
+ * Creates a deduplicated image at path with the data of source. Blocks
+ * that already are in the store are shared instead of stored again.
+ */
+LDI_ERROR
+dedupparser_convert(struct fileinterface *fi, struct diskimage *source, char *path, struct logger logger)
+{
+	struct diskimage_options options;
+	struct dedupimage *image;
+	struct diskstats stats;
+	uint64_t disk_size;
+	LDI_ERROR result;
+
+	disk_size = diskimage_diskinfo(source).disksize;
+	result = dedupimage_create(fi, path, disk_size, logger);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	bzero(&options, sizeof(options));
+	result = dedupimage_open(fi, path, options, &image, logger);
+	if (IS_ERROR(result)) {
+		file_remove(fi, path);
+		return result;
+	}
+
+	result = import(image, source);
+	if (IS_ERROR(result)) {
+		/* Drop the references to the blocks that were imported. */
+		dedupimage_discard(image, disk_size, 0);
+	} else {
+		bzero(&stats, sizeof(stats));
+		dedupimage_stats(image, &stats);
+		LOG_INFO(logger, "%ju blocks were already in the store.\n",
+		    (uintmax_t)stats.deduplicated_blocks);
+	}
+	dedupimage_destroy(&image);
+	if (IS_ERROR(result)) {
+		file_remove(fi, path);
+	}
+
+	return result;
+}
+
+/*
+ * Define an ldi_parser struct for the dedup parser and define the parser
+ * using the PARSER_DEFINE macro. This will make the parser discoverable
+ * in diskimage.c.
+ */
+static struct ldi_parser dedupparser_format = {
+	.name = "dedup",
+	.probe = dedupparser_probe,
+	.construct = dedupparser_new,
+	.destructor = dedupparser_destroy,
+	.diskinfo = dedupparser_diskinfo,
+	.read = dedupparser_read,
+	.write = dedupparser_write,
+	.flush = dedupparser_flush,
+	.discard = dedupparser_discard,
+	.map = dedupparser_map,
+	.stats = dedupparser_stats,
+	.convert = dedupparser_convert
+};
+
+PARSER_DEFINE(dedupparser_format);
@@ -0,0 +1,720 @@
+
+#include <sys/param.h>
+#include <sys/endian.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "dedupstore.h"
+#include "diskimage.h"
+#include "fileinterface.h"
+#include "internal.h"
+#include "log.h"
+
+/*
+ * Stores start with a header, followed by groups of blocks. Each group
+ * is a table with an entry for each of its blocks, followed by the
+ * blocks. Groups are added whole, and the blocks of a group that are not
+ * used have entries without references. All numbers are little endian.
+ */
+#define STORE_MAGIC "ldistore"
+#define STORE_MAGIC_SIZE 8
+#define STORE_VERSION 1
+#define STORE_HEADER_SIZE 4096
+
+/* Defines the offsets used in the header. */
+#define STORE_VERSION_OFFSET 8
+#define STORE_BLOCK_SIZE_OFFSET 12
+#define STORE_CHECKSUM_OFFSET 16
+
+/* The size of the table of each group, and of the entries in it. */
+#define STORE_TABLE_SIZE 4096
+#define STORE_ENTRY_SIZE 16
+#define STORE_GROUP_CHUNKS (STORE_TABLE_SIZE / STORE_ENTRY_SIZE)
+
+/* Defines the offsets used in each entry. */
+#define STORE_ENTRY_HASH_OFFSET 0
+#define STORE_ENTRY_REFCOUNT_OFFSET 8
+
+/* The smallest and the largest blocks that are allowed. */
+#define STORE_MIN_BLOCK_SIZE 4096
+#define STORE_MAX_BLOCK_SIZE (16 * 1024 * 1024)
+
+/* The primes of xxHash, which the block hash is modelled on. */
+#define HASH_PRIME1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define HASH_PRIME3 0x165667B19E3779F9ULL
+
+struct dedupstore {
+	/* The resolved path of the file, which identifies the store. */
+	char   *path;
+	enum diskimage_cache_mode cache_mode;
+	/* The number of references. Protected by stores_lock. */
+	int	refcount;
+	/* The next open store. Protected by stores_lock. */
+	struct dedupstore *next;
+
+	/* The store has an interface of its own, since it outlives images. */
+	struct fileinterface *fi;
+	struct file *file;
+	uint32_t block_size;
+	/* The number of blocks in all groups, used or not. */
+	uint64_t chunk_count;
+	/* The number of blocks the arrays below have room for. */
+	uint64_t capacity;
+	/* The hash and the reference count of each block. */
+	uint64_t *hashes;
+	uint32_t *refcounts;
+	/* The groups whose tables have changed since the last flush. */
+	bool   *dirty;
+	/*
+	 * The hash index of the blocks in use. Buckets and links hold a
+	 * block number plus one, or 0 at the end of a chain.
+	 */
+	uint64_t *buckets;
+	uint64_t nbuckets;
+	uint64_t *links;
+	/* The blocks that are not in use, the lowest last. */
+	uint64_t *free_chunks;
+	uint64_t nfree;
+	/* Holds the blocks that new data is compared with. */
+	char   *compare;
+	/* Protects the fields above that stores_lock doesn't. */
+	pthread_mutex_t lock;
+	/* Used for logging. */
+	struct logger logger;
+};
+
+/* All open stores. Protected by stores_lock. */
+static struct dedupstore *stores = NULL;
+static pthread_mutex_t stores_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Returns the checksum of the header, which is the CRC-32 of the fields
+ * before it.
+ */
+static uint32_t
+store_checksum(uint8_t *bytes)
+{
+	return crc32(crc32(0, NULL, 0), bytes, STORE_CHECKSUM_OFFSET);
+}
+
+/*
+ * Returns the offset of the table of the group in the file.
+ */
+static off_t
+table_offset(struct dedupstore *store, uint64_t group)
+{
+	return STORE_HEADER_SIZE +
+	    group * (STORE_TABLE_SIZE + (off_t)STORE_GROUP_CHUNKS * store->block_size);
+}
+
+/*
+ * Returns the offset of the block in the file.
+ */
+static off_t
+chunk_offset(struct dedupstore *store, uint64_t chunk)
+{
+	return table_offset(store, chunk / STORE_GROUP_CHUNKS) + STORE_TABLE_SIZE +
+	    (off_t)(chunk % STORE_GROUP_CHUNKS) * store->block_size;
+}
+
+/*
+ * Rotates the word left by bits.
+ */
+static uint64_t
+rotl64(uint64_t word, int bits)
+{
+	return (word << bits) | (word >> (64 - bits));
+}
+
+/*
+ * Returns the hash of a block. The words are mixed in four independent
+ * lanes, so that their multiplications overlap.
+ */
+static uint64_t
+block_hash(char *data, size_t nbytes)
+{
+	uint64_t lanes[4] = {
+		HASH_PRIME1 + HASH_PRIME2, HASH_PRIME2, 0, -HASH_PRIME1
+	};
+	uint64_t hash;
+	size_t	i;
+	int	j;
+
+	for (i = 0; i < nbytes; i += sizeof(lanes)) {
+		for (j = 0; j < 4; j++) {
+			lanes[j] += le64dec(data + i + j * sizeof(uint64_t)) * HASH_PRIME2;
+			lanes[j] = rotl64(lanes[j], 31) * HASH_PRIME1;
+		}
+	}
+
+	hash = rotl64(lanes[0], 1) + rotl64(lanes[1], 7) + rotl64(lanes[2], 12) +
+	    rotl64(lanes[3], 18) + nbytes;
+	hash ^= hash >> 33;
+	hash *= HASH_PRIME2;
+	hash ^= hash >> 29;
+	hash *= HASH_PRIME3;
+	hash ^= hash >> 32;
+
+	return hash;
+}
+
+/*
+ * Returns the bucket of the hash.
+ */
+static uint64_t *
+hash_bucket(struct dedupstore *store, uint64_t hash)
+{
+	/* The number of buckets is a power of two. */
+	return &store->buckets[hash & (store->nbuckets - 1)];
+}
+
+/*
+ * Adds a block that is in use to the hash index.
+ */
+static void
+index_add(struct dedupstore *store, uint64_t chunk)
+{
+	uint64_t *head;
+
+	head = hash_bucket(store, store->hashes[chunk]);
+	store->links[chunk] = *head;
+	*head = chunk + 1;
+}
+
+/*
+ * Removes a block that is no longer used from the hash index.
+ */
+static void
+index_remove(struct dedupstore *store, uint64_t chunk)
+{
+	uint64_t *link;
+
+	for (link = hash_bucket(store, store->hashes[chunk]); *link != chunk + 1;
+	    link = &store->links[*link - 1])
+		;
+	*link = store->links[chunk];
+}
+
+/*
+ * Makes room for capacity blocks in the arrays, and rebuilds the hash
+ * index with about twice as many buckets.
+ */
+static LDI_ERROR
+grow_arrays(struct dedupstore *store, uint64_t capacity)
+{
+	uint64_t *hashes, *links, *free_chunks, *buckets;
+	uint32_t *refcounts;
+	bool   *dirty;
+	uint64_t groups, nbuckets, chunk;
+
+	groups = capacity / STORE_GROUP_CHUNKS;
+	hashes = realloc(store->hashes, capacity * sizeof(uint64_t));
+	if (hashes != NULL)
+		store->hashes = hashes;
+	refcounts = realloc(store->refcounts, capacity * sizeof(uint32_t));
+	if (refcounts != NULL)
+		store->refcounts = refcounts;
+	links = realloc(store->links, capacity * sizeof(uint64_t));
+	if (links != NULL)
+		store->links = links;
+	free_chunks = realloc(store->free_chunks, capacity * sizeof(uint64_t));
+	if (free_chunks != NULL)
+		store->free_chunks = free_chunks;
+	dirty = realloc(store->dirty, groups * sizeof(bool));
+	if (dirty != NULL)
+		store->dirty = dirty;
+	for (nbuckets = 1; nbuckets < 2 * capacity; nbuckets *= 2)
+		;
+	buckets = calloc(nbuckets, sizeof(uint64_t));
+	if (hashes == NULL || refcounts == NULL || links == NULL || free_chunks == NULL ||
+	    dirty == NULL || buckets == NULL) {
+		/* The arrays that did grow are only larger than needed. */
+		free(buckets);
+		return ERROR(LDI_ERR_NOMEM);
+	}
+
+	bzero(store->dirty + store->capacity / STORE_GROUP_CHUNKS,
+	    (groups - store->capacity / STORE_GROUP_CHUNKS) * sizeof(bool));
+	store->capacity = capacity;
+	free(store->buckets);
+	store->buckets = buckets;
+	store->nbuckets = nbuckets;
+	for (chunk = 0; chunk < store->chunk_count; chunk++) {
+		if (store->refcounts[chunk] > 0) {
+			index_add(store, chunk);
+		}
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Adds the entries of a group, read from the table in source, to the
+ * store. Blocks without references are added as free.
+ */
+static void
+add_group(struct dedupstore *store, uint8_t *source)
+{
+	uint64_t chunk, first;
+	int	i;
+
+	first = store->chunk_count;
+	store->chunk_count += STORE_GROUP_CHUNKS;
+	for (i = 0; i < STORE_GROUP_CHUNKS; i++) {
+		chunk = first + i;
+		store->hashes[chunk] = le64dec(source + i * STORE_ENTRY_SIZE + STORE_ENTRY_HASH_OFFSET);
+		store->refcounts[chunk] = le32dec(source + i * STORE_ENTRY_SIZE +
+		    STORE_ENTRY_REFCOUNT_OFFSET);
+		if (store->refcounts[chunk] > 0) {
+			index_add(store, chunk);
+		}
+	}
+
+	/* Push the free blocks so that the lowest is taken first. */
+	for (i = STORE_GROUP_CHUNKS - 1; i >= 0; i--) {
+		if (store->refcounts[first + i] == 0) {
+			store->free_chunks[store->nfree++] = first + i;
+		}
+	}
+}
+
+/*
+ * Reads the header and the tables of all groups.
+ */
+static LDI_ERROR
+read_store(struct dedupstore *store)
+{
+	uint8_t header[STORE_HEADER_SIZE], table[STORE_TABLE_SIZE];
+	uint64_t group, groups;
+	size_t	size;
+	LDI_ERROR result;
+
+	result = file_getsize(store->file, &size);
+	if (!IS_ERROR(result)) {
+		result = size < STORE_HEADER_SIZE ? ERROR(LDI_ERR_PARSEERROR) :
+		    file_read(store->file, header, sizeof(header), 0, store->logger);
+	}
+	if (IS_ERROR(result)) {
+		return result;
+	}
+	if (memcmp(header, STORE_MAGIC, STORE_MAGIC_SIZE) != 0 ||
+	    le32dec(header + STORE_CHECKSUM_OFFSET) != store_checksum(header)) {
+		LOG_ERROR(store->logger, "%s is not a deduplication store.\n", store->path);
+		return ERROR(LDI_ERR_PARSEERROR);
+	}
+	if (le32dec(header + STORE_VERSION_OFFSET) != STORE_VERSION) {
+		return ERROR(LDI_ERR_FILENOTSUP);
+	}
+	store->block_size = le32dec(header + STORE_BLOCK_SIZE_OFFSET);
+	if (store->block_size < STORE_MIN_BLOCK_SIZE || store->block_size > STORE_MAX_BLOCK_SIZE ||
+	    !powerof2(store->block_size)) {
+		LOG_ERROR(store->logger, "The block size of the store is invalid.\n");
+		return ERROR(LDI_ERR_PARSEERROR);
+	}
+
+	/* A group that was being added when the host crashed is ignored. */
+	groups = (size - STORE_HEADER_SIZE) / (table_offset(store, 1) - STORE_HEADER_SIZE);
+	result = grow_arrays(store, MAX(groups, 1) * STORE_GROUP_CHUNKS);
+	for (group = 0; group < groups && !IS_ERROR(result); group++) {
+		result = file_read(store->file, table, sizeof(table), table_offset(store, group),
+		    store->logger);
+		if (!IS_ERROR(result)) {
+			add_group(store, table);
+		}
+	}
+
+	return result;
+}
+
+/*
+ * Creates a new, empty store at path, unless there already is a file
+ * there.
+ */
+static LDI_ERROR
+create_store(char *path, struct logger logger)
+{
+	struct fileinterface *fi;
+	struct file *file;
+	uint8_t header[STORE_HEADER_SIZE];
+	LDI_ERROR result;
+
+	result = fileinterface_create(LDI_CACHE_WRITEBACK, &fi);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+	result = file_create_new(fi, path, &file);
+	if (IS_ERROR(result)) {
+		fileinterface_destroy(&fi);
+		/* Another image may just have created it. */
+		return result.suberror == EEXIST ? NO_ERROR : result;
+	}
+
+	bzero(header, sizeof(header));
+	memcpy(header, STORE_MAGIC, STORE_MAGIC_SIZE);
+	le32enc(header + STORE_VERSION_OFFSET, STORE_VERSION);
+	le32enc(header + STORE_BLOCK_SIZE_OFFSET, DEDUPSTORE_BLOCK_SIZE);
+	le32enc(header + STORE_CHECKSUM_OFFSET, store_checksum(header));
+
+	LOG_VERBOSE(logger, "Creating the store %s\n", path);
+	result = file_setsize(file, sizeof(header));
+	if (!IS_ERROR(result)) {
+		result = file_write(file, header, sizeof(header), 0, logger);
+	}
+	if (!IS_ERROR(result)) {
+		result = file_sync(file);
+	}
+	file_close(&file);
+	if (IS_ERROR(result)) {
+		file_remove(fi, path);
+	}
+	fileinterface_destroy(&fi);
+
+	return result;
+}
+
+/*
+ * Frees the store and everything in it.
+ */
+static void
+destroy_store(struct dedupstore *store)
+{
+	if (store->file != NULL) {
+		file_close(&store->file);
+	}
+	if (store->fi != NULL) {
+		fileinterface_destroy(&store->fi);
+	}
+	free(store->hashes);
+	free(store->refcounts);
+	free(store->dirty);
+	free(store->buckets);
+	free(store->links);
+	free(store->free_chunks);
+	free(store->compare);
+	free(store->path);
+	pthread_mutex_destroy(&store->lock);
+	free(store);
+}
+
+/*
+ * Opens the store at the resolved path.
+ */
+static LDI_ERROR
+open_store(char *path, enum diskimage_cache_mode cache_mode, struct dedupstore **store, struct logger logger)
+{
+	LDI_ERROR result;
+
+	*store = calloc(1, sizeof(struct dedupstore));
+	if (*store == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	pthread_mutex_init(&(*store)->lock, NULL);
+	(*store)->cache_mode = cache_mode;
+	(*store)->refcount = 1;
+	(*store)->logger = logger;
+	(*store)->path = strdup(path);
+	if ((*store)->path == NULL) {
+		result = ERROR(LDI_ERR_NOMEM);
+	} else {
+		result = fileinterface_create(cache_mode, &(*store)->fi);
+	}
+	if (!IS_ERROR(result)) {
+		result = file_open((*store)->fi, path, &(*store)->file);
+	}
+	if (!IS_ERROR(result)) {
+		result = file_lock((*store)->file);
+		if (IS_ERROR(result)) {
+			LOG_ERROR(logger, "The store %s is in use by another process.\n", path);
+		}
+	}
+	if (!IS_ERROR(result)) {
+		result = read_store(*store);
+	}
+	if (!IS_ERROR(result)) {
+		(*store)->compare = malloc((*store)->block_size);
+		if ((*store)->compare == NULL) {
+			result = ERROR(LDI_ERR_NOMEM);
+		}
+	}
+	if (IS_ERROR(result)) {
+		destroy_store(*store);
+		*store = NULL;
+	}
+
+	return result;
+}
+
+/*
+ * Opens the store at path, or returns another reference to it.
+ */
+LDI_ERROR
+dedupstore_open(char *path, enum diskimage_cache_mode cache_mode, bool create, struct dedupstore **store, struct logger logger)
+{
+	char	resolved[PATH_MAX];
+	LDI_ERROR result;
+
+	if (create) {
+		result = create_store(path, logger);
+		if (IS_ERROR(result)) {
+			return result;
+		}
+	}
+	if (realpath(path, resolved) == NULL) {
+		LOG_ERROR(logger, "The store %s was not found.\n", path);
+		return ERROR2(LDI_ERR_FILEERROR, errno);
+	}
+
+	pthread_mutex_lock(&stores_lock);
+	for (*store = stores; *store != NULL; *store = (*store)->next) {
+		if (strcmp((*store)->path, resolved) == 0) {
+			/* There must only be one free list, so the first mode wins. */
+			if ((*store)->cache_mode != cache_mode) {
+				LOG_VERBOSE(logger, "The store %s is already open with another cache mode.\n",
+				    resolved);
+			}
+			(*store)->refcount++;
+			pthread_mutex_unlock(&stores_lock);
+			return NO_ERROR;
+		}
+	}
+
+	result = open_store(resolved, cache_mode, store, logger);
+	if (!IS_ERROR(result)) {
+		(*store)->next = stores;
+		stores = *store;
+	}
+	pthread_mutex_unlock(&stores_lock);
+
+	return result;
+}
+
+/*
+ * Drops a reference to the store and sets the pointer to NULL.
+ */
+void
+dedupstore_close(struct dedupstore **store)
+{
+	struct dedupstore **link;
+	bool	last;
+
+	pthread_mutex_lock(&stores_lock);
+	last = --(*store)->refcount == 0;
+	if (last) {
+		for (link = &stores; *link != *store; link = &(*link)->next)
+			;
+		*link = (*store)->next;
+	}
+	pthread_mutex_unlock(&stores_lock);
+
+	if (last) {
+		/* Write the references that were dropped since the last flush. */
+		dedupstore_flush(*store);
+		destroy_store(*store);
+	}
+	*store = NULL;
+}
+
+/*
+ * Returns the number of bytes in each block of the store.
+ */
+uint32_t
+dedupstore_block_size(struct dedupstore *store)
+{
+	return store->block_size;
+}
+
+/*
+ * Returns true if chunk is a block of the store.
+ */
+bool
+dedupstore_has_chunk(struct dedupstore *store, uint64_t chunk)
+{
+	bool	result;
+
+	pthread_mutex_lock(&store->lock);
+	result = chunk < store->chunk_count;
+	pthread_mutex_unlock(&store->lock);
+
+	return result;
+}
+
+/*
+ * Reads nbytes at offset in the block chunk into the buffer.
+ */
+LDI_ERROR
+dedupstore_read(struct dedupstore *store, uint64_t chunk, char *buf, size_t nbytes, size_t offset)
+{
+	/* Blocks are never moved, so they can be read without the lock. */
+	return file_read(store->file, buf, nbytes, chunk_offset(store, chunk) + offset,
+	    store->logger);
+}
+
+/*
+ * Finds the block in use with the same data as data, and sets link to
+ * its number plus one, or to 0 if there is none. The blocks with the same
+ * hash are compared with the data, so blocks are only shared if their
+ * data is the same. Must be called with the lock held.
+ */
+static LDI_ERROR
+find_chunk(struct dedupstore *store, char *data, uint64_t hash, uint64_t *link)
+{
+	LDI_ERROR result;
+
+	for (*link = *hash_bucket(store, hash); *link != 0; *link = store->links[*link - 1]) {
+		if (store->hashes[*link - 1] != hash) {
+			continue;
+		}
+		result = dedupstore_read(store, *link - 1, store->compare, store->block_size, 0);
+		if (IS_ERROR(result)) {
+			return result;
+		}
+		if (memcmp(store->compare, data, store->block_size) == 0) {
+			break;
+		}
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Adds a group of free blocks at the end of the file. Must be called with
+ * the lock held.
+ */
+static LDI_ERROR
+add_free_group(struct dedupstore *store)
+{
+	uint8_t table[STORE_TABLE_SIZE];
+	LDI_ERROR result;
+
+	if (store->chunk_count == store->capacity) {
+		result = grow_arrays(store, 2 * store->capacity);
+		if (IS_ERROR(result)) {
+			return result;
+		}
+	}
+
+	/* The new table is all zeros, so none of its blocks are used. */
+	result = file_setsize(store->file, table_offset(store, store->chunk_count / STORE_GROUP_CHUNKS + 1));
+	if (IS_ERROR(result)) {
+		return result;
+	}
+	bzero(table, sizeof(table));
+	add_group(store, table);
+
+	/* Overwrite whatever a group that was being added left there. */
+	store->dirty[store->chunk_count / STORE_GROUP_CHUNKS - 1] = true;
+
+	return NO_ERROR;
+}
+
+/*
+ * Finds the block with the same data, or adds a new one, and takes a
+ * reference to it.
+ */
+LDI_ERROR
+dedupstore_put(struct dedupstore *store, char *data, uint64_t *chunk, bool *found)
+{
+	uint64_t hash, link;
+	LDI_ERROR result;
+
+	/* Hash before taking the lock, since it takes as long as a copy. */
+	hash = block_hash(data, store->block_size);
+
+	pthread_mutex_lock(&store->lock);
+	result = find_chunk(store, data, hash, &link);
+	*found = link != 0;
+	if (!IS_ERROR(result) && !*found && store->nfree == 0) {
+		result = add_free_group(store);
+	}
+	if (!IS_ERROR(result) && !*found) {
+		link = store->free_chunks[--store->nfree] + 1;
+		result = file_write(store->file, data, store->block_size,
+		    chunk_offset(store, link - 1), store->logger);
+		if (IS_ERROR(result)) {
+			store->nfree++;
+		} else {
+			store->hashes[link - 1] = hash;
+			index_add(store, link - 1);
+		}
+	}
+	if (!IS_ERROR(result)) {
+		*chunk = link - 1;
+		store->refcounts[*chunk]++;
+		store->dirty[*chunk / STORE_GROUP_CHUNKS] = true;
+	}
+	pthread_mutex_unlock(&store->lock);
+
+	return result;
+}
+
+/*
+ * Drops the references to count blocks. Blocks that are no longer used
+ * are reused for new data.
+ */
+void
+dedupstore_release(struct dedupstore *store, uint64_t *chunks, size_t count)
+{
+	uint64_t chunk;
+	size_t	i;
+
+	pthread_mutex_lock(&store->lock);
+	for (i = 0; i < count; i++) {
+		chunk = chunks[i];
+		store->dirty[chunk / STORE_GROUP_CHUNKS] = true;
+		if (--store->refcounts[chunk] == 0) {
+			index_remove(store, chunk);
+			store->free_chunks[store->nfree++] = chunk;
+		}
+	}
+	pthread_mutex_unlock(&store->lock);
+}
+
+/*
+ * Writes the tables of the groups that have changed, and syncs the file,
+ * which also makes the blocks written since the last flush durable.
+ */
+LDI_ERROR
+dedupstore_flush(struct dedupstore *store)
+{
+	uint8_t table[STORE_TABLE_SIZE];
+	uint64_t group, chunk;
+	int	i;
+	LDI_ERROR result;
+
+	result = NO_ERROR;
+	pthread_mutex_lock(&store->lock);
+	for (group = 0; group < store->chunk_count / STORE_GROUP_CHUNKS; group++) {
+		if (!store->dirty[group]) {
+			continue;
+		}
+		bzero(table, sizeof(table));
+		for (i = 0; i < STORE_GROUP_CHUNKS; i++) {
+			chunk = group * STORE_GROUP_CHUNKS + i;
+			if (store->refcounts[chunk] > 0) {
+				le64enc(table + i * STORE_ENTRY_SIZE + STORE_ENTRY_HASH_OFFSET,
+				    store->hashes[chunk]);
+				le32enc(table + i * STORE_ENTRY_SIZE + STORE_ENTRY_REFCOUNT_OFFSET,
+				    store->refcounts[chunk]);
+			}
+		}
+		result = file_write(store->file, table, sizeof(table), table_offset(store, group),
+		    store->logger);
+		if (IS_ERROR(result)) {
+			break;
+		}
+		store->dirty[group] = false;
+	}
+	pthread_mutex_unlock(&store->lock);
+
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	return file_sync(store->file);
+}
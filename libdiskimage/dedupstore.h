@@ -0,0 +1,75 @@
+#ifndef _DEDUPSTORE_H_
+#define _DEDUPSTORE_H_
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "diskimage.h"
+
+/*
+ * A file of blocks that are shared by deduplicated images, each stored
+ * once however many images use it. The blocks are found by a hash of
+ * their data, and are only shared after the data has been compared.
+ * Each block has a reference count, and blocks that are no longer used
+ * are reused for new data.
+ *
+ * All images in the process that use the same store share it. A store
+ * is locked while it is open, so that only one process uses it at a time.
+ */
+struct dedupstore;
+
+/* The block size of new stores. */
+#define DEDUPSTORE_BLOCK_SIZE (64 * 1024)
+
+/*
+ * Opens the store at path, or returns another reference to it if it is
+ * already open, with the cache mode it was opened with. A new, empty store
+ * is created first if create is true and there is no file at path. Fails
+ * if another process has the store open.
+ */
+LDI_ERROR dedupstore_open(char *path, enum diskimage_cache_mode cache_mode, bool create, struct dedupstore **store, struct logger logger);
+
+/*
+ * Drops a reference to the store and sets the pointer to NULL. The store
+ * is flushed and closed when the last reference is dropped.
+ */
+void	dedupstore_close(struct dedupstore **store);
+
+/*
+ * Returns the number of bytes in each block of the store.
+ */
+uint32_t dedupstore_block_size(struct dedupstore *store);
+
+/*
+ * Returns true if chunk is a block of the store.
+ */
+bool	dedupstore_has_chunk(struct dedupstore *store, uint64_t chunk);
+
+/*
+ * Reads nbytes at offset in the block chunk into the buffer.
+ */
+LDI_ERROR dedupstore_read(struct dedupstore *store, uint64_t chunk, char *buf, size_t nbytes, size_t offset);
+
+/*
+ * Finds the block with the same data as the block in data, or adds the
+ * data as a new block, and takes a reference to it. found is set to
+ * true if the block already was in the store.
+ */
+LDI_ERROR dedupstore_put(struct dedupstore *store, char *data, uint64_t *chunk, bool *found);
+
+/*
+ * Drops the references to count blocks. Must only be called once the
+ * images that no longer use the blocks have been flushed, since the
+ * blocks may be reused for new data right away.
+ */
+void	dedupstore_release(struct dedupstore *store, uint64_t *chunks, size_t count);
+
+/*
+ * Makes the blocks and the references added so far durable. Dropped
+ * references are written lazily, by the next flush after they were
+ * released, so a crash can only leave blocks that are never reused.
+ */
+LDI_ERROR dedupstore_flush(struct dedupstore *store);
+
+#endif					/* _DEDUPSTORE_H_ */
@@ -1,6 +1,9 @@
 
+#include <sys/param.h>
+
 #include <stdlib.h>
 #include <unistd.h>
+#include <string.h>
 #include <strings.h>
 #include <fcntl.h>
 
@@ -19,6 +22,8 @@ struct diskimage {
 	struct ldi_parser *parser;
 	/* The internal state of the parser. */
 	void   *parserstate;
+	/* The options the diskimage was opened with. */
+	struct diskimage_options options;
 	/* Object used for logging. */
 	struct logger logger;
 };
@@ -28,6 +33,82 @@ empty_log_write(int level, void *privarg, char *fmt,...)
 {
 }
 
+/*
+ * Returns the parser for the format name, or NULL if there is none.
+ */
+static struct ldi_parser *
+find_parser(char *format)
+{
+	struct ldi_parser *parser = NULL, **iter;
+
+	/* Go through all formats and find one that matches the format name. */
+	SET_FOREACH(iter, parsers) {
+		if (strcasecmp(format, (*iter)->name) == 0)
+			parser = *iter;
+	}
+
+	return parser;
+}
+
+/*
+ * Finds the parser for the image at path from the first and the last
+ * bytes of the file. Fails if no parser, or more than one, recognizes it.
+ */
+static LDI_ERROR
+probe_parser(struct fileinterface *fi, char *path, struct ldi_parser **parser, struct logger logger)
+{
+	uint8_t head[LDI_PROBE_SIZE], tail[LDI_PROBE_SIZE];
+	struct ldi_parser **iter;
+	struct file *file;
+	size_t	size, length;
+	LDI_ERROR res;
+
+	res = file_open_readonly(fi, path, &file);
+	if (IS_ERROR(res)) {
+		return res;
+	}
+	res = file_getsize(file, &size);
+	if (IS_ERROR(res)) {
+		file_close(&file);
+		return res;
+	}
+
+	/* Short files are read once, and the tail is the same bytes. */
+	bzero(head, sizeof(head));
+	bzero(tail, sizeof(tail));
+	length = MIN(size, LDI_PROBE_SIZE);
+	res = file_read(file, head, length, 0, logger);
+	if (!IS_ERROR(res)) {
+		if (size > LDI_PROBE_SIZE) {
+			res = file_read(file, tail, LDI_PROBE_SIZE, size - LDI_PROBE_SIZE, logger);
+		} else {
+			memcpy(tail + LDI_PROBE_SIZE - length, head, length);
+		}
+	}
+	file_close(&file);
+	if (IS_ERROR(res)) {
+		return res;
+	}
+
+	*parser = NULL;
+	SET_FOREACH(iter, parsers) {
+		if ((*iter)->probe == NULL || !(*iter)->probe(head, tail))
+			continue;
+		if (*parser != NULL) {
+			LOG_ERROR(logger, "%s could be both %s and %s.\n", path,
+			    (*parser)->name, (*iter)->name);
+			return ERROR(LDI_ERR_FORMATUNKNOWN);
+		}
+		*parser = *iter;
+	}
+	if (*parser == NULL) {
+		LOG_ERROR(logger, "The format of %s is unknown.\n", path);
+		return ERROR(LDI_ERR_FORMATUNKNOWN);
+	}
+
+	return NO_ERROR;
+}
+
 /*
  * Opens the disk image at the supplied path with the given format.
  * Allocates the diskimage structure that is passed to all successive calls.
@@ -35,26 +116,47 @@ empty_log_write(int level, void *privarg, char *fmt,...)
  */
 LDI_ERROR
 diskimage_open(char *path, char *format, struct logger logger, struct diskimage **di)
+{
+	struct diskimage_options options;
+
+	/* Use the default value for all options. */
+	bzero(&options, sizeof(options));
+
+	return diskimage_open_options(path, format, options, logger, di);
+}
+
+/*
+ * Like diskimage_open, but with explicit options.
+ */
+LDI_ERROR
+diskimage_open_options(char *path, char *format, struct diskimage_options options, struct logger logger, struct diskimage **di)
 {
 	struct fileinterface *fileinterface;
-	struct ldi_parser *parser = NULL, **iter;
+	struct ldi_parser *parser;
 	LDI_ERROR res;
 
-	/* Go through all formats and find one that matches the format name. */
-	SET_FOREACH(iter, parsers) {
-		if (strcasecmp(format, (*iter)->name) == 0)
-			parser = *iter;
+	if (logger.write == NULL) {
+		logger.write = empty_log_write;
 	}
 
 	/* Check that we actually found a parser matching the name */
-	if (parser == NULL)
+	parser = find_parser(format);
+	if (parser == NULL && strcasecmp(format, LDI_FORMAT_AUTO) != 0)
 		return ERROR(LDI_ERR_FORMATUNKNOWN);
 
-	res = fileinterface_create(&fileinterface);
+	res = fileinterface_create(options.cache_mode, &fileinterface);
 	if (IS_ERROR(res)) {
 		return res;
 	}
 
+	if (parser == NULL) {
+		res = probe_parser(fileinterface, path, &parser, logger);
+		if (IS_ERROR(res)) {
+			fileinterface_destroy(&fileinterface);
+			return res;
+		}
+	}
+
 	/* All state must be saved in the diskimage struct. */
 	*di = malloc(sizeof(struct diskimage));
 	if (!di) {
@@ -64,14 +166,11 @@ diskimage_open(char *path, char *format, struct logger logger, struct diskimage
 
 	(*di)->parser = parser;
 	(*di)->fileinterface = fileinterface;
-
-	if (logger.write == NULL) {
-		logger.write = empty_log_write;
-	}
+	(*di)->options = options;
 	(*di)->logger = logger;
 
 	/* Let the parser create its own format specific parser state. */
-	res = (*di)->parser->construct(fileinterface, path, &(*di)->parserstate, logger);
+	res = (*di)->parser->construct(fileinterface, path, options, &(*di)->parserstate, logger);
 	if (IS_ERROR(res)) {
 		fileinterface_destroy(&fileinterface);
 		free(*di);
@@ -110,6 +209,23 @@ diskimage_diskinfo(struct diskimage *di)
 	return di->parser->diskinfo(di->parserstate);
 }
 
+/*
+ * Returns the counters collected since the diskimage was opened.
+ */
+struct diskstats
+diskimage_stats(struct diskimage *di)
+{
+	struct diskstats stats;
+
+	bzero(&stats, sizeof(stats));
+
+	/* Not all parsers collect statistics. */
+	if (di->parser->stats != NULL)
+		di->parser->stats(di->parserstate, &stats);
+
+	return stats;
+}
+
 /*
  * Reads nbytes of data at offset into the supplied buffer.
  */
@@ -135,6 +251,15 @@ diskimage_read(struct diskimage *di, char *buf, size_t nbytes, off_t offset)
  */
 LDI_ERROR
 diskimage_write(struct diskimage *di, char *buf, size_t nbytes, off_t offset)
+{
+	return diskimage_write_flags(di, buf, nbytes, offset, 0);
+}
+
+/*
+ * Like diskimage_write, but with flags from enum diskimage_write_flags.
+ */
+LDI_ERROR
+diskimage_write_flags(struct diskimage *di, char *buf, size_t nbytes, off_t offset, int flags)
 {
 	LDI_ERROR result;
 
@@ -144,8 +269,183 @@ diskimage_write(struct diskimage *di, char *buf, size_t nbytes, off_t offset)
 
 	LOG_VERBOSE(di->logger, "Writing %d bytes at %d\n", nbytes, offset);
 
+	/* In writethrough mode, all writes behave as FUA writes. */
+	if (di->options.cache_mode == LDI_CACHE_WRITETHROUGH)
+		flags |= LDI_WRITE_FUA;
+
 	/* Hand over to the file format aware parser. */
 	result = di->parser->write(di->parserstate, buf, nbytes, offset);
+	if (!IS_ERROR(result) && (flags & LDI_WRITE_FUA) != 0) {
+		/* The data must reach stable storage before we return. */
+		result = diskimage_flush(di);
+	}
 	LOG_VERBOSE(di->logger, "Result: %d\n", result);
 	return result;
 }
+
+/*
+ * Makes all data written to the diskimage durable.
+ */
+LDI_ERROR
+diskimage_flush(struct diskimage *di)
+{
+	LOG_VERBOSE(di->logger, "Flushing\n");
+
+	/* Hand over to the file format aware parser. */
+	return di->parser->flush(di->parserstate);
+}
+
+/*
+ * Tells the diskimage that nbytes at offset are no longer used.
+ */
+LDI_ERROR
+diskimage_discard(struct diskimage *di, size_t nbytes, off_t offset)
+{
+	/* Check that the whole range is within the range of the disk. */
+	if (offset < 0 || offset + nbytes > di->diskinfo.disksize)
+		return ERROR(LDI_ERR_OUTOFRANGE);
+
+	/* Discarding is only a hint, so formats that can't free space ignore it. */
+	if (di->parser->discard == NULL)
+		return NO_ERROR;
+
+	LOG_VERBOSE(di->logger, "Discarding %d bytes at %d\n", nbytes, offset);
+
+	return di->parser->discard(di->parserstate, nbytes, offset);
+}
+
+/*
+ * Finds out if the data at offset is stored in the image.
+ */
+LDI_ERROR
+diskimage_map(struct diskimage *di, size_t nbytes, off_t offset, bool *allocated, size_t *length)
+{
+	/* Check that the whole range is within the range of the disk. */
+	if (offset < 0 || offset + nbytes > di->diskinfo.disksize)
+		return ERROR(LDI_ERR_OUTOFRANGE);
+
+	if (di->parser->map == NULL) {
+		*allocated = true;
+		*length = nbytes;
+		return NO_ERROR;
+	}
+
+	return di->parser->map(di->parserstate, nbytes, offset, allocated, length);
+}
+
+/*
+ * Reads from the source of a conversion, without reading the data that
+ * is not stored.
+ */
+LDI_ERROR
+parser_read_source(struct diskimage *source, char *buf, size_t nbytes, off_t offset)
+{
+	size_t	length;
+	bool	allocated;
+	LDI_ERROR res;
+
+	while (nbytes > 0) {
+		res = diskimage_map(source, nbytes, offset, &allocated, &length);
+		if (IS_ERROR(res)) {
+			return res;
+		}
+		if (allocated) {
+			res = diskimage_read(source, buf, length, offset);
+			if (IS_ERROR(res)) {
+				return res;
+			}
+		} else {
+			memset(buf, 0, length);
+		}
+
+		buf += length;
+		offset += length;
+		nbytes -= length;
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Writes all data of a differencing disk into its parent.
+ */
+LDI_ERROR
+diskimage_commit(struct diskimage *di, struct diskimage_commit_options options)
+{
+	/* Only parsers for formats with parents can commit. */
+	if (di->parser->commit == NULL)
+		return ERROR(LDI_ERR_FILENOTSUP);
+
+	LOG_VERBOSE(di->logger, "Committing\n");
+
+	return di->parser->commit(di->parserstate, options);
+}
+
+/*
+ * Creates a new, empty image at child_path that reads its data from the
+ * image at parent_path.
+ */
+LDI_ERROR
+diskimage_create_child(char *parent_path, char *child_path, char *format, struct logger logger)
+{
+	struct fileinterface *fileinterface;
+	struct ldi_parser *parser;
+	LDI_ERROR res;
+
+	parser = find_parser(format);
+	if (parser == NULL)
+		return ERROR(LDI_ERR_FORMATUNKNOWN);
+
+	/* Only parsers for formats with parents can create children. */
+	if (parser->create_child == NULL)
+		return ERROR(LDI_ERR_FILENOTSUP);
+
+	res = fileinterface_create(LDI_CACHE_WRITEBACK, &fileinterface);
+	if (IS_ERROR(res)) {
+		return res;
+	}
+
+	if (logger.write == NULL) {
+		logger.write = empty_log_write;
+	}
+
+	LOG_VERBOSE(logger, "Creating %s on top of %s\n", child_path, parent_path);
+	res = parser->create_child(fileinterface, parent_path, child_path, logger);
+
+	fileinterface_destroy(&fileinterface);
+	return res;
+}
+
+/*
+ * Creates a new image at path with the data of the diskimage.
+ */
+LDI_ERROR
+diskimage_convert(struct diskimage *di, char *path, char *format, struct logger logger)
+{
+	struct fileinterface *fileinterface;
+	struct ldi_parser *parser;
+	LDI_ERROR res;
+
+	parser = find_parser(format);
+	if (parser == NULL)
+		return ERROR(LDI_ERR_FORMATUNKNOWN);
+
+	/* Only parsers for formats that can be written whole can convert. */
+	if (parser->convert == NULL)
+		return ERROR(LDI_ERR_FILENOTSUP);
+
+	res = fileinterface_create(LDI_CACHE_WRITEBACK, &fileinterface);
+	if (IS_ERROR(res)) {
+		return res;
+	}
+
+	if (logger.write == NULL) {
+		logger.write = empty_log_write;
+	}
+
+	LOG_VERBOSE(logger, "Converting to %s at %s\n", format, path);
+	res = parser->convert(fileinterface, di, path, logger);
+
+	fileinterface_destroy(&fileinterface);
+	return res;
+}
@@ -2,6 +2,7 @@
 #define DISKIMAGE_H
 
 #include <sys/types.h>
+#include <stdbool.h>
 
 /* Defines all error codes that can be returned by functions in libdiskimage */
 typedef enum {
@@ -24,7 +25,9 @@ typedef enum {
 	/* Error when parsing a file. Possibly corrupt. */
 	LDI_ERR_PARSEERROR,
 	/* Internal programming error */
-	LDI_ERR_INTERNAL
+	LDI_ERR_INTERNAL,
+	/* The parent of a differencing image could not be found */
+	LDI_ERR_PARENTNOTFOUND
 }	LDI_ERROR_CODE;
 
 /* Defines the error struct returned by functions in libdiskimage */
@@ -43,6 +46,12 @@ enum disk_type {
 	DISK_TYPE_DIFFERENCING
 };
 
+/* Flags that can be passed to diskimage_write_flags. */
+enum diskimage_write_flags {
+	/* Force unit access: the data is durable when the write returns. */
+	LDI_WRITE_FUA = 0x1
+};
+
 /*
  * The internal state of the diskimage object. Created using diskimage_open.
  * Needs to be passed to all other diskimage_* functions.
@@ -69,12 +78,104 @@ struct diskinfo {
 };
 
 /*
- * Opens the disk image at the supplied path with the given format.
- * Allocates the diskimage structure that is passed to all successive calls.
- * The diskimage structure must be deallocated using diskimage_destroy.
+ * Controls how the backing files are accessed and when written data is
+ * made durable.
+ */
+enum diskimage_cache_mode {
+	/*
+	 * I/O goes through the page cache and written data is durable
+	 * after diskimage_flush or an LDI_WRITE_FUA write. Metadata changes
+	 * are kept in the library until the next flush. This is the
+	 * default mode.
+	 */
+	LDI_CACHE_WRITEBACK = 0,
+	/*
+	 * The files are opened with O_DIRECT and accessed with pread and
+	 * pwrite, bypassing the page cache. Durability is the same as for
+	 * LDI_CACHE_WRITEBACK, since the device may still cache writes.
+	 */
+	LDI_CACHE_NONE,
+	/*
+	 * I/O goes through the page cache, but every write is flushed,
+	 * including the metadata it changed, before it returns.
+	 */
+	LDI_CACHE_WRITETHROUGH,
+	/*
+	 * I/O goes through the page cache and the files are never synced.
+	 * Flushing only writes the metadata kept in the library. Data may
+	 * be lost or the image corrupted if the host crashes.
+	 */
+	LDI_CACHE_UNSAFE
+};
+
+/* Options that control how a diskimage is opened and accessed. */
+struct diskimage_options {
+	/* How the backing files are cached. */
+	enum diskimage_cache_mode cache_mode;
+	/*
+	 * Scan writes to unallocated blocks and skip the allocation when
+	 * the written data is all zeros.
+	 */
+	bool	zero_elision;
+	/*
+	 * Copy blocks of a differencing disk that are read from its parents
+	 * into the disk, in the background, so that later reads of them are
+	 * served from the disk itself.
+	 */
+	bool	copy_on_read;
+	/*
+	 * The maximum number of bytes per second copied by copy_on_read, or
+	 * 0 for no limit.
+	 */
+	uint64_t copy_on_read_rate;
+};
+
+/* Counters describing the work done by the library for a diskimage. */
+struct diskstats {
+	/* Number of written bytes that did not have to be stored. */
+	uint64_t zero_bytes_elided;
+	/* Number of block allocations avoided by zero elision. */
+	uint64_t zero_blocks_elided;
+	/* Number of bytes copied from parents by copy_on_read. */
+	uint64_t populated_bytes;
+	/* Number of written blocks that were already in the store. */
+	uint64_t deduplicated_blocks;
+};
+
+/* Options for diskimage_commit. */
+struct diskimage_commit_options {
+	/*
+	 * The number of threads copying data in addition to the calling
+	 * thread. With 0, all data is copied by the calling thread.
+	 */
+	int	workers;
+	/*
+	 * The largest number of bytes read from the image at once, or 0
+	 * for the default.
+	 */
+	size_t	batch_size;
+};
+
+/*
+ * The format name that makes diskimage_open find the format of the image
+ * from the magic numbers in it. Raw images have none, and are never found.
+ */
+#define LDI_FORMAT_AUTO "auto"
+
+/*
+ * Opens the disk image at the supplied path with the given format, or
+ * LDI_FORMAT_AUTO. Allocates the diskimage structure that is passed to
+ * all successive calls. The diskimage structure must be deallocated using
+ * diskimage_destroy.
  */
 LDI_ERROR diskimage_open(char *path, char *format, struct logger logger, struct diskimage **di);
 
+/*
+ * Like diskimage_open, but with explicit options. diskimage_open is the
+ * same as calling this function with all options zeroed.
+ */
+LDI_ERROR diskimage_open_options(char *path, char *format, struct diskimage_options options, struct logger logger, struct diskimage **di);
+
 /*
  * Deallocates and sets the diskimage pointer ot zero.
  */
@@ -85,6 +186,11 @@ void	diskimage_destroy(struct diskimage **di);
  */
 struct diskinfo diskimage_diskinfo(struct diskimage *di);
 
+/*
+ * Returns the counters collected since the diskimage was opened.
+ */
+struct diskstats diskimage_stats(struct diskimage *di);
+
 /*
  * Reads nbytes of data at offset into the supplied buffer.
  */
@@ -95,4 +201,64 @@ LDI_ERROR diskimage_read(struct diskimage *di, char *buf, size_t nbytes, off_t o
  */
 LDI_ERROR diskimage_write(struct diskimage *di, char *buf, size_t nbytes, off_t offset);
 
+/*
+ * Like diskimage_write, but with flags from enum diskimage_write_flags.
+ */
+LDI_ERROR diskimage_write_flags(struct diskimage *di, char *buf, size_t nbytes, off_t offset, int flags);
+
+/*
+ * Makes all data written to the diskimage durable. Writes are not
+ * guaranteed to survive a crash until the diskimage has been flushed,
+ * or until the diskimage has been destroyed.
+ */
+LDI_ERROR diskimage_flush(struct diskimage *di);
+
+/*
+ * Tells the diskimage that nbytes at offset are no longer used. Formats
+ * that can free the space do, and the range reads as zeros afterwards.
+ * The data of other formats is left as it is.
+ */
+LDI_ERROR diskimage_discard(struct diskimage *di, size_t nbytes, off_t offset);
+
+/*
+ * Finds out if the data at offset is stored in the image, and sets length
+ * to the number of bytes, up to nbytes, that are stored or not stored
+ * alike. Data that is not stored reads as zeros. Formats that can't tell
+ * report all data as stored.
+ */
+LDI_ERROR diskimage_map(struct diskimage *di, size_t nbytes, off_t offset, bool *allocated, size_t *length);
+
+/*
+ * Writes all data of a differencing disk into its parent, so that the
+ * disk can be discarded. The parent must not be used by other images
+ * while it is changed. The diskimage can be read and written from other
+ * threads during the commit. Data written during the commit is copied
+ * again, until none is left. Progress is saved in a file next to the
+ * image, and an interrupted commit continues from there when it is
+ * started again. Returns LDI_ERR_FILENOTSUP for images that have no
+ * parent.
+ */
+LDI_ERROR diskimage_commit(struct diskimage *di, struct diskimage_commit_options options);
+
+/*
+ * Creates a new, empty image at child_path with the given format, whose
+ * data is read from the image at parent_path until it is overwritten.
+ * VHD children are differencing disks, and VMDK children are
+ * monolithicSparse disks that refer to the parent with parentCID. Only the
+ * metadata of the parent is read, so the time taken does not depend on the
+ * amount of data in the parent. The parent must not be written while it
+ * has children. Fails if child_path already exists.
+ */
+LDI_ERROR diskimage_create_child(char *parent_path, char *child_path, char *format, struct logger logger);
+
+/*
+ * Creates a new image at path with the given format and the data of the
+ * diskimage. Data that is not stored in the diskimage is not read. Only
+ * some formats can be created this way, such as ldz, which is a
+ * compressed format that can only be read, and dedup, whose blocks are
+ * shared with the other dedup images in the same directory. Returns
+ * LDI_ERR_FILENOTSUP for the others. Fails if path already exists.
+ */
+LDI_ERROR diskimage_convert(struct diskimage *di, char *path, char *format, struct logger logger);
+
 #endif					/* DISKIMAGE_H */
@@ -1,10 +1,14 @@
 
 #include <sys/types.h>
+#include <sys/file.h>
 #include <sys/param.h>
 #include <sys/stat.h>
 
 #include <errno.h>
 #include <libgen.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -12,14 +16,43 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "blockcache.h"
+#include "bouncepool.h"
 #include "fileinterface.h"
 #include "filemap.h"
 #include "internal.h"
 
+/*
+ * The alignment of buffers, offsets and lengths used for direct I/O. This
+ * is large enough for devices with 4096 byte sectors.
+ */
+#define DIRECT_ALIGNMENT 4096
+
+/* The number and size of the bounce buffers used for direct I/O. */
+#define BOUNCE_BUFFERS 4
+#define BOUNCE_BUFFER_SIZE (256 * 1024)
+
+/*
+ * The size of the blocks cached for shared files, and the number of blocks
+ * cached for each shared file.
+ */
+#define SHARED_BLOCK_SIZE (64 * 1024)
+#define SHARED_CACHE_BLOCKS 256
+
+/* The size of the buffer used to fill files with zeros. */
+#define ZERO_BUFFER_SIZE (64 * 1024)
+
+/* Source for writes of zeros. Aligned so that it can be used directly. */
+static const char zero_buffer[ZERO_BUFFER_SIZE] __aligned(DIRECT_ALIGNMENT);
+
 /*
  * A struct representing interface that is used to open files.
  */
 struct fileinterface {
+	/* The cache mode for all files opened through the interface. */
+	enum diskimage_cache_mode cache_mode;
+	/* Bounce buffers shared by all files. Only used for direct I/O. */
+	struct bouncepool *bouncepool;
 };
 
 /*
@@ -29,18 +62,65 @@ struct fileinterface {
 struct file {
 	int	fd;
 	char   *path;
+	/* Decides how the file is opened, read, written and synced. */
+	enum diskimage_cache_mode cache_mode;
+	/* The bounce buffers of the file interface that opened the file. */
+	struct bouncepool *bouncepool;
+	/* True if the file was opened with file_open_readonly. */
+	bool	readonly;
+
+	/*
+	 * The remaining fields are only used for files opened with
+	 * file_open_shared. The reference count is 0 for other files.
+	 */
+	int	refcount;
+	/* Identifies the file in the list of shared files. */
+	dev_t	dev;
+	ino_t	ino;
+	/* Caches the data read by all users of the file. */
+	struct blockcache *cache;
+	/* The object attached with file_share_object. */
+	void   *object;
+	void	(*destroy_object)(void *object);
+	/* The next shared file. */
+	struct file *next;
 };
 
+/*
+ * All files opened with file_open_shared in the process. Protected by
+ * shared_lock, which also protects the reference counts and the attached
+ * objects.
+ */
+static struct file *shared_files = NULL;
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /*
  * Creates a new file interface.
  */
 LDI_ERROR
-fileinterface_create(struct fileinterface **fi)
+fileinterface_create(enum diskimage_cache_mode cache_mode, struct fileinterface **fi)
 {
+	LDI_ERROR res;
+
 	*fi = malloc(sizeof(struct fileinterface));
 	if (!*fi) {
 		return ERROR(LDI_ERR_NOMEM);
 	}
+	(*fi)->cache_mode = cache_mode;
+	(*fi)->bouncepool = NULL;
+
+	if (cache_mode == LDI_CACHE_NONE) {
+		/*
+		 * Allocate the bounce buffers now, so that unaligned
+		 * requests don't need any allocations.
+		 */
+		res = bouncepool_create(BOUNCE_BUFFERS, BOUNCE_BUFFER_SIZE,
+		    DIRECT_ALIGNMENT, &(*fi)->bouncepool);
+		if (IS_ERROR(res)) {
+			fileinterface_destroy(fi);
+			return res;
+		}
+	}
 
 	return NO_ERROR;
 }
@@ -51,6 +131,9 @@ fileinterface_create(struct fileinterface **fi)
 void
 fileinterface_destroy(struct fileinterface **fi)
 {
+	if ((*fi)->bouncepool != NULL) {
+		bouncepool_destroy(&(*fi)->bouncepool);
+	}
 	free(*fi);
 	*fi = NULL;
 }
@@ -69,10 +152,66 @@ fileinterface_getpath(struct fileinterface *fi, char *directory, char *filename,
 }
 
 /*
- * Opens a file with the given path.
+ * Returns a new string with the path of path relative to the directory.
+ * Both are resolved first, so the file and the directory must exist.
  */
 LDI_ERROR
-file_open(struct fileinterface *fi, char *path, struct file **file)
+fileinterface_getrelativepath(struct fileinterface *fi, char *directory, char *path, char **result)
+{
+	char from[PATH_MAX], to[PATH_MAX];
+	char *rest, *c;
+	size_t common, length;
+	int ups;
+
+	if (realpath(directory, from) == NULL || realpath(path, to) == NULL) {
+		return ERROR2(LDI_ERR_FILEERROR, errno);
+	}
+
+	/* Find the longest common prefix that ends at a separator. */
+	common = 0;
+	length = strlen(from);
+	while (from[common] != 0 && from[common] == to[common]) {
+		common++;
+	}
+	if (from[common] == 0 && to[common] == '/') {
+		/* The file is below the directory. */
+		common++;
+	} else {
+		while (common > 0 && to[common - 1] != '/') {
+			common--;
+		}
+	}
+	rest = to + common;
+
+	/* Go up once for each directory left in from. */
+	ups = 0;
+	if (common < length) {
+		ups = 1;
+		for (c = from + common; *c != 0; c++) {
+			if (*c == '/')
+				ups++;
+		}
+	}
+
+	*result = malloc(ups * 3 + strlen(rest) + 1);
+	if (*result == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	(*result)[0] = 0;
+	while (ups-- > 0) {
+		strcat(*result, "../");
+	}
+	strcat(*result, rest);
+
+	return NO_ERROR;
+}
+
+/*
+ * Opens a file with the given access mode (O_RDWR or O_RDONLY), and any
+ * extra flags such as O_CREAT.
+ */
+static LDI_ERROR
+open_file(struct fileinterface *fi, char *path, int flags, struct file **file)
 {
 	/* Create the file structure. */
 	*file = malloc(sizeof(struct file));
@@ -80,9 +219,26 @@ file_open(struct fileinterface *fi, char *path, struct file **file)
 		return ERROR(LDI_ERR_NOMEM);
 	}
 	(*file)->path = NULL;
+	(*file)->cache_mode = fi->cache_mode;
+	(*file)->bouncepool = fi->bouncepool;
+	(*file)->readonly = ((flags & O_ACCMODE) == O_RDONLY);
+	(*file)->refcount = 0;
+	(*file)->cache = NULL;
+	(*file)->object = NULL;
+	(*file)->destroy_object = NULL;
+	(*file)->next = NULL;
+
+	/*
+	 * Writes are never synchronous, data is made durable with file_sync
+	 * when the user flushes the diskimage. Only bypass the page cache
+	 * if the user asked for it.
+	 */
+	if (fi->cache_mode == LDI_CACHE_NONE) {
+		flags |= O_DIRECT;
+	}
 
 	/* Try to open the file. */
-	(*file)->fd = open(path, O_RDWR | O_DIRECT | O_FSYNC);
+	(*file)->fd = open(path, flags, 0644);
 	if ((*file)->fd == -1) {
 		file_close(file);
 		return ERROR2(LDI_ERR_FILEERROR, errno);
@@ -99,11 +255,247 @@ file_open(struct fileinterface *fi, char *path, struct file **file)
 }
 
 /*
- * Closes the given file and sets the pointer to zero.
+ * Opens a file with the given path.
+ */
+LDI_ERROR
+file_open(struct fileinterface *fi, char *path, struct file **file)
+{
+	return open_file(fi, path, O_RDWR, file);
+}
+
+/*
+ * Creates a new, empty file with the given path and opens it. An existing
+ * file is truncated.
+ */
+LDI_ERROR
+file_create(struct fileinterface *fi, char *path, struct file **file)
+{
+	return open_file(fi, path, O_RDWR | O_CREAT | O_TRUNC, file);
+}
+
+/*
+ * Creates a new, empty file with the given path and opens it. Fails if
+ * the file already exists.
+ */
+LDI_ERROR
+file_create_new(struct fileinterface *fi, char *path, struct file **file)
+{
+	return open_file(fi, path, O_RDWR | O_CREAT | O_EXCL, file);
+}
+
+/*
+ * Removes the file with the given path. It is not an error if there is no
+ * such file.
+ */
+LDI_ERROR
+file_remove(struct fileinterface *fi, char *path)
+{
+	if (unlink(path) == -1 && errno != ENOENT) {
+		return ERROR2(LDI_ERR_FILEERROR, errno);
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Opens a file with the given path for reading only.
+ */
+LDI_ERROR
+file_open_readonly(struct fileinterface *fi, char *path, struct file **file)
+{
+	return open_file(fi, path, O_RDONLY, file);
+}
+
+/*
+ * Returns the shared file with the given identity, or NULL. Must be called
+ * with shared_lock held.
+ */
+static struct file *
+find_shared(dev_t dev, ino_t ino, enum diskimage_cache_mode cache_mode)
+{
+	struct file *f;
+
+	for (f = shared_files; f != NULL; f = f->next) {
+		if (f->dev == dev && f->ino == ino && f->cache_mode == cache_mode) {
+			return f;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Opens a file for reading only, shared by everyone in the process that
+ * opens the same file with the same cache mode.
+ */
+LDI_ERROR
+file_open_shared(struct fileinterface *fi, char *path, struct file **file)
+{
+	struct file *shared;
+	struct stat sb;
+	LDI_ERROR res;
+
+	/* Hold the lock, so that a file is never added to the list twice. */
+	pthread_mutex_lock(&shared_lock);
+
+	res = open_file(fi, path, O_RDONLY, file);
+	if (IS_ERROR(res)) {
+		pthread_mutex_unlock(&shared_lock);
+		return res;
+	}
+	if (fstat((*file)->fd, &sb) == -1) {
+		res = ERROR2(LDI_ERR_FILEERROR, errno);
+		file_close(file);
+		pthread_mutex_unlock(&shared_lock);
+		return res;
+	}
+
+	shared = find_shared(sb.st_dev, sb.st_ino, fi->cache_mode);
+	if (shared != NULL) {
+		/* Already open, use that instead. */
+		file_close(file);
+		shared->refcount++;
+		*file = shared;
+		pthread_mutex_unlock(&shared_lock);
+		return NO_ERROR;
+	}
+
+	res = blockcache_create(SHARED_CACHE_BLOCKS, &(*file)->cache);
+	if (IS_ERROR(res)) {
+		file_close(file);
+		pthread_mutex_unlock(&shared_lock);
+		return res;
+	}
+	/*
+	 * The file may outlive the file interface, so don't use its bounce
+	 * buffers. Reads of shared files don't need them.
+	 */
+	(*file)->bouncepool = NULL;
+	(*file)->dev = sb.st_dev;
+	(*file)->ino = sb.st_ino;
+	(*file)->refcount = 1;
+	(*file)->next = shared_files;
+	shared_files = *file;
+
+	pthread_mutex_unlock(&shared_lock);
+
+	return NO_ERROR;
+}
+
+/*
+ * Returns the object attached to a shared file, or NULL.
+ */
+void   *
+file_shared_object(struct file *f)
+{
+	void *object;
+
+	pthread_mutex_lock(&shared_lock);
+	object = f->object;
+	pthread_mutex_unlock(&shared_lock);
+
+	return object;
+}
+
+/*
+ * Attaches the object to a shared file, unless one already is attached.
+ * Returns the object that is attached.
+ */
+void   *
+file_share_object(struct file *f, void *object, void (*destroy)(void *object))
+{
+	pthread_mutex_lock(&shared_lock);
+	if (f->object == NULL) {
+		f->object = object;
+		f->destroy_object = destroy;
+	}
+	object = f->object;
+	pthread_mutex_unlock(&shared_lock);
+
+	return object;
+}
+
+/*
+ * Removes the file from the list of shared files, if it still is in the
+ * list. Must be called with shared_lock held.
+ */
+static void
+unlink_shared(struct file *f)
+{
+	struct file **link;
+
+	for (link = &shared_files; *link != NULL; link = &(*link)->next) {
+		if (*link == f) {
+			*link = f->next;
+			break;
+		}
+	}
+}
+
+/*
+ * Stops sharing the file with later callers of file_open_shared.
+ */
+LDI_ERROR
+file_unshare(struct file *f)
+{
+	struct file *shared;
+	int	users;
+
+	pthread_mutex_lock(&shared_lock);
+	/* Count the references with other cache modes too. */
+	users = f->refcount;
+	for (shared = shared_files; shared != NULL; shared = shared->next) {
+		if (shared != f && shared->dev == f->dev && shared->ino == f->ino) {
+			users += shared->refcount;
+		}
+	}
+	if (users > 1) {
+		pthread_mutex_unlock(&shared_lock);
+		return ERROR2(LDI_ERR_FILEERROR, EBUSY);
+	}
+	unlink_shared(f);
+	pthread_mutex_unlock(&shared_lock);
+
+	return NO_ERROR;
+}
+
+/*
+ * Drops a reference to a shared file. Returns true if it was the last one,
+ * in which case the file has been removed from the list of shared files
+ * and the attached object has been destroyed.
+ */
+static bool
+release_shared(struct file *f)
+{
+	pthread_mutex_lock(&shared_lock);
+	if (--f->refcount > 0) {
+		pthread_mutex_unlock(&shared_lock);
+		return false;
+	}
+	unlink_shared(f);
+	pthread_mutex_unlock(&shared_lock);
+
+	/* The object may close other shared files. */
+	if (f->object != NULL) {
+		f->destroy_object(f->object);
+	}
+	blockcache_destroy(&f->cache);
+
+	return true;
+}
+
+/*
+ * Closes the given file and sets the pointer to zero. Shared files are
+ * closed when the last reference is closed.
  */
 void
 file_close(struct file **f)
 {
+	if ((*f)->refcount > 0 && !release_shared(*f)) {
+		*f = NULL;
+		return;
+	}
+
 	if ((*f)->fd >= 0) {
 		close((*f)->fd);
 	}
@@ -134,37 +526,237 @@ file_getsize(struct file *f, size_t *size)
 }
 
 /*
- * Writes zeros to the fd at the specified position.
+ * Returns true if the value is aligned for direct I/O.
  */
-LDI_ERROR
-write_zeros(int fd, off_t pos, size_t nbytes)
+static bool
+is_aligned(uintptr_t value)
 {
-	char *buffer;
-	int bytes_written;
+	return value % DIRECT_ALIGNMENT == 0;
+}
 
-	buffer = malloc(512);
-	if (!buffer) {
-		/* Failed to allocate buffer. */
-		return ERROR(LDI_ERR_NOMEM);
+/*
+ * Reads up to nbytes with pread, retrying until all bytes have been read
+ * or the end of the file is reached. The number of bytes actually read is
+ * stored in bytes_read.
+ */
+static LDI_ERROR
+full_pread(int fd, char *buf, size_t nbytes, off_t offset, size_t *bytes_read)
+{
+	ssize_t res;
+
+	*bytes_read = 0;
+	while (*bytes_read < nbytes) {
+		res = pread(fd, buf + *bytes_read, nbytes - *bytes_read, offset + *bytes_read);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			return ERROR2(LDI_ERR_IO, errno);
+		}
+		if (res == 0) {
+			/* End of file. */
+			break;
+		}
+		*bytes_read += res;
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Writes all nbytes with pwrite.
+ */
+static LDI_ERROR
+full_pwrite(int fd, const char *buf, size_t nbytes, off_t offset)
+{
+	ssize_t res;
+
+	while (nbytes > 0) {
+		res = pwrite(fd, buf, nbytes, offset);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			return ERROR2(LDI_ERR_IO, errno);
+		}
+		buf += res;
+		nbytes -= res;
+		offset += res;
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Reads from a file opened for direct I/O. Aligned requests are passed
+ * straight to pread. The unaligned parts of other requests are read into
+ * a bounce buffer, rounded out to whole aligned sectors, and copied to
+ * the caller's buffer.
+ */
+static LDI_ERROR
+direct_read(struct file *f, char *buf, size_t nbytes, off_t offset)
+{
+	char *bounce = NULL;
+	off_t start;
+	size_t skip, length, bytes_read;
+	LDI_ERROR res = NO_ERROR;
+
+	while (nbytes > 0) {
+		if (is_aligned(offset) && is_aligned((uintptr_t)buf) &&
+		    nbytes >= DIRECT_ALIGNMENT) {
+			/* Read as much as possible directly. */
+			length = nbytes - nbytes % DIRECT_ALIGNMENT;
+			res = full_pread(f->fd, buf, length, offset, &bytes_read);
+			if (IS_ERROR(res))
+				break;
+		} else {
+			if (bounce == NULL)
+				bounce = bouncepool_get(f->bouncepool);
+
+			/* Read the aligned range around the data. */
+			start = offset - offset % DIRECT_ALIGNMENT;
+			skip = offset - start;
+			length = MIN(nbytes, bouncepool_buffersize(f->bouncepool) - skip);
+			res = full_pread(f->fd, bounce,
+			    roundup2(skip + length, DIRECT_ALIGNMENT), start, &bytes_read);
+			if (IS_ERROR(res))
+				break;
+			bytes_read = bytes_read > skip ? MIN(bytes_read - skip, length) : 0;
+			memcpy(buf, bounce + skip, bytes_read);
+		}
+
+		if (bytes_read < length) {
+			/* The file ended before the request. */
+			res = ERROR(LDI_ERR_IO);
+			break;
+		}
+		buf += length;
+		nbytes -= length;
+		offset += length;
+	}
+
+	if (bounce != NULL)
+		bouncepool_put(f->bouncepool, bounce);
+
+	return res;
+}
+
+/*
+ * Writes the partial sector at offset using read-modify-write of the
+ * aligned sector in the bounce buffer. At most the rest of the sector is
+ * written and the number of bytes written is stored in written.
+ */
+static LDI_ERROR
+direct_write_partial(struct file *f, char *bounce, const char *buf, size_t nbytes, off_t offset, size_t *written)
+{
+	off_t start;
+	size_t skip, bytes_read;
+	LDI_ERROR res;
+
+	start = offset - offset % DIRECT_ALIGNMENT;
+	skip = offset - start;
+	*written = MIN(nbytes, DIRECT_ALIGNMENT - skip);
+
+	res = full_pread(f->fd, bounce, DIRECT_ALIGNMENT, start, &bytes_read);
+	if (IS_ERROR(res)) {
+		return res;
+	}
+	/* Anything beyond the end of the file reads as zeros. */
+	bzero(bounce + bytes_read, DIRECT_ALIGNMENT - bytes_read);
+	memcpy(bounce + skip, buf, *written);
+
+	res = full_pwrite(f->fd, bounce, DIRECT_ALIGNMENT, start);
+	if (IS_ERROR(res)) {
+		return res;
+	}
+
+	if (bytes_read < DIRECT_ALIGNMENT && bytes_read < skip + *written) {
+		/*
+		 * The sector extended the file past the written data. Cut
+		 * it back to the size it would have with a regular write.
+		 */
+		if (ftruncate(f->fd, offset + *written) == -1) {
+			return ERROR2(LDI_ERR_IO, errno);
+		}
+	} else if (bytes_read < DIRECT_ALIGNMENT) {
+		/* Restore the original size of the file. */
+		if (ftruncate(f->fd, start + bytes_read) == -1) {
+			return ERROR2(LDI_ERR_IO, errno);
+		}
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Writes to a file opened for direct I/O. Aligned requests are passed
+ * straight to pwrite. Whole sectors from unaligned buffers are copied to
+ * a bounce buffer, and only partial sectors at the head and the tail of
+ * the request are read, modified and written back.
+ */
+static LDI_ERROR
+direct_write(struct file *f, const char *buf, size_t nbytes, off_t offset)
+{
+	char *bounce = NULL;
+	size_t length;
+	LDI_ERROR res = NO_ERROR;
+
+	while (nbytes > 0) {
+		if (is_aligned(offset) && nbytes >= DIRECT_ALIGNMENT) {
+			length = nbytes - nbytes % DIRECT_ALIGNMENT;
+			if (is_aligned((uintptr_t)buf)) {
+				/* Write as much as possible directly. */
+				res = full_pwrite(f->fd, buf, length, offset);
+			} else {
+				/* Whole sectors, no need to read. */
+				if (bounce == NULL)
+					bounce = bouncepool_get(f->bouncepool);
+				length = MIN(length, bouncepool_buffersize(f->bouncepool));
+				memcpy(bounce, buf, length);
+				res = full_pwrite(f->fd, bounce, length, offset);
+			}
+		} else {
+			if (bounce == NULL)
+				bounce = bouncepool_get(f->bouncepool);
+			res = direct_write_partial(f, bounce, buf, nbytes, offset, &length);
+		}
+		if (IS_ERROR(res))
+			break;
+
+		buf += length;
+		nbytes -= length;
+		offset += length;
 	}
 
-	/* Zero out the buffer. */
-	bzero(buffer, 512);
+	if (bounce != NULL)
+		bouncepool_put(f->bouncepool, bounce);
+
+	return res;
+}
+
+/*
+ * Writes zeros to the file at the specified position.
+ */
+static LDI_ERROR
+write_zeros(struct file *f, off_t pos, size_t nbytes)
+{
+	size_t length;
+	LDI_ERROR res;
 
 	while (nbytes > 0) {
-		bytes_written = pwrite(fd, buffer, MIN(512, nbytes), pos);
+		length = MIN(ZERO_BUFFER_SIZE, nbytes);
 
-		if (bytes_written < 0) {
-			free(buffer);
-			/* Something went wrong. */
-			return ERROR(LDI_ERR_IO);
+		if (f->cache_mode == LDI_CACHE_NONE) {
+			res = direct_write(f, zero_buffer, length, pos);
+		} else {
+			res = full_pwrite(f->fd, zero_buffer, length, pos);
+		}
+		if (IS_ERROR(res)) {
+			return res;
 		}
 		/* Update pos, nbytes */
-		pos += bytes_written;
-		nbytes -= bytes_written;
+		pos += length;
+		nbytes -= length;
 	}
 
-	free(buffer);
 	return NO_ERROR;
 }
 
@@ -184,7 +776,7 @@ file_setsize(struct file *f, size_t newsize)
 
 	if (newsize > oldsize) {
 		/* Fill the new space with zeros. */
-		res = write_zeros(f->fd, oldsize, newsize - oldsize);
+		res = write_zeros(f, oldsize, newsize - oldsize);
 		if (IS_ERROR(res)) {
 			return res;
 		}
@@ -197,21 +789,257 @@ file_setsize(struct file *f, size_t newsize)
 	return NO_ERROR;
 }
 
+/*
+ * Finds out if offset in the file is in data or in a hole, and where the
+ * data or the hole ends.
+ */
+LDI_ERROR
+file_getextent(struct file *f, off_t offset, bool *data, off_t *end)
+{
+	size_t size;
+	off_t next;
+	LDI_ERROR res;
+
+	/* The offset of the file is never used, since all I/O is positional. */
+	next = lseek(f->fd, offset, SEEK_DATA);
+	if (next == -1 && errno == ENXIO) {
+		/* There is no data after offset. */
+		res = file_getsize(f, &size);
+		if (IS_ERROR(res)) {
+			return res;
+		}
+		*data = false;
+		*end = MAX((off_t)size, offset);
+		return NO_ERROR;
+	}
+	if (next > offset) {
+		*data = false;
+		*end = next;
+		return NO_ERROR;
+	}
+
+	/* Offset is in data, or the file system doesn't report holes. */
+	*data = true;
+	*end = lseek(f->fd, offset, SEEK_HOLE);
+	if (*end == -1) {
+		res = file_getsize(f, &size);
+		if (IS_ERROR(res)) {
+			return res;
+		}
+		*end = MAX((off_t)size, offset);
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Frees the storage of nbytes at offset in the file.
+ */
+LDI_ERROR
+file_deallocate(struct file *f, off_t offset, size_t nbytes)
+{
+#ifdef SPACECTL_DEALLOC
+	struct spacectl_range range;
+
+	range.r_offset = offset;
+	range.r_len = nbytes;
+	/* The call may stop early, and tells where it stopped. */
+	while (range.r_len > 0) {
+		if (fspacectl(f->fd, SPACECTL_DEALLOC, &range, 0, &range) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno != EOPNOTSUPP) {
+				return ERROR2(LDI_ERR_IO, errno);
+			}
+			return write_zeros(f, range.r_offset, range.r_len);
+		}
+	}
+
+	return NO_ERROR;
+#else
+	return write_zeros(f, offset, nbytes);
+#endif
+}
+
+/*
+ * Reads from a shared file through its block cache. Blocks that are not
+ * cached are read whole, with buffers and offsets that are aligned for
+ * direct I/O.
+ */
+static LDI_ERROR
+shared_read(struct file *f, char *buf, size_t nbytes, off_t offset)
+{
+	uint64_t block;
+	size_t offset_in_block, length, bytes_read;
+	void *data;
+	LDI_ERROR res;
+
+	while (nbytes > 0) {
+		block = offset / SHARED_BLOCK_SIZE;
+		offset_in_block = offset % SHARED_BLOCK_SIZE;
+		length = MIN(SHARED_BLOCK_SIZE - offset_in_block, nbytes);
+
+		if (!blockcache_get(f->cache, block, buf, offset_in_block, length)) {
+			if (posix_memalign(&data, DIRECT_ALIGNMENT, SHARED_BLOCK_SIZE) != 0) {
+				return ERROR(LDI_ERR_NOMEM);
+			}
+			res = full_pread(f->fd, data, SHARED_BLOCK_SIZE,
+			    block * SHARED_BLOCK_SIZE, &bytes_read);
+			if (!IS_ERROR(res) && bytes_read < offset_in_block + length) {
+				/* The file ended before the request. */
+				res = ERROR(LDI_ERR_IO);
+			}
+			if (IS_ERROR(res)) {
+				free(data);
+				return res;
+			}
+			memcpy(buf, (char *)data + offset_in_block, length);
+			blockcache_put(f->cache, block, data, bytes_read);
+		}
+
+		buf += length;
+		nbytes -= length;
+		offset += length;
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Reads nbytes at offset in the file into the buffer. Shared files are
+ * read through their block cache. Files opened with LDI_CACHE_NONE and
+ * read-only files are read with pread, all other files are memory mapped.
+ */
+LDI_ERROR
+file_read(struct file *f, void *buf, size_t nbytes, off_t offset, struct logger logger)
+{
+	struct filemap *map;
+	size_t bytes_read;
+	LDI_ERROR res;
+
+	if (f->cache != NULL) {
+		return shared_read(f, buf, nbytes, offset);
+	}
+
+	if (f->cache_mode == LDI_CACHE_NONE) {
+		return direct_read(f, buf, nbytes, offset);
+	}
+
+	if (f->readonly) {
+		/* Read-only files can't be mapped for writing. */
+		res = full_pread(f->fd, buf, nbytes, offset, &bytes_read);
+		if (!IS_ERROR(res) && bytes_read < nbytes) {
+			res = ERROR(LDI_ERR_IO);
+		}
+		return res;
+	}
+
+	/* Copy the data from the page cache. */
+	res = filemap_create(f->fd, offset, nbytes, &map, logger);
+	if (IS_ERROR(res)) {
+		return res;
+	}
+	memcpy(buf, map->pointer, nbytes);
+	filemap_destroy(&map);
+
+	return NO_ERROR;
+}
+
+/*
+ * Writes nbytes from the buffer at offset in the file. Files opened with
+ * LDI_CACHE_NONE are written with pwrite, all other files are memory
+ * mapped.
+ */
+LDI_ERROR
+file_write(struct file *f, void *buf, size_t nbytes, off_t offset, struct logger logger)
+{
+	struct filemap *map;
+	LDI_ERROR res;
+
+	if (f->cache_mode == LDI_CACHE_NONE) {
+		return direct_write(f, buf, nbytes, offset);
+	}
+
+	/* Copy the data to the page cache. */
+	res = filemap_create(f->fd, offset, nbytes, &map, logger);
+	if (IS_ERROR(res)) {
+		return res;
+	}
+	memcpy(map->pointer, buf, nbytes);
+	filemap_destroy(&map);
+
+	return NO_ERROR;
+}
+
+/*
+ * Writes all modified data of the file to stable storage. This includes
+ * data written through filemaps that have since been destroyed, since the
+ * pages of a shared mapping belong to the file.
+ */
+LDI_ERROR
+file_sync(struct file *f)
+{
+	if (f->cache_mode == LDI_CACHE_UNSAFE) {
+		/* The user does not care about durability. */
+		return NO_ERROR;
+	}
+
+	if (fdatasync(f->fd) == -1) {
+		return ERROR2(LDI_ERR_IO, errno);
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Takes an exclusive lock on the file, which is released when it is
+ * closed. Fails if another open file holds the lock.
+ */
+LDI_ERROR
+file_lock(struct file *f)
+{
+	if (flock(f->fd, LOCK_EX | LOCK_NB) == -1) {
+		return ERROR2(LDI_ERR_FILEERROR, errno);
+	}
+
+	return NO_ERROR;
+}
+
 /*
  * Returns a filemap struct with a chunk of the file mapped to memory.
  */
 LDI_ERROR
 file_getmap(struct file *f, size_t offset, size_t length, struct filemap **map, struct logger logger)
 {
+	if (f->readonly) {
+		return filemap_create_readonly(f->fd, offset, length, map, logger);
+	}
+
 	return filemap_create(f->fd, offset, length, map, logger);
 }
 
+/*
+ * Returns the path the file was opened with.
+ */
+char   *
+file_getpath(struct file *f)
+{
+	return f->path;
+}
+
 char   *
 file_getdirectory(struct file *f)
 {
-	char *res;
+	char *path, *res;
+
+	/* dirname may modify its argument, so work on a copy. */
+	path = strdup(f->path);
+	if (path == NULL) {
+		return NULL;
+	}
+	res = strdup(dirname(path));
+	free(path);
 
-	/* THREAD SAFETY */
-	res = dirname(f->path);
-	return strdup(res);
+	return res;
 }
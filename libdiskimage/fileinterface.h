@@ -19,7 +19,7 @@ struct file;
 /*
  * Creates a new file interface.
  */
-LDI_ERROR	fileinterface_create(struct fileinterface **fi);
+LDI_ERROR	fileinterface_create(enum diskimage_cache_mode cache_mode, struct fileinterface **fi);
 
 /*
  * Frees the file interface and zeros the pointer.
@@ -31,13 +31,73 @@ void	fileinterface_destroy(struct fileinterface **fi);
  */
 LDI_ERROR	fileinterface_getpath(struct fileinterface *fi, char *directory, char *filename, char **result);
 
+/*
+ * Returns the path of a file relative to the directory, such as
+ * "../images/parent.vhd". Both must exist.
+ */
+LDI_ERROR	fileinterface_getrelativepath(struct fileinterface *fi, char *directory, char *path, char **result);
+
 /*
  * Opens a file with the given path.
  */
 LDI_ERROR	file_open(struct fileinterface *fi, char *path, struct file **file);
 
 /*
- * Closes the given file and sets the pointer to zero.
+ * Creates a new, empty file with the given path and opens it. An existing
+ * file is truncated.
+ */
+LDI_ERROR	file_create(struct fileinterface *fi, char *path, struct file **file);
+
+/*
+ * Creates a new, empty file with the given path and opens it. Fails if
+ * the file already exists.
+ */
+LDI_ERROR	file_create_new(struct fileinterface *fi, char *path, struct file **file);
+
+/*
+ * Removes the file with the given path. It is not an error if there is no
+ * such file.
+ */
+LDI_ERROR	file_remove(struct fileinterface *fi, char *path);
+
+/*
+ * Opens a file with the given path for reading only.
+ */
+LDI_ERROR	file_open_readonly(struct fileinterface *fi, char *path, struct file **file);
+
+/*
+ * Opens a file for reading only, shared by everyone in the process that
+ * opens the same file with the same cache mode. Each call returns a new
+ * reference to the same file, and the file is closed when all of them
+ * have been closed with file_close. All reads go through a block cache
+ * that is shared by all users of the file.
+ */
+LDI_ERROR	file_open_shared(struct fileinterface *fi, char *path, struct file **file);
+
+/*
+ * Returns the object attached to a shared file, or NULL.
+ */
+void   *file_shared_object(struct file *f);
+
+/*
+ * Attaches an object, such as the parsed metadata of the file, to a shared
+ * file unless another object already is attached. Returns the attached
+ * object. destroy is called with the object when the last reference to
+ * the file is closed.
+ */
+void   *file_share_object(struct file *f, void *object, void (*destroy)(void *object));
+
+/*
+ * Stops sharing a shared file with later callers of file_open_shared, so
+ * that the file can be changed through another handle without them
+ * seeing the stale cache and object of this one. Fails with EBUSY if
+ * anyone else in the process uses the file, with any cache mode.
+ */
+LDI_ERROR	file_unshare(struct file *f);
+
+/*
+ * Closes the given file and sets the pointer to zero. Shared files are
+ * only closed when the last reference is closed.
  */
 void	file_close(struct file **f);
 
@@ -52,10 +112,55 @@ LDI_ERROR	file_getsize(struct file *f, size_t *size);
 LDI_ERROR	file_setsize(struct file *f, size_t newsize);
 
 /*
- * Returns a filemap struct with a chunk of the file mapped to memory.
+ * Finds out if offset in the file is in data or in a hole, and where the
+ * data or the hole ends. Files on file systems that don't report holes
+ * are all data.
+ */
+LDI_ERROR	file_getextent(struct file *f, off_t offset, bool *data, off_t *end);
+
+/*
+ * Frees the storage of nbytes at offset in the file, which reads as zeros
+ * afterwards. Where the file system can't free parts of files, the range
+ * is written with zeros instead. Must not be used on shared files.
+ */
+LDI_ERROR	file_deallocate(struct file *f, off_t offset, size_t nbytes);
+
+/*
+ * Reads nbytes at offset in the file into the buffer.
+ */
+LDI_ERROR	file_read(struct file *f, void *buf, size_t nbytes, off_t offset, struct logger logger);
+
+/*
+ * Writes nbytes from the buffer at offset in the file.
+ */
+LDI_ERROR	file_write(struct file *f, void *buf, size_t nbytes, off_t offset, struct logger logger);
+
+/*
+ * Writes all modified data of the file to stable storage. This includes
+ * data written through filemaps that have since been destroyed. Does
+ * nothing for files opened with LDI_CACHE_UNSAFE.
+ */
+LDI_ERROR	file_sync(struct file *f);
+
+/*
+ * Takes an exclusive lock on the file, which is released when it is
+ * closed. Fails if another process, or another open file of this one,
+ * holds the lock.
+ */
+LDI_ERROR	file_lock(struct file *f);
+
+/*
+ * Returns a filemap struct with a chunk of the file mapped to memory. The
+ * memory of files opened for reading only can only be read.
  */
 LDI_ERROR file_getmap(struct file *f, size_t offset, size_t length, struct filemap **map, struct logger logger);
 
+/*
+ * Returns the path the file was opened with. The string belongs to the
+ * file.
+ */
+char   *file_getpath(struct file *f);
+
 /*
  * Returns the directory of the file.
  */
@@ -52,13 +52,10 @@ align(size_t *offset, size_t *length)
 }
 
 /*
- * Memory maps the requested file range into memory. The returned filemap
- * object must be destroyed using filemap_destroy when it is no longer needed.
- * Handles page aligning the range. While not strictly needed on FreeBSD, it
- * is needed for POSIX compliance and when running in valgrind.
+ * Maps the file range with the protection prot.
  */
-LDI_ERROR
-filemap_create(int fd, size_t offset, size_t length, struct filemap **map, struct logger logger)
+static LDI_ERROR
+create_map(int fd, size_t offset, size_t length, int prot, struct filemap **map, struct logger logger)
 {
 	void *ptr;
 	size_t original_offset = offset;
@@ -79,7 +76,7 @@ filemap_create(int fd, size_t offset, size_t length, struct filemap **map, struc
 	align(&offset, &length);
 
 	/* Create the memory map. It will be unmapped in filemap_destroy. */
-	ptr = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+	ptr = mmap(NULL, length, prot, MAP_SHARED, fd, offset);
 
 	if (ptr == MAP_FAILED) {
 		/* We failed to create a map. */
@@ -97,6 +94,27 @@ filemap_create(int fd, size_t offset, size_t length, struct filemap **map, struc
 	return NO_ERROR;
 }
 
+/*
+ * Memory maps the requested file range into memory. The returned filemap
+ * object must be destroyed using filemap_destroy when it is no longer needed.
+ * Handles page aligning the range. While not strictly needed on FreeBSD, it
+ * is needed for POSIX compliance and when running in valgrind.
+ */
+LDI_ERROR
+filemap_create(int fd, size_t offset, size_t length, struct filemap **map, struct logger logger)
+{
+	return create_map(fd, offset, length, PROT_READ | PROT_WRITE, map, logger);
+}
+
+/*
+ * Like filemap_create, but the memory can only be read.
+ */
+LDI_ERROR
+filemap_create_readonly(int fd, size_t offset, size_t length, struct filemap **map, struct logger logger)
+{
+	return create_map(fd, offset, length, PROT_READ, map, logger);
+}
+
 /*
  * Destroys the filemap object and unmaps the memory. Any pointer
  * that has been returned by filemap_pointer is invalid after calling
@@ -20,6 +20,12 @@ struct filemap {
  */
 LDI_ERROR filemap_create(int fd, size_t offset, size_t length, struct filemap **map, struct logger logger);
 
+/*
+ * Like filemap_create, but the memory can only be read. Works with files
+ * that are opened for reading only.
+ */
+LDI_ERROR filemap_create_readonly(int fd, size_t offset, size_t length, struct filemap **map, struct logger logger);
+
 /*
  * Destroys the filemap object and unmaps the memory. Any pointer
  * that has been returned by filemap_pointer is invalid after calling
@@ -0,0 +1,223 @@
+
+#include <sys/param.h>
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fileinterface.h"
+#include "holemap.h"
+#include "internal.h"
+
+/* The most holes kept in a map, which then uses at most 16 MB. */
+#define HOLEMAP_MAX_HOLES (1024 * 1024)
+
+/* The number of holes there is room for in a new map. */
+#define HOLEMAP_INITIAL_CAPACITY 16
+
+/*
+ * A hole from start up to, but not including, end.
+ */
+struct hole {
+	off_t	start;
+	off_t	end;
+};
+
+struct holemap {
+	/* The holes, sorted by offset. Holes never overlap or touch. */
+	struct hole *holes;
+	size_t	count;
+	size_t	capacity;
+	/* Everything from here on is data, whether it is in a hole or not. */
+	off_t	mapped_end;
+	/* The number of bytes in the file that the map covers. */
+	off_t	size;
+	/* Protects all of the above that can change. */
+	pthread_mutex_t lock;
+};
+
+/*
+ * Makes room for one more hole. Returns false if the map already holds
+ * as many holes as it may or there is no memory for more.
+ */
+static bool
+grow(struct holemap *map)
+{
+	struct hole *holes;
+	size_t	capacity;
+
+	if (map->count < map->capacity) {
+		return true;
+	}
+	if (map->capacity >= HOLEMAP_MAX_HOLES) {
+		return false;
+	}
+
+	capacity = MAX(map->capacity * 2, HOLEMAP_INITIAL_CAPACITY);
+	holes = realloc(map->holes, capacity * sizeof(struct hole));
+	if (holes == NULL) {
+		return false;
+	}
+	map->holes = holes;
+	map->capacity = capacity;
+
+	return true;
+}
+
+/*
+ * Finds the holes in the first size bytes of the file.
+ */
+LDI_ERROR
+holemap_create(struct file *file, off_t size, struct holemap **map)
+{
+	off_t	offset, end;
+	bool	data;
+	LDI_ERROR result;
+
+	*map = calloc(1, sizeof(struct holemap));
+	if (*map == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	(*map)->size = size;
+	pthread_mutex_init(&(*map)->lock, NULL);
+
+	offset = 0;
+	while (offset < size) {
+		result = file_getextent(file, offset, &data, &end);
+		if (IS_ERROR(result)) {
+			holemap_destroy(map);
+			return result;
+		}
+		if (end <= offset) {
+			/* The file is shorter than size. */
+			break;
+		}
+		end = MIN(end, size);
+
+		if (!data) {
+			if (!grow(*map)) {
+				break;
+			}
+			(*map)->holes[(*map)->count].start = offset;
+			(*map)->holes[(*map)->count].end = end;
+			(*map)->count++;
+		}
+		offset = end;
+	}
+	(*map)->mapped_end = offset;
+
+	return NO_ERROR;
+}
+
+/*
+ * Frees the map and sets the pointer to NULL.
+ */
+void
+holemap_destroy(struct holemap **map)
+{
+	pthread_mutex_destroy(&(*map)->lock);
+	free((*map)->holes);
+	free(*map);
+	*map = NULL;
+}
+
+/*
+ * Returns the index of the first hole that ends after offset, or the
+ * number of holes if there is none.
+ */
+static size_t
+first_after(struct holemap *map, off_t offset)
+{
+	size_t	low, high, middle;
+
+	low = 0;
+	high = map->count;
+	while (low < high) {
+		middle = low + (high - low) / 2;
+		if (map->holes[middle].end > offset) {
+			high = middle;
+		} else {
+			low = middle + 1;
+		}
+	}
+
+	return low;
+}
+
+/*
+ * Finds out if offset is in a hole, and where the hole or data ends.
+ */
+void
+holemap_find(struct holemap *map, off_t offset, bool *hole, off_t *end)
+{
+	size_t	i;
+
+	pthread_mutex_lock(&map->lock);
+	if (offset >= map->mapped_end) {
+		*hole = false;
+		*end = MAX(map->size, offset);
+	} else {
+		i = first_after(map, offset);
+		if (i == map->count) {
+			*hole = false;
+			*end = map->mapped_end;
+		} else if (map->holes[i].start <= offset) {
+			*hole = true;
+			*end = map->holes[i].end;
+		} else {
+			*hole = false;
+			*end = map->holes[i].start;
+		}
+	}
+	pthread_mutex_unlock(&map->lock);
+}
+
+/*
+ * Removes nbytes at offset from the holes.
+ */
+void
+holemap_fill(struct holemap *map, off_t offset, size_t nbytes)
+{
+	off_t	end;
+	size_t	i, j;
+
+	end = offset + nbytes;
+
+	pthread_mutex_lock(&map->lock);
+	i = first_after(map, offset);
+	if (i < map->count && map->holes[i].start < offset && map->holes[i].end > end) {
+		/*
+		 * The write splits the hole in two. Without room for the
+		 * second half, it is treated as data.
+		 */
+		if (grow(map)) {
+			memmove(&map->holes[i + 2], &map->holes[i + 1],
+			    (map->count - i - 1) * sizeof(struct hole));
+			map->holes[i + 1].start = end;
+			map->holes[i + 1].end = map->holes[i].end;
+			map->count++;
+		}
+		map->holes[i].end = offset;
+		pthread_mutex_unlock(&map->lock);
+		return;
+	}
+
+	/* Keep the start of a hole that begins before offset. */
+	if (i < map->count && map->holes[i].start < offset) {
+		map->holes[i].end = offset;
+		i++;
+	}
+
+	/* Remove the holes that are all written, and cut the last one. */
+	j = i;
+	while (j < map->count && map->holes[j].end <= end) {
+		j++;
+	}
+	if (j < map->count && map->holes[j].start < end) {
+		map->holes[j].start = end;
+	}
+	memmove(&map->holes[i], &map->holes[j], (map->count - j) * sizeof(struct hole));
+	map->count -= j - i;
+	pthread_mutex_unlock(&map->lock);
+}
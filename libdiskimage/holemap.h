@@ -0,0 +1,41 @@
+#ifndef _HOLEMAP_H_
+#define _HOLEMAP_H_
+
+#include <sys/types.h>
+#include <stdbool.h>
+
+#include "diskimage.h"
+#include "fileinterface.h"
+
+/*
+ * The holes of a sparse file, found once with SEEK_DATA and SEEK_HOLE and
+ * kept up to date by the writes made through the map. Safe to use from
+ * several threads.
+ */
+struct holemap;
+
+/*
+ * Finds the holes in the first size bytes of the file. Files with very
+ * many holes only have the first of them in the map, and the rest of the
+ * file is treated as data.
+ */
+LDI_ERROR holemap_create(struct file *file, off_t size, struct holemap **map);
+
+/*
+ * Frees the map and sets the pointer to NULL.
+ */
+void	holemap_destroy(struct holemap **map);
+
+/*
+ * Finds out if offset is in a hole, and sets end to where the hole or the
+ * data at offset ends.
+ */
+void	holemap_find(struct holemap *map, off_t offset, bool *hole, off_t *end);
+
+/*
+ * Removes nbytes at offset from the holes. Must be called before the
+ * range is written.
+ */
+void	holemap_fill(struct holemap *map, off_t offset, size_t nbytes);
+
+#endif					/* _HOLEMAP_H_ */
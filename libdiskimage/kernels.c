@@ -0,0 +1,571 @@
+
+#include <sys/types.h>
+#include <sys/endian.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "kernels.h"
+
+/*
+ * The vector kernels are only built for x86 with compilers that support
+ * per function target attributes, so the rest of the library can be built
+ * for the baseline CPU.
+ */
+#if (defined(__amd64__) || defined(__i386__)) && defined(__GNUC__)
+#define KERNELS_X86
+#include <immintrin.h>
+#define KERNEL_TARGET(isa) __attribute__((__target__(isa)))
+#endif
+
+/* The number of bytes checked in each iteration of the unrolled loops. */
+#define ZERO_STRIDE (4 * sizeof(uint64_t))
+
+/*
+ * One implementation of each kernel.
+ */
+struct kernel_ops {
+	size_t	(*zero_prefix)(const void *buf, size_t nbytes);
+	size_t	(*zero_suffix)(const void *buf, size_t nbytes);
+	uint32_t (*bytesum)(const void *buf, size_t nbytes);
+	void	(*be32dec_array)(uint32_t *dst, const void *src, size_t count);
+	void	(*be32enc_array)(void *dst, const uint32_t *src, size_t count);
+};
+
+/*
+ * Returns true if the stride starting at words only contains zeros.
+ * Written without branches between the loads so that the compiler
+ * can turn it into vector instructions.
+ */
+static inline bool
+stride_iszero(const uint64_t *words)
+{
+	return (words[0] | words[1] | words[2] | words[3]) == 0;
+}
+
+/*
+ * Returns the number of leading zero bytes in the buffer.
+ */
+static size_t
+scalar_zero_prefix(const void *buf, size_t nbytes)
+{
+	const uint8_t *bytes = buf;
+	size_t pos = 0;
+
+	/* Check single bytes until the position is word aligned. */
+	while (pos < nbytes && ((uintptr_t)(bytes + pos) % sizeof(uint64_t)) != 0) {
+		if (bytes[pos] != 0)
+			return pos;
+		pos++;
+	}
+
+	/* Skip whole strides of zeros. */
+	while (pos + ZERO_STRIDE <= nbytes &&
+	    stride_iszero((const uint64_t *)(bytes + pos)))
+		pos += ZERO_STRIDE;
+
+	/* Find the exact position in the last (partial) stride. */
+	while (pos < nbytes && bytes[pos] == 0)
+		pos++;
+
+	return pos;
+}
+
+/*
+ * Returns the number of trailing zero bytes in the buffer.
+ */
+static size_t
+scalar_zero_suffix(const void *buf, size_t nbytes)
+{
+	const uint8_t *bytes = buf;
+	size_t end = nbytes;
+
+	/* Check single bytes until the end is word aligned. */
+	while (end > 0 && ((uintptr_t)(bytes + end) % sizeof(uint64_t)) != 0) {
+		if (bytes[end - 1] != 0)
+			return nbytes - end;
+		end--;
+	}
+
+	/* Skip whole strides of zeros. */
+	while (end >= ZERO_STRIDE &&
+	    stride_iszero((const uint64_t *)(bytes + end - ZERO_STRIDE)))
+		end -= ZERO_STRIDE;
+
+	/* Find the exact position in the last (partial) stride. */
+	while (end > 0 && bytes[end - 1] == 0)
+		end--;
+
+	return nbytes - end;
+}
+
+/*
+ * Returns the sum of all bytes in the buffer.
+ */
+static uint32_t
+scalar_bytesum(const void *buf, size_t nbytes)
+{
+	const uint8_t *bytes = buf;
+	uint32_t result = 0;
+	size_t i;
+
+	for (i = 0; i < nbytes; i++) {
+		result += bytes[i];
+	}
+
+	return result;
+}
+
+/*
+ * Decodes big endian uint32 values one at a time.
+ */
+static void
+scalar_be32dec_array(uint32_t *dst, const void *src, size_t count)
+{
+	const uint8_t *bytes = src;
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		dst[i] = be32dec(bytes + i * 4);
+	}
+}
+
+/*
+ * Encodes big endian uint32 values one at a time.
+ */
+static void
+scalar_be32enc_array(void *dst, const uint32_t *src, size_t count)
+{
+	uint8_t *bytes = dst;
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		be32enc(bytes + i * 4, src[i]);
+	}
+}
+
+static const struct kernel_ops scalar_ops = {
+	.zero_prefix = scalar_zero_prefix,
+	.zero_suffix = scalar_zero_suffix,
+	.bytesum = scalar_bytesum,
+	.be32dec_array = scalar_be32dec_array,
+	.be32enc_array = scalar_be32enc_array,
+};
+
+#ifdef KERNELS_X86
+
+/*
+ * Byte swaps count uint32 values from src to dst, with the tail handled
+ * one value at a time. x86 is little endian, so this both decodes and
+ * encodes big endian values. All loads and stores are unaligned.
+ */
+static void
+bswap32_tail(uint8_t *dst, const uint8_t *src, size_t count)
+{
+	uint32_t value;
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		memcpy(&value, src + i * 4, 4);
+		value = bswap32(value);
+		memcpy(dst + i * 4, &value, 4);
+	}
+}
+
+/*
+ * Returns the number of leading zero bytes, checking 64 bytes at a time.
+ */
+static size_t KERNEL_TARGET("sse2")
+sse2_zero_prefix(const void *buf, size_t nbytes)
+{
+	const uint8_t *bytes = buf;
+	const __m128i *p;
+	__m128i v;
+	size_t pos = 0;
+
+	for (; pos + 64 <= nbytes; pos += 64) {
+		p = (const __m128i *)(bytes + pos);
+		v = _mm_or_si128(
+		    _mm_or_si128(_mm_loadu_si128(p), _mm_loadu_si128(p + 1)),
+		    _mm_or_si128(_mm_loadu_si128(p + 2), _mm_loadu_si128(p + 3)));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xFFFF)
+			break;
+	}
+
+	/* Find the exact position in the first non-zero stride. */
+	return pos + scalar_zero_prefix(bytes + pos, nbytes - pos);
+}
+
+/*
+ * Returns the number of trailing zero bytes, checking 64 bytes at a time.
+ */
+static size_t KERNEL_TARGET("sse2")
+sse2_zero_suffix(const void *buf, size_t nbytes)
+{
+	const uint8_t *bytes = buf;
+	const __m128i *p;
+	__m128i v;
+	size_t end = nbytes;
+
+	for (; end >= 64; end -= 64) {
+		p = (const __m128i *)(bytes + end - 64);
+		v = _mm_or_si128(
+		    _mm_or_si128(_mm_loadu_si128(p), _mm_loadu_si128(p + 1)),
+		    _mm_or_si128(_mm_loadu_si128(p + 2), _mm_loadu_si128(p + 3)));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xFFFF)
+			break;
+	}
+
+	return nbytes - end + scalar_zero_suffix(bytes, end);
+}
+
+/*
+ * Sums the bytes using the sum of absolute differences against zero,
+ * which adds 8 bytes into each 64 bit lane.
+ */
+static uint32_t KERNEL_TARGET("sse2")
+sse2_bytesum(const void *buf, size_t nbytes)
+{
+	const uint8_t *bytes = buf;
+	const __m128i *p;
+	__m128i sum = _mm_setzero_si128();
+	__m128i zero = _mm_setzero_si128();
+	uint64_t lanes[2];
+	size_t pos = 0;
+
+	for (; pos + 64 <= nbytes; pos += 64) {
+		p = (const __m128i *)(bytes + pos);
+		sum = _mm_add_epi64(sum, _mm_sad_epu8(_mm_loadu_si128(p), zero));
+		sum = _mm_add_epi64(sum, _mm_sad_epu8(_mm_loadu_si128(p + 1), zero));
+		sum = _mm_add_epi64(sum, _mm_sad_epu8(_mm_loadu_si128(p + 2), zero));
+		sum = _mm_add_epi64(sum, _mm_sad_epu8(_mm_loadu_si128(p + 3), zero));
+	}
+	_mm_storeu_si128((__m128i *)lanes, sum);
+
+	return (uint32_t)(lanes[0] + lanes[1]) +
+	    scalar_bytesum(bytes + pos, nbytes - pos);
+}
+
+/*
+ * Byte swaps 4 values at a time. SSE2 has no byte shuffle, so the 16 bit
+ * halves are swapped first and then the bytes within each half.
+ */
+static void KERNEL_TARGET("sse2")
+sse2_bswap32_array(void *dst, const void *src, size_t count)
+{
+	uint8_t *out = dst;
+	const uint8_t *in = src;
+	__m128i v;
+	size_t i = 0;
+
+	for (; i + 4 <= count; i += 4) {
+		v = _mm_loadu_si128((const __m128i *)(in + i * 4));
+		v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+		v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		_mm_storeu_si128((__m128i *)(out + i * 4), v);
+	}
+
+	bswap32_tail(out + i * 4, in + i * 4, count - i);
+}
+
+static void
+sse2_be32dec_array(uint32_t *dst, const void *src, size_t count)
+{
+	sse2_bswap32_array(dst, src, count);
+}
+
+static void
+sse2_be32enc_array(void *dst, const uint32_t *src, size_t count)
+{
+	sse2_bswap32_array(dst, src, count);
+}
+
+static const struct kernel_ops sse2_ops = {
+	.zero_prefix = sse2_zero_prefix,
+	.zero_suffix = sse2_zero_suffix,
+	.bytesum = sse2_bytesum,
+	.be32dec_array = sse2_be32dec_array,
+	.be32enc_array = sse2_be32enc_array,
+};
+
+/*
+ * Returns true if the 128 bytes at p only contain zeros.
+ */
+static inline bool KERNEL_TARGET("avx2")
+avx2_stride_iszero(const __m256i *p)
+{
+	__m256i v;
+
+	v = _mm256_or_si256(
+	    _mm256_or_si256(_mm256_loadu_si256(p), _mm256_loadu_si256(p + 1)),
+	    _mm256_or_si256(_mm256_loadu_si256(p + 2), _mm256_loadu_si256(p + 3)));
+
+	return _mm256_testz_si256(v, v);
+}
+
+/*
+ * Returns the number of leading zero bytes, checking 128 bytes at a time.
+ */
+static size_t KERNEL_TARGET("avx2")
+avx2_zero_prefix(const void *buf, size_t nbytes)
+{
+	const uint8_t *bytes = buf;
+	size_t pos = 0;
+
+	while (pos + 128 <= nbytes &&
+	    avx2_stride_iszero((const __m256i *)(bytes + pos)))
+		pos += 128;
+
+	return pos + scalar_zero_prefix(bytes + pos, nbytes - pos);
+}
+
+/*
+ * Returns the number of trailing zero bytes, checking 128 bytes at a time.
+ */
+static size_t KERNEL_TARGET("avx2")
+avx2_zero_suffix(const void *buf, size_t nbytes)
+{
+	const uint8_t *bytes = buf;
+	size_t end = nbytes;
+
+	while (end >= 128 &&
+	    avx2_stride_iszero((const __m256i *)(bytes + end - 128)))
+		end -= 128;
+
+	return nbytes - end + scalar_zero_suffix(bytes, end);
+}
+
+/*
+ * Sums the bytes 128 at a time, like sse2_bytesum.
+ */
+static uint32_t KERNEL_TARGET("avx2")
+avx2_bytesum(const void *buf, size_t nbytes)
+{
+	const uint8_t *bytes = buf;
+	const __m256i *p;
+	__m256i sum = _mm256_setzero_si256();
+	__m256i zero = _mm256_setzero_si256();
+	uint64_t lanes[4];
+	size_t pos = 0;
+
+	for (; pos + 128 <= nbytes; pos += 128) {
+		p = (const __m256i *)(bytes + pos);
+		sum = _mm256_add_epi64(sum, _mm256_sad_epu8(_mm256_loadu_si256(p), zero));
+		sum = _mm256_add_epi64(sum, _mm256_sad_epu8(_mm256_loadu_si256(p + 1), zero));
+		sum = _mm256_add_epi64(sum, _mm256_sad_epu8(_mm256_loadu_si256(p + 2), zero));
+		sum = _mm256_add_epi64(sum, _mm256_sad_epu8(_mm256_loadu_si256(p + 3), zero));
+	}
+	for (; pos + 32 <= nbytes; pos += 32) {
+		p = (const __m256i *)(bytes + pos);
+		sum = _mm256_add_epi64(sum, _mm256_sad_epu8(_mm256_loadu_si256(p), zero));
+	}
+	_mm256_storeu_si256((__m256i *)lanes, sum);
+
+	/*
+	 * The tail is done here rather than with the SSE2 kernel, mixing
+	 * legacy SSE and AVX code without vzeroupper is slow.
+	 */
+	return (uint32_t)(lanes[0] + lanes[1] + lanes[2] + lanes[3]) +
+	    scalar_bytesum(bytes + pos, nbytes - pos);
+}
+
+/*
+ * Byte swaps 16 values at a time with a byte shuffle.
+ */
+static void KERNEL_TARGET("avx2")
+avx2_bswap32_array(void *dst, const void *src, size_t count)
+{
+	uint8_t *out = dst;
+	const uint8_t *in = src;
+	__m256i mask, a, b;
+	size_t i = 0;
+
+	mask = _mm256_setr_epi8(
+	    3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+	    3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+
+	for (; i + 16 <= count; i += 16) {
+		a = _mm256_loadu_si256((const __m256i *)(in + i * 4));
+		b = _mm256_loadu_si256((const __m256i *)(in + i * 4 + 32));
+		_mm256_storeu_si256((__m256i *)(out + i * 4), _mm256_shuffle_epi8(a, mask));
+		_mm256_storeu_si256((__m256i *)(out + i * 4 + 32), _mm256_shuffle_epi8(b, mask));
+	}
+	for (; i + 8 <= count; i += 8) {
+		a = _mm256_loadu_si256((const __m256i *)(in + i * 4));
+		_mm256_storeu_si256((__m256i *)(out + i * 4), _mm256_shuffle_epi8(a, mask));
+	}
+
+	bswap32_tail(out + i * 4, in + i * 4, count - i);
+}
+
+static void
+avx2_be32dec_array(uint32_t *dst, const void *src, size_t count)
+{
+	avx2_bswap32_array(dst, src, count);
+}
+
+static void
+avx2_be32enc_array(void *dst, const uint32_t *src, size_t count)
+{
+	avx2_bswap32_array(dst, src, count);
+}
+
+static const struct kernel_ops avx2_ops = {
+	.zero_prefix = avx2_zero_prefix,
+	.zero_suffix = avx2_zero_suffix,
+	.bytesum = avx2_bytesum,
+	.be32dec_array = avx2_be32dec_array,
+	.be32enc_array = avx2_be32enc_array,
+};
+
+#endif					/* KERNELS_X86 */
+
+/* The implementations for each instruction set, NULL if not built. */
+static const struct kernel_ops *isa_ops[KERNEL_ISA_COUNT] = {
+	[KERNEL_ISA_SCALAR] = &scalar_ops,
+#ifdef KERNELS_X86
+	[KERNEL_ISA_SSE2] = &sse2_ops,
+	[KERNEL_ISA_AVX2] = &avx2_ops,
+#endif
+};
+
+static const char *isa_names[KERNEL_ISA_COUNT] = {
+	[KERNEL_ISA_SCALAR] = "scalar",
+	[KERNEL_ISA_SSE2] = "sse2",
+	[KERNEL_ISA_AVX2] = "avx2",
+};
+
+/* The selected instruction set and its kernels. */
+static enum kernel_isa current_isa = KERNEL_ISA_SCALAR;
+static const struct kernel_ops *ops = &scalar_ops;
+
+/*
+ * Selects the best supported kernels when the library is loaded, so that
+ * the kernels don't need to check for initialization on each call.
+ */
+static void __attribute__((__constructor__))
+kernel_init(void)
+{
+	int isa;
+
+#ifdef KERNELS_X86
+	/* Needed before __builtin_cpu_supports in constructors. */
+	__builtin_cpu_init();
+#endif
+	for (isa = KERNEL_ISA_COUNT - 1; isa > KERNEL_ISA_SCALAR; isa--) {
+		if (kernel_set_isa(isa))
+			break;
+	}
+}
+
+/*
+ * Returns true if the CPU supports the instruction set.
+ */
+bool
+kernel_isa_supported(enum kernel_isa isa)
+{
+	if (isa < 0 || isa >= KERNEL_ISA_COUNT || isa_ops[isa] == NULL)
+		return false;
+
+	switch (isa) {
+#ifdef KERNELS_X86
+	case KERNEL_ISA_SSE2:
+		return __builtin_cpu_supports("sse2");
+	case KERNEL_ISA_AVX2:
+		return __builtin_cpu_supports("avx2");
+#endif
+	default:
+		return true;
+	}
+}
+
+/*
+ * Returns the instruction set used by the kernels.
+ */
+enum kernel_isa
+kernel_get_isa(void)
+{
+	return current_isa;
+}
+
+/*
+ * Switches all kernels to the given instruction set.
+ */
+bool
+kernel_set_isa(enum kernel_isa isa)
+{
+	if (!kernel_isa_supported(isa))
+		return false;
+
+	current_isa = isa;
+	ops = isa_ops[isa];
+
+	return true;
+}
+
+/*
+ * Returns a printable name for the instruction set.
+ */
+const char *
+kernel_isa_name(enum kernel_isa isa)
+{
+	if (isa < 0 || isa >= KERNEL_ISA_COUNT)
+		return "unknown";
+
+	return isa_names[isa];
+}
+
+/*
+ * Returns the number of leading zero bytes in the buffer.
+ */
+size_t
+kernel_zero_prefix(const void *buf, size_t nbytes)
+{
+	return ops->zero_prefix(buf, nbytes);
+}
+
+/*
+ * Returns the number of trailing zero bytes in the buffer.
+ */
+size_t
+kernel_zero_suffix(const void *buf, size_t nbytes)
+{
+	return ops->zero_suffix(buf, nbytes);
+}
+
+/*
+ * Returns true if the buffer only contains zeros.
+ */
+bool
+kernel_iszero(const void *buf, size_t nbytes)
+{
+	return kernel_zero_prefix(buf, nbytes) == nbytes;
+}
+
+/*
+ * Returns the sum of all bytes in the buffer, modulo 2^32.
+ */
+uint32_t
+kernel_bytesum(const void *buf, size_t nbytes)
+{
+	return ops->bytesum(buf, nbytes);
+}
+
+/*
+ * Decodes count big endian uint32 values from src into dst.
+ */
+void
+kernel_be32dec_array(uint32_t *dst, const void *src, size_t count)
+{
+	ops->be32dec_array(dst, src, count);
+}
+
+/*
+ * Encodes count uint32 values from src as big endian into dst.
+ */
+void
+kernel_be32enc_array(void *dst, const uint32_t *src, size_t count)
+{
+	ops->be32enc_array(dst, src, count);
+}
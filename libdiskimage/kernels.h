@@ -0,0 +1,71 @@
+#ifndef _KERNELS_H_
+#define _KERNELS_H_
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * The instruction set extensions that the kernels can be implemented with.
+ * The best one supported by the CPU is selected when the library is loaded.
+ */
+enum kernel_isa {
+	KERNEL_ISA_SCALAR = 0,
+	KERNEL_ISA_SSE2,
+	KERNEL_ISA_AVX2,
+	KERNEL_ISA_COUNT
+};
+
+/*
+ * Returns the number of leading zero bytes in the buffer.
+ */
+size_t	kernel_zero_prefix(const void *buf, size_t nbytes);
+
+/*
+ * Returns the number of trailing zero bytes in the buffer.
+ */
+size_t	kernel_zero_suffix(const void *buf, size_t nbytes);
+
+/*
+ * Returns true if the buffer only contains zeros.
+ */
+bool	kernel_iszero(const void *buf, size_t nbytes);
+
+/*
+ * Returns the sum of all bytes in the buffer, modulo 2^32.
+ */
+uint32_t kernel_bytesum(const void *buf, size_t nbytes);
+
+/*
+ * Decodes count big endian uint32 values from src into dst.
+ */
+void	kernel_be32dec_array(uint32_t *dst, const void *src, size_t count);
+
+/*
+ * Encodes count uint32 values from src as big endian into dst.
+ */
+void	kernel_be32enc_array(void *dst, const uint32_t *src, size_t count);
+
+/*
+ * Returns true if the CPU supports the instruction set.
+ */
+bool	kernel_isa_supported(enum kernel_isa isa);
+
+/*
+ * Returns the instruction set used by the kernels.
+ */
+enum kernel_isa kernel_get_isa(void);
+
+/*
+ * Switches all kernels to the given instruction set. Returns false, and
+ * leaves the kernels unchanged, if the CPU doesn't support it. Not thread
+ * safe, only meant for tests and benchmarks.
+ */
+bool	kernel_set_isa(enum kernel_isa isa);
+
+/*
+ * Returns a printable name for the instruction set.
+ */
+const char *kernel_isa_name(enum kernel_isa isa);
+
+#endif					/* _KERNELS_H_ */
@@ -0,0 +1,237 @@
+
+#include <sys/param.h>
+#include <sys/endian.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "diskimage.h"
+#include "fileinterface.h"
+#include "internal.h"
+#include "kernels.h"
+#include "ldzcreate.h"
+#include "ldzheader.h"
+#include "log.h"
+
+/* The number of bytes of the disk in each chunk. */
+#define CHUNK_SIZE (64 * 1024)
+
+/* The number of bytes of the disk that are read and written at once. */
+#define BATCH_SIZE (4 * 1024 * 1024)
+
+/*
+ * The state of an image that is being created.
+ */
+struct ldzcreate_state {
+	struct file *file;
+	struct ldzheader header;
+	/* The offset of each chunk in the file, and where the last ends. */
+	uint64_t *index;
+	/* The disk data of a batch. */
+	char   *input;
+	/* The compressed data of a batch. */
+	char   *output;
+	/* Room to compress a single chunk. */
+	char   *compressed;
+	uLong	compressed_size;
+	/* Where the next batch is written in the file. */
+	uint64_t next_offset;
+	struct logger logger;
+};
+
+/*
+ * Compresses the chunk into the output of the batch, and returns the
+ * number of bytes it takes there. Zero chunks take none, and chunks that
+ * don't get smaller are copied as they are.
+ */
+static LDI_ERROR
+compress_chunk(struct ldzcreate_state *state, char *data, size_t nbytes, char *output, size_t *length)
+{
+	uLongf	compressed;
+	int	error;
+
+	if (kernel_iszero(data, nbytes)) {
+		*length = 0;
+		return NO_ERROR;
+	}
+
+	compressed = state->compressed_size;
+	error = compress2((Bytef *)state->compressed, &compressed, (Bytef *)data, nbytes,
+	    Z_DEFAULT_COMPRESSION);
+	if (error != Z_OK) {
+		LOG_ERROR(state->logger, "Failed to compress a chunk.\n");
+		return ERROR(LDI_ERR_NOMEM);
+	}
+
+	if (compressed < nbytes) {
+		memcpy(output, state->compressed, compressed);
+		*length = compressed;
+	} else {
+		memcpy(output, data, nbytes);
+		*length = nbytes;
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Reads, compresses and writes the chunks from first up to end.
+ */
+static LDI_ERROR
+write_batch(struct ldzcreate_state *state, uint64_t first, uint64_t end, ldz_read_fn read, void *arg)
+{
+	uint64_t chunk, offset;
+	size_t	nbytes, output_size, length, bytes;
+	LDI_ERROR result;
+
+	offset = first * state->header.chunk_size;
+	nbytes = MIN((end - first) * state->header.chunk_size, state->header.disk_size - offset);
+	result = read(arg, state->input, nbytes, offset);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	output_size = 0;
+	for (chunk = first; chunk < end; chunk++) {
+		bytes = MIN(state->header.chunk_size, nbytes - (chunk - first) * state->header.chunk_size);
+		result = compress_chunk(state, state->input + (chunk - first) * state->header.chunk_size,
+		    bytes, state->output + output_size, &length);
+		if (IS_ERROR(result)) {
+			return result;
+		}
+		state->index[chunk] = state->next_offset + output_size;
+		output_size += length;
+	}
+
+	if (output_size > 0) {
+		result = file_setsize(state->file, state->next_offset + output_size);
+		if (!IS_ERROR(result)) {
+			result = file_write(state->file, state->output, output_size,
+			    state->next_offset, state->logger);
+		}
+		if (IS_ERROR(result)) {
+			return result;
+		}
+	}
+	state->next_offset += output_size;
+
+	return NO_ERROR;
+}
+
+/*
+ * Writes the header, the index and the footer of the image, once all
+ * chunks have been written.
+ */
+static LDI_ERROR
+write_metadata(struct ldzcreate_state *state)
+{
+	uint8_t header[LDZ_HEADER_SIZE];
+	uint64_t chunk;
+	size_t	index_size;
+	uint8_t *buffer;
+	LDI_ERROR result;
+
+	/* The header at the start doesn't know where the index is. */
+	state->header.index_offset = 0;
+	ldzheader_write(&state->header, header);
+	result = file_write(state->file, header, sizeof(header), 0, state->logger);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	index_size = (state->header.chunk_count + 1) * LDZ_INDEX_ENTRY_SIZE;
+	buffer = malloc(index_size + LDZ_HEADER_SIZE);
+	if (buffer == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	state->index[state->header.chunk_count] = state->next_offset;
+	for (chunk = 0; chunk <= state->header.chunk_count; chunk++) {
+		le64enc(buffer + chunk * LDZ_INDEX_ENTRY_SIZE, state->index[chunk]);
+	}
+	state->header.index_offset = state->next_offset;
+	ldzheader_write(&state->header, buffer + index_size);
+
+	result = file_setsize(state->file, state->next_offset + index_size + LDZ_HEADER_SIZE);
+	if (!IS_ERROR(result)) {
+		result = file_write(state->file, buffer, index_size + LDZ_HEADER_SIZE,
+		    state->next_offset, state->logger);
+	}
+	free(buffer);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	return file_sync(state->file);
+}
+
+/*
+ * Writes all chunks of the disk, and then the metadata that points to
+ * them.
+ */
+static LDI_ERROR
+write_image(struct ldzcreate_state *state, ldz_read_fn read, void *arg)
+{
+	uint64_t chunk, batch_chunks;
+	LDI_ERROR result;
+
+	batch_chunks = BATCH_SIZE / state->header.chunk_size;
+	for (chunk = 0; chunk < state->header.chunk_count; chunk += batch_chunks) {
+		result = write_batch(state, chunk,
+		    MIN(chunk + batch_chunks, state->header.chunk_count), read, arg);
+		if (IS_ERROR(result)) {
+			return result;
+		}
+	}
+
+	return write_metadata(state);
+}
+
+/*
+ * Creates a compressed image at path.
+ */
+LDI_ERROR
+ldzcreate(struct fileinterface *fi, char *path, uint64_t disk_size, ldz_read_fn read, void *arg, struct logger logger)
+{
+	struct ldzcreate_state state;
+	LDI_ERROR result;
+
+	bzero(&state, sizeof(state));
+	state.logger = logger;
+	state.header.version = LDZ_VERSION;
+	state.header.chunk_size = CHUNK_SIZE;
+	state.header.disk_size = disk_size;
+	state.header.chunk_count = howmany(disk_size, CHUNK_SIZE);
+	state.next_offset = LDZ_HEADER_SIZE;
+	state.compressed_size = compressBound(CHUNK_SIZE);
+
+	state.index = malloc((state.header.chunk_count + 1) * sizeof(uint64_t));
+	state.input = malloc(BATCH_SIZE);
+	state.output = malloc(BATCH_SIZE);
+	state.compressed = malloc(state.compressed_size);
+	if (state.index == NULL || state.input == NULL || state.output == NULL ||
+	    state.compressed == NULL) {
+		result = ERROR(LDI_ERR_NOMEM);
+	} else {
+		result = file_create_new(fi, path, &state.file);
+	}
+
+	if (!IS_ERROR(result)) {
+		result = file_setsize(state.file, LDZ_HEADER_SIZE);
+		if (!IS_ERROR(result)) {
+			result = write_image(&state, read, arg);
+		}
+		file_close(&state.file);
+		if (IS_ERROR(result)) {
+			/* Don't leave a partial image behind. */
+			file_remove(fi, path);
+		}
+	}
+
+	free(state.index);
+	free(state.input);
+	free(state.output);
+	free(state.compressed);
+
+	return result;
+}
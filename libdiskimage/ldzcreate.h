@@ -0,0 +1,22 @@
+#ifndef _LDZCREATE_H_
+#define _LDZCREATE_H_
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#include "diskimage.h"
+#include "fileinterface.h"
+
+/*
+ * Reads nbytes of the disk that is compressed at offset into the buffer.
+ */
+typedef LDI_ERROR (*ldz_read_fn) (void *arg, char *buf, size_t nbytes, off_t offset);
+
+/*
+ * Creates a compressed image at path of a disk with disk_size bytes,
+ * which are read in order with read. Fails if path already exists, and
+ * removes the partial image if anything fails.
+ */
+LDI_ERROR ldzcreate(struct fileinterface *fi, char *path, uint64_t disk_size, ldz_read_fn read, void *arg, struct logger logger);
+
+#endif					/* _LDZCREATE_H_ */
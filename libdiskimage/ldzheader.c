@@ -0,0 +1,108 @@
+
+#include <sys/endian.h>
+#include <sys/param.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "internal.h"
+#include "ldzheader.h"
+
+/* Defines the offsets used in the header. */
+#define LDZ_MAGIC_OFFSET 0
+#define LDZ_VERSION_OFFSET 8
+#define LDZ_CHUNK_SIZE_OFFSET 12
+#define LDZ_DISK_SIZE_OFFSET 16
+#define LDZ_CHUNK_COUNT_OFFSET 24
+#define LDZ_INDEX_OFFSET_OFFSET 32
+#define LDZ_CHECKSUM_OFFSET 40
+
+/*
+ * Returns true if source starts a compressed image.
+ */
+bool
+ldzheader_magic_valid(void *source)
+{
+	uint8_t *bytes = source;
+
+	return memcmp(bytes + LDZ_MAGIC_OFFSET, LDZ_MAGIC, LDZ_MAGIC_SIZE) == 0;
+}
+
+/*
+ * Returns the checksum of the header in source, which is the CRC-32 of
+ * the fields before it.
+ */
+static uint32_t
+checksum(uint8_t *bytes)
+{
+	return crc32(crc32(0, NULL, 0), bytes, LDZ_CHECKSUM_OFFSET);
+}
+
+/*
+ * Creates a new header by reading it from source.
+ */
+LDI_ERROR
+ldzheader_new(void *source, struct ldzheader **header)
+{
+	uint8_t *bytes = source;
+	uint32_t chunk_size;
+	uint64_t disk_size;
+
+	if (!ldzheader_magic_valid(bytes) ||
+	    le32dec(bytes + LDZ_CHECKSUM_OFFSET) != checksum(bytes)) {
+		return ERROR(LDI_ERR_PARSEERROR);
+	}
+	if (le32dec(bytes + LDZ_VERSION_OFFSET) != LDZ_VERSION) {
+		return ERROR(LDI_ERR_FILENOTSUP);
+	}
+
+	chunk_size = le32dec(bytes + LDZ_CHUNK_SIZE_OFFSET);
+	disk_size = le64dec(bytes + LDZ_DISK_SIZE_OFFSET);
+	if (chunk_size < LDZ_MIN_CHUNK_SIZE || chunk_size > LDZ_MAX_CHUNK_SIZE ||
+	    !powerof2(chunk_size) ||
+	    le64dec(bytes + LDZ_CHUNK_COUNT_OFFSET) != howmany(disk_size, chunk_size)) {
+		return ERROR(LDI_ERR_PARSEERROR);
+	}
+
+	*header = malloc(sizeof(struct ldzheader));
+	if (*header == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+
+	(*header)->version = LDZ_VERSION;
+	(*header)->chunk_size = chunk_size;
+	(*header)->disk_size = disk_size;
+	(*header)->chunk_count = howmany(disk_size, chunk_size);
+	(*header)->index_offset = le64dec(bytes + LDZ_INDEX_OFFSET_OFFSET);
+
+	return NO_ERROR;
+}
+
+/*
+ * Writes the header into dest.
+ */
+void
+ldzheader_write(struct ldzheader *header, void *dest)
+{
+	uint8_t *bytes = dest;
+
+	bzero(bytes, LDZ_HEADER_SIZE);
+	memcpy(bytes + LDZ_MAGIC_OFFSET, LDZ_MAGIC, LDZ_MAGIC_SIZE);
+	le32enc(bytes + LDZ_VERSION_OFFSET, header->version);
+	le32enc(bytes + LDZ_CHUNK_SIZE_OFFSET, header->chunk_size);
+	le64enc(bytes + LDZ_DISK_SIZE_OFFSET, header->disk_size);
+	le64enc(bytes + LDZ_CHUNK_COUNT_OFFSET, header->chunk_count);
+	le64enc(bytes + LDZ_INDEX_OFFSET_OFFSET, header->index_offset);
+	le32enc(bytes + LDZ_CHECKSUM_OFFSET, checksum(bytes));
+}
+
+/*
+ * Frees memory and zeros the header.
+ */
+void
+ldzheader_destroy(struct ldzheader **header)
+{
+	free(*header);
+	*header = NULL;
+}
@@ -0,0 +1,73 @@
+#ifndef _LDZHEADER_H_
+#define _LDZHEADER_H_
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "diskimage.h"
+
+/*
+ * Compressed images are made of a header, the chunks of the disk, each
+ * compressed on its own, an index with the offset of each chunk in the
+ * file and a footer, which is a copy of the header that also tells where
+ * the index is. The index has one more entry than there are chunks, so
+ * that the length of each chunk is the difference between two entries.
+ * Chunks of zeros have no data, and chunks that don't get smaller when
+ * compressed are stored as they are. All numbers are little endian.
+ */
+#define LDZ_MAGIC "ldzimage"
+#define LDZ_MAGIC_SIZE 8
+
+/* The version of the format that is supported. */
+#define LDZ_VERSION 1
+
+/* The size of the header at the start of the file and of the footer. */
+#define LDZ_HEADER_SIZE 512
+
+/* The size of each entry in the index. */
+#define LDZ_INDEX_ENTRY_SIZE 8
+
+/* The smallest and the largest chunks that are allowed. */
+#define LDZ_MIN_CHUNK_SIZE 4096
+#define LDZ_MAX_CHUNK_SIZE (16 * 1024 * 1024)
+
+/*
+ * The parsed form of the header or the footer of a compressed image.
+ */
+struct ldzheader {
+	uint32_t version;
+	/* The number of bytes of the disk in each chunk. */
+	uint32_t chunk_size;
+	/* The number of bytes in the disk. */
+	uint64_t disk_size;
+	/* The number of chunks, the last of which may be short. */
+	uint64_t chunk_count;
+	/* The offset of the index in the file. 0 in the header. */
+	uint64_t index_offset;
+};
+
+/*
+ * Returns true if source, which must hold LDZ_MAGIC_SIZE bytes, starts a
+ * compressed image.
+ */
+bool	ldzheader_magic_valid(void *source);
+
+/*
+ * Creates a new header by reading it from source, which must hold
+ * LDZ_HEADER_SIZE bytes. Fails if source is not a header with a valid
+ * checksum, or if its fields don't fit together.
+ */
+LDI_ERROR ldzheader_new(void *source, struct ldzheader **header);
+
+/*
+ * Writes the header into dest, which must hold LDZ_HEADER_SIZE bytes.
+ */
+void	ldzheader_write(struct ldzheader *header, void *dest);
+
+/*
+ * Frees memory and zeros the header.
+ */
+void	ldzheader_destroy(struct ldzheader **header);
+
+#endif					/* _LDZHEADER_H_ */
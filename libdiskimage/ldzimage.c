@@ -0,0 +1,513 @@
+
+#include <sys/param.h>
+#include <sys/endian.h>
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "blockcache.h"
+#include "diskimage.h"
+#include "fileinterface.h"
+#include "filemap.h"
+#include "internal.h"
+#include "ldzheader.h"
+#include "ldzimage.h"
+#include "log.h"
+#include "taskpool.h"
+
+/* The number of bytes of inflated chunks that are kept in memory. */
+#define CHUNK_CACHE_BYTES (32 * 1024 * 1024)
+
+/*
+ * The number of chunks after a sequential read that are inflated in the
+ * background.
+ */
+#define READAHEAD_CHUNKS 16
+
+/* Reads that inflate at least this many chunks use worker threads. */
+#define PARALLEL_CHUNKS 4
+
+/*
+ * The number of threads inflating chunks in addition to the caller, and
+ * the number that read ahead.
+ */
+#define CHUNK_WORKERS 3
+
+/*
+ * A chunk to inflate, and the part of it that is read. Chunks that are
+ * read ahead have no destination.
+ */
+struct chunk_task {
+	uint64_t chunk;
+	char   *dest;
+	size_t	offset;
+	size_t	length;
+};
+
+/*
+ * The chunks that a read has to inflate, or that are read ahead, shared
+ * by the threads that do it.
+ */
+struct chunk_job {
+	struct ldzimage *image;
+	struct chunk_task *tasks;
+	size_t	ntasks;
+};
+
+struct ldzimage {
+	/* The file with the image. */
+	struct file *file;
+	/* The footer at the end of the file. */
+	struct ldzheader *header;
+	/* The number of bytes in the file. */
+	size_t	filesize;
+	/* The whole file, or NULL if it is read with file_read. */
+	struct filemap *map;
+	/* The index, in the mapping or read into memory. */
+	uint8_t *index;
+	/* The most recently inflated chunks. */
+	struct blockcache *cache;
+	/* Where the last read ended, to find sequential reads. */
+	off_t	next_offset;
+	/* Protects next_offset. */
+	pthread_mutex_t lock;
+	/* The chunks read ahead in the background, if any. */
+	struct taskpool *readahead;
+	struct chunk_job readahead_job;
+	struct chunk_task readahead_tasks[READAHEAD_CHUNKS];
+	/* Protects readahead and its job. */
+	pthread_mutex_t readahead_lock;
+	/* Used for logging. */
+	struct logger logger;
+};
+
+/*
+ * Reads the header at offset in the file into a new header.
+ */
+static LDI_ERROR
+read_header(struct ldzimage *image, off_t offset, struct ldzheader **header)
+{
+	uint8_t buffer[LDZ_HEADER_SIZE];
+	LDI_ERROR result;
+
+	result = file_read(image->file, buffer, sizeof(buffer), offset, image->logger);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	return ldzheader_new(buffer, header);
+}
+
+/*
+ * Reads the header and the footer, and checks that the index fits between
+ * the chunks and the footer.
+ */
+static LDI_ERROR
+read_headers(struct ldzimage *image)
+{
+	struct ldzheader *header;
+	uint64_t index_size;
+	LDI_ERROR result;
+
+	if (image->filesize < 2 * LDZ_HEADER_SIZE) {
+		LOG_ERROR(image->logger, "The file is too short to be a compressed image.\n");
+		return ERROR(LDI_ERR_PARSEERROR);
+	}
+
+	result = read_header(image, 0, &header);
+	if (IS_ERROR(result)) {
+		LOG_ERROR(image->logger, "The file is not a compressed image.\n");
+		return result;
+	}
+	result = read_header(image, image->filesize - LDZ_HEADER_SIZE, &image->header);
+	if (IS_ERROR(result)) {
+		LOG_ERROR(image->logger, "The footer of the compressed image is invalid.\n");
+		ldzheader_destroy(&header);
+		return result;
+	}
+
+	index_size = (image->header->chunk_count + 1) * LDZ_INDEX_ENTRY_SIZE;
+	if (header->chunk_size != image->header->chunk_size ||
+	    header->disk_size != image->header->disk_size ||
+	    image->header->index_offset < LDZ_HEADER_SIZE ||
+	    image->header->index_offset + index_size + LDZ_HEADER_SIZE != image->filesize) {
+		LOG_ERROR(image->logger, "The footer does not match the compressed image.\n");
+		result = ERROR(LDI_ERR_PARSEERROR);
+	}
+	ldzheader_destroy(&header);
+
+	return result;
+}
+
+/*
+ * Maps the file, or reads the index into memory with direct I/O, which
+ * must not go through the page cache.
+ */
+static LDI_ERROR
+read_index(struct ldzimage *image, struct diskimage_options options)
+{
+	size_t	index_size;
+	LDI_ERROR result;
+
+	if (options.cache_mode != LDI_CACHE_NONE) {
+		result = file_getmap(image->file, 0, image->filesize, &image->map, image->logger);
+		if (!IS_ERROR(result)) {
+			image->index = (uint8_t *)image->map->pointer + image->header->index_offset;
+			return NO_ERROR;
+		}
+		LOG_WARNING(image->logger, "Failed to map the compressed image, using file_read.\n");
+		image->map = NULL;
+	}
+
+	index_size = (image->header->chunk_count + 1) * LDZ_INDEX_ENTRY_SIZE;
+	image->index = malloc(index_size);
+	if (image->index == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+
+	return file_read(image->file, image->index, index_size, image->header->index_offset,
+	    image->logger);
+}
+
+/*
+ * Waits for the chunks that are read ahead in the background to be
+ * inflated.
+ */
+static void
+wait_read_ahead(struct ldzimage *image)
+{
+	pthread_mutex_lock(&image->readahead_lock);
+	if (image->readahead != NULL) {
+		/* Reading ahead is only a hint, so errors are ignored. */
+		taskpool_finish(&image->readahead);
+	}
+	pthread_mutex_unlock(&image->readahead_lock);
+}
+
+/*
+ * Opens the compressed image at path.
+ */
+LDI_ERROR
+ldzimage_open(struct fileinterface *fi, char *path, struct diskimage_options options, struct ldzimage **image, struct logger logger)
+{
+	size_t	chunks;
+	LDI_ERROR result;
+
+	*image = calloc(1, sizeof(struct ldzimage));
+	if (*image == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	(*image)->logger = logger;
+	(*image)->next_offset = -1;
+	pthread_mutex_init(&(*image)->lock, NULL);
+	pthread_mutex_init(&(*image)->readahead_lock, NULL);
+	(*image)->readahead_job.image = *image;
+	(*image)->readahead_job.tasks = (*image)->readahead_tasks;
+
+	result = file_open_readonly(fi, path, &(*image)->file);
+	if (!IS_ERROR(result)) {
+		result = file_getsize((*image)->file, &(*image)->filesize);
+	}
+	if (!IS_ERROR(result)) {
+		result = read_headers(*image);
+	}
+	if (!IS_ERROR(result)) {
+		result = read_index(*image, options);
+	}
+	if (!IS_ERROR(result)) {
+		/* Keep room for a read ahead, even with large chunks. */
+		chunks = MAX(CHUNK_CACHE_BYTES / (*image)->header->chunk_size, 2 * READAHEAD_CHUNKS);
+		result = blockcache_create(chunks, &(*image)->cache);
+	}
+	if (IS_ERROR(result)) {
+		ldzimage_destroy(image);
+		return result;
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Frees the image and sets the pointer to NULL.
+ */
+void
+ldzimage_destroy(struct ldzimage **image)
+{
+	wait_read_ahead(*image);
+	if ((*image)->cache != NULL) {
+		blockcache_destroy(&(*image)->cache);
+	}
+	if ((*image)->map != NULL) {
+		filemap_destroy(&(*image)->map);
+	} else {
+		free((*image)->index);
+	}
+	if ((*image)->header != NULL) {
+		ldzheader_destroy(&(*image)->header);
+	}
+	if ((*image)->file != NULL) {
+		file_close(&(*image)->file);
+	}
+	pthread_mutex_destroy(&(*image)->readahead_lock);
+	pthread_mutex_destroy(&(*image)->lock);
+	free(*image);
+	*image = NULL;
+}
+
+/*
+ * Returns the number of bytes in the disk.
+ */
+uint64_t
+ldzimage_size(struct ldzimage *image)
+{
+	return image->header->disk_size;
+}
+
+/*
+ * Returns the number of bytes of the disk in the chunk. Only the last one
+ * may be short.
+ */
+static size_t
+chunk_bytes(struct ldzimage *image, uint64_t chunk)
+{
+	return MIN(image->header->chunk_size,
+	    image->header->disk_size - chunk * image->header->chunk_size);
+}
+
+/*
+ * Finds where the data of the chunk is in the file, and how long it is.
+ * The index is checked for each chunk as it is used, so that opening the
+ * image doesn't read all of it.
+ */
+static LDI_ERROR
+find_chunk(struct ldzimage *image, uint64_t chunk, uint64_t *start, size_t *length)
+{
+	uint64_t end;
+
+	*start = le64dec(image->index + chunk * LDZ_INDEX_ENTRY_SIZE);
+	end = le64dec(image->index + (chunk + 1) * LDZ_INDEX_ENTRY_SIZE);
+	if (*start < LDZ_HEADER_SIZE || end < *start || end > image->header->index_offset ||
+	    end - *start > chunk_bytes(image, chunk)) {
+		LOG_ERROR(image->logger, "The index entry of chunk %ju is invalid.\n",
+		    (uintmax_t)chunk);
+		return ERROR(LDI_ERR_PARSEERROR);
+	}
+	*length = end - *start;
+
+	return NO_ERROR;
+}
+
+/*
+ * Returns true if the data of the chunk in the file is compressed. Chunks
+ * without data are zeros, and chunks with all of their bytes are stored as
+ * they are.
+ */
+static bool
+is_compressed(struct ldzimage *image, uint64_t chunk, size_t length)
+{
+	return length > 0 && length < chunk_bytes(image, chunk);
+}
+
+/*
+ * Inflates the chunk into a new buffer of chunk_size bytes.
+ */
+static LDI_ERROR
+inflate_chunk(struct ldzimage *image, uint64_t chunk, char **data)
+{
+	uint8_t *compressed;
+	uint64_t start;
+	size_t	length;
+	uLongf	inflated;
+	int	error;
+	LDI_ERROR result;
+
+	result = find_chunk(image, chunk, &start, &length);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	*data = malloc(image->header->chunk_size);
+	if (*data == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	if (image->map != NULL) {
+		compressed = (uint8_t *)image->map->pointer + start;
+	} else {
+		compressed = malloc(length);
+		if (compressed == NULL) {
+			free(*data);
+			return ERROR(LDI_ERR_NOMEM);
+		}
+		result = file_read(image->file, compressed, length, start, image->logger);
+		if (IS_ERROR(result)) {
+			free(compressed);
+			free(*data);
+			return result;
+		}
+	}
+
+	inflated = image->header->chunk_size;
+	error = uncompress((Bytef *)*data, &inflated, compressed, length);
+	if (image->map == NULL) {
+		free(compressed);
+	}
+	if (error != Z_OK || inflated != chunk_bytes(image, chunk)) {
+		LOG_ERROR(image->logger, "Failed to inflate chunk %ju.\n", (uintmax_t)chunk);
+		free(*data);
+		return ERROR(LDI_ERR_PARSEERROR);
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Inflates the chunk of a task of the job into the cache.
+ */
+static LDI_ERROR
+inflate_chunk_task(void *arg, size_t index, char *buffer)
+{
+	struct chunk_job *job = arg;
+	struct ldzimage *image = job->image;
+	struct chunk_task *task = &job->tasks[index];
+	char   *data;
+	LDI_ERROR result;
+
+	result = inflate_chunk(image, task->chunk, &data);
+	if (IS_ERROR(result)) {
+		/* Chunks that are read ahead are inflated again when read. */
+		return task->dest != NULL ? result : NO_ERROR;
+	}
+	if (task->dest != NULL) {
+		memcpy(task->dest, data + task->offset, task->length);
+	}
+
+	/* The cache takes over the chunk. */
+	blockcache_put(image->cache, task->chunk, data, image->header->chunk_size);
+
+	return NO_ERROR;
+}
+
+/*
+ * Starts inflating the compressed chunks after last that are not cached,
+ * on worker threads in the background. A read ahead that is still running
+ * is waited for first.
+ */
+static void
+read_ahead(struct ldzimage *image, uint64_t last)
+{
+	struct chunk_job *job = &image->readahead_job;
+	uint64_t chunk, start;
+	size_t	length;
+	char	byte;
+
+	pthread_mutex_lock(&image->readahead_lock);
+	if (image->readahead != NULL) {
+		taskpool_finish(&image->readahead);
+	}
+
+	job->ntasks = 0;
+	for (chunk = last + 1; chunk <= last + READAHEAD_CHUNKS &&
+	    chunk < image->header->chunk_count; chunk++) {
+		/* Reading ahead is only a hint, so bad chunks are left for later. */
+		if (IS_ERROR(find_chunk(image, chunk, &start, &length))) {
+			break;
+		}
+		if (is_compressed(image, chunk, length) &&
+		    !blockcache_get(image->cache, chunk, &byte, 0, 0)) {
+			job->tasks[job->ntasks].chunk = chunk;
+			job->tasks[job->ntasks].dest = NULL;
+			job->ntasks++;
+		}
+	}
+
+	if (job->ntasks > 0) {
+		/* Without a pool, nothing is read ahead. */
+		taskpool_start(job->ntasks, CHUNK_WORKERS, 0, inflate_chunk_task, job,
+		    &image->readahead);
+	}
+	pthread_mutex_unlock(&image->readahead_lock);
+}
+
+/*
+ * Reads nbytes at offset on the disk into the buffer. Chunks that are
+ * zeros, stored as they are or cached are copied right away, and the
+ * others are inflated afterwards.
+ */
+LDI_ERROR
+ldzimage_read(struct ldzimage *image, char *buf, size_t nbytes, off_t offset)
+{
+	struct chunk_job job;
+	uint64_t chunk, first, last, start;
+	size_t	offset_in_chunk, length, stored;
+	bool	sequential;
+	LDI_ERROR result;
+
+	if (nbytes == 0) {
+		return NO_ERROR;
+	}
+
+	pthread_mutex_lock(&image->lock);
+	sequential = offset == image->next_offset;
+	image->next_offset = offset + nbytes;
+	pthread_mutex_unlock(&image->lock);
+
+	first = offset / image->header->chunk_size;
+	last = (offset + nbytes - 1) / image->header->chunk_size;
+	job.image = image;
+	job.ntasks = 0;
+	job.tasks = malloc((last - first + 1) * sizeof(struct chunk_task));
+	if (job.tasks == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+
+	result = NO_ERROR;
+	for (chunk = first; chunk <= last && !IS_ERROR(result); chunk++) {
+		offset_in_chunk = offset % image->header->chunk_size;
+		length = MIN(image->header->chunk_size - offset_in_chunk, nbytes);
+
+		result = find_chunk(image, chunk, &start, &stored);
+		if (IS_ERROR(result)) {
+			break;
+		}
+		if (stored == 0) {
+			memset(buf, 0, length);
+		} else if (!is_compressed(image, chunk, stored)) {
+			if (image->map != NULL) {
+				memcpy(buf, image->map->pointer + start + offset_in_chunk, length);
+			} else {
+				result = file_read(image->file, buf, length, start + offset_in_chunk,
+				    image->logger);
+			}
+		} else if (!blockcache_get(image->cache, chunk, buf, offset_in_chunk, length)) {
+			job.tasks[job.ntasks].chunk = chunk;
+			job.tasks[job.ntasks].dest = buf;
+			job.tasks[job.ntasks].offset = offset_in_chunk;
+			job.tasks[job.ntasks].length = length;
+			job.ntasks++;
+		}
+
+		buf += length;
+		offset += length;
+		nbytes -= length;
+	}
+
+	if (!IS_ERROR(result)) {
+		result = taskpool_run(job.ntasks,
+		    job.ntasks >= PARALLEL_CHUNKS ? CHUNK_WORKERS : 0, 0,
+		    inflate_chunk_task, &job);
+	}
+
+	/*
+	 * Sequential scans that had to inflate chunks inflate the next ones
+	 * while the caller uses the data.
+	 */
+	if (!IS_ERROR(result) && sequential && job.ntasks > 0) {
+		read_ahead(image, last);
+	}
+	free(job.tasks);
+
+	return result;
+}
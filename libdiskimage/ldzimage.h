@@ -0,0 +1,41 @@
+#ifndef _LDZIMAGE_H_
+#define _LDZIMAGE_H_
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#include "diskimage.h"
+#include "fileinterface.h"
+
+/*
+ * A compressed image, which can only be read. Any chunk is found with a
+ * single lookup in the index, and the most recently inflated chunks are
+ * kept in memory.
+ */
+struct ldzimage;
+
+/*
+ * Opens the compressed image at path. Unless the options ask for direct
+ * I/O, the whole file is mapped, and the index and the chunks are used
+ * where they are in the mapping.
+ */
+LDI_ERROR ldzimage_open(struct fileinterface *fi, char *path, struct diskimage_options options, struct ldzimage **image, struct logger logger);
+
+/*
+ * Closes the file of the image, frees it and sets the pointer to NULL.
+ */
+void	ldzimage_destroy(struct ldzimage **image);
+
+/*
+ * Returns the number of bytes in the disk.
+ */
+uint64_t ldzimage_size(struct ldzimage *image);
+
+/*
+ * Reads nbytes at offset on the disk into the buffer. Reads that inflate
+ * several chunks do it on several threads, and reads that continue where
+ * the last one ended also inflate the chunks after them.
+ */
+LDI_ERROR ldzimage_read(struct ldzimage *image, char *buf, size_t nbytes, off_t offset);
+
+#endif					/* _LDZIMAGE_H_ */
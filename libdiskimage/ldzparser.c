@@ -0,0 +1,114 @@
+#include "diskimage.h"
+#include "fileinterface.h"
+#include "internal.h"
+#include "ldzcreate.h"
+#include "ldzheader.h"
+#include "ldzimage.h"
+#include "parser.h"
+
+void	ldzparser_destroy(void **parser);
+
+/*
+ * Returns true if head starts a compressed image.
+ */
+bool
+ldzparser_probe(void *head, void *tail)
+{
+	return ldzheader_magic_valid(head);
+}
+
+/*
+ * Creates the parser state, which is the image itself.
+ */
+LDI_ERROR
+ldzparser_new(struct fileinterface *fi, char *path, struct diskimage_options options, void **parser, struct logger logger)
+{
+	return ldzimage_open(fi, path, options, (struct ldzimage **)parser, logger);
+}
+
+/*
+ * Deallocates the parser state and sets the pointer to NULL.
+ */
+void
+ldzparser_destroy(void **parser)
+{
+	ldzimage_destroy((struct ldzimage **)parser);
+}
+
+/*
+ * Returns a diskinfo struct with properties for the disk.
+ */
+struct diskinfo
+ldzparser_diskinfo(void *parser)
+{
+	struct diskinfo result;
+
+	result.disksize = ldzimage_size(parser);
+
+	return result;
+}
+
+/*
+ * Reads nbytes at offset into the buffer.
+ */
+LDI_ERROR
+ldzparser_read(void *parser, char *buf, size_t nbytes, off_t offset)
+{
+	return ldzimage_read(parser, buf, nbytes, offset);
+}
+
+/*
+ * Compressed images are read only.
+ */
+LDI_ERROR
+ldzparser_write(void *parser, char *buf, size_t nbytes, off_t offset)
+{
+	return ERROR(LDI_ERR_FILENOTSUP);
+}
+
+/*
+ * There is never anything to flush, since nothing is written.
+ */
+LDI_ERROR
+ldzparser_flush(void *parser)
+{
+	return NO_ERROR;
+}
+
+/*
+ * Reads from the source of a conversion.
+ */
+static LDI_ERROR
+read_source(void *arg, char *buf, size_t nbytes, off_t offset)
+{
+	return parser_read_source(arg, buf, nbytes, offset);
+}
+
+/*
+ * Creates a compressed image at path with the data of source.
+ */
+LDI_ERROR
+ldzparser_convert(struct fileinterface *fi, struct diskimage *source, char *path, struct logger logger)
+{
+	return ldzcreate(fi, path, diskimage_diskinfo(source).disksize, read_source, source,
+	    logger);
+}
+
+/*
+ * Define an ldi_parser struct for the ldz parser and define the parser
+ * using the PARSER_DEFINE macro. This will make the parser discoverable
+ * in diskimage.c.
+ */
+static struct ldi_parser ldzparser_format = {
+	.name = "ldz",
+	.probe = ldzparser_probe,
+	.construct = ldzparser_new,
+	.destructor = ldzparser_destroy,
+	.diskinfo = ldzparser_diskinfo,
+	.read = ldzparser_read,
+	.write = ldzparser_write,
+	.flush = ldzparser_flush,
+	.convert = ldzparser_convert
+};
+
+PARSER_DEFINE(ldzparser_format);
@@ -7,14 +7,27 @@
 
 #include "fileinterface.h"
 
+/*
+ * The number of bytes at the start and at the end of a file that parsers
+ * recognize their format from.
+ */
+#define LDI_PROBE_SIZE 512
+
 /*
  * A common interface for all parsers.
  */
 struct ldi_parser {
 	/* The name of the parser */
 	const char *name;
+	/*
+	 * Returns true if the file is an image in the format, given the
+	 * first and the last LDI_PROBE_SIZE bytes of it. In files shorter
+	 * than that, head is padded with zeros at its end and tail at its
+	 * start. May be NULL for formats that can't be recognized.
+	 */
+	bool    (*probe) (void *head, void *tail);
 	/* A constructor for the parser state. */
-	LDI_ERROR (*construct) (struct fileinterface *fi, char *path, void **parser, struct logger logger);
+	LDI_ERROR (*construct) (struct fileinterface *fi, char *path, struct diskimage_options options, void **parser, struct logger logger);
 	/* A destructor for the parser state */
 	void    (*destructor) (void **parser);
 	/* Returns diskinfo with properties for the disk. */
@@ -26,8 +39,37 @@ struct ldi_parser {
 	 * offset.
 	 */
 	LDI_ERROR (*write) (void *parser, char *buf, size_t nbytes, off_t offset);
+	/* Makes all data written so far durable. */
+	LDI_ERROR (*flush) (void *parser);
+	/* Frees the storage of a range of the disk. May be NULL. */
+	LDI_ERROR (*discard) (void *parser, size_t nbytes, off_t offset);
+	/*
+	 * Finds out if the data at offset is stored, and how much of the
+	 * data after it is stored alike. May be NULL.
+	 */
+	LDI_ERROR (*map) (void *parser, size_t nbytes, off_t offset, bool *allocated, size_t *length);
+	/* Adds the parser counters to stats. May be NULL. */
+	void    (*stats) (void *parser, struct diskstats *stats);
+	/* Writes the data of the disk into its parent. May be NULL. */
+	LDI_ERROR (*commit) (void *parser, struct diskimage_commit_options options);
+	/*
+	 * Creates a new, empty image at child_path that reads its data from
+	 * the image at parent_path. May be NULL.
+	 */
+	LDI_ERROR (*create_child) (struct fileinterface *fi, char *parent_path, char *child_path, struct logger logger);
+	/*
+	 * Creates a new image at path in the format with the data of
+	 * source. May be NULL.
+	 */
+	LDI_ERROR (*convert) (struct fileinterface *fi, struct diskimage *source, char *path, struct logger logger);
 };
 
+/*
+ * Reads nbytes at offset of the source of a conversion. Data that is not
+ * stored in the source is zeroed without being read.
+ */
+LDI_ERROR parser_read_source(struct diskimage *source, char *buf, size_t nbytes, off_t offset);
+
 /* Declare a linker set for all the parsers. */
 SET_DECLARE(parsers, struct ldi_parser);
 
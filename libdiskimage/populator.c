@@ -0,0 +1,209 @@
+
+#include <sys/types.h>
+#include <sys/param.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "internal.h"
+#include "populator.h"
+
+/* The maximum number of blocks waiting to be copied. */
+#define QUEUE_SIZE 1024
+
+struct populator {
+	populate_fn populate;
+	void   *arg;
+	uint32_t block_size;
+	/* The rate limit in bytes per second, 0 for none. */
+	uint64_t rate;
+	/*
+	 * The number of bytes that may be copied right now. Grows with the
+	 * rate, up to one second worth of copying or one block.
+	 */
+	double	tokens;
+	struct timespec last_refill;
+
+	/* A ring of queued blocks. */
+	uint32_t queue[QUEUE_SIZE];
+	int	head;
+	int	count;
+	/* One bit per block, set while the block is queued or copied. */
+	uint8_t *pending;
+
+	bool	stop;
+	pthread_t thread;
+	/* Protects the queue, pending and stop. */
+	pthread_mutex_t lock;
+	/* Signaled when a block is queued or the worker should stop. */
+	pthread_cond_t changed;
+};
+
+/*
+ * Returns the number of seconds from a to b.
+ */
+static double
+elapsed(struct timespec *a, struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+/*
+ * Waits until the rate limit allows another block to be copied. Returns
+ * false if the worker should stop instead. Called with the lock held.
+ */
+static bool
+wait_for_tokens(struct populator *p)
+{
+	struct timespec now, deadline;
+	double burst, wait;
+
+	if (p->rate == 0) {
+		return !p->stop;
+	}
+
+	burst = MAX((double)p->rate, (double)p->block_size);
+	while (!p->stop) {
+		clock_gettime(CLOCK_REALTIME, &now);
+		p->tokens = MIN(burst, p->tokens + elapsed(&p->last_refill, &now) * p->rate);
+		p->last_refill = now;
+		if (p->tokens >= p->block_size) {
+			p->tokens -= p->block_size;
+			return true;
+		}
+
+		/* Sleep until there are enough tokens, or until stopped. */
+		wait = (p->block_size - p->tokens) / p->rate;
+		deadline.tv_sec = now.tv_sec + (time_t)wait;
+		deadline.tv_nsec = now.tv_nsec + (long)((wait - (time_t)wait) * 1e9);
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&p->changed, &p->lock, &deadline);
+	}
+
+	return false;
+}
+
+/*
+ * The worker thread. Copies the queued blocks in order.
+ */
+static void *
+worker(void *arg)
+{
+	struct populator *p = arg;
+	uint32_t block;
+	uint64_t bytes;
+
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		while (!p->stop && p->count == 0) {
+			pthread_cond_wait(&p->changed, &p->lock);
+		}
+		if (!wait_for_tokens(p)) {
+			break;
+		}
+		block = p->queue[p->head];
+		p->head = (p->head + 1) % QUEUE_SIZE;
+		p->count--;
+		pthread_mutex_unlock(&p->lock);
+
+		/*
+		 * Copying is best effort. A block that failed is read from
+		 * the parent again, and may be queued again.
+		 */
+		p->populate(p->arg, block, &bytes);
+
+		pthread_mutex_lock(&p->lock);
+		p->pending[block / 8] &= ~(1 << (block % 8));
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	return NULL;
+}
+
+/*
+ * Creates a populator and starts the worker thread.
+ */
+LDI_ERROR
+populator_create(uint32_t numblocks, uint32_t block_size, uint64_t rate, populate_fn populate, void *arg, struct populator **populator)
+{
+	struct populator *p;
+	int error;
+
+	p = malloc(sizeof(struct populator));
+	if (p == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	p->pending = calloc(numblocks / 8 + 1, 1);
+	if (p->pending == NULL) {
+		free(p);
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	p->populate = populate;
+	p->arg = arg;
+	p->block_size = block_size;
+	p->rate = rate;
+	p->tokens = block_size;
+	clock_gettime(CLOCK_REALTIME, &p->last_refill);
+	p->head = 0;
+	p->count = 0;
+	p->stop = false;
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->changed, NULL);
+
+	error = pthread_create(&p->thread, NULL, worker, p);
+	if (error != 0) {
+		pthread_cond_destroy(&p->changed);
+		pthread_mutex_destroy(&p->lock);
+		free(p->pending);
+		free(p);
+		return ERROR2(LDI_ERR_INTERNAL, error);
+	}
+	*populator = p;
+
+	return NO_ERROR;
+}
+
+/*
+ * Stops the worker thread and frees the populator.
+ */
+void
+populator_destroy(struct populator **populator)
+{
+	struct populator *p = *populator;
+
+	pthread_mutex_lock(&p->lock);
+	p->stop = true;
+	pthread_cond_signal(&p->changed);
+	pthread_mutex_unlock(&p->lock);
+	pthread_join(p->thread, NULL);
+
+	pthread_cond_destroy(&p->changed);
+	pthread_mutex_destroy(&p->lock);
+	free(p->pending);
+	free(p);
+	*populator = NULL;
+}
+
+/*
+ * Queues the block to be copied, unless it already is.
+ */
+void
+populator_queue(struct populator *p, uint32_t block)
+{
+	pthread_mutex_lock(&p->lock);
+	if ((p->pending[block / 8] & (1 << (block % 8))) == 0 &&
+	    p->count < QUEUE_SIZE) {
+		p->pending[block / 8] |= 1 << (block % 8);
+		p->queue[(p->head + p->count) % QUEUE_SIZE] = block;
+		p->count++;
+		pthread_cond_signal(&p->changed);
+	}
+	pthread_mutex_unlock(&p->lock);
+}
@@ -0,0 +1,41 @@
+#ifndef _POPULATOR_H_
+#define _POPULATOR_H_
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#include "diskimage.h"
+
+/*
+ * A background worker that copies blocks into an image, one at a time
+ * and at a limited rate. Used to populate differencing disks with data
+ * read from their parents.
+ */
+struct populator;
+
+/*
+ * Copies the block. Called from the worker thread. The number of bytes
+ * actually written is stored in bytes.
+ */
+typedef LDI_ERROR (*populate_fn)(void *arg, uint32_t block, uint64_t *bytes);
+
+/*
+ * Creates a populator for an image with numblocks blocks of block_size
+ * bytes, and starts the worker thread. rate is the maximum number of bytes
+ * per second to copy, or 0 for no limit.
+ */
+LDI_ERROR populator_create(uint32_t numblocks, uint32_t block_size, uint64_t rate, populate_fn populate, void *arg, struct populator **populator);
+
+/*
+ * Stops the worker thread, waiting for the block being copied, drops the
+ * blocks still queued and sets the pointer to NULL.
+ */
+void	populator_destroy(struct populator **populator);
+
+/*
+ * Queues the block to be copied. Never blocks. Does nothing if the block
+ * already is queued or being copied, or if the queue is full.
+ */
+void	populator_queue(struct populator *populator, uint32_t block);
+
+#endif					/* _POPULATOR_H_ */
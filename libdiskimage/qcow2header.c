@@ -0,0 +1,145 @@
+
+#include <sys/endian.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+#include "qcow2header.h"
+
+/* Defines the offsets used in the header of a qcow2 image. */
+#define MAGIC_OFFSET 0
+#define VERSION_OFFSET 4
+#define BACKING_FILE_OFFSET_OFFSET 8
+#define BACKING_FILE_SIZE_OFFSET 16
+#define CLUSTER_BITS_OFFSET 20
+#define SIZE_OFFSET 24
+#define CRYPT_METHOD_OFFSET 32
+#define L1_SIZE_OFFSET 36
+#define L1_TABLE_OFFSET_OFFSET 40
+#define REFCOUNT_TABLE_OFFSET_OFFSET 48
+#define REFCOUNT_TABLE_CLUSTERS_OFFSET 56
+#define NB_SNAPSHOTS_OFFSET 60
+#define SNAPSHOTS_OFFSET_OFFSET 64
+#define INCOMPATIBLE_FEATURES_OFFSET 72
+#define COMPATIBLE_FEATURES_OFFSET 80
+#define AUTOCLEAR_FEATURES_OFFSET 88
+#define REFCOUNT_ORDER_OFFSET 96
+#define HEADER_LENGTH_OFFSET 100
+
+/* The refcount order of version 2 images, which have 16 bit refcounts. */
+#define V2_REFCOUNT_ORDER 4
+
+/*
+ * Returns true if source starts the header of a qcow image of version 2
+ * or 3.
+ */
+bool
+qcow2header_magic_valid(void *source)
+{
+	uint8_t *bytes = source;
+	uint32_t version;
+
+	version = be32dec(bytes + VERSION_OFFSET);
+
+	return be32dec(bytes + MAGIC_OFFSET) == QCOW2_MAGIC &&
+	    (version == 2 || version == 3);
+}
+
+/*
+ * Creates a new header by reading it from source.
+ */
+LDI_ERROR
+qcow2header_new(void *source, struct qcow2header **header)
+{
+	uint8_t *bytes = source;
+
+	/* Unlike VHD and VMDK, all of qcow2 is big endian. */
+	if (be32dec(bytes + MAGIC_OFFSET) != QCOW2_MAGIC) {
+		return ERROR(LDI_ERR_PARSEERROR);
+	}
+
+	*header = malloc(sizeof(struct qcow2header));
+	if (*header == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+
+	(*header)->version = be32dec(bytes + VERSION_OFFSET);
+	(*header)->backing_file_offset = be64dec(bytes + BACKING_FILE_OFFSET_OFFSET);
+	(*header)->backing_file_size = be32dec(bytes + BACKING_FILE_SIZE_OFFSET);
+	(*header)->cluster_bits = be32dec(bytes + CLUSTER_BITS_OFFSET);
+	(*header)->size = be64dec(bytes + SIZE_OFFSET);
+	(*header)->crypt_method = be32dec(bytes + CRYPT_METHOD_OFFSET);
+	(*header)->l1_size = be32dec(bytes + L1_SIZE_OFFSET);
+	(*header)->l1_table_offset = be64dec(bytes + L1_TABLE_OFFSET_OFFSET);
+	(*header)->refcount_table_offset = be64dec(bytes + REFCOUNT_TABLE_OFFSET_OFFSET);
+	(*header)->refcount_table_clusters = be32dec(bytes + REFCOUNT_TABLE_CLUSTERS_OFFSET);
+	(*header)->nb_snapshots = be32dec(bytes + NB_SNAPSHOTS_OFFSET);
+	(*header)->snapshots_offset = be64dec(bytes + SNAPSHOTS_OFFSET_OFFSET);
+
+	if ((*header)->version < 3) {
+		/* Version 2 headers end before the feature fields. */
+		(*header)->incompatible_features = 0;
+		(*header)->compatible_features = 0;
+		(*header)->autoclear_features = 0;
+		(*header)->refcount_order = V2_REFCOUNT_ORDER;
+		(*header)->header_length = QCOW2_HEADER_V2_SIZE;
+		return NO_ERROR;
+	}
+
+	(*header)->incompatible_features = be64dec(bytes + INCOMPATIBLE_FEATURES_OFFSET);
+	(*header)->compatible_features = be64dec(bytes + COMPATIBLE_FEATURES_OFFSET);
+	(*header)->autoclear_features = be64dec(bytes + AUTOCLEAR_FEATURES_OFFSET);
+	(*header)->refcount_order = be32dec(bytes + REFCOUNT_ORDER_OFFSET);
+	(*header)->header_length = be32dec(bytes + HEADER_LENGTH_OFFSET);
+
+	return NO_ERROR;
+}
+
+/*
+ * Writes the header to the destination buffer.
+ */
+size_t
+qcow2header_write(struct qcow2header *header, void *dest)
+{
+	uint8_t *bytes = dest;
+
+	bzero(bytes, QCOW2_HEADER_SIZE);
+
+	be32enc(bytes + MAGIC_OFFSET, QCOW2_MAGIC);
+	be32enc(bytes + VERSION_OFFSET, header->version);
+	be64enc(bytes + BACKING_FILE_OFFSET_OFFSET, header->backing_file_offset);
+	be32enc(bytes + BACKING_FILE_SIZE_OFFSET, header->backing_file_size);
+	be32enc(bytes + CLUSTER_BITS_OFFSET, header->cluster_bits);
+	be64enc(bytes + SIZE_OFFSET, header->size);
+	be32enc(bytes + CRYPT_METHOD_OFFSET, header->crypt_method);
+	be32enc(bytes + L1_SIZE_OFFSET, header->l1_size);
+	be64enc(bytes + L1_TABLE_OFFSET_OFFSET, header->l1_table_offset);
+	be64enc(bytes + REFCOUNT_TABLE_OFFSET_OFFSET, header->refcount_table_offset);
+	be32enc(bytes + REFCOUNT_TABLE_CLUSTERS_OFFSET, header->refcount_table_clusters);
+	be32enc(bytes + NB_SNAPSHOTS_OFFSET, header->nb_snapshots);
+	be64enc(bytes + SNAPSHOTS_OFFSET_OFFSET, header->snapshots_offset);
+
+	if (header->version < 3) {
+		return QCOW2_HEADER_V2_SIZE;
+	}
+
+	be64enc(bytes + INCOMPATIBLE_FEATURES_OFFSET, header->incompatible_features);
+	be64enc(bytes + COMPATIBLE_FEATURES_OFFSET, header->compatible_features);
+	be64enc(bytes + AUTOCLEAR_FEATURES_OFFSET, header->autoclear_features);
+	be32enc(bytes + REFCOUNT_ORDER_OFFSET, header->refcount_order);
+	be32enc(bytes + HEADER_LENGTH_OFFSET, header->header_length);
+
+	/* Longer headers have fields that are left as they are in the file. */
+	return QCOW2_HEADER_SIZE;
+}
+
+/*
+ * Frees memory and zeros the header.
+ */
+void
+qcow2header_destroy(struct qcow2header **header)
+{
+	free(*header);
+	*header = NULL;
+}
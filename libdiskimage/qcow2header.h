@@ -0,0 +1,86 @@
+#ifndef _QCOW2HEADER_H_
+#define _QCOW2HEADER_H_
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "diskimage.h"
+
+/* The magic number of qcow images, "QFI\xfb" in the file. */
+#define QCOW2_MAGIC 0x514649fb
+
+/* The size of the header of version 2 images. */
+#define QCOW2_HEADER_V2_SIZE 72
+
+/*
+ * The size of the part of the header that is parsed. Version 3 headers
+ * are at least this long.
+ */
+#define QCOW2_HEADER_SIZE 104
+
+/* Incompatible feature bits. */
+#define QCOW2_INCOMPAT_DIRTY 0x1
+#define QCOW2_INCOMPAT_CORRUPT 0x2
+#define QCOW2_INCOMPAT_DATA_FILE 0x4
+#define QCOW2_INCOMPAT_COMPRESSION 0x8
+#define QCOW2_INCOMPAT_EXTL2 0x10
+
+/*
+ * The parsed form of the header of a qcow2 image. All offsets are in bytes
+ * from the start of the file. Version 2 headers get the defaults of the
+ * fields that were added in version 3.
+ */
+struct qcow2header {
+	uint32_t version;
+	/* The name of the backing file, if any. */
+	uint64_t backing_file_offset;
+	uint32_t backing_file_size;
+	/* Clusters are 1 << cluster_bits bytes. */
+	uint32_t cluster_bits;
+	/* The number of bytes in the disk. */
+	uint64_t size;
+	uint32_t crypt_method;
+	/* The number of entries in the L1 table and where it is. */
+	uint32_t l1_size;
+	uint64_t l1_table_offset;
+	/* The refcount table and the number of clusters it fills. */
+	uint64_t refcount_table_offset;
+	uint32_t refcount_table_clusters;
+	uint32_t nb_snapshots;
+	uint64_t snapshots_offset;
+	uint64_t incompatible_features;
+	uint64_t compatible_features;
+	uint64_t autoclear_features;
+	/* Refcounts are 1 << refcount_order bits wide. */
+	uint32_t refcount_order;
+	/* The length of the header, up to the header extensions. */
+	uint32_t header_length;
+};
+
+/*
+ * Returns true if source, which must hold 8 bytes, starts the header of a
+ * qcow image of version 2 or 3.
+ */
+bool	qcow2header_magic_valid(void *source);
+
+/*
+ * Creates a new header by reading it from source, which must hold
+ * QCOW2_HEADER_SIZE bytes. Fails if source is not the header of a qcow
+ * image.
+ */
+LDI_ERROR qcow2header_new(void *source, struct qcow2header **header);
+
+/*
+ * Writes the header to the destination buffer, which must hold
+ * QCOW2_HEADER_SIZE bytes. Returns the number of bytes that belong to the
+ * header, which is less than QCOW2_HEADER_SIZE for version 2 headers.
+ */
+size_t	qcow2header_write(struct qcow2header *header, void *dest);
+
+/*
+ * Frees memory and zeros the header.
+ */
+void	qcow2header_destroy(struct qcow2header **header);
+
+#endif					/* _QCOW2HEADER_H_ */
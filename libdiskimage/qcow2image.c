@@ -0,0 +1,1195 @@
+#include <sys/param.h>
+#include <sys/endian.h>
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "blockcache.h"
+#include "diskimage.h"
+#include "fileinterface.h"
+#include "internal.h"
+#include "log.h"
+#include "qcow2header.h"
+#include "qcow2image.h"
+
+#define SECTOR_SIZE 512
+
+/* The cluster sizes that images may have, 512 bytes to 2 MB. */
+#define MIN_CLUSTER_BITS 9
+#define MAX_CLUSTER_BITS 21
+
+/* The largest L1 or refcount table that is read. */
+#define MAX_TABLE_BYTES (32 * 1024 * 1024)
+
+/*
+ * The number of L2 tables that are kept in memory. With the default 64 KB
+ * clusters each table covers 512 MB of the disk, so the cache covers
+ * 32 GB in 4 MB of memory.
+ */
+#define L2_CACHE_SIZE 64
+
+/* The number of inflated compressed clusters that are kept in memory. */
+#define COMPRESSED_CACHE_SIZE 64
+
+/*
+ * The number of clusters the file is extended with at a time, so that
+ * most cluster allocations don't change the size of the file.
+ */
+#define ALLOCATION_BATCH 16
+
+/* The bits of L1 and L2 table entries. */
+#define ENTRY_COPIED (1ULL << 63)
+#define ENTRY_COMPRESSED (1ULL << 62)
+#define ENTRY_ZERO 1ULL
+#define ENTRY_OFFSET_MASK 0x00fffffffffffe00ULL
+
+/* The bits of refcount table entries that hold the offset. */
+#define REFTABLE_OFFSET_MASK 0xfffffffffffffe00ULL
+
+/* The widest refcounts, which are 64 bits. */
+#define MAX_REFCOUNT_ORDER 6
+
+/*
+ * An L2 table or refcount block that has been changed since the last
+ * flush, as it is stored in the file, and the range of its bytes that have
+ * to be written.
+ */
+struct dirty_cluster {
+	uint8_t *data;
+	size_t	first_byte;
+	size_t	end_byte;
+};
+
+/*
+ * The dirty clusters of one kind, by their index in the L1 or refcount
+ * table, and a list of those indexes.
+ */
+struct dirty_set {
+	struct dirty_cluster **clusters;
+	uint64_t *list;
+	uint64_t count;
+	/* The number of indexes there is room for. */
+	uint64_t size;
+};
+
+struct qcow2image {
+	/* The file with the image. */
+	struct file *file;
+	/* The header of the image. */
+	struct qcow2header *header;
+	/* The number of bytes in each cluster. */
+	size_t	cluster_bytes;
+	/* The number of entries in each L2 table, and its log2. */
+	uint64_t l2_entries;
+	uint32_t l2_bits;
+	/* The L1 table, in host byte order. */
+	uint64_t *l1;
+	/* True if the L1 table has to be written. */
+	bool	l1_dirty;
+	/*
+	 * The most recently used L2 tables, by index in the L1 table. Tables
+	 * that are dirty are not in the cache.
+	 */
+	struct blockcache *l2_cache;
+	/* The dirty L2 tables. */
+	struct dirty_set dirty_l2;
+	/* The refcount table, in host byte order, and its number of entries. */
+	uint64_t *reftable;
+	uint64_t reftable_entries;
+	/* The number of refcounts in each refcount block. */
+	uint64_t refblock_entries;
+	/*
+	 * The refcount blocks that have been changed since the last flush.
+	 * Refcounts are only read to be changed, so clean blocks are not
+	 * kept.
+	 */
+	struct dirty_set dirty_refblocks;
+	/* True if the refcount table or the header have to be written. */
+	bool	reftable_dirty;
+	bool	header_dirty;
+	/* The most recently read compressed clusters, inflated. */
+	struct blockcache *compressed_cache;
+	/* The size of the file when it was opened. */
+	size_t	filesize;
+	/*
+	 * The offset where the next cluster is allocated, and the end of the
+	 * space that the file has been extended with.
+	 */
+	uint64_t next_offset;
+	uint64_t end_offset;
+	/* False if the image can only be read. */
+	bool	writable;
+	/* Protects all of the above that can change. */
+	pthread_mutex_t lock;
+	/* Used for logging. */
+	struct logger logger;
+};
+
+static LDI_ERROR set_refcount(struct qcow2image *image, uint64_t offset, uint64_t value);
+
+/*
+ * Checks that the header describes an image that can be read.
+ */
+static LDI_ERROR
+check_header(struct qcow2header *header, struct logger logger)
+{
+	uint64_t cluster_bytes, l2_coverage;
+
+	if (header->version < 2 || header->version > 3) {
+		LOG_ERROR(logger, "Unknown qcow2 version %u.\n", header->version);
+		return ERROR(LDI_ERR_FILENOTSUP);
+	}
+	if (header->cluster_bits < MIN_CLUSTER_BITS ||
+	    header->cluster_bits > MAX_CLUSTER_BITS ||
+	    (header->version >= 3 && header->header_length < QCOW2_HEADER_SIZE) ||
+	    header->refcount_order > MAX_REFCOUNT_ORDER) {
+		LOG_ERROR(logger, "The qcow2 header is invalid.\n");
+		return ERROR(LDI_ERR_PARSEERROR);
+	}
+	if (header->crypt_method != 0) {
+		LOG_ERROR(logger, "Encrypted qcow2 images are not supported.\n");
+		return ERROR(LDI_ERR_FILENOTSUP);
+	}
+	if (header->backing_file_offset != 0) {
+		LOG_ERROR(logger, "qcow2 images with a backing file are not supported.\n");
+		return ERROR(LDI_ERR_FILENOTSUP);
+	}
+	if ((header->incompatible_features & QCOW2_INCOMPAT_CORRUPT) != 0) {
+		LOG_ERROR(logger, "The qcow2 image is marked as corrupt.\n");
+		return ERROR(LDI_ERR_FILENOTSUP);
+	}
+	if ((header->incompatible_features & ~(uint64_t)QCOW2_INCOMPAT_DIRTY) != 0) {
+		LOG_ERROR(logger, "Unsupported qcow2 features 0x%jx.\n",
+		    (uintmax_t)header->incompatible_features);
+		return ERROR(LDI_ERR_FILENOTSUP);
+	}
+
+	cluster_bytes = 1ULL << header->cluster_bits;
+	l2_coverage = cluster_bytes / sizeof(uint64_t) * cluster_bytes;
+	if ((header->l1_table_offset & (cluster_bytes - 1)) != 0 ||
+	    (header->refcount_table_offset & (cluster_bytes - 1)) != 0 ||
+	    header->l1_size < howmany(header->size, l2_coverage)) {
+		LOG_ERROR(logger, "The qcow2 header is invalid.\n");
+		return ERROR(LDI_ERR_PARSEERROR);
+	}
+	if ((uint64_t)header->l1_size * sizeof(uint64_t) > MAX_TABLE_BYTES ||
+	    (uint64_t)header->refcount_table_clusters * cluster_bytes > MAX_TABLE_BYTES) {
+		LOG_ERROR(logger, "The qcow2 tables are too large.\n");
+		return ERROR(LDI_ERR_FILENOTSUP);
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Reads a table of entries 64 bit entries at offset, such as the L1 table.
+ */
+static LDI_ERROR
+read_table(struct qcow2image *image, uint64_t offset, uint64_t entries, uint64_t **table)
+{
+	uint64_t i;
+	LDI_ERROR result;
+
+	/* Allocate at least one entry, so that empty tables are not NULL. */
+	*table = malloc(MAX(entries, 1) * sizeof(uint64_t));
+	if (*table == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+
+	result = file_read(image->file, *table, entries * sizeof(uint64_t),
+	    offset, image->logger);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	for (i = 0; i < entries; i++) {
+		(*table)[i] = be64toh((*table)[i]);
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Writes a table of entries 64 bit entries at offset.
+ */
+static LDI_ERROR
+write_table(struct qcow2image *image, uint64_t offset, uint64_t *table, uint64_t entries)
+{
+	uint64_t *buffer;
+	uint64_t i;
+	LDI_ERROR result;
+
+	buffer = malloc(MAX(entries, 1) * sizeof(uint64_t));
+	if (buffer == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	for (i = 0; i < entries; i++) {
+		buffer[i] = htobe64(table[i]);
+	}
+
+	result = file_write(image->file, buffer, entries * sizeof(uint64_t),
+	    offset, image->logger);
+	free(buffer);
+
+	return result;
+}
+
+/*
+ * Opens the qcow2 image at path.
+ */
+LDI_ERROR
+qcow2image_open(struct fileinterface *fi, char *path, struct qcow2image **image, struct logger logger)
+{
+	char buffer[QCOW2_HEADER_SIZE];
+	struct qcow2header *header;
+	LDI_ERROR result;
+
+	*image = calloc(1, sizeof(struct qcow2image));
+	if (*image == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	(*image)->logger = logger;
+	pthread_mutex_init(&(*image)->lock, NULL);
+
+	result = file_open(fi, path, &(*image)->file);
+	if (!IS_ERROR(result)) {
+		result = file_read((*image)->file, buffer, sizeof(buffer), 0, logger);
+	}
+	if (!IS_ERROR(result)) {
+		result = qcow2header_new(buffer, &(*image)->header);
+		if (IS_ERROR(result)) {
+			LOG_ERROR(logger, "The file is not a qcow2 image.\n");
+		}
+	}
+	if (!IS_ERROR(result)) {
+		result = check_header((*image)->header, logger);
+	}
+	if (IS_ERROR(result)) {
+		qcow2image_destroy(image);
+		return result;
+	}
+
+	header = (*image)->header;
+	(*image)->cluster_bytes = (size_t)1 << header->cluster_bits;
+	(*image)->l2_bits = header->cluster_bits - 3;
+	(*image)->l2_entries = 1ULL << (*image)->l2_bits;
+	(*image)->reftable_entries = (uint64_t)header->refcount_table_clusters *
+	    (*image)->cluster_bytes / sizeof(uint64_t);
+	(*image)->refblock_entries = (uint64_t)(*image)->cluster_bytes * 8 >>
+	    header->refcount_order;
+
+	result = read_table(*image, header->l1_table_offset, header->l1_size,
+	    &(*image)->l1);
+	if (!IS_ERROR(result)) {
+		result = read_table(*image, header->refcount_table_offset,
+		    (*image)->reftable_entries, &(*image)->reftable);
+	}
+	if (!IS_ERROR(result)) {
+		result = file_getsize((*image)->file, &(*image)->filesize);
+	}
+	if (!IS_ERROR(result)) {
+		result = blockcache_create(L2_CACHE_SIZE, &(*image)->l2_cache);
+	}
+	if (!IS_ERROR(result)) {
+		result = blockcache_create(COMPRESSED_CACHE_SIZE, &(*image)->compressed_cache);
+	}
+	if (IS_ERROR(result)) {
+		qcow2image_destroy(image);
+		return result;
+	}
+
+	/*
+	 * Clusters that are shared with snapshots would have to be copied
+	 * before they are written, and the refcounts of an image that was
+	 * not closed cleanly can not be trusted.
+	 */
+	(*image)->writable = header->nb_snapshots == 0 &&
+	    (header->incompatible_features & QCOW2_INCOMPAT_DIRTY) == 0;
+	if (!(*image)->writable) {
+		LOG_WARNING(logger, "The qcow2 image has snapshots or was not closed cleanly, and can only be read.\n");
+	}
+
+	/* New clusters are added at the end of the file. */
+	(*image)->next_offset = roundup((*image)->filesize, (*image)->cluster_bytes);
+	(*image)->end_offset = (*image)->next_offset;
+
+	return NO_ERROR;
+}
+
+/*
+ * Frees the dirty clusters of the set.
+ */
+static void
+free_dirty_set(struct dirty_set *set)
+{
+	uint64_t i;
+
+	for (i = 0; i < set->count; i++) {
+		free(set->clusters[set->list[i]]->data);
+		free(set->clusters[set->list[i]]);
+	}
+	free(set->clusters);
+	free(set->list);
+}
+
+/*
+ * Frees the image and sets the pointer to NULL.
+ */
+void
+qcow2image_destroy(struct qcow2image **image)
+{
+	/* Make sure that all metadata is written before the file is closed. */
+	if ((*image)->dirty_l2.count > 0 || (*image)->dirty_refblocks.count > 0 ||
+	    (*image)->l1_dirty || (*image)->reftable_dirty || (*image)->header_dirty) {
+		qcow2image_flush(*image);
+	}
+	if ((*image)->end_offset > (*image)->next_offset) {
+		/* Give back the space that no cluster was allocated in. */
+		file_setsize((*image)->file, (*image)->next_offset);
+	}
+
+	free_dirty_set(&(*image)->dirty_l2);
+	free_dirty_set(&(*image)->dirty_refblocks);
+	if ((*image)->l2_cache != NULL) {
+		blockcache_destroy(&(*image)->l2_cache);
+	}
+	if ((*image)->compressed_cache != NULL) {
+		blockcache_destroy(&(*image)->compressed_cache);
+	}
+	if ((*image)->header != NULL) {
+		qcow2header_destroy(&(*image)->header);
+	}
+	if ((*image)->file != NULL) {
+		file_close(&(*image)->file);
+	}
+	pthread_mutex_destroy(&(*image)->lock);
+	free((*image)->l1);
+	free((*image)->reftable);
+	free(*image);
+	*image = NULL;
+}
+
+/*
+ * Returns the number of bytes in the disk.
+ */
+uint64_t
+qcow2image_size(struct qcow2image *image)
+{
+	return image->header->size;
+}
+
+/*
+ * Looks up the L2 table entry of the cluster. Reads the L2 table into the
+ * cache if it is not already there. Must be called with the lock held.
+ */
+static LDI_ERROR
+lookup_cluster_locked(struct qcow2image *image, uint64_t cluster, uint64_t *entry)
+{
+	uint8_t *table;
+	uint64_t l1_index, index, l2_offset, raw;
+	LDI_ERROR result;
+
+	l1_index = cluster >> image->l2_bits;
+	index = cluster & (image->l2_entries - 1);
+	if (l1_index >= image->header->l1_size) {
+		return ERROR(LDI_ERR_OUTOFRANGE);
+	}
+
+	/* An L2 table that was never allocated has no clusters. */
+	l2_offset = image->l1[l1_index] & ENTRY_OFFSET_MASK;
+	if (l2_offset == 0) {
+		*entry = 0;
+		return NO_ERROR;
+	}
+
+	if (l1_index < image->dirty_l2.size && image->dirty_l2.clusters[l1_index] != NULL) {
+		*entry = be64dec(image->dirty_l2.clusters[l1_index]->data +
+		    index * sizeof(uint64_t));
+		return NO_ERROR;
+	}
+
+	if (blockcache_get(image->l2_cache, l1_index, &raw, index * sizeof(uint64_t),
+	    sizeof(uint64_t))) {
+		*entry = be64toh(raw);
+		return NO_ERROR;
+	}
+
+	table = malloc(image->cluster_bytes);
+	if (table == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	result = file_read(image->file, table, image->cluster_bytes, l2_offset,
+	    image->logger);
+	if (IS_ERROR(result)) {
+		free(table);
+		return result;
+	}
+	*entry = be64dec(table + index * sizeof(uint64_t));
+
+	/* The cache takes over the table. */
+	blockcache_put(image->l2_cache, l1_index, table, image->cluster_bytes);
+
+	return NO_ERROR;
+}
+
+/*
+ * Looks up the L2 table entry of the cluster.
+ */
+static LDI_ERROR
+lookup_cluster(struct qcow2image *image, uint64_t cluster, uint64_t *entry)
+{
+	LDI_ERROR result;
+
+	pthread_mutex_lock(&image->lock);
+	result = lookup_cluster_locked(image, cluster, entry);
+	pthread_mutex_unlock(&image->lock);
+
+	return result;
+}
+
+/*
+ * Returns true if the L2 table entry is for a cluster that reads as zeros.
+ * Without a backing file, that includes clusters that are not allocated.
+ */
+static bool
+entry_is_zero(struct qcow2image *image, uint64_t entry)
+{
+	if ((entry & ENTRY_COMPRESSED) != 0) {
+		return false;
+	}
+
+	return (entry & ENTRY_OFFSET_MASK) == 0 ||
+	    (image->header->version >= 3 && (entry & ENTRY_ZERO) != 0);
+}
+
+/*
+ * Returns true if a cluster with the entry continues a run of count
+ * clusters that starts with the entry start, so that the whole run can be
+ * read at once. Compressed clusters are always read one at a time.
+ */
+static bool
+continues_run(struct qcow2image *image, uint64_t start, uint64_t count, uint64_t entry)
+{
+	if ((start & ENTRY_COMPRESSED) != 0 || (entry & ENTRY_COMPRESSED) != 0) {
+		return false;
+	}
+	if (entry_is_zero(image, start)) {
+		return entry_is_zero(image, entry);
+	}
+
+	return !entry_is_zero(image, entry) && (entry & ENTRY_OFFSET_MASK) ==
+	    (start & ENTRY_OFFSET_MASK) + count * image->cluster_bytes;
+}
+
+/*
+ * Inflates the compressed cluster in the length bytes at source into
+ * destination, which holds a cluster.
+ */
+static LDI_ERROR
+inflate_cluster(struct qcow2image *image, uint8_t *source, size_t length, uint8_t *destination)
+{
+	z_stream stream;
+	int error;
+
+	bzero(&stream, sizeof(stream));
+	/* Clusters are raw deflate streams, without a zlib header. */
+	if (inflateInit2(&stream, -MAX_WBITS) != Z_OK) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	stream.next_in = source;
+	stream.avail_in = length;
+	stream.next_out = destination;
+	stream.avail_out = image->cluster_bytes;
+	error = inflate(&stream, Z_FINISH);
+	inflateEnd(&stream);
+
+	/* The stream may be followed by padding up to the next sector. */
+	if (stream.avail_out != 0 || (error != Z_STREAM_END && error != Z_BUF_ERROR)) {
+		return ERROR(LDI_ERR_PARSEERROR);
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Reads nbytes at offset in the compressed cluster with the L2 table entry
+ * into the buffer. The most recently inflated clusters are cached by their
+ * offset in the file, which is never written again.
+ */
+static LDI_ERROR
+read_compressed(struct qcow2image *image, uint64_t entry, char *buf, size_t offset, size_t nbytes)
+{
+	uint8_t *compressed, *data;
+	uint64_t shift, start, sectors;
+	size_t length;
+	LDI_ERROR result;
+
+	/* The size field is wider the smaller the clusters are. */
+	shift = 62 - (image->header->cluster_bits - 8);
+	start = entry & ((1ULL << shift) - 1);
+	sectors = ((entry >> shift) & ((1ULL << (image->header->cluster_bits - 8)) - 1)) + 1;
+
+	if (blockcache_get(image->compressed_cache, start, buf, offset, nbytes)) {
+		return NO_ERROR;
+	}
+
+	if (start >= image->filesize) {
+		LOG_ERROR(image->logger, "Compressed cluster at %ju is outside the file.\n",
+		    (uintmax_t)start);
+		return ERROR(LDI_ERR_PARSEERROR);
+	}
+	/* The last compressed cluster may end before its last sector. */
+	length = MIN(sectors * SECTOR_SIZE - start % SECTOR_SIZE,
+	    image->filesize - start);
+
+	compressed = malloc(length);
+	data = malloc(image->cluster_bytes);
+	if (compressed == NULL || data == NULL) {
+		free(compressed);
+		free(data);
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	result = file_read(image->file, compressed, length, start, image->logger);
+	if (!IS_ERROR(result)) {
+		result = inflate_cluster(image, compressed, length, data);
+		if (IS_ERROR(result)) {
+			LOG_ERROR(image->logger, "Failed to inflate the cluster at %ju.\n",
+			    (uintmax_t)start);
+		}
+	}
+	free(compressed);
+	if (IS_ERROR(result)) {
+		free(data);
+		return result;
+	}
+	memcpy(buf, data + offset, nbytes);
+
+	/* The cache takes over the cluster. */
+	blockcache_put(image->compressed_cache, start, data, image->cluster_bytes);
+
+	return NO_ERROR;
+}
+
+/*
+ * Reads nbytes at offset on the disk into the buffer. Clusters that are
+ * next to each other both on the disk and in the file are read with a
+ * single read, and runs of clusters that read as zeros are zeroed at once.
+ */
+LDI_ERROR
+qcow2image_read(struct qcow2image *image, char *buf, size_t nbytes, off_t offset)
+{
+	uint64_t cluster, start, entry;
+	size_t offset_in_cluster, length;
+	LDI_ERROR result;
+
+	cluster = offset / image->cluster_bytes;
+	result = lookup_cluster(image, cluster, &entry);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	while (nbytes > 0) {
+		start = entry;
+		offset_in_cluster = offset % image->cluster_bytes;
+		length = MIN(image->cluster_bytes - offset_in_cluster, nbytes);
+
+		/* Extend the run with as many of the following clusters as possible. */
+		while (length < nbytes) {
+			result = lookup_cluster(image, cluster + 1, &entry);
+			if (IS_ERROR(result)) {
+				return result;
+			}
+			cluster++;
+			if (!continues_run(image, start,
+			    (offset_in_cluster + length) / image->cluster_bytes, entry)) {
+				break;
+			}
+			length += MIN(image->cluster_bytes, nbytes - length);
+		}
+
+		if (entry_is_zero(image, start)) {
+			memset(buf, 0, length);
+		} else if ((start & ENTRY_COMPRESSED) != 0) {
+			result = read_compressed(image, start, buf, offset_in_cluster, length);
+		} else {
+			result = file_read(image->file, buf, length,
+			    (start & ENTRY_OFFSET_MASK) + offset_in_cluster, image->logger);
+		}
+		if (IS_ERROR(result)) {
+			return result;
+		}
+
+		buf += length;
+		offset += length;
+		nbytes -= length;
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Reserves clusters at the end of the file. The file is extended in
+ * batches of several clusters, so that most allocations only move the
+ * tail. The reserved clusters read as zeros.
+ */
+static LDI_ERROR
+reserve(struct qcow2image *image, uint64_t clusters, uint64_t *start)
+{
+	uint64_t batch;
+	LDI_ERROR result;
+
+	if (image->next_offset + clusters * image->cluster_bytes > image->end_offset) {
+		batch = MAX(clusters, ALLOCATION_BATCH) * image->cluster_bytes;
+		result = file_setsize(image->file, image->next_offset + batch);
+		if (IS_ERROR(result)) {
+			return result;
+		}
+		image->end_offset = image->next_offset + batch;
+	}
+
+	*start = image->next_offset;
+	image->next_offset += clusters * image->cluster_bytes;
+
+	return NO_ERROR;
+}
+
+/*
+ * Makes room for index in the set.
+ */
+static LDI_ERROR
+grow_dirty_set(struct dirty_set *set, uint64_t index)
+{
+	struct dirty_cluster **clusters;
+	uint64_t *list;
+	uint64_t size;
+
+	size = MAX(index + 1, set->size * 2);
+	clusters = realloc(set->clusters, size * sizeof(struct dirty_cluster *));
+	if (clusters == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	set->clusters = clusters;
+	list = realloc(set->list, size * sizeof(uint64_t));
+	if (list == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	set->list = list;
+	memset(set->clusters + set->size, 0,
+	    (size - set->size) * sizeof(struct dirty_cluster *));
+	set->size = size;
+
+	return NO_ERROR;
+}
+
+/*
+ * Adds the cluster at offset to the set under index, taking it out of the
+ * cache, if any, or reading it if needed. Clusters at offset 0 are new and
+ * start out as zeros. Must be called with the lock held.
+ */
+static LDI_ERROR
+get_dirty_cluster(struct qcow2image *image, struct dirty_set *set, uint64_t index, uint64_t offset, struct blockcache *cache, struct dirty_cluster **dirty)
+{
+	struct dirty_cluster *new;
+	LDI_ERROR result;
+
+	if (index >= set->size) {
+		result = grow_dirty_set(set, index);
+		if (IS_ERROR(result)) {
+			return result;
+		}
+	}
+	if (set->clusters[index] != NULL) {
+		*dirty = set->clusters[index];
+		return NO_ERROR;
+	}
+
+	new = calloc(1, sizeof(struct dirty_cluster));
+	if (new == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	new->data = calloc(1, image->cluster_bytes);
+	if (new->data == NULL) {
+		free(new);
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	new->first_byte = image->cluster_bytes;
+
+	if (offset != 0 && (cache == NULL ||
+	    !blockcache_get(cache, index, new->data, 0, image->cluster_bytes))) {
+		result = file_read(image->file, new->data, image->cluster_bytes,
+		    offset, image->logger);
+		if (IS_ERROR(result)) {
+			free(new->data);
+			free(new);
+			return result;
+		}
+	}
+	/* The dirty copy is the only one until it has been written. */
+	if (cache != NULL) {
+		blockcache_remove(cache, index);
+	}
+
+	set->clusters[index] = new;
+	set->list[set->count++] = index;
+	*dirty = new;
+
+	return NO_ERROR;
+}
+
+/*
+ * Marks nbytes at offset in the dirty cluster as changed.
+ */
+static void
+mark_dirty(struct dirty_cluster *dirty, size_t offset, size_t nbytes)
+{
+	dirty->first_byte = MIN(dirty->first_byte, offset);
+	dirty->end_byte = MAX(dirty->end_byte, offset + nbytes);
+}
+
+/*
+ * Moves the refcount table to a larger one at the end of the file with room
+ * for at least entries entries. The old table is left allocated, since it
+ * is used until the header that points at the new one has been written.
+ * Must be called with the lock held.
+ */
+static LDI_ERROR
+grow_reftable(struct qcow2image *image, uint64_t entries)
+{
+	uint64_t *reftable;
+	uint64_t clusters, per_cluster, start, i;
+	LDI_ERROR result;
+
+	per_cluster = image->cluster_bytes / sizeof(uint64_t);
+	clusters = MAX(image->header->refcount_table_clusters * 2,
+	    howmany(entries, per_cluster));
+	if (clusters * image->cluster_bytes > MAX_TABLE_BYTES) {
+		LOG_ERROR(image->logger, "The qcow2 image is full.\n");
+		return ERROR(LDI_ERR_IO);
+	}
+
+	reftable = realloc(image->reftable, clusters * image->cluster_bytes);
+	if (reftable == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	image->reftable = reftable;
+	memset(reftable + image->reftable_entries, 0,
+	    (clusters * per_cluster - image->reftable_entries) * sizeof(uint64_t));
+
+	result = reserve(image, clusters, &start);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+	image->reftable_entries = clusters * per_cluster;
+	image->header->refcount_table_offset = start;
+	image->header->refcount_table_clusters = clusters;
+	image->reftable_dirty = true;
+	image->header_dirty = true;
+
+	/* The new table is large enough to count its own clusters. */
+	for (i = 0; i < clusters; i++) {
+		result = set_refcount(image, start + i * image->cluster_bytes, 1);
+		if (IS_ERROR(result)) {
+			return result;
+		}
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Allocates the refcount block with the index in the refcount table. The
+ * new block is written in full by the next flush. Must be called with the
+ * lock held.
+ */
+static LDI_ERROR
+allocate_refblock(struct qcow2image *image, uint64_t index)
+{
+	struct dirty_cluster *dirty;
+	uint64_t start;
+	LDI_ERROR result;
+
+	result = get_dirty_cluster(image, &image->dirty_refblocks, index, 0, NULL, &dirty);
+	if (!IS_ERROR(result)) {
+		result = reserve(image, 1, &start);
+	}
+	if (IS_ERROR(result)) {
+		return result;
+	}
+	image->reftable[index] = start;
+	image->reftable_dirty = true;
+	mark_dirty(dirty, 0, image->cluster_bytes);
+
+	/* The block may be the first one that counts itself. */
+	return set_refcount(image, start, 1);
+}
+
+/*
+ * Sets the refcount of the cluster at offset to value, allocating the
+ * refcount block and growing the refcount table as needed. Must be called
+ * with the lock held.
+ */
+static LDI_ERROR
+set_refcount(struct qcow2image *image, uint64_t offset, uint64_t value)
+{
+	struct dirty_cluster *dirty;
+	uint64_t cluster, table_index, index;
+	size_t bits, byte, shift;
+	uint8_t mask;
+	LDI_ERROR result;
+
+	cluster = offset / image->cluster_bytes;
+	table_index = cluster / image->refblock_entries;
+	index = cluster % image->refblock_entries;
+
+	result = NO_ERROR;
+	if (table_index >= image->reftable_entries) {
+		result = grow_reftable(image, table_index + 1);
+	}
+	if (!IS_ERROR(result) && (image->reftable[table_index] & REFTABLE_OFFSET_MASK) == 0) {
+		result = allocate_refblock(image, table_index);
+	}
+	if (!IS_ERROR(result)) {
+		result = get_dirty_cluster(image, &image->dirty_refblocks, table_index,
+		    image->reftable[table_index] & REFTABLE_OFFSET_MASK, NULL, &dirty);
+	}
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	/* Refcounts narrower than a byte start at its least significant bit. */
+	bits = (size_t)1 << image->header->refcount_order;
+	if (bits < 8) {
+		byte = index * bits / 8;
+		shift = index * bits % 8;
+		mask = ((1 << bits) - 1) << shift;
+		dirty->data[byte] = (dirty->data[byte] & ~mask) | ((value << shift) & mask);
+		mark_dirty(dirty, byte, 1);
+		return NO_ERROR;
+	}
+
+	byte = index * (bits / 8);
+	switch (bits) {
+	case 8:
+		dirty->data[byte] = value;
+		break;
+	case 16:
+		be16enc(dirty->data + byte, value);
+		break;
+	case 32:
+		be32enc(dirty->data + byte, value);
+		break;
+	default:
+		be64enc(dirty->data + byte, value);
+	}
+	mark_dirty(dirty, byte, bits / 8);
+
+	return NO_ERROR;
+}
+
+/*
+ * Allocates a cluster at the end of the file and counts it. Must be called
+ * with the lock held.
+ */
+static LDI_ERROR
+allocate(struct qcow2image *image, uint64_t *start)
+{
+	LDI_ERROR result;
+
+	result = reserve(image, 1, start);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	return set_refcount(image, *start, 1);
+}
+
+/*
+ * Gives the L2 table with the index in the L1 table a cluster of its own,
+ * with a copy of the old table if there is one. The new table is written
+ * in full by the next flush. Must be called with the lock held.
+ */
+static LDI_ERROR
+allocate_table(struct qcow2image *image, uint64_t l1_index)
+{
+	struct dirty_cluster *dirty;
+	uint64_t start;
+	LDI_ERROR result;
+
+	result = get_dirty_cluster(image, &image->dirty_l2, l1_index,
+	    image->l1[l1_index] & ENTRY_OFFSET_MASK, image->l2_cache, &dirty);
+	if (!IS_ERROR(result)) {
+		result = allocate(image, &start);
+	}
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	image->l1[l1_index] = start | ENTRY_COPIED;
+	image->l1_dirty = true;
+	mark_dirty(dirty, 0, image->cluster_bytes);
+
+	return NO_ERROR;
+}
+
+/*
+ * Allocates a cluster at the end of the file for the cluster on the disk
+ * and points its L2 table entry at it. The cluster it replaces, if any,
+ * is left allocated. Must be called with the lock held.
+ */
+static LDI_ERROR
+allocate_cluster(struct qcow2image *image, uint64_t cluster, uint64_t *start)
+{
+	struct dirty_cluster *dirty;
+	uint64_t l1_index, index;
+	LDI_ERROR result;
+
+	l1_index = cluster >> image->l2_bits;
+	index = cluster & (image->l2_entries - 1);
+
+	/* Tables that are shared or not allocated get a cluster of their own. */
+	result = NO_ERROR;
+	if ((image->l1[l1_index] & ENTRY_COPIED) == 0) {
+		result = allocate_table(image, l1_index);
+	}
+	if (!IS_ERROR(result)) {
+		result = get_dirty_cluster(image, &image->dirty_l2, l1_index,
+		    image->l1[l1_index] & ENTRY_OFFSET_MASK, image->l2_cache, &dirty);
+	}
+	if (!IS_ERROR(result)) {
+		result = allocate(image, start);
+	}
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	be64enc(dirty->data + index * sizeof(uint64_t), *start | ENTRY_COPIED);
+	mark_dirty(dirty, index * sizeof(uint64_t), sizeof(uint64_t));
+
+	return NO_ERROR;
+}
+
+/*
+ * Writes nbytes from the buffer at offset in a cluster on the disk whose
+ * L2 table entry is entry. Clusters that are not allocated, read as
+ * zeros, are compressed or are shared get a new cluster. For partial
+ * writes the rest of the new cluster is copied from the old one, unless
+ * it reads as zeros. Must be called with the lock held.
+ */
+static LDI_ERROR
+write_cluster(struct qcow2image *image, uint64_t cluster, uint64_t entry, char *buf, size_t offset, size_t nbytes)
+{
+	char *data;
+	uint64_t start;
+	LDI_ERROR result;
+
+	if ((entry & (ENTRY_COPIED | ENTRY_COMPRESSED)) == ENTRY_COPIED &&
+	    !entry_is_zero(image, entry)) {
+		return file_write(image->file, buf, nbytes,
+		    (entry & ENTRY_OFFSET_MASK) + offset, image->logger);
+	}
+
+	if (nbytes == image->cluster_bytes || entry_is_zero(image, entry)) {
+		/* New clusters read as zeros. */
+		result = allocate_cluster(image, cluster, &start);
+		if (IS_ERROR(result)) {
+			return result;
+		}
+		return file_write(image->file, buf, nbytes, start + offset,
+		    image->logger);
+	}
+
+	data = malloc(image->cluster_bytes);
+	if (data == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	if ((entry & ENTRY_COMPRESSED) != 0) {
+		result = read_compressed(image, entry, data, 0, image->cluster_bytes);
+	} else {
+		result = file_read(image->file, data, image->cluster_bytes,
+		    entry & ENTRY_OFFSET_MASK, image->logger);
+	}
+	if (!IS_ERROR(result)) {
+		result = allocate_cluster(image, cluster, &start);
+	}
+	if (!IS_ERROR(result)) {
+		memcpy(data + offset, buf, nbytes);
+		result = file_write(image->file, data, image->cluster_bytes, start,
+		    image->logger);
+	}
+	free(data);
+
+	return result;
+}
+
+/*
+ * Writes nbytes from the buffer at offset on the disk. The L2 and refcount
+ * tables are only written by a flush.
+ */
+LDI_ERROR
+qcow2image_write(struct qcow2image *image, char *buf, size_t nbytes, off_t offset)
+{
+	uint64_t cluster, entry;
+	size_t offset_in_cluster, length;
+	LDI_ERROR result;
+
+	if (!image->writable) {
+		return ERROR(LDI_ERR_FILENOTSUP);
+	}
+
+	pthread_mutex_lock(&image->lock);
+	if (image->header->autoclear_features != 0) {
+		/* Features that are not known are dropped by the first write. */
+		image->header->autoclear_features = 0;
+		image->header_dirty = true;
+	}
+	while (nbytes > 0) {
+		cluster = offset / image->cluster_bytes;
+		offset_in_cluster = offset % image->cluster_bytes;
+		length = MIN(image->cluster_bytes - offset_in_cluster, nbytes);
+
+		result = lookup_cluster_locked(image, cluster, &entry);
+		if (!IS_ERROR(result)) {
+			result = write_cluster(image, cluster, entry, buf,
+			    offset_in_cluster, length);
+		}
+		if (IS_ERROR(result)) {
+			pthread_mutex_unlock(&image->lock);
+			return result;
+		}
+
+		buf += length;
+		offset += length;
+		nbytes -= length;
+	}
+	pthread_mutex_unlock(&image->lock);
+
+	return NO_ERROR;
+}
+
+/*
+ * Writes the changed sectors of the dirty clusters in the set. The offset
+ * of each cluster is in table, under the same index.
+ */
+static LDI_ERROR
+write_dirty_set(struct qcow2image *image, struct dirty_set *set, uint64_t *table, uint64_t mask)
+{
+	struct dirty_cluster *dirty;
+	size_t start, end;
+	uint64_t i;
+	LDI_ERROR result;
+
+	for (i = 0; i < set->count; i++) {
+		dirty = set->clusters[set->list[i]];
+		if (dirty->first_byte >= dirty->end_byte ||
+		    (table[set->list[i]] & mask) == 0) {
+			/* Nothing was changed, or no cluster could be allocated. */
+			continue;
+		}
+
+		start = rounddown(dirty->first_byte, SECTOR_SIZE);
+		end = MIN(roundup(dirty->end_byte, SECTOR_SIZE), image->cluster_bytes);
+		result = file_write(image->file, dirty->data + start, end - start,
+		    (table[set->list[i]] & mask) + start, image->logger);
+		if (IS_ERROR(result)) {
+			return result;
+		}
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Empties the set after it has been written. The clusters are added to the
+ * cache, if any, and freed otherwise.
+ */
+static void
+clean_dirty_set(struct qcow2image *image, struct dirty_set *set, struct blockcache *cache)
+{
+	struct dirty_cluster *dirty;
+	uint64_t i;
+
+	for (i = 0; i < set->count; i++) {
+		dirty = set->clusters[set->list[i]];
+		if (cache != NULL) {
+			blockcache_put(cache, set->list[i], dirty->data, image->cluster_bytes);
+		} else {
+			free(dirty->data);
+		}
+		free(dirty);
+		set->clusters[set->list[i]] = NULL;
+	}
+	set->count = 0;
+}
+
+/*
+ * Writes the refcounts and tables that have changed. Each step is made
+ * durable before the next one: the data clusters, the refcount blocks,
+ * the refcount table, the header, the L2 tables and the L1 table. A crash
+ * at any point can then leak clusters, but never leaves an entry that
+ * points at data that was not written or at a cluster that is not
+ * counted.
+ */
+LDI_ERROR
+qcow2image_flush(struct qcow2image *image)
+{
+	char buffer[QCOW2_HEADER_SIZE];
+	size_t length;
+	LDI_ERROR result;
+
+	pthread_mutex_lock(&image->lock);
+	result = file_sync(image->file);
+
+	if (!IS_ERROR(result) && image->dirty_refblocks.count > 0) {
+		result = write_dirty_set(image, &image->dirty_refblocks,
+		    image->reftable, REFTABLE_OFFSET_MASK);
+		if (!IS_ERROR(result)) {
+			result = file_sync(image->file);
+		}
+	}
+	if (!IS_ERROR(result) && image->reftable_dirty) {
+		result = write_table(image, image->header->refcount_table_offset,
+		    image->reftable, image->reftable_entries);
+		if (!IS_ERROR(result)) {
+			result = file_sync(image->file);
+		}
+	}
+	if (!IS_ERROR(result) && image->header_dirty) {
+		length = qcow2header_write(image->header, buffer);
+		result = file_write(image->file, buffer, length, 0, image->logger);
+		if (!IS_ERROR(result)) {
+			result = file_sync(image->file);
+		}
+	}
+	if (!IS_ERROR(result) && image->dirty_l2.count > 0) {
+		result = write_dirty_set(image, &image->dirty_l2, image->l1,
+		    ENTRY_OFFSET_MASK);
+		if (!IS_ERROR(result)) {
+			result = file_sync(image->file);
+		}
+	}
+	if (!IS_ERROR(result) && image->l1_dirty) {
+		result = write_table(image, image->header->l1_table_offset,
+		    image->l1, image->header->l1_size);
+		if (!IS_ERROR(result)) {
+			result = file_sync(image->file);
+		}
+	}
+	if (IS_ERROR(result)) {
+		/* Everything stays dirty so that the next flush tries again. */
+		pthread_mutex_unlock(&image->lock);
+		return result;
+	}
+
+	/* The written L2 tables are clean and can be cached again. */
+	clean_dirty_set(image, &image->dirty_l2, image->l2_cache);
+	clean_dirty_set(image, &image->dirty_refblocks, NULL);
+	image->l1_dirty = false;
+	image->reftable_dirty = false;
+	image->header_dirty = false;
+	pthread_mutex_unlock(&image->lock);
+
+	return NO_ERROR;
+}
@@ -0,0 +1,56 @@
+#ifndef _QCOW2IMAGE_H_
+#define _QCOW2IMAGE_H_
+
+#include <sys/types.h>
+
+#include "diskimage.h"
+#include "fileinterface.h"
+
+/*
+ * A qcow2 image. The L1 and refcount tables are read when the image is
+ * opened, and the L2 tables are read when they are first needed and kept
+ * in a bounded cache.
+ */
+struct qcow2image;
+
+/*
+ * Opens the qcow2 image at path. Fails with LDI_ERR_FILENOTSUP for
+ * encrypted images, images with a backing file and images that use
+ * incompatible features that are not supported. Images with snapshots
+ * and images that were not closed cleanly are opened, but can not be
+ * written.
+ */
+LDI_ERROR qcow2image_open(struct fileinterface *fi, char *path, struct qcow2image **image, struct logger logger);
+
+/*
+ * Flushes the image, closes its file, frees it and sets the pointer to
+ * NULL.
+ */
+void	qcow2image_destroy(struct qcow2image **image);
+
+/*
+ * Returns the number of bytes in the disk.
+ */
+uint64_t qcow2image_size(struct qcow2image *image);
+
+/*
+ * Reads nbytes at offset on the disk into the buffer. Clusters that are
+ * not allocated read as zeros.
+ */
+LDI_ERROR qcow2image_read(struct qcow2image *image, char *buf, size_t nbytes, off_t offset);
+
+/*
+ * Writes nbytes from the buffer at offset on the disk. Unallocated and
+ * compressed clusters get a new cluster at the end of the file, which is
+ * extended several clusters at a time. The L2 and refcount tables are not
+ * written until the image is flushed.
+ */
+LDI_ERROR qcow2image_write(struct qcow2image *image, char *buf, size_t nbytes, off_t offset);
+
+/*
+ * Makes the written clusters durable and then writes the refcounts and
+ * tables that point at them.
+ */
+LDI_ERROR qcow2image_flush(struct qcow2image *image);
+
+#endif					/* _QCOW2IMAGE_H_ */
@@ -0,0 +1,96 @@
+
+#include <stdlib.h>
+
+#include "diskimage.h"
+#include "fileinterface.h"
+#include "internal.h"
+#include "parser.h"
+#include "qcow2header.h"
+#include "qcow2image.h"
+
+void	qcow2parser_destroy(void **parser);
+
+/*
+ * Creates the parser state, which is the image itself.
+ */
+LDI_ERROR
+qcow2parser_new(struct fileinterface *fi, char *path, struct diskimage_options options, void **parser, struct logger logger)
+{
+	return qcow2image_open(fi, path, (struct qcow2image **)parser, logger);
+}
+
+/*
+ * Deallocates the parser state and sets the pointer to NULL.
+ */
+void
+qcow2parser_destroy(void **parser)
+{
+	qcow2image_destroy((struct qcow2image **)parser);
+}
+
+/*
+ * Returns a diskinfo struct with properties for the disk.
+ */
+struct diskinfo
+qcow2parser_diskinfo(void *parser)
+{
+	struct diskinfo result;
+
+	result.disksize = qcow2image_size(parser);
+
+	return result;
+}
+
+/*
+ * Reads nbytes at offset into the buffer.
+ */
+LDI_ERROR
+qcow2parser_read(void *parser, char *buf, size_t nbytes, off_t offset)
+{
+	return qcow2image_read(parser, buf, nbytes, offset);
+}
+
+/*
+ * Writes nbytes from the buffer into the diskimage at the specified offset.
+ */
+LDI_ERROR
+qcow2parser_write(void *parser, char *buf, size_t nbytes, off_t offset)
+{
+	return qcow2image_write(parser, buf, nbytes, offset);
+}
+
+/*
+ * Makes all data written to the diskimage durable.
+ */
+LDI_ERROR
+qcow2parser_flush(void *parser)
+{
+	return qcow2image_flush(parser);
+}
+
+/*
+ * Returns true if the file starts a qcow image.
+ */
+bool
+qcow2parser_probe(void *head, void *tail)
+{
+	return qcow2header_magic_valid(head);
+}
+
+/*
+ * Define an ldi_parser struct for the qcow2 parser and define the parser
+ * using the PARSER_DEFINE macro. This will make the parser discoverable
+ * in diskimage.c.
+ */
+static struct ldi_parser qcow2parser_format = {
+	.name = "qcow2",
+	.probe = qcow2parser_probe,
+	.construct = qcow2parser_new,
+	.destructor = qcow2parser_destroy,
+	.diskinfo = qcow2parser_diskinfo,
+	.read = qcow2parser_read,
+	.write = qcow2parser_write,
+	.flush = qcow2parser_flush
+};
+
+PARSER_DEFINE(qcow2parser_format);
@@ -0,0 +1,288 @@
+#include <sys/param.h>
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "diskimage.h"
+#include "fileinterface.h"
+#include "filemap.h"
+#include "internal.h"
+#include "log.h"
+#include "rawimage.h"
+
+struct rawimage {
+	/* The file with the image. */
+	struct file *file;
+	/* The number of bytes in the disk and in the file. */
+	uint64_t size;
+	/*
+	 * The whole file, mapped when the image is opened, or NULL if the
+	 * file is read and written with file_read and file_write.
+	 */
+	struct filemap *map;
+	/* The cache mode the image was opened with. */
+	enum diskimage_cache_mode cache_mode;
+	/*
+	 * The last run of data that was found in the file. Writes never turn
+	 * data into a hole, so only discards change it.
+	 */
+	off_t	data_start;
+	off_t	data_end;
+	/* Counts the discards, which make runs found before them stale. */
+	uint64_t discards;
+	/*
+	 * False while data written through the mapping may be in what the
+	 * file system still reports as a hole. File systems only see such
+	 * data once it has been synced.
+	 */
+	bool	holes_valid;
+	/* Protects all of the above that can change. */
+	pthread_mutex_t lock;
+	/* Used for logging. */
+	struct logger logger;
+};
+
+/*
+ * Opens the raw image at path.
+ */
+LDI_ERROR
+rawimage_open(struct fileinterface *fi, char *path, struct diskimage_options options, struct rawimage **image, struct logger logger)
+{
+	size_t size;
+	LDI_ERROR result;
+
+	*image = calloc(1, sizeof(struct rawimage));
+	if (*image == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	(*image)->logger = logger;
+	(*image)->cache_mode = options.cache_mode;
+	(*image)->holes_valid = true;
+	pthread_mutex_init(&(*image)->lock, NULL);
+
+	result = file_open(fi, path, &(*image)->file);
+	if (!IS_ERROR(result)) {
+		result = file_getsize((*image)->file, &size);
+	}
+	if (IS_ERROR(result)) {
+		rawimage_destroy(image);
+		return result;
+	}
+	(*image)->size = size;
+
+	/*
+	 * With the whole file mapped, requests are only copies. Direct I/O
+	 * must not go through the page cache, and empty files can't be
+	 * mapped.
+	 */
+	if (options.cache_mode != LDI_CACHE_NONE && size > 0) {
+		result = file_getmap((*image)->file, 0, size, &(*image)->map, logger);
+		if (IS_ERROR(result)) {
+			LOG_WARNING(logger, "Failed to map the raw image, using file_read.\n");
+			(*image)->map = NULL;
+		}
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Frees the image and sets the pointer to NULL.
+ */
+void
+rawimage_destroy(struct rawimage **image)
+{
+	if ((*image)->map != NULL) {
+		filemap_destroy(&(*image)->map);
+	}
+	if ((*image)->file != NULL) {
+		file_close(&(*image)->file);
+	}
+	pthread_mutex_destroy(&(*image)->lock);
+	free(*image);
+	*image = NULL;
+}
+
+/*
+ * Returns the number of bytes in the disk.
+ */
+uint64_t
+rawimage_size(struct rawimage *image)
+{
+	return image->size;
+}
+
+/*
+ * Finds out if offset is in data or in a hole, and where that ends. The
+ * last run of data is remembered, so that files without holes are only
+ * asked once. Holes that may have been written are reported as data.
+ */
+static LDI_ERROR
+find_extent(struct rawimage *image, off_t offset, bool *data, off_t *end)
+{
+	uint64_t discards;
+	bool	holes_valid;
+	LDI_ERROR result;
+
+	pthread_mutex_lock(&image->lock);
+	if (offset >= image->data_start && offset < image->data_end) {
+		*data = true;
+		*end = image->data_end;
+		pthread_mutex_unlock(&image->lock);
+		return NO_ERROR;
+	}
+	holes_valid = image->holes_valid;
+	discards = image->discards;
+	pthread_mutex_unlock(&image->lock);
+
+	result = file_getextent(image->file, offset, data, end);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+	if (*end <= offset) {
+		/* The file is shorter than it was when it was opened. */
+		*end = image->size;
+	}
+
+	if (!*data) {
+		*data = !holes_valid;
+		return NO_ERROR;
+	}
+	pthread_mutex_lock(&image->lock);
+	if (image->discards == discards) {
+		image->data_start = offset;
+		image->data_end = *end;
+	}
+	pthread_mutex_unlock(&image->lock);
+
+	return NO_ERROR;
+}
+
+/*
+ * Reads nbytes at offset on the disk into the buffer. Holes in the file
+ * are zeroed without reading them.
+ */
+LDI_ERROR
+rawimage_read(struct rawimage *image, char *buf, size_t nbytes, off_t offset)
+{
+	size_t	length;
+	off_t	end;
+	bool	data;
+	LDI_ERROR result;
+
+	while (nbytes > 0) {
+		result = find_extent(image, offset, &data, &end);
+		if (IS_ERROR(result)) {
+			return result;
+		}
+		length = MIN((uint64_t)(end - offset), nbytes);
+
+		if (!data) {
+			memset(buf, 0, length);
+		} else if (image->map != NULL) {
+			memcpy(buf, image->map->pointer + offset, length);
+		} else {
+			result = file_read(image->file, buf, length, offset, image->logger);
+			if (IS_ERROR(result)) {
+				return result;
+			}
+		}
+
+		buf += length;
+		offset += length;
+		nbytes -= length;
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Writes nbytes from the buffer at offset on the disk.
+ */
+LDI_ERROR
+rawimage_write(struct rawimage *image, char *buf, size_t nbytes, off_t offset)
+{
+	/* Only direct I/O doesn't write through a mapping. */
+	if (image->cache_mode != LDI_CACHE_NONE) {
+		pthread_mutex_lock(&image->lock);
+		if (offset < image->data_start || offset + (off_t)nbytes > image->data_end) {
+			image->holes_valid = false;
+		}
+		pthread_mutex_unlock(&image->lock);
+	}
+
+	if (image->map == NULL) {
+		return file_write(image->file, buf, nbytes, offset, image->logger);
+	}
+	memcpy(image->map->pointer + offset, buf, nbytes);
+
+	return NO_ERROR;
+}
+
+/*
+ * Makes all data written to the image durable.
+ */
+LDI_ERROR
+rawimage_flush(struct rawimage *image)
+{
+	LDI_ERROR result;
+
+	result = file_sync(image->file);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	/* Synced data is no longer in a hole, unless the file is never synced. */
+	if (image->cache_mode != LDI_CACHE_UNSAFE) {
+		pthread_mutex_lock(&image->lock);
+		image->holes_valid = true;
+		pthread_mutex_unlock(&image->lock);
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Punches a hole for nbytes at offset on the disk.
+ */
+LDI_ERROR
+rawimage_discard(struct rawimage *image, size_t nbytes, off_t offset)
+{
+	LDI_ERROR result;
+
+	result = file_deallocate(image->file, offset, nbytes);
+
+	pthread_mutex_lock(&image->lock);
+	image->discards++;
+	if (offset < image->data_end && offset + (off_t)nbytes > image->data_start) {
+		image->data_start = 0;
+		image->data_end = 0;
+	}
+	pthread_mutex_unlock(&image->lock);
+	if (IS_ERROR(result)) {
+		LOG_ERROR(image->logger, "Failed to discard %zu bytes at %jd.\n", nbytes,
+		    (intmax_t)offset);
+	}
+
+	return result;
+}
+
+/*
+ * Finds out if the data at offset is in a hole of the file.
+ */
+LDI_ERROR
+rawimage_map(struct rawimage *image, size_t nbytes, off_t offset, bool *allocated, size_t *length)
+{
+	off_t	end;
+	LDI_ERROR result;
+
+	result = find_extent(image, offset, allocated, &end);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+	*length = MIN((uint64_t)(end - offset), nbytes);
+
+	return NO_ERROR;
+}
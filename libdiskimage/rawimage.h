@@ -0,0 +1,58 @@
+#ifndef _RAWIMAGE_H_
+#define _RAWIMAGE_H_
+
+#include <sys/types.h>
+
+#include "diskimage.h"
+#include "fileinterface.h"
+
+/*
+ * A raw image, where the disk is the file as it is. Holes in the file are
+ * read as zeros without touching the file.
+ */
+struct rawimage;
+
+/*
+ * Opens the raw image at path. Unless the options ask for direct I/O, the
+ * whole file is mapped, so that requests are served from the mapping.
+ */
+LDI_ERROR rawimage_open(struct fileinterface *fi, char *path, struct diskimage_options options, struct rawimage **image, struct logger logger);
+
+/*
+ * Closes the file of the image, frees it and sets the pointer to NULL.
+ */
+void	rawimage_destroy(struct rawimage **image);
+
+/*
+ * Returns the number of bytes in the disk, which is the size of the file.
+ */
+uint64_t rawimage_size(struct rawimage *image);
+
+/*
+ * Reads nbytes at offset on the disk into the buffer.
+ */
+LDI_ERROR rawimage_read(struct rawimage *image, char *buf, size_t nbytes, off_t offset);
+
+/*
+ * Writes nbytes from the buffer at offset on the disk.
+ */
+LDI_ERROR rawimage_write(struct rawimage *image, char *buf, size_t nbytes, off_t offset);
+
+/*
+ * Makes all data written to the image durable.
+ */
+LDI_ERROR rawimage_flush(struct rawimage *image);
+
+/*
+ * Frees the storage of nbytes at offset on the disk by punching a hole in
+ * the file. The range reads as zeros afterwards.
+ */
+LDI_ERROR rawimage_discard(struct rawimage *image, size_t nbytes, off_t offset);
+
+/*
+ * Finds out if the data at offset is in a hole of the file, and sets
+ * length to the number of bytes, up to nbytes, that are the same.
+ */
+LDI_ERROR rawimage_map(struct rawimage *image, size_t nbytes, off_t offset, bool *allocated, size_t *length);
+
+#endif					/* _RAWIMAGE_H_ */
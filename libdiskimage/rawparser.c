@@ -0,0 +1,105 @@
+
+#include <stdlib.h>
+
+#include "diskimage.h"
+#include "fileinterface.h"
+#include "internal.h"
+#include "parser.h"
+#include "rawimage.h"
+
+void	rawparser_destroy(void **parser);
+
+/*
+ * Creates the parser state, which is the image itself.
+ */
+LDI_ERROR
+rawparser_new(struct fileinterface *fi, char *path, struct diskimage_options options, void **parser, struct logger logger)
+{
+	return rawimage_open(fi, path, options, (struct rawimage **)parser, logger);
+}
+
+/*
+ * Deallocates the parser state and sets the pointer to NULL.
+ */
+void
+rawparser_destroy(void **parser)
+{
+	rawimage_destroy((struct rawimage **)parser);
+}
+
+/*
+ * Returns a diskinfo struct with properties for the disk.
+ */
+struct diskinfo
+rawparser_diskinfo(void *parser)
+{
+	struct diskinfo result;
+
+	result.disksize = rawimage_size(parser);
+
+	return result;
+}
+
+/*
+ * Reads nbytes at offset into the buffer.
+ */
+LDI_ERROR
+rawparser_read(void *parser, char *buf, size_t nbytes, off_t offset)
+{
+	return rawimage_read(parser, buf, nbytes, offset);
+}
+
+/*
+ * Writes nbytes from the buffer into the diskimage at the specified offset.
+ */
+LDI_ERROR
+rawparser_write(void *parser, char *buf, size_t nbytes, off_t offset)
+{
+	return rawimage_write(parser, buf, nbytes, offset);
+}
+
+/*
+ * Makes all data written to the diskimage durable.
+ */
+LDI_ERROR
+rawparser_flush(void *parser)
+{
+	return rawimage_flush(parser);
+}
+
+/*
+ * Frees the storage of nbytes at offset in the diskimage.
+ */
+LDI_ERROR
+rawparser_discard(void *parser, size_t nbytes, off_t offset)
+{
+	return rawimage_discard(parser, nbytes, offset);
+}
+
+/*
+ * Finds out if nbytes at offset in the diskimage are allocated.
+ */
+LDI_ERROR
+rawparser_map(void *parser, size_t nbytes, off_t offset, bool *allocated, size_t *length)
+{
+	return rawimage_map(parser, nbytes, offset, allocated, length);
+}
+
+/*
+ * Define an ldi_parser struct for the raw parser and define the parser
+ * using the PARSER_DEFINE macro. This will make the parser discoverable
+ * in diskimage.c.
+ */
+static struct ldi_parser rawparser_format = {
+	.name = "raw",
+	.construct = rawparser_new,
+	.destructor = rawparser_destroy,
+	.diskinfo = rawparser_diskinfo,
+	.read = rawparser_read,
+	.write = rawparser_write,
+	.flush = rawparser_flush,
+	.discard = rawparser_discard,
+	.map = rawparser_map
+};
+
+PARSER_DEFINE(rawparser_format);
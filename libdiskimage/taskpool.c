@@ -0,0 +1,189 @@
+#include <sys/types.h>
+#include <sys/param.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "internal.h"
+#include "taskpool.h"
+
+struct taskpool {
+	taskpool_task task;
+	void   *arg;
+	size_t	ntasks;
+	/* The size of the buffer of each thread. */
+	size_t	buffer_size;
+	/* The buffer of the calling thread. */
+	char   *buffer;
+	/* The worker threads that were started. */
+	pthread_t *threads;
+	int	nthreads;
+	/* The next task to start. */
+	size_t	next;
+	/* The first error, which stops the pool. */
+	LDI_ERROR result;
+	/* Protects next and result. */
+	pthread_mutex_t lock;
+};
+
+/*
+ * Runs tasks with the buffer until there are none left or one fails, or
+ * only one if once is set. Returns true if no more tasks will be started.
+ */
+static bool
+run_tasks(struct taskpool *pool, char *buffer, bool once)
+{
+	size_t	index;
+	bool	finished;
+	LDI_ERROR result;
+
+	pthread_mutex_lock(&pool->lock);
+	while (!IS_ERROR(pool->result) && pool->next < pool->ntasks) {
+		index = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+
+		result = pool->task(pool->arg, index, buffer);
+
+		pthread_mutex_lock(&pool->lock);
+		if (IS_ERROR(result) && !IS_ERROR(pool->result)) {
+			pool->result = result;
+		}
+		if (once) {
+			break;
+		}
+	}
+	finished = IS_ERROR(pool->result) || pool->next >= pool->ntasks;
+	pthread_mutex_unlock(&pool->lock);
+
+	return finished;
+}
+
+/*
+ * A worker thread of the pool.
+ */
+static void *
+pool_worker(void *arg)
+{
+	struct taskpool *pool = arg;
+	char   *buffer;
+
+	buffer = NULL;
+	if (pool->buffer_size > 0) {
+		buffer = malloc(pool->buffer_size);
+		if (buffer == NULL) {
+			/* The other threads do the work. */
+			return NULL;
+		}
+	}
+	run_tasks(pool, buffer, false);
+	free(buffer);
+
+	return NULL;
+}
+
+/*
+ * Starts a pool for ntasks tasks.
+ */
+LDI_ERROR
+taskpool_start(size_t ntasks, int workers, size_t buffer_size, taskpool_task task, void *arg, struct taskpool **pool)
+{
+	int	i;
+
+	workers = (int)MIN((size_t)MAX(workers, 0), ntasks);
+
+	*pool = calloc(1, sizeof(struct taskpool));
+	if (*pool == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	(*pool)->task = task;
+	(*pool)->arg = arg;
+	(*pool)->ntasks = ntasks;
+	(*pool)->buffer_size = buffer_size;
+	(*pool)->result = NO_ERROR;
+	if (buffer_size > 0) {
+		(*pool)->buffer = malloc(buffer_size);
+	}
+	(*pool)->threads = calloc(MAX(workers, 1), sizeof(pthread_t));
+	if ((buffer_size > 0 && (*pool)->buffer == NULL) || (*pool)->threads == NULL) {
+		free((*pool)->buffer);
+		free((*pool)->threads);
+		free(*pool);
+		*pool = NULL;
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	pthread_mutex_init(&(*pool)->lock, NULL);
+
+	for (i = 0; i < workers; i++) {
+		if (pthread_create(&(*pool)->threads[i], NULL, pool_worker, *pool) != 0) {
+			/* The threads that did start do the work. */
+			break;
+		}
+		(*pool)->nthreads++;
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Runs tasks on the calling thread.
+ */
+bool
+taskpool_work(struct taskpool *pool, bool once)
+{
+	return run_tasks(pool, pool->buffer, once);
+}
+
+/*
+ * Stops the pool with an error of the caller.
+ */
+void
+taskpool_fail(struct taskpool *pool, LDI_ERROR result)
+{
+	pthread_mutex_lock(&pool->lock);
+	if (!IS_ERROR(pool->result)) {
+		pool->result = result;
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Waits for the worker threads and frees the pool.
+ */
+LDI_ERROR
+taskpool_finish(struct taskpool **pool)
+{
+	LDI_ERROR result;
+	int	i;
+
+	for (i = 0; i < (*pool)->nthreads; i++) {
+		pthread_join((*pool)->threads[i], NULL);
+	}
+	result = (*pool)->result;
+	pthread_mutex_destroy(&(*pool)->lock);
+	free((*pool)->threads);
+	free((*pool)->buffer);
+	free(*pool);
+	*pool = NULL;
+
+	return result;
+}
+
+/*
+ * Runs all tasks and returns the first error.
+ */
+LDI_ERROR
+taskpool_run(size_t ntasks, int workers, size_t buffer_size, taskpool_task task, void *arg)
+{
+	struct taskpool *pool;
+	LDI_ERROR result;
+
+	/* The caller takes one of the tasks. */
+	result = taskpool_start(ntasks, ntasks > 0 ? (int)MIN((size_t)MAX(workers, 0), ntasks - 1) : 0,
+	    buffer_size, task, arg, &pool);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+	taskpool_work(pool, false);
+
+	return taskpool_finish(&pool);
+}
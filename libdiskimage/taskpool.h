@@ -0,0 +1,55 @@
+#ifndef _TASKPOOL_H_
+#define _TASKPOOL_H_
+
+#include <sys/types.h>
+
+#include <stdbool.h>
+
+#include "diskimage.h"
+
+/*
+ * Runs a number of tasks on the calling thread and on worker threads. The
+ * tasks are started in order, and the first task that fails stops the
+ * pool from starting more.
+ */
+struct taskpool;
+
+/*
+ * Does the task with the given index. The buffer belongs to the thread
+ * that runs the task, and has the size given when the pool was started.
+ */
+typedef LDI_ERROR (*taskpool_task)(void *arg, size_t index, char *buffer);
+
+/*
+ * Starts a pool for ntasks tasks with at most workers threads, and no more
+ * threads than tasks. The caller can run tasks too with taskpool_work, and
+ * must call taskpool_finish. Tasks that no thread takes are not run.
+ */
+LDI_ERROR taskpool_start(size_t ntasks, int workers, size_t buffer_size, taskpool_task task, void *arg, struct taskpool **pool);
+
+/*
+ * Runs tasks on the calling thread until there are none left or one
+ * fails, or only one if once is set. Returns true if no more tasks will
+ * be started.
+ */
+bool	taskpool_work(struct taskpool *pool, bool once);
+
+/*
+ * Stops the pool with an error of the caller, unless a task failed first.
+ * Tasks that have started are finished.
+ */
+void	taskpool_fail(struct taskpool *pool, LDI_ERROR result);
+
+/*
+ * Waits for the worker threads, frees the pool and sets the pointer to
+ * NULL. Returns the first error.
+ */
+LDI_ERROR taskpool_finish(struct taskpool **pool);
+
+/*
+ * Runs all tasks with at most workers threads in addition to the caller,
+ * and returns the first error.
+ */
+LDI_ERROR taskpool_run(size_t ntasks, int workers, size_t buffer_size, taskpool_task task, void *arg);
+
+#endif					/* _TASKPOOL_H_ */
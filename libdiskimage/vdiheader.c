@@ -0,0 +1,99 @@
+
+#include <sys/endian.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+#include "vdiheader.h"
+
+/*
+ * Defines the offsets used in the header of a VDI image. The header starts
+ * after 64 bytes of text that name the program that made the image.
+ */
+#define SIGNATURE_OFFSET 0x40
+#define VERSION_OFFSET 0x44
+#define HEADER_SIZE_OFFSET 0x48
+#define TYPE_OFFSET 0x4c
+#define FLAGS_OFFSET 0x50
+#define BLOCKS_OFFSET_OFFSET 0x154
+#define DATA_OFFSET_OFFSET 0x158
+#define DISK_SIZE_OFFSET 0x170
+#define BLOCK_SIZE_OFFSET 0x178
+#define BLOCK_EXTRA_OFFSET 0x17c
+#define BLOCKS_OFFSET 0x180
+#define BLOCKS_ALLOCATED_OFFSET 0x184
+#define UUID_CREATE_OFFSET 0x188
+#define UUID_MODIFY_OFFSET 0x198
+#define UUID_LINKAGE_OFFSET 0x1a8
+#define UUID_PARENT_MODIFY_OFFSET 0x1b8
+
+/*
+ * Returns true if source starts a VDI image.
+ */
+bool
+vdiheader_signature_valid(void *source)
+{
+	uint8_t *bytes = source;
+
+	return le32dec(bytes + SIGNATURE_OFFSET) == VDI_SIGNATURE;
+}
+
+/*
+ * Creates a new header by reading it from source.
+ */
+LDI_ERROR
+vdiheader_new(void *source, struct vdiheader **header)
+{
+	uint8_t *bytes = source;
+
+	if (le32dec(bytes + SIGNATURE_OFFSET) != VDI_SIGNATURE) {
+		return ERROR(LDI_ERR_PARSEERROR);
+	}
+
+	*header = malloc(sizeof(struct vdiheader));
+	if (*header == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+
+	(*header)->version = le32dec(bytes + VERSION_OFFSET);
+	(*header)->header_size = le32dec(bytes + HEADER_SIZE_OFFSET);
+	(*header)->type = le32dec(bytes + TYPE_OFFSET);
+	(*header)->flags = le32dec(bytes + FLAGS_OFFSET);
+	(*header)->blocks_offset = le32dec(bytes + BLOCKS_OFFSET_OFFSET);
+	(*header)->data_offset = le32dec(bytes + DATA_OFFSET_OFFSET);
+	(*header)->disk_size = le64dec(bytes + DISK_SIZE_OFFSET);
+	(*header)->block_size = le32dec(bytes + BLOCK_SIZE_OFFSET);
+	(*header)->block_extra = le32dec(bytes + BLOCK_EXTRA_OFFSET);
+	(*header)->blocks = le32dec(bytes + BLOCKS_OFFSET);
+	(*header)->blocks_allocated = le32dec(bytes + BLOCKS_ALLOCATED_OFFSET);
+	uuid_dec_le(bytes + UUID_CREATE_OFFSET, &(*header)->uuid_create);
+	uuid_dec_le(bytes + UUID_MODIFY_OFFSET, &(*header)->uuid_modify);
+	uuid_dec_le(bytes + UUID_LINKAGE_OFFSET, &(*header)->uuid_linkage);
+	uuid_dec_le(bytes + UUID_PARENT_MODIFY_OFFSET, &(*header)->uuid_parent_modify);
+
+	return NO_ERROR;
+}
+
+/*
+ * Writes the fields of the header that can change into dest.
+ */
+void
+vdiheader_write(struct vdiheader *header, void *dest)
+{
+	uint8_t *bytes = dest;
+
+	le32enc(bytes + FLAGS_OFFSET, header->flags);
+	le32enc(bytes + BLOCKS_ALLOCATED_OFFSET, header->blocks_allocated);
+	uuid_enc_le(bytes + UUID_MODIFY_OFFSET, &header->uuid_modify);
+}
+
+/*
+ * Frees memory and zeros the header.
+ */
+void
+vdiheader_destroy(struct vdiheader **header)
+{
+	free(*header);
+	*header = NULL;
+}
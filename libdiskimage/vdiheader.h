@@ -0,0 +1,90 @@
+#ifndef _VDIHEADER_H_
+#define _VDIHEADER_H_
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <uuid.h>
+
+#include "diskimage.h"
+
+/* The signature of VDI images, after the text at the start of the file. */
+#define VDI_SIGNATURE 0xbeda107f
+
+/* The version of the header that is supported, 1.1. */
+#define VDI_VERSION 0x00010001
+
+/*
+ * The number of bytes at the start of the file that hold the header,
+ * rounded up to a sector.
+ */
+#define VDI_HEADER_SIZE 512
+
+/* The types of images. */
+#define VDI_TYPE_DYNAMIC 1
+#define VDI_TYPE_FIXED 2
+#define VDI_TYPE_UNDO 3
+#define VDI_TYPE_DIFF 4
+
+/* Block map entries of blocks that are not allocated. */
+#define VDI_BLOCK_FREE 0xffffffff
+#define VDI_BLOCK_ZERO 0xfffffffe
+
+/*
+ * The parsed form of the header of a VDI image. All offsets are in bytes
+ * from the start of the file. The comment and the geometry are not parsed.
+ */
+struct vdiheader {
+	uint32_t version;
+	/* The length of the header after the version. */
+	uint32_t header_size;
+	uint32_t type;
+	uint32_t flags;
+	/* Where the block map and the first block are. */
+	uint32_t blocks_offset;
+	uint32_t data_offset;
+	/* The number of bytes in the disk. */
+	uint64_t disk_size;
+	/*
+	 * The number of bytes of data in each block, and the number of bytes
+	 * before the data that are not part of the disk.
+	 */
+	uint32_t block_size;
+	uint32_t block_extra;
+	/* The number of entries in the block map, and of blocks in the file. */
+	uint32_t blocks;
+	uint32_t blocks_allocated;
+	uuid_t	uuid_create;
+	/* Changed each time the image is first written after being opened. */
+	uuid_t	uuid_modify;
+	/* The parent of differencing images. */
+	uuid_t	uuid_linkage;
+	uuid_t	uuid_parent_modify;
+};
+
+/*
+ * Returns true if source, which must hold VDI_HEADER_SIZE bytes, starts a
+ * VDI image.
+ */
+bool	vdiheader_signature_valid(void *source);
+
+/*
+ * Creates a new header by reading it from source, which must hold
+ * VDI_HEADER_SIZE bytes. Fails if source is not the header of a VDI
+ * image.
+ */
+LDI_ERROR vdiheader_new(void *source, struct vdiheader **header);
+
+/*
+ * Writes the fields of the header that can change into dest, which must
+ * hold the VDI_HEADER_SIZE bytes the header was read from. The comment and
+ * the other fields that are not parsed are kept.
+ */
+void	vdiheader_write(struct vdiheader *header, void *dest);
+
+/*
+ * Frees memory and zeros the header.
+ */
+void	vdiheader_destroy(struct vdiheader **header);
+
+#endif					/* _VDIHEADER_H_ */
@@ -0,0 +1,522 @@
+#include <sys/param.h>
+#include <sys/endian.h>
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uuid.h>
+
+#include "diskimage.h"
+#include "fileinterface.h"
+#include "internal.h"
+#include "log.h"
+#include "vdiheader.h"
+#include "vdiimage.h"
+
+#define SECTOR_SIZE 512
+
+/* The smallest header of version 1.1, up to the UUID of the parent. */
+#define MIN_HEADER_SIZE 0x180
+
+/* The largest blocks that are supported, 256 MB. */
+#define MAX_BLOCK_SIZE (256 * 1024 * 1024)
+
+/* The largest block map that is read. */
+#define MAX_MAP_BYTES (32 * 1024 * 1024)
+
+/*
+ * The number of blocks the file is extended with at a time, so that most
+ * block allocations don't change the size of the file.
+ */
+#define ALLOCATION_BATCH 16
+
+/* The number of block map entries in a sector. */
+#define ENTRIES_PER_SECTOR (SECTOR_SIZE / sizeof(uint32_t))
+
+struct vdiimage {
+	/* The file with the image. */
+	struct file *file;
+	/* The header of the image, and the sector it was read from. */
+	struct vdiheader *header;
+	uint8_t	header_bytes[VDI_HEADER_SIZE];
+	/* The number of bytes each block takes in the file. */
+	uint64_t block_stride;
+	/* The block map, in host byte order. */
+	uint32_t *map;
+	/* The range of block map entries that have to be written. */
+	uint32_t first_dirty;
+	uint32_t end_dirty;
+	/* True if the header has to be written. */
+	bool	header_dirty;
+	/* True once the image has been given a new modification UUID. */
+	bool	modified;
+	/* The size of the file when it was opened. */
+	size_t	filesize;
+	/*
+	 * The offset of the next block that is allocated, and the end of the
+	 * space that the file has been extended with.
+	 */
+	uint64_t next_offset;
+	uint64_t end_offset;
+	/* Protects all of the above that can change. */
+	pthread_mutex_t lock;
+	/* Used for logging. */
+	struct logger logger;
+};
+
+/*
+ * Checks that the header describes an image that can be read.
+ */
+static LDI_ERROR
+check_header(struct vdiheader *header, struct logger logger)
+{
+	if (header->version != VDI_VERSION) {
+		LOG_ERROR(logger, "Unknown VDI version %u.%u.\n", header->version >> 16,
+		    header->version & 0xffff);
+		return ERROR(LDI_ERR_FILENOTSUP);
+	}
+	if (header->type == VDI_TYPE_UNDO || header->type == VDI_TYPE_DIFF) {
+		LOG_ERROR(logger, "Differencing VDI images are not supported.\n");
+		return ERROR(LDI_ERR_FILENOTSUP);
+	}
+	if ((header->type != VDI_TYPE_DYNAMIC && header->type != VDI_TYPE_FIXED) ||
+	    header->header_size < MIN_HEADER_SIZE ||
+	    header->block_size == 0 || header->block_size % SECTOR_SIZE != 0 ||
+	    header->block_size > MAX_BLOCK_SIZE ||
+	    header->block_extra % SECTOR_SIZE != 0 ||
+	    header->disk_size % SECTOR_SIZE != 0 ||
+	    header->blocks < howmany(header->disk_size, header->block_size) ||
+	    header->blocks_allocated > header->blocks ||
+	    header->blocks_offset < VDI_HEADER_SIZE ||
+	    header->blocks_offset % SECTOR_SIZE != 0 ||
+	    header->data_offset % SECTOR_SIZE != 0 ||
+	    header->data_offset < header->blocks_offset +
+	    (uint64_t)header->blocks * sizeof(uint32_t)) {
+		LOG_ERROR(logger, "The VDI header is invalid.\n");
+		return ERROR(LDI_ERR_PARSEERROR);
+	}
+	if ((uint64_t)header->blocks * sizeof(uint32_t) > MAX_MAP_BYTES) {
+		LOG_ERROR(logger, "The VDI block map is too large.\n");
+		return ERROR(LDI_ERR_FILENOTSUP);
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Returns true if the block map entry is for a block in the file.
+ */
+static bool
+is_allocated(uint32_t entry)
+{
+	return entry != VDI_BLOCK_FREE && entry != VDI_BLOCK_ZERO;
+}
+
+/*
+ * Returns the offset in the file of the data of the block that the block
+ * map entry points at.
+ */
+static uint64_t
+block_offset(struct vdiimage *image, uint32_t entry)
+{
+	return image->header->data_offset + entry * image->block_stride +
+	    image->header->block_extra;
+}
+
+/*
+ * Reads the block map and checks that each entry is for a block in the
+ * file or for one that is not allocated.
+ */
+static LDI_ERROR
+read_map(struct vdiimage *image)
+{
+	struct vdiheader *header = image->header;
+	uint32_t i;
+	LDI_ERROR result;
+
+	/* Allocate at least one entry, so that empty maps are not NULL. */
+	image->map = malloc(MAX(header->blocks, 1) * sizeof(uint32_t));
+	if (image->map == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+
+	result = file_read(image->file, image->map,
+	    (size_t)header->blocks * sizeof(uint32_t), header->blocks_offset,
+	    image->logger);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	for (i = 0; i < header->blocks; i++) {
+		image->map[i] = le32toh(image->map[i]);
+		if (is_allocated(image->map[i]) && image->map[i] >= header->blocks_allocated) {
+			LOG_ERROR(image->logger, "Block %u points outside the VDI image.\n", i);
+			return ERROR(LDI_ERR_PARSEERROR);
+		}
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Opens the VDI image at path.
+ */
+LDI_ERROR
+vdiimage_open(struct fileinterface *fi, char *path, struct vdiimage **image, struct logger logger)
+{
+	struct vdiheader *header;
+	LDI_ERROR result;
+
+	*image = calloc(1, sizeof(struct vdiimage));
+	if (*image == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	(*image)->logger = logger;
+	pthread_mutex_init(&(*image)->lock, NULL);
+
+	result = file_open(fi, path, &(*image)->file);
+	if (!IS_ERROR(result)) {
+		result = file_read((*image)->file, (*image)->header_bytes,
+		    VDI_HEADER_SIZE, 0, logger);
+	}
+	if (!IS_ERROR(result)) {
+		result = vdiheader_new((*image)->header_bytes, &(*image)->header);
+		if (IS_ERROR(result)) {
+			LOG_ERROR(logger, "The file is not a VDI image.\n");
+		}
+	}
+	if (!IS_ERROR(result)) {
+		result = check_header((*image)->header, logger);
+	}
+	if (!IS_ERROR(result)) {
+		(*image)->block_stride = (uint64_t)(*image)->header->block_size +
+		    (*image)->header->block_extra;
+		result = read_map(*image);
+	}
+	if (!IS_ERROR(result)) {
+		result = file_getsize((*image)->file, &(*image)->filesize);
+	}
+	if (IS_ERROR(result)) {
+		vdiimage_destroy(image);
+		return result;
+	}
+
+	/* Blocks are numbered in the order they were allocated. */
+	header = (*image)->header;
+	(*image)->next_offset = header->data_offset +
+	    header->blocks_allocated * (*image)->block_stride;
+	if ((*image)->filesize < (*image)->next_offset) {
+		LOG_ERROR(logger, "The VDI image is shorter than its blocks.\n");
+		vdiimage_destroy(image);
+		return ERROR(LDI_ERR_PARSEERROR);
+	}
+	(*image)->end_offset = (*image)->next_offset;
+	(*image)->first_dirty = header->blocks;
+
+	return NO_ERROR;
+}
+
+/*
+ * Frees the image and sets the pointer to NULL.
+ */
+void
+vdiimage_destroy(struct vdiimage **image)
+{
+	/* Make sure that all metadata is written before the file is closed. */
+	if ((*image)->first_dirty < (*image)->end_dirty || (*image)->header_dirty) {
+		vdiimage_flush(*image);
+	}
+	if ((*image)->end_offset > (*image)->next_offset) {
+		/* Give back the space that no block was allocated in. */
+		file_setsize((*image)->file, (*image)->next_offset);
+	}
+
+	if ((*image)->header != NULL) {
+		vdiheader_destroy(&(*image)->header);
+	}
+	if ((*image)->file != NULL) {
+		file_close(&(*image)->file);
+	}
+	pthread_mutex_destroy(&(*image)->lock);
+	free((*image)->map);
+	free(*image);
+	*image = NULL;
+}
+
+/*
+ * Returns the number of bytes in the disk.
+ */
+uint64_t
+vdiimage_size(struct vdiimage *image)
+{
+	return image->header->disk_size;
+}
+
+/*
+ * Returns true if a block with the block map entry continues a run of
+ * count blocks that starts with the entry start, so that the whole run can
+ * be read or written at once. Blocks with extra bytes before their data
+ * are never next to each other in the file.
+ */
+static bool
+continues_run(struct vdiimage *image, uint32_t start, uint32_t count, uint32_t entry)
+{
+	if (!is_allocated(start)) {
+		return !is_allocated(entry);
+	}
+
+	return image->header->block_extra == 0 && is_allocated(entry) &&
+	    entry == start + count;
+}
+
+/*
+ * Returns the number of bytes of the run of blocks, starting with the
+ * block at offset on the disk and at most nbytes long, that can be read or
+ * written at once. The block map entry of the first block is returned in
+ * start. Must be called with the lock held.
+ */
+static size_t
+find_run_locked(struct vdiimage *image, off_t offset, size_t nbytes, uint32_t *start)
+{
+	uint64_t block;
+	uint32_t count;
+	size_t	length;
+
+	block = offset / image->header->block_size;
+	length = MIN(image->header->block_size - offset % image->header->block_size, nbytes);
+	*start = image->map[block];
+
+	/* Extend the run with as many of the following blocks as possible. */
+	for (count = 1; length < nbytes &&
+	    continues_run(image, *start, count, image->map[block + count]); count++) {
+		length += MIN(image->header->block_size, nbytes - length);
+	}
+
+	return length;
+}
+
+/*
+ * Reads nbytes at offset on the disk into the buffer. Blocks that are next
+ * to each other both on the disk and in the file are read with a single
+ * read, and runs of blocks that are not allocated are zeroed at once.
+ */
+LDI_ERROR
+vdiimage_read(struct vdiimage *image, char *buf, size_t nbytes, off_t offset)
+{
+	uint32_t start;
+	size_t	length;
+	LDI_ERROR result;
+
+	while (nbytes > 0) {
+		pthread_mutex_lock(&image->lock);
+		length = find_run_locked(image, offset, nbytes, &start);
+		pthread_mutex_unlock(&image->lock);
+
+		if (!is_allocated(start)) {
+			memset(buf, 0, length);
+		} else {
+			result = file_read(image->file, buf, length, block_offset(image, start) +
+			    offset % image->header->block_size, image->logger);
+			if (IS_ERROR(result)) {
+				return result;
+			}
+		}
+
+		buf += length;
+		offset += length;
+		nbytes -= length;
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Reserves count blocks at the end of the file and returns the number of
+ * the first one. The file is extended in batches of several blocks, so
+ * that most allocations only move the tail. The reserved blocks read as
+ * zeros. Must be called with the lock held.
+ */
+static LDI_ERROR
+reserve_locked(struct vdiimage *image, uint32_t count, uint32_t *first)
+{
+	uint64_t batch;
+	LDI_ERROR result;
+
+	if (image->header->blocks_allocated + (uint64_t)count > image->header->blocks) {
+		LOG_ERROR(image->logger, "The VDI image has more blocks than its block map.\n");
+		return ERROR(LDI_ERR_IO);
+	}
+
+	if (image->next_offset + count * image->block_stride > image->end_offset) {
+		/* Anything after the last block is cut off, so that new blocks are zeros. */
+		if (image->filesize > image->end_offset) {
+			result = file_setsize(image->file, image->end_offset);
+			if (IS_ERROR(result)) {
+				return result;
+			}
+			image->filesize = image->end_offset;
+		}
+		batch = MAX(count, ALLOCATION_BATCH) * image->block_stride;
+		result = file_setsize(image->file, image->next_offset + batch);
+		if (IS_ERROR(result)) {
+			return result;
+		}
+		image->end_offset = image->next_offset + batch;
+	}
+
+	*first = image->header->blocks_allocated;
+	image->header->blocks_allocated += count;
+	image->next_offset += count * image->block_stride;
+	image->header_dirty = true;
+
+	return NO_ERROR;
+}
+
+/*
+ * Points the block map entries of count blocks, starting with block, at
+ * blocks in the file starting with first. Must be called with the lock
+ * held.
+ */
+static void
+set_entries_locked(struct vdiimage *image, uint64_t block, uint32_t count, uint32_t first)
+{
+	uint32_t i;
+
+	for (i = 0; i < count; i++) {
+		image->map[block + i] = first + i;
+	}
+	image->first_dirty = MIN(image->first_dirty, block);
+	image->end_dirty = MAX(image->end_dirty, block + count);
+}
+
+/*
+ * Writes nbytes from the buffer at offset on the disk. Runs of blocks that
+ * are not allocated get that many new blocks with a single allocation, and
+ * are written with a single write, as are runs of blocks that are next to
+ * each other in the file. New blocks read as zeros, so nothing has to be
+ * copied into them. The block map and the header are only written by a
+ * flush.
+ */
+LDI_ERROR
+vdiimage_write(struct vdiimage *image, char *buf, size_t nbytes, off_t offset)
+{
+	uint64_t block;
+	uint32_t start, count;
+	uint32_t status;
+	size_t	offset_in_block, length;
+	LDI_ERROR result;
+
+	pthread_mutex_lock(&image->lock);
+	if (!image->modified) {
+		/* Tell others that have seen the image that it has changed. */
+		uuid_create(&image->header->uuid_modify, &status);
+		image->header_dirty = true;
+		image->modified = true;
+	}
+	while (nbytes > 0) {
+		block = offset / image->header->block_size;
+		offset_in_block = offset % image->header->block_size;
+		length = find_run_locked(image, offset, nbytes, &start);
+
+		result = NO_ERROR;
+		if (!is_allocated(start) && image->header->block_extra != 0) {
+			/* New blocks with extra bytes are not next to each other. */
+			length = MIN(length, image->header->block_size - offset_in_block);
+		}
+		if (!is_allocated(start)) {
+			count = howmany(offset_in_block + length, image->header->block_size);
+			result = reserve_locked(image, count, &start);
+			if (!IS_ERROR(result)) {
+				set_entries_locked(image, block, count, start);
+			}
+		}
+		if (!IS_ERROR(result)) {
+			result = file_write(image->file, buf, length,
+			    block_offset(image, start) + offset_in_block, image->logger);
+		}
+		if (IS_ERROR(result)) {
+			pthread_mutex_unlock(&image->lock);
+			return result;
+		}
+
+		buf += length;
+		offset += length;
+		nbytes -= length;
+	}
+	pthread_mutex_unlock(&image->lock);
+
+	return NO_ERROR;
+}
+
+/*
+ * Writes the sectors of the block map with entries that have changed.
+ * Must be called with the lock held.
+ */
+static LDI_ERROR
+write_map_locked(struct vdiimage *image)
+{
+	uint32_t *buffer;
+	uint32_t first, end, i;
+	LDI_ERROR result;
+
+	first = rounddown(image->first_dirty, ENTRIES_PER_SECTOR);
+	end = MIN(roundup(image->end_dirty, ENTRIES_PER_SECTOR), image->header->blocks);
+
+	buffer = malloc((end - first) * sizeof(uint32_t));
+	if (buffer == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	for (i = first; i < end; i++) {
+		buffer[i - first] = htole32(image->map[i]);
+	}
+
+	result = file_write(image->file, buffer, (end - first) * sizeof(uint32_t),
+	    image->header->blocks_offset + first * sizeof(uint32_t), image->logger);
+	free(buffer);
+
+	return result;
+}
+
+/*
+ * Writes the header and the block map if they have changed. Each step is
+ * made durable before the next one: the data blocks, the header with the
+ * number of allocated blocks and the block map. A crash at any point can
+ * then leak blocks, but never leaves an entry that points at data that
+ * was not written or at a block that is not counted.
+ */
+LDI_ERROR
+vdiimage_flush(struct vdiimage *image)
+{
+	LDI_ERROR result;
+
+	pthread_mutex_lock(&image->lock);
+	result = file_sync(image->file);
+
+	if (!IS_ERROR(result) && image->header_dirty) {
+		vdiheader_write(image->header, image->header_bytes);
+		result = file_write(image->file, image->header_bytes, VDI_HEADER_SIZE, 0,
+		    image->logger);
+		if (!IS_ERROR(result)) {
+			result = file_sync(image->file);
+		}
+	}
+	if (!IS_ERROR(result) && image->first_dirty < image->end_dirty) {
+		result = write_map_locked(image);
+		if (!IS_ERROR(result)) {
+			result = file_sync(image->file);
+		}
+	}
+	if (IS_ERROR(result)) {
+		/* Everything stays dirty so that the next flush tries again. */
+		pthread_mutex_unlock(&image->lock);
+		return result;
+	}
+
+	image->header_dirty = false;
+	image->first_dirty = image->header->blocks;
+	image->end_dirty = 0;
+	pthread_mutex_unlock(&image->lock);
+
+	return NO_ERROR;
+}
@@ -0,0 +1,52 @@
+#ifndef _VDIIMAGE_H_
+#define _VDIIMAGE_H_
+
+#include <sys/types.h>
+
+#include "diskimage.h"
+#include "fileinterface.h"
+
+/*
+ * A fixed or dynamic VirtualBox VDI image. The whole block map is read
+ * when the image is opened.
+ */
+struct vdiimage;
+
+/*
+ * Opens the VDI image at path. Fails with LDI_ERR_FILENOTSUP for
+ * differencing and undo images and for versions other than 1.1.
+ */
+LDI_ERROR vdiimage_open(struct fileinterface *fi, char *path, struct vdiimage **image, struct logger logger);
+
+/*
+ * Flushes the image, closes its file, frees it and sets the pointer to
+ * NULL.
+ */
+void	vdiimage_destroy(struct vdiimage **image);
+
+/*
+ * Returns the number of bytes in the disk.
+ */
+uint64_t vdiimage_size(struct vdiimage *image);
+
+/*
+ * Reads nbytes at offset on the disk into the buffer. Blocks that are not
+ * allocated read as zeros.
+ */
+LDI_ERROR vdiimage_read(struct vdiimage *image, char *buf, size_t nbytes, off_t offset);
+
+/*
+ * Writes nbytes from the buffer at offset on the disk. Blocks that are not
+ * allocated get new blocks at the end of the file, which is extended
+ * several blocks at a time. The block map and the header are not written
+ * until the image is flushed.
+ */
+LDI_ERROR vdiimage_write(struct vdiimage *image, char *buf, size_t nbytes, off_t offset);
+
+/*
+ * Makes the written blocks durable and then writes the header and the
+ * block map that point at them.
+ */
+LDI_ERROR vdiimage_flush(struct vdiimage *image);
+
+#endif					/* _VDIIMAGE_H_ */
@@ -0,0 +1,96 @@
+
+#include <stdlib.h>
+
+#include "diskimage.h"
+#include "fileinterface.h"
+#include "internal.h"
+#include "parser.h"
+#include "vdiheader.h"
+#include "vdiimage.h"
+
+void	vdiparser_destroy(void **parser);
+
+/*
+ * Creates the parser state, which is the image itself.
+ */
+LDI_ERROR
+vdiparser_new(struct fileinterface *fi, char *path, struct diskimage_options options, void **parser, struct logger logger)
+{
+	return vdiimage_open(fi, path, (struct vdiimage **)parser, logger);
+}
+
+/*
+ * Deallocates the parser state and sets the pointer to NULL.
+ */
+void
+vdiparser_destroy(void **parser)
+{
+	vdiimage_destroy((struct vdiimage **)parser);
+}
+
+/*
+ * Returns a diskinfo struct with properties for the disk.
+ */
+struct diskinfo
+vdiparser_diskinfo(void *parser)
+{
+	struct diskinfo result;
+
+	result.disksize = vdiimage_size(parser);
+
+	return result;
+}
+
+/*
+ * Reads nbytes at offset into the buffer.
+ */
+LDI_ERROR
+vdiparser_read(void *parser, char *buf, size_t nbytes, off_t offset)
+{
+	return vdiimage_read(parser, buf, nbytes, offset);
+}
+
+/*
+ * Writes nbytes from the buffer into the diskimage at the specified offset.
+ */
+LDI_ERROR
+vdiparser_write(void *parser, char *buf, size_t nbytes, off_t offset)
+{
+	return vdiimage_write(parser, buf, nbytes, offset);
+}
+
+/*
+ * Makes all data written to the diskimage durable.
+ */
+LDI_ERROR
+vdiparser_flush(void *parser)
+{
+	return vdiimage_flush(parser);
+}
+
+/*
+ * Returns true if the file starts a VDI image.
+ */
+bool
+vdiparser_probe(void *head, void *tail)
+{
+	return vdiheader_signature_valid(head);
+}
+
+/*
+ * Define an ldi_parser struct for the VDI parser and define the parser
+ * using the PARSER_DEFINE macro. This will make the parser discoverable
+ * in diskimage.c.
+ */
+static struct ldi_parser vdiparser_format = {
+	.name = "vdi",
+	.probe = vdiparser_probe,
+	.construct = vdiparser_new,
+	.destructor = vdiparser_destroy,
+	.diskinfo = vdiparser_diskinfo,
+	.read = vdiparser_read,
+	.write = vdiparser_write,
+	.flush = vdiparser_flush
+};
+
+PARSER_DEFINE(vdiparser_format);
@@ -5,8 +5,8 @@
 
 #include "diskimage.h"
 #include "internal.h"
+#include "kernels.h"
 #include "log.h"
-#include "vhdserialization.h"
 
 
 struct vhd_bat {
@@ -24,13 +24,9 @@ void	log_bat(struct vhd_bat *bat);
 static void
 read_bat(void *source, struct vhd_bat *bat)
 {
-	int i;
-
 	bat->block_offsets = malloc(bat->numblocks * sizeof(uint32_t));
 
-	for (i = 0; i < bat->numblocks; i++) {
-		bat->block_offsets[i] = read_uint32(source + i * 4);
-	}
+	kernel_be32dec_array(bat->block_offsets, source, bat->numblocks);
 }
 
 
@@ -61,11 +57,7 @@ vhd_bat_new(void *source, struct vhd_bat **bat, int numblocks, struct logger log
 LDI_ERROR
 vhd_bat_write(struct vhd_bat *bat, void *destination)
 {
-	int i;
-
-	for (i = 0; i < bat->numblocks; i++) {
-		write_uint32(bat->block_offsets[i], destination + i * 4);
-	}
+	kernel_be32enc_array(destination, bat->block_offsets, bat->numblocks);
 
 	return NO_ERROR;
 }
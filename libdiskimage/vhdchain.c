@@ -0,0 +1,244 @@
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "diskimage.h"
+#include "internal.h"
+#include "vhdchain.h"
+
+#define SECTOR_SIZE 512
+
+/*
+ * The runs of one block of the index.
+ */
+struct chain_block {
+	struct vhdchain_run *runs;
+	uint32_t nruns;
+	uint32_t capacity;
+	/* True once all runs of the block have been added. */
+	bool	resolved;
+};
+
+struct vhdchain {
+	uint32_t numblocks;
+	uint32_t sectors_per_block;
+	struct chain_block *blocks;
+};
+
+/*
+ * Returns true if run directly continues previous, so that the two can be
+ * stored as one run.
+ */
+static bool
+continues(struct vhdchain_run *previous, struct vhdchain_run *run)
+{
+	if (previous->layer != run->layer ||
+	    previous->sector + previous->count != run->sector) {
+		return false;
+	}
+
+	/* Zeros have no file offset. */
+	return run->layer == NULL ||
+	    previous->file_offset + (uint64_t)previous->count * SECTOR_SIZE == run->file_offset;
+}
+
+/*
+ * Adds the run to the end of the array, merging it with the last run if
+ * possible. The array must have room for one more run.
+ */
+static void
+push_run(struct vhdchain_run *runs, uint32_t *nruns, struct vhdchain_run run)
+{
+	if (*nruns > 0 && continues(&runs[*nruns - 1], &run)) {
+		runs[*nruns - 1].count += run.count;
+	} else {
+		runs[(*nruns)++] = run;
+	}
+}
+
+/*
+ * Creates an empty index for numblocks blocks.
+ */
+LDI_ERROR
+vhdchain_new(uint32_t numblocks, uint32_t sectors_per_block, struct vhdchain **chain)
+{
+	*chain = malloc(sizeof(struct vhdchain));
+	if (*chain == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	(*chain)->numblocks = numblocks;
+	(*chain)->sectors_per_block = sectors_per_block;
+	(*chain)->blocks = calloc(numblocks, sizeof(struct chain_block));
+	if ((*chain)->blocks == NULL) {
+		free(*chain);
+		*chain = NULL;
+		return ERROR(LDI_ERR_NOMEM);
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Frees the index and sets the pointer to NULL.
+ */
+void
+vhdchain_destroy(struct vhdchain **chain)
+{
+	uint32_t i;
+
+	for (i = 0; i < (*chain)->numblocks; i++) {
+		free((*chain)->blocks[i].runs);
+	}
+	free((*chain)->blocks);
+	free(*chain);
+	*chain = NULL;
+}
+
+/*
+ * Returns the run that contains the sector of the block.
+ */
+struct vhdchain_run *
+vhdchain_lookup(struct vhdchain *chain, uint32_t block, uint32_t sector)
+{
+	struct chain_block *b = &chain->blocks[block];
+	uint32_t low, high, middle;
+
+	if (!b->resolved || b->nruns == 0) {
+		return NULL;
+	}
+
+	/* Find the last run that starts at or before the sector. */
+	low = 0;
+	high = b->nruns - 1;
+	while (low < high) {
+		middle = (low + high + 1) / 2;
+		if (b->runs[middle].sector <= sector) {
+			low = middle;
+		} else {
+			high = middle - 1;
+		}
+	}
+
+	if (sector < b->runs[low].sector ||
+	    sector >= b->runs[low].sector + b->runs[low].count) {
+		return NULL;
+	}
+
+	return &b->runs[low];
+}
+
+/*
+ * Appends a run to a block that is being resolved.
+ */
+LDI_ERROR
+vhdchain_append(struct vhdchain *chain, uint32_t block, struct vhdchain_run run)
+{
+	struct chain_block *b = &chain->blocks[block];
+	struct vhdchain_run *runs;
+	uint32_t capacity;
+
+	if (b->nruns == b->capacity) {
+		/* Most blocks have a single run. */
+		capacity = b->capacity == 0 ? 1 : b->capacity * 2;
+		runs = realloc(b->runs, capacity * sizeof(struct vhdchain_run));
+		if (runs == NULL) {
+			return ERROR(LDI_ERR_NOMEM);
+		}
+		b->runs = runs;
+		b->capacity = capacity;
+	}
+	push_run(b->runs, &b->nruns, run);
+
+	return NO_ERROR;
+}
+
+/*
+ * Marks the block as resolved, or discards the runs if it failed.
+ */
+void
+vhdchain_resolved(struct vhdchain *chain, uint32_t block, bool success)
+{
+	struct chain_block *b = &chain->blocks[block];
+
+	if (success) {
+		b->resolved = true;
+	} else {
+		free(b->runs);
+		b->runs = NULL;
+		b->nruns = 0;
+		b->capacity = 0;
+		b->resolved = false;
+	}
+}
+
+/*
+ * Records that the sectors of the run are now owned by its layer. The
+ * runs that overlap it are trimmed or removed.
+ */
+LDI_ERROR
+vhdchain_assign(struct vhdchain *chain, uint32_t block, struct vhdchain_run run)
+{
+	struct chain_block *b = &chain->blocks[block];
+	struct vhdchain_run *runs, *r, part;
+	uint32_t i, nruns, end, r_end;
+	bool inserted = false;
+
+	if (!b->resolved) {
+		return NO_ERROR;
+	}
+
+	/* At most one run is split in two, and the new run is added. */
+	runs = malloc((b->nruns + 2) * sizeof(struct vhdchain_run));
+	if (runs == NULL) {
+		/* Force the block to be resolved again instead. */
+		vhdchain_resolved(chain, block, false);
+		return ERROR(LDI_ERR_NOMEM);
+	}
+
+	end = run.sector + run.count;
+	nruns = 0;
+	for (i = 0; i < b->nruns; i++) {
+		r = &b->runs[i];
+		r_end = r->sector + r->count;
+
+		if (r_end <= run.sector) {
+			/* Before the new run. */
+			push_run(runs, &nruns, *r);
+			continue;
+		}
+		if (r->sector < run.sector) {
+			/* Keep the head of a run that starts before. */
+			part = *r;
+			part.count = run.sector - r->sector;
+			push_run(runs, &nruns, part);
+		}
+		if (!inserted) {
+			push_run(runs, &nruns, run);
+			inserted = true;
+		}
+		if (r_end > end) {
+			/* Keep the tail of a run that ends after. */
+			part = *r;
+			if (r->sector < end) {
+				part.sector = end;
+				part.count = r_end - end;
+				if (part.layer != NULL) {
+					part.file_offset += (uint64_t)(end - r->sector) * SECTOR_SIZE;
+				}
+			}
+			push_run(runs, &nruns, part);
+		}
+	}
+	if (!inserted) {
+		push_run(runs, &nruns, run);
+	}
+
+	free(b->runs);
+	b->capacity = b->nruns + 2;
+	b->runs = runs;
+	b->nruns = nruns;
+
+	return NO_ERROR;
+}
@@ -0,0 +1,69 @@
+#ifndef _VHDCHAIN_H_
+#define _VHDCHAIN_H_
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "diskimage.h"
+
+/*
+ * A flattened index for a chain of differencing disks. For each block of
+ * the top disk it holds a sorted list of sector runs, each mapped directly
+ * to the layer in the chain that owns the data and the offset of the data
+ * in the file of that layer. Blocks are resolved the first time they are
+ * used, and updated when the top disk is written.
+ */
+struct vhdchain;
+
+/*
+ * A run of sectors in a block that are stored contiguously in one layer.
+ */
+struct vhdchain_run {
+	/* The first sector of the run, relative to the start of the block. */
+	uint32_t sector;
+	/* The number of sectors in the run. */
+	uint32_t count;
+	/* The layer that owns the data, or NULL if the run reads as zeros. */
+	void   *layer;
+	/* The offset in the file of the layer of the first sector. */
+	uint64_t file_offset;
+};
+
+/*
+ * Creates an empty index for numblocks blocks, with no blocks resolved.
+ */
+LDI_ERROR vhdchain_new(uint32_t numblocks, uint32_t sectors_per_block, struct vhdchain **chain);
+
+/*
+ * Frees the index and sets the pointer to NULL.
+ */
+void	vhdchain_destroy(struct vhdchain **chain);
+
+/*
+ * Returns the run that contains the sector of the block, or NULL if the
+ * block has not been resolved.
+ */
+struct vhdchain_run *vhdchain_lookup(struct vhdchain *chain, uint32_t block, uint32_t sector);
+
+/*
+ * Appends a run to a block that is being resolved. Runs must be appended
+ * in order. A run that continues the previous one in the same layer is
+ * merged with it.
+ */
+LDI_ERROR vhdchain_append(struct vhdchain *chain, uint32_t block, struct vhdchain_run run);
+
+/*
+ * Marks the block as resolved, once all its runs have been appended, or
+ * discards the appended runs if the resolution failed.
+ */
+void	vhdchain_resolved(struct vhdchain *chain, uint32_t block, bool success);
+
+/*
+ * Records that the sectors of the run are now owned by its layer. Used
+ * when the top disk is written. Does nothing if the block has not been
+ * resolved, since it will see the new data when it is.
+ */
+LDI_ERROR vhdchain_assign(struct vhdchain *chain, uint32_t block, struct vhdchain_run run);
+
+#endif					/* _VHDCHAIN_H_ */
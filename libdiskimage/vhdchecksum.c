@@ -2,6 +2,7 @@
 #include <stdbool.h>
 #include <uuid.h>
 
+#include "kernels.h"
 #include "vhdchecksum.h"
 #include "vhdtypes.h"
 
@@ -11,14 +12,7 @@
 uint32_t
 checksum_uint8_array(uint8_t *source, uint32_t count)
 {
-	int i;
-	uint32_t result = 0;
-
-	for (i = 0; i < count; i++) {
-		result += *(source + i);
-	}
-
-	return result;
+	return kernel_bytesum(source, count);
 }
 
 /*
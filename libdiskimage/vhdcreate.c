@@ -0,0 +1,274 @@
+
+#include <sys/param.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uuid.h>
+
+#include "diskimage.h"
+#include "fileinterface.h"
+#include "internal.h"
+#include "log.h"
+#include "vhdcreate.h"
+#include "vhdfooter.h"
+#include "vhdheader.h"
+
+#define FOOTER_SIZE 512
+#define HEADER_SIZE 1024
+
+/* The block size used for children of fixed disks, which have none. */
+#define DEFAULT_BLOCK_SIZE (2 * 1024 * 1024)
+
+/* The parent locator entries written, in the order they are tried. */
+#define NUM_LOCATORS 2
+static char *locator_codes[NUM_LOCATORS] = {"W2ru", "W2ku"};
+
+/*
+ * Reads a footer structure from the given file offset.
+ */
+static LDI_ERROR
+read_footer_at(struct file *file, off_t offset, struct vhdfooter **footer, struct logger logger)
+{
+	char buffer[FOOTER_SIZE];
+	LDI_ERROR result;
+
+	result = file_read(file, buffer, sizeof(buffer), offset, logger);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	return vhdfooter_new(buffer, footer, logger);
+}
+
+/*
+ * Reads the footer of the parent, and the block size from the dynamic
+ * header if it has one.
+ */
+static LDI_ERROR
+read_parent(struct file *file, struct vhdfooter **footer, uint32_t *block_size, struct logger logger)
+{
+	struct vhd_header *header;
+	char buffer[HEADER_SIZE];
+	size_t size;
+	LDI_ERROR result;
+
+	result = file_getsize(file, &size);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+	if (size < FOOTER_SIZE) {
+		return ERROR(LDI_ERR_PARSEERROR);
+	}
+
+	result = read_footer_at(file, size - FOOTER_SIZE, footer, logger);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+	if ((vhdfooter_getstatus(*footer) & VHDFOOTER_BADCOOKIE) != 0) {
+		/* Dynamic disks that were never flushed only have the copy. */
+		vhdfooter_destroy(footer);
+		result = read_footer_at(file, 0, footer, logger);
+		if (IS_ERROR(result)) {
+			return result;
+		}
+	}
+	if (vhdfooter_getstatus(*footer) != VHDFOOTER_OK ||
+	    vhdfooter_getdisktype(*footer) == DISK_TYPE_UNKNOWN) {
+		LOG_ERROR(logger, "The parent is not a valid VHD.\n");
+		vhdfooter_destroy(footer);
+		return ERROR(LDI_ERR_PARSEERROR);
+	}
+
+	if (vhdfooter_getdisktype(*footer) == DISK_TYPE_FIXED) {
+		*block_size = DEFAULT_BLOCK_SIZE;
+		return NO_ERROR;
+	}
+
+	result = file_read(file, buffer, sizeof(buffer), vhdfooter_offset(*footer), logger);
+	if (!IS_ERROR(result)) {
+		result = vhd_header_new(buffer, &header, logger);
+	}
+	if (IS_ERROR(result)) {
+		vhdfooter_destroy(footer);
+		return result;
+	}
+	if (!vhd_header_isvalid(header)) {
+		LOG_ERROR(logger, "The dynamic header of the parent is invalid.\n");
+		vhd_header_destroy(&header);
+		vhdfooter_destroy(footer);
+		return ERROR(LDI_ERR_PARSEERROR);
+	}
+	*block_size = vhd_header_block_size(header);
+	vhd_header_destroy(&header);
+
+	return NO_ERROR;
+}
+
+/*
+ * Encodes the paths to the parent for the parent locators: first relative
+ * to the directory of the child, so that the pair can be moved together,
+ * then the absolute path.
+ */
+static LDI_ERROR
+encode_locators(struct fileinterface *fi, struct file *child, char *parent_path, char **data, uint32_t *lengths)
+{
+	char absolute[PATH_MAX];
+	char *directory, *relative, *paths[NUM_LOCATORS];
+	int i;
+	LDI_ERROR result;
+
+	if (realpath(parent_path, absolute) == NULL) {
+		return ERROR2(LDI_ERR_FILEERROR, errno);
+	}
+
+	directory = file_getdirectory(child);
+	if (directory == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	result = fileinterface_getrelativepath(fi, directory, parent_path, &relative);
+	free(directory);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	paths[0] = relative;
+	paths[1] = absolute;
+	for (i = 0; i < NUM_LOCATORS; i++) {
+		data[i] = vhd_parent_locator_encode(locator_codes[i], paths[i], &lengths[i]);
+		if (data[i] == NULL) {
+			result = ERROR(LDI_ERR_NOMEM);
+		}
+	}
+	free(relative);
+
+	return result;
+}
+
+/*
+ * Writes the metadata of an empty differencing disk to the child file: a
+ * copy of the footer, the dynamic header, a block allocation table with
+ * all blocks unallocated, the parent locator data and the footer.
+ */
+static LDI_ERROR
+write_child(struct fileinterface *fi, struct file *child, char *parent_path, struct vhdfooter *parent, uint32_t block_size, struct logger logger)
+{
+	struct vhdfooter *footer;
+	struct vhd_header *header;
+	char *data[NUM_LOCATORS] = {NULL, NULL};
+	uint32_t lengths[NUM_LOCATORS], spaces[NUM_LOCATORS];
+	char *buffer, *name;
+	uuid_t parent_id;
+	uint32_t numblocks;
+	size_t bat_size, size;
+	off_t offset;
+	int i;
+	LDI_ERROR result;
+
+	result = encode_locators(fi, child, parent_path, data, lengths);
+	if (IS_ERROR(result)) {
+		for (i = 0; i < NUM_LOCATORS; i++) {
+			free(data[i]);
+		}
+		return result;
+	}
+
+	/* The BAT and each locator take up whole sectors. */
+	numblocks = howmany(vhdfooter_disksize(parent), block_size);
+	bat_size = roundup((size_t)numblocks * 4, 512);
+	size = FOOTER_SIZE + HEADER_SIZE + bat_size + FOOTER_SIZE;
+	for (i = 0; i < NUM_LOCATORS; i++) {
+		spaces[i] = roundup(lengths[i], 512);
+		size += spaces[i];
+	}
+
+	buffer = calloc(1, size);
+	name = strrchr(parent_path, '/');
+	vhdfooter_unique_id(parent, &parent_id);
+	result = vhd_header_new_child(FOOTER_SIZE + HEADER_SIZE, numblocks,
+	    block_size, &parent_id, vhdfooter_time_stamp(parent),
+	    name != NULL ? name + 1 : parent_path, &header, logger);
+	if (IS_ERROR(result) || buffer == NULL) {
+		if (!IS_ERROR(result)) {
+			vhd_header_destroy(&header);
+		}
+		for (i = 0; i < NUM_LOCATORS; i++) {
+			free(data[i]);
+		}
+		free(buffer);
+		return ERROR(LDI_ERR_NOMEM);
+	}
+
+	/* All blocks are unallocated, so all reads go to the parent. */
+	memset(buffer + FOOTER_SIZE + HEADER_SIZE, 0xFF, bat_size);
+
+	offset = FOOTER_SIZE + HEADER_SIZE + bat_size;
+	for (i = 0; i < NUM_LOCATORS; i++) {
+		vhd_header_set_parent_locator(header, i, locator_codes[i],
+		    spaces[i], lengths[i], offset);
+		memcpy(buffer + offset, data[i], lengths[i]);
+		offset += spaces[i];
+		free(data[i]);
+	}
+	vhd_header_write(header, buffer + FOOTER_SIZE);
+	vhd_header_destroy(&header);
+
+	result = vhdfooter_new_child(parent, FOOTER_SIZE, &footer, logger);
+	if (IS_ERROR(result)) {
+		free(buffer);
+		return result;
+	}
+	vhdfooter_write(footer, buffer);
+	vhdfooter_write(footer, buffer + size - FOOTER_SIZE);
+	vhdfooter_destroy(&footer);
+
+	result = file_setsize(child, size);
+	if (!IS_ERROR(result)) {
+		result = file_write(child, buffer, size, 0, logger);
+	}
+	free(buffer);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	return file_sync(child);
+}
+
+/*
+ * Creates a new, empty differencing disk on top of the VHD at
+ * parent_path.
+ */
+LDI_ERROR
+vhdcreate_child(struct fileinterface *fi, char *parent_path, char *child_path, struct logger logger)
+{
+	struct file *parent_file, *child;
+	struct vhdfooter *parent;
+	uint32_t block_size;
+	LDI_ERROR result;
+
+	result = file_open_readonly(fi, parent_path, &parent_file);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+	result = read_parent(parent_file, &parent, &block_size, logger);
+	file_close(&parent_file);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	result = file_create_new(fi, child_path, &child);
+	if (IS_ERROR(result)) {
+		vhdfooter_destroy(&parent);
+		return result;
+	}
+
+	result = write_child(fi, child, parent_path, parent, block_size, logger);
+	vhdfooter_destroy(&parent);
+	file_close(&child);
+	if (IS_ERROR(result)) {
+		/* Don't leave a partial image behind. */
+		file_remove(fi, child_path);
+	}
+
+	return result;
+}
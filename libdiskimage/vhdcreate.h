@@ -0,0 +1,15 @@
+#ifndef _VHDCREATE_H_
+#define _VHDCREATE_H_
+
+#include "diskimage.h"
+#include "fileinterface.h"
+
+/*
+ * Creates a new, empty differencing disk at child_path on top of the VHD
+ * at parent_path. Only the footer and dynamic header of the parent are
+ * read, so the time taken does not depend on the amount of data in the
+ * parent. Fails if child_path already exists.
+ */
+LDI_ERROR vhdcreate_child(struct fileinterface *fi, char *parent_path, char *child_path, struct logger logger);
+
+#endif					/* _VHDCREATE_H_ */
@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <uuid.h>
 #include <errno.h>
+#include <time.h>
 
 #include "internal.h"
 #include "log.h"
@@ -28,6 +29,16 @@
 #define UNIQUE_ID_OFFSET 68
 #define SAVED_STATE_OFFSET 84
 
+/* The VHD time stamps count seconds since January 1, 2000 UTC. */
+#define VHD_EPOCH 946684800
+
+/* Identifies footers written by this library. */
+#define CREATOR_APPLICATION "ldi "
+#define CREATOR_VERSION_MAJOR 1
+#define CREATOR_VERSION_MINOR 0
+/* The host os is "Wi2k" or "Mac ". Use the former, as most tools do. */
+#define CREATOR_HOST_OS 0x5769326B
+
 LDI_ERROR	log_footer(struct vhdfooter *footer);
 
 /* Features defined in the footer. */
@@ -144,6 +155,26 @@ get_uuid_string(uuid_t uuid)
 	return uuid_str;
 }
 
+/*
+ * Returns true if source is a footer with the right cookie and checksum.
+ */
+bool
+vhdfooter_valid(void *source)
+{
+	uint8_t *bytes = source;
+	uint32_t sum;
+
+	if (memcmp(bytes + COOKIE_OFFSET, "conectix", 8) != 0) {
+		return false;
+	}
+
+	/* Sum the fields up to the saved state, except for the checksum. */
+	sum = checksum_uint8_array(bytes, SAVED_STATE_OFFSET + 1) -
+	    checksum_uint8_array(bytes + CHECKSUM_OFFSET, 4);
+
+	return ~sum == be32dec(bytes + CHECKSUM_OFFSET);
+}
+
 /*
  * Creates a new vhd footer structure by reading from source.
  */
@@ -168,6 +199,47 @@ vhdfooter_new(void *source, struct vhdfooter **footer, struct logger logger)
 	return NO_ERROR;
 }
 
+/*
+ * Creates the footer for a new differencing disk on top of the disk with
+ * the parent footer. The header of the new disk starts at data_offset.
+ */
+LDI_ERROR
+vhdfooter_new_child(struct vhdfooter *parent, off_t data_offset, struct vhdfooter **footer, struct logger logger)
+{
+	uint32_t status;
+
+	*footer = TESTSEAM(malloc)(sizeof(struct vhdfooter));
+	if (*footer == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+
+	/* The child has the size and geometry of the parent. */
+	**footer = *parent;
+	(*footer)->logger = logger;
+	(*footer)->features = VHD_FEATURES_RESERVED;
+	(*footer)->file_format_version.major = 1;
+	(*footer)->file_format_version.minor = 0;
+	(*footer)->data_offset = data_offset;
+	(*footer)->time_stamp = time(NULL) - VHD_EPOCH;
+	memcpy((*footer)->creator_application, CREATOR_APPLICATION, 5);
+	(*footer)->creator_version.major = CREATOR_VERSION_MAJOR;
+	(*footer)->creator_version.minor = CREATOR_VERSION_MINOR;
+	(*footer)->creator_host_os = CREATOR_HOST_OS;
+	(*footer)->disk_type = VHD_TYPE_DIFFERENCING;
+	(*footer)->saved_state = false;
+
+	uuid_create(&(*footer)->unique_id, &status);
+	if (status != uuid_s_ok) {
+		vhdfooter_destroy(footer);
+		return ERROR(LDI_ERR_UNKNOWN);
+	}
+
+	(*footer)->calculated_checksum = calculate_checksum(*footer);
+	(*footer)->checksum = (*footer)->calculated_checksum;
+
+	return NO_ERROR;
+}
+
 /*
  * Writes the footer to the destination buffer.
  */
@@ -309,3 +381,21 @@ vhdfooter_offset(struct vhdfooter *footer)
 {
 	return footer->data_offset;
 }
+
+/*
+ * Returns the unique id of the disk.
+ */
+void
+vhdfooter_unique_id(struct vhdfooter *footer, uuid_t *unique_id)
+{
+	*unique_id = footer->unique_id;
+}
+
+/*
+ * Returns the time the disk was created.
+ */
+int32_t
+vhdfooter_time_stamp(struct vhdfooter *footer)
+{
+	return footer->time_stamp;
+}
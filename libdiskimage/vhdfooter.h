@@ -4,6 +4,7 @@
 
 #include <sys/types.h>
 #include <stdbool.h>
+#include <uuid.h>
 
 #include "diskimage.h"
 
@@ -19,12 +20,27 @@ enum vhdfooter_status {
 	VHDFOOTER_BADCHECKSUM = 2
 };
 
+/*
+ * Returns true if source, which must hold 512 bytes, is a footer with the
+ * right cookie and checksum.
+ */
+bool
+vhdfooter_valid(void *source);
+
 /*
  * Creates a new vhd footer structure by reading from source.
  */
 LDI_ERROR
 vhdfooter_new(void *source, struct vhdfooter **footer, struct logger logger);
 
+/*
+ * Creates the footer for a new differencing disk on top of the disk with
+ * the parent footer. The new disk gets the size and geometry of the
+ * parent and a new unique id. Its dynamic header starts at data_offset.
+ */
+LDI_ERROR
+vhdfooter_new_child(struct vhdfooter *parent, off_t data_offset, struct vhdfooter **footer, struct logger logger);
+
 /*
  * Writes the footer to the destination buffer.
  */
@@ -61,4 +77,19 @@ vhdfooter_disksize(struct vhdfooter *footer);
 off_t
 vhdfooter_offset(struct vhdfooter *footer);
 
+/*
+ * Returns the unique id of the disk. Differencing disks store the unique
+ * id of their parent in the dynamic header.
+ */
+void
+vhdfooter_unique_id(struct vhdfooter *footer, uuid_t *unique_id);
+
+/*
+ * Returns the time the disk was created, in seconds since January 1, 2000
+ * UTC. Differencing disks store the time stamp of their parent in the
+ * dynamic header.
+ */
+int32_t
+vhdfooter_time_stamp(struct vhdfooter *footer);
+
 #endif					/* VHDFOOTER_H */
@@ -2,8 +2,12 @@
 #include <sys/types.h>
 #include <stdlib.h>
 #include <uuid.h>
+#include <ctype.h>
 #include <errno.h>
 #include <iconv.h>
+#include <langinfo.h>
+#include <stdio.h>
+#include <string.h>
 
 #include "diskimage.h"
 #include "internal.h"
@@ -33,6 +37,9 @@
 #define PARENT_LOCATOR_RESERVED_OFFSET 12
 #define PARENT_LOCATOR_DATA_OFFSET 16
 
+/* The size of the header in the file. */
+#define HEADER_SIZE 1024
+
 struct parent_locator_entry {
 	/* A code describing the parent locator platform. */
 	char	platform_code[5];
@@ -103,21 +110,59 @@ read_parent_locator_entry(uint8_t *source, struct parent_locator_entry *parent_l
 }
 
 /*
- * Converts a UTF16 string to the local charset
+ * Converts a string from the given charset to the local charset. The
+ * result is always NUL terminated, and truncated if it doesn't fit.
  */
-void
-convert_utf16_to_local(char *source, char *destination, size_t count)
+static void
+convert_to_local(char *charset, char *source, size_t source_count, char *destination, size_t destination_count)
 {
 	iconv_t converter;
 	size_t source_left, destination_left;
 
-	converter = iconv_open("", "UTF-16");
-	source_left = count;
-	destination_left = count;
+	converter = iconv_open(nl_langinfo(CODESET), charset);
+	if (converter == (iconv_t)-1) {
+		destination[0] = 0;
+		return;
+	}
+	source_left = source_count;
+	destination_left = destination_count - 1;
+
+	iconv(converter, &source, &source_left, &destination, &destination_left);
+	*destination = 0;
+	iconv_close(converter);
+}
+
+/*
+ * Converts a string in the local charset to the given charset. Returns the
+ * number of bytes written, which is truncated to fit.
+ */
+static size_t
+convert_from_local(char *charset, char *source, char *destination, size_t destination_count)
+{
+	iconv_t converter;
+	size_t source_left, destination_left;
+
+	converter = iconv_open(charset, nl_langinfo(CODESET));
+	if (converter == (iconv_t)-1) {
+		return 0;
+	}
+	source_left = strlen(source);
+	destination_left = destination_count;
 
 	iconv(converter, &source, &source_left, &destination, &destination_left);
-	destination[count] = 0;
 	iconv_close(converter);
+
+	return destination_count - destination_left;
+}
+
+/*
+ * Converts a UTF16 string to the local charset. The VHD format stores
+ * names in big endian UTF16 without a byte order mark.
+ */
+void
+convert_utf16_to_local(char *source, char *destination, size_t count)
+{
+	convert_to_local("UTF-16BE", source, count, destination, count + 1);
 }
 
 /*
@@ -215,6 +260,113 @@ vhd_header_new(void *source, struct vhd_header **header, struct logger logger)
 	return NO_ERROR;
 }
 
+/*
+ * Deallocates the header and sets the pointer to NULL.
+ */
+void
+vhd_header_destroy(struct vhd_header **header)
+{
+	free(*header);
+	*header = NULL;
+}
+
+/*
+ * Creates the header for a new differencing disk, with no parent locator
+ * entries.
+ */
+LDI_ERROR
+vhd_header_new_child(uint64_t table_offset, uint32_t max_table_entries, uint32_t block_size, uuid_t *parent_unique_id, int32_t parent_time_stamp, char *parent_name, struct vhd_header **header, struct logger logger)
+{
+	*header = calloc(1, sizeof(struct vhd_header));
+	if (*header == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	(*header)->logger = logger;
+
+	memcpy((*header)->cookie, "cxsparse", 9);
+	(*header)->data_offset = UINT64_MAX;
+	(*header)->table_offset = table_offset;
+	(*header)->header_version.major = 1;
+	(*header)->header_version.minor = 0;
+	(*header)->max_table_entries = max_table_entries;
+	(*header)->block_size = block_size;
+	(*header)->parent_unique_id = *parent_unique_id;
+	(*header)->parent_time_stamp = parent_time_stamp;
+	convert_from_local("UTF-16BE", parent_name, (*header)->parent_unicode_name, 512);
+	strlcpy((*header)->parent_local_name, parent_name, sizeof((*header)->parent_local_name));
+
+	(*header)->calculated_checksum = calculate_checksum(*header);
+	(*header)->checksum = (*header)->calculated_checksum;
+
+	return NO_ERROR;
+}
+
+/*
+ * Sets a parent locator entry, pointing at data_length bytes of locator
+ * data at data_offset, in data_space reserved bytes.
+ */
+void
+vhd_header_set_parent_locator(struct vhd_header *header, int index, char *platform_code, uint32_t data_space, uint32_t data_length, uint64_t data_offset)
+{
+	struct parent_locator_entry *entry;
+
+	entry = &header->parent_locator_entries[index];
+	memcpy(entry->platform_code, platform_code, 4);
+	entry->platform_code[4] = 0;
+	entry->platform_data_space = data_space;
+	entry->platform_data_length = data_length;
+	bzero(entry->reserved, sizeof(entry->reserved));
+	entry->platform_data_offset = data_offset;
+
+	header->calculated_checksum = calculate_checksum(header);
+	header->checksum = header->calculated_checksum;
+}
+
+/*
+ * Writes a parent locator entry to the destination.
+ */
+static void
+write_parent_locator_entry(struct parent_locator_entry *parent_locator_entry, uint8_t *dest)
+{
+	write_chars(parent_locator_entry->platform_code, dest + PARENT_LOCATOR_CODE_OFFSET, 4);
+	write_uint32(parent_locator_entry->platform_data_space, dest + PARENT_LOCATOR_DATA_SPACE_OFFSET);
+	write_uint32(parent_locator_entry->platform_data_length, dest + PARENT_LOCATOR_DATA_LENGTH_OFFSET);
+	write_chars(parent_locator_entry->reserved, dest + PARENT_LOCATOR_RESERVED_OFFSET, 4);
+	write_uint64(parent_locator_entry->platform_data_offset, dest + PARENT_LOCATOR_DATA_OFFSET);
+}
+
+/*
+ * Writes the header to the destination buffer, which must hold 1024
+ * bytes.
+ */
+LDI_ERROR
+vhd_header_write(struct vhd_header *header, void *dest)
+{
+	uint8_t *bytes = (uint8_t *)dest;
+	int i;
+
+	/* The reserved fields must be zero. */
+	bzero(bytes, HEADER_SIZE);
+
+	write_chars(header->cookie, bytes + COOKIE_OFFSET, 8);
+	write_uint64(header->data_offset, bytes + DATA_OFFSET_OFFSET);
+	write_uint64(header->table_offset, bytes + TABLE_OFFSET_OFFSET);
+	write_version(&header->header_version, bytes + HEADER_VERSION_OFFSET);
+	write_uint32(header->max_table_entries, bytes + MAX_TABLE_ENTRIES_OFFSET);
+	write_uint32(header->block_size, bytes + BLOCK_SIZE_OFFSET);
+	write_uint32(header->calculated_checksum, bytes + CHECKSUM_OFFSET);
+	write_uuid(&header->parent_unique_id, bytes + PARENT_UNIQUE_ID_OFFSET);
+	write_int32(header->parent_time_stamp, bytes + PARENT_TIME_STAMP_OFFSET);
+	write_chars(header->parent_unicode_name, bytes + PARENT_UNICODE_NAME_OFFSET, 512);
+
+	for (i = 0; i < 8; i++) {
+		write_parent_locator_entry(&header->parent_locator_entries[i],
+		    bytes + PARENT_LOCATOR_ENTRIES_OFFSET + i * 24);
+	}
+
+	return NO_ERROR;
+}
+
 /*
  * Writes all the values in the header to the log, for debug purposes.
  */
@@ -302,3 +454,168 @@ vhd_header_block_size(struct vhd_header *header)
 {
 	return header->block_size;
 }
+
+/*
+ * Returns the unique id of the parent of a differencing disk.
+ */
+void
+vhd_header_parent_unique_id(struct vhd_header *header, uuid_t *unique_id)
+{
+	*unique_id = header->parent_unique_id;
+}
+
+/*
+ * Returns the file name of the parent of a differencing disk.
+ */
+char *
+vhd_header_parent_name(struct vhd_header *header)
+{
+	return header->parent_local_name;
+}
+
+/*
+ * Returns the platform code and the location of the data for a parent
+ * locator entry.
+ */
+bool
+vhd_header_parent_locator(struct vhd_header *header, int index, char **platform_code, uint64_t *data_offset, uint32_t *data_length)
+{
+	struct parent_locator_entry *entry;
+
+	entry = &header->parent_locator_entries[index];
+	if (entry->platform_code[0] == 0 || entry->platform_data_length == 0) {
+		return false;
+	}
+
+	*platform_code = entry->platform_code;
+	*data_offset = entry->platform_data_offset;
+	*data_length = entry->platform_data_length;
+
+	return true;
+}
+
+/*
+ * Encodes a path as parent locator data for the platform.
+ */
+char *
+vhd_parent_locator_encode(char *platform_code, char *path, uint32_t *length)
+{
+	char *data, *windows_path, *c;
+	size_t size;
+
+	if (strcmp(platform_code, "W2ru") != 0 && strcmp(platform_code, "W2ku") != 0) {
+		return NULL;
+	}
+
+	/* Windows paths use backslashes, and relative paths start with ".\". */
+	if (path[0] == '/' || strncmp(path, "../", 3) == 0) {
+		windows_path = strdup(path);
+	} else {
+		asprintf(&windows_path, "./%s", path);
+	}
+	if (windows_path == NULL) {
+		return NULL;
+	}
+	for (c = windows_path; *c != 0; c++) {
+		if (*c == '/')
+			*c = '\\';
+	}
+
+	/* Each character is at most 4 bytes in UTF-16. */
+	size = strlen(windows_path) * 4;
+	data = malloc(size);
+	if (data != NULL) {
+		*length = convert_from_local("UTF-16LE", windows_path, data, size);
+		if (*length == 0) {
+			free(data);
+			data = NULL;
+		}
+	}
+	free(windows_path);
+
+	return data;
+}
+
+/*
+ * Decodes a percent encoded file URL in place.
+ */
+static void
+decode_url(char *url)
+{
+	char *source, *destination;
+	unsigned int value;
+
+	for (source = destination = url; *source != 0; source++, destination++) {
+		if (source[0] == '%' && sscanf(source + 1, "%2x", &value) == 1) {
+			*destination = value;
+			source += 2;
+		} else {
+			*destination = *source;
+		}
+	}
+	*destination = 0;
+}
+
+/*
+ * Decodes the data of a parent locator entry into a path.
+ */
+char *
+vhd_parent_locator_decode(char *platform_code, char *data, uint32_t length, bool *relative)
+{
+	char *path, *start, *c;
+	size_t path_size;
+
+	/* UTF-16 can expand to at most 3 bytes for each 2 in UTF-8. */
+	path_size = length * 2 + 1;
+	path = malloc(path_size);
+	if (path == NULL) {
+		return NULL;
+	}
+
+	if (strcmp(platform_code, "W2ru") == 0 || strcmp(platform_code, "W2ku") == 0) {
+		/* Windows paths, in UTF-16 little endian. */
+		convert_to_local("UTF-16LE", data, length, path, path_size);
+	} else if (strcmp(platform_code, "Wi2r") == 0 || strcmp(platform_code, "Wi2k") == 0 ||
+	    strcmp(platform_code, "MacX") == 0) {
+		/* Deprecated Windows paths and file URLs are plain bytes. */
+		memcpy(path, data, length);
+		path[length] = 0;
+	} else {
+		/*
+		 * "Mac " locators contain a Mac OS alias record, which can
+		 * only be resolved on Mac OS.
+		 */
+		free(path);
+		return NULL;
+	}
+
+	start = path;
+	if (platform_code[0] == 'M') {
+		/* A URL such as file://localhost/path/to/parent.vhd */
+		if (strncmp(start, "file://", 7) == 0) {
+			start += 7;
+			if (strncmp(start, "localhost", 9) == 0)
+				start += 9;
+		}
+		decode_url(start);
+	} else {
+		/* Use forward slashes and drop any drive letter. */
+		for (c = start; *c != 0; c++) {
+			if (*c == '\\')
+				*c = '/';
+		}
+		if (isalpha(start[0]) && start[1] == ':')
+			start += 2;
+		while (strncmp(start, "./", 2) == 0)
+			start += 2;
+	}
+
+	*relative = start[0] != '/';
+	memmove(path, start, strlen(start) + 1);
+	if (path[0] == 0) {
+		free(path);
+		return NULL;
+	}
+
+	return path;
+}
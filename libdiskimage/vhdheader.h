@@ -2,6 +2,13 @@
 #ifndef _VHDHEADER_H_
 #define _VHDHEADER_H_
 
+#include <sys/types.h>
+#include <stdbool.h>
+#include <uuid.h>
+
+/* The number of parent locator entries in the header. */
+#define VHD_PARENT_LOCATORS 8
+
 struct vhd_header;
 
 /*
@@ -9,6 +16,30 @@ struct vhd_header;
  */
 LDI_ERROR vhd_header_new(void *source, struct vhd_header **header, struct logger logger);
 
+/*
+ * Deallocates the header and sets the pointer to NULL.
+ */
+void	vhd_header_destroy(struct vhd_header **header);
+
+/*
+ * Creates the header for a new differencing disk. The block allocation
+ * table of max_table_entries entries starts at table_offset. parent_name
+ * is the file name of the parent, in the local charset.
+ */
+LDI_ERROR vhd_header_new_child(uint64_t table_offset, uint32_t max_table_entries, uint32_t block_size, uuid_t *parent_unique_id, int32_t parent_time_stamp, char *parent_name, struct vhd_header **header, struct logger logger);
+
+/*
+ * Sets a parent locator entry, pointing at data_length bytes of locator
+ * data at data_offset, in data_space reserved bytes.
+ */
+void	vhd_header_set_parent_locator(struct vhd_header *header, int index, char *platform_code, uint32_t data_space, uint32_t data_length, uint64_t data_offset);
+
+/*
+ * Writes the header to the destination buffer, which must hold 1024
+ * bytes.
+ */
+LDI_ERROR vhd_header_write(struct vhd_header *header, void *dest);
+
 /*
  * Returns true if the checksum for the header is valid.
  */
@@ -34,4 +65,37 @@ uint32_t vhd_header_max_table_entries(struct vhd_header *header);
  */
 uint32_t vhd_header_block_size(struct vhd_header *header);
 
+/*
+ * Returns the unique id of the parent of a differencing disk.
+ */
+void	vhd_header_parent_unique_id(struct vhd_header *header, uuid_t *unique_id);
+
+/*
+ * Returns the file name of the parent of a differencing disk, converted
+ * to the local charset.
+ */
+char   *vhd_header_parent_name(struct vhd_header *header);
+
+/*
+ * Returns the platform code and the location of the data for a parent
+ * locator entry. Returns false if the entry is not used.
+ */
+bool	vhd_header_parent_locator(struct vhd_header *header, int index, char **platform_code, uint64_t *data_offset, uint32_t *data_length);
+
+/*
+ * Decodes the data of a parent locator entry into a path using '/' as the
+ * separator. relative is set to true if the path is relative to the
+ * directory of the child. Returns NULL if the platform is not supported or
+ * the data can't be decoded. The result must be freed.
+ */
+char   *vhd_parent_locator_decode(char *platform_code, char *data, uint32_t length, bool *relative);
+
+/*
+ * Encodes a path using '/' as the separator into parent locator data for
+ * the platform, the reverse of vhd_parent_locator_decode. Only the "W2ru"
+ * and "W2ku" platforms are supported. Returns NULL on failure. The result
+ * must be freed.
+ */
+char   *vhd_parent_locator_encode(char *platform_code, char *path, uint32_t *length);
+
 #endif					/* _VHDHEADER_H_ */
@@ -1,12 +1,20 @@
 
+#include "holemap.h"
+#include "kernels.h"
 #include "log.h"
+#include "populator.h"
+#include "taskpool.h"
 #include "vhdbat.h"
+#include "vhdchain.h"
 #include "vhdfooter.h"
 #include "vhdheader.h"
 #include "parser.h"
 
 #include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <sys/endian.h>
 #include <sys/mman.h>
 #include <sys/param.h>
 #include <sys/stat.h>
@@ -21,6 +29,11 @@
 
 
 struct vhdinstance {
+	/*
+	 * The file interface used to open the file and any parents. NULL
+	 * for shared parents, which may outlive it.
+	 */
+	struct fileinterface *fi;
 	/* The file descriptor of the opened file. */
 	struct file *file;
 	/* The type of disk. */
@@ -31,34 +44,151 @@ struct vhdinstance {
 	struct vhd_header *header;
 	/* The block allocation table. */
 	struct vhd_bat *bat;
+	/*
+	 * The holes in the file of a fixed disk, which are read as zeros
+	 * without reading the file. NULL for other disk types, for shared
+	 * parents, which are read through the chain of their children, and
+	 * if the holes couldn't be found.
+	 */
+	struct holemap *holes;
+	/* A sector bitmap with all sectors marked as used. */
+	char   *full_bitmap;
+	/*
+	 * The sector bitmaps of the allocated blocks of a differencing
+	 * disk, read the first time the block is used. NULL for other
+	 * disk types.
+	 */
+	uint8_t **bitmaps;
+	/*
+	 * The parent of a differencing disk. Parents are opened read-only
+	 * and shared by all children in the process. The instance belongs
+	 * to the shared file, and the child holds a reference to the file.
+	 */
+	struct vhdinstance *parent;
+	struct file *parent_file;
+	/* The path the parent was opened with. */
+	char   *parent_path;
+	/* True if the instance belongs to a shared file. */
+	bool	shared;
+	/* Protects the lazily read bitmaps of shared parents. */
+	pthread_mutex_t lock;
+	/*
+	 * Copies blocks read from the parents into a differencing disk when
+	 * copy_on_read is enabled.
+	 */
+	struct populator *populator;
+	/* The state of a running commit, or NULL. */
+	struct commit *commit;
+	/*
+	 * True if a checkpoint of an interrupted commit may exist. It only
+	 * tracks writes made during a commit, so it is removed before the
+	 * first write made while no commit runs.
+	 */
+	bool	checkpoint_stale;
+	/*
+	 * The copy_on_read worker and commits use differencing disks from
+	 * other threads, so reads, writes and flushes of them hold io_lock.
+	 */
+	pthread_mutex_t io_lock;
+	/*
+	 * Maps the blocks of a differencing disk directly to the layers of
+	 * the chain that own the data. Created on the first read.
+	 */
+	struct vhdchain *chain;
+	/* The number of differencing disks above this one in the chain. */
+	int	depth;
+	/* True if the in memory BAT has changes not yet written to the file. */
+	bool	bat_dirty;
+	/* True if the footer at the end of the file needs to be rewritten. */
+	bool	footer_dirty;
 	/* Information about the opened file. */
 	size_t	filesize;
+	/* The options the image was opened with. */
+	struct diskimage_options options;
+	/* Counters reported through vhdinstance_stats. */
+	struct diskstats stats;
+	/* The blocks counted in zero_blocks_elided, if any were. */
+	uint8_t *elided_blocks;
 	/* Used for logging. */
 	struct logger logger;
 };
 
 void	vhdinstance_destroy(struct vhdinstance **instance);
+LDI_ERROR vhdinstance_flush(struct vhdinstance *instance);
+static LDI_ERROR populate_block(void *arg, uint32_t block, uint64_t *bytes);
+static LDI_ERROR write_checkpoint(struct vhdinstance *instance);
+static LDI_ERROR checkpoint_path(struct vhdinstance *instance, char **path);
+static LDI_ERROR open_instance(struct fileinterface *fi, struct file *file, struct diskimage_options options, bool shared, int depth, struct vhdinstance **instance, struct logger logger);
+uint32_t get_block_size(struct vhdinstance *instance);
+uint32_t get_block_bitmap_size(struct vhdinstance *instance);
+void	update_block_bitmap(void *destination, int sectors_in_block);
 
 const int SECTOR_SIZE = 512;
 
+/*
+ * A commit of a differencing disk into its parent. Protected by io_lock.
+ */
+struct commit {
+	/* One bit per block, set when the block is written. */
+	uint8_t *dirty;
+	/* The blocks being copied again, after the first pass. */
+	uint8_t *copying;
+	/*
+	 * The first pass has copied all data stored before this offset in
+	 * the file into the parent, and the parent has been flushed.
+	 * UINT64_MAX once the first pass is done.
+	 */
+	uint64_t offset;
+	/* The file that progress is saved to. */
+	char   *checkpoint_path;
+};
+
+/* The default largest number of bytes read at once by a commit. */
+#define COMMIT_BATCH_SIZE (4 * 1024 * 1024)
+
+/* The amount of data copied by a commit between saving progress. */
+#define COMMIT_CHECKPOINT_INTERVAL (256 * 1024 * 1024)
+
+/*
+ * The number of times a commit copies the blocks written while it runs,
+ * before it blocks writes to copy the last of them.
+ */
+#define COMMIT_PASSES 4
+
+/* Identifies the files that commits save progress to. */
+#define COMMIT_MAGIC "ldcommit"
+
+/*
+ * The size of a checkpoint file before the bitmap: the magic, the UUID of
+ * the parent, the size of the differencing disk, the offset of the first
+ * pass and the number of blocks.
+ */
+#define COMMIT_CHECKPOINT_HEADER_SIZE (8 + 16 + 8 + 8 + 4)
+
+/*
+ * The maximum number of differencing disks in a chain. Protects against
+ * parent locators that form a loop.
+ */
+#define MAX_CHAIN_DEPTH 128
+
 /*
  * Reads the dynamic header data from disk.
  */
 LDI_ERROR
 read_dynamic_header(struct vhdinstance *instance)
 {
-	struct filemap *map;
+	char buffer[1024];
 	off_t header_offset;
-	size_t bat_size;
 	LDI_ERROR result;
 
 	header_offset = vhdfooter_offset(instance->footer);
 
-	file_getmap(instance->file, header_offset, header_offset + 1024, &map, instance->logger);
-	result = vhd_header_new(map->pointer, &instance->header, instance->logger);
-	filemap_destroy(&map);
+	result = file_read(instance->file, buffer, sizeof(buffer), header_offset, instance->logger);
+	if (IS_ERROR(result)) {
+		return result;
+	}
 
-	return result;
+	return vhd_header_new(buffer, &instance->header, instance->logger);
 }
 
 /*
@@ -67,7 +197,7 @@ read_dynamic_header(struct vhdinstance *instance)
 LDI_ERROR
 read_bat_data(struct vhdinstance *instance)
 {
-	struct filemap *map;
+	char *buffer;
 	off_t bat_offset;
 	size_t bat_size;
 	LDI_ERROR result;
@@ -75,11 +205,18 @@ read_bat_data(struct vhdinstance *instance)
 	bat_offset = vhd_header_table_offset(instance->header);
 	bat_size = vhd_header_max_table_entries(instance->header);
 
-	file_getmap(instance->file, bat_offset, bat_offset + bat_size * 4, &map, instance->logger);
-	result = vhd_bat_new(map->pointer, &instance->bat, bat_size, instance->logger);
-	filemap_destroy(&map);
+	buffer = malloc(bat_size * 4);
+	if (buffer == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+
+	result = file_read(instance->file, buffer, bat_size * 4, bat_offset, instance->logger);
+	if (!IS_ERROR(result)) {
+		result = vhd_bat_new(buffer, &instance->bat, bat_size, instance->logger);
+	}
+	free(buffer);
 
-	return NO_ERROR;
+	return result;
 }
 
 /*
@@ -100,349 +237,678 @@ read_dynamic_data(struct vhdinstance *instance)
 		 */
 		return result;
 	}
+	/*
+	 * Prepare the bitmap that is written for all blocks, so that
+	 * writes don't have to allocate it.
+	 */
+	instance->full_bitmap = calloc(1, get_block_bitmap_size(instance));
+	if (instance->full_bitmap == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	update_block_bitmap(instance->full_bitmap, get_block_size(instance) / SECTOR_SIZE);
+
 	/* Read BAT and return result. */
 	return read_bat_data(instance);
 }
 
 /*
- * Reads the footer that is available in all VHD types.
+ * Reads a footer structure from the given file offset.
  */
 LDI_ERROR
-read_footer(struct vhdinstance *instance)
+read_footer_at(struct vhdinstance *instance, off_t offset, struct vhdfooter **footer)
 {
-	struct filemap *map;
+	char buffer[512];
 	LDI_ERROR result;
 
-	file_getmap(instance->file, instance->filesize - 512LL, 512, &map, instance->logger);
-	result = vhdfooter_new(map->pointer, &instance->footer, instance->logger);
-	filemap_destroy(&map);
-
-	return result;
-}
-
-/*
- * Reads any format specific data from the file.
- */
-LDI_ERROR
-read_format_specific_data(struct vhdinstance *instance)
-{
-	switch (instance->disk_type) {
-	case DISK_TYPE_FIXED:
-		/* We're done. Just return. */
-		return NO_ERROR;
-	case DISK_TYPE_DYNAMIC:
-		return read_dynamic_data(instance);
-	default:
-		/* Only fixed and dynamic VHDs are supported. */
-		return ERROR(LDI_ERR_FILENOTSUP);
+	result = file_read(instance->file, buffer, sizeof(buffer), offset, instance->logger);
+	if (IS_ERROR(result)) {
+		return result;
 	}
+
+	return vhdfooter_new(buffer, footer, instance->logger);
 }
 
 /*
- * Creates the instance state.
+ * Reads the footer that is available in all VHD types.
  */
 LDI_ERROR
-vhdinstance_new(struct fileinterface *fi, char *path, struct vhdinstance **instance, struct logger logger)
+read_footer(struct vhdinstance *instance)
 {
+	struct vhdfooter *copy;
 	LDI_ERROR result;
-	struct file *file;
 
-	/* Open the backing file. */
-	result = file_open(fi, path, &file);
-	if (IS_ERROR(result)) {
+	result = read_footer_at(instance, instance->filesize - 512LL, &instance->footer);
+	if (IS_ERROR(result) ||
+	    (vhdfooter_getstatus(instance->footer) & VHDFOOTER_BADCOOKIE) == 0) {
 		return result;
 	}
 
-	errno = 0;
-	*instance = malloc((unsigned int)sizeof(struct vhdinstance));
-	if (instance == NULL) {
-		return ERROR(LDI_ERR_NOMEM);
-	}
-	(*instance)->file = file;
-
-	result = file_getsize(file, &(*instance)->filesize);
+	/*
+	 * The footer at the end of the file is missing, which happens if
+	 * the file was extended with a new block but the image was never
+	 * flushed. Dynamic disks keep a copy of the footer at the start of
+	 * the file, so try to use that instead.
+	 */
+	result = read_footer_at(instance, 0, &copy);
 	if (IS_ERROR(result)) {
-		vhdinstance_destroy(instance);
 		return result;
 	}
-
-	(*instance)->logger = logger;
-	/* Set pointers to NULL as default. */
-	(*instance)->footer = NULL;
-	(*instance)->header = NULL;
-	(*instance)->bat = NULL;
-
-	/* Read the footer */
-	result = read_footer(*instance);
-
-	if (IS_ERROR(result)) {
-		/* We couldn't read the footer. Clean up and return. */
-		vhdinstance_destroy(instance);
-		return result;
+	if (vhdfooter_getstatus(copy) != VHDFOOTER_OK ||
+	    vhdfooter_getdisktype(copy) == DISK_TYPE_FIXED) {
+		/* No usable copy. Keep the original footer. */
+		vhdfooter_destroy(&copy);
+		return NO_ERROR;
 	}
-	(*instance)->disk_type = vhdfooter_getdisktype((*instance)->footer);
 
-	result = read_format_specific_data((*instance));
-	if (IS_ERROR(result)) {
-		/*
-		 * Something went wrong when reading the format specific
-		 * data.
-		 */
-		vhdinstance_destroy(instance);
-	}
-	return result;
+	LOG_WARNING(instance->logger, "Footer missing, using the copy at the start of the file.\n");
+	vhdfooter_destroy(&instance->footer);
+	instance->footer = copy;
+	/*
+	 * Put the footer back at the end of the file on the next flush.
+	 * Shared parents are read-only, and are left as they are.
+	 */
+	instance->footer_dirty = !instance->shared;
+
+	return NO_ERROR;
 }
 
 /*
- * Deallocates the instance state and sets the pointer to NULL.
+ * Returns the offset in the file after the headers, the BAT, the parent
+ * locators and all allocated blocks of a dynamic or differencing disk.
  */
-void
-vhdinstance_destroy(struct vhdinstance **instance)
+static uint64_t
+data_end(struct vhdinstance *instance)
 {
-
-	/* Close the file. */
-	file_close(&((*instance))->file);
-
-	if ((*instance)->footer) {
-		vhdfooter_destroy(&(*instance)->footer);
+	uint64_t end, data_offset;
+	uint32_t numblocks, block_offset, data_length, i;
+	char *code;
+
+	numblocks = vhd_header_max_table_entries(instance->header);
+	end = MAX(vhdfooter_offset(instance->footer) + 1024,
+	    vhd_header_table_offset(instance->header) +
+	    roundup2((uint64_t)numblocks * 4, SECTOR_SIZE));
+	for (i = 0; i < VHD_PARENT_LOCATORS; i++) {
+		if (vhd_header_parent_locator(instance->header, i, &code, &data_offset,
+		    &data_length)) {
+			end = MAX(end, data_offset + data_length);
+		}
 	}
-	free(*instance);
-	*instance = NULL;
+	for (i = 0; i < numblocks; i++) {
+		block_offset = vhd_bat_get_block_offset(instance->bat, i);
+		if (block_offset != -1) {
+			end = MAX(end, (uint64_t)block_offset * SECTOR_SIZE +
+			    get_block_bitmap_size(instance) + get_block_size(instance));
+		}
+	}
+
+	return end;
 }
 
 /*
- * Returns a diskinfo struct with properties for the disk.
+ * Makes room for the footer that read_footer found missing. A file that
+ * was extended but never flushed has zeros where the footer goes, but a
+ * truncated file ends with data, so the file is extended to put the
+ * footer after it.
  */
-struct diskinfo
-vhdinstance_diskinfo(struct vhdinstance *instance)
+static LDI_ERROR
+place_footer(struct vhdinstance *instance)
 {
-	struct diskinfo result;
-
-	result.disksize = vhdfooter_disksize(instance->footer);
+	uint64_t end;
+	LDI_ERROR result;
 
-	return result;
-}
+	end = roundup2(data_end(instance), SECTOR_SIZE);
+	if (end + 512 <= instance->filesize) {
+		return NO_ERROR;
+	}
 
-/*
- * Reads data from a raw file (not disk) offset.
- */
-LDI_ERROR
-read_from_raw_offset(struct file *file, char *buf, size_t nbytes, off_t offset, struct logger logger)
-{
-	struct filemap *map;
+	LOG_WARNING(instance->logger, "The file is truncated, adding the footer after the data.\n");
+	result = file_setsize(instance->file, end + 512);
+	if (IS_ERROR(result)) {
+		/* Never write the footer over the data. */
+		instance->footer_dirty = false;
+		return result;
+	}
 
-	file_getmap(file, offset, nbytes, &map, logger);
-	memcpy(buf, map->pointer, nbytes);
-	filemap_destroy(&map);
-	return NO_ERROR;
+	return file_getsize(instance->file, &instance->filesize);
 }
 
 /*
- * Reads data from a fixed disk.
+ * The logger of shared parents, which may outlive the logger of the child
+ * that opened them.
  */
-LDI_ERROR
-read_fixed(struct vhdinstance *instance, char *buf, size_t nbytes, off_t offset)
+static void
+discard_log_write(int level, void *privarg, char *fmt,...)
 {
-	return read_from_raw_offset(instance->file, buf, nbytes, offset, instance->logger);
 }
 
 /*
- * Returns the block size (in number of sectors) for the VHD file.
+ * Destroys a shared parent when the last reference to its file is closed.
  */
-uint32_t
-get_block_size(struct vhdinstance *instance)
+static void
+destroy_shared(void *object)
 {
-	return vhd_header_block_size(instance->header);
+	struct vhdinstance *instance = object;
+
+	vhdinstance_destroy(&instance);
 }
 
 /*
- * Returns the size (in bytes) of the sector bitmap that exists
- * at the beginning of each block.
+ * Tries to open path as the parent of a differencing disk. Relative paths
+ * are resolved against the directory of the child. The parent is only
+ * used if its unique id is the one the child was created from.
  */
-uint32_t
-get_block_bitmap_size(struct vhdinstance *instance)
+static LDI_ERROR
+try_parent(struct vhdinstance *instance, char *directory, char *path, bool relative)
 {
-	uint32_t block_bitmap_size, sectors_per_block;
+	struct vhdinstance *parent, *shared;
+	struct file *file;
+	uuid_t expected, actual;
+	char *fullpath;
+	LDI_ERROR result;
 
-	sectors_per_block = get_block_size(instance) / SECTOR_SIZE;
+	if (relative) {
+		result = fileinterface_getpath(instance->fi, directory, path, &fullpath);
+		if (IS_ERROR(result)) {
+			return result;
+		}
+	} else {
+		fullpath = strdup(path);
+		if (fullpath == NULL) {
+			return ERROR(LDI_ERR_NOMEM);
+		}
+	}
 
-	/* One bit is used for each sector. */
-	block_bitmap_size = sectors_per_block / 8;
+	LOG_VERBOSE(instance->logger, "Trying parent %s\n", fullpath);
+	result = file_open_shared(instance->fi, fullpath, &file);
+	if (IS_ERROR(result)) {
+		free(fullpath);
+		return result;
+	}
 
-	/* The bitmap is padded to fill the last sector. */
-	block_bitmap_size = block_bitmap_size +
-	    (SECTOR_SIZE - block_bitmap_size % SECTOR_SIZE) % SECTOR_SIZE;
+	/* Only parse the parent if no other child already has. */
+	parent = file_shared_object(file);
+	if (parent == NULL) {
+		result = open_instance(instance->fi, file, instance->options, true,
+		    instance->depth + 1, &parent, instance->logger);
+		if (IS_ERROR(result)) {
+			free(fullpath);
+			file_close(&file);
+			return result;
+		}
+		shared = file_share_object(file, parent, destroy_shared);
+		if (shared != parent) {
+			/* Another thread opened the same parent. */
+			vhdinstance_destroy(&parent);
+			parent = shared;
+		}
+	}
 
-	return block_bitmap_size;
-}
+	vhd_header_parent_unique_id(instance->header, &expected);
+	vhdfooter_unique_id(parent->footer, &actual);
+	if (!uuid_equal(&expected, &actual, NULL)) {
+		LOG_WARNING(instance->logger, "Ignoring parent %s, the unique id does not match.\n", fullpath);
+		free(fullpath);
+		file_close(&file);
+		return ERROR(LDI_ERR_PARENTNOTFOUND);
+	}
+
+	instance->parent = parent;
+	instance->parent_file = file;
+	instance->parent_path = fullpath;
 
+	return NO_ERROR;
+}
 
 /*
- * Reads data from a dynamic VHD.
+ * Finds and opens the parent of a differencing disk. The parent locator
+ * entries are tried in order, and last the parent name from the header in
+ * the directory of the child.
  */
-LDI_ERROR
-read_dynamic(struct vhdinstance *instance, char *buf, size_t nbytes, off_t offset)
+static LDI_ERROR
+open_parent(struct vhdinstance *instance)
 {
-	int block, bytes_to_read, bytes_left_in_block;
-	uint32_t block_offset, block_size, block_bitmap_size;
-	uint64_t file_offset;
+	char *code, *data, *path, *name, *directory;
+	uint64_t data_offset;
+	uint32_t data_length;
+	bool relative;
+	int i;
 	LDI_ERROR result;
 
-	/*
-	 * The dynamic VHD is split into blocks. Each block can be mapped to
-	 * an offset in the file, or be set to -1 to indicate that it is
-	 * unused. In that case, we treat it as filled with zeros.
-	 */
-	block_size = get_block_size(instance);
-	block_bitmap_size = get_block_bitmap_size(instance);
+	if (instance->depth >= MAX_CHAIN_DEPTH) {
+		LOG_ERROR(instance->logger, "The chain of differencing disks is too long.\n");
+		return ERROR(LDI_ERR_PARSEERROR);
+	}
 
-	/* Loop until there is nothing more to read. */
-	while (nbytes > 0) {
-		/* Calculate the block number. */
-		block = offset / block_size;
+	directory = file_getdirectory(instance->file);
+	if (directory == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
 
-		/* Get the block offset in the file (in number of sectors). */
-		block_offset = vhd_bat_get_block_offset(instance->bat, block);
+	result = ERROR(LDI_ERR_PARENTNOTFOUND);
+	for (i = 0; i < VHD_PARENT_LOCATORS && instance->parent == NULL; i++) {
+		if (!vhd_header_parent_locator(instance->header, i, &code, &data_offset, &data_length)) {
+			continue;
+		}
 
-		/* Calculate the number of bytes remaining in the block. */
-		bytes_left_in_block = block_size - offset % block_size;
-		/*
-		 * If nbytes is larger than bytes_left_in_block, the read will
-		 * continue in the next loop iteration with the next block.
-		 */
-		bytes_to_read = MIN(bytes_left_in_block, nbytes);
+		data = malloc(data_length);
+		if (data == NULL) {
+			result = ERROR(LDI_ERR_NOMEM);
+			break;
+		}
+		path = NULL;
+		result = file_read(instance->file, data, data_length, data_offset, instance->logger);
+		if (!IS_ERROR(result)) {
+			path = vhd_parent_locator_decode(code, data, data_length, &relative);
+		}
+		free(data);
+		if (path == NULL) {
+			LOG_VERBOSE(instance->logger, "Skipping parent locator %d (%s).\n", i, code);
+			continue;
+		}
 
-		if (block_offset == -1) {
+		result = try_parent(instance, directory, path, relative);
+		if (IS_ERROR(result) && result.code != LDI_ERR_NOMEM && !relative) {
 			/*
-			 * This block is not yet allocated, which means that
-			 * it is all zeros.
+			 * Absolute paths are often from the machine that
+			 * created the image. Look for the same file name
+			 * next to the child.
 			 */
-			bzero(buf, bytes_to_read);
-		} else {
-			/* Calculate the actual file offset to read at. */
-			file_offset = block_offset * SECTOR_SIZE + block_bitmap_size + offset % block_size;
-
-			/* Do the actual read. */
-			result = read_from_raw_offset(instance->file, buf, bytes_to_read, file_offset, instance->logger);
-			if (IS_ERROR(result)) {
-				return result;
-			}
+			name = strrchr(path, '/');
+			result = try_parent(instance, directory, name + 1, true);
 		}
+		free(path);
+		if (result.code == LDI_ERR_NOMEM) {
+			break;
+		}
+	}
 
-		/* update offset, buf and nbytes */
-		buf += bytes_to_read;
-		nbytes -= bytes_to_read;
-		offset += bytes_to_read;
+	if (instance->parent == NULL && result.code != LDI_ERR_NOMEM) {
+		result = try_parent(instance, directory,
+		    vhd_header_parent_name(instance->header), true);
+	}
+	free(directory);
+
+	if (instance->parent == NULL) {
+		LOG_ERROR(instance->logger, "Could not find the parent %s.\n",
+		    vhd_header_parent_name(instance->header));
+		if (result.code != LDI_ERR_NOMEM) {
+			result = ERROR(LDI_ERR_PARENTNOTFOUND);
+		}
+		return result;
 	}
 
 	return NO_ERROR;
 }
 
 /*
- * Reads nbytes at offset into the buffer.
+ * Reads all the extra data needed for differencing disks, and opens the
+ * parent.
  */
 LDI_ERROR
-vhdinstance_read(void *instance, char *buf, size_t nbytes, off_t offset)
+read_differencing_data(struct vhdinstance *instance)
 {
-	struct vhdinstance *vhdinstance = (struct vhdinstance *)instance;
+	LDI_ERROR result;
 
-	switch (vhdinstance->disk_type) {
-	case DISK_TYPE_FIXED:
-		return read_fixed(vhdinstance, buf, nbytes, offset);
-	case DISK_TYPE_DYNAMIC:
-		return read_dynamic(vhdinstance, buf, nbytes, offset);
-	default:
-		/* Should not happen. */
-		return ERROR(LDI_ERR_FILENOTSUP);
+	/* The layout is the same as for dynamic disks. */
+	result = read_dynamic_data(instance);
+	if (IS_ERROR(result)) {
+		return result;
 	}
+
+	instance->bitmaps = calloc(vhd_header_max_table_entries(instance->header), sizeof(uint8_t *));
+	if (instance->bitmaps == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+
+	return open_parent(instance);
 }
 
 /*
- * Writes nbytes of data at offset from the buffer to the VHD.
+ * Finds the holes in a fixed disk, which are usually sparse files. Reads
+ * work without them, so failing to find them is not an error.
  */
 LDI_ERROR
-write_fixed(struct vhdinstance *instance, char *buf, size_t nbytes, off_t offset)
+read_fixed_data(struct vhdinstance *instance)
 {
-	struct filemap *map;
+	LDI_ERROR result;
+
+	if (instance->shared) {
+		return NO_ERROR;
+	}
 
-	file_getmap(instance->file, offset, nbytes, &map, instance->logger);
-	memcpy(map->pointer, buf, nbytes);
-	filemap_destroy(&map);
+	result = holemap_create(instance->file, vhdfooter_disksize(instance->footer),
+	    &instance->holes);
+	if (IS_ERROR(result)) {
+		LOG_WARNING(instance->logger, "Failed to find the holes in the fixed disk.\n");
+		instance->holes = NULL;
+	}
 
 	return NO_ERROR;
 }
 
-
 /*
- * Extends a dynamic VHD with space for an extra block.
- * Does not update the block allocation table.
+ * Reads any format specific data from the file.
  */
 LDI_ERROR
-extend_file(struct vhdinstance *instance)
+read_format_specific_data(struct vhdinstance *instance)
 {
-	size_t old_size, extension_size, new_size;
-	struct filemap *map;
-	LDI_ERROR res;
+	switch (instance->disk_type) {
+	case DISK_TYPE_FIXED:
+		return read_fixed_data(instance);
+	case DISK_TYPE_DYNAMIC:
+		return read_dynamic_data(instance);
+	case DISK_TYPE_DIFFERENCING:
+		return read_differencing_data(instance);
+	default:
+		return ERROR(LDI_ERR_FILENOTSUP);
+	}
+}
 
-	old_size = instance->filesize;
+/*
+ * Creates the instance for the image in the opened file. Shared instances
+ * are parents of differencing disks, with depth counting the number of
+ * children above them. The file of a shared instance is not closed when
+ * the instance is destroyed.
+ */
+static LDI_ERROR
+open_instance(struct fileinterface *fi, struct file *file, struct diskimage_options options, bool shared, int depth, struct vhdinstance **instance, struct logger logger)
+{
+	LDI_ERROR result;
 
-	/* Write blocksize + sector_bitmap_size zeros. */
-	extension_size = get_block_size(instance) + get_block_bitmap_size(instance);
-	new_size = old_size + extension_size;
+	errno = 0;
+	*instance = malloc((unsigned int)sizeof(struct vhdinstance));
+	if (*instance == NULL) {
+		if (!shared) {
+			file_close(&file);
+		}
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	(*instance)->fi = fi;
+	(*instance)->file = file;
+	(*instance)->holes = NULL;
+	(*instance)->full_bitmap = NULL;
+	(*instance)->bitmaps = NULL;
+	(*instance)->parent = NULL;
+	(*instance)->parent_file = NULL;
+	(*instance)->parent_path = NULL;
+	(*instance)->commit = NULL;
+	(*instance)->checkpoint_stale = !shared;
+	(*instance)->shared = shared;
+	pthread_mutex_init(&(*instance)->lock, NULL);
+	(*instance)->populator = NULL;
+	pthread_mutex_init(&(*instance)->io_lock, NULL);
+	(*instance)->chain = NULL;
+	(*instance)->depth = depth;
+	(*instance)->bat_dirty = false;
+	(*instance)->footer_dirty = false;
+	(*instance)->logger = logger;
+	(*instance)->options = options;
+	bzero(&(*instance)->stats, sizeof((*instance)->stats));
+	(*instance)->elided_blocks = NULL;
+	/* Set pointers to NULL as default. */
+	(*instance)->footer = NULL;
+	(*instance)->header = NULL;
+	(*instance)->bat = NULL;
 
-	res = file_setsize(instance->file, new_size);
-	if (IS_ERROR(res)) {
-		return res;
+	result = file_getsize(file, &(*instance)->filesize);
+	if (IS_ERROR(result)) {
+		vhdinstance_destroy(instance);
+		return result;
 	}
 
-	/* Write a new footer at the end. */
-	file_getmap(instance->file, new_size - 512, 512, &map, instance->logger);
-	vhdfooter_write(instance->footer, map->pointer);
-	filemap_destroy(&map);
+	/* Read the footer */
+	result = read_footer(*instance);
 
-	/* Zero out the old footer. */
-	file_getmap(instance->file, old_size - 512, 512, &map, instance->logger);;
-	bzero(map->pointer, 512);
-	filemap_destroy(&map);
+	if (IS_ERROR(result)) {
+		/* We couldn't read the footer. Clean up and return. */
+		vhdinstance_destroy(instance);
+		return result;
+	}
+	(*instance)->disk_type = vhdfooter_getdisktype((*instance)->footer);
 
-	/* Update instance->filesize now that the size is updated. */
-	res = file_getsize(instance->file, &instance->filesize);
-	if (IS_ERROR(res)) {
-		return res;
+	result = read_format_specific_data((*instance));
+	if (!IS_ERROR(result) && (*instance)->footer_dirty) {
+		result = place_footer(*instance);
+	}
+	if (IS_ERROR(result)) {
+		/*
+		 * Something went wrong when reading the format specific
+		 * data.
+		 */
+		vhdinstance_destroy(instance);
+		return result;
+	}
+
+	if (shared) {
+		/*
+		 * The parent may outlive the child that opened it, along with
+		 * its file interface and logger.
+		 */
+		(*instance)->fi = NULL;
+		(*instance)->logger.write = discard_log_write;
+		(*instance)->logger.privarg = NULL;
 	}
 
 	return NO_ERROR;
 }
 
 /*
- * Updates the sector bitmap for a block
+ * Creates the instance state.
+ */
+LDI_ERROR
+vhdinstance_new(struct fileinterface *fi, char *path, struct diskimage_options options, struct vhdinstance **instance, struct logger logger)
+{
+	struct file *file;
+	LDI_ERROR result;
+
+	result = file_open(fi, path, &file);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	result = open_instance(fi, file, options, false, 0, instance, logger);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	if (options.copy_on_read && (*instance)->disk_type == DISK_TYPE_DIFFERENCING) {
+		result = populator_create(vhd_header_max_table_entries((*instance)->header),
+		    get_block_size(*instance), options.copy_on_read_rate,
+		    populate_block, *instance, &(*instance)->populator);
+		if (IS_ERROR(result)) {
+			vhdinstance_destroy(instance);
+		}
+	}
+
+	return result;
+}
+
+/*
+ * Deallocates the instance state and sets the pointer to NULL.
  */
 void
-update_block_bitmap(void *destination, int sectors_in_block)
+vhdinstance_destroy(struct vhdinstance **instance)
 {
-	char *bytes = destination;
+	uint32_t i;
 
-	while (sectors_in_block > 0) {
-		*bytes = 0xF;
+	/* Stop copying blocks before anything is torn down. */
+	if ((*instance)->populator) {
+		populator_destroy(&(*instance)->populator);
+	}
 
-		bytes++;
-		sectors_in_block -= 8;
+	/*
+	 * Make sure that all metadata is written before closing the file.
+	 * Shared parents are never written.
+	 */
+	if (!(*instance)->shared && ((*instance)->bat_dirty || (*instance)->footer_dirty)) {
+		vhdinstance_flush(*instance);
+	}
+
+	/* Close the file, unless it belongs to the shared file. */
+	if (!(*instance)->shared) {
+		file_close(&((*instance))->file);
+	}
+
+	if ((*instance)->footer) {
+		vhdfooter_destroy(&(*instance)->footer);
+	}
+	if ((*instance)->bitmaps) {
+		for (i = 0; i < vhd_header_max_table_entries((*instance)->header); i++) {
+			free((*instance)->bitmaps[i]);
+		}
+		free((*instance)->bitmaps);
+	}
+	if ((*instance)->holes) {
+		holemap_destroy(&(*instance)->holes);
+	}
+	if ((*instance)->header) {
+		vhd_header_destroy(&(*instance)->header);
+	}
+	if ((*instance)->chain) {
+		vhdchain_destroy(&(*instance)->chain);
+	}
+	if ((*instance)->parent_file) {
+		/* The parent is destroyed with the last reference. */
+		file_close(&(*instance)->parent_file);
+	}
+	free((*instance)->parent_path);
+	pthread_mutex_destroy(&(*instance)->io_lock);
+	pthread_mutex_destroy(&(*instance)->lock);
+	free((*instance)->full_bitmap);
+	free((*instance)->elided_blocks);
+	free(*instance);
+	*instance = NULL;
+}
+
+/*
+ * Returns a diskinfo struct with properties for the disk.
+ */
+struct diskinfo
+vhdinstance_diskinfo(struct vhdinstance *instance)
+{
+	struct diskinfo result;
+
+	result.disksize = vhdfooter_disksize(instance->footer);
+
+	return result;
+}
+
+/*
+ * Serializes access to the instance with the copy_on_read worker and
+ * commits.
+ */
+static void
+lock_io(struct vhdinstance *instance)
+{
+	pthread_mutex_lock(&instance->io_lock);
+}
+
+static void
+unlock_io(struct vhdinstance *instance)
+{
+	pthread_mutex_unlock(&instance->io_lock);
+}
+
+/*
+ * Adds the counters collected by the instance to stats.
+ */
+void
+vhdinstance_stats(struct vhdinstance *instance, struct diskstats *stats)
+{
+	lock_io(instance);
+	stats->zero_bytes_elided += instance->stats.zero_bytes_elided;
+	stats->zero_blocks_elided += instance->stats.zero_blocks_elided;
+	stats->populated_bytes += instance->stats.populated_bytes;
+	unlock_io(instance);
+}
+
+/*
+ * Reads data from a raw file (not disk) offset.
+ */
+LDI_ERROR
+read_from_raw_offset(struct file *file, char *buf, size_t nbytes, off_t offset, struct logger logger)
+{
+	return file_read(file, buf, nbytes, offset, logger);
+}
+
+/*
+ * Reads data from a fixed disk. Holes in the file are zeroed without
+ * reading them.
+ */
+LDI_ERROR
+read_fixed(struct vhdinstance *instance, char *buf, size_t nbytes, off_t offset)
+{
+	size_t	length;
+	off_t	end;
+	bool	hole;
+	LDI_ERROR result;
+
+	if (instance->holes == NULL) {
+		return read_from_raw_offset(instance->file, buf, nbytes, offset, instance->logger);
+	}
+
+	while (nbytes > 0) {
+		holemap_find(instance->holes, offset, &hole, &end);
+		length = MIN((uint64_t)(end - offset), nbytes);
+
+		if (hole) {
+			memset(buf, 0, length);
+		} else {
+			result = read_from_raw_offset(instance->file, buf, length, offset,
+			    instance->logger);
+			if (IS_ERROR(result)) {
+				return result;
+			}
+		}
+
+		buf += length;
+		offset += length;
+		nbytes -= length;
 	}
+
+	return NO_ERROR;
 }
 
 /*
- * Writes nbytes of data at offset from the buffer to a dynamic VHD.
+ * Returns the block size (in number of sectors) for the VHD file.
+ */
+uint32_t
+get_block_size(struct vhdinstance *instance)
+{
+	return vhd_header_block_size(instance->header);
+}
+
+/*
+ * Returns the size (in bytes) of the sector bitmap that exists
+ * at the beginning of each block.
+ */
+uint32_t
+get_block_bitmap_size(struct vhdinstance *instance)
+{
+	uint32_t block_bitmap_size, sectors_per_block;
+
+	sectors_per_block = get_block_size(instance) / SECTOR_SIZE;
+
+	/* One bit is used for each sector. */
+	block_bitmap_size = sectors_per_block / 8;
+
+	/* The bitmap is padded to fill the last sector. */
+	block_bitmap_size = block_bitmap_size +
+	    (SECTOR_SIZE - block_bitmap_size % SECTOR_SIZE) % SECTOR_SIZE;
+
+	return block_bitmap_size;
+}
+
+
+/*
+ * Reads data from a dynamic VHD.
  */
 LDI_ERROR
-write_dynamic(struct vhdinstance *instance, char *buf, size_t nbytes, off_t offset)
+read_dynamic(struct vhdinstance *instance, char *buf, size_t nbytes, off_t offset)
 {
-	struct filemap *map;
-	const int sector_size = 512;
-	int block, bytes_to_write, bytes_left_in_block, sectors_per_block;
-	uint32_t block_offset, block_size, block_bitmap_size, offset_in_block;
+	int block, bytes_to_read, bytes_left_in_block;
+	uint32_t block_offset, block_size, block_bitmap_size;
 	uint64_t file_offset;
-	size_t original_file_size, bat_size;
-	off_t bat_offset;
 	LDI_ERROR result;
 
 	/*
@@ -453,8 +919,8 @@ write_dynamic(struct vhdinstance *instance, char *buf, size_t nbytes, off_t offs
 	block_size = get_block_size(instance);
 	block_bitmap_size = get_block_bitmap_size(instance);
 
+	/* Loop until there is nothing more to read. */
 	while (nbytes > 0) {
-
 		/* Calculate the block number. */
 		block = offset / block_size;
 
@@ -467,82 +933,1599 @@ write_dynamic(struct vhdinstance *instance, char *buf, size_t nbytes, off_t offs
 		 * If nbytes is larger than bytes_left_in_block, the read will
 		 * continue in the next loop iteration with the next block.
 		 */
-		bytes_to_write = MIN(bytes_left_in_block, nbytes);
+		bytes_to_read = MIN(bytes_left_in_block, nbytes);
 
 		if (block_offset == -1) {
-			/* This block is not yet allocated. */
-
-			original_file_size = instance->filesize;
-
 			/*
-			 * Make room for the new block by extending the
-			 * file.
-			 */
-			extend_file(instance);
-
-			/*
-			 * Update the BAT. The footer has been moved to the
-			 * end of the extended file. The new block starts
-			 * where the old footer started.
+			 * This block is not yet allocated, which means that
+			 * it is all zeros.
 			 */
-			block_offset = original_file_size / 512 - 1;
-			vhd_bat_add_block(instance->bat, block, block_offset);
-
-			bat_offset = vhd_header_table_offset(instance->header);
-			bat_size = vhd_header_max_table_entries(instance->header);
-
-			file_getmap(instance->file, bat_offset, bat_offset + bat_size * 4, &map, instance->logger);
-			vhd_bat_write(instance->bat, map->pointer);
-			filemap_destroy(&map);
+			bzero(buf, bytes_to_read);
+		} else {
+			/* Calculate the actual file offset to read at. */
+			file_offset = block_offset * SECTOR_SIZE + block_bitmap_size + offset % block_size;
 
+			/* Do the actual read. */
+			result = read_from_raw_offset(instance->file, buf, bytes_to_read, file_offset, instance->logger);
+			if (IS_ERROR(result)) {
+				return result;
+			}
 		}
-		offset_in_block = offset % block_size;
-
-		/* Do the actual write. */
-		file_getmap(instance->file, block_offset * SECTOR_SIZE + block_bitmap_size + offset_in_block, bytes_to_write, &map, instance->logger);
-		memcpy(map->pointer, buf, bytes_to_write);
-		filemap_destroy(&map);
 
+		/* update offset, buf and nbytes */
+		buf += bytes_to_read;
+		nbytes -= bytes_to_read;
+		offset += bytes_to_read;
+	}
 
-		/*
-		 * Update the sector bitmap. This indicates which sectors in
-		 * the block have data in them. Ideally this can be used to
-		 * do some optimization during read. This is not what we do
-		 * below. Instead, we indicate that all sectors in the block
-		 * have data in them if one of them have. This is probably
-		 * not ideal, but seems to be what VirtualBox does.
-		 */
-		file_getmap(instance->file, block_offset * SECTOR_SIZE, block_bitmap_size, &map, instance->logger);
-		sectors_per_block = get_block_size(instance) / SECTOR_SIZE;
-		update_block_bitmap(map->pointer, sectors_per_block);
-		filemap_destroy(&map);
+	return NO_ERROR;
+}
 
-		/* update offset, buf and nbytes */
-		buf += bytes_to_write;
-		nbytes -= bytes_to_write;
-		offset += bytes_to_write;
+/*
+ * Returns true if the sector is marked as present in the sector bitmap.
+ * The first sector of the block is the most significant bit of the first
+ * byte.
+ */
+static inline bool
+sector_isset(const uint8_t *bitmap, uint32_t sector)
+{
+	return (bitmap[sector / 8] & (0x80 >> (sector % 8))) != 0;
+}
+
+/*
+ * Marks the sectors covering length bytes at offset_in_block as present.
+ * Returns true if any of them were not already marked.
+ */
+static bool
+set_sectors(uint8_t *bitmap, uint32_t offset_in_block, size_t length)
+{
+	uint32_t sector, last;
+	bool changed = false;
+
+	last = (offset_in_block + length - 1) / SECTOR_SIZE;
+	for (sector = offset_in_block / SECTOR_SIZE; sector <= last; sector++) {
+		if (!sector_isset(bitmap, sector)) {
+			bitmap[sector / 8] |= 0x80 >> (sector % 8);
+			changed = true;
+		}
+	}
+
+	return changed;
+}
+
+/*
+ * Returns the number of bytes, at most nbytes, starting at offset_in_block
+ * that are in sectors with the same presence as the first sector. The
+ * presence is returned in present.
+ */
+static size_t
+sector_run(const uint8_t *bitmap, uint32_t offset_in_block, size_t nbytes, bool *present)
+{
+	uint32_t sector;
+	uint8_t same;
+	size_t length;
+
+	sector = offset_in_block / SECTOR_SIZE;
+	*present = sector_isset(bitmap, sector);
+	same = *present ? 0xFF : 0;
+
+	length = SECTOR_SIZE - offset_in_block % SECTOR_SIZE;
+	sector++;
+	while (length < nbytes) {
+		if (sector % 8 == 0 && bitmap[sector / 8] == same) {
+			/* Skip whole bytes of the bitmap. */
+			length += 8 * SECTOR_SIZE;
+			sector += 8;
+		} else if (sector_isset(bitmap, sector) == *present) {
+			length += SECTOR_SIZE;
+			sector++;
+		} else {
+			break;
+		}
 	}
 
+	return MIN(length, nbytes);
+}
+
+/*
+ * Returns the sector bitmap of an allocated block in a differencing disk.
+ * The bitmap is read from the file the first time and then kept in memory.
+ * Shared parents are used by several children at once, so the bitmap is
+ * read into a new buffer and only then published under the lock.
+ */
+static LDI_ERROR
+get_sector_bitmap(struct vhdinstance *instance, int block, uint32_t block_offset, uint8_t **bitmap)
+{
+	uint32_t block_bitmap_size;
+	uint8_t *buffer;
+	LDI_ERROR result;
+
+	pthread_mutex_lock(&instance->lock);
+	*bitmap = instance->bitmaps[block];
+	pthread_mutex_unlock(&instance->lock);
+	if (*bitmap != NULL) {
+		return NO_ERROR;
+	}
+
+	block_bitmap_size = get_block_bitmap_size(instance);
+	buffer = malloc(block_bitmap_size);
+	if (buffer == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	result = file_read(instance->file, buffer, block_bitmap_size,
+	    (off_t)block_offset * SECTOR_SIZE, instance->logger);
+	if (IS_ERROR(result)) {
+		free(buffer);
+		return result;
+	}
+
+	pthread_mutex_lock(&instance->lock);
+	if (instance->bitmaps[block] == NULL) {
+		instance->bitmaps[block] = buffer;
+	} else {
+		/* Another child read it first. */
+		free(buffer);
+	}
+	*bitmap = instance->bitmaps[block];
+	pthread_mutex_unlock(&instance->lock);
+
 	return NO_ERROR;
+}
+
+/*
+ * Adds a run of count sectors, owned by layer, to the block of the chain
+ * index. sector is relative to the start of the disk.
+ */
+static LDI_ERROR
+add_run(struct vhdinstance *top, uint32_t block, uint64_t sector, uint32_t count, struct vhdinstance *layer, uint64_t file_offset)
+{
+	struct vhdchain_run run;
+	uint32_t sectors_per_block;
 
+	sectors_per_block = get_block_size(top) / SECTOR_SIZE;
+
+	run.sector = sector - (uint64_t)block * sectors_per_block;
+	run.count = count;
+	run.layer = layer;
+	run.file_offset = file_offset;
+
+	return vhdchain_append(top->chain, block, run);
 }
 
 /*
- * Writes nbytes from the buffer into the diskimage at the specified offset.
+ * Adds the runs for count sectors starting at sector in the layer to the
+ * block of the chain index of top. Sectors that the layer doesn't contain
+ * are resolved in its parent. The in memory BAT of each layer is an exact
+ * summary of its allocated blocks, so layers that don't have the block
+ * are skipped without any I/O.
+ */
+static LDI_ERROR
+resolve_sectors(struct vhdinstance *top, uint32_t block, struct vhdinstance *layer, uint64_t sector, uint32_t count)
+{
+	uint32_t sectors_per_block, layer_block, block_offset, in_block, n, m, run, zeros;
+	uint64_t layer_sectors, data_offset;
+	uint8_t *bitmap;
+	bool present;
+	LDI_ERROR result;
+
+	/* Sectors beyond the end of a smaller parent read as zeros. */
+	layer_sectors = vhdfooter_disksize(layer->footer) / SECTOR_SIZE;
+	zeros = 0;
+	if (sector + count > layer_sectors) {
+		zeros = sector < layer_sectors ? sector + count - layer_sectors : count;
+		count -= zeros;
+	}
+
+	/* Fixed disks have no header, and are mapped in one run. */
+	sectors_per_block = layer->disk_type == DISK_TYPE_FIXED ? 0 :
+	    get_block_size(layer) / SECTOR_SIZE;
+	result = NO_ERROR;
+	while (!IS_ERROR(result) && count > 0) {
+		if (layer->disk_type == DISK_TYPE_FIXED) {
+			result = add_run(top, block, sector, count, layer, sector * SECTOR_SIZE);
+			sector += count;
+			break;
+		}
+
+		layer_block = sector / sectors_per_block;
+		in_block = sector % sectors_per_block;
+		n = MIN(count, sectors_per_block - in_block);
+		block_offset = vhd_bat_get_block_offset(layer->bat, layer_block);
+		data_offset = (uint64_t)block_offset * SECTOR_SIZE +
+		    get_block_bitmap_size(layer) + (uint64_t)in_block * SECTOR_SIZE;
+
+		if (block_offset == -1 && layer->disk_type == DISK_TYPE_DIFFERENCING) {
+			result = resolve_sectors(top, block, layer->parent, sector, n);
+		} else if (block_offset == -1) {
+			result = add_run(top, block, sector, n, NULL, 0);
+		} else if (layer->disk_type == DISK_TYPE_DYNAMIC) {
+			result = add_run(top, block, sector, n, layer, data_offset);
+		} else {
+			/* Split the range on the sector bitmap. */
+			result = get_sector_bitmap(layer, layer_block, block_offset, &bitmap);
+			for (m = 0; !IS_ERROR(result) && m < n; m += run) {
+				run = sector_run(bitmap, (in_block + m) * SECTOR_SIZE,
+				    (n - m) * SECTOR_SIZE, &present) / SECTOR_SIZE;
+				if (present) {
+					result = add_run(top, block, sector + m, run, layer,
+					    data_offset + (uint64_t)m * SECTOR_SIZE);
+				} else {
+					result = resolve_sectors(top, block, layer->parent,
+					    sector + m, run);
+				}
+			}
+		}
+
+		sector += n;
+		count -= n;
+	}
+	if (IS_ERROR(result) || zeros == 0) {
+		return result;
+	}
+
+	return add_run(top, block, sector, zeros, NULL, 0);
+}
+/*
+ * Resolves all sectors of a block of a differencing disk in the chain
+ * index.
+ */
+static LDI_ERROR
+resolve_block(struct vhdinstance *instance, uint32_t block)
+{
+	uint32_t sectors_per_block;
+	LDI_ERROR result;
+
+	sectors_per_block = get_block_size(instance) / SECTOR_SIZE;
+	result = resolve_sectors(instance, block, instance,
+	    (uint64_t)block * sectors_per_block, sectors_per_block);
+	vhdchain_resolved(instance->chain, block, !IS_ERROR(result));
+
+	return result;
+}
+
+/*
+ * Reads data from a differencing VHD. Each block is resolved once into
+ * runs of sectors that map directly to the layer of the chain that owns
+ * them, so reads don't walk the chain.
  */
 LDI_ERROR
-vhdinstance_write(void *instance, char *buf, size_t nbytes, off_t offset)
+read_differencing(struct vhdinstance *instance, char *buf, size_t nbytes, off_t offset)
+{
+	struct vhdchain_run *run;
+	struct vhdinstance *layer;
+	uint32_t block, block_size, offset_in_block;
+	size_t length;
+	LDI_ERROR result;
+
+	block_size = get_block_size(instance);
+
+	if (instance->chain == NULL) {
+		result = vhdchain_new(vhd_header_max_table_entries(instance->header),
+		    block_size / SECTOR_SIZE, &instance->chain);
+		if (IS_ERROR(result)) {
+			return result;
+		}
+	}
+
+	while (nbytes > 0) {
+		block = offset / block_size;
+		offset_in_block = offset % block_size;
+
+		run = vhdchain_lookup(instance->chain, block, offset_in_block / SECTOR_SIZE);
+		if (run == NULL) {
+			result = resolve_block(instance, block);
+			if (IS_ERROR(result)) {
+				return result;
+			}
+			run = vhdchain_lookup(instance->chain, block, offset_in_block / SECTOR_SIZE);
+		}
+
+		length = MIN((uint64_t)(run->sector + run->count) * SECTOR_SIZE - offset_in_block, nbytes);
+		layer = run->layer;
+		if (layer != NULL && layer != instance && instance->populator != NULL) {
+			/* Copy the block so that the next read is local. */
+			populator_queue(instance->populator, block);
+		}
+		if (layer == NULL) {
+			bzero(buf, length);
+		} else {
+			result = file_read(layer->file, buf, length, run->file_offset +
+			    offset_in_block - (uint64_t)run->sector * SECTOR_SIZE, instance->logger);
+			if (IS_ERROR(result)) {
+				return result;
+			}
+		}
+
+		buf += length;
+		nbytes -= length;
+		offset += length;
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Reads nbytes at offset into the buffer.
+ */
+LDI_ERROR
+vhdinstance_read(void *instance, char *buf, size_t nbytes, off_t offset)
 {
 	struct vhdinstance *vhdinstance = (struct vhdinstance *)instance;
+	LDI_ERROR result;
 
 	switch (vhdinstance->disk_type) {
 	case DISK_TYPE_FIXED:
-		return write_fixed(vhdinstance, buf, nbytes, offset);
+		return read_fixed(vhdinstance, buf, nbytes, offset);
 	case DISK_TYPE_DYNAMIC:
-		return write_dynamic(vhdinstance, buf, nbytes, offset);
+		return read_dynamic(vhdinstance, buf, nbytes, offset);
+	case DISK_TYPE_DIFFERENCING:
+		lock_io(vhdinstance);
+		result = read_differencing(vhdinstance, buf, nbytes, offset);
+		unlock_io(vhdinstance);
+		return result;
 	default:
 		/* Should not happen. */
 		return ERROR(LDI_ERR_FILENOTSUP);
 	}
 }
 
+/*
+ * Writes nbytes of data at offset from the buffer to the VHD.
+ */
+LDI_ERROR
+write_fixed(struct vhdinstance *instance, char *buf, size_t nbytes, off_t offset)
+{
+	if (instance->holes != NULL) {
+		holemap_fill(instance->holes, offset, nbytes);
+	}
+
+	return file_write(instance->file, buf, nbytes, offset, instance->logger);
+}
+
+
+/*
+ * Extends a dynamic VHD with space for an extra block.
+ * Does not update the block allocation table.
+ */
+LDI_ERROR
+extend_file(struct vhdinstance *instance)
+{
+	size_t old_size, extension_size, new_size;
+	char zeros[512];
+	LDI_ERROR res;
+
+	old_size = instance->filesize;
+
+	/* Write blocksize + sector_bitmap_size zeros. */
+	extension_size = get_block_size(instance) + get_block_bitmap_size(instance);
+	new_size = old_size + extension_size;
+
+	res = file_setsize(instance->file, new_size);
+	if (IS_ERROR(res)) {
+		return res;
+	}
+
+	/*
+	 * The new footer is written at the end of the file when the image
+	 * is flushed, after the BAT that references the new block.
+	 */
+	instance->footer_dirty = true;
+
+	/* Zero out the old footer. */
+	bzero(zeros, sizeof(zeros));
+	res = file_write(instance->file, zeros, sizeof(zeros), old_size - 512, instance->logger);
+	if (IS_ERROR(res)) {
+		return res;
+	}
+
+	/* Update instance->filesize now that the size is updated. */
+	res = file_getsize(instance->file, &instance->filesize);
+	if (IS_ERROR(res)) {
+		return res;
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Allocates a new block at the end of the file and adds it to the BAT.
+ * The new block, including the sector bitmap, is filled with zeros.
+ */
+static LDI_ERROR
+allocate_block(struct vhdinstance *instance, int block, uint32_t *block_offset)
+{
+	size_t original_file_size;
+	LDI_ERROR result;
+
+	original_file_size = instance->filesize;
+
+	/* Make room for the new block by extending the file. */
+	result = extend_file(instance);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	/*
+	 * Update the BAT. The footer has been moved to the end of the
+	 * extended file. The new block starts where the old footer started.
+	 */
+	*block_offset = original_file_size / 512 - 1;
+	vhd_bat_add_block(instance->bat, block, *block_offset);
+
+	/*
+	 * The BAT is written on the next flush, after the data and the
+	 * sector bitmap of the block.
+	 */
+	instance->bat_dirty = true;
+
+	return NO_ERROR;
+}
+
+/*
+ * Updates the sector bitmap for a block
+ */
+void
+update_block_bitmap(void *destination, int sectors_in_block)
+{
+	char *bytes = destination;
+
+	while (sectors_in_block > 0) {
+		*bytes = 0xFF;
+
+		bytes++;
+		sectors_in_block -= 8;
+	}
+}
+
+/*
+ * Counts a block whose allocation was avoided by zero elision, unless it
+ * was counted before.
+ */
+static void
+count_elided_block(struct vhdinstance *instance, int block)
+{
+	if (instance->elided_blocks == NULL) {
+		instance->elided_blocks =
+		    calloc(vhd_header_max_table_entries(instance->header) / 8 + 1, 1);
+		if (instance->elided_blocks == NULL) {
+			/* The counter is only informational. */
+			return;
+		}
+	}
+	if ((instance->elided_blocks[block / 8] & (1 << (block % 8))) == 0) {
+		instance->elided_blocks[block / 8] |= 1 << (block % 8);
+		instance->stats.zero_blocks_elided++;
+	}
+}
+
+/*
+ * Writes nbytes of data at offset from the buffer to a dynamic VHD.
+ */
+LDI_ERROR
+write_dynamic(struct vhdinstance *instance, char *buf, size_t nbytes, off_t offset)
+{
+	const int sector_size = 512;
+	int block, bytes_to_write, bytes_left_in_block;
+	uint32_t block_offset, block_size, block_bitmap_size, offset_in_block;
+	uint64_t file_offset;
+	size_t data_length, zero_prefix, zero_suffix;
+	char *data;
+	LDI_ERROR result;
+
+	/*
+	 * The dynamic VHD is split into blocks. Each block can be mapped to
+	 * an offset in the file, or be set to -1 to indicate that it is
+	 * unused. In that case, we treat it as filled with zeros.
+	 */
+	block_size = get_block_size(instance);
+	block_bitmap_size = get_block_bitmap_size(instance);
+
+	while (nbytes > 0) {
+
+		/* Calculate the block number. */
+		block = offset / block_size;
+
+		/* Get the block offset in the file (in number of sectors). */
+		block_offset = vhd_bat_get_block_offset(instance->bat, block);
+
+		/* Calculate the number of bytes remaining in the block. */
+		bytes_left_in_block = block_size - offset % block_size;
+		/*
+		 * If nbytes is larger than bytes_left_in_block, the read will
+		 * continue in the next loop iteration with the next block.
+		 */
+		bytes_to_write = MIN(bytes_left_in_block, nbytes);
+
+		if (block_offset == -1 && instance->options.zero_elision &&
+		    kernel_iszero(buf, bytes_to_write)) {
+			/*
+			 * An unallocated block already reads as zeros, so
+			 * there is no need to allocate it just to store
+			 * zeros in it.
+			 */
+			instance->stats.zero_bytes_elided += bytes_to_write;
+			count_elided_block(instance, block);
+
+			buf += bytes_to_write;
+			nbytes -= bytes_to_write;
+			offset += bytes_to_write;
+			continue;
+		}
+		offset_in_block = offset % block_size;
+		data = buf;
+		data_length = bytes_to_write;
+
+		if (block_offset == -1) {
+			/* This block is not yet allocated. */
+			result = allocate_block(instance, block, &block_offset);
+			if (IS_ERROR(result)) {
+				return result;
+			}
+
+			if (instance->options.zero_elision) {
+				/*
+				 * The new block is filled with zeros, so
+				 * whole zero sectors at the start and the
+				 * end of the data do not need to be written.
+				 */
+				zero_prefix = kernel_zero_prefix(data, data_length);
+				zero_prefix -= zero_prefix % SECTOR_SIZE;
+				data += zero_prefix;
+				data_length -= zero_prefix;
+				offset_in_block += zero_prefix;
+
+				zero_suffix = kernel_zero_suffix(data, data_length);
+				zero_suffix -= zero_suffix % SECTOR_SIZE;
+				data_length -= zero_suffix;
+
+				instance->stats.zero_bytes_elided += zero_prefix + zero_suffix;
+			}
+		}
+
+		/* Do the actual write. */
+		result = file_write(instance->file, data, data_length, block_offset * SECTOR_SIZE + block_bitmap_size + offset_in_block, instance->logger);
+		if (IS_ERROR(result)) {
+			return result;
+		}
+
+		/*
+		 * Update the sector bitmap. This indicates which sectors in
+		 * the block have data in them. Ideally this can be used to
+		 * do some optimization during read. This is not what we do
+		 * below. Instead, we indicate that all sectors in the block
+		 * have data in them if one of them have. This is probably
+		 * not ideal, but seems to be what VirtualBox does.
+		 */
+		result = file_write(instance->file, instance->full_bitmap, block_bitmap_size, block_offset * SECTOR_SIZE, instance->logger);
+		if (IS_ERROR(result)) {
+			return result;
+		}
+
+		/* update offset, buf and nbytes */
+		buf += bytes_to_write;
+		nbytes -= bytes_to_write;
+		offset += bytes_to_write;
+	}
+
+	return NO_ERROR;
+
+}
+
+/*
+ * Removes the checkpoint of an interrupted commit, if there is one, before
+ * the disk is written without the writes being tracked.
+ */
+static LDI_ERROR
+remove_checkpoint(struct vhdinstance *instance)
+{
+	char *path;
+	LDI_ERROR result;
+
+	result = checkpoint_path(instance, &path);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+	if (!IS_ERROR(file_remove(instance->fi, path))) {
+		LOG_VERBOSE(instance->logger, "Removed the checkpoint of an interrupted commit.\n");
+	}
+	free(path);
+	instance->checkpoint_stale = false;
+
+	return NO_ERROR;
+}
+
+/*
+ * Writes nbytes of data at offset from the buffer to a differencing VHD.
+ * Blocks are allocated in the child on the first write. Sectors that are
+ * only partially written, and not yet present in the child, are filled in
+ * with the rest of the sector from the parent.
+ */
+LDI_ERROR
+write_differencing(struct vhdinstance *instance, char *buf, size_t nbytes, off_t offset)
+{
+	struct vhdchain_run run;
+	char sector_buffer[512];
+	uint32_t block, block_offset, block_size, block_bitmap_size, offset_in_block;
+	size_t bytes_to_write, length, skip;
+	uint64_t data_offset;
+	uint8_t *bitmap;
+	bool bitmap_dirty;
+	LDI_ERROR result;
+
+	block_size = get_block_size(instance);
+	block_bitmap_size = get_block_bitmap_size(instance);
+
+	if (instance->commit == NULL && instance->checkpoint_stale) {
+		result = remove_checkpoint(instance);
+		if (IS_ERROR(result)) {
+			return result;
+		}
+	}
+
+	while (nbytes > 0) {
+		block = offset / block_size;
+		block_offset = vhd_bat_get_block_offset(instance->bat, block);
+		offset_in_block = offset % block_size;
+		bytes_to_write = MIN(block_size - offset_in_block, nbytes);
+
+		if (block_offset == -1) {
+			result = allocate_block(instance, block, &block_offset);
+			if (IS_ERROR(result)) {
+				return result;
+			}
+			/* No sectors of the new block are present yet. */
+			instance->bitmaps[block] = calloc(1, block_bitmap_size);
+			if (instance->bitmaps[block] == NULL) {
+				return ERROR(LDI_ERR_NOMEM);
+			}
+		}
+		result = get_sector_bitmap(instance, block, block_offset, &bitmap);
+		if (IS_ERROR(result)) {
+			return result;
+		}
+
+		data_offset = (uint64_t)block_offset * SECTOR_SIZE + block_bitmap_size;
+		bitmap_dirty = false;
+
+		while (bytes_to_write > 0) {
+			skip = offset_in_block % SECTOR_SIZE;
+
+			if (skip != 0 || bytes_to_write < SECTOR_SIZE) {
+				/* A partial sector. */
+				length = MIN(SECTOR_SIZE - skip, bytes_to_write);
+			} else {
+				/* As many whole sectors as possible. */
+				length = bytes_to_write - bytes_to_write % SECTOR_SIZE;
+			}
+
+			if (length < SECTOR_SIZE &&
+			    !sector_isset(bitmap, offset_in_block / SECTOR_SIZE)) {
+				/* Copy the rest of the sector from the parent. */
+				result = read_differencing(instance, sector_buffer,
+				    SECTOR_SIZE, offset - skip);
+				if (IS_ERROR(result)) {
+					return result;
+				}
+				memcpy(sector_buffer + skip, buf, length);
+				result = file_write(instance->file, sector_buffer, SECTOR_SIZE,
+				    data_offset + offset_in_block - skip, instance->logger);
+			} else {
+				result = file_write(instance->file, buf, length,
+				    data_offset + offset_in_block, instance->logger);
+			}
+			if (IS_ERROR(result)) {
+				return result;
+			}
+
+			if (set_sectors(bitmap, offset_in_block, length)) {
+				bitmap_dirty = true;
+			}
+			if (instance->chain != NULL) {
+				/* The sectors are now read from the child. */
+				run.sector = offset_in_block / SECTOR_SIZE;
+				run.count = (skip + length + SECTOR_SIZE - 1) / SECTOR_SIZE;
+				run.layer = instance;
+				run.file_offset = data_offset + (uint64_t)run.sector * SECTOR_SIZE;
+				result = vhdchain_assign(instance->chain, block, run);
+				if (IS_ERROR(result)) {
+					return result;
+				}
+			}
+
+			/* update offset, buf and nbytes */
+			buf += length;
+			nbytes -= length;
+			offset += length;
+			offset_in_block += length;
+			bytes_to_write -= length;
+		}
+
+		if (instance->commit != NULL) {
+			/* Copy the block again. */
+			instance->commit->dirty[block / 8] |= 1 << (block % 8);
+		}
+
+		if (bitmap_dirty) {
+			/*
+			 * The bitmap is written after the data, so sectors
+			 * are never marked as present before they are.
+			 */
+			result = file_write(instance->file, bitmap, block_bitmap_size,
+			    (off_t)block_offset * SECTOR_SIZE, instance->logger);
+			if (IS_ERROR(result)) {
+				return result;
+			}
+		}
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Copies a block of a differencing disk from its parents into the disk.
+ * Sectors already present in the disk are left alone. Called by the
+ * copy_on_read worker.
+ */
+static LDI_ERROR
+populate_block(void *arg, uint32_t block, uint64_t *bytes)
+{
+	struct vhdinstance *instance = arg;
+	uint32_t block_size, block_offset, offset_in_block;
+	uint64_t offset, disksize;
+	size_t length, run;
+	uint8_t *bitmap;
+	bool present;
+	char *buffer;
+	LDI_ERROR result;
+
+	block_size = get_block_size(instance);
+	disksize = vhdfooter_disksize(instance->footer);
+	offset = (uint64_t)block * block_size;
+	length = MIN(block_size, disksize - offset);
+	*bytes = 0;
+
+	buffer = malloc(block_size);
+	if (buffer == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+
+	pthread_mutex_lock(&instance->io_lock);
+	result = read_differencing(instance, buffer, length, offset);
+
+	bitmap = NULL;
+	block_offset = vhd_bat_get_block_offset(instance->bat, block);
+	if (!IS_ERROR(result) && block_offset != -1) {
+		result = get_sector_bitmap(instance, block, block_offset, &bitmap);
+	}
+
+	/* Only write the runs of sectors the disk doesn't have. */
+	for (offset_in_block = 0; !IS_ERROR(result) && offset_in_block < length;
+	    offset_in_block += run) {
+		if (bitmap == NULL) {
+			run = length;
+			present = false;
+		} else {
+			run = sector_run(bitmap, offset_in_block, length - offset_in_block, &present);
+		}
+		if (!present) {
+			result = write_differencing(instance, buffer + offset_in_block,
+			    run, offset + offset_in_block);
+			if (!IS_ERROR(result)) {
+				*bytes += run;
+			}
+		}
+	}
+	instance->stats.populated_bytes += *bytes;
+	pthread_mutex_unlock(&instance->io_lock);
+
+	if (IS_ERROR(result)) {
+		LOG_WARNING(instance->logger, "Could not copy block %u from the parent.\n", block);
+	}
+	free(buffer);
+
+	return result;
+}
+
+/*
+ * Writes nbytes from the buffer at offset, without taking the io_lock.
+ */
+static LDI_ERROR
+write_instance(struct vhdinstance *instance, char *buf, size_t nbytes, off_t offset)
+{
+	switch (instance->disk_type) {
+	case DISK_TYPE_FIXED:
+		return write_fixed(instance, buf, nbytes, offset);
+	case DISK_TYPE_DYNAMIC:
+		return write_dynamic(instance, buf, nbytes, offset);
+	case DISK_TYPE_DIFFERENCING:
+		return write_differencing(instance, buf, nbytes, offset);
+	default:
+		/* Should not happen. */
+		return ERROR(LDI_ERR_FILENOTSUP);
+	}
+}
+
+/*
+ * Writes nbytes from the buffer into the diskimage at the specified offset.
+ */
+LDI_ERROR
+vhdinstance_write(void *instance, char *buf, size_t nbytes, off_t offset)
+{
+	struct vhdinstance *vhdinstance = (struct vhdinstance *)instance;
+	LDI_ERROR result;
+
+	if (vhdinstance->disk_type != DISK_TYPE_DIFFERENCING) {
+		return write_instance(vhdinstance, buf, nbytes, offset);
+	}
+
+	lock_io(vhdinstance);
+	result = write_instance(vhdinstance, buf, nbytes, offset);
+	unlock_io(vhdinstance);
+
+	return result;
+}
+
+/*
+ * Writes the in memory BAT to the file.
+ */
+static LDI_ERROR
+write_bat(struct vhdinstance *instance)
+{
+	char *buffer;
+	off_t bat_offset;
+	size_t bat_size;
+	LDI_ERROR res;
+
+	bat_offset = vhd_header_table_offset(instance->header);
+	bat_size = vhd_header_max_table_entries(instance->header);
+
+	buffer = malloc(bat_size * 4);
+	if (buffer == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	vhd_bat_write(instance->bat, buffer);
+	res = file_write(instance->file, buffer, bat_size * 4, bat_offset, instance->logger);
+	free(buffer);
+
+	return res;
+}
+
+/*
+ * Writes the footer to the end of the file.
+ */
+static LDI_ERROR
+write_footer(struct vhdinstance *instance)
+{
+	char buffer[512];
+
+	vhdfooter_write(instance->footer, buffer);
+
+	return file_write(instance->file, buffer, sizeof(buffer), instance->filesize - 512, instance->logger);
+}
+
+/*
+ * Makes all data written to the instance durable. Metadata is written in
+ * an order that keeps the file consistent if the flush is interrupted:
+ * block data and sector bitmaps first, then the BAT that references the
+ * blocks, and last the footer at the end of the extended file.
+ */
+static LDI_ERROR
+flush_instance(struct vhdinstance *instance)
+{
+	LDI_ERROR res;
+
+	/* Data and sector bitmaps. */
+	res = TESTSEAM(file_sync)(instance->file);
+	if (IS_ERROR(res)) {
+		return res;
+	}
+
+	if (instance->bat_dirty) {
+		res = write_bat(instance);
+		if (IS_ERROR(res)) {
+			return res;
+		}
+		res = TESTSEAM(file_sync)(instance->file);
+		if (IS_ERROR(res)) {
+			return res;
+		}
+		instance->bat_dirty = false;
+	}
+
+	if (instance->footer_dirty) {
+		res = write_footer(instance);
+		if (IS_ERROR(res)) {
+			return res;
+		}
+		res = TESTSEAM(file_sync)(instance->file);
+		if (IS_ERROR(res)) {
+			return res;
+		}
+		instance->footer_dirty = false;
+	}
+
+	if (instance->commit != NULL) {
+		/*
+		 * Blocks written before the flush must be copied by a
+		 * commit that is interrupted and started again.
+		 */
+		return write_checkpoint(instance);
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Makes all data written to the instance durable.
+ */
+LDI_ERROR
+vhdinstance_flush(struct vhdinstance *instance)
+{
+	LDI_ERROR res;
+
+	lock_io(instance);
+	res = flush_instance(instance);
+	unlock_io(instance);
+
+	return res;
+}
+
+/*
+ * A run of data in a differencing disk that a commit copies into the
+ * parent.
+ */
+struct commit_extent {
+	/* The offset of the data in the disk. */
+	uint64_t offset;
+	/* The offset of the data in the file. */
+	uint64_t file_offset;
+	uint32_t length;
+};
+
+/*
+ * A pass of a commit over a set of blocks. The extents are sorted by their
+ * offset in the file, and grouped into batches that are read at once.
+ */
+struct commit_job {
+	struct vhdinstance *child;
+	struct vhdinstance *target;
+	struct commit_extent *extents;
+	size_t	nextents;
+	/* The index of the first extent of each batch, and nextents. */
+	size_t *batches;
+	size_t	nbatches;
+	size_t	batch_size;
+	/* True if the caller holds the io_lock of the child. */
+	bool	locked;
+	/* Which batches have been copied, and how many in a row from 0. */
+	bool   *done;
+	size_t	done_prefix;
+	/* Protects done and done_prefix. */
+	pthread_mutex_t lock;
+};
+
+/*
+ * A block to copy and its offset in the file, for sorting.
+ */
+struct commit_block {
+	uint32_t block;
+	uint32_t block_offset;
+};
+
+/*
+ * Orders blocks by their offset in the file.
+ */
+static int
+compare_blocks(const void *a, const void *b)
+{
+	const struct commit_block *x = a, *y = b;
+
+	return (x->block_offset > y->block_offset) - (x->block_offset < y->block_offset);
+}
+
+/*
+ * Adds an extent to the job, split so that no extent is larger than a
+ * batch.
+ */
+static LDI_ERROR
+add_extent(struct commit_job *job, size_t *capacity, uint64_t offset, uint64_t file_offset, size_t length)
+{
+	struct commit_extent *extents;
+	size_t part;
+
+	while (length > 0) {
+		if (job->nextents == *capacity) {
+			*capacity = *capacity == 0 ? 64 : *capacity * 2;
+			extents = realloc(job->extents, *capacity * sizeof(struct commit_extent));
+			if (extents == NULL) {
+				return ERROR(LDI_ERR_NOMEM);
+			}
+			job->extents = extents;
+		}
+		part = MIN(length, job->batch_size);
+		job->extents[job->nextents].offset = offset;
+		job->extents[job->nextents].file_offset = file_offset;
+		job->extents[job->nextents].length = part;
+		job->nextents++;
+
+		offset += part;
+		file_offset += part;
+		length -= part;
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Collects the data of the blocks set in blocks, or of all blocks if it is
+ * NULL, that is stored at or after from in the file. Must be called with
+ * the io_lock of the child held.
+ */
+static LDI_ERROR
+build_job(struct commit_job *job, uint8_t *blocks, uint64_t from)
+{
+	struct vhdinstance *child = job->child;
+	struct commit_block *list;
+	uint32_t numblocks, block_size, block_offset, nblocks, i;
+	uint64_t start, end, file_offset, disksize;
+	size_t capacity, pos, run, length, first, b;
+	uint8_t *bitmap;
+	bool present;
+	LDI_ERROR result;
+
+	numblocks = vhd_header_max_table_entries(child->header);
+	block_size = get_block_size(child);
+	disksize = vhdfooter_disksize(child->footer);
+
+	list = malloc(numblocks * sizeof(struct commit_block));
+	if (list == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	nblocks = 0;
+	for (i = 0; i < numblocks; i++) {
+		block_offset = vhd_bat_get_block_offset(child->bat, i);
+		if (block_offset == -1 ||
+		    (blocks != NULL && (blocks[i / 8] & (1 << (i % 8))) == 0)) {
+			continue;
+		}
+		list[nblocks].block = i;
+		list[nblocks].block_offset = block_offset;
+		nblocks++;
+	}
+	/* Copy in the order the data is stored in the file. */
+	qsort(list, nblocks, sizeof(struct commit_block), compare_blocks);
+
+	capacity = 0;
+	result = NO_ERROR;
+	for (i = 0; i < nblocks && !IS_ERROR(result); i++) {
+		result = get_sector_bitmap(child, list[i].block, list[i].block_offset, &bitmap);
+		start = (uint64_t)list[i].block * block_size;
+		length = MIN(block_size, disksize - start);
+		file_offset = (uint64_t)list[i].block_offset * SECTOR_SIZE +
+		    get_block_bitmap_size(child);
+
+		for (pos = 0; !IS_ERROR(result) && pos < length; pos += run) {
+			run = sector_run(bitmap, pos, length - pos, &present);
+			end = file_offset + pos + run;
+			if (!present || end <= from) {
+				continue;
+			}
+			/* Skip the part that an earlier commit copied. */
+			first = from > file_offset + pos ? from - (file_offset + pos) : 0;
+			result = add_extent(job, &capacity, start + pos + first,
+			    file_offset + pos + first, run - first);
+		}
+	}
+	free(list);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	/* Group extents that are close in the file into batches. */
+	job->batches = malloc((job->nextents + 1) * sizeof(size_t));
+	job->done = calloc(job->nextents + 1, sizeof(bool));
+	if (job->batches == NULL || job->done == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	job->nbatches = 0;
+	for (b = 0; b < job->nextents; b++) {
+		if (b == 0 || job->extents[b].file_offset + job->extents[b].length -
+		    job->extents[job->batches[job->nbatches - 1]].file_offset > job->batch_size) {
+			job->batches[job->nbatches++] = b;
+		}
+	}
+	job->batches[job->nbatches] = job->nextents;
+
+	return NO_ERROR;
+}
+
+/*
+ * Frees the extents and batches of the job.
+ */
+static void
+free_job(struct commit_job *job)
+{
+	free(job->extents);
+	free(job->batches);
+	free(job->done);
+	pthread_mutex_destroy(&job->lock);
+}
+
+/*
+ * Reads a batch from the child with a single read, and writes its
+ * extents to the parent. The workers of a commit write to the parent at
+ * the same time, so the writes hold the io_lock of the parent, which
+ * serializes block allocation in all types of disks.
+ */
+static LDI_ERROR
+copy_batch(struct commit_job *job, size_t index, char *buffer)
+{
+	struct commit_extent *first, *last, *e;
+	LDI_ERROR result;
+
+	first = &job->extents[job->batches[index]];
+	last = &job->extents[job->batches[index + 1] - 1];
+
+	if (!job->locked) {
+		lock_io(job->child);
+	}
+	result = file_read(job->child->file, buffer,
+	    last->file_offset + last->length - first->file_offset,
+	    first->file_offset, job->child->logger);
+	if (!job->locked) {
+		unlock_io(job->child);
+	}
+
+	lock_io(job->target);
+	for (e = first; e <= last && !IS_ERROR(result); e++) {
+		result = write_instance(job->target,
+		    buffer + (e->file_offset - first->file_offset), e->length, e->offset);
+	}
+	unlock_io(job->target);
+
+	return result;
+}
+
+/*
+ * A task of the worker pool of a commit, which copies a batch and records
+ * that it is done.
+ */
+static LDI_ERROR
+copy_task(void *arg, size_t index, char *buffer)
+{
+	struct commit_job *job = arg;
+	LDI_ERROR result;
+
+	result = copy_batch(job, index, buffer);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	pthread_mutex_lock(&job->lock);
+	job->done[index] = true;
+	while (job->done_prefix < job->nbatches && job->done[job->done_prefix]) {
+		job->done_prefix++;
+	}
+	pthread_mutex_unlock(&job->lock);
+
+	return NO_ERROR;
+}
+
+/*
+ * Writes the progress of the commit to its checkpoint file. The size of
+ * the differencing disk is saved along with it, since a resumed commit
+ * can't be trusted if blocks were allocated without being tracked. Must
+ * be called with the io_lock of the instance held.
+ */
+static LDI_ERROR
+write_checkpoint(struct vhdinstance *instance)
+{
+	struct commit *commit = instance->commit;
+	struct file *file;
+	uuid_t parent;
+	uint32_t numblocks, i;
+	size_t bitmap_size, size;
+	uint8_t *buffer;
+	LDI_ERROR result;
+
+	numblocks = vhd_header_max_table_entries(instance->header);
+	bitmap_size = numblocks / 8 + 1;
+	size = COMMIT_CHECKPOINT_HEADER_SIZE + bitmap_size;
+	buffer = malloc(size);
+	if (buffer == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+
+	/* The blocks that still have to be copied after the first pass. */
+	memcpy(buffer, COMMIT_MAGIC, 8);
+	vhd_header_parent_unique_id(instance->header, &parent);
+	uuid_enc_be(buffer + 8, &parent);
+	be64enc(buffer + 24, instance->filesize);
+	be64enc(buffer + 32, commit->offset);
+	be32enc(buffer + 40, numblocks);
+	for (i = 0; i < bitmap_size; i++) {
+		buffer[COMMIT_CHECKPOINT_HEADER_SIZE + i] = commit->dirty[i] | commit->copying[i];
+	}
+
+	result = file_create(instance->fi, commit->checkpoint_path, &file);
+	if (IS_ERROR(result)) {
+		free(buffer);
+		return result;
+	}
+	result = file_setsize(file, size);
+	if (!IS_ERROR(result)) {
+		result = file_write(file, buffer, size, 0, instance->logger);
+	}
+	if (!IS_ERROR(result)) {
+		result = file_sync(file);
+	}
+	file_close(&file);
+	free(buffer);
+
+	return result;
+}
+
+/*
+ * Reads the progress of an interrupted commit from its checkpoint file,
+ * if there is one for this disk and parent and the disk has not grown
+ * since it was saved.
+ */
+static void
+read_checkpoint(struct vhdinstance *instance)
+{
+	struct commit *commit = instance->commit;
+	struct file *file;
+	uuid_t expected, parent;
+	uint32_t numblocks;
+	size_t bitmap_size, size, filesize;
+	uint8_t *buffer;
+	LDI_ERROR result;
+
+	numblocks = vhd_header_max_table_entries(instance->header);
+	bitmap_size = numblocks / 8 + 1;
+	size = COMMIT_CHECKPOINT_HEADER_SIZE + bitmap_size;
+
+	if (IS_ERROR(file_open_readonly(instance->fi, commit->checkpoint_path, &file))) {
+		return;
+	}
+	buffer = malloc(size);
+	result = file_getsize(file, &filesize);
+	if (buffer != NULL && !IS_ERROR(result) && filesize == size) {
+		result = file_read(file, buffer, size, 0, instance->logger);
+		vhd_header_parent_unique_id(instance->header, &expected);
+		uuid_dec_be(buffer + 8, &parent);
+		if (!IS_ERROR(result) && memcmp(buffer, COMMIT_MAGIC, 8) == 0 &&
+		    uuid_equal(&expected, &parent, NULL) &&
+		    be64dec(buffer + 24) == instance->filesize &&
+		    be32dec(buffer + 40) == numblocks) {
+			LOG_VERBOSE(instance->logger, "Resuming an interrupted commit.\n");
+			commit->offset = be64dec(buffer + 32);
+			memcpy(commit->copying, buffer + COMMIT_CHECKPOINT_HEADER_SIZE,
+			    bitmap_size);
+		}
+	}
+	free(buffer);
+	file_close(&file);
+}
+
+/*
+ * Runs a pass of the commit with the given number of extra threads. If
+ * checkpoint is set, progress is saved regularly, which requires the
+ * extents to cover all data after the first extent in the file.
+ */
+static LDI_ERROR
+run_job(struct commit_job *job, int workers, bool checkpoint)
+{
+	struct vhdinstance *child = job->child;
+	struct taskpool *pool;
+	uint64_t saved, offset;
+	size_t prefix;
+	bool finished;
+	LDI_ERROR result;
+
+	result = taskpool_start(job->nbatches, workers, job->batch_size, copy_task, job, &pool);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	saved = 0;
+	do {
+		finished = taskpool_work(pool, checkpoint);
+		pthread_mutex_lock(&job->lock);
+		prefix = job->done_prefix;
+		pthread_mutex_unlock(&job->lock);
+		if (!checkpoint || finished || prefix == 0) {
+			/* The end of the pass is saved by the caller. */
+			continue;
+		}
+		offset = job->extents[job->batches[prefix]].file_offset;
+		if (offset - saved < COMMIT_CHECKPOINT_INTERVAL) {
+			continue;
+		}
+
+		/* The data must be in the parent before it is recorded. */
+		result = vhdinstance_flush(job->target);
+		if (!IS_ERROR(result)) {
+			lock_io(child);
+			child->commit->offset = offset;
+			result = write_checkpoint(child);
+			unlock_io(child);
+		}
+		if (IS_ERROR(result)) {
+			/* Stop the workers too. */
+			taskpool_fail(pool, result);
+			break;
+		}
+		saved = offset;
+	} while (!finished);
+
+	return taskpool_finish(&pool);
+}
+
+/*
+ * Initializes a job that copies from child to target.
+ */
+static void
+init_job(struct commit_job *job, struct vhdinstance *child, struct vhdinstance *target, size_t batch_size)
+{
+	bzero(job, sizeof(struct commit_job));
+	job->child = child;
+	job->target = target;
+	job->batch_size = batch_size;
+	pthread_mutex_init(&job->lock, NULL);
+}
+
+/*
+ * Records that the data written so far is in the parent. With first_pass
+ * set, the first pass is marked as done.
+ */
+static LDI_ERROR
+save_progress(struct vhdinstance *child, struct vhdinstance *target, bool first_pass)
+{
+	LDI_ERROR result;
+
+	result = vhdinstance_flush(target);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	lock_io(child);
+	if (first_pass) {
+		child->commit->offset = UINT64_MAX;
+	}
+	result = write_checkpoint(child);
+	unlock_io(child);
+
+	return result;
+}
+
+/*
+ * Copies the blocks written since the last pass, until none are left.
+ * After COMMIT_PASSES passes, writes are blocked while the last blocks
+ * are copied, so that the commit always finishes.
+ */
+static LDI_ERROR
+copy_written_blocks(struct vhdinstance *child, struct vhdinstance *target, struct diskimage_commit_options options, size_t batch_size)
+{
+	struct commit *commit = child->commit;
+	struct commit_job job;
+	size_t bitmap_size, i;
+	bool empty, last;
+	int pass;
+	LDI_ERROR result;
+
+	bitmap_size = vhd_header_max_table_entries(child->header) / 8 + 1;
+
+	for (pass = 0;; pass++) {
+		lock_io(child);
+		empty = true;
+		for (i = 0; i < bitmap_size; i++) {
+			commit->copying[i] |= commit->dirty[i];
+			commit->dirty[i] = 0;
+			empty = empty && commit->copying[i] == 0;
+		}
+		if (empty) {
+			unlock_io(child);
+			return NO_ERROR;
+		}
+
+		last = pass >= COMMIT_PASSES;
+		init_job(&job, child, target, batch_size);
+		job.locked = last;
+		result = build_job(&job, commit->copying, 0);
+		if (!last) {
+			unlock_io(child);
+		}
+		if (!IS_ERROR(result)) {
+			result = run_job(&job, last ? 0 : options.workers, false);
+		}
+		if (!IS_ERROR(result)) {
+			bzero(commit->copying, bitmap_size);
+		}
+		if (last) {
+			unlock_io(child);
+		}
+		free_job(&job);
+		if (IS_ERROR(result)) {
+			return result;
+		}
+
+		result = save_progress(child, target, false);
+		if (IS_ERROR(result)) {
+			return result;
+		}
+	}
+}
+
+/*
+ * Opens the parent of a differencing disk for writing.
+ */
+static LDI_ERROR
+open_target(struct vhdinstance *instance, struct vhdinstance **target)
+{
+	struct diskimage_options options;
+	struct file *file;
+	uuid_t expected, actual;
+	LDI_ERROR result;
+
+	result = file_open(instance->fi, instance->parent_path, &file);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+	options = instance->options;
+	options.copy_on_read = false;
+	result = open_instance(instance->fi, file, options, false,
+	    instance->depth + 1, target, instance->logger);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	vhd_header_parent_unique_id(instance->header, &expected);
+	vhdfooter_unique_id((*target)->footer, &actual);
+	if (!uuid_equal(&expected, &actual, NULL)) {
+		LOG_ERROR(instance->logger, "The parent %s has changed.\n", instance->parent_path);
+		vhdinstance_destroy(target);
+		return ERROR(LDI_ERR_PARENTNOTFOUND);
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Frees the state of a commit and stops tracking writes.
+ */
+static void
+end_commit(struct vhdinstance *instance)
+{
+	struct commit *commit;
+
+	lock_io(instance);
+	commit = instance->commit;
+	instance->commit = NULL;
+	/* An unfinished commit leaves a checkpoint behind. */
+	instance->checkpoint_stale = true;
+	unlock_io(instance);
+
+	free(commit->dirty);
+	free(commit->copying);
+	free(commit->checkpoint_path);
+	free(commit);
+}
+
+/*
+ * Returns the path of the checkpoint file of a commit of the instance.
+ */
+static LDI_ERROR
+checkpoint_path(struct vhdinstance *instance, char **path)
+{
+	if (asprintf(path, "%s.commit", file_getpath(instance->file)) == -1) {
+		*path = NULL;
+		return ERROR(LDI_ERR_NOMEM);
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Allocates the state of a commit of the instance.
+ */
+static LDI_ERROR
+new_commit(struct vhdinstance *instance, struct commit **commit)
+{
+	size_t	bitmap_size;
+
+	bitmap_size = vhd_header_max_table_entries(instance->header) / 8 + 1;
+	*commit = calloc(1, sizeof(struct commit));
+	if (*commit == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	(*commit)->dirty = calloc(bitmap_size, 1);
+	(*commit)->copying = calloc(bitmap_size, 1);
+	if ((*commit)->dirty == NULL || (*commit)->copying == NULL ||
+	    IS_ERROR(checkpoint_path(instance, &(*commit)->checkpoint_path))) {
+		free((*commit)->dirty);
+		free((*commit)->copying);
+		free(*commit);
+		*commit = NULL;
+		return ERROR(LDI_ERR_NOMEM);
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Writes all data of a differencing disk into its parent. The first pass
+ * copies all allocated blocks in the order they are stored in the file,
+ * and saves how far it got. Later passes copy the blocks written during
+ * the commit.
+ */
+LDI_ERROR
+vhdinstance_commit(struct vhdinstance *instance, struct diskimage_commit_options options)
+{
+	struct vhdinstance *target;
+	struct commit *commit;
+	struct commit_job job;
+	size_t	batch_size;
+	LDI_ERROR result;
+
+	if (instance->disk_type != DISK_TYPE_DIFFERENCING) {
+		return ERROR(LDI_ERR_FILENOTSUP);
+	}
+	batch_size = options.batch_size == 0 ? COMMIT_BATCH_SIZE :
+	    roundup2(options.batch_size, SECTOR_SIZE);
+
+	/*
+	 * The parent is written through another file, so other children
+	 * sharing it would keep reading its old metadata and cached data.
+	 */
+	result = file_unshare(instance->parent_file);
+	if (IS_ERROR(result)) {
+		LOG_ERROR(instance->logger, "The parent %s is in use by another image.\n",
+		    instance->parent_path);
+		return result;
+	}
+
+	result = open_target(instance, &target);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	result = new_commit(instance, &commit);
+	if (IS_ERROR(result)) {
+		vhdinstance_destroy(&target);
+		return result;
+	}
+
+	/* Start tracking writes before anything is copied. */
+	lock_io(instance);
+	instance->commit = commit;
+	read_checkpoint(instance);
+	unlock_io(instance);
+
+	result = NO_ERROR;
+	if (commit->offset != UINT64_MAX) {
+		init_job(&job, instance, target, batch_size);
+		lock_io(instance);
+		result = build_job(&job, NULL, commit->offset);
+		unlock_io(instance);
+		if (!IS_ERROR(result)) {
+			result = run_job(&job, options.workers, true);
+		}
+		free_job(&job);
+		if (!IS_ERROR(result)) {
+			result = save_progress(instance, target, true);
+		}
+	}
+	if (!IS_ERROR(result)) {
+		result = copy_written_blocks(instance, target, options, batch_size);
+	}
+	if (!IS_ERROR(result)) {
+		/* Done, there is nothing to resume. */
+		result = file_remove(instance->fi, commit->checkpoint_path);
+	}
+
+	end_commit(instance);
+	vhdinstance_destroy(&target);
+
+	return result;
+}
@@ -9,7 +9,7 @@ struct vhdinstance;
 /*
  * Creates the instance state.
  */
-LDI_ERROR vhdinstance_new(struct fileinterface *fi, char *path, struct vhdinstance **instance, struct logger logger);
+LDI_ERROR vhdinstance_new(struct fileinterface *fi, char *path, struct diskimage_options options, struct vhdinstance **instance, struct logger logger);
 
 /*
  * Deallocates the instance state and sets the pointer to NULL.
@@ -31,4 +31,19 @@ LDI_ERROR vhdinstance_read(struct vhdinstance *instance, char *buf, size_t nbyte
  */
 LDI_ERROR vhdinstance_write(struct vhdinstance *instance, char *buf, size_t nbytes, off_t offset);
 
+/*
+ * Makes all data written to the instance durable.
+ */
+LDI_ERROR vhdinstance_flush(struct vhdinstance *instance);
+
+/*
+ * Adds the counters collected by the instance to stats.
+ */
+void vhdinstance_stats(struct vhdinstance *instance, struct diskstats *stats);
+
+/*
+ * Writes all data of a differencing disk into its parent.
+ */
+LDI_ERROR vhdinstance_commit(struct vhdinstance *instance, struct diskimage_commit_options options);
+
 #endif					/* _VHDINSTANCE_H_ */
@@ -1,6 +1,8 @@
 
 #include "log.h"
 #include "parser.h"
+#include "vhdcreate.h"
+#include "vhdfooter.h"
 #include "vhdinstance.h"
 
 #include <errno.h>
@@ -31,7 +33,7 @@ void	vhd_parser_destroy(void **parser);
  * Creates the parser state.
  */
 LDI_ERROR
-vhd_parser_new(struct fileinterface *fi, char *path, void **parser, struct logger logger)
+vhd_parser_new(struct fileinterface *fi, char *path, struct diskimage_options options, void **parser, struct logger logger)
 {
 	LDI_ERROR result;
 	struct vhd_parser *vhd_parser;
@@ -47,7 +49,7 @@ vhd_parser_new(struct fileinterface *fi, char *path, void **parser, struct logge
 	vhd_parser->logger = logger;
 
 	vhd_parser->instance = NULL;
-	result = vhdinstance_new(fi, path, &(vhd_parser->instance), logger);
+	result = vhdinstance_new(fi, path, options, &(vhd_parser->instance), logger);
 	if (IS_ERROR(result)) {
 	    vhd_parser_destroy(parser);
 	}
@@ -109,6 +111,58 @@ vhd_parser_write(void *parser, char *buf, size_t nbytes, off_t offset)
 	return vhdinstance_write(vhd_parser->instance, buf, nbytes, offset);
 }
 
+/*
+ * Makes all data written to the diskimage durable.
+ */
+LDI_ERROR
+vhd_parser_flush(void *parser)
+{
+	struct vhd_parser *vhd_parser = (struct vhd_parser *)parser;
+
+	return vhdinstance_flush(vhd_parser->instance);
+}
+
+/*
+ * Adds the counters collected by the parser to stats.
+ */
+void
+vhd_parser_stats(void *parser, struct diskstats *stats)
+{
+	struct vhd_parser *vhd_parser = (struct vhd_parser *)parser;
+
+	vhdinstance_stats(vhd_parser->instance, stats);
+}
+
+/*
+ * Writes the data of a differencing disk into its parent.
+ */
+LDI_ERROR
+vhd_parser_commit(void *parser, struct diskimage_commit_options options)
+{
+	struct vhd_parser *vhd_parser = (struct vhd_parser *)parser;
+
+	return vhdinstance_commit(vhd_parser->instance, options);
+}
+
+/*
+ * Creates a new differencing disk on top of the disk at parent_path.
+ */
+LDI_ERROR
+vhd_parser_create_child(struct fileinterface *fi, char *parent_path, char *child_path, struct logger logger)
+{
+	return vhdcreate_child(fi, parent_path, child_path, logger);
+}
+
+/*
+ * Returns true if the file ends with a VHD footer, or starts with the copy
+ * of the footer that dynamic disks have.
+ */
+bool
+vhd_parser_probe(void *head, void *tail)
+{
+	return vhdfooter_valid(tail) || vhdfooter_valid(head);
+}
+
 /*
  * Define an ldi_parser struct for the VHD parser and define the parser
  * using the PARSER_DEFINE macro. This will make the parser discoverable
@@ -116,11 +170,16 @@ vhd_parser_write(void *parser, char *buf, size_t nbytes, off_t offset)
  */
 static struct ldi_parser vhd_parser_format = {
 	.name = "vhd",
+	.probe = vhd_parser_probe,
 	.construct = vhd_parser_new,
 	.destructor = vhd_parser_destroy,
 	.diskinfo = vhd_parser_diskinfo,
 	.read = vhd_parser_read,
-	.write = vhd_parser_write
+	.write = vhd_parser_write,
+	.flush = vhd_parser_flush,
+	.stats = vhd_parser_stats,
+	.commit = vhd_parser_commit,
+	.create_child = vhd_parser_create_child
 };
 
 PARSER_DEFINE(vhd_parser_format);
@@ -0,0 +1,68 @@
+#include <sys/types.h>
+
+#include "vhdxchecksum.h"
+
+/* The reflected Castagnoli polynomial used by VHDX checksums. */
+#define CRC32C_POLYNOMIAL 0x82f63b78
+
+static uint32_t crc32c_table[256];
+
+/*
+ * Fills the lookup table when the library is loaded, so that the checksum
+ * doesn't need to check for initialization on each call.
+ */
+static void __attribute__((__constructor__))
+crc32c_init(void)
+{
+	uint32_t crc, i, bit;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ (CRC32C_POLYNOMIAL & -(crc & 1));
+		crc32c_table[i] = crc;
+	}
+}
+
+/*
+ * Continues the CRC-32C in crc, which is not inverted, with nbytes at
+ * source.
+ */
+static uint32_t
+crc32c_update(uint32_t crc, uint8_t *source, size_t nbytes)
+{
+	size_t i;
+
+	for (i = 0; i < nbytes; i++)
+		crc = crc32c_table[(crc ^ source[i]) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+/*
+ * Calculates the CRC-32C of nbytes at source.
+ */
+uint32_t
+vhdx_crc32c(void *source, size_t nbytes)
+{
+	return ~crc32c_update(~0U, source, nbytes);
+}
+
+/*
+ * Calculates the checksum of a VHDX structure, taking the checksum field
+ * to be zero.
+ */
+uint32_t
+vhdx_checksum(void *source, size_t nbytes, size_t checksum_offset)
+{
+	uint8_t zeros[sizeof(uint32_t)] = {0};
+	uint8_t *bytes = source;
+	uint32_t crc;
+
+	crc = crc32c_update(~0U, bytes, checksum_offset);
+	crc = crc32c_update(crc, zeros, sizeof(zeros));
+	crc = crc32c_update(crc, bytes + checksum_offset + sizeof(zeros),
+	    nbytes - checksum_offset - sizeof(zeros));
+
+	return ~crc;
+}
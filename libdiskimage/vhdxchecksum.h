@@ -0,0 +1,18 @@
+#ifndef _VHDXCHECKSUM_H_
+#define _VHDXCHECKSUM_H_
+
+#include <sys/types.h>
+
+/*
+ * Calculates the CRC-32C of nbytes at source.
+ */
+uint32_t vhdx_crc32c(void *source, size_t nbytes);
+
+/*
+ * Calculates the checksum of a VHDX structure of nbytes at source, which
+ * has its own checksum at checksum_offset. The checksum field is taken
+ * to be zero, without changing it.
+ */
+uint32_t vhdx_checksum(void *source, size_t nbytes, size_t checksum_offset);
+
+#endif					/* _VHDXCHECKSUM_H_ */
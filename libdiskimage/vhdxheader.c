@@ -0,0 +1,194 @@
+
+#include <sys/endian.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <uuid.h>
+
+#include "internal.h"
+#include "vhdxchecksum.h"
+#include "vhdxheader.h"
+
+/* The signatures of the headers and the region table, in host order. */
+#define HEADER_SIGNATURE 0x64616568	/* "head" */
+#define REGION_TABLE_SIGNATURE 0x69676572	/* "regi" */
+
+/* Defines the offsets used in a header. */
+#define HEADER_SIGNATURE_OFFSET 0
+#define HEADER_CHECKSUM_OFFSET 4
+#define HEADER_SEQUENCE_NUMBER_OFFSET 8
+#define HEADER_FILE_WRITE_GUID_OFFSET 16
+#define HEADER_DATA_WRITE_GUID_OFFSET 32
+#define HEADER_LOG_GUID_OFFSET 48
+#define HEADER_LOG_VERSION_OFFSET 64
+#define HEADER_FORMAT_VERSION_OFFSET 66
+#define HEADER_LOG_LENGTH_OFFSET 68
+#define HEADER_LOG_OFFSET_OFFSET 72
+
+/* Defines the offsets used in the region table and its entries. */
+#define REGION_SIGNATURE_OFFSET 0
+#define REGION_CHECKSUM_OFFSET 4
+#define REGION_ENTRY_COUNT_OFFSET 8
+#define REGION_ENTRIES_OFFSET 16
+#define REGION_ENTRY_SIZE 32
+#define REGION_ENTRY_GUID_OFFSET 0
+#define REGION_ENTRY_FILE_OFFSET_OFFSET 16
+#define REGION_ENTRY_LENGTH_OFFSET 24
+#define REGION_ENTRY_REQUIRED_OFFSET 28
+
+/* The largest number of entries the region table can hold. */
+#define MAX_REGION_ENTRIES ((VHDX_REGION_TABLE_SIZE - REGION_ENTRIES_OFFSET) / REGION_ENTRY_SIZE)
+
+/* 2DC27766-F623-4200-9D64-115E9BFD4A08 */
+const uuid_t vhdx_bat_guid = {0x2dc27766, 0xf623, 0x4200, 0x9d, 0x64,
+	{0x11, 0x5e, 0x9b, 0xfd, 0x4a, 0x08}};
+
+/* 8B7CA206-4790-4B9A-B8FE-575F050F886E */
+const uuid_t vhdx_metadata_guid = {0x8b7ca206, 0x4790, 0x4b9a, 0xb8, 0xfe,
+	{0x57, 0x5f, 0x05, 0x0f, 0x88, 0x6e}};
+
+/*
+ * Returns true if source starts a VHDX file.
+ */
+bool
+vhdx_file_identifier_valid(void *source)
+{
+	return memcmp(source, VHDX_FILE_SIGNATURE, VHDX_FILE_SIGNATURE_SIZE) == 0;
+}
+
+/*
+ * Creates a new header by reading it from source.
+ */
+LDI_ERROR
+vhdx_header_new(void *source, struct vhdx_header **header)
+{
+	uint8_t *bytes = source;
+
+	if (le32dec(bytes + HEADER_SIGNATURE_OFFSET) != HEADER_SIGNATURE ||
+	    le32dec(bytes + HEADER_CHECKSUM_OFFSET) !=
+	    vhdx_checksum(bytes, VHDX_HEADER_SIZE, HEADER_CHECKSUM_OFFSET)) {
+		return ERROR(LDI_ERR_PARSEERROR);
+	}
+
+	*header = malloc(sizeof(struct vhdx_header));
+	if (*header == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+
+	/* GUIDs are stored with their first three fields little endian. */
+	(*header)->sequence_number = le64dec(bytes + HEADER_SEQUENCE_NUMBER_OFFSET);
+	uuid_dec_le(bytes + HEADER_FILE_WRITE_GUID_OFFSET, &(*header)->file_write_guid);
+	uuid_dec_le(bytes + HEADER_DATA_WRITE_GUID_OFFSET, &(*header)->data_write_guid);
+	uuid_dec_le(bytes + HEADER_LOG_GUID_OFFSET, &(*header)->log_guid);
+	(*header)->log_version = le16dec(bytes + HEADER_LOG_VERSION_OFFSET);
+	(*header)->version = le16dec(bytes + HEADER_FORMAT_VERSION_OFFSET);
+	(*header)->log_length = le32dec(bytes + HEADER_LOG_LENGTH_OFFSET);
+	(*header)->log_offset = le64dec(bytes + HEADER_LOG_OFFSET_OFFSET);
+
+	return NO_ERROR;
+}
+
+/*
+ * Writes the header and its checksum to the destination buffer.
+ */
+void
+vhdx_header_write(struct vhdx_header *header, void *dest)
+{
+	uint8_t *bytes = dest;
+
+	bzero(bytes, VHDX_HEADER_SIZE);
+
+	le32enc(bytes + HEADER_SIGNATURE_OFFSET, HEADER_SIGNATURE);
+	le64enc(bytes + HEADER_SEQUENCE_NUMBER_OFFSET, header->sequence_number);
+	uuid_enc_le(bytes + HEADER_FILE_WRITE_GUID_OFFSET, &header->file_write_guid);
+	uuid_enc_le(bytes + HEADER_DATA_WRITE_GUID_OFFSET, &header->data_write_guid);
+	uuid_enc_le(bytes + HEADER_LOG_GUID_OFFSET, &header->log_guid);
+	le16enc(bytes + HEADER_LOG_VERSION_OFFSET, header->log_version);
+	le16enc(bytes + HEADER_FORMAT_VERSION_OFFSET, header->version);
+	le32enc(bytes + HEADER_LOG_LENGTH_OFFSET, header->log_length);
+	le64enc(bytes + HEADER_LOG_OFFSET_OFFSET, header->log_offset);
+
+	le32enc(bytes + HEADER_CHECKSUM_OFFSET,
+	    vhdx_checksum(bytes, VHDX_HEADER_SIZE, HEADER_CHECKSUM_OFFSET));
+}
+
+/*
+ * Frees memory and zeros the header.
+ */
+void
+vhdx_header_destroy(struct vhdx_header **header)
+{
+	free(*header);
+	*header = NULL;
+}
+
+/*
+ * Creates a new region table by reading it from source.
+ */
+LDI_ERROR
+vhdx_region_table_new(void *source, struct vhdx_region_table **table)
+{
+	uint8_t *bytes = source;
+	uint8_t *entry;
+	uint32_t count, i;
+
+	if (le32dec(bytes + REGION_SIGNATURE_OFFSET) != REGION_TABLE_SIGNATURE ||
+	    le32dec(bytes + REGION_CHECKSUM_OFFSET) !=
+	    vhdx_checksum(bytes, VHDX_REGION_TABLE_SIZE, REGION_CHECKSUM_OFFSET)) {
+		return ERROR(LDI_ERR_PARSEERROR);
+	}
+	count = le32dec(bytes + REGION_ENTRY_COUNT_OFFSET);
+	if (count > MAX_REGION_ENTRIES) {
+		return ERROR(LDI_ERR_PARSEERROR);
+	}
+
+	*table = malloc(sizeof(struct vhdx_region_table));
+	if (*table == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	/* Allocate at least one entry, so that empty tables are not NULL. */
+	(*table)->entries = calloc(count > 0 ? count : 1, sizeof(struct vhdx_region));
+	if ((*table)->entries == NULL) {
+		free(*table);
+		*table = NULL;
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	(*table)->entry_count = count;
+
+	for (i = 0; i < count; i++) {
+		entry = bytes + REGION_ENTRIES_OFFSET + i * REGION_ENTRY_SIZE;
+		uuid_dec_le(entry + REGION_ENTRY_GUID_OFFSET, &(*table)->entries[i].guid);
+		(*table)->entries[i].offset = le64dec(entry + REGION_ENTRY_FILE_OFFSET_OFFSET);
+		(*table)->entries[i].length = le32dec(entry + REGION_ENTRY_LENGTH_OFFSET);
+		(*table)->entries[i].required = (le32dec(entry + REGION_ENTRY_REQUIRED_OFFSET) & 1) != 0;
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Returns the region with the guid, or NULL if the table doesn't have it.
+ */
+struct vhdx_region *
+vhdx_region_table_find(struct vhdx_region_table *table, const uuid_t *guid)
+{
+	uint32_t i;
+
+	for (i = 0; i < table->entry_count; i++) {
+		if (uuid_equal(&table->entries[i].guid, (uuid_t *)guid, NULL))
+			return &table->entries[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * Frees memory and zeros the region table.
+ */
+void
+vhdx_region_table_destroy(struct vhdx_region_table **table)
+{
+	free((*table)->entries);
+	free(*table);
+	*table = NULL;
+}
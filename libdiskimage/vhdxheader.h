@@ -0,0 +1,113 @@
+#ifndef _VHDXHEADER_H_
+#define _VHDXHEADER_H_
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <uuid.h>
+
+#include "diskimage.h"
+
+/* The file type identifier at the start of the file, and its size. */
+#define VHDX_FILE_SIGNATURE "vhdxfile"
+#define VHDX_FILE_SIGNATURE_SIZE 8
+
+/*
+ * The two copies of the header, each in the first part of a 64 KB area
+ * starting at 64 KB, and the size of the part that is checksummed.
+ */
+#define VHDX_HEADER_OFFSET(slot) ((uint64_t)((slot) + 1) * 64 * 1024)
+#define VHDX_HEADER_SIZE 4096
+
+/* The two copies of the region table, and their size. */
+#define VHDX_REGION_TABLE_OFFSET(slot) ((uint64_t)((slot) + 3) * 64 * 1024)
+#define VHDX_REGION_TABLE_SIZE (64 * 1024)
+
+/* The version of the format and of the log that are supported. */
+#define VHDX_VERSION 1
+#define VHDX_LOG_VERSION 0
+
+/* The regions that are known. */
+extern const uuid_t vhdx_bat_guid;
+extern const uuid_t vhdx_metadata_guid;
+
+/*
+ * The parsed form of a header of a VHDX file. All offsets are in bytes
+ * from the start of the file.
+ */
+struct vhdx_header {
+	/* The copy with the highest sequence number is the current one. */
+	uint64_t sequence_number;
+	/* Changed when the file or the data on the disk is first changed. */
+	uuid_t	file_write_guid;
+	uuid_t	data_write_guid;
+	/* Set when the log has entries that must be replayed. */
+	uuid_t	log_guid;
+	uint16_t log_version;
+	uint16_t version;
+	/* The circular log. */
+	uint32_t log_length;
+	uint64_t log_offset;
+};
+
+/*
+ * A region of the file listed in the region table.
+ */
+struct vhdx_region {
+	uuid_t	guid;
+	uint64_t offset;
+	uint32_t length;
+	/* True if the file can't be used without knowing the region. */
+	bool	required;
+};
+
+/*
+ * The parsed form of the region table.
+ */
+struct vhdx_region_table {
+	uint32_t entry_count;
+	struct vhdx_region *entries;
+};
+
+/*
+ * Returns true if source, which must hold VHDX_FILE_SIGNATURE_SIZE bytes,
+ * starts a VHDX file.
+ */
+bool	vhdx_file_identifier_valid(void *source);
+
+/*
+ * Creates a new header by reading it from source, which must hold
+ * VHDX_HEADER_SIZE bytes. Fails if the signature or the checksum is
+ * wrong.
+ */
+LDI_ERROR vhdx_header_new(void *source, struct vhdx_header **header);
+
+/*
+ * Writes the header and its checksum to the destination buffer, which
+ * must hold VHDX_HEADER_SIZE bytes.
+ */
+void	vhdx_header_write(struct vhdx_header *header, void *dest);
+
+/*
+ * Frees memory and zeros the header.
+ */
+void	vhdx_header_destroy(struct vhdx_header **header);
+
+/*
+ * Creates a new region table by reading it from source, which must hold
+ * VHDX_REGION_TABLE_SIZE bytes. Fails if the signature or the checksum is
+ * wrong.
+ */
+LDI_ERROR vhdx_region_table_new(void *source, struct vhdx_region_table **table);
+
+/*
+ * Returns the region with the guid, or NULL if the table doesn't have it.
+ */
+struct vhdx_region *vhdx_region_table_find(struct vhdx_region_table *table, const uuid_t *guid);
+
+/*
+ * Frees memory and zeros the region table.
+ */
+void	vhdx_region_table_destroy(struct vhdx_region_table **table);
+
+#endif					/* _VHDXHEADER_H_ */
@@ -0,0 +1,1350 @@
+#include <sys/param.h>
+#include <sys/endian.h>
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uuid.h>
+
+#include "blockcache.h"
+#include "diskimage.h"
+#include "fileinterface.h"
+#include "internal.h"
+#include "log.h"
+#include "vhdheader.h"
+#include "vhdxheader.h"
+#include "vhdxinstance.h"
+#include "vhdxlog.h"
+#include "vhdxmetadata.h"
+
+#define MB (1024 * 1024)
+
+/* The block sizes that disks may have, 1 MB to 256 MB. */
+#define MIN_BLOCK_SIZE MB
+#define MAX_BLOCK_SIZE (256 * MB)
+
+/* The largest disk the format allows, 64 TB. */
+#define MAX_DISK_SIZE (64ULL * 1024 * 1024 * MB)
+
+/* The largest metadata region that is read. */
+#define MAX_METADATA_LENGTH (32 * MB)
+
+/* The BAT and the sector bitmaps are cached and logged in pages. */
+#define METADATA_PAGE_SIZE VHDX_LOG_SECTOR_SIZE
+
+/*
+ * The number of BAT and sector bitmap pages that are kept in memory. A
+ * page of the BAT covers 16 GB of a disk with the default 32 MB blocks,
+ * so the cache covers the BAT of a 16 TB disk in 4 MB of memory.
+ */
+#define METADATA_CACHE_SIZE 1024
+
+/*
+ * Each sector bitmap block has a bit for each of 2^23 sectors, and the
+ * BAT has an entry for it after the entries of the blocks it covers.
+ */
+#define SECTORS_PER_BITMAP (1ULL << 23)
+#define BITMAP_BLOCK_SIZE MB
+
+/* The bits of BAT entries. */
+#define ENTRY_STATE_MASK 0x7ULL
+#define ENTRY_OFFSET_MASK 0xfffffffffff00000ULL
+
+/* The states of the BAT entries of payload blocks. */
+#define PAYLOAD_NOT_PRESENT 0
+#define PAYLOAD_UNDEFINED 1
+#define PAYLOAD_ZERO 2
+#define PAYLOAD_UNMAPPED 3
+#define PAYLOAD_FULLY_PRESENT 6
+#define PAYLOAD_PARTIALLY_PRESENT 7
+
+/* The states of the BAT entries of sector bitmap blocks. */
+#define BITMAP_NOT_PRESENT 0
+#define BITMAP_PRESENT 6
+
+/* The longest chain of differencing disks that is opened. */
+#define MAX_CHAIN_DEPTH 128
+
+/* How a part of the disk is stored. */
+enum extent_kind {
+	/* In the file, at a given offset. */
+	EXTENT_DATA,
+	/* Nowhere, it reads as zeros. */
+	EXTENT_ZERO,
+	/* In the parent of a differencing disk. */
+	EXTENT_PARENT
+};
+
+/*
+ * A page of the BAT or of a sector bitmap that has been changed since the
+ * last flush, by its number in the file.
+ */
+struct dirty_page {
+	uint64_t page;
+	uint8_t *data;
+};
+
+struct vhdxinstance {
+	/* Used to open the parent. */
+	struct fileinterface *fi;
+	/* The file with the disk. */
+	struct file *file;
+	/*
+	 * True for parents, which are only read and whose file is shared
+	 * with, and closed by, the children.
+	 */
+	bool	readonly;
+	/* The current header and which of the two copies it is. */
+	struct vhdx_header *header;
+	int	header_slot;
+	struct vhdx_metadata *metadata;
+	/* Where the BAT is in the file, and its number of entries. */
+	uint64_t bat_offset;
+	uint64_t bat_entries;
+	/* The number of blocks covered by each sector bitmap block. */
+	uint64_t chunk_ratio;
+	/*
+	 * The most recently used pages of the BAT and the sector bitmaps.
+	 * Pages that are dirty are not in the cache.
+	 */
+	struct blockcache *page_cache;
+	/* The dirty pages, sorted by page number. */
+	struct dirty_page *dirty;
+	size_t	dirty_count;
+	size_t	dirty_size;
+	/* The offset where the next block is allocated. */
+	uint64_t next_offset;
+	/* True once the GUIDs have been changed for the first write. */
+	bool	writing;
+	/* The sequence number of the next log entry. */
+	uint64_t log_sequence;
+	/* The parent of a differencing disk, and its file. */
+	struct vhdxinstance *parent;
+	struct file *parent_file;
+	int	depth;
+	/* Protects all of the above that can change. */
+	pthread_mutex_t lock;
+	/* Used for logging. */
+	struct logger logger;
+};
+
+static LDI_ERROR open_instance(struct fileinterface *fi, struct file *file, bool readonly, int depth, struct vhdxinstance **instance, struct logger logger);
+
+/*
+ * Reads both headers and makes the valid one with the highest sequence
+ * number the current one.
+ */
+static LDI_ERROR
+read_headers(struct vhdxinstance *instance)
+{
+	char buffer[VHDX_HEADER_SIZE];
+	struct vhdx_header *header;
+	int slot;
+	LDI_ERROR result;
+
+	for (slot = 0; slot < 2; slot++) {
+		result = file_read(instance->file, buffer, sizeof(buffer),
+		    VHDX_HEADER_OFFSET(slot), instance->logger);
+		if (IS_ERROR(result)) {
+			return result;
+		}
+		result = vhdx_header_new(buffer, &header);
+		if (result.code == LDI_ERR_NOMEM) {
+			return result;
+		}
+		if (IS_ERROR(result)) {
+			LOG_VERBOSE(instance->logger, "Header %d of the VHDX file is not valid.\n", slot + 1);
+			continue;
+		}
+
+		if (instance->header != NULL &&
+		    instance->header->sequence_number >= header->sequence_number) {
+			vhdx_header_destroy(&header);
+			continue;
+		}
+		if (instance->header != NULL) {
+			vhdx_header_destroy(&instance->header);
+		}
+		instance->header = header;
+		instance->header_slot = slot;
+	}
+
+	if (instance->header == NULL) {
+		LOG_ERROR(instance->logger, "The VHDX file has no valid header.\n");
+		return ERROR(LDI_ERR_PARSEERROR);
+	}
+	if (instance->header->version != VHDX_VERSION ||
+	    instance->header->log_version != VHDX_LOG_VERSION) {
+		LOG_ERROR(instance->logger, "Unknown VHDX version %u.\n", instance->header->version);
+		return ERROR(LDI_ERR_FILENOTSUP);
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Writes the current header, with a higher sequence number, over the other
+ * copy, which then becomes the current one. Must be called with the lock
+ * held, or before the instance is shared.
+ */
+static LDI_ERROR
+write_header(struct vhdxinstance *instance)
+{
+	char buffer[VHDX_HEADER_SIZE];
+	int slot;
+	LDI_ERROR result;
+
+	slot = 1 - instance->header_slot;
+	instance->header->sequence_number++;
+	vhdx_header_write(instance->header, buffer);
+
+	result = file_write(instance->file, buffer, sizeof(buffer),
+	    VHDX_HEADER_OFFSET(slot), instance->logger);
+	if (!IS_ERROR(result)) {
+		result = file_sync(instance->file);
+	}
+	if (!IS_ERROR(result)) {
+		instance->header_slot = slot;
+	}
+
+	return result;
+}
+
+/*
+ * Replays the log, if there is one, and removes the log GUID from the
+ * header so that the log is not replayed again.
+ */
+static LDI_ERROR
+replay_log(struct vhdxinstance *instance)
+{
+	bool	replayed;
+	LDI_ERROR result;
+
+	if (uuid_is_nil(&instance->header->log_guid, NULL)) {
+		return NO_ERROR;
+	}
+	if (instance->readonly) {
+		LOG_ERROR(instance->logger, "The VHDX file %s has a log that must be replayed by opening it for writing.\n",
+		    file_getpath(instance->file));
+		return ERROR(LDI_ERR_FILENOTSUP);
+	}
+
+	result = vhdxlog_replay(instance->file, instance->header, &replayed, instance->logger);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+	if (replayed) {
+		LOG_INFO(instance->logger, "Replayed the log of the VHDX file.\n");
+	}
+
+	uuid_create_nil(&instance->header->log_guid, NULL);
+
+	return write_header(instance);
+}
+
+/*
+ * Reads the first valid copy of the region table, and checks that all of
+ * the regions that are required are known.
+ */
+static LDI_ERROR
+read_region_table(struct vhdxinstance *instance, struct vhdx_region_table **table)
+{
+	char   *buffer;
+	uint32_t i;
+	int slot;
+	LDI_ERROR result;
+
+	buffer = malloc(VHDX_REGION_TABLE_SIZE);
+	if (buffer == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+
+	result = ERROR(LDI_ERR_PARSEERROR);
+	for (slot = 0; slot < 2 && IS_ERROR(result); slot++) {
+		result = file_read(instance->file, buffer, VHDX_REGION_TABLE_SIZE,
+		    VHDX_REGION_TABLE_OFFSET(slot), instance->logger);
+		if (IS_ERROR(result)) {
+			break;
+		}
+		result = vhdx_region_table_new(buffer, table);
+		if (result.code == LDI_ERR_NOMEM) {
+			break;
+		}
+	}
+	free(buffer);
+	if (result.code == LDI_ERR_PARSEERROR) {
+		LOG_ERROR(instance->logger, "The VHDX file has no valid region table.\n");
+	}
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	for (i = 0; i < (*table)->entry_count; i++) {
+		if ((*table)->entries[i].required &&
+		    !uuid_equal(&(*table)->entries[i].guid, (uuid_t *)&vhdx_bat_guid, NULL) &&
+		    !uuid_equal(&(*table)->entries[i].guid, (uuid_t *)&vhdx_metadata_guid, NULL)) {
+			LOG_ERROR(instance->logger, "The VHDX file has a required region that is not supported.\n");
+			vhdx_region_table_destroy(table);
+			return ERROR(LDI_ERR_FILENOTSUP);
+		}
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Reads the metadata region and checks that it describes a disk that can
+ * be read.
+ */
+static LDI_ERROR
+read_metadata(struct vhdxinstance *instance, struct vhdx_region *region)
+{
+	struct vhdx_metadata *metadata;
+	char   *buffer;
+	LDI_ERROR result;
+
+	if (region->length > MAX_METADATA_LENGTH) {
+		LOG_ERROR(instance->logger, "The VHDX metadata region is too large.\n");
+		return ERROR(LDI_ERR_FILENOTSUP);
+	}
+	buffer = malloc(region->length > 0 ? region->length : 1);
+	if (buffer == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	result = file_read(instance->file, buffer, region->length, region->offset,
+	    instance->logger);
+	if (!IS_ERROR(result)) {
+		result = vhdx_metadata_new(buffer, region->length, &instance->metadata);
+		if (result.code == LDI_ERR_PARSEERROR) {
+			LOG_ERROR(instance->logger, "The VHDX metadata is not valid.\n");
+		} else if (result.code == LDI_ERR_FILENOTSUP) {
+			LOG_ERROR(instance->logger, "The VHDX file has required metadata that is not supported.\n");
+		}
+	}
+	free(buffer);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	metadata = instance->metadata;
+	if (metadata->block_size < MIN_BLOCK_SIZE || metadata->block_size > MAX_BLOCK_SIZE ||
+	    !powerof2(metadata->block_size) ||
+	    (metadata->logical_sector_size != 512 && metadata->logical_sector_size != 4096) ||
+	    metadata->disk_size == 0 || metadata->disk_size > MAX_DISK_SIZE ||
+	    metadata->disk_size % metadata->logical_sector_size != 0) {
+		LOG_ERROR(instance->logger, "The VHDX metadata is not valid.\n");
+		return ERROR(LDI_ERR_PARSEERROR);
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Works out the layout of the BAT, which has an entry for each payload
+ * block and, after the entries of the blocks it covers, for each sector
+ * bitmap block.
+ */
+static LDI_ERROR
+setup_bat(struct vhdxinstance *instance, struct vhdx_region *region)
+{
+	struct vhdx_metadata *metadata = instance->metadata;
+	uint64_t blocks;
+
+	instance->chunk_ratio = SECTORS_PER_BITMAP * metadata->logical_sector_size /
+	    metadata->block_size;
+	blocks = howmany(metadata->disk_size, metadata->block_size);
+	if (metadata->has_parent) {
+		instance->bat_entries = howmany(blocks, instance->chunk_ratio) *
+		    (instance->chunk_ratio + 1);
+	} else {
+		instance->bat_entries = blocks + (blocks - 1) / instance->chunk_ratio;
+	}
+	instance->bat_offset = region->offset;
+
+	if (region->length / sizeof(uint64_t) < instance->bat_entries ||
+	    region->offset % MB != 0) {
+		LOG_ERROR(instance->logger, "The VHDX BAT region is too small.\n");
+		return ERROR(LDI_ERR_PARSEERROR);
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Destroys the parent when the last child that shares it is closed.
+ */
+static void
+destroy_shared(void *object)
+{
+	struct vhdxinstance *instance = object;
+
+	vhdxinstance_destroy(&instance);
+}
+
+/*
+ * Tries to open path as the parent of a differencing disk. Relative paths
+ * are resolved against the directory of the child. The parent is only
+ * used if its data write GUID is one of the linkage GUIDs of the child.
+ */
+static LDI_ERROR
+try_parent(struct vhdxinstance *instance, char *directory, char *path, bool relative)
+{
+	struct vhdxinstance *parent, *shared;
+	struct vhdx_metadata *metadata = instance->metadata;
+	struct file *file;
+	char   *fullpath;
+	LDI_ERROR result;
+
+	if (relative) {
+		result = fileinterface_getpath(instance->fi, directory, path, &fullpath);
+		if (IS_ERROR(result)) {
+			return result;
+		}
+	} else {
+		fullpath = strdup(path);
+		if (fullpath == NULL) {
+			return ERROR(LDI_ERR_NOMEM);
+		}
+	}
+
+	LOG_VERBOSE(instance->logger, "Trying parent %s\n", fullpath);
+	result = file_open_shared(instance->fi, fullpath, &file);
+	if (IS_ERROR(result)) {
+		free(fullpath);
+		return result;
+	}
+
+	/* Only parse the parent if no other child already has. */
+	parent = file_shared_object(file);
+	if (parent == NULL) {
+		result = open_instance(instance->fi, file, true, instance->depth + 1,
+		    &parent, instance->logger);
+		if (IS_ERROR(result)) {
+			free(fullpath);
+			file_close(&file);
+			return result;
+		}
+		shared = file_share_object(file, parent, destroy_shared);
+		if (shared != parent) {
+			/* Another thread opened the same parent. */
+			vhdxinstance_destroy(&parent);
+			parent = shared;
+		}
+	}
+
+	if (!uuid_equal(&parent->header->data_write_guid, &metadata->parent_linkage, NULL) &&
+	    (!metadata->has_parent_linkage2 ||
+	    !uuid_equal(&parent->header->data_write_guid, &metadata->parent_linkage2, NULL))) {
+		LOG_WARNING(instance->logger, "Ignoring parent %s, the data write GUID does not match.\n", fullpath);
+		free(fullpath);
+		file_close(&file);
+		return ERROR(LDI_ERR_PARENTNOTFOUND);
+	}
+	free(fullpath);
+
+	instance->parent = parent;
+	instance->parent_file = file;
+
+	return NO_ERROR;
+}
+
+/*
+ * Finds and opens the parent of a differencing disk. The paths of the
+ * parent locator are tried in the order the format recommends.
+ */
+static LDI_ERROR
+open_parent(struct vhdxinstance *instance)
+{
+	static char *keys[] = {"relative_path", "volume_path", "absolute_win32_path"};
+	char   *value, *path, *name, *directory;
+	uint16_t length;
+	bool	relative;
+	size_t	i;
+	LDI_ERROR result;
+
+	if (instance->depth >= MAX_CHAIN_DEPTH) {
+		LOG_ERROR(instance->logger, "The chain of differencing disks is too long.\n");
+		return ERROR(LDI_ERR_PARSEERROR);
+	}
+
+	directory = file_getdirectory(instance->file);
+	if (directory == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+
+	result = ERROR(LDI_ERR_PARENTNOTFOUND);
+	for (i = 0; i < nitems(keys) && instance->parent == NULL; i++) {
+		if (!vhdx_metadata_parent_entry(instance->metadata, keys[i], &value, &length)) {
+			continue;
+		}
+
+		/* The paths are Windows paths, like those of VHD parent locators. */
+		path = vhd_parent_locator_decode("W2ru", value, length, &relative);
+		if (path == NULL) {
+			LOG_VERBOSE(instance->logger, "Skipping parent locator entry %s.\n", keys[i]);
+			continue;
+		}
+
+		result = try_parent(instance, directory, path, relative);
+		if (IS_ERROR(result) && result.code != LDI_ERR_NOMEM && !relative) {
+			/*
+			 * Absolute paths are often from the machine that
+			 * created the disk. Look for the same file name next
+			 * to the child.
+			 */
+			name = strrchr(path, '/');
+			result = try_parent(instance, directory, name + 1, true);
+		}
+		free(path);
+		if (result.code == LDI_ERR_NOMEM) {
+			break;
+		}
+	}
+	free(directory);
+
+	if (instance->parent == NULL) {
+		LOG_ERROR(instance->logger, "Could not find the parent of the VHDX file.\n");
+		if (result.code != LDI_ERR_NOMEM) {
+			result = ERROR(LDI_ERR_PARENTNOTFOUND);
+		}
+		return result;
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Creates the instance for the VHDX disk in file. The file is closed with
+ * the instance, unless it is a shared file that is only read.
+ */
+static LDI_ERROR
+open_instance(struct fileinterface *fi, struct file *file, bool readonly, int depth, struct vhdxinstance **instance, struct logger logger)
+{
+	char identifier[VHDX_FILE_SIGNATURE_SIZE];
+	struct vhdx_region_table *table;
+	struct vhdx_region *bat, *metadata;
+	size_t filesize;
+	LDI_ERROR result;
+
+	*instance = calloc(1, sizeof(struct vhdxinstance));
+	if (*instance == NULL) {
+		if (!readonly) {
+			file_close(&file);
+		}
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	(*instance)->fi = fi;
+	(*instance)->file = file;
+	(*instance)->readonly = readonly;
+	(*instance)->depth = depth;
+	(*instance)->log_sequence = 1;
+	(*instance)->logger = logger;
+	pthread_mutex_init(&(*instance)->lock, NULL);
+
+	result = file_read(file, identifier, sizeof(identifier), 0, logger);
+	if (!IS_ERROR(result) && !vhdx_file_identifier_valid(identifier)) {
+		LOG_ERROR(logger, "The file is not a VHDX file.\n");
+		result = ERROR(LDI_ERR_PARSEERROR);
+	}
+	if (!IS_ERROR(result)) {
+		result = read_headers(*instance);
+	}
+	if (!IS_ERROR(result)) {
+		/* The log may change any other part of the file. */
+		result = replay_log(*instance);
+	}
+	if (!IS_ERROR(result)) {
+		result = read_region_table(*instance, &table);
+	}
+	if (IS_ERROR(result)) {
+		vhdxinstance_destroy(instance);
+		return result;
+	}
+
+	bat = vhdx_region_table_find(table, &vhdx_bat_guid);
+	metadata = vhdx_region_table_find(table, &vhdx_metadata_guid);
+	if (bat == NULL || metadata == NULL) {
+		LOG_ERROR(logger, "The VHDX file lacks the BAT or the metadata region.\n");
+		result = ERROR(LDI_ERR_PARSEERROR);
+	}
+	if (!IS_ERROR(result)) {
+		result = read_metadata(*instance, metadata);
+	}
+	if (!IS_ERROR(result)) {
+		result = setup_bat(*instance, bat);
+	}
+	vhdx_region_table_destroy(&table);
+	if (!IS_ERROR(result)) {
+		result = blockcache_create(METADATA_CACHE_SIZE, &(*instance)->page_cache);
+	}
+	if (!IS_ERROR(result)) {
+		result = file_getsize(file, &filesize);
+	}
+	if (!IS_ERROR(result) && (*instance)->metadata->has_parent) {
+		result = open_parent(*instance);
+	}
+	if (IS_ERROR(result)) {
+		vhdxinstance_destroy(instance);
+		return result;
+	}
+
+	/* New blocks are added at the end of the file, aligned to 1 MB. */
+	(*instance)->next_offset = roundup(filesize, MB);
+
+	return NO_ERROR;
+}
+
+/*
+ * Opens the VHDX disk at path.
+ */
+LDI_ERROR
+vhdxinstance_open(struct fileinterface *fi, char *path, struct vhdxinstance **instance, struct logger logger)
+{
+	struct file *file;
+	LDI_ERROR result;
+
+	result = file_open(fi, path, &file);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	return open_instance(fi, file, false, 0, instance, logger);
+}
+
+/*
+ * Frees the instance and sets the pointer to NULL.
+ */
+void
+vhdxinstance_destroy(struct vhdxinstance **instance)
+{
+	size_t	i;
+
+	if ((*instance)->dirty_count > 0) {
+		/* Make sure that the BAT is written before the file is closed. */
+		vhdxinstance_flush(*instance);
+	}
+	if ((*instance)->writing && (*instance)->dirty_count == 0 &&
+	    !uuid_is_nil(&(*instance)->header->log_guid, NULL)) {
+		/* Everything in the log has been applied. */
+		uuid_create_nil(&(*instance)->header->log_guid, NULL);
+		write_header(*instance);
+	}
+
+	for (i = 0; i < (*instance)->dirty_count; i++) {
+		free((*instance)->dirty[i].data);
+	}
+	free((*instance)->dirty);
+	if ((*instance)->page_cache != NULL) {
+		blockcache_destroy(&(*instance)->page_cache);
+	}
+	if ((*instance)->parent_file != NULL) {
+		/* The parent is destroyed with the last reference to its file. */
+		file_close(&(*instance)->parent_file);
+	}
+	if ((*instance)->metadata != NULL) {
+		vhdx_metadata_destroy(&(*instance)->metadata);
+	}
+	if ((*instance)->header != NULL) {
+		vhdx_header_destroy(&(*instance)->header);
+	}
+	if ((*instance)->file != NULL && !(*instance)->readonly) {
+		/* Shared files are closed by the children. */
+		file_close(&(*instance)->file);
+	}
+	pthread_mutex_destroy(&(*instance)->lock);
+	free(*instance);
+	*instance = NULL;
+}
+
+/*
+ * Returns the number of bytes in the disk.
+ */
+uint64_t
+vhdxinstance_size(struct vhdxinstance *instance)
+{
+	return instance->metadata->disk_size;
+}
+
+/*
+ * Returns the index of the dirty page, or the index it would be inserted
+ * at if it is not dirty.
+ */
+static size_t
+find_dirty(struct vhdxinstance *instance, uint64_t page)
+{
+	size_t	low, high, middle;
+
+	low = 0;
+	high = instance->dirty_count;
+	while (low < high) {
+		middle = low + (high - low) / 2;
+		if (instance->dirty[middle].page < page)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	return low;
+}
+
+/*
+ * Reads nbytes at offset in the file, which must be within one page of
+ * the BAT or of a sector bitmap, from the dirty pages or the cache. Pages
+ * that are not cached are read and added to the cache. Must be called
+ * with the lock held.
+ */
+static LDI_ERROR
+read_page_locked(struct vhdxinstance *instance, uint64_t offset, void *buf, size_t nbytes)
+{
+	uint8_t *data;
+	uint64_t page;
+	size_t	index, offset_in_page;
+	LDI_ERROR result;
+
+	page = offset / METADATA_PAGE_SIZE;
+	offset_in_page = offset % METADATA_PAGE_SIZE;
+
+	index = find_dirty(instance, page);
+	if (index < instance->dirty_count && instance->dirty[index].page == page) {
+		memcpy(buf, instance->dirty[index].data + offset_in_page, nbytes);
+		return NO_ERROR;
+	}
+	if (blockcache_get(instance->page_cache, page, buf, offset_in_page, nbytes)) {
+		return NO_ERROR;
+	}
+
+	data = malloc(METADATA_PAGE_SIZE);
+	if (data == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	result = file_read(instance->file, data, METADATA_PAGE_SIZE,
+	    page * METADATA_PAGE_SIZE, instance->logger);
+	if (IS_ERROR(result)) {
+		free(data);
+		return result;
+	}
+	memcpy(buf, data + offset_in_page, nbytes);
+
+	/* The cache takes over the page. */
+	blockcache_put(instance->page_cache, page, data, METADATA_PAGE_SIZE);
+
+	return NO_ERROR;
+}
+
+/*
+ * Returns the page with offset in the file as a dirty page, taking it out
+ * of the cache or reading it if needed. Must be called with the lock
+ * held.
+ */
+static LDI_ERROR
+get_dirty_page_locked(struct vhdxinstance *instance, uint64_t offset, uint8_t **data)
+{
+	struct dirty_page *dirty;
+	uint64_t page;
+	size_t	index, size;
+	LDI_ERROR result;
+
+	page = offset / METADATA_PAGE_SIZE;
+	index = find_dirty(instance, page);
+	if (index < instance->dirty_count && instance->dirty[index].page == page) {
+		*data = instance->dirty[index].data;
+		return NO_ERROR;
+	}
+
+	if (instance->dirty_count == instance->dirty_size) {
+		size = MAX(16, instance->dirty_size * 2);
+		dirty = realloc(instance->dirty, size * sizeof(struct dirty_page));
+		if (dirty == NULL) {
+			return ERROR(LDI_ERR_NOMEM);
+		}
+		instance->dirty = dirty;
+		instance->dirty_size = size;
+	}
+
+	*data = malloc(METADATA_PAGE_SIZE);
+	if (*data == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	result = read_page_locked(instance, page * METADATA_PAGE_SIZE, *data,
+	    METADATA_PAGE_SIZE);
+	if (IS_ERROR(result)) {
+		free(*data);
+		return result;
+	}
+	/* The dirty copy is the only one until it has been written. */
+	blockcache_remove(instance->page_cache, page);
+
+	memmove(instance->dirty + index + 1, instance->dirty + index,
+	    (instance->dirty_count - index) * sizeof(struct dirty_page));
+	instance->dirty[index].page = page;
+	instance->dirty[index].data = *data;
+	instance->dirty_count++;
+
+	return NO_ERROR;
+}
+
+/*
+ * Returns the index in the BAT of the entry of the payload block.
+ */
+static uint64_t
+payload_index(struct vhdxinstance *instance, uint64_t block)
+{
+	return block + block / instance->chunk_ratio;
+}
+
+/*
+ * Returns the index in the BAT of the entry of the sector bitmap block
+ * that covers the payload block.
+ */
+static uint64_t
+bitmap_index(struct vhdxinstance *instance, uint64_t block)
+{
+	return block / instance->chunk_ratio * (instance->chunk_ratio + 1) +
+	    instance->chunk_ratio;
+}
+
+/*
+ * Looks up the BAT entry with the index. Must be called with the lock
+ * held.
+ */
+static LDI_ERROR
+lookup_entry_locked(struct vhdxinstance *instance, uint64_t index, uint64_t *entry)
+{
+	uint64_t raw;
+	LDI_ERROR result;
+
+	if (index >= instance->bat_entries) {
+		return ERROR(LDI_ERR_OUTOFRANGE);
+	}
+	result = read_page_locked(instance, instance->bat_offset + index * sizeof(uint64_t),
+	    &raw, sizeof(raw));
+	if (IS_ERROR(result)) {
+		return result;
+	}
+	*entry = le64toh(raw);
+
+	return NO_ERROR;
+}
+
+/*
+ * Sets the BAT entry with the index. Must be called with the lock held.
+ */
+static LDI_ERROR
+set_entry_locked(struct vhdxinstance *instance, uint64_t index, uint64_t entry)
+{
+	uint8_t *data;
+	uint64_t offset;
+	LDI_ERROR result;
+
+	offset = instance->bat_offset + index * sizeof(uint64_t);
+	result = get_dirty_page_locked(instance, offset, &data);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+	le64enc(data + offset % METADATA_PAGE_SIZE, entry);
+
+	return NO_ERROR;
+}
+
+/*
+ * Counts the bits in the sector bitmap at bitmap_offset, starting with
+ * bit first, that have the same value as the first one, up to max_bits.
+ * Must be called with the lock held.
+ */
+static LDI_ERROR
+bitmap_run_locked(struct vhdxinstance *instance, uint64_t bitmap_offset, uint64_t first, uint64_t max_bits, bool *set, uint64_t *count)
+{
+	uint8_t page[METADATA_PAGE_SIZE];
+	uint64_t bit, offset, page_offset;
+	uint8_t byte;
+	LDI_ERROR result;
+
+	page_offset = UINT64_MAX;
+	for (*count = 0; *count < max_bits; ) {
+		bit = first + *count;
+		offset = bitmap_offset + bit / 8;
+		if (rounddown(offset, METADATA_PAGE_SIZE) != page_offset) {
+			page_offset = rounddown(offset, METADATA_PAGE_SIZE);
+			result = read_page_locked(instance, page_offset, page, sizeof(page));
+			if (IS_ERROR(result)) {
+				return result;
+			}
+		}
+
+		/* The first sector of a byte is its least significant bit. */
+		byte = page[offset - page_offset];
+		if (*count == 0) {
+			*set = (byte >> (bit % 8) & 1) != 0;
+		} else if (((byte >> (bit % 8) & 1) != 0) != *set) {
+			break;
+		}
+		if (bit % 8 == 0 && byte == (*set ? 0xff : 0) && max_bits - *count >= 8) {
+			*count += 8;
+		} else {
+			(*count)++;
+		}
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Finds how the part of the disk at offset is stored. length is set to
+ * the number of bytes, up to nbytes, that are stored the same way, which
+ * never crosses the end of a block. For data in the file, file_offset is
+ * set to where it is. Must be called with the lock held.
+ */
+static LDI_ERROR
+map_locked(struct vhdxinstance *instance, uint64_t offset, size_t nbytes, enum extent_kind *kind, uint64_t *file_offset, size_t *length)
+{
+	uint64_t block, offset_in_block, entry, bitmap, sector, sectors, count;
+	uint32_t sector_size;
+	bool	set;
+	LDI_ERROR result;
+
+	block = offset / instance->metadata->block_size;
+	offset_in_block = offset % instance->metadata->block_size;
+	*length = MIN(nbytes, instance->metadata->block_size - offset_in_block);
+
+	result = lookup_entry_locked(instance, payload_index(instance, block), &entry);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	switch (entry & ENTRY_STATE_MASK) {
+	case PAYLOAD_FULLY_PRESENT:
+	case PAYLOAD_PARTIALLY_PRESENT:
+		if ((entry & ENTRY_OFFSET_MASK) == 0) {
+			LOG_ERROR(instance->logger, "The BAT entry of block %ju is not valid.\n",
+			    (uintmax_t)block);
+			return ERROR(LDI_ERR_PARSEERROR);
+		}
+		*kind = EXTENT_DATA;
+		*file_offset = (entry & ENTRY_OFFSET_MASK) + offset_in_block;
+		break;
+	case PAYLOAD_NOT_PRESENT:
+		*kind = instance->parent != NULL ? EXTENT_PARENT : EXTENT_ZERO;
+		return NO_ERROR;
+	default:
+		*kind = EXTENT_ZERO;
+		return NO_ERROR;
+	}
+
+	if ((entry & ENTRY_STATE_MASK) != PAYLOAD_PARTIALLY_PRESENT ||
+	    instance->parent == NULL) {
+		return NO_ERROR;
+	}
+
+	/* The sector bitmap tells which sectors are in the file. */
+	result = lookup_entry_locked(instance, bitmap_index(instance, block), &bitmap);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+	if ((bitmap & ENTRY_STATE_MASK) != BITMAP_PRESENT) {
+		*kind = EXTENT_PARENT;
+		return NO_ERROR;
+	}
+
+	sector_size = instance->metadata->logical_sector_size;
+	sector = offset / sector_size;
+	sectors = howmany(offset + *length, sector_size) - sector;
+	result = bitmap_run_locked(instance, bitmap & ENTRY_OFFSET_MASK,
+	    sector % SECTORS_PER_BITMAP, sectors, &set, &count);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+	*kind = set ? EXTENT_DATA : EXTENT_PARENT;
+	*length = MIN(*length, (sector + count) * sector_size - offset);
+
+	return NO_ERROR;
+}
+
+/*
+ * Reads nbytes at offset on the parent into the buffer. The parent may be
+ * smaller than the child, and reads as zeros after its end.
+ */
+static LDI_ERROR
+read_parent(struct vhdxinstance *instance, char *buf, size_t nbytes, uint64_t offset)
+{
+	uint64_t parent_size;
+	size_t	length;
+
+	parent_size = vhdxinstance_size(instance->parent);
+	length = offset < parent_size ? MIN(nbytes, parent_size - offset) : 0;
+	memset(buf + length, 0, nbytes - length);
+	if (length == 0) {
+		return NO_ERROR;
+	}
+
+	return vhdxinstance_read(instance->parent, buf, length, offset);
+}
+
+/*
+ * Reads nbytes at offset on the disk into the buffer. Runs of parts that
+ * are stored the same way, and for data in the file next to each other,
+ * are read with a single read. The lock is only taken to look up the
+ * runs, unless the caller holds it.
+ */
+static LDI_ERROR
+read_range(struct vhdxinstance *instance, char *buf, size_t nbytes, off_t offset, bool locked)
+{
+	enum extent_kind kind, next_kind;
+	uint64_t file_offset, next_file_offset;
+	size_t	length, next_length;
+	LDI_ERROR result;
+
+	while (nbytes > 0) {
+		if (!locked) {
+			pthread_mutex_lock(&instance->lock);
+		}
+		result = map_locked(instance, offset, nbytes, &kind, &file_offset, &length);
+
+		/* Extend the run with as much of what follows as possible. */
+		while (!IS_ERROR(result) && length < nbytes) {
+			result = map_locked(instance, offset + length, nbytes - length,
+			    &next_kind, &next_file_offset, &next_length);
+			if (IS_ERROR(result) || next_kind != kind ||
+			    (kind == EXTENT_DATA && next_file_offset != file_offset + length)) {
+				break;
+			}
+			length += next_length;
+		}
+		if (!locked) {
+			pthread_mutex_unlock(&instance->lock);
+		}
+		if (IS_ERROR(result)) {
+			return result;
+		}
+
+		switch (kind) {
+		case EXTENT_DATA:
+			result = file_read(instance->file, buf, length, file_offset,
+			    instance->logger);
+			break;
+		case EXTENT_PARENT:
+			result = read_parent(instance, buf, length, offset);
+			break;
+		default:
+			memset(buf, 0, length);
+		}
+		if (IS_ERROR(result)) {
+			return result;
+		}
+
+		buf += length;
+		offset += length;
+		nbytes -= length;
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Reads nbytes at offset on the disk into the buffer.
+ */
+LDI_ERROR
+vhdxinstance_read(struct vhdxinstance *instance, char *buf, size_t nbytes, off_t offset)
+{
+	return read_range(instance, buf, nbytes, offset, false);
+}
+
+/*
+ * Changes the GUIDs in the header before the file is first changed, which
+ * tells that the disk is not the same as before, and that children of it
+ * no longer match it. Must be called with the lock held.
+ */
+static LDI_ERROR
+start_writing_locked(struct vhdxinstance *instance)
+{
+	uint32_t status;
+	LDI_ERROR result;
+
+	uuid_create(&instance->header->file_write_guid, &status);
+	if (status == uuid_s_ok) {
+		uuid_create(&instance->header->data_write_guid, &status);
+	}
+	if (status != uuid_s_ok) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+
+	result = write_header(instance);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+	instance->writing = true;
+
+	return NO_ERROR;
+}
+
+/*
+ * Allocates length bytes at the end of the file. The new space reads as
+ * zeros. Must be called with the lock held.
+ */
+static LDI_ERROR
+allocate_locked(struct vhdxinstance *instance, uint64_t length, uint64_t *start)
+{
+	LDI_ERROR result;
+
+	result = file_setsize(instance->file, instance->next_offset + length);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+	*start = instance->next_offset;
+	instance->next_offset += length;
+
+	return NO_ERROR;
+}
+
+/*
+ * Allocates a block for the payload block, whose BAT entry is entry, and
+ * sets entry to its new BAT entry. The blocks of differencing disks that
+ * were not present get their data from the parent, so only the sectors
+ * that are written are marked present. Must be called with the lock held.
+ */
+static LDI_ERROR
+allocate_block_locked(struct vhdxinstance *instance, uint64_t block, uint64_t *entry)
+{
+	uint64_t start, state;
+	LDI_ERROR result;
+
+	result = allocate_locked(instance, instance->metadata->block_size, &start);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	state = PAYLOAD_FULLY_PRESENT;
+	if (instance->parent != NULL && (*entry & ENTRY_STATE_MASK) == PAYLOAD_NOT_PRESENT) {
+		state = PAYLOAD_PARTIALLY_PRESENT;
+	}
+	*entry = start | state;
+
+	return set_entry_locked(instance, payload_index(instance, block), *entry);
+}
+
+/*
+ * Sets count bits starting with bit first.
+ */
+static void
+set_bits(uint8_t *bitmap, uint64_t first, uint64_t count)
+{
+	for (; count > 0 && first % 8 != 0; first++, count--)
+		bitmap[first / 8] |= 1 << (first % 8);
+	memset(bitmap + first / 8, 0xff, count / 8);
+	first += count / 8 * 8;
+	for (count %= 8; count > 0; first++, count--)
+		bitmap[first / 8] |= 1 << (first % 8);
+}
+
+/*
+ * Marks the sectors of nbytes at offset on the disk, which must be within
+ * one block, as present in the sector bitmap, allocating the sector
+ * bitmap block if needed. Must be called with the lock held.
+ */
+static LDI_ERROR
+mark_present_locked(struct vhdxinstance *instance, uint64_t offset, size_t nbytes)
+{
+	uint8_t *data;
+	uint64_t block, entry, start, bit, end, page_end, bitmap_offset;
+	uint32_t sector_size;
+	LDI_ERROR result;
+
+	block = offset / instance->metadata->block_size;
+	result = lookup_entry_locked(instance, bitmap_index(instance, block), &entry);
+	if (!IS_ERROR(result) && (entry & ENTRY_STATE_MASK) != BITMAP_PRESENT) {
+		result = allocate_locked(instance, BITMAP_BLOCK_SIZE, &start);
+		if (!IS_ERROR(result)) {
+			entry = start | BITMAP_PRESENT;
+			result = set_entry_locked(instance, bitmap_index(instance, block), entry);
+		}
+	}
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	sector_size = instance->metadata->logical_sector_size;
+	bit = offset / sector_size % SECTORS_PER_BITMAP;
+	end = bit + nbytes / sector_size;
+	while (bit < end) {
+		bitmap_offset = (entry & ENTRY_OFFSET_MASK) + bit / 8;
+		result = get_dirty_page_locked(instance, bitmap_offset, &data);
+		if (IS_ERROR(result)) {
+			return result;
+		}
+		page_end = (rounddown(bit, METADATA_PAGE_SIZE * 8) + METADATA_PAGE_SIZE * 8);
+		set_bits(data, bit % (METADATA_PAGE_SIZE * 8), MIN(end, page_end) - bit);
+		bit = MIN(end, page_end);
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Writes nbytes from the buffer at offset on the disk, which for
+ * differencing disks must be whole sectors. Must be called with the lock
+ * held.
+ */
+static LDI_ERROR
+write_locked(struct vhdxinstance *instance, char *buf, size_t nbytes, uint64_t offset)
+{
+	uint64_t block, offset_in_block, entry, state;
+	size_t	length;
+	LDI_ERROR result;
+
+	while (nbytes > 0) {
+		block = offset / instance->metadata->block_size;
+		offset_in_block = offset % instance->metadata->block_size;
+		length = MIN(instance->metadata->block_size - offset_in_block, nbytes);
+
+		result = lookup_entry_locked(instance, payload_index(instance, block), &entry);
+		if (IS_ERROR(result)) {
+			return result;
+		}
+		state = entry & ENTRY_STATE_MASK;
+		if (state != PAYLOAD_FULLY_PRESENT && state != PAYLOAD_PARTIALLY_PRESENT) {
+			result = allocate_block_locked(instance, block, &entry);
+		} else if ((entry & ENTRY_OFFSET_MASK) == 0) {
+			LOG_ERROR(instance->logger, "The BAT entry of block %ju is not valid.\n",
+			    (uintmax_t)block);
+			result = ERROR(LDI_ERR_PARSEERROR);
+		}
+		if (!IS_ERROR(result)) {
+			result = file_write(instance->file, buf, length,
+			    (entry & ENTRY_OFFSET_MASK) + offset_in_block, instance->logger);
+		}
+		if (!IS_ERROR(result) && instance->parent != NULL &&
+		    (entry & ENTRY_STATE_MASK) == PAYLOAD_PARTIALLY_PRESENT) {
+			result = mark_present_locked(instance, offset, length);
+		}
+		if (IS_ERROR(result)) {
+			return result;
+		}
+
+		buf += length;
+		offset += length;
+		nbytes -= length;
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Writes nbytes from the buffer at offset on the disk. The sector bitmaps
+ * of differencing disks can only mark whole sectors as present, so the
+ * rest of partially written sectors is read first.
+ */
+LDI_ERROR
+vhdxinstance_write(struct vhdxinstance *instance, char *buf, size_t nbytes, off_t offset)
+{
+	char   *bounce;
+	uint64_t start, end;
+	uint32_t sector_size;
+	LDI_ERROR result;
+
+	if (instance->readonly) {
+		return ERROR(LDI_ERR_FILENOTSUP);
+	}
+
+	sector_size = instance->metadata->logical_sector_size;
+	start = rounddown(offset, sector_size);
+	end = roundup(offset + nbytes, sector_size);
+	bounce = NULL;
+	pthread_mutex_lock(&instance->lock);
+	result = NO_ERROR;
+	if (instance->parent != NULL && (start != (uint64_t)offset || end != offset + nbytes)) {
+		/*
+		 * The rest of the partial sectors comes from the disk. It is
+		 * read with the lock held, so that no write to the same
+		 * sectors comes in between.
+		 */
+		bounce = malloc(end - start);
+		if (bounce == NULL) {
+			result = ERROR(LDI_ERR_NOMEM);
+		}
+		if (!IS_ERROR(result)) {
+			result = read_range(instance, bounce, sector_size, start, true);
+		}
+		if (!IS_ERROR(result)) {
+			result = read_range(instance, bounce + (end - start) - sector_size,
+			    sector_size, end - sector_size, true);
+		}
+		if (!IS_ERROR(result)) {
+			memcpy(bounce + (offset - start), buf, nbytes);
+			buf = bounce;
+			nbytes = end - start;
+			offset = start;
+		}
+	}
+
+	if (!IS_ERROR(result) && !instance->writing) {
+		result = start_writing_locked(instance);
+	}
+	if (!IS_ERROR(result)) {
+		result = write_locked(instance, buf, nbytes, offset);
+	}
+	pthread_mutex_unlock(&instance->lock);
+	free(bounce);
+
+	return result;
+}
+
+/*
+ * Makes the written blocks durable, and then writes the dirty pages of
+ * the BAT and the sector bitmaps through the log. A crash at any point
+ * leaves either the old or the new pages once the log is replayed, and
+ * new pages only point at blocks that have been written.
+ */
+LDI_ERROR
+vhdxinstance_flush(struct vhdxinstance *instance)
+{
+	struct vhdxlog_page *pages;
+	uint32_t status;
+	size_t	i;
+	LDI_ERROR result;
+
+	pthread_mutex_lock(&instance->lock);
+	result = file_sync(instance->file);
+	if (IS_ERROR(result) || instance->dirty_count == 0) {
+		pthread_mutex_unlock(&instance->lock);
+		return result;
+	}
+
+	/* The header must point at the log before anything is logged. */
+	if (uuid_is_nil(&instance->header->log_guid, NULL)) {
+		uuid_create(&instance->header->log_guid, &status);
+		if (status != uuid_s_ok) {
+			result = ERROR(LDI_ERR_NOMEM);
+		} else {
+			result = write_header(instance);
+		}
+	}
+
+	pages = malloc(instance->dirty_count * sizeof(struct vhdxlog_page));
+	if (!IS_ERROR(result) && pages == NULL) {
+		result = ERROR(LDI_ERR_NOMEM);
+	}
+	if (!IS_ERROR(result)) {
+		for (i = 0; i < instance->dirty_count; i++) {
+			pages[i].offset = instance->dirty[i].page * METADATA_PAGE_SIZE;
+			pages[i].data = instance->dirty[i].data;
+		}
+		result = vhdxlog_commit(instance->file, instance->header,
+		    &instance->log_sequence, pages, instance->dirty_count, instance->logger);
+	}
+	free(pages);
+	if (IS_ERROR(result)) {
+		/* Everything stays dirty so that the next flush tries again. */
+		pthread_mutex_unlock(&instance->lock);
+		return result;
+	}
+
+	/* The written pages are clean and can be cached again. */
+	for (i = 0; i < instance->dirty_count; i++) {
+		blockcache_put(instance->page_cache, instance->dirty[i].page,
+		    instance->dirty[i].data, METADATA_PAGE_SIZE);
+	}
+	instance->dirty_count = 0;
+	pthread_mutex_unlock(&instance->lock);
+
+	return NO_ERROR;
+}
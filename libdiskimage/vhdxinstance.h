@@ -0,0 +1,55 @@
+#ifndef _VHDXINSTANCE_H_
+#define _VHDXINSTANCE_H_
+
+#include <sys/types.h>
+
+#include "diskimage.h"
+#include "fileinterface.h"
+
+/*
+ * A fixed, dynamic or differencing VHDX disk. The BAT and the sector
+ * bitmaps are read a page at a time when they are first needed and kept
+ * in a bounded cache, so opening a disk doesn't depend on its size.
+ */
+struct vhdxinstance;
+
+/*
+ * Opens the VHDX disk at path, replaying its log if it has one, and opens
+ * the chain of parents of differencing disks. Fails with
+ * LDI_ERR_FILENOTSUP for versions and required regions or metadata that
+ * are not known.
+ */
+LDI_ERROR vhdxinstance_open(struct fileinterface *fi, char *path, struct vhdxinstance **instance, struct logger logger);
+
+/*
+ * Flushes the disk, closes its file and its parent, frees it and sets the
+ * pointer to NULL.
+ */
+void	vhdxinstance_destroy(struct vhdxinstance **instance);
+
+/*
+ * Returns the number of bytes in the disk.
+ */
+uint64_t vhdxinstance_size(struct vhdxinstance *instance);
+
+/*
+ * Reads nbytes at offset on the disk into the buffer. Blocks that are next
+ * to each other both on the disk and in the file are read with a single
+ * read.
+ */
+LDI_ERROR vhdxinstance_read(struct vhdxinstance *instance, char *buf, size_t nbytes, off_t offset);
+
+/*
+ * Writes nbytes from the buffer at offset on the disk. Blocks that are not
+ * present get a new block at the end of the file. The BAT and the sector
+ * bitmaps are not written until the disk is flushed.
+ */
+LDI_ERROR vhdxinstance_write(struct vhdxinstance *instance, char *buf, size_t nbytes, off_t offset);
+
+/*
+ * Makes the written blocks durable and then writes the BAT and sector
+ * bitmap pages that changed through the log.
+ */
+LDI_ERROR vhdxinstance_flush(struct vhdxinstance *instance);
+
+#endif					/* _VHDXINSTANCE_H_ */
@@ -0,0 +1,595 @@
+
+#include <sys/param.h>
+#include <sys/endian.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <uuid.h>
+
+#include "diskimage.h"
+#include "fileinterface.h"
+#include "internal.h"
+#include "log.h"
+#include "vhdxchecksum.h"
+#include "vhdxheader.h"
+#include "vhdxlog.h"
+
+#define SECTOR_SIZE VHDX_LOG_SECTOR_SIZE
+
+/* The signatures of the log structures, in host order. */
+#define ENTRY_SIGNATURE 0x65676f6c	/* "loge" */
+#define ZERO_SIGNATURE 0x6f72657a	/* "zero" */
+#define DESCRIPTOR_SIGNATURE 0x63736564	/* "desc" */
+#define DATA_SIGNATURE 0x61746164	/* "data" */
+
+/* Defines the offsets used in the header of an entry. */
+#define ENTRY_HEADER_SIZE 64
+#define ENTRY_SIGNATURE_OFFSET 0
+#define ENTRY_CHECKSUM_OFFSET 4
+#define ENTRY_LENGTH_OFFSET 8
+#define ENTRY_TAIL_OFFSET 12
+#define ENTRY_SEQUENCE_NUMBER_OFFSET 16
+#define DESCRIPTOR_COUNT_OFFSET 24
+#define ENTRY_LOG_GUID_OFFSET 32
+#define FLUSHED_FILE_OFFSET_OFFSET 48
+#define LAST_FILE_OFFSET_OFFSET 56
+
+/*
+ * Defines the offsets used in the descriptors that follow the header.
+ * Zero descriptors have the number of bytes to zero where data
+ * descriptors have the leading bytes of their sector. Data sectors start
+ * with a signature at the same offset.
+ */
+#define DESCRIPTOR_SIZE 32
+#define SIGNATURE_OFFSET 0
+#define TRAILING_BYTES_OFFSET 4
+#define LEADING_BYTES_OFFSET 8
+#define ZERO_LENGTH_OFFSET 8
+#define FILE_OFFSET_OFFSET 16
+#define DESCRIPTOR_SEQUENCE_OFFSET 24
+
+/*
+ * The data sectors that follow the descriptors hold all but the first 8
+ * and the last 4 bytes of a sector, which are in the descriptor.
+ */
+#define LEADING_BYTES 8
+#define TRAILING_BYTES 4
+#define SEQUENCE_HIGH_OFFSET 4
+#define DATA_OFFSET LEADING_BYTES
+#define SEQUENCE_LOW_OFFSET (SECTOR_SIZE - TRAILING_BYTES)
+
+/* The number of zeros written at a time for zero descriptors. */
+#define ZERO_CHUNK (1024 * 1024)
+
+/*
+ * The parsed header of a valid entry, or valid set to false for sectors
+ * that don't start one.
+ */
+struct log_entry {
+	bool	valid;
+	/* True if the entry continues the sequence of the entry before it. */
+	bool	continued;
+	uint32_t length;
+	uint32_t tail;
+	uint64_t sequence_number;
+	uint64_t flushed_file_offset;
+	uint64_t last_file_offset;
+};
+
+/*
+ * Returns the number of sectors the header and count descriptors fill.
+ */
+static uint32_t
+descriptor_sectors(uint64_t count)
+{
+	return howmany(ENTRY_HEADER_SIZE + count * DESCRIPTOR_SIZE, SECTOR_SIZE);
+}
+
+/*
+ * Checks the descriptors and data sectors of the entry of length bytes at
+ * bytes.
+ */
+static bool
+check_descriptors(uint8_t *bytes, uint32_t length, uint64_t sequence_number)
+{
+	uint8_t *descriptor, *sector;
+	uint32_t count, data_sectors, first, signature, i;
+
+	count = le32dec(bytes + DESCRIPTOR_COUNT_OFFSET);
+	first = descriptor_sectors(count);
+	data_sectors = 0;
+	for (i = 0; i < count; i++) {
+		descriptor = bytes + ENTRY_HEADER_SIZE + i * DESCRIPTOR_SIZE;
+		signature = le32dec(descriptor + SIGNATURE_OFFSET);
+		if (le64dec(descriptor + DESCRIPTOR_SEQUENCE_OFFSET) != sequence_number ||
+		    le64dec(descriptor + FILE_OFFSET_OFFSET) % SECTOR_SIZE != 0) {
+			return false;
+		}
+		if (signature == ZERO_SIGNATURE) {
+			if (le64dec(descriptor + ZERO_LENGTH_OFFSET) % SECTOR_SIZE != 0)
+				return false;
+			continue;
+		}
+		if (signature != DESCRIPTOR_SIGNATURE ||
+		    (first + data_sectors + 1) * SECTOR_SIZE > length) {
+			return false;
+		}
+
+		/* The data sector has the sequence number split around it. */
+		sector = bytes + (first + data_sectors) * SECTOR_SIZE;
+		if (le32dec(sector + SIGNATURE_OFFSET) != DATA_SIGNATURE ||
+		    le32dec(sector + SEQUENCE_HIGH_OFFSET) != sequence_number >> 32 ||
+		    le32dec(sector + SEQUENCE_LOW_OFFSET) != (uint32_t)sequence_number) {
+			return false;
+		}
+		data_sectors++;
+	}
+
+	return (first + data_sectors) * SECTOR_SIZE == length;
+}
+
+/*
+ * Parses the entry at position in the log, which is followed by a second
+ * copy of itself so that entries that wrap around are contiguous. Returns
+ * false if there is no valid entry for the log GUID at position.
+ */
+static bool
+parse_entry(uint8_t *log, uint32_t log_length, uint32_t position, uuid_t *guid, struct log_entry *entry)
+{
+	uint8_t *bytes = log + position;
+	uuid_t	entry_guid;
+	uint32_t length, count;
+
+	if (le32dec(bytes + ENTRY_SIGNATURE_OFFSET) != ENTRY_SIGNATURE) {
+		return false;
+	}
+	length = le32dec(bytes + ENTRY_LENGTH_OFFSET);
+	count = le32dec(bytes + DESCRIPTOR_COUNT_OFFSET);
+	uuid_dec_le(bytes + ENTRY_LOG_GUID_OFFSET, &entry_guid);
+	if (length == 0 || length % SECTOR_SIZE != 0 || length > log_length ||
+	    (uint64_t)descriptor_sectors(count) * SECTOR_SIZE > length ||
+	    !uuid_equal(&entry_guid, guid, NULL)) {
+		return false;
+	}
+	if (le32dec(bytes + ENTRY_CHECKSUM_OFFSET) != vhdx_checksum(bytes, length, ENTRY_CHECKSUM_OFFSET)) {
+		return false;
+	}
+
+	entry->length = length;
+	entry->tail = le32dec(bytes + ENTRY_TAIL_OFFSET);
+	entry->sequence_number = le64dec(bytes + ENTRY_SEQUENCE_NUMBER_OFFSET);
+	entry->flushed_file_offset = le64dec(bytes + FLUSHED_FILE_OFFSET_OFFSET);
+	entry->last_file_offset = le64dec(bytes + LAST_FILE_OFFSET_OFFSET);
+
+	return entry->tail < log_length && entry->tail % SECTOR_SIZE == 0 &&
+	    check_descriptors(bytes, length, entry->sequence_number);
+}
+
+/*
+ * Returns the position of the entry that follows the entry at position.
+ */
+static uint32_t
+next_position(struct log_entry *entries, uint32_t log_length, uint32_t position)
+{
+	return (position + entries[position / SECTOR_SIZE].length) % log_length;
+}
+
+/*
+ * Returns true if the entry at position is directly followed by the next
+ * entry in its sequence.
+ */
+static bool
+continues_sequence(struct log_entry *entries, uint32_t log_length, uint32_t position)
+{
+	struct log_entry *entry, *next;
+
+	entry = &entries[position / SECTOR_SIZE];
+	next = &entries[next_position(entries, log_length, position) / SECTOR_SIZE];
+
+	return next->valid && next->sequence_number == entry->sequence_number + 1;
+}
+
+/*
+ * Finds the active sequence of the log, the valid sequence whose last
+ * entry, the head, has the highest sequence number and whose tail is in
+ * the sequence. Returns false if there is none.
+ */
+static bool
+find_sequence(struct log_entry *entries, uint32_t log_length, uint32_t *tail, uint32_t *head)
+{
+	uint64_t total;
+	uint32_t sectors, start, end, position, s;
+	bool	found;
+
+	sectors = log_length / SECTOR_SIZE;
+	for (s = 0; s < sectors; s++) {
+		if (entries[s].valid && continues_sequence(entries, log_length, s * SECTOR_SIZE)) {
+			position = next_position(entries, log_length, s * SECTOR_SIZE);
+			entries[position / SECTOR_SIZE].continued = true;
+		}
+	}
+
+	found = false;
+	for (s = 0; s < sectors; s++) {
+		/* The rest of a sequence has the same head as its first entry. */
+		if (!entries[s].valid || entries[s].continued) {
+			continue;
+		}
+
+		start = s * SECTOR_SIZE;
+		end = start;
+		total = entries[s].length;
+		while (continues_sequence(entries, log_length, end)) {
+			/* A sequence can't be longer than the log. */
+			position = next_position(entries, log_length, end);
+			total += entries[position / SECTOR_SIZE].length;
+			if (total > log_length)
+				break;
+			end = position;
+		}
+		if (found && entries[end / SECTOR_SIZE].sequence_number <=
+		    entries[*head / SECTOR_SIZE].sequence_number) {
+			continue;
+		}
+
+		/* The tail of the head must be one of the entries. */
+		position = start;
+		while (position != end && position != entries[end / SECTOR_SIZE].tail)
+			position = next_position(entries, log_length, position);
+		if (position == entries[end / SECTOR_SIZE].tail) {
+			*tail = position;
+			*head = end;
+			found = true;
+		}
+	}
+
+	return found;
+}
+
+/*
+ * Returns the end of the last byte in the file that the entry at bytes
+ * writes.
+ */
+static uint64_t
+entry_end(uint8_t *bytes)
+{
+	uint8_t *descriptor;
+	uint64_t end, length;
+	uint32_t count, i;
+
+	count = le32dec(bytes + DESCRIPTOR_COUNT_OFFSET);
+	end = 0;
+	for (i = 0; i < count; i++) {
+		descriptor = bytes + ENTRY_HEADER_SIZE + i * DESCRIPTOR_SIZE;
+		length = SECTOR_SIZE;
+		if (le32dec(descriptor + SIGNATURE_OFFSET) == ZERO_SIGNATURE)
+			length = le64dec(descriptor + ZERO_LENGTH_OFFSET);
+		end = MAX(end, le64dec(descriptor + FILE_OFFSET_OFFSET) + length);
+	}
+
+	return end;
+}
+
+/*
+ * Writes the sectors and zeros of the entry at bytes in place, in the
+ * order of the descriptors. Data sectors that are next to each other in
+ * the file are written at once from buffer, which must hold the entry.
+ */
+static LDI_ERROR
+apply_entry(struct file *file, uint8_t *bytes, uint8_t *buffer, uint8_t *zeros, struct logger logger)
+{
+	uint8_t *descriptor, *sector, *run;
+	uint64_t offset, run_offset, zero_length, length;
+	uint32_t count, first, data_sectors, i;
+	size_t	run_length;
+	LDI_ERROR result;
+
+	count = le32dec(bytes + DESCRIPTOR_COUNT_OFFSET);
+	first = descriptor_sectors(count);
+	data_sectors = 0;
+	run_offset = 0;
+	run_length = 0;
+	for (i = 0; i < count; i++) {
+		descriptor = bytes + ENTRY_HEADER_SIZE + i * DESCRIPTOR_SIZE;
+		offset = le64dec(descriptor + FILE_OFFSET_OFFSET);
+
+		if (run_length > 0 && (offset != run_offset + run_length ||
+		    le32dec(descriptor + SIGNATURE_OFFSET) != DESCRIPTOR_SIGNATURE)) {
+			result = file_write(file, buffer, run_length, run_offset, logger);
+			if (IS_ERROR(result)) {
+				return result;
+			}
+			run_length = 0;
+		}
+
+		if (le32dec(descriptor + SIGNATURE_OFFSET) == ZERO_SIGNATURE) {
+			zero_length = le64dec(descriptor + ZERO_LENGTH_OFFSET);
+			while (zero_length > 0) {
+				length = MIN(zero_length, ZERO_CHUNK);
+				result = file_write(file, zeros, length, offset, logger);
+				if (IS_ERROR(result)) {
+					return result;
+				}
+				offset += length;
+				zero_length -= length;
+			}
+			continue;
+		}
+
+		/* Put the sector back together from the descriptor and the data. */
+		if (run_length == 0)
+			run_offset = offset;
+		sector = bytes + (first + data_sectors) * SECTOR_SIZE;
+		run = buffer + run_length;
+		memcpy(run, descriptor + LEADING_BYTES_OFFSET, LEADING_BYTES);
+		memcpy(run + DATA_OFFSET, sector + DATA_OFFSET,
+		    SECTOR_SIZE - LEADING_BYTES - TRAILING_BYTES);
+		memcpy(run + SEQUENCE_LOW_OFFSET, descriptor + TRAILING_BYTES_OFFSET,
+		    TRAILING_BYTES);
+		run_length += SECTOR_SIZE;
+		data_sectors++;
+	}
+
+	if (run_length > 0) {
+		return file_write(file, buffer, run_length, run_offset, logger);
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Writes the entries of the active sequence from the tail to the head in
+ * place, and makes them durable.
+ */
+static LDI_ERROR
+apply_sequence(struct file *file, uint8_t *log, struct log_entry *entries, uint32_t log_length, uint32_t tail, uint32_t head, struct logger logger)
+{
+	uint8_t *buffer, *zeros;
+	uint64_t end;
+	uint32_t position;
+	size_t	filesize;
+	LDI_ERROR result;
+
+	result = file_getsize(file, &filesize);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+	if (filesize < entries[head / SECTOR_SIZE].flushed_file_offset) {
+		LOG_ERROR(logger, "The VHDX file is shorter than its log requires.\n");
+		return ERROR(LDI_ERR_PARSEERROR);
+	}
+
+	/* The file is extended first, since it is written through mappings. */
+	end = entries[head / SECTOR_SIZE].last_file_offset;
+	for (position = tail; ; position = next_position(entries, log_length, position)) {
+		end = MAX(end, entry_end(log + position));
+		if (position == head)
+			break;
+	}
+	if (end > filesize) {
+		result = file_setsize(file, end);
+		if (IS_ERROR(result)) {
+			return result;
+		}
+	}
+
+	buffer = malloc(log_length);
+	zeros = calloc(1, ZERO_CHUNK);
+	if (buffer == NULL || zeros == NULL) {
+		free(buffer);
+		free(zeros);
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	for (position = tail; ; position = next_position(entries, log_length, position)) {
+		result = apply_entry(file, log + position, buffer, zeros, logger);
+		if (IS_ERROR(result) || position == head)
+			break;
+	}
+	free(buffer);
+	free(zeros);
+
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	return file_sync(file);
+}
+
+/*
+ * Replays the log of the file, if the header has a log GUID.
+ */
+LDI_ERROR
+vhdxlog_replay(struct file *file, struct vhdx_header *header, bool *replayed, struct logger logger)
+{
+	struct log_entry *entries;
+	uint8_t *log;
+	uint32_t sectors, tail, head, s;
+	LDI_ERROR result;
+
+	*replayed = false;
+	if (uuid_is_nil(&header->log_guid, NULL)) {
+		return NO_ERROR;
+	}
+	if (header->log_length == 0 || header->log_length % SECTOR_SIZE != 0) {
+		LOG_ERROR(logger, "The VHDX log is invalid.\n");
+		return ERROR(LDI_ERR_PARSEERROR);
+	}
+
+	/*
+	 * The log is followed by a copy of itself, so that entries that wrap
+	 * around the end are in one piece.
+	 */
+	sectors = header->log_length / SECTOR_SIZE;
+	log = malloc(2 * (size_t)header->log_length);
+	entries = calloc(sectors, sizeof(struct log_entry));
+	if (log == NULL || entries == NULL) {
+		free(log);
+		free(entries);
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	result = file_read(file, log, header->log_length, header->log_offset, logger);
+	if (IS_ERROR(result)) {
+		free(log);
+		free(entries);
+		return result;
+	}
+	memcpy(log + header->log_length, log, header->log_length);
+
+	for (s = 0; s < sectors; s++) {
+		entries[s].valid = parse_entry(log, header->log_length, s * SECTOR_SIZE,
+		    &header->log_guid, &entries[s]);
+	}
+
+	/* Without a valid sequence there is nothing that must be replayed. */
+	if (find_sequence(entries, header->log_length, &tail, &head)) {
+		LOG_VERBOSE(logger, "Replaying the VHDX log up to sequence number %ju.\n",
+		    (uintmax_t)entries[head / SECTOR_SIZE].sequence_number);
+		result = apply_sequence(file, log, entries, header->log_length,
+		    tail, head, logger);
+		*replayed = !IS_ERROR(result);
+	}
+	free(log);
+	free(entries);
+
+	return result;
+}
+
+/*
+ * Returns the number of pages a single entry can hold.
+ */
+size_t
+vhdxlog_max_pages(uint32_t log_length)
+{
+	size_t	count;
+
+	count = log_length / SECTOR_SIZE;
+	while (count > 0 && descriptor_sectors(count) + count > log_length / SECTOR_SIZE)
+		count--;
+
+	return count;
+}
+
+/*
+ * Writes an entry for count pages into buffer, and returns its length.
+ */
+static uint32_t
+write_entry(struct vhdx_header *header, uint64_t sequence_number, struct vhdxlog_page *pages, size_t count, uint64_t filesize, uint8_t *buffer)
+{
+	uint8_t *descriptor, *sector;
+	uint32_t first, length;
+	size_t	i;
+
+	first = descriptor_sectors(count);
+	length = (first + count) * SECTOR_SIZE;
+	bzero(buffer, first * SECTOR_SIZE);
+
+	/* The entry is its own tail, since all earlier ones have been applied. */
+	le32enc(buffer + ENTRY_SIGNATURE_OFFSET, ENTRY_SIGNATURE);
+	le32enc(buffer + ENTRY_LENGTH_OFFSET, length);
+	le32enc(buffer + ENTRY_TAIL_OFFSET, 0);
+	le64enc(buffer + ENTRY_SEQUENCE_NUMBER_OFFSET, sequence_number);
+	le32enc(buffer + DESCRIPTOR_COUNT_OFFSET, count);
+	uuid_enc_le(buffer + ENTRY_LOG_GUID_OFFSET, &header->log_guid);
+	le64enc(buffer + FLUSHED_FILE_OFFSET_OFFSET, filesize);
+	le64enc(buffer + LAST_FILE_OFFSET_OFFSET, filesize);
+
+	for (i = 0; i < count; i++) {
+		descriptor = buffer + ENTRY_HEADER_SIZE + i * DESCRIPTOR_SIZE;
+		sector = buffer + (first + i) * SECTOR_SIZE;
+
+		le32enc(descriptor + SIGNATURE_OFFSET, DESCRIPTOR_SIGNATURE);
+		memcpy(descriptor + TRAILING_BYTES_OFFSET, pages[i].data + SEQUENCE_LOW_OFFSET,
+		    TRAILING_BYTES);
+		memcpy(descriptor + LEADING_BYTES_OFFSET, pages[i].data, LEADING_BYTES);
+		le64enc(descriptor + FILE_OFFSET_OFFSET, pages[i].offset);
+		le64enc(descriptor + DESCRIPTOR_SEQUENCE_OFFSET, sequence_number);
+
+		le32enc(sector + SIGNATURE_OFFSET, DATA_SIGNATURE);
+		le32enc(sector + SEQUENCE_HIGH_OFFSET, sequence_number >> 32);
+		memcpy(sector + DATA_OFFSET, pages[i].data + DATA_OFFSET,
+		    SECTOR_SIZE - LEADING_BYTES - TRAILING_BYTES);
+		le32enc(sector + SEQUENCE_LOW_OFFSET, sequence_number);
+	}
+
+	le32enc(buffer + ENTRY_CHECKSUM_OFFSET, vhdx_checksum(buffer, length, ENTRY_CHECKSUM_OFFSET));
+
+	return length;
+}
+
+/*
+ * Writes the pages in place, with the pages that are next to each other
+ * in the file written at once from buffer.
+ */
+static LDI_ERROR
+write_pages(struct file *file, struct vhdxlog_page *pages, size_t count, uint8_t *buffer, struct logger logger)
+{
+	size_t	first, i;
+	LDI_ERROR result;
+
+	for (first = 0; first < count; first = i) {
+		memcpy(buffer, pages[first].data, SECTOR_SIZE);
+		for (i = first + 1; i < count &&
+		    pages[i].offset == pages[i - 1].offset + SECTOR_SIZE; i++) {
+			memcpy(buffer + (i - first) * SECTOR_SIZE, pages[i].data, SECTOR_SIZE);
+		}
+		result = file_write(file, buffer, (i - first) * SECTOR_SIZE,
+		    pages[first].offset, logger);
+		if (IS_ERROR(result)) {
+			return result;
+		}
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Writes the pages to the file through the log, as many at a time as an
+ * entry can hold.
+ */
+LDI_ERROR
+vhdxlog_commit(struct file *file, struct vhdx_header *header, uint64_t *sequence_number, struct vhdxlog_page *pages, size_t count, struct logger logger)
+{
+	uint8_t *buffer;
+	uint32_t length;
+	size_t	max_pages, filesize, n;
+	LDI_ERROR result;
+
+	max_pages = vhdxlog_max_pages(header->log_length);
+	if (max_pages == 0) {
+		LOG_ERROR(logger, "The VHDX log is too small.\n");
+		return ERROR(LDI_ERR_IO);
+	}
+	result = file_getsize(file, &filesize);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+	buffer = malloc(header->log_length);
+	if (buffer == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+
+	/*
+	 * Each entry is written at the start of the log, so that the one
+	 * with the highest sequence number is the only one that is replayed.
+	 */
+	while (count > 0 && !IS_ERROR(result)) {
+		n = MIN(count, max_pages);
+		length = write_entry(header, *sequence_number, pages, n, filesize, buffer);
+		result = file_write(file, buffer, length, header->log_offset, logger);
+		if (!IS_ERROR(result)) {
+			result = file_sync(file);
+		}
+		if (!IS_ERROR(result)) {
+			(*sequence_number)++;
+			result = write_pages(file, pages, n, buffer, logger);
+		}
+		if (!IS_ERROR(result)) {
+			result = file_sync(file);
+		}
+		pages += n;
+		count -= n;
+	}
+	free(buffer);
+
+	return result;
+}
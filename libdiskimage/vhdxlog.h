@@ -0,0 +1,49 @@
+#ifndef _VHDXLOG_H_
+#define _VHDXLOG_H_
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "diskimage.h"
+#include "fileinterface.h"
+#include "vhdxheader.h"
+
+/* The log writes metadata a sector of this size at a time. */
+#define VHDX_LOG_SECTOR_SIZE 4096
+
+/*
+ * A sector of metadata, such as a part of the BAT, that is written through
+ * the log. offset is in bytes from the start of the file.
+ */
+struct vhdxlog_page {
+	uint64_t offset;
+	uint8_t *data;
+};
+
+/*
+ * Replays the log of the file that the header points at, if the header
+ * has a log GUID. The whole log is read at once, the sequence of valid
+ * entries with the highest sequence number is found, and its writes are
+ * made durable with a single sync. replayed is set to true if any entries
+ * were replayed. The caller must write a header without the log GUID
+ * afterwards.
+ */
+LDI_ERROR vhdxlog_replay(struct file *file, struct vhdx_header *header, bool *replayed, struct logger logger);
+
+/*
+ * Returns the number of pages a single entry in a log of log_length bytes
+ * can hold.
+ */
+size_t	vhdxlog_max_pages(uint32_t log_length);
+
+/*
+ * Writes count pages, which must be sorted by offset, to the file through
+ * the log that the header points at. The header must have a log GUID that
+ * is durable in the file. Each entry is made durable before its pages are
+ * written in place, and the pages are durable when this returns. The next
+ * sequence number is taken from and stored in sequence_number.
+ */
+LDI_ERROR vhdxlog_commit(struct file *file, struct vhdx_header *header, uint64_t *sequence_number, struct vhdxlog_page *pages, size_t count, struct logger logger);
+
+#endif					/* _VHDXLOG_H_ */
@@ -0,0 +1,338 @@
+
+#include <sys/endian.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <uuid.h>
+
+#include "internal.h"
+#include "vhdxmetadata.h"
+
+/* The signature of the metadata table. */
+#define METADATA_SIGNATURE "metadata"
+#define METADATA_SIGNATURE_SIZE 8
+
+/* The table of items at the start of the region, and its entries. */
+#define METADATA_TABLE_SIZE (64 * 1024)
+#define TABLE_ENTRY_COUNT_OFFSET 10
+#define TABLE_ENTRIES_OFFSET 32
+#define TABLE_ENTRY_SIZE 32
+#define TABLE_ENTRY_ITEM_ID_OFFSET 0
+#define TABLE_ENTRY_OFFSET_OFFSET 16
+#define TABLE_ENTRY_LENGTH_OFFSET 20
+#define TABLE_ENTRY_FLAGS_OFFSET 24
+#define TABLE_ENTRY_FLAG_REQUIRED 0x4
+
+/* The largest number of entries the table can hold. */
+#define MAX_METADATA_ENTRIES 2047
+
+/* The fields of the file parameters item. */
+#define FILE_PARAMETERS_SIZE 8
+#define FILE_PARAMETERS_BLOCK_SIZE_OFFSET 0
+#define FILE_PARAMETERS_FLAGS_OFFSET 4
+#define FLAG_LEAVE_BLOCKS_ALLOCATED 0x1
+#define FLAG_HAS_PARENT 0x2
+
+/* The header of the parent locator item and its entries. */
+#define LOCATOR_TYPE_OFFSET 0
+#define LOCATOR_COUNT_OFFSET 18
+#define LOCATOR_ENTRIES_OFFSET 20
+#define LOCATOR_ENTRY_SIZE 12
+#define LOCATOR_KEY_OFFSET_OFFSET 0
+#define LOCATOR_VALUE_OFFSET_OFFSET 4
+#define LOCATOR_KEY_LENGTH_OFFSET 8
+#define LOCATOR_VALUE_LENGTH_OFFSET 10
+
+/* The items that must be present in every file. */
+#define ITEM_FILE_PARAMETERS 0x01
+#define ITEM_DISK_SIZE 0x02
+#define ITEM_LOGICAL_SECTOR_SIZE 0x04
+#define ITEM_PHYSICAL_SECTOR_SIZE 0x08
+#define ITEM_PARENT_LOCATOR 0x10
+#define REQUIRED_ITEMS (ITEM_FILE_PARAMETERS | ITEM_DISK_SIZE | \
+	ITEM_LOGICAL_SECTOR_SIZE | ITEM_PHYSICAL_SECTOR_SIZE)
+
+/* CAA16737-FA36-4D43-B3B6-33F0AA44E76B */
+static const uuid_t file_parameters_guid = {0xcaa16737, 0xfa36, 0x4d43, 0xb3, 0xb6,
+	{0x33, 0xf0, 0xaa, 0x44, 0xe7, 0x6b}};
+
+/* 2FA54224-CD1B-4876-B211-5DBED83BF4B8 */
+static const uuid_t disk_size_guid = {0x2fa54224, 0xcd1b, 0x4876, 0xb2, 0x11,
+	{0x5d, 0xbe, 0xd8, 0x3b, 0xf4, 0xb8}};
+
+/* BECA12AB-B2E6-4523-93EF-C309E000C746 */
+static const uuid_t disk_id_guid = {0xbeca12ab, 0xb2e6, 0x4523, 0x93, 0xef,
+	{0xc3, 0x09, 0xe0, 0x00, 0xc7, 0x46}};
+
+/* 8141BF1D-A96F-4709-BA47-F233A8FAAB5F */
+static const uuid_t logical_sector_size_guid = {0x8141bf1d, 0xa96f, 0x4709, 0xba, 0x47,
+	{0xf2, 0x33, 0xa8, 0xfa, 0xab, 0x5f}};
+
+/* CDA348C7-445D-4471-9CC9-E9885251C556 */
+static const uuid_t physical_sector_size_guid = {0xcda348c7, 0x445d, 0x4471, 0x9c, 0xc9,
+	{0xe9, 0x88, 0x52, 0x51, 0xc5, 0x56}};
+
+/* A8D35F2D-B30B-454D-ABF7-D3D84834AB0C */
+static const uuid_t parent_locator_guid = {0xa8d35f2d, 0xb30b, 0x454d, 0xab, 0xf7,
+	{0xd3, 0xd8, 0x48, 0x34, 0xab, 0x0c}};
+
+/* B04AEFB7-D19E-4A81-B789-25B8E9445913, the only type of parent locator. */
+static const uuid_t vhdx_locator_type_guid = {0xb04aefb7, 0xd19e, 0x4a81, 0xb7, 0x89,
+	{0x25, 0xb8, 0xe9, 0x44, 0x59, 0x13}};
+
+/*
+ * Converts length bytes of UTF-16 little endian at source to a NUL
+ * terminated ASCII string. Characters outside ASCII become '?'. The result
+ * must be freed.
+ */
+static char *
+utf16_to_ascii(uint8_t *source, size_t length)
+{
+	char   *result;
+	uint16_t c;
+	size_t i;
+
+	result = malloc(length / 2 + 1);
+	if (result == NULL) {
+		return NULL;
+	}
+	for (i = 0; i < length / 2; i++) {
+		c = le16dec(source + i * 2);
+		result[i] = c < 0x80 ? c : '?';
+	}
+	result[i] = 0;
+
+	return result;
+}
+
+/*
+ * Parses a GUID in braces, such as the value of the parent_linkage key.
+ */
+static bool
+parse_linkage(struct vhdx_parent_locator_entry *entry, uuid_t *linkage)
+{
+	char   *value;
+	size_t	length;
+	uint32_t status;
+
+	value = utf16_to_ascii((uint8_t *)entry->value, entry->value_length);
+	if (value == NULL) {
+		return false;
+	}
+	length = strlen(value);
+	status = uuid_s_invalid_string_uuid;
+	if (length > 2 && value[0] == '{' && value[length - 1] == '}') {
+		value[length - 1] = 0;
+		uuid_from_string(value + 1, linkage, &status);
+	}
+	free(value);
+
+	return status == uuid_s_ok;
+}
+
+/*
+ * Parses the parent locator item of length bytes at source.
+ */
+static LDI_ERROR
+parse_parent_locator(uint8_t *source, uint32_t length, struct vhdx_metadata *metadata)
+{
+	struct vhdx_parent_locator_entry *entry;
+	uuid_t	type;
+	uint8_t *raw;
+	uint32_t key_offset, value_offset;
+	uint16_t count, key_length, value_length, i;
+
+	if (length < LOCATOR_ENTRIES_OFFSET) {
+		return ERROR(LDI_ERR_PARSEERROR);
+	}
+	uuid_dec_le(source + LOCATOR_TYPE_OFFSET, &type);
+	if (!uuid_equal(&type, (uuid_t *)&vhdx_locator_type_guid, NULL)) {
+		return ERROR(LDI_ERR_FILENOTSUP);
+	}
+	count = le16dec(source + LOCATOR_COUNT_OFFSET);
+	if (LOCATOR_ENTRIES_OFFSET + (uint32_t)count * LOCATOR_ENTRY_SIZE > length) {
+		return ERROR(LDI_ERR_PARSEERROR);
+	}
+
+	metadata->parent_entries = calloc(count > 0 ? count : 1,
+	    sizeof(struct vhdx_parent_locator_entry));
+	if (metadata->parent_entries == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+
+	for (i = 0; i < count; i++) {
+		raw = source + LOCATOR_ENTRIES_OFFSET + i * LOCATOR_ENTRY_SIZE;
+		key_offset = le32dec(raw + LOCATOR_KEY_OFFSET_OFFSET);
+		value_offset = le32dec(raw + LOCATOR_VALUE_OFFSET_OFFSET);
+		key_length = le16dec(raw + LOCATOR_KEY_LENGTH_OFFSET);
+		value_length = le16dec(raw + LOCATOR_VALUE_LENGTH_OFFSET);
+		if ((uint64_t)key_offset + key_length > length ||
+		    (uint64_t)value_offset + value_length > length) {
+			return ERROR(LDI_ERR_PARSEERROR);
+		}
+
+		entry = &metadata->parent_entries[i];
+		metadata->parent_entry_count = i + 1;
+		entry->key = utf16_to_ascii(source + key_offset, key_length);
+		entry->value = malloc(value_length > 0 ? value_length : 1);
+		if (entry->key == NULL || entry->value == NULL) {
+			return ERROR(LDI_ERR_NOMEM);
+		}
+		memcpy(entry->value, source + value_offset, value_length);
+		entry->value_length = value_length;
+
+		if (strcmp(entry->key, "parent_linkage") == 0 &&
+		    !parse_linkage(entry, &metadata->parent_linkage)) {
+			return ERROR(LDI_ERR_PARSEERROR);
+		}
+		if (strcmp(entry->key, "parent_linkage2") == 0) {
+			metadata->has_parent_linkage2 =
+			    parse_linkage(entry, &metadata->parent_linkage2);
+		}
+	}
+
+	/* The linkage is the only key every parent locator must have. */
+	if (!vhdx_metadata_parent_entry(metadata, "parent_linkage", NULL, NULL)) {
+		return ERROR(LDI_ERR_PARSEERROR);
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Parses the item of length bytes at source with the guid into metadata,
+ * and adds it to the set of found items. Unknown items are skipped unless
+ * they are required.
+ */
+static LDI_ERROR
+parse_item(uuid_t *guid, uint8_t *source, uint32_t length, bool required, struct vhdx_metadata *metadata, int *found)
+{
+	if (uuid_equal(guid, (uuid_t *)&file_parameters_guid, NULL) &&
+	    length >= FILE_PARAMETERS_SIZE) {
+		metadata->block_size = le32dec(source + FILE_PARAMETERS_BLOCK_SIZE_OFFSET);
+		metadata->leave_blocks_allocated =
+		    (le32dec(source + FILE_PARAMETERS_FLAGS_OFFSET) & FLAG_LEAVE_BLOCKS_ALLOCATED) != 0;
+		metadata->has_parent =
+		    (le32dec(source + FILE_PARAMETERS_FLAGS_OFFSET) & FLAG_HAS_PARENT) != 0;
+		*found |= ITEM_FILE_PARAMETERS;
+	} else if (uuid_equal(guid, (uuid_t *)&disk_size_guid, NULL) &&
+	    length >= sizeof(uint64_t)) {
+		metadata->disk_size = le64dec(source);
+		*found |= ITEM_DISK_SIZE;
+	} else if (uuid_equal(guid, (uuid_t *)&logical_sector_size_guid, NULL) &&
+	    length >= sizeof(uint32_t)) {
+		metadata->logical_sector_size = le32dec(source);
+		*found |= ITEM_LOGICAL_SECTOR_SIZE;
+	} else if (uuid_equal(guid, (uuid_t *)&physical_sector_size_guid, NULL) &&
+	    length >= sizeof(uint32_t)) {
+		metadata->physical_sector_size = le32dec(source);
+		*found |= ITEM_PHYSICAL_SECTOR_SIZE;
+	} else if (uuid_equal(guid, (uuid_t *)&disk_id_guid, NULL) &&
+	    length >= sizeof(uuid_t)) {
+		uuid_dec_le(source, &metadata->disk_id);
+	} else if (uuid_equal(guid, (uuid_t *)&parent_locator_guid, NULL)) {
+		*found |= ITEM_PARENT_LOCATOR;
+		return parse_parent_locator(source, length, metadata);
+	} else if (required) {
+		return ERROR(LDI_ERR_FILENOTSUP);
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Creates new metadata by reading the metadata region from source.
+ */
+LDI_ERROR
+vhdx_metadata_new(void *source, size_t length, struct vhdx_metadata **metadata)
+{
+	uint8_t *bytes = source;
+	uint8_t *entry;
+	uuid_t	guid;
+	uint32_t offset, item_length;
+	uint16_t count, i;
+	int	found;
+	LDI_ERROR result;
+
+	if (length < METADATA_TABLE_SIZE ||
+	    memcmp(bytes, METADATA_SIGNATURE, METADATA_SIGNATURE_SIZE) != 0) {
+		return ERROR(LDI_ERR_PARSEERROR);
+	}
+	count = le16dec(bytes + TABLE_ENTRY_COUNT_OFFSET);
+	if (count > MAX_METADATA_ENTRIES) {
+		return ERROR(LDI_ERR_PARSEERROR);
+	}
+
+	*metadata = calloc(1, sizeof(struct vhdx_metadata));
+	if (*metadata == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+
+	found = 0;
+	result = NO_ERROR;
+	for (i = 0; i < count && !IS_ERROR(result); i++) {
+		entry = bytes + TABLE_ENTRIES_OFFSET + i * TABLE_ENTRY_SIZE;
+		uuid_dec_le(entry + TABLE_ENTRY_ITEM_ID_OFFSET, &guid);
+		offset = le32dec(entry + TABLE_ENTRY_OFFSET_OFFSET);
+		item_length = le32dec(entry + TABLE_ENTRY_LENGTH_OFFSET);
+
+		/* Items are stored after the table. */
+		if (item_length > 0 && (offset < METADATA_TABLE_SIZE ||
+		    (uint64_t)offset + item_length > length)) {
+			result = ERROR(LDI_ERR_PARSEERROR);
+			break;
+		}
+		result = parse_item(&guid, bytes + offset, item_length,
+		    (le32dec(entry + TABLE_ENTRY_FLAGS_OFFSET) & TABLE_ENTRY_FLAG_REQUIRED) != 0,
+		    *metadata, &found);
+	}
+
+	if (!IS_ERROR(result) && ((found & REQUIRED_ITEMS) != REQUIRED_ITEMS ||
+	    ((*metadata)->has_parent && (found & ITEM_PARENT_LOCATOR) == 0))) {
+		result = ERROR(LDI_ERR_PARSEERROR);
+	}
+	if (IS_ERROR(result)) {
+		vhdx_metadata_destroy(metadata);
+		return result;
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Finds the parent locator entry with the key.
+ */
+bool
+vhdx_metadata_parent_entry(struct vhdx_metadata *metadata, char *key, char **value, uint16_t *value_length)
+{
+	uint16_t i;
+
+	for (i = 0; i < metadata->parent_entry_count; i++) {
+		if (strcmp(metadata->parent_entries[i].key, key) != 0)
+			continue;
+		if (value != NULL)
+			*value = metadata->parent_entries[i].value;
+		if (value_length != NULL)
+			*value_length = metadata->parent_entries[i].value_length;
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * Frees memory and zeros the metadata.
+ */
+void
+vhdx_metadata_destroy(struct vhdx_metadata **metadata)
+{
+	uint16_t i;
+
+	for (i = 0; i < (*metadata)->parent_entry_count; i++) {
+		free((*metadata)->parent_entries[i].key);
+		free((*metadata)->parent_entries[i].value);
+	}
+	free((*metadata)->parent_entries);
+	free(*metadata);
+	*metadata = NULL;
+}
@@ -0,0 +1,67 @@
+#ifndef _VHDXMETADATA_H_
+#define _VHDXMETADATA_H_
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <uuid.h>
+
+#include "diskimage.h"
+
+/*
+ * An entry of the parent locator of a differencing disk. The key is
+ * converted to ASCII, and the value is kept as UTF-16 little endian, as it
+ * is in the file.
+ */
+struct vhdx_parent_locator_entry {
+	char   *key;
+	char   *value;
+	uint16_t value_length;
+};
+
+/*
+ * The parsed form of the metadata region of a VHDX file.
+ */
+struct vhdx_metadata {
+	/* The number of bytes of the disk in each payload block. */
+	uint32_t block_size;
+	/* True for fixed disks, whose blocks can't be unmapped. */
+	bool	leave_blocks_allocated;
+	/* True for differencing disks. */
+	bool	has_parent;
+	/* The number of bytes in the disk. */
+	uint64_t disk_size;
+	uint32_t logical_sector_size;
+	uint32_t physical_sector_size;
+	uuid_t	disk_id;
+	/*
+	 * The data write GUID of the parent the disk was created from, and
+	 * that of the parent it was last opened with, if set.
+	 */
+	uuid_t	parent_linkage;
+	uuid_t	parent_linkage2;
+	bool	has_parent_linkage2;
+	uint16_t parent_entry_count;
+	struct vhdx_parent_locator_entry *parent_entries;
+};
+
+/*
+ * Creates new metadata by reading the metadata region of length bytes
+ * from source. Fails with LDI_ERR_PARSEERROR if the region is invalid or
+ * lacks a required item, and with LDI_ERR_FILENOTSUP if it has a required
+ * item that is not known.
+ */
+LDI_ERROR vhdx_metadata_new(void *source, size_t length, struct vhdx_metadata **metadata);
+
+/*
+ * Finds the parent locator entry with the key. Returns false if there is
+ * none.
+ */
+bool	vhdx_metadata_parent_entry(struct vhdx_metadata *metadata, char *key, char **value, uint16_t *value_length);
+
+/*
+ * Frees memory and zeros the metadata.
+ */
+void	vhdx_metadata_destroy(struct vhdx_metadata **metadata);
+
+#endif					/* _VHDXMETADATA_H_ */
@@ -0,0 +1,96 @@
+
+#include <stdlib.h>
+
+#include "diskimage.h"
+#include "fileinterface.h"
+#include "internal.h"
+#include "parser.h"
+#include "vhdxheader.h"
+#include "vhdxinstance.h"
+
+void	vhdxparser_destroy(void **parser);
+
+/*
+ * Creates the parser state, which is the disk itself.
+ */
+LDI_ERROR
+vhdxparser_new(struct fileinterface *fi, char *path, struct diskimage_options options, void **parser, struct logger logger)
+{
+	return vhdxinstance_open(fi, path, (struct vhdxinstance **)parser, logger);
+}
+
+/*
+ * Deallocates the parser state and sets the pointer to NULL.
+ */
+void
+vhdxparser_destroy(void **parser)
+{
+	vhdxinstance_destroy((struct vhdxinstance **)parser);
+}
+
+/*
+ * Returns a diskinfo struct with properties for the disk.
+ */
+struct diskinfo
+vhdxparser_diskinfo(void *parser)
+{
+	struct diskinfo result;
+
+	result.disksize = vhdxinstance_size(parser);
+
+	return result;
+}
+
+/*
+ * Reads nbytes at offset into the buffer.
+ */
+LDI_ERROR
+vhdxparser_read(void *parser, char *buf, size_t nbytes, off_t offset)
+{
+	return vhdxinstance_read(parser, buf, nbytes, offset);
+}
+
+/*
+ * Writes nbytes from the buffer into the diskimage at the specified offset.
+ */
+LDI_ERROR
+vhdxparser_write(void *parser, char *buf, size_t nbytes, off_t offset)
+{
+	return vhdxinstance_write(parser, buf, nbytes, offset);
+}
+
+/*
+ * Makes all data written to the diskimage durable.
+ */
+LDI_ERROR
+vhdxparser_flush(void *parser)
+{
+	return vhdxinstance_flush(parser);
+}
+
+/*
+ * Returns true if the file starts a VHDX image.
+ */
+bool
+vhdxparser_probe(void *head, void *tail)
+{
+	return vhdx_file_identifier_valid(head);
+}
+
+/*
+ * Define an ldi_parser struct for the VHDX parser and define the parser
+ * using the PARSER_DEFINE macro. This will make the parser discoverable
+ * in diskimage.c.
+ */
+static struct ldi_parser vhdxparser_format = {
+	.name = "vhdx",
+	.probe = vhdxparser_probe,
+	.construct = vhdxparser_new,
+	.destructor = vhdxparser_destroy,
+	.diskinfo = vhdxparser_diskinfo,
+	.read = vhdxparser_read,
+	.write = vhdxparser_write,
+	.flush = vhdxparser_flush
+};
+
+PARSER_DEFINE(vhdxparser_format);
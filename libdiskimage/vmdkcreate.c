@@ -0,0 +1,209 @@
+
+#include <sys/param.h>
+#include <sys/endian.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "diskimage.h"
+#include "fileinterface.h"
+#include "internal.h"
+#include "log.h"
+#include "vmdkcreate.h"
+#include "vmdkdescriptorfile.h"
+#include "vmdksparse.h"
+#include "vmdksparseheader.h"
+
+#define SECTOR_SIZE 512
+
+/* The layout of new sparse extents, the same as VMware uses. */
+#define GRAIN_SIZE 128
+#define NUM_GTES_PER_GT 512
+#define DESCRIPTOR_SECTORS 20
+
+/* The descriptor of new children. */
+#define DESCRIPTOR_FORMAT \
+	"# Disk DescriptorFile\n" \
+	"version=1\n" \
+	"CID=%08x\n" \
+	"parentCID=%08x\n" \
+	"createType=\"monolithicSparse\"\n" \
+	"parentFileNameHint=\"%s\"\n" \
+	"\n" \
+	"# Extent description\n" \
+	"RW %ju SPARSE \"%s\"\n" \
+	"\n" \
+	"# The Disk Data Base\n" \
+	"#DDB\n" \
+	"\n" \
+	"ddb.virtualHWVersion = \"4\"\n" \
+	"ddb.adapterType = \"ide\"\n" \
+	"ddb.geometry.cylinders = \"%ju\"\n" \
+	"ddb.geometry.heads = \"16\"\n" \
+	"ddb.geometry.sectors = \"63\"\n"
+
+/*
+ * Writes the grain directory for num_gts grain tables, placed right after
+ * the directory.
+ */
+static LDI_ERROR
+write_directory(struct file *child, uint64_t offset, uint32_t num_gts, uint32_t gd_sectors, struct logger logger)
+{
+	uint32_t *gd;
+	uint32_t i, gt_sectors;
+	LDI_ERROR result;
+
+	gd = calloc(gd_sectors, SECTOR_SIZE);
+	if (gd == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+
+	/*
+	 * The grain tables are not written. They are in a hole in the file,
+	 * and read as zeros, which marks all grains as unallocated.
+	 */
+	gt_sectors = NUM_GTES_PER_GT * sizeof(uint32_t) / SECTOR_SIZE;
+	for (i = 0; i < num_gts; i++) {
+		gd[i] = htole32(offset + gd_sectors + i * gt_sectors);
+	}
+
+	result = file_write(child, gd, (size_t)gd_sectors * SECTOR_SIZE, offset * SECTOR_SIZE, logger);
+	free(gd);
+
+	return result;
+}
+
+/*
+ * Writes an empty sparse extent with an embedded descriptor that refers
+ * to the parent.
+ */
+static LDI_ERROR
+write_child(struct fileinterface *fi, struct file *child, char *parent_path, struct vmdkdescriptorfile *parent, struct logger logger)
+{
+	struct vmdksparseheader header;
+	char *buffer, *descriptor, *directory, *relative, *name;
+	uint64_t capacity;
+	uint32_t cid, num_gts, gd_sectors, gt_sectors;
+	size_t length;
+	int i;
+	LDI_ERROR result;
+
+	capacity = 0;
+	for (i = 0; i < parent->numextents; i++) {
+		capacity += parent->extents[i]->sectors;
+	}
+	if (capacity == 0) {
+		return ERROR(LDI_ERR_PARSEERROR);
+	}
+
+	/* Store the hint relative to the child, like VMware does. */
+	directory = file_getdirectory(child);
+	if (directory == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	result = fileinterface_getrelativepath(fi, directory, parent_path, &relative);
+	free(directory);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	/* The content id changes whenever the disk is written. */
+	do {
+		cid = arc4random();
+	} while (cid == parent->cid || cid == VMDK_CID_NOPARENT);
+
+	name = strrchr(file_getpath(child), '/');
+	length = asprintf(&descriptor, DESCRIPTOR_FORMAT, cid, parent->cid,
+	    relative, (uintmax_t)capacity,
+	    name != NULL ? name + 1 : file_getpath(child),
+	    (uintmax_t)MIN(capacity / (16 * 63), 16383));
+	free(relative);
+	if (length == (size_t)-1) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+
+	/*
+	 * The layout is the header, the descriptor, the redundant grain
+	 * directory and tables, and the grain directory and tables.
+	 */
+	num_gts = howmany(capacity, GRAIN_SIZE * NUM_GTES_PER_GT);
+	gd_sectors = howmany(num_gts * sizeof(uint32_t), SECTOR_SIZE);
+	gt_sectors = NUM_GTES_PER_GT * sizeof(uint32_t) / SECTOR_SIZE;
+
+	bzero(&header, sizeof(header));
+	header.version = 1;
+	header.flags = VMDK_FLAG_VALID_NEWLINE_TEST | VMDK_FLAG_REDUNDANT_GRAIN_TABLE;
+	header.capacity = capacity;
+	header.grain_size = GRAIN_SIZE;
+	header.descriptor_offset = 1;
+	header.descriptor_size = MAX(DESCRIPTOR_SECTORS, howmany(length, SECTOR_SIZE));
+	header.num_gtes_per_gt = NUM_GTES_PER_GT;
+	header.rgd_offset = header.descriptor_offset + header.descriptor_size;
+	header.gd_offset = header.rgd_offset + gd_sectors + (uint64_t)num_gts * gt_sectors;
+	header.overhead = roundup(header.gd_offset + gd_sectors + (uint64_t)num_gts * gt_sectors, GRAIN_SIZE);
+
+	buffer = calloc(1 + header.descriptor_size, SECTOR_SIZE);
+	if (buffer == NULL) {
+		free(descriptor);
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	vmdksparseheader_write(&header, buffer);
+	memcpy(buffer + SECTOR_SIZE, descriptor, length);
+	free(descriptor);
+
+	/* Grains are allocated after the metadata. */
+	result = file_setsize(child, header.overhead * SECTOR_SIZE);
+	if (!IS_ERROR(result)) {
+		result = file_write(child, buffer, (1 + header.descriptor_size) * SECTOR_SIZE, 0, logger);
+	}
+	free(buffer);
+	if (!IS_ERROR(result)) {
+		result = write_directory(child, header.rgd_offset, num_gts, gd_sectors, logger);
+	}
+	if (!IS_ERROR(result)) {
+		result = write_directory(child, header.gd_offset, num_gts, gd_sectors, logger);
+	}
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	return file_sync(child);
+}
+
+/*
+ * Creates a new, empty child of the VMDK at parent_path.
+ */
+LDI_ERROR
+vmdkcreate_child(struct fileinterface *fi, char *parent_path, char *child_path, struct logger logger)
+{
+	struct vmdkdescriptorfile *parent;
+	struct file *parent_file, *child;
+	LDI_ERROR result;
+
+	result = file_open_readonly(fi, parent_path, &parent_file);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+	result = vmdksparse_read_descriptor(parent_file, &parent, logger);
+	file_close(&parent_file);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	result = file_create_new(fi, child_path, &child);
+	if (IS_ERROR(result)) {
+		vmdkdescriptorfile_destroy(&parent);
+		return result;
+	}
+
+	result = write_child(fi, child, parent_path, parent, logger);
+	vmdkdescriptorfile_destroy(&parent);
+	file_close(&child);
+	if (IS_ERROR(result)) {
+		/* Don't leave a partial image behind. */
+		file_remove(fi, child_path);
+	}
+
+	return result;
+}
@@ -0,0 +1,15 @@
+#ifndef _VMDKCREATE_H_
+#define _VMDKCREATE_H_
+
+#include "diskimage.h"
+#include "fileinterface.h"
+
+/*
+ * Creates a new, empty monolithicSparse child at child_path of the VMDK
+ * whose descriptor is at parent_path. The child refers to the parent with
+ * parentCID and parentFileNameHint. Only the descriptor of the parent is
+ * read. Fails if child_path already exists.
+ */
+LDI_ERROR vmdkcreate_child(struct fileinterface *fi, char *parent_path, char *child_path, struct logger logger);
+
+#endif					/* _VMDKCREATE_H_ */
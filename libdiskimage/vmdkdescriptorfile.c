@@ -1,6 +1,8 @@
 
+#include <sys/param.h>
 #include <sys/queue.h>
 
+#include <stdbool.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -41,7 +43,7 @@ size_t
 get_key_value(char *input, size_t length, struct key_value *result)
 {
 	char *cur;
-	char *last_nonwhite;
+	char *last_nonwhite = NULL;
 	char *end = input + length;
 	enum parser_state state = BEFORE_KEY;
 
@@ -96,18 +98,62 @@ get_key_value(char *input, size_t length, struct key_value *result)
 	return cur - input;
 }
 
+/*
+ * Parses the number in the length characters of value, in the given base
+ * of 10 or 16. Returns false if there is anything but digits.
+ */
+static bool
+parse_number(char *value, size_t length, int base, uint32_t *result)
+{
+	size_t i;
+	int digit;
+
+	if (length == 0) {
+		return false;
+	}
+
+	*result = 0;
+	for (i = 0; i < length; i++) {
+		if (value[i] >= '0' && value[i] <= '9') {
+			digit = value[i] - '0';
+		} else if (base == 16 && value[i] >= 'a' && value[i] <= 'f') {
+			digit = value[i] - 'a' + 10;
+		} else if (base == 16 && value[i] >= 'A' && value[i] <= 'F') {
+			digit = value[i] - 'A' + 10;
+		} else {
+			return false;
+		}
+		*result = *result * base + digit;
+	}
+
+	return true;
+}
+
+/*
+ * Copies the value into the string arena of the descriptorfile.
+ */
+static char *
+store_string(struct vmdkdescriptorfile *descriptorfile, char *value, size_t length)
+{
+	char *result = descriptorfile->strings;
+
+	memcpy(result, value, length);
+	result[length] = 0;
+	descriptorfile->strings += length + 1;
+
+	return result;
+}
+
 /*
  * Stores the version in the descriptorfile.
  */
 LDI_ERROR
-handle_version(struct vmdkdescriptorfile *descriptorfile, char *value)
+handle_version(struct vmdkdescriptorfile *descriptorfile, char *value, size_t length)
 {
-	long version;
-	char *endptr = NULL;
+	uint32_t version;
 
-	version = strtol(value, &endptr, 10);
-	if (endptr != value + strlen(value)) {
-		/* Failed to intepret the entire value as a long. */
+	if (!parse_number(value, length, 10, &version)) {
+		/* Failed to intepret the entire value as a number. */
 		return ERROR(LDI_ERR_PARSEERROR);
 	}
 	descriptorfile->version = version;
@@ -145,12 +191,12 @@ struct type_name types[] = {
  * Stores the file type (called createtype in the spec) in the descriptorfile.
  */
 LDI_ERROR
-handle_createtype(struct vmdkdescriptorfile *descriptorfile, char *value)
+handle_createtype(struct vmdkdescriptorfile *descriptorfile, char *value, size_t length)
 {
 	int i;
 
 	for (i = 0; types[i].name; i++) {
-		if (strcmp(value, types[i].name) == 0) {
+		if (strncmp(value, types[i].name, length) == 0 && types[i].name[length] == 0) {
 			descriptorfile->filetype = types[i].type;
 			return NO_ERROR;
 		}
@@ -160,26 +206,27 @@ handle_createtype(struct vmdkdescriptorfile *descriptorfile, char *value)
 }
 
 /*
- * Stores the extent description in the descriptorfile.
+ * Parses the extent description into the next free descriptor of the
+ * arena.
  */
 LDI_ERROR
-handle_extent(struct vmdkdescriptorfile *descriptorfile, char *value)
+handle_extent(struct vmdkdescriptorfile *descriptorfile, char *value, size_t length)
 {
 	LDI_ERROR res;
 	struct vmdkextentdescriptor *extentdescriptor;
 
-	res = vmdkextentdescriptor_new(value, &extentdescriptor);
+	if (descriptorfile->numextents == UINT16_MAX) {
+		/* Too many extents to count. */
+		return ERROR(LDI_ERR_FILENOTSUP);
+	}
+	extentdescriptor = &descriptorfile->extentarena[descriptorfile->numextents];
+	res = vmdkextentdescriptor_parse(value, length, extentdescriptor,
+	    &descriptorfile->strings);
 	if (IS_ERROR(res)) {
 		/* We couldn't parse the extent. */
 		return res;
 	}
-	/*
-	 * Increment numextents and reallocate the extents array to make
-	 * sure that the new entry fits.
-	 */
-	descriptorfile->numextents++;
-	descriptorfile->extents = realloc(descriptorfile->extents, descriptorfile->numextents * sizeof(struct vmdkextentdescriptor *));
-	descriptorfile->extents[descriptorfile->numextents - 1] = extentdescriptor;
+	descriptorfile->extents[descriptorfile->numextents++] = extentdescriptor;
 
 	return NO_ERROR;
 }
@@ -188,17 +235,12 @@ handle_extent(struct vmdkdescriptorfile *descriptorfile, char *value)
  * Stores the creator id in the descriptorfile.
  */
 LDI_ERROR
-handle_cid(struct vmdkdescriptorfile *descriptorfile, char *value)
+handle_cid(struct vmdkdescriptorfile *descriptorfile, char *value, size_t length)
 {
-	long cid;
-	char *endptr = NULL;
-
-	cid = strtol(value, &endptr, 16);
-	if (endptr != value + strlen(value)) {
-		/* Failed to intepret the entire value as a long. */
+	if (!parse_number(value, length, 16, &descriptorfile->cid)) {
+		/* Failed to intepret the entire value as a number. */
 		return ERROR(LDI_ERR_PARSEERROR);
 	}
-	descriptorfile->cid = cid;
 	return NO_ERROR;
 }
 
@@ -206,17 +248,22 @@ handle_cid(struct vmdkdescriptorfile *descriptorfile, char *value)
  * Stores the parent creator id in the descriptorfile.
  */
 LDI_ERROR
-handle_parentcid(struct vmdkdescriptorfile *descriptorfile, char *value)
+handle_parentcid(struct vmdkdescriptorfile *descriptorfile, char *value, size_t length)
 {
-	long parentcid;
-	char *endptr = NULL;
-
-	parentcid = strtol(value, &endptr, 16);
-	if (endptr != value + strlen(value)) {
-		/* Failed to intepret the entire value as a long. */
+	if (!parse_number(value, length, 16, &descriptorfile->parentcid)) {
+		/* Failed to intepret the entire value as a number. */
 		return ERROR(LDI_ERR_PARSEERROR);
 	}
-	descriptorfile->parentcid = parentcid;
+	return NO_ERROR;
+}
+
+/*
+ * Stores the path of the parent descriptor in the descriptorfile.
+ */
+LDI_ERROR
+handle_parentfilenamehint(struct vmdkdescriptorfile *descriptorfile, char *value, size_t length)
+{
+	descriptorfile->parentfilenamehint = store_string(descriptorfile, value, length);
 	return NO_ERROR;
 }
 
@@ -225,7 +272,7 @@ handle_parentcid(struct vmdkdescriptorfile *descriptorfile, char *value)
  */
 struct handler {
 	char   *key;
-	LDI_ERROR     (*handler) (struct vmdkdescriptorfile *, char *);
+	LDI_ERROR     (*handler) (struct vmdkdescriptorfile *, char *, size_t);
 };
 
 /*
@@ -237,64 +284,94 @@ struct handler handlers[] = {
 	{"createType", handle_createtype},
 	{"CID", handle_cid},
 	{"parentCID", handle_parentcid},
+	{"parentFileNameHint", handle_parentfilenamehint},
 	{NULL, NULL}
 };
 
 /*
- * Calls the handler for the key, if any.
+ * Calls the handler for the key, if any. The value is passed as it is in
+ * the descriptor, without copying it.
  */
 LDI_ERROR
 handle_argument(struct vmdkdescriptorfile *descriptorfile, char *key, size_t key_length, char *value, size_t value_length)
 {
-	char *value_copy;
 	int i;
-	LDI_ERROR res;
-	LDI_ERROR (*handler) (struct vmdkdescriptorfile *, char *)= NULL;
 
 	for (i = 0; handlers[i].key; i++) {
 		if (strlen(handlers[i].key) == key_length
-		    && strncmp(key, handlers[i].key, key_length) == 0) {
-			handler = handlers[i].handler;
-			break;
+		    && (key_length == 0 || strncmp(key, handlers[i].key, key_length) == 0)) {
+			return handlers[i].handler(descriptorfile, value, value_length);
 		}
 	}
+	return NO_ERROR;
+}
 
-	if (handler) {
-		value_copy = strndup(value, value_length);
-		res = handler(descriptorfile, value_copy);
-		free(value_copy);
-		if (IS_ERROR(res)) {
-			/* Something went wrong. */
-			return res;
-		}
+/*
+ * Returns the number of lines in the length bytes at source.
+ */
+static size_t
+count_lines(char *source, size_t length)
+{
+	char *cur, *end;
+	size_t lines = 1;
+
+	end = source + length;
+	for (cur = source; (cur = memchr(cur, '\n', end - cur)) != NULL; cur++) {
+		lines++;
 	}
-	return NO_ERROR;
+
+	return lines;
 }
 
 /*
  * Creates a new descriptorfile given the description in source.
+ *
+ * The descriptor is read in one pass. Every line holds at most one extent
+ * or string, so after counting the lines a single arena is allocated with
+ * room for all extents and strings, and nothing is copied or allocated
+ * per line.
  */
 LDI_ERROR
 vmdkdescriptorfile_new(void *source, struct vmdkdescriptorfile **descriptorfile, size_t length, struct logger logger)
 {
-	char *next_newline, *data;
-	size_t line_length;
-	size_t buffer_size = 10;
+	char *data;
+	size_t line_length, lines;
 	struct key_value key_value;
 	LDI_ERROR res;
-	int bytes_left = length;
+	size_t bytes_left = length;
 
 	data = source;
+	lines = count_lines(data, length);
 
-	(*descriptorfile) = malloc((unsigned int)sizeof(struct vmdkdescriptorfile));
+	(*descriptorfile) = malloc(sizeof(struct vmdkdescriptorfile));
+	if (*descriptorfile == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
 	(*descriptorfile)->numextents = 0;
-	(*descriptorfile)->extents = NULL;
+	(*descriptorfile)->arena = malloc(lines * sizeof(struct vmdkextentdescriptor) +
+	    lines * sizeof(struct vmdkextentdescriptor *) + length + lines);
+	if ((*descriptorfile)->arena == NULL) {
+		free(*descriptorfile);
+		*descriptorfile = NULL;
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	(*descriptorfile)->extentarena = (*descriptorfile)->arena;
+	(*descriptorfile)->extents = (struct vmdkextentdescriptor **)
+	    ((*descriptorfile)->extentarena + lines);
+	(*descriptorfile)->strings = (char *)((*descriptorfile)->extents + lines);
+	/* Descriptors without a parent may leave out parentCID. */
+	(*descriptorfile)->cid = 0;
+	(*descriptorfile)->parentcid = VMDK_CID_NOPARENT;
+	(*descriptorfile)->parentfilenamehint = NULL;
+	/* Without a createType, the extents tell what the disk is. */
+	(*descriptorfile)->filetype = MONOLITHIC_SPARSE;
 	while (bytes_left > 0) {
-		line_length = get_key_value(data, length, &key_value);
+		line_length = get_key_value(data, bytes_left, &key_value);
 		data += line_length + 1;
-		bytes_left -= line_length + 1;
+		bytes_left -= MIN(line_length + 1, bytes_left);
 
-		if (line_length == 1 || (key_value.key_length == 0 && *key_value.value == '#')) {
+		if (line_length == 1 || key_value.value == NULL ||
+		    (key_value.key_length == 0 && *key_value.value == '#')) {
 			/* Empty or commented line. Ignore. */
 			continue;
 		}
@@ -319,19 +396,13 @@ vmdkdescriptorfile_new(void *source, struct vmdkdescriptorfile **descriptorfile,
 }
 
 /*
- * Frees mamory and zeros the descriptorfile.
+ * Frees mamory and zeros the descriptorfile. The extents and strings are
+ * all in the arena.
  */
 void
 vmdkdescriptorfile_destroy(struct vmdkdescriptorfile **descriptorfile)
 {
-	int i;
-
-	if ((*descriptorfile)->extents) {
-		for (i = 0; i < (*descriptorfile)->numextents; i++) {
-			vmdkextentdescriptor_destroy(&(*descriptorfile)->extents[i]);
-		}
-		free((*descriptorfile)->extents);
-	}
+	free((*descriptorfile)->arena);
 	free(*descriptorfile);
 	*descriptorfile = NULL;
 }
@@ -6,6 +6,9 @@
 
 #include "vmdkextentdescriptor.h"
 
+/* The parentCID of disks that have no parent. */
+#define VMDK_CID_NOPARENT 0xffffffff
+
 /*
  * The different types of vmdk files.
  */
@@ -30,10 +33,19 @@ enum vmdktype {
 struct vmdkdescriptorfile {
 	uint32_t cid;
 	uint32_t parentcid;
+	/* The path of the parent descriptor, or NULL if there is none. */
+	char   *parentfilenamehint;
 	uint16_t version;
 	enum vmdktype filetype;
 	struct vmdkextentdescriptor **extents;
 	uint16_t numextents;
+	/*
+	 * A single allocation with the extents, the pointers to them and
+	 * the strings, sized from the number of lines in the descriptor.
+	 */
+	void   *arena;
+	struct vmdkextentdescriptor *extentarena;
+	char   *strings;
 };
 
 /*
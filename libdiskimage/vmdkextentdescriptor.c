@@ -1,6 +1,7 @@
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
-#include <regex.h>
 #include <string.h>
 
 #include "internal.h"
@@ -25,24 +26,6 @@ struct string_to_access access_strings[] = {
 	{NULL, 0}
 };
 
-/*
- * Handles the access part of the extent description.
- */
-static int
-handle_access(char *value, struct vmdkextentdescriptor *descriptor)
-{
-	int i;
-
-	for (i = 0; access_strings[i].string; i++) {
-		if (strcmp(access_strings[i].string, value) == 0) {
-			descriptor->access = access_strings[i].value;
-			return 0;
-		}
-	}
-
-	return -1;
-}
-
 /*
  * Maps an extent type string to an enum value.
  */
@@ -66,129 +49,157 @@ struct string_to_extenttype extenttype_strings[] = {
 };
 
 /*
- * Handles the extent type part of the extent description.
+ * Returns true if the token of the given length is the string.
  */
-static int
-handle_extenttype(char *value, struct vmdkextentdescriptor *descriptor)
+static bool
+token_equals(char *token, size_t length, char *string)
 {
-	int i;
-
-	for (i = 0; extenttype_strings[i].string; i++) {
-		if (strcmp(extenttype_strings[i].string, value) == 0) {
-			descriptor->type = extenttype_strings[i].value;
-			return 0;
-		}
-	}
-
-	return -1;
+	return strncmp(token, string, length) == 0 && string[length] == 0;
 }
 
 /*
- * Handles the size part of the extent description.
+ * Reads the next token, which ends at a space or at the end of the input,
+ * and moves the cursor past it. Returns the length of the token.
  */
-static int
-handle_size(char *value, struct vmdkextentdescriptor *descriptor)
+static size_t
+next_token(char **cur, char *end, char **token)
 {
-	char *end;
-	size_t size = strtol(value, &end, 10);
-
-	if (end != value + strlen(value)) {
-		return -1;
+	*token = *cur;
+	while (*cur != end && **cur != ' ' && **cur != '\t') {
+		(*cur)++;
 	}
-	descriptor->sectors = size;
-	return 0;
-}
 
-/*
- * Handles the filename part of the extent description.
- */
-static int
-handle_filename(char *value, struct vmdkextentdescriptor *descriptor)
-{
-	descriptor->filename = strdup(value);;
-	return 0;
+	return *cur - *token;
 }
 
 /*
- * Handles the offset part of the extent description.
+ * Moves the cursor past any spaces. Returns false if there were none.
  */
-static int
-handle_offset(char *value, struct vmdkextentdescriptor *descriptor)
+static bool
+skip_spaces(char **cur, char *end)
 {
-	char *end;
-	off_t offset = strtol(value, &end, 10);
+	char *start = *cur;
 
-	if (end != value + strlen(value)) {
-		return -1;
+	while (*cur != end && (**cur == ' ' || **cur == '\t')) {
+		(*cur)++;
 	}
-	descriptor->offset = offset;
-	return 0;
-}
 
+	return *cur != start;
+}
 
 /*
- * Duplicates the string in the match and calls the handler.
+ * Parses the decimal number in the token. Returns false if the token is
+ * empty or has anything but digits.
  */
-static int
-dup_call(char *source, regmatch_t match, struct vmdkextentdescriptor *descriptor, int (handler) (char *value, struct vmdkextentdescriptor *descriptor))
+static bool
+parse_decimal(char *token, size_t length, uint64_t *value)
 {
-	int result;
-	char *match_string;
-	size_t match_length;
+	size_t i;
 
-	match_length = match.rm_eo - match.rm_so;
-	match_string = strndup(source + match.rm_so, match_length);
+	if (length == 0) {
+		return false;
+	}
 
-	result = handler(match_string, descriptor);
+	*value = 0;
+	for (i = 0; i < length; i++) {
+		if (token[i] < '0' || token[i] > '9') {
+			return false;
+		}
+		*value = *value * 10 + (token[i] - '0');
+	}
 
-	free(match_string);
-	return result;
+	return true;
 }
 
 /*
- * Initializes the descriptor given the match results.
+ * Parses the extent description of length bytes in source into the
+ * descriptor. A vmdk extent descriptor looks like this:
+ * access size_in_sectors type ["filename" [offset]]
+ *
+ * The line is read once, left to right, without copying anything but the
+ * filename, which is stored at *strings followed by a NUL. *strings is
+ * moved past it.
  */
-static int
-initialize(char *source, regmatch_t matches[], struct vmdkextentdescriptor *descriptor)
+LDI_ERROR
+vmdkextentdescriptor_parse(char *source, size_t length, struct vmdkextentdescriptor *descriptor, char **strings)
 {
-	int res;
+	char *cur, *end, *token;
+	size_t token_length;
+	uint64_t number;
+	int i;
+
+	cur = source;
+	end = source + length;
+	descriptor->filename = NULL;
+	descriptor->offset = 0;
 
 	/* Handle the access restriction. */
-	res = dup_call(source, matches[1], descriptor, handle_access);
-	if (res != 0) {
-		/* Failed to parse the access. */
-		return -1;
+	token_length = next_token(&cur, end, &token);
+	for (i = 0; access_strings[i].string; i++) {
+		if (token_equals(token, token_length, access_strings[i].string)) {
+			break;
+		}
+	}
+	if (access_strings[i].string == NULL || !skip_spaces(&cur, end)) {
+		return ERROR(LDI_ERR_PARSEERROR);
 	}
+	descriptor->access = access_strings[i].value;
+
 	/* Handle the size. */
-	res = dup_call(source, matches[2], descriptor, handle_size);
-	if (res != 0) {
-		/* Failed to parse the size. */
-		return -1;
+	token_length = next_token(&cur, end, &token);
+	if (!parse_decimal(token, token_length, &number) || !skip_spaces(&cur, end)) {
+		return ERROR(LDI_ERR_PARSEERROR);
 	}
+	descriptor->sectors = number;
+
 	/* Handle the extent type. */
-	res = dup_call(source, matches[3], descriptor, handle_extenttype);
-	if (res != 0) {
-		/* Failed to parse the extent type. */
-		return -1;
+	token_length = next_token(&cur, end, &token);
+	for (i = 0; extenttype_strings[i].string; i++) {
+		if (token_equals(token, token_length, extenttype_strings[i].string)) {
+			break;
+		}
+	}
+	if (extenttype_strings[i].string == NULL) {
+		return ERROR(LDI_ERR_PARSEERROR);
+	}
+	descriptor->type = extenttype_strings[i].value;
+
+	/* ZERO extents have no file, so the filename is optional. */
+	skip_spaces(&cur, end);
+	if (cur == end) {
+		return descriptor->type == VMDK_EXTENT_ZERO ? NO_ERROR :
+		    ERROR(LDI_ERR_PARSEERROR);
+	}
+
+	/* Handle the filename, which may contain spaces. */
+	if (*cur != '"') {
+		return ERROR(LDI_ERR_PARSEERROR);
 	}
-	/* Handle the filename. */
-	res = dup_call(source, matches[4], descriptor, handle_filename);
-	if (res != 0) {
-		/* Failed to parse the filename. */
-		return -1;
+	token = ++cur;
+	while (cur != end && *cur != '"') {
+		cur++;
+	}
+	if (cur == end) {
+		return ERROR(LDI_ERR_PARSEERROR);
 	}
+	descriptor->filename = *strings;
+	memcpy(*strings, token, cur - token);
+	(*strings)[cur - token] = 0;
+	*strings += cur - token + 1;
+	cur++;
+
 	/* The offset part is optional. */
-	descriptor->offset = 0;
-	if (matches[6].rm_so >= 0) {
-		/* Handle the offset. */
-		res = dup_call(source, matches[6], descriptor, handle_offset);
-		if (res != 0) {
-			/* Failed to parse the offset. */
-			return -1;
+	skip_spaces(&cur, end);
+	if (cur != end) {
+		token_length = next_token(&cur, end, &token);
+		if (!parse_decimal(token, token_length, &number)) {
+			return ERROR(LDI_ERR_PARSEERROR);
 		}
+		descriptor->offset = number;
 	}
+
 	/* Everything went well. */
-	return 0;
+	return NO_ERROR;
 }
 
 /*
@@ -197,42 +208,23 @@ initialize(char *source, regmatch_t matches[], struct vmdkextentdescriptor *desc
 LDI_ERROR
 vmdkextentdescriptor_new(char *source, struct vmdkextentdescriptor **descriptor)
 {
-	regex_t regex;
-	regmatch_t matches[7];
-	int res;
-
-	/* Start by allocating the descriptor. */
-	(*descriptor) = malloc(sizeof(struct vmdkextentdescriptor));
-	(*descriptor)->filename = NULL;
-
-	/*
-	 * A vmdk extent descriptor looks like this:
-	 * access size_in_sectors type "filename" [offset]
-	 *
-	 * Use a regex to parse the different parts.
-	 */
-	res = regcomp(&regex, "([^ ]+) ([0-9]+) ([^ ]+) \"([^\"]*)\"( ([0-9]*))?", REG_EXTENDED);
-	if (res != 0) {
-		/* Failed to compile the regex. */
-		vmdkextentdescriptor_destroy(descriptor);
-		return ERROR(LDI_ERR_INTERNAL);
+	char *strings;
+	size_t length;
+	LDI_ERROR res;
+
+	/* The descriptor and its filename are allocated together. */
+	length = strlen(source);
+	*descriptor = malloc(sizeof(struct vmdkextentdescriptor) + length + 1);
+	if (*descriptor == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
 	}
-	/* Execute the regex. */
-	res = regexec(&regex, source, 7, matches, 0);
-
-	/* Free the regex. */
-	regfree(&regex);
+	strings = (char *)(*descriptor + 1);
 
-	if (res != 0) {
-		/* Failed to match the input. */
-		vmdkextentdescriptor_destroy(descriptor);
-		return ERROR(LDI_ERR_PARSEERROR);
-	}
-	res = initialize(source, matches, *descriptor);
-	if (res != 0) {
+	res = vmdkextentdescriptor_parse(source, length, *descriptor, &strings);
+	if (IS_ERROR(res)) {
 		/* Failed to parse. */
 		vmdkextentdescriptor_destroy(descriptor);
-		return ERROR(LDI_ERR_PARSEERROR);
+		return res;
 	}
 	/* Everything went well. */
 	return NO_ERROR;
@@ -244,10 +236,6 @@ vmdkextentdescriptor_new(char *source, struct vmdkextentdescriptor **descriptor)
 void
 vmdkextentdescriptor_destroy(struct vmdkextentdescriptor **descriptor)
 {
-	/* If a filename has been set, we need to free the string. */
-	if ((*descriptor)->filename) {
-		free((*descriptor)->filename);
-	}
 	free(*descriptor);
 	*descriptor = NULL;
 }
@@ -34,13 +34,20 @@ struct vmdkextentdescriptor {
 	off_t	offset;
 };
 
+/*
+ * Parses the extent description of length bytes in source into the
+ * descriptor. The filename is copied to *strings, which must have room for
+ * length + 1 bytes, and *strings is moved past it.
+ */
+LDI_ERROR	vmdkextentdescriptor_parse(char *source, size_t length, struct vmdkextentdescriptor *descriptor, char **strings);
+
 /*
  * Creates a new extentdescriptor given the description in source.
  */
 LDI_ERROR   vmdkextentdescriptor_new(char *source, struct vmdkextentdescriptor **descriptor);
 
 /*
- * Frees memory and zeros the descriptor.
+ * Frees memory and zeros a descriptor created by vmdkextentdescriptor_new.
  */
 void	vmdkextentdescriptor_destroy(struct vmdkextentdescriptor **descriptor);
 
@@ -0,0 +1,570 @@
+
+#include <sys/param.h>
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "diskimage.h"
+#include "fileinterface.h"
+#include "internal.h"
+#include "kernels.h"
+#include "log.h"
+#include "vmdkdescriptorfile.h"
+#include "vmdkextentdescriptor.h"
+#include "vmdkextents.h"
+#include "vmdksparse.h"
+#include "vmdkstream.h"
+
+#define SECTOR_SIZE 512
+
+/*
+ * The number of extent files that are kept open. Split images have one
+ * file per 2 GB, so this covers 128 GB of recently used data.
+ */
+#define MAX_OPEN_EXTENTS 64
+
+/*
+ * An extent, and its file while it is open. Open extents are in the LRU
+ * list.
+ */
+struct extent {
+	struct vmdkextentdescriptor *descriptor;
+	/* The path of the file, or NULL for ZERO extents. */
+	char   *path;
+	struct file *file;
+	/* The grain directory and tables, if the extent is sparse. */
+	struct vmdksparse *sparse;
+	/* The grain index, if the extent is stream optimized. */
+	struct vmdkstream *stream;
+	/* The number of reads using the file, which must not be closed. */
+	unsigned int users;
+	/* The neighbours in the LRU list. */
+	struct extent *newer;
+	struct extent *older;
+};
+
+struct vmdkextents {
+	struct fileinterface *fi;
+	struct extent *extents;
+	uint16_t count;
+	/*
+	 * The disk offset where each extent starts, with the size of the
+	 * disk as a last entry.
+	 */
+	uint64_t *starts;
+	/* Whether the sparse extents are stream optimized. */
+	bool	stream_optimized;
+	/* Whether the files are opened read only. */
+	bool	readonly;
+	/* Reads the parent disk for the sparse extents, if there is one. */
+	vmdk_parent_read_fn parent_read;
+	void   *parent_arg;
+	/* The ends of the LRU list of open extents. */
+	struct extent *newest;
+	struct extent *oldest;
+	unsigned int num_open;
+	/* Protects the files and the LRU list. */
+	pthread_mutex_t lock;
+	/* Used for logging. */
+	struct logger logger;
+};
+
+/*
+ * Removes the extent from the LRU list.
+ */
+static void
+unlink_extent(struct vmdkextents *extents, struct extent *extent)
+{
+	if (extent->newer != NULL)
+		extent->newer->older = extent->older;
+	else
+		extents->newest = extent->older;
+	if (extent->older != NULL)
+		extent->older->newer = extent->newer;
+	else
+		extents->oldest = extent->newer;
+	extent->newer = NULL;
+	extent->older = NULL;
+}
+
+/*
+ * Puts the extent first in the LRU list.
+ */
+static void
+link_newest(struct vmdkextents *extents, struct extent *extent)
+{
+	extent->newer = NULL;
+	extent->older = extents->newest;
+	if (extents->newest != NULL)
+		extents->newest->newer = extent;
+	extents->newest = extent;
+	if (extents->oldest == NULL)
+		extents->oldest = extent;
+}
+
+/*
+ * Closes the file of an open extent.
+ */
+static void
+close_extent(struct vmdkextents *extents, struct extent *extent)
+{
+	unlink_extent(extents, extent);
+	if (extent->sparse != NULL) {
+		vmdksparse_destroy(&extent->sparse);
+	}
+	if (extent->stream != NULL) {
+		vmdkstream_destroy(&extent->stream);
+	}
+	file_close(&extent->file);
+	extents->num_open--;
+}
+
+/*
+ * Makes the data written to an open extent durable, and writes its grain
+ * tables if it is sparse.
+ */
+static LDI_ERROR
+sync_extent(struct extent *extent)
+{
+	if (extent->sparse != NULL) {
+		return vmdksparse_flush(extent->sparse);
+	}
+
+	return file_sync(extent->file);
+}
+
+/*
+ * Makes sure that the file of the extent is open, and marks it as used so
+ * that it is not closed until it is released. The least recently used
+ * extent that is not in use is synced and closed if too many are open.
+ */
+static LDI_ERROR
+acquire_extent(struct vmdkextents *extents, struct extent *extent)
+{
+	struct extent *victim;
+	LDI_ERROR result;
+
+	pthread_mutex_lock(&extents->lock);
+	if (extent->file != NULL) {
+		unlink_extent(extents, extent);
+		link_newest(extents, extent);
+		extent->users++;
+		pthread_mutex_unlock(&extents->lock);
+		return NO_ERROR;
+	}
+
+	if (extents->num_open >= MAX_OPEN_EXTENTS) {
+		/* Extents that are being read are skipped. */
+		for (victim = extents->oldest; victim != NULL; victim = victim->newer) {
+			if (victim->users == 0) {
+				break;
+			}
+		}
+		if (victim != NULL && !extents->readonly) {
+			/* Closed extents are not synced by vmdkextents_sync. */
+			result = sync_extent(victim);
+			if (IS_ERROR(result)) {
+				LOG_ERROR(extents->logger, "Failed to sync the extent %s.\n",
+				    victim->path);
+				pthread_mutex_unlock(&extents->lock);
+				return result;
+			}
+		}
+		if (victim != NULL) {
+			close_extent(extents, victim);
+		}
+	}
+
+	if (extents->readonly) {
+		result = file_open_readonly(extents->fi, extent->path, &extent->file);
+	} else {
+		result = file_open(extents->fi, extent->path, &extent->file);
+	}
+	if (!IS_ERROR(result) && extent->descriptor->type == VMDK_EXTENT_SPARSE) {
+		/* Sparse extents start with a header that locates the grains. */
+		if (extents->stream_optimized) {
+			result = vmdkstream_open(extents->fi, extent->file,
+			    &extent->stream, extents->logger);
+		} else {
+			result = vmdksparse_open(extent->file, &extent->sparse,
+			    extents->logger);
+		}
+		if (!IS_ERROR(result) && extent->sparse != NULL &&
+		    extents->parent_read != NULL) {
+			vmdksparse_set_parent(extent->sparse, extents->parent_read,
+			    extents->parent_arg, extents->starts[extent - extents->extents]);
+		}
+		if (IS_ERROR(result)) {
+			file_close(&extent->file);
+		}
+	}
+	if (IS_ERROR(result)) {
+		LOG_ERROR(extents->logger, "Failed to open the extent %s.\n", extent->path);
+		pthread_mutex_unlock(&extents->lock);
+		return result;
+	}
+
+	link_newest(extents, extent);
+	extents->num_open++;
+	extent->users++;
+	pthread_mutex_unlock(&extents->lock);
+
+	return NO_ERROR;
+}
+
+/*
+ * Allows the file of the extent to be closed again.
+ */
+static void
+release_extent(struct vmdkextents *extents, struct extent *extent)
+{
+	pthread_mutex_lock(&extents->lock);
+	extent->users--;
+	pthread_mutex_unlock(&extents->lock);
+}
+
+/*
+ * Checks that the extent types are supported and creates the paths of
+ * the extent files.
+ */
+static LDI_ERROR
+init_extent(struct vmdkextents *extents, char *directory, struct vmdkextentdescriptor *descriptor, struct extent *extent)
+{
+	extent->descriptor = descriptor;
+
+	switch (descriptor->type) {
+	case VMDK_EXTENT_ZERO:
+		return NO_ERROR;
+	case VMDK_EXTENT_FLAT:
+	case VMDK_EXTENT_VMFS:
+	case VMDK_EXTENT_SPARSE:
+		return fileinterface_getpath(extents->fi, directory,
+		    descriptor->filename, &extent->path);
+	default:
+		LOG_ERROR(extents->logger, "Unsupported extent type %d.\n", descriptor->type);
+		return ERROR(LDI_ERR_FILENOTSUP);
+	}
+}
+
+/*
+ * Creates the extents of the descriptor.
+ */
+LDI_ERROR
+vmdkextents_new(struct fileinterface *fi, char *directory, struct vmdkdescriptorfile *descriptorfile, bool readonly, struct vmdkextents **extents, struct logger logger)
+{
+	uint16_t i;
+	LDI_ERROR result;
+
+	if (descriptorfile->numextents == 0) {
+		LOG_ERROR(logger, "The descriptor has no extents.\n");
+		return ERROR(LDI_ERR_PARSEERROR);
+	}
+
+	*extents = calloc(1, sizeof(struct vmdkextents));
+	if (*extents == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	(*extents)->fi = fi;
+	(*extents)->count = descriptorfile->numextents;
+	(*extents)->stream_optimized = descriptorfile->filetype == STREAM_OPTIMIZED;
+	(*extents)->readonly = readonly;
+	(*extents)->logger = logger;
+	pthread_mutex_init(&(*extents)->lock, NULL);
+
+	(*extents)->extents = calloc((*extents)->count, sizeof(struct extent));
+	(*extents)->starts = malloc(((size_t)(*extents)->count + 1) * sizeof(uint64_t));
+	if ((*extents)->extents == NULL || (*extents)->starts == NULL) {
+		vmdkextents_destroy(extents);
+		return ERROR(LDI_ERR_NOMEM);
+	}
+
+	(*extents)->starts[0] = 0;
+	for (i = 0; i < (*extents)->count; i++) {
+		result = init_extent(*extents, directory,
+		    descriptorfile->extents[i], &(*extents)->extents[i]);
+		if (IS_ERROR(result)) {
+			vmdkextents_destroy(extents);
+			return result;
+		}
+		(*extents)->starts[i + 1] = (*extents)->starts[i] +
+		    (uint64_t)descriptorfile->extents[i]->sectors * SECTOR_SIZE;
+	}
+
+	/*
+	 * Open the first extent now, so that a missing or broken data file
+	 * is found when the disk is opened rather than on the first read.
+	 */
+	if ((*extents)->extents[0].path != NULL) {
+		result = acquire_extent(*extents, &(*extents)->extents[0]);
+		if (IS_ERROR(result)) {
+			vmdkextents_destroy(extents);
+			return result;
+		}
+		release_extent(*extents, &(*extents)->extents[0]);
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Closes all extent files, frees the extents and sets the pointer to NULL.
+ */
+void
+vmdkextents_destroy(struct vmdkextents **extents)
+{
+	uint16_t i;
+
+	while ((*extents)->oldest != NULL) {
+		close_extent(*extents, (*extents)->oldest);
+	}
+	if ((*extents)->extents != NULL) {
+		for (i = 0; i < (*extents)->count; i++) {
+			free((*extents)->extents[i].path);
+		}
+	}
+	pthread_mutex_destroy(&(*extents)->lock);
+	free((*extents)->extents);
+	free((*extents)->starts);
+	free(*extents);
+	*extents = NULL;
+}
+
+/*
+ * Returns the size of the disk in bytes.
+ */
+uint64_t
+vmdkextents_size(struct vmdkextents *extents)
+{
+	return extents->starts[extents->count];
+}
+
+/*
+ * Sets the function that reads the parent disk, for sparse extents that
+ * only partially write new grains.
+ */
+void
+vmdkextents_set_parent(struct vmdkextents *extents, vmdk_parent_read_fn read, void *arg)
+{
+	struct extent *extent;
+
+	pthread_mutex_lock(&extents->lock);
+	extents->parent_read = read;
+	extents->parent_arg = arg;
+	for (extent = extents->newest; extent != NULL; extent = extent->older) {
+		if (extent->sparse != NULL) {
+			vmdksparse_set_parent(extent->sparse, read, arg,
+			    extents->starts[extent - extents->extents]);
+		}
+	}
+	pthread_mutex_unlock(&extents->lock);
+}
+
+/*
+ * Returns the index of the extent that contains the disk offset, which
+ * must be on the disk. Empty extents are never returned.
+ */
+static uint16_t
+find_extent(struct vmdkextents *extents, uint64_t offset)
+{
+	uint16_t low, high, middle;
+
+	/* Find the last extent that starts at or before the offset. */
+	low = 0;
+	high = extents->count - 1;
+	while (low < high) {
+		middle = low + (high - low + 1) / 2;
+		if (extents->starts[middle] <= offset)
+			low = middle;
+		else
+			high = middle - 1;
+	}
+
+	return low;
+}
+
+/*
+ * Reads nbytes at offset in a single extent.
+ */
+static LDI_ERROR
+read_extent(struct vmdkextents *extents, struct extent *extent, char *buf, size_t nbytes, off_t offset)
+{
+	LDI_ERROR result;
+
+	if (extent->descriptor->type == VMDK_EXTENT_ZERO) {
+		memset(buf, 0, nbytes);
+		return NO_ERROR;
+	}
+
+	result = acquire_extent(extents, extent);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	if (extent->sparse != NULL) {
+		result = vmdksparse_read(extent->sparse, buf, nbytes, offset);
+	} else if (extent->stream != NULL) {
+		result = vmdkstream_read(extent->stream, buf, nbytes, offset);
+	} else {
+		/* Flat extents may start anywhere in their file. */
+		result = file_read(extent->file, buf, nbytes,
+		    extent->descriptor->offset * SECTOR_SIZE + offset, extents->logger);
+	}
+
+	release_extent(extents, extent);
+	return result;
+}
+
+/*
+ * Reads nbytes at offset on the disk into the buffer.
+ */
+LDI_ERROR
+vmdkextents_read(struct vmdkextents *extents, char *buf, size_t nbytes, off_t offset)
+{
+	uint16_t index;
+	size_t length;
+	LDI_ERROR result;
+
+	while (nbytes > 0) {
+		index = find_extent(extents, offset);
+		length = MIN(extents->starts[index + 1] - offset, nbytes);
+
+		result = read_extent(extents, &extents->extents[index], buf,
+		    length, offset - extents->starts[index]);
+		if (IS_ERROR(result)) {
+			return result;
+		}
+
+		buf += length;
+		offset += length;
+		nbytes -= length;
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Sets length to the number of bytes from offset, at most nbytes, that are
+ * either all stored in the disk or all left to its parent. Only sparse
+ * extents leave data to the parent.
+ */
+LDI_ERROR
+vmdkextents_allocated(struct vmdkextents *extents, off_t offset, size_t nbytes, bool *allocated, size_t *length)
+{
+	struct extent *extent;
+	uint16_t index;
+	LDI_ERROR result;
+
+	index = find_extent(extents, offset);
+	extent = &extents->extents[index];
+	nbytes = MIN(extents->starts[index + 1] - offset, nbytes);
+
+	if (extent->descriptor->type != VMDK_EXTENT_SPARSE || extents->stream_optimized) {
+		*allocated = true;
+		*length = nbytes;
+		return NO_ERROR;
+	}
+
+	result = acquire_extent(extents, extent);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+	result = vmdksparse_allocated(extent->sparse, offset - extents->starts[index],
+	    nbytes, allocated, length);
+	release_extent(extents, extent);
+
+	return result;
+}
+
+/*
+ * Writes nbytes at offset in a single extent.
+ */
+static LDI_ERROR
+write_extent(struct vmdkextents *extents, struct extent *extent, char *buf, size_t nbytes, off_t offset)
+{
+	LDI_ERROR result;
+
+	if (extent->descriptor->type == VMDK_EXTENT_ZERO) {
+		/* Writing zeros does not change a ZERO extent. */
+		if (kernel_iszero(buf, nbytes)) {
+			return NO_ERROR;
+		}
+		LOG_ERROR(extents->logger, "Data can not be written to a ZERO extent.\n");
+		return ERROR(LDI_ERR_FILENOTSUP);
+	}
+	if (extent->descriptor->access != VMDK_ACCESS_RW) {
+		LOG_ERROR(extents->logger, "The extent %s is not writable.\n", extent->path);
+		return ERROR(LDI_ERR_FILENOTSUP);
+	}
+
+	result = acquire_extent(extents, extent);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	if (extent->sparse != NULL) {
+		result = vmdksparse_write(extent->sparse, buf, nbytes, offset);
+	} else if (extent->stream != NULL) {
+		LOG_ERROR(extents->logger, "Stream optimized extents are read only.\n");
+		result = ERROR(LDI_ERR_FILENOTSUP);
+	} else {
+		result = file_write(extent->file, buf, nbytes,
+		    extent->descriptor->offset * SECTOR_SIZE + offset, extents->logger);
+	}
+
+	release_extent(extents, extent);
+	return result;
+}
+
+/*
+ * Writes nbytes from the buffer at offset on the disk.
+ */
+LDI_ERROR
+vmdkextents_write(struct vmdkextents *extents, char *buf, size_t nbytes, off_t offset)
+{
+	uint16_t index;
+	size_t length;
+	LDI_ERROR result;
+
+	while (nbytes > 0) {
+		index = find_extent(extents, offset);
+		length = MIN(extents->starts[index + 1] - offset, nbytes);
+
+		result = write_extent(extents, &extents->extents[index], buf,
+		    length, offset - extents->starts[index]);
+		if (IS_ERROR(result)) {
+			return result;
+		}
+
+		buf += length;
+		offset += length;
+		nbytes -= length;
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Makes all data written to the open extent files durable, and writes the
+ * grain tables of the sparse extents. Extents that were closed were synced
+ * before.
+ */
+LDI_ERROR
+vmdkextents_sync(struct vmdkextents *extents)
+{
+	struct extent *extent;
+	LDI_ERROR result;
+
+	pthread_mutex_lock(&extents->lock);
+	for (extent = extents->newest; extent != NULL; extent = extent->older) {
+		result = sync_extent(extent);
+		if (IS_ERROR(result)) {
+			pthread_mutex_unlock(&extents->lock);
+			return result;
+		}
+	}
+	pthread_mutex_unlock(&extents->lock);
+
+	return NO_ERROR;
+}
@@ -0,0 +1,69 @@
+#ifndef _VMDKEXTENTS_H_
+#define _VMDKEXTENTS_H_
+
+#include <sys/types.h>
+#include <stdbool.h>
+
+#include "diskimage.h"
+#include "fileinterface.h"
+#include "vmdkdescriptorfile.h"
+#include "vmdksparse.h"
+
+/*
+ * All extents of a VMDK, laid out after each other in the order of the
+ * descriptor. The files of the extents are opened when they are first
+ * needed, and only a bounded number of them are kept open at a time.
+ */
+struct vmdkextents;
+
+/*
+ * Creates the extents of the descriptor, whose extent filenames are
+ * relative to directory. The descriptor must outlive the extents. The
+ * files of the parents of a disk are opened read only.
+ */
+LDI_ERROR vmdkextents_new(struct fileinterface *fi, char *directory, struct vmdkdescriptorfile *descriptorfile, bool readonly, struct vmdkextents **extents, struct logger logger);
+
+/*
+ * Closes all extent files, frees the extents and sets the pointer to NULL.
+ */
+void	vmdkextents_destroy(struct vmdkextents **extents);
+
+/*
+ * Returns the size of the disk in bytes, which is the sum of the sizes of
+ * all extents.
+ */
+uint64_t vmdkextents_size(struct vmdkextents *extents);
+
+/*
+ * Sets the function that reads the parent disk. Grains of sparse extents
+ * that are partially written are first filled with the data of the parent.
+ */
+void	vmdkextents_set_parent(struct vmdkextents *extents, vmdk_parent_read_fn read, void *arg);
+
+/*
+ * Sets length to the number of bytes from offset, at most nbytes, that are
+ * either all stored in the disk or all left to its parent, and allocated
+ * to which of them it is. The range ends at most at the end of an extent.
+ */
+LDI_ERROR vmdkextents_allocated(struct vmdkextents *extents, off_t offset, size_t nbytes, bool *allocated, size_t *length);
+
+/*
+ * Reads nbytes at offset on the disk into the buffer. ZERO extents are
+ * read without any I/O.
+ */
+LDI_ERROR vmdkextents_read(struct vmdkextents *extents, char *buf, size_t nbytes, off_t offset);
+
+/*
+ * Writes nbytes from the buffer at offset on the disk. Sparse extents
+ * allocate grains as needed. Only zeros can be written to ZERO extents, and
+ * read only and stream optimized extents can not be written.
+ */
+LDI_ERROR vmdkextents_write(struct vmdkextents *extents, char *buf, size_t nbytes, off_t offset);
+
+/*
+ * Makes all data written to the open extent files durable, including the
+ * grain tables of sparse extents.
+ */
+LDI_ERROR vmdkextents_sync(struct vmdkextents *extents);
+
+#endif					/* _VMDKEXTENTS_H_ */
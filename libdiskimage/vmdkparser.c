@@ -1,11 +1,36 @@
+
+#include <sys/param.h>
+
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "diskimage.h"
 #include "fileinterface.h"
 #include "internal.h"
+#include "log.h"
 #include "parser.h"
+#include "vhdchain.h"
+#include "vmdkcreate.h"
 #include "vmdkdescriptorfile.h"
+#include "vmdkextents.h"
+#include "vmdksparse.h"
+#include "vmdksparseheader.h"
+
+#define SECTOR_SIZE 512
+
+/* The first line of descriptor files. */
+#define DESCRIPTOR_SIGNATURE "# Disk DescriptorFile"
+
+/* The longest chain of delta disks that is opened. */
+#define MAX_CHAIN_DEPTH 128
+
+/*
+ * The size of the parts of the disk that the chain index resolves at a
+ * time.
+ */
+#define CHAIN_BLOCK_SECTORS 2048
 
 /* The internal parser state. */
 struct vmdkparser {
@@ -15,106 +40,197 @@ struct vmdkparser {
 	/* A pointer to the file containing the descriptor. */
 	struct file *descriptor;
 
-	/* The length of the file containing the descriptor. */
-	size_t	descriptorlength;
-
 	/* The struct representing the contents of the descriptorfile. */
 	struct vmdkdescriptorfile *descriptorfile;
 
-	/* A pointer to the file containing the data. */
-	struct file *datafile;
+	/* The extents with the data. */
+	struct vmdkextents *extents;
+
+	/* The parent of a delta disk, or NULL. Parents are opened read only. */
+	struct vmdkparser *parent;
+
+	/* The number of delta disks above this one. */
+	int	depth;
+
+	/*
+	 * For delta disks, an index of the layer in the chain that owns each
+	 * part of the disk, created on the first read.
+	 */
+	struct vhdchain *chain;
+	pthread_mutex_t chain_lock;
 };
 
 void	vmdkparser_destroy(void **parser);
+static LDI_ERROR open_disk(struct fileinterface *fi, char *path, bool readonly, int depth, struct vmdkparser **vmdkparser, struct logger logger);
+LDI_ERROR vmdkparser_read(void *parser, char *buf, size_t nbytes, off_t offset);
 
 /*
- * Creates the parser state.
+ * Tries to open path as the parent of a delta disk. The parent is only used
+ * if its CID is the parentCID of the child, so that a parent that changed
+ * after the child was created is not read.
  */
-LDI_ERROR
-vmdkparser_new(struct fileinterface *fi, char *path, void **parser, struct logger logger)
+static LDI_ERROR
+try_parent(struct fileinterface *fi, struct vmdkparser *vmdkparser, char *path)
+{
+	struct vmdkparser *parent;
+	LDI_ERROR res;
+
+	LOG_VERBOSE(vmdkparser->logger, "Trying parent %s\n", path);
+	res = open_disk(fi, path, true, vmdkparser->depth + 1, &parent,
+	    vmdkparser->logger);
+	if (IS_ERROR(res)) {
+		return res;
+	}
+
+	if (parent->descriptorfile->cid != vmdkparser->descriptorfile->parentcid) {
+		LOG_WARNING(vmdkparser->logger, "Ignoring parent %s, the CID %08x is not %08x.\n",
+		    path, parent->descriptorfile->cid, vmdkparser->descriptorfile->parentcid);
+		vmdkparser_destroy((void **)&parent);
+		return ERROR(LDI_ERR_PARENTNOTFOUND);
+	}
+
+	vmdkparser->parent = parent;
+	return NO_ERROR;
+}
+
+/*
+ * Opens the parent of a delta disk from the parentFileNameHint. Relative
+ * hints are resolved against the directory of the child. Absolute hints
+ * are often from the machine that created the disk, so the same file name
+ * is also looked for next to the child.
+ */
+static LDI_ERROR
+open_parent(struct fileinterface *fi, struct vmdkparser *vmdkparser, char *directory)
+{
+	char *hint, *name, *path;
+	LDI_ERROR res;
+
+	hint = vmdkparser->descriptorfile->parentfilenamehint;
+	if (hint == NULL) {
+		LOG_ERROR(vmdkparser->logger, "The delta disk has no parentFileNameHint.\n");
+		return ERROR(LDI_ERR_PARENTNOTFOUND);
+	}
+	if (vmdkparser->depth >= MAX_CHAIN_DEPTH) {
+		LOG_ERROR(vmdkparser->logger, "The chain of delta disks is too long.\n");
+		return ERROR(LDI_ERR_PARSEERROR);
+	}
+
+	if (hint[0] == '/') {
+		res = try_parent(fi, vmdkparser, hint);
+	} else {
+		res = fileinterface_getpath(fi, directory, hint, &path);
+		if (!IS_ERROR(res)) {
+			res = try_parent(fi, vmdkparser, path);
+			free(path);
+		}
+	}
+
+	/* Windows hints use backslashes. */
+	name = strrchr(hint, '\\');
+	if (name == NULL) {
+		name = strrchr(hint, '/');
+	}
+	if (IS_ERROR(res) && res.code != LDI_ERR_NOMEM && name != NULL) {
+		res = fileinterface_getpath(fi, directory, name + 1, &path);
+		if (!IS_ERROR(res)) {
+			res = try_parent(fi, vmdkparser, path);
+			free(path);
+		}
+	}
+
+	if (IS_ERROR(res)) {
+		LOG_ERROR(vmdkparser->logger, "Could not find the parent %s.\n", hint);
+		if (res.code != LDI_ERR_NOMEM) {
+			res = ERROR(LDI_ERR_PARENTNOTFOUND);
+		}
+		return res;
+	}
+
+	/* New grains of the child are filled with the data of the parent. */
+	vmdkextents_set_parent(vmdkparser->extents, vmdkparser_read, vmdkparser->parent);
+
+	return NO_ERROR;
+}
+
+/*
+ * Opens the disk at path, and its parents. depth is the number of delta
+ * disks above it.
+ */
+static LDI_ERROR
+open_disk(struct fileinterface *fi, char *path, bool readonly, int depth, struct vmdkparser **vmdkparser, struct logger logger)
 {
-	struct vmdkparser *vmdkparser;
-	struct filemap *map;
 	char *dir;
-	char *datapath;
 	LDI_ERROR res;
 
 	/* Allocate the parser structure. */
-	*parser = malloc(sizeof(struct vmdkparser));
-	if (!*parser) {
+	*vmdkparser = malloc(sizeof(struct vmdkparser));
+	if (!*vmdkparser) {
 		/* Failed to allocate the parser. */
 		return ERROR(LDI_ERR_NOMEM);
 	}
-	vmdkparser = (struct vmdkparser *)(*parser);
-	vmdkparser->logger = logger;
+	(*vmdkparser)->logger = logger;
+	(*vmdkparser)->depth = depth;
+	pthread_mutex_init(&(*vmdkparser)->chain_lock, NULL);
 
 	/* Intialize pointers to null to simplify cleanup on error. */
-	vmdkparser->descriptor = NULL;
-	vmdkparser->descriptorfile = NULL;
-	vmdkparser->datafile = NULL;
+	(*vmdkparser)->descriptor = NULL;
+	(*vmdkparser)->descriptorfile = NULL;
+	(*vmdkparser)->extents = NULL;
+	(*vmdkparser)->parent = NULL;
+	(*vmdkparser)->chain = NULL;
 
 	/* Open the descriptor file. */
-	res = file_open(fi, path, &vmdkparser->descriptor);
-	if (IS_ERROR(res)) {
-		/* Something went wrong opening the descriptor file. */
-		vmdkparser_destroy(parser);
-		return res;
-	}
-
-	/* Get the size of the descriptor file. */
-	res = file_getsize(vmdkparser->descriptor, &vmdkparser->descriptorlength);
-	if (IS_ERROR(res)) {
-		/* Failed to get the size of the file. */
-		vmdkparser_destroy(parser);
-		return res;
+	if (readonly) {
+		res = file_open_readonly(fi, path, &(*vmdkparser)->descriptor);
+	} else {
+		res = file_open(fi, path, &(*vmdkparser)->descriptor);
 	}
-
-	/* Map the entire descriptorfile into memory. */
-	res = file_getmap(vmdkparser->descriptor, 0, vmdkparser->descriptorlength, &map, logger);
 	if (IS_ERROR(res)) {
-		/* Couldn't map memory. */
-		vmdkparser_destroy(parser);
+		/* Something went wrong opening the descriptor file. */
+		vmdkparser_destroy((void **)vmdkparser);
 		return res;
 	}
 
-	/* Create a descriptorfile struct from the mapped file. */
-	res = vmdkdescriptorfile_new(
-	    map->pointer,
-	    &vmdkparser->descriptorfile,
-	    vmdkparser->descriptorlength,
-	    logger);
-	filemap_destroy(&map);
+	/* Read the descriptor, which may be embedded in a sparse extent. */
+	res = vmdksparse_read_descriptor((*vmdkparser)->descriptor,
+	    &(*vmdkparser)->descriptorfile, logger);
 	if (IS_ERROR(res)) {
 		/* Couldn't read the descriptorfile. */
-		vmdkparser_destroy(parser);
+		vmdkparser_destroy((void **)vmdkparser);
 		return res;
 	}
 
-	/* Get the path to the data file. */
-	dir = file_getdirectory(vmdkparser->descriptor);
-	res = fileinterface_getpath(fi, dir, vmdkparser->descriptorfile->extents[0]->filename, &datapath);
-	if (IS_ERROR(res)) {
-		/* Couldn't get file path. */
-		vmdkparser_destroy(parser);
-		return res;
+	/* Extent filenames and the parent are relative to the descriptor. */
+	dir = file_getdirectory((*vmdkparser)->descriptor);
+	if (dir == NULL) {
+		vmdkparser_destroy((void **)vmdkparser);
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	res = vmdkextents_new(fi, dir, (*vmdkparser)->descriptorfile, readonly,
+	    &(*vmdkparser)->extents, logger);
+	if (!IS_ERROR(res) &&
+	    (*vmdkparser)->descriptorfile->parentcid != VMDK_CID_NOPARENT) {
+		res = open_parent(fi, *vmdkparser, dir);
 	}
-
-	/* Open the data file. */
-	res = file_open(fi, datapath, &vmdkparser->datafile);
-
-	/* Clean up temporary strings. */
 	free(dir);
-	free(datapath);
-
-	/* Check if the file was opened correctly. */
 	if (IS_ERROR(res)) {
-		/* Failed to open the data file. */
-		vmdkparser_destroy(parser);
+		/* Failed to set up the extents or the parent. */
+		vmdkparser_destroy((void **)vmdkparser);
+		return res;
 	}
 
 	return NO_ERROR;
 }
 
+/*
+ * Creates the parser state.
+ */
+LDI_ERROR
+vmdkparser_new(struct fileinterface *fi, char *path, struct diskimage_options options, void **parser, struct logger logger)
+{
+	return open_disk(fi, path, false, 0, (struct vmdkparser **)parser, logger);
+}
+
 /*
  * Deallocates the parser state and sets the pointer to NULL.
  */
@@ -123,6 +239,18 @@ vmdkparser_destroy(void **parser)
 {
 	struct vmdkparser *vmdkparser = *parser;
 
+	if (vmdkparser->chain) {
+		vhdchain_destroy(&vmdkparser->chain);
+	}
+
+	if (vmdkparser->parent) {
+		vmdkparser_destroy((void **)&vmdkparser->parent);
+	}
+
+	if (vmdkparser->extents) {
+		vmdkextents_destroy(&vmdkparser->extents);
+	}
+
 	if (vmdkparser->descriptorfile) {
 		vmdkdescriptorfile_destroy(&vmdkparser->descriptorfile);
 	}
@@ -130,11 +258,9 @@ vmdkparser_destroy(void **parser)
 	if (vmdkparser->descriptor) {
 		file_close(&vmdkparser->descriptor);
 	}
-
-	if (vmdkparser->datafile) {
-		file_close(&vmdkparser->datafile);
-	}
+	pthread_mutex_destroy(&vmdkparser->chain_lock);
 	free(*parser);
+	*parser = NULL;
 }
 
 /*
@@ -146,30 +272,145 @@ vmdkparser_diskinfo(void *parser)
 	struct diskinfo result;
 	struct vmdkparser *vmdkparser = parser;
 
-	/* Calculate the disk size. */
-	result.disksize = vmdkparser->descriptorfile->extents[0]->sectors * 512;
+	/* The disk is made up of all the extents. */
+	result.disksize = vmdkextents_size(vmdkparser->extents);
 
 	return result;
 }
 
+/*
+ * Adds the runs for nbytes at offset to the block of the chain index of
+ * top, looking for the data in layer and then in its parents. The grain
+ * tables of each layer are cached by its own extents, so only tables that
+ * have not been used before cause any I/O.
+ */
+static LDI_ERROR
+resolve_range(struct vmdkparser *top, uint32_t block, struct vmdkparser *layer, uint64_t offset, uint64_t nbytes)
+{
+	struct vhdchain_run run;
+	uint64_t layer_size;
+	size_t length;
+	bool allocated;
+	LDI_ERROR result;
+
+	while (nbytes > 0) {
+		layer_size = vmdkextents_size(layer->extents);
+		if (offset >= layer_size) {
+			/* Beyond the end of a smaller parent reads as zeros. */
+			allocated = false;
+			length = nbytes;
+		} else {
+			result = vmdkextents_allocated(layer->extents, offset,
+			    MIN(nbytes, layer_size - offset), &allocated, &length);
+			if (IS_ERROR(result)) {
+				return result;
+			}
+		}
+
+		if (!allocated && offset < layer_size && layer->parent != NULL) {
+			result = resolve_range(top, block, layer->parent, offset, length);
+		} else {
+			run.sector = offset / SECTOR_SIZE - (uint64_t)block * CHAIN_BLOCK_SECTORS;
+			run.count = length / SECTOR_SIZE;
+			run.layer = allocated ? layer : NULL;
+			run.file_offset = offset;
+			result = vhdchain_append(top->chain, block, run);
+		}
+		if (IS_ERROR(result)) {
+			return result;
+		}
+
+		offset += length;
+		nbytes -= length;
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Reads nbytes at offset of a delta disk. Each part of the disk is resolved
+ * once into runs that point directly at the layer of the chain that owns
+ * the data, so deep chains are not walked on every read.
+ */
+static LDI_ERROR
+read_chain(struct vmdkparser *vmdkparser, char *buf, size_t nbytes, off_t offset)
+{
+	struct vhdchain_run *found, run;
+	uint64_t disksize, block_start;
+	uint32_t block, sector;
+	size_t length;
+	LDI_ERROR result;
+
+	disksize = vmdkextents_size(vmdkparser->extents);
+	while (nbytes > 0) {
+		block = offset / (CHAIN_BLOCK_SECTORS * SECTOR_SIZE);
+		block_start = (uint64_t)block * CHAIN_BLOCK_SECTORS * SECTOR_SIZE;
+		sector = (offset - block_start) / SECTOR_SIZE;
+
+		pthread_mutex_lock(&vmdkparser->chain_lock);
+		result = NO_ERROR;
+		if (vmdkparser->chain == NULL) {
+			result = vhdchain_new(howmany(disksize, CHAIN_BLOCK_SECTORS * SECTOR_SIZE),
+			    CHAIN_BLOCK_SECTORS, &vmdkparser->chain);
+		}
+		found = NULL;
+		if (!IS_ERROR(result)) {
+			found = vhdchain_lookup(vmdkparser->chain, block, sector);
+		}
+		if (!IS_ERROR(result) && found == NULL) {
+			result = resolve_range(vmdkparser, block, vmdkparser, block_start,
+			    MIN(CHAIN_BLOCK_SECTORS * SECTOR_SIZE, disksize - block_start));
+			vhdchain_resolved(vmdkparser->chain, block, !IS_ERROR(result));
+			if (!IS_ERROR(result)) {
+				found = vhdchain_lookup(vmdkparser->chain, block, sector);
+			}
+		}
+		if (!IS_ERROR(result) && found == NULL) {
+			result = ERROR(LDI_ERR_INTERNAL);
+		}
+		if (!IS_ERROR(result)) {
+			/* The run may change once the lock is released. */
+			run = *found;
+		}
+		pthread_mutex_unlock(&vmdkparser->chain_lock);
+		if (IS_ERROR(result)) {
+			return result;
+		}
+
+		length = MIN(block_start + (uint64_t)(run.sector + run.count) * SECTOR_SIZE - offset,
+		    nbytes);
+		if (run.layer == NULL) {
+			memset(buf, 0, length);
+		} else {
+			result = vmdkextents_read(((struct vmdkparser *)run.layer)->extents, buf,
+			    length, run.file_offset + offset - block_start -
+			    (uint64_t)run.sector * SECTOR_SIZE);
+			if (IS_ERROR(result)) {
+				return result;
+			}
+		}
+
+		buf += length;
+		nbytes -= length;
+		offset += length;
+	}
+
+	return NO_ERROR;
+}
+
 /*
  * Reads nbytes at offset into the buffer.
  */
 LDI_ERROR
 vmdkparser_read(void *parser, char *buf, size_t nbytes, off_t offset)
 {
-	struct filemap *map;
 	struct vmdkparser *vmdkparser = parser;
-	LDI_ERROR res;
 
-	res = file_getmap(vmdkparser->datafile, offset, nbytes, &map, vmdkparser->logger);
-	if (IS_ERROR(res)) {
-		return res;
+	if (vmdkparser->parent != NULL) {
+		return read_chain(vmdkparser, buf, nbytes, offset);
 	}
-	memcpy(buf, map->pointer, nbytes);
-	filemap_destroy(&map);
 
-	return NO_ERROR;
+	return vmdkextents_read(vmdkparser->extents, buf, nbytes, offset);
 }
 
 /*
@@ -178,8 +419,69 @@ vmdkparser_read(void *parser, char *buf, size_t nbytes, off_t offset)
 LDI_ERROR
 vmdkparser_write(void *parser, char *buf, size_t nbytes, off_t offset)
 {
-	/* Not yet supported, ignore the call. */
-	return NO_ERROR;
+	struct vmdkparser *vmdkparser = parser;
+	struct vhdchain_run run;
+	uint64_t start, end, block_start;
+	uint32_t block;
+	LDI_ERROR result;
+
+	result = vmdkextents_write(vmdkparser->extents, buf, nbytes, offset);
+	if (IS_ERROR(result) || vmdkparser->parent == NULL) {
+		return result;
+	}
+
+	/*
+	 * The written sectors now belong to the child. Partially written
+	 * sectors are in grains that were filled from the parent.
+	 */
+	pthread_mutex_lock(&vmdkparser->chain_lock);
+	start = rounddown(offset, SECTOR_SIZE);
+	end = roundup(offset + nbytes, SECTOR_SIZE);
+	while (vmdkparser->chain != NULL && !IS_ERROR(result) && start < end) {
+		block = start / (CHAIN_BLOCK_SECTORS * SECTOR_SIZE);
+		block_start = (uint64_t)block * CHAIN_BLOCK_SECTORS * SECTOR_SIZE;
+		run.sector = (start - block_start) / SECTOR_SIZE;
+		run.count = MIN(end - start, block_start +
+		    CHAIN_BLOCK_SECTORS * SECTOR_SIZE - start) / SECTOR_SIZE;
+		run.layer = vmdkparser;
+		run.file_offset = start;
+		result = vhdchain_assign(vmdkparser->chain, block, run);
+		start += (uint64_t)run.count * SECTOR_SIZE;
+	}
+	pthread_mutex_unlock(&vmdkparser->chain_lock);
+
+	return result;
+}
+
+/*
+ * Makes all data written to the diskimage durable.
+ */
+LDI_ERROR
+vmdkparser_flush(void *parser)
+{
+	struct vmdkparser *vmdkparser = parser;
+
+	return vmdkextents_sync(vmdkparser->extents);
+}
+
+/*
+ * Creates a new child of the disk at parent_path.
+ */
+LDI_ERROR
+vmdkparser_create_child(struct fileinterface *fi, char *parent_path, char *child_path, struct logger logger)
+{
+	return vmdkcreate_child(fi, parent_path, child_path, logger);
+}
+
+/*
+ * Returns true if the file is a descriptor file or starts a hosted sparse
+ * extent, which may have the descriptor embedded.
+ */
+bool
+vmdkparser_probe(void *head, void *tail)
+{
+	return vmdksparseheader_magic_valid(head) ||
+	    memcmp(head, DESCRIPTOR_SIGNATURE, strlen(DESCRIPTOR_SIGNATURE)) == 0;
 }
 
 /*
@@ -189,11 +491,14 @@ vmdkparser_write(void *parser, char *buf, size_t nbytes, off_t offset)
  */
 static struct ldi_parser vmdkparser_format = {
 	.name = "vmdk",
+	.probe = vmdkparser_probe,
 	.construct = vmdkparser_new,
 	.destructor = vmdkparser_destroy,
 	.diskinfo = vmdkparser_diskinfo,
 	.read = vmdkparser_read,
-	.write = vmdkparser_write
+	.write = vmdkparser_write,
+	.flush = vmdkparser_flush,
+	.create_child = vmdkparser_create_child
 };
 
 PARSER_DEFINE(vmdkparser_format);
@@ -0,0 +1,854 @@
+
+#include <sys/param.h>
+#include <sys/endian.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blockcache.h"
+#include "diskimage.h"
+#include "fileinterface.h"
+#include "internal.h"
+#include "log.h"
+#include "vmdkdescriptorfile.h"
+#include "vmdksparse.h"
+#include "vmdksparseheader.h"
+
+#define SECTOR_SIZE 512
+
+/* The largest descriptor that is read. */
+#define MAX_DESCRIPTOR_SIZE (1024 * 1024)
+
+/*
+ * The number of grain tables that are kept in memory. With the default
+ * layout each table covers 32 MB of the disk in 2 KB of memory.
+ */
+#define GT_CACHE_SIZE 512
+
+/*
+ * The number of grains the file is extended with at a time, so that most
+ * grain allocations don't change the size of the file.
+ */
+#define ALLOCATION_BATCH 16
+
+/* Grain table entries of grains that read as zeros without a parent. */
+#define GTE_UNALLOCATED 0
+#define GTE_ZERO 1
+
+/*
+ * A grain table that has been changed since the last flush, in little
+ * endian byte order, and the range of its entries that have to be written.
+ */
+struct dirty_table {
+	uint32_t *table;
+	uint32_t first_entry;
+	uint32_t end_entry;
+};
+
+struct vmdksparse {
+	/* The file with the extent. */
+	struct file *file;
+	/* The header of the extent. */
+	struct vmdksparseheader *header;
+	/* The grain directory, in host byte order. */
+	uint32_t *gd;
+	/* The redundant grain directory, or NULL if there is none. */
+	uint32_t *rgd;
+	/* The number of entries in the grain directory. */
+	uint32_t num_gts;
+	/* The number of bytes in each grain and in each grain table. */
+	size_t	grain_bytes;
+	size_t	gt_bytes;
+	/*
+	 * The most recently used grain tables, by index in the directory.
+	 * Tables that are dirty are not in the cache.
+	 */
+	struct blockcache *gt_cache;
+	/*
+	 * The dirty grain tables by index in the directory, and a list of
+	 * those indexes. Allocated on the first write.
+	 */
+	struct dirty_table **dirty;
+	uint32_t *dirty_list;
+	uint32_t ndirty;
+	/* True if the grain directories have to be written. */
+	bool	gd_dirty;
+	/*
+	 * The sector where the next grain is allocated, and the end of the
+	 * space that the file has been extended with.
+	 */
+	uint64_t next_sector;
+	uint64_t end_sector;
+	/* Protects all of the above that can change. */
+	pthread_mutex_t lock;
+	/*
+	 * Reads the parent disk, if there is one, at parent_offset plus the
+	 * offset in the extent.
+	 */
+	vmdk_parent_read_fn parent_read;
+	void   *parent_arg;
+	off_t	parent_offset;
+	/* Used for logging. */
+	struct logger logger;
+};
+
+/*
+ * Checks that the header describes an extent that can be read.
+ */
+static LDI_ERROR
+check_header(struct vmdksparseheader *header, struct logger logger)
+{
+	if ((header->flags & (VMDK_FLAG_COMPRESSED | VMDK_FLAG_MARKERS)) != 0 ||
+	    header->gd_offset == VMDK_GD_AT_END) {
+		LOG_ERROR(logger, "Compressed extents must be in a streamOptimized disk.\n");
+		return ERROR(LDI_ERR_FILENOTSUP);
+	}
+	if (header->version < 1 || header->version > 3) {
+		LOG_ERROR(logger, "Unknown sparse extent version %u.\n", header->version);
+		return ERROR(LDI_ERR_FILENOTSUP);
+	}
+	if (header->grain_size == 0 || !powerof2(header->grain_size) ||
+	    header->num_gtes_per_gt == 0) {
+		LOG_ERROR(logger, "The sparse extent header is invalid.\n");
+		return ERROR(LDI_ERR_PARSEERROR);
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Reads a grain directory at the given sector.
+ */
+static LDI_ERROR
+read_directory(struct vmdksparse *sparse, uint64_t sector, uint32_t **gd)
+{
+	uint32_t i;
+	LDI_ERROR result;
+
+	*gd = malloc((size_t)sparse->num_gts * sizeof(uint32_t));
+	if (*gd == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+
+	result = file_read(sparse->file, (char *)*gd,
+	    (size_t)sparse->num_gts * sizeof(uint32_t),
+	    sector * SECTOR_SIZE, sparse->logger);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	for (i = 0; i < sparse->num_gts; i++) {
+		(*gd)[i] = le32toh((*gd)[i]);
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Writes a grain directory at the given sector.
+ */
+static LDI_ERROR
+write_directory(struct vmdksparse *sparse, uint64_t sector, uint32_t *gd)
+{
+	uint32_t *buffer;
+	uint32_t i;
+	LDI_ERROR result;
+
+	buffer = malloc((size_t)sparse->num_gts * sizeof(uint32_t));
+	if (buffer == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	for (i = 0; i < sparse->num_gts; i++) {
+		buffer[i] = htole32(gd[i]);
+	}
+
+	result = file_write(sparse->file, buffer,
+	    (size_t)sparse->num_gts * sizeof(uint32_t),
+	    sector * SECTOR_SIZE, sparse->logger);
+	free(buffer);
+
+	return result;
+}
+
+/*
+ * Opens the hosted sparse extent in file.
+ */
+LDI_ERROR
+vmdksparse_open(struct file *file, struct vmdksparse **sparse, struct logger logger)
+{
+	char buffer[VMDK_SPARSE_HEADER_SIZE];
+	uint64_t gt_coverage;
+	size_t filesize;
+	LDI_ERROR result;
+
+	result = file_read(file, buffer, sizeof(buffer), 0, logger);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	*sparse = calloc(1, sizeof(struct vmdksparse));
+	if (*sparse == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	(*sparse)->file = file;
+	(*sparse)->logger = logger;
+	pthread_mutex_init(&(*sparse)->lock, NULL);
+
+	result = vmdksparseheader_new(buffer, &(*sparse)->header);
+	if (IS_ERROR(result)) {
+		LOG_ERROR(logger, "The extent is not a hosted sparse extent.\n");
+		vmdksparse_destroy(sparse);
+		return result;
+	}
+	result = check_header((*sparse)->header, logger);
+	if (IS_ERROR(result)) {
+		vmdksparse_destroy(sparse);
+		return result;
+	}
+
+	(*sparse)->grain_bytes = (*sparse)->header->grain_size * SECTOR_SIZE;
+	(*sparse)->gt_bytes = (*sparse)->header->num_gtes_per_gt * sizeof(uint32_t);
+	gt_coverage = (*sparse)->header->grain_size * (*sparse)->header->num_gtes_per_gt;
+	(*sparse)->num_gts = howmany((*sparse)->header->capacity, gt_coverage);
+
+	result = read_directory(*sparse, (*sparse)->header->gd_offset, &(*sparse)->gd);
+	if (!IS_ERROR(result) &&
+	    ((*sparse)->header->flags & VMDK_FLAG_REDUNDANT_GRAIN_TABLE) != 0 &&
+	    (*sparse)->header->rgd_offset != 0) {
+		result = read_directory(*sparse, (*sparse)->header->rgd_offset, &(*sparse)->rgd);
+	}
+	if (!IS_ERROR(result)) {
+		result = file_getsize(file, &filesize);
+	}
+	if (!IS_ERROR(result)) {
+		result = blockcache_create(GT_CACHE_SIZE, &(*sparse)->gt_cache);
+	}
+	if (IS_ERROR(result)) {
+		vmdksparse_destroy(sparse);
+		return result;
+	}
+
+	/* New grains are added at the end of the file. */
+	(*sparse)->next_sector = howmany(filesize, SECTOR_SIZE);
+	(*sparse)->end_sector = (*sparse)->next_sector;
+
+	return NO_ERROR;
+}
+
+/*
+ * Frees the extent and sets the pointer to NULL.
+ */
+void
+vmdksparse_destroy(struct vmdksparse **sparse)
+{
+	uint32_t i;
+
+	/* Make sure that all metadata is written before the file is closed. */
+	if (((*sparse)->ndirty > 0 || (*sparse)->gd_dirty) &&
+	    IS_ERROR(vmdksparse_flush(*sparse))) {
+		LOG_ERROR((*sparse)->logger, "Failed to write the grain tables.\n");
+	}
+	if ((*sparse)->end_sector > (*sparse)->next_sector) {
+		/* Give back the space that no grain was allocated in. */
+		file_setsize((*sparse)->file, (*sparse)->next_sector * SECTOR_SIZE);
+	}
+
+	if ((*sparse)->dirty != NULL) {
+		for (i = 0; i < (*sparse)->ndirty; i++) {
+			free((*sparse)->dirty[(*sparse)->dirty_list[i]]->table);
+			free((*sparse)->dirty[(*sparse)->dirty_list[i]]);
+		}
+		free((*sparse)->dirty);
+		free((*sparse)->dirty_list);
+	}
+	if ((*sparse)->gt_cache != NULL) {
+		blockcache_destroy(&(*sparse)->gt_cache);
+	}
+	if ((*sparse)->header != NULL) {
+		vmdksparseheader_destroy(&(*sparse)->header);
+	}
+	pthread_mutex_destroy(&(*sparse)->lock);
+	free((*sparse)->gd);
+	free((*sparse)->rgd);
+	free(*sparse);
+	*sparse = NULL;
+}
+
+/*
+ * Returns the number of bytes in the extent.
+ */
+uint64_t
+vmdksparse_size(struct vmdksparse *sparse)
+{
+	return sparse->header->capacity * SECTOR_SIZE;
+}
+
+/*
+ * Sets the function that reads the data of unallocated grains from the
+ * parent disk.
+ */
+void
+vmdksparse_set_parent(struct vmdksparse *sparse, vmdk_parent_read_fn read, void *arg, off_t offset)
+{
+	sparse->parent_read = read;
+	sparse->parent_arg = arg;
+	sparse->parent_offset = offset;
+}
+
+/*
+ * Looks up the grain table entry of the grain, which is the sector where
+ * the grain starts in the file. Reads the grain table into the cache if
+ * it is not already there. Must be called with the lock held.
+ */
+static LDI_ERROR
+lookup_grain_locked(struct vmdksparse *sparse, uint64_t grain, uint32_t *sector)
+{
+	uint32_t *table;
+	uint32_t entry;
+	uint64_t gt;
+	size_t index;
+	LDI_ERROR result;
+
+	gt = grain / sparse->header->num_gtes_per_gt;
+	index = grain % sparse->header->num_gtes_per_gt;
+	if (gt >= sparse->num_gts) {
+		return ERROR(LDI_ERR_OUTOFRANGE);
+	}
+
+	/* A grain table that was never allocated has no grains. */
+	if (sparse->gd[gt] == 0) {
+		*sector = GTE_UNALLOCATED;
+		return NO_ERROR;
+	}
+
+	if (sparse->dirty != NULL && sparse->dirty[gt] != NULL) {
+		*sector = le32toh(sparse->dirty[gt]->table[index]);
+		return NO_ERROR;
+	}
+
+	if (blockcache_get(sparse->gt_cache, gt, &entry, index * sizeof(uint32_t), sizeof(uint32_t))) {
+		*sector = le32toh(entry);
+		return NO_ERROR;
+	}
+
+	table = malloc(sparse->gt_bytes);
+	if (table == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	result = file_read(sparse->file, (char *)table, sparse->gt_bytes,
+	    (off_t)sparse->gd[gt] * SECTOR_SIZE, sparse->logger);
+	if (IS_ERROR(result)) {
+		free(table);
+		return result;
+	}
+	*sector = le32toh(table[index]);
+
+	/* The cache takes over the table. */
+	blockcache_put(sparse->gt_cache, gt, table, sparse->gt_bytes);
+
+	return NO_ERROR;
+}
+
+/*
+ * Looks up the grain table entry of the grain.
+ */
+static LDI_ERROR
+lookup_grain(struct vmdksparse *sparse, uint64_t grain, uint32_t *sector)
+{
+	LDI_ERROR result;
+
+	pthread_mutex_lock(&sparse->lock);
+	result = lookup_grain_locked(sparse, grain, sector);
+	pthread_mutex_unlock(&sparse->lock);
+
+	return result;
+}
+
+/*
+ * Returns true if a grain at sector continues a run of count grains that
+ * starts at start, so that the whole run can be read at once.
+ */
+static bool
+continues_run(struct vmdksparse *sparse, uint32_t start, uint64_t count, uint32_t sector)
+{
+	if (start == GTE_UNALLOCATED || start == GTE_ZERO) {
+		return sector == GTE_UNALLOCATED || sector == GTE_ZERO;
+	}
+
+	return sector == start + count * sparse->header->grain_size;
+}
+
+/*
+ * Finds how many bytes from offset, up to nbytes, are either all in
+ * allocated grains or all in unallocated grains. Zero grains count as
+ * allocated, since they hide the parent.
+ */
+LDI_ERROR
+vmdksparse_allocated(struct vmdksparse *sparse, off_t offset, size_t nbytes, bool *allocated, size_t *length)
+{
+	uint64_t grain;
+	uint32_t sector;
+	LDI_ERROR result;
+
+	grain = offset / sparse->grain_bytes;
+	result = lookup_grain(sparse, grain, &sector);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+	*allocated = sector != GTE_UNALLOCATED;
+	*length = MIN(sparse->grain_bytes - offset % sparse->grain_bytes, nbytes);
+
+	while (*length < nbytes) {
+		result = lookup_grain(sparse, ++grain, &sector);
+		if (IS_ERROR(result)) {
+			return result;
+		}
+		if ((sector != GTE_UNALLOCATED) != *allocated) {
+			break;
+		}
+		*length += MIN(sparse->grain_bytes, nbytes - *length);
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Reads nbytes at offset in the extent into the buffer. Grains that are
+ * next to each other both on the disk and in the file are read with a
+ * single read, and runs of unallocated grains are zeroed at once.
+ */
+LDI_ERROR
+vmdksparse_read(struct vmdksparse *sparse, char *buf, size_t nbytes, off_t offset)
+{
+	uint64_t grain;
+	uint32_t start, sector;
+	size_t offset_in_grain, length;
+	LDI_ERROR result;
+
+	grain = offset / sparse->grain_bytes;
+	result = lookup_grain(sparse, grain, &sector);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	while (nbytes > 0) {
+		start = sector;
+		offset_in_grain = offset % sparse->grain_bytes;
+		length = MIN(sparse->grain_bytes - offset_in_grain, nbytes);
+
+		/* Extend the run with as many of the following grains as possible. */
+		while (length < nbytes) {
+			result = lookup_grain(sparse, grain + 1, &sector);
+			if (IS_ERROR(result)) {
+				return result;
+			}
+			grain++;
+			if (!continues_run(sparse, start,
+			    (offset_in_grain + length) / sparse->grain_bytes, sector)) {
+				break;
+			}
+			length += MIN(sparse->grain_bytes, nbytes - length);
+		}
+
+		if (start == GTE_UNALLOCATED || start == GTE_ZERO) {
+			memset(buf, 0, length);
+		} else {
+			result = file_read(sparse->file, buf, length,
+			    (off_t)start * SECTOR_SIZE + offset_in_grain, sparse->logger);
+			if (IS_ERROR(result)) {
+				return result;
+			}
+		}
+
+		buf += length;
+		offset += length;
+		nbytes -= length;
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Reserves sectors at the end of the file. The file is extended in batches
+ * of several grains, so that most allocations only move the tail.
+ */
+static LDI_ERROR
+reserve(struct vmdksparse *sparse, uint64_t sectors, uint64_t *start)
+{
+	uint64_t batch;
+	LDI_ERROR result;
+
+	if (sparse->next_sector + sectors > sparse->end_sector) {
+		batch = MAX(sectors, ALLOCATION_BATCH * sparse->header->grain_size);
+		result = file_setsize(sparse->file,
+		    (sparse->next_sector + batch) * SECTOR_SIZE);
+		if (IS_ERROR(result)) {
+			return result;
+		}
+		sparse->end_sector = sparse->next_sector + batch;
+	}
+
+	*start = sparse->next_sector;
+	sparse->next_sector += sectors;
+
+	return NO_ERROR;
+}
+
+/*
+ * Adds the grain table to the dirty tables, taking it out of the cache or
+ * reading it if needed. Must be called with the lock held.
+ */
+static LDI_ERROR
+get_dirty_table(struct vmdksparse *sparse, uint32_t gt, struct dirty_table **dirty)
+{
+	struct dirty_table *new;
+	LDI_ERROR result;
+
+	if (sparse->dirty == NULL) {
+		sparse->dirty = calloc(sparse->num_gts, sizeof(struct dirty_table *));
+		sparse->dirty_list = malloc(sparse->num_gts * sizeof(uint32_t));
+		if (sparse->dirty == NULL || sparse->dirty_list == NULL) {
+			free(sparse->dirty);
+			free(sparse->dirty_list);
+			sparse->dirty = NULL;
+			sparse->dirty_list = NULL;
+			return ERROR(LDI_ERR_NOMEM);
+		}
+	}
+	if (sparse->dirty[gt] != NULL) {
+		*dirty = sparse->dirty[gt];
+		return NO_ERROR;
+	}
+
+	new = calloc(1, sizeof(struct dirty_table));
+	if (new == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	new->table = calloc(1, sparse->gt_bytes);
+	if (new->table == NULL) {
+		free(new);
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	new->first_entry = sparse->header->num_gtes_per_gt;
+
+	/* Tables that were never allocated are all zeros. */
+	if (sparse->gd[gt] != 0 &&
+	    !blockcache_get(sparse->gt_cache, gt, new->table, 0, sparse->gt_bytes)) {
+		result = file_read(sparse->file, (char *)new->table, sparse->gt_bytes,
+		    (off_t)sparse->gd[gt] * SECTOR_SIZE, sparse->logger);
+		if (IS_ERROR(result)) {
+			free(new->table);
+			free(new);
+			return result;
+		}
+	}
+	/* The dirty copy is the only one until it has been written. */
+	blockcache_remove(sparse->gt_cache, gt);
+
+	sparse->dirty[gt] = new;
+	sparse->dirty_list[sparse->ndirty++] = gt;
+	*dirty = new;
+
+	return NO_ERROR;
+}
+
+/*
+ * Allocates the grain table in both grain directories. The new tables are
+ * written in full by the next flush. Must be called with the lock held.
+ */
+static LDI_ERROR
+allocate_table(struct vmdksparse *sparse, uint32_t gt)
+{
+	struct dirty_table *dirty;
+	uint64_t sectors, start, redundant;
+	LDI_ERROR result;
+
+	result = get_dirty_table(sparse, gt, &dirty);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	sectors = howmany(sparse->gt_bytes, SECTOR_SIZE);
+	redundant = 0;
+	result = reserve(sparse, sectors, &start);
+	if (!IS_ERROR(result) && sparse->rgd != NULL) {
+		result = reserve(sparse, sectors, &redundant);
+	}
+	if (IS_ERROR(result)) {
+		return result;
+	}
+	if (MAX(start, redundant) > UINT32_MAX) {
+		LOG_ERROR(sparse->logger, "The sparse extent is full.\n");
+		return ERROR(LDI_ERR_IO);
+	}
+	sparse->gd[gt] = start;
+	if (sparse->rgd != NULL) {
+		sparse->rgd[gt] = redundant;
+	}
+
+	dirty->first_entry = 0;
+	dirty->end_entry = sparse->header->num_gtes_per_gt;
+	sparse->gd_dirty = true;
+
+	return NO_ERROR;
+}
+
+/*
+ * Allocates space for the grain at the end of the file and points its grain
+ * table entry at it. Must be called with the lock held.
+ */
+static LDI_ERROR
+allocate_grain(struct vmdksparse *sparse, uint64_t grain, uint32_t *sector)
+{
+	struct dirty_table *dirty;
+	uint32_t gt, index;
+	uint64_t start;
+	LDI_ERROR result;
+
+	gt = grain / sparse->header->num_gtes_per_gt;
+	index = grain % sparse->header->num_gtes_per_gt;
+
+	result = NO_ERROR;
+	if (sparse->gd[gt] == 0) {
+		result = allocate_table(sparse, gt);
+	}
+	if (!IS_ERROR(result)) {
+		result = get_dirty_table(sparse, gt, &dirty);
+	}
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	result = reserve(sparse, sparse->header->grain_size, &start);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+	if (start > UINT32_MAX) {
+		LOG_ERROR(sparse->logger, "The sparse extent is full.\n");
+		return ERROR(LDI_ERR_IO);
+	}
+
+	dirty->table[index] = htole32((uint32_t)start);
+	dirty->first_entry = MIN(dirty->first_entry, index);
+	dirty->end_entry = MAX(dirty->end_entry, index + 1);
+	*sector = start;
+
+	return NO_ERROR;
+}
+
+/*
+ * Writes part of a newly allocated grain at sector, with the rest of the
+ * grain copied from the parent.
+ */
+static LDI_ERROR
+write_partial_grain(struct vmdksparse *sparse, uint64_t grain, uint32_t sector, char *buf, size_t offset_in_grain, size_t nbytes)
+{
+	char *buffer;
+	size_t length;
+	LDI_ERROR result;
+
+	buffer = malloc(sparse->grain_bytes);
+	if (buffer == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+
+	/* The last grain may extend past the end of the extent. */
+	length = MIN(sparse->grain_bytes,
+	    vmdksparse_size(sparse) - grain * sparse->grain_bytes);
+	result = sparse->parent_read(sparse->parent_arg, buffer, length,
+	    sparse->parent_offset + grain * sparse->grain_bytes);
+	if (!IS_ERROR(result)) {
+		memcpy(buffer + offset_in_grain, buf, nbytes);
+		result = file_write(sparse->file, buffer, length,
+		    (off_t)sector * SECTOR_SIZE, sparse->logger);
+	}
+	free(buffer);
+
+	return result;
+}
+
+/*
+ * Writes nbytes from the buffer at offset in the extent. Grains that are
+ * not allocated are added at the end of the file. The rest of such a
+ * grain is copied from the parent, or reads as zeros if there is none.
+ * The grain tables are only written by a flush.
+ */
+LDI_ERROR
+vmdksparse_write(struct vmdksparse *sparse, char *buf, size_t nbytes, off_t offset)
+{
+	uint64_t grain;
+	uint32_t entry, sector;
+	size_t offset_in_grain, length;
+	LDI_ERROR result;
+
+	pthread_mutex_lock(&sparse->lock);
+	while (nbytes > 0) {
+		grain = offset / sparse->grain_bytes;
+		offset_in_grain = offset % sparse->grain_bytes;
+		length = MIN(sparse->grain_bytes - offset_in_grain, nbytes);
+
+		result = lookup_grain_locked(sparse, grain, &entry);
+		sector = entry;
+		if (!IS_ERROR(result) &&
+		    (entry == GTE_UNALLOCATED || entry == GTE_ZERO)) {
+			result = allocate_grain(sparse, grain, &sector);
+		}
+		if (!IS_ERROR(result) && entry == GTE_UNALLOCATED &&
+		    sparse->parent_read != NULL && length < sparse->grain_bytes) {
+			result = write_partial_grain(sparse, grain, sector, buf,
+			    offset_in_grain, length);
+		} else if (!IS_ERROR(result)) {
+			result = file_write(sparse->file, buf, length,
+			    (off_t)sector * SECTOR_SIZE + offset_in_grain, sparse->logger);
+		}
+		if (IS_ERROR(result)) {
+			pthread_mutex_unlock(&sparse->lock);
+			return result;
+		}
+
+		buf += length;
+		offset += length;
+		nbytes -= length;
+	}
+	pthread_mutex_unlock(&sparse->lock);
+
+	return NO_ERROR;
+}
+
+/*
+ * Writes the changed sectors of a dirty grain table to the table at sector.
+ */
+static LDI_ERROR
+write_table(struct vmdksparse *sparse, struct dirty_table *dirty, uint64_t sector)
+{
+	size_t start, end;
+
+	if (dirty->first_entry >= dirty->end_entry || sector == 0) {
+		/* Nothing was changed, or the table could not be allocated. */
+		return NO_ERROR;
+	}
+
+	start = rounddown(dirty->first_entry * sizeof(uint32_t), SECTOR_SIZE);
+	end = MIN(roundup(dirty->end_entry * sizeof(uint32_t), SECTOR_SIZE),
+	    sparse->gt_bytes);
+
+	return file_write(sparse->file, (char *)dirty->table + start, end - start,
+	    sector * SECTOR_SIZE + start, sparse->logger);
+}
+
+/*
+ * Writes the grain tables and directories that have changed. The grains
+ * are made durable before the tables that point at them, and the tables
+ * before the directories, so that a crash never leaves an entry that
+ * points at data that was not written.
+ */
+LDI_ERROR
+vmdksparse_flush(struct vmdksparse *sparse)
+{
+	struct dirty_table *dirty;
+	uint32_t i, gt;
+	LDI_ERROR result;
+
+	pthread_mutex_lock(&sparse->lock);
+	result = file_sync(sparse->file);
+
+	for (i = 0; i < sparse->ndirty && !IS_ERROR(result); i++) {
+		gt = sparse->dirty_list[i];
+		result = write_table(sparse, sparse->dirty[gt], sparse->gd[gt]);
+		if (!IS_ERROR(result) && sparse->rgd != NULL && sparse->rgd[gt] != 0) {
+			result = write_table(sparse, sparse->dirty[gt], sparse->rgd[gt]);
+		}
+	}
+	if (!IS_ERROR(result) && sparse->ndirty > 0) {
+		result = file_sync(sparse->file);
+	}
+
+	if (!IS_ERROR(result) && sparse->gd_dirty) {
+		result = write_directory(sparse, sparse->header->gd_offset, sparse->gd);
+		if (!IS_ERROR(result) && sparse->rgd != NULL) {
+			result = write_directory(sparse, sparse->header->rgd_offset, sparse->rgd);
+		}
+		if (!IS_ERROR(result)) {
+			result = file_sync(sparse->file);
+		}
+	}
+	if (IS_ERROR(result)) {
+		/* Everything stays dirty so that the next flush tries again. */
+		pthread_mutex_unlock(&sparse->lock);
+		return result;
+	}
+
+	/* The written tables are clean and can be cached again. */
+	for (i = 0; i < sparse->ndirty; i++) {
+		gt = sparse->dirty_list[i];
+		dirty = sparse->dirty[gt];
+		blockcache_put(sparse->gt_cache, gt, dirty->table, sparse->gt_bytes);
+		free(dirty);
+		sparse->dirty[gt] = NULL;
+	}
+	sparse->ndirty = 0;
+	sparse->gd_dirty = false;
+	pthread_mutex_unlock(&sparse->lock);
+
+	return NO_ERROR;
+}
+
+/*
+ * Reads the descriptor in file, either a descriptor file or the descriptor
+ * embedded in a sparse extent.
+ */
+LDI_ERROR
+vmdksparse_read_descriptor(struct file *file, struct vmdkdescriptorfile **descriptorfile, struct logger logger)
+{
+	struct vmdksparseheader *header;
+	char *buffer;
+	size_t size, length;
+	off_t offset;
+	LDI_ERROR result;
+
+	result = file_getsize(file, &size);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	buffer = malloc(VMDK_SPARSE_HEADER_SIZE);
+	if (buffer == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	offset = 0;
+	length = size;
+	if (size >= VMDK_SPARSE_HEADER_SIZE) {
+		result = file_read(file, buffer, VMDK_SPARSE_HEADER_SIZE, 0, logger);
+		if (IS_ERROR(result)) {
+			free(buffer);
+			return result;
+		}
+		if (!IS_ERROR(vmdksparseheader_new(buffer, &header))) {
+			offset = header->descriptor_offset * SECTOR_SIZE;
+			length = header->descriptor_size * SECTOR_SIZE;
+			vmdksparseheader_destroy(&header);
+		}
+	}
+	free(buffer);
+
+	if (length == 0 || length > MAX_DESCRIPTOR_SIZE) {
+		/* A sparse extent that belongs to a separate descriptor. */
+		LOG_ERROR(logger, "No descriptor found in the file.\n");
+		return ERROR(LDI_ERR_FILENOTSUP);
+	}
+
+	buffer = malloc(length);
+	if (buffer == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	result = file_read(file, buffer, length, offset, logger);
+	if (!IS_ERROR(result)) {
+		/* Embedded descriptors are padded with zeros. */
+		result = vmdkdescriptorfile_new(buffer, descriptorfile,
+		    strnlen(buffer, length), logger);
+	}
+	free(buffer);
+
+	return result;
+}
@@ -0,0 +1,80 @@
+#ifndef _VMDKSPARSE_H_
+#define _VMDKSPARSE_H_
+
+#include <sys/types.h>
+#include <stdbool.h>
+
+#include "diskimage.h"
+#include "fileinterface.h"
+#include "vmdkdescriptorfile.h"
+
+/*
+ * Reads nbytes at offset on the parent disk, for the parts of grains that
+ * are not written when they are allocated.
+ */
+typedef LDI_ERROR (*vmdk_parent_read_fn)(void *arg, char *buf, size_t nbytes, off_t offset);
+
+/*
+ * A hosted sparse extent. The grain directory is read when the extent is
+ * opened, and the grain tables are read when they are first needed and
+ * kept in a bounded cache.
+ */
+struct vmdksparse;
+
+/*
+ * Opens the hosted sparse extent in file. The file must stay open until
+ * the extent is destroyed. Fails with LDI_ERR_FILENOTSUP for compressed
+ * extents.
+ */
+LDI_ERROR vmdksparse_open(struct file *file, struct vmdksparse **sparse, struct logger logger);
+
+/*
+ * Flushes the extent, frees it and sets the pointer to NULL. Does not
+ * close the file.
+ */
+void	vmdksparse_destroy(struct vmdksparse **sparse);
+
+/*
+ * Returns the number of bytes in the extent.
+ */
+uint64_t vmdksparse_size(struct vmdksparse *sparse);
+
+/*
+ * Sets the function that reads the parent disk of a delta extent. offset
+ * is the offset on the parent disk where the extent starts.
+ */
+void	vmdksparse_set_parent(struct vmdksparse *sparse, vmdk_parent_read_fn read, void *arg, off_t offset);
+
+/*
+ * Sets length to the number of bytes from offset, at most nbytes, that are
+ * either all allocated in the extent or all left to the parent, and
+ * allocated to which of them it is.
+ */
+LDI_ERROR vmdksparse_allocated(struct vmdksparse *sparse, off_t offset, size_t nbytes, bool *allocated, size_t *length);
+
+/*
+ * Reads nbytes at offset in the extent into the buffer. Grains that are
+ * not allocated read as zeros.
+ */
+LDI_ERROR vmdksparse_read(struct vmdksparse *sparse, char *buf, size_t nbytes, off_t offset);
+
+/*
+ * Writes nbytes from the buffer at offset in the extent. Unallocated grains
+ * are allocated at the end of the file, which is extended several grains at
+ * a time. The grain tables are not written until the extent is flushed.
+ */
+LDI_ERROR vmdksparse_write(struct vmdksparse *sparse, char *buf, size_t nbytes, off_t offset);
+
+/*
+ * Makes the written grains durable and then writes the grain tables and
+ * directories that point at them.
+ */
+LDI_ERROR vmdksparse_flush(struct vmdksparse *sparse);
+
+/*
+ * Reads the descriptor in file, which is either a descriptor file or a
+ * sparse extent with an embedded descriptor.
+ */
+LDI_ERROR vmdksparse_read_descriptor(struct file *file, struct vmdkdescriptorfile **descriptorfile, struct logger logger);
+
+#endif					/* _VMDKSPARSE_H_ */
@@ -0,0 +1,112 @@
+
+#include <sys/endian.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+#include "vmdksparseheader.h"
+
+/* Defines the offsets used in the header of a hosted sparse extent. */
+#define MAGIC_OFFSET 0
+#define VERSION_OFFSET 4
+#define FLAGS_OFFSET 8
+#define CAPACITY_OFFSET 12
+#define GRAIN_SIZE_OFFSET 20
+#define DESCRIPTOR_OFFSET_OFFSET 28
+#define DESCRIPTOR_SIZE_OFFSET 36
+#define NUM_GTES_PER_GT_OFFSET 44
+#define RGD_OFFSET_OFFSET 48
+#define GD_OFFSET_OFFSET 56
+#define OVERHEAD_OFFSET 64
+#define UNCLEAN_SHUTDOWN_OFFSET 72
+#define SINGLE_END_LINE_CHAR_OFFSET 73
+#define NON_END_LINE_CHAR_OFFSET 74
+#define DOUBLE_END_LINE_CHAR1_OFFSET 75
+#define DOUBLE_END_LINE_CHAR2_OFFSET 76
+#define COMPRESS_ALGORITHM_OFFSET 77
+
+/*
+ * Returns true if source starts a hosted sparse extent.
+ */
+bool
+vmdksparseheader_magic_valid(void *source)
+{
+	uint8_t *bytes = source;
+
+	return le32dec(bytes + MAGIC_OFFSET) == VMDK_SPARSE_MAGIC;
+}
+
+/*
+ * Creates a new header by reading it from source.
+ */
+LDI_ERROR
+vmdksparseheader_new(void *source, struct vmdksparseheader **header)
+{
+	uint8_t *bytes = source;
+
+	/* Unlike the descriptor, the header is little endian binary. */
+	if (le32dec(bytes + MAGIC_OFFSET) != VMDK_SPARSE_MAGIC) {
+		return ERROR(LDI_ERR_PARSEERROR);
+	}
+
+	*header = malloc(sizeof(struct vmdksparseheader));
+	if (*header == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+
+	(*header)->version = le32dec(bytes + VERSION_OFFSET);
+	(*header)->flags = le32dec(bytes + FLAGS_OFFSET);
+	(*header)->capacity = le64dec(bytes + CAPACITY_OFFSET);
+	(*header)->grain_size = le64dec(bytes + GRAIN_SIZE_OFFSET);
+	(*header)->descriptor_offset = le64dec(bytes + DESCRIPTOR_OFFSET_OFFSET);
+	(*header)->descriptor_size = le64dec(bytes + DESCRIPTOR_SIZE_OFFSET);
+	(*header)->num_gtes_per_gt = le32dec(bytes + NUM_GTES_PER_GT_OFFSET);
+	(*header)->rgd_offset = le64dec(bytes + RGD_OFFSET_OFFSET);
+	(*header)->gd_offset = le64dec(bytes + GD_OFFSET_OFFSET);
+	(*header)->overhead = le64dec(bytes + OVERHEAD_OFFSET);
+	(*header)->unclean_shutdown = bytes[UNCLEAN_SHUTDOWN_OFFSET] != 0;
+	(*header)->compress_algorithm = le16dec(bytes + COMPRESS_ALGORITHM_OFFSET);
+
+	return NO_ERROR;
+}
+
+/*
+ * Writes the header to the destination buffer.
+ */
+void
+vmdksparseheader_write(struct vmdksparseheader *header, void *dest)
+{
+	uint8_t *bytes = dest;
+
+	bzero(bytes, VMDK_SPARSE_HEADER_SIZE);
+
+	le32enc(bytes + MAGIC_OFFSET, VMDK_SPARSE_MAGIC);
+	le32enc(bytes + VERSION_OFFSET, header->version);
+	le32enc(bytes + FLAGS_OFFSET, header->flags);
+	le64enc(bytes + CAPACITY_OFFSET, header->capacity);
+	le64enc(bytes + GRAIN_SIZE_OFFSET, header->grain_size);
+	le64enc(bytes + DESCRIPTOR_OFFSET_OFFSET, header->descriptor_offset);
+	le64enc(bytes + DESCRIPTOR_SIZE_OFFSET, header->descriptor_size);
+	le32enc(bytes + NUM_GTES_PER_GT_OFFSET, header->num_gtes_per_gt);
+	le64enc(bytes + RGD_OFFSET_OFFSET, header->rgd_offset);
+	le64enc(bytes + GD_OFFSET_OFFSET, header->gd_offset);
+	le64enc(bytes + OVERHEAD_OFFSET, header->overhead);
+	bytes[UNCLEAN_SHUTDOWN_OFFSET] = header->unclean_shutdown;
+	/* Lets readers detect files damaged by newline conversion. */
+	bytes[SINGLE_END_LINE_CHAR_OFFSET] = '\n';
+	bytes[NON_END_LINE_CHAR_OFFSET] = ' ';
+	bytes[DOUBLE_END_LINE_CHAR1_OFFSET] = '\r';
+	bytes[DOUBLE_END_LINE_CHAR2_OFFSET] = '\n';
+	le16enc(bytes + COMPRESS_ALGORITHM_OFFSET, header->compress_algorithm);
+}
+
+/*
+ * Frees memory and zeros the header.
+ */
+void
+vmdksparseheader_destroy(struct vmdksparseheader **header)
+{
+	free(*header);
+	*header = NULL;
+}
@@ -0,0 +1,73 @@
+#ifndef _VMDKSPARSEHEADER_H_
+#define _VMDKSPARSEHEADER_H_
+
+#include <sys/types.h>
+#include <stdbool.h>
+
+#include "diskimage.h"
+
+/* The magic number of hosted sparse extents, "KDMV" in the file. */
+#define VMDK_SPARSE_MAGIC 0x564d444b
+
+/* The size of the header in the file. */
+#define VMDK_SPARSE_HEADER_SIZE 512
+
+/* Flags in the header. */
+#define VMDK_FLAG_VALID_NEWLINE_TEST 0x1
+#define VMDK_FLAG_REDUNDANT_GRAIN_TABLE 0x2
+#define VMDK_FLAG_COMPRESSED 0x10000
+#define VMDK_FLAG_MARKERS 0x20000
+
+/* The grain directory offset of extents that have it in the footer. */
+#define VMDK_GD_AT_END 0xffffffffffffffffULL
+
+/*
+ * The parsed form of the header of a hosted sparse extent. All offsets
+ * and sizes are in sectors.
+ */
+struct vmdksparseheader {
+	uint32_t version;
+	uint32_t flags;
+	/* The number of sectors in the extent. */
+	uint64_t capacity;
+	/* The number of sectors in each grain. */
+	uint64_t grain_size;
+	/* The location of the embedded descriptor, if any. */
+	uint64_t descriptor_offset;
+	uint64_t descriptor_size;
+	/* The number of entries in each grain table. */
+	uint32_t num_gtes_per_gt;
+	/* The redundant grain directory. */
+	uint64_t rgd_offset;
+	/* The grain directory. */
+	uint64_t gd_offset;
+	/* The number of sectors used by metadata before the first grain. */
+	uint64_t overhead;
+	bool	unclean_shutdown;
+	uint16_t compress_algorithm;
+};
+
+/*
+ * Returns true if source, which must hold 4 bytes, starts a hosted sparse
+ * extent.
+ */
+bool	vmdksparseheader_magic_valid(void *source);
+
+/*
+ * Creates a new header by reading it from source. Fails if source is not
+ * the header of a hosted sparse extent.
+ */
+LDI_ERROR vmdksparseheader_new(void *source, struct vmdksparseheader **header);
+
+/*
+ * Writes the header to the destination buffer, which must hold
+ * VMDK_SPARSE_HEADER_SIZE bytes.
+ */
+void	vmdksparseheader_write(struct vmdksparseheader *header, void *dest);
+
+/*
+ * Frees memory and zeros the header.
+ */
+void	vmdksparseheader_destroy(struct vmdksparseheader **header);
+
+#endif					/* _VMDKSPARSEHEADER_H_ */
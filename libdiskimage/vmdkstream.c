@@ -0,0 +1,610 @@
+
+#include <sys/param.h>
+#include <sys/endian.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "blockcache.h"
+#include "diskimage.h"
+#include "fileinterface.h"
+#include "internal.h"
+#include "log.h"
+#include "taskpool.h"
+#include "vmdksparseheader.h"
+#include "vmdkstream.h"
+
+#define SECTOR_SIZE 512
+
+/* The only compression algorithm, deflate in the zlib format. */
+#define COMPRESSION_DEFLATE 1
+
+/* The types of the markers that are not followed by a grain. */
+#define MARKER_EOS 0
+#define MARKER_GT 1
+#define MARKER_GD 2
+#define MARKER_FOOTER 3
+
+/* The size of the start of a marker that is read to find its type. */
+#define MARKER_SIZE 16
+
+/* The number of bytes before the compressed data of a grain. */
+#define GRAIN_MARKER_SIZE 12
+
+/*
+ * The number of inflated grains that are kept in memory, 16 MB with the
+ * usual 64 KB grains.
+ */
+#define GRAIN_CACHE_SIZE 256
+
+/* Reads that inflate at least this many grains use worker threads. */
+#define PARALLEL_GRAINS 4
+
+/* The number of threads inflating grains in addition to the caller. */
+#define INFLATE_WORKERS 3
+
+/*
+ * The layout of index files: a magic string, the size of the extent, the
+ * number of grains and the end of the extent, which has the footer, and
+ * then an entry for each grain.
+ */
+#define INDEX_MAGIC "ldgrains"
+#define INDEX_TAIL_SIZE 1024
+#define INDEX_HEADER_SIZE (8 + 8 + 8 + INDEX_TAIL_SIZE)
+#define INDEX_ENTRY_SIZE (8 + 8 + 4)
+
+/*
+ * Where a grain is stored in the stream.
+ */
+struct grain {
+	/* The number of the grain on the disk. */
+	uint64_t grain;
+	/* The offset of the grain marker in the file. */
+	uint64_t offset;
+	/* The number of bytes of compressed data. */
+	uint32_t size;
+};
+
+struct vmdkstream {
+	/* The file with the extent. */
+	struct file *file;
+	/* The header at the start of the extent. */
+	struct vmdksparseheader *header;
+	/* The number of bytes in each grain. */
+	size_t	grain_bytes;
+	/* The grains in the stream, sorted by grain number. */
+	struct grain *grains;
+	size_t	count;
+	/* The most recently read grains, inflated. */
+	struct blockcache *cache;
+	/* Used for logging. */
+	struct logger logger;
+};
+
+/*
+ * A grain to inflate, and the part of it that is read.
+ */
+struct inflate_task {
+	struct grain *grain;
+	char   *dest;
+	size_t	offset;
+	size_t	length;
+};
+
+/*
+ * The grains that a read has to inflate, shared by the threads that do
+ * it.
+ */
+struct inflate_job {
+	struct vmdkstream *stream;
+	struct inflate_task *tasks;
+	size_t	ntasks;
+};
+
+/*
+ * Orders grains by grain number, and grains with the same number by their
+ * position in the stream.
+ */
+static int
+compare_grains(const void *a, const void *b)
+{
+	const struct grain *first = a, *second = b;
+
+	if (first->grain != second->grain)
+		return first->grain < second->grain ? -1 : 1;
+	if (first->offset != second->offset)
+		return first->offset < second->offset ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Adds a grain to the end of the grains of the stream.
+ */
+static LDI_ERROR
+add_grain(struct vmdkstream *stream, size_t *capacity, uint64_t grain, uint64_t offset, uint32_t size)
+{
+	struct grain *grains;
+
+	if (stream->count == *capacity) {
+		*capacity = MAX(*capacity * 2, 1024);
+		grains = realloc(stream->grains, *capacity * sizeof(struct grain));
+		if (grains == NULL) {
+			return ERROR(LDI_ERR_NOMEM);
+		}
+		stream->grains = grains;
+	}
+
+	stream->grains[stream->count].grain = grain;
+	stream->grains[stream->count].offset = offset;
+	stream->grains[stream->count].size = size;
+	stream->count++;
+
+	return NO_ERROR;
+}
+
+/*
+ * Walks the markers from the start of the stream to the end-of-stream
+ * marker and builds the sorted index of the grains. A grain that is in the
+ * stream more than once is read from the last copy.
+ */
+static LDI_ERROR
+walk_markers(struct vmdkstream *stream, size_t filesize)
+{
+	uint8_t marker[MARKER_SIZE];
+	uint64_t value, pos;
+	uint32_t size;
+	size_t capacity, i, j;
+	LDI_ERROR result;
+
+	capacity = 0;
+	pos = stream->header->overhead * SECTOR_SIZE;
+	for (;;) {
+		if (pos + SECTOR_SIZE > filesize) {
+			LOG_ERROR(stream->logger, "The stream has no end-of-stream marker.\n");
+			return ERROR(LDI_ERR_PARSEERROR);
+		}
+		result = file_read(stream->file, marker, sizeof(marker), pos, stream->logger);
+		if (IS_ERROR(result)) {
+			return result;
+		}
+		value = le64dec(marker);
+		size = le32dec(marker + 8);
+
+		if (size != 0) {
+			/* A grain marker, where value is the first sector. */
+			if (value % stream->header->grain_size != 0 ||
+			    value >= stream->header->capacity ||
+			    GRAIN_MARKER_SIZE + (uint64_t)size > filesize - pos) {
+				LOG_ERROR(stream->logger, "Invalid grain marker at %ju.\n", (uintmax_t)pos);
+				return ERROR(LDI_ERR_PARSEERROR);
+			}
+			result = add_grain(stream, &capacity,
+			    value / stream->header->grain_size, pos, size);
+			if (IS_ERROR(result)) {
+				return result;
+			}
+			pos += roundup(GRAIN_MARKER_SIZE + (uint64_t)size, SECTOR_SIZE);
+			continue;
+		}
+
+		if (le32dec(marker + 12) == MARKER_EOS) {
+			break;
+		}
+		/* Other markers are followed by value sectors of metadata. */
+		pos += SECTOR_SIZE + value * SECTOR_SIZE;
+	}
+
+	qsort(stream->grains, stream->count, sizeof(struct grain), compare_grains);
+	for (i = 0, j = 0; i < stream->count; i++) {
+		if (j > 0 && stream->grains[j - 1].grain == stream->grains[i].grain) {
+			stream->grains[j - 1] = stream->grains[i];
+		} else {
+			stream->grains[j++] = stream->grains[i];
+		}
+	}
+	stream->count = j;
+
+	return NO_ERROR;
+}
+
+/*
+ * Reads the end of the extent, which identifies it in the index file.
+ */
+static LDI_ERROR
+read_tail(struct vmdkstream *stream, size_t filesize, uint8_t *tail)
+{
+	size_t length;
+
+	length = MIN(filesize, INDEX_TAIL_SIZE);
+	memset(tail, 0, INDEX_TAIL_SIZE);
+
+	return file_read(stream->file, tail, length, filesize - length, stream->logger);
+}
+
+/*
+ * Loads the grains from the index file at path. Returns false if there is
+ * no index file, or if it was saved for another extent.
+ */
+static bool
+load_index(struct fileinterface *fi, struct vmdkstream *stream, char *path, size_t filesize, uint8_t *tail)
+{
+	struct file *file;
+	uint8_t header[INDEX_HEADER_SIZE];
+	uint8_t *entries, *entry;
+	uint64_t count, num_grains;
+	size_t size, i;
+	LDI_ERROR result;
+
+	if (IS_ERROR(file_open_readonly(fi, path, &file))) {
+		return false;
+	}
+
+	result = file_getsize(file, &size);
+	if (IS_ERROR(result) || size < INDEX_HEADER_SIZE) {
+		file_close(&file);
+		return false;
+	}
+	result = file_read(file, header, sizeof(header), 0, stream->logger);
+	count = be64dec(header + 16);
+	if (IS_ERROR(result) ||
+	    memcmp(header, INDEX_MAGIC, 8) != 0 ||
+	    be64dec(header + 8) != filesize ||
+	    memcmp(header + 24, tail, INDEX_TAIL_SIZE) != 0 ||
+	    count > (size - INDEX_HEADER_SIZE) / INDEX_ENTRY_SIZE ||
+	    size != INDEX_HEADER_SIZE + count * INDEX_ENTRY_SIZE) {
+		file_close(&file);
+		return false;
+	}
+
+	entries = malloc(MAX(count * INDEX_ENTRY_SIZE, 1));
+	stream->grains = malloc(MAX(count * sizeof(struct grain), 1));
+	if (entries == NULL || stream->grains == NULL) {
+		free(entries);
+		file_close(&file);
+		return false;
+	}
+	result = file_read(file, entries, count * INDEX_ENTRY_SIZE, INDEX_HEADER_SIZE, stream->logger);
+	file_close(&file);
+	if (IS_ERROR(result)) {
+		free(entries);
+		return false;
+	}
+
+	/* The entries must be sorted, and point into the extent. */
+	num_grains = howmany(stream->header->capacity, stream->header->grain_size);
+	for (i = 0; i < count; i++) {
+		entry = entries + i * INDEX_ENTRY_SIZE;
+		stream->grains[i].grain = be64dec(entry);
+		stream->grains[i].offset = be64dec(entry + 8);
+		stream->grains[i].size = be32dec(entry + 16);
+		if ((i > 0 && stream->grains[i].grain <= stream->grains[i - 1].grain) ||
+		    stream->grains[i].grain >= num_grains ||
+		    stream->grains[i].offset + GRAIN_MARKER_SIZE + stream->grains[i].size > filesize) {
+			free(entries);
+			return false;
+		}
+	}
+	free(entries);
+	stream->count = count;
+
+	return true;
+}
+
+/*
+ * Saves the grains to the index file at path.
+ */
+static LDI_ERROR
+save_index(struct fileinterface *fi, struct vmdkstream *stream, char *path, size_t filesize, uint8_t *tail)
+{
+	struct file *file;
+	uint8_t *buffer, *entry;
+	size_t size, i;
+	LDI_ERROR result;
+
+	size = INDEX_HEADER_SIZE + stream->count * INDEX_ENTRY_SIZE;
+	buffer = malloc(size);
+	if (buffer == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+
+	memcpy(buffer, INDEX_MAGIC, 8);
+	be64enc(buffer + 8, filesize);
+	be64enc(buffer + 16, stream->count);
+	memcpy(buffer + 24, tail, INDEX_TAIL_SIZE);
+	for (i = 0; i < stream->count; i++) {
+		entry = buffer + INDEX_HEADER_SIZE + i * INDEX_ENTRY_SIZE;
+		be64enc(entry, stream->grains[i].grain);
+		be64enc(entry + 8, stream->grains[i].offset);
+		be32enc(entry + 16, stream->grains[i].size);
+	}
+
+	result = file_create(fi, path, &file);
+	if (IS_ERROR(result)) {
+		free(buffer);
+		return result;
+	}
+	result = file_setsize(file, size);
+	if (!IS_ERROR(result)) {
+		result = file_write(file, buffer, size, 0, stream->logger);
+	}
+	if (!IS_ERROR(result)) {
+		result = file_sync(file);
+	}
+	file_close(&file);
+	free(buffer);
+	if (IS_ERROR(result)) {
+		/* A partial index would be rejected, but don't leave it. */
+		file_remove(fi, path);
+	}
+
+	return result;
+}
+
+/*
+ * Loads the index of the grains, or builds and saves it if there is no
+ * valid index file.
+ */
+static LDI_ERROR
+read_index(struct fileinterface *fi, struct vmdkstream *stream)
+{
+	uint8_t tail[INDEX_TAIL_SIZE];
+	char *path;
+	size_t filesize;
+	LDI_ERROR result;
+
+	result = file_getsize(stream->file, &filesize);
+	if (!IS_ERROR(result)) {
+		result = read_tail(stream, filesize, tail);
+	}
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	if (asprintf(&path, "%s.index", file_getpath(stream->file)) == -1) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+
+	if (load_index(fi, stream, path, filesize, tail)) {
+		LOG_VERBOSE(stream->logger, "Loaded the grain index from %s.\n", path);
+		free(path);
+		return NO_ERROR;
+	}
+	free(stream->grains);
+	stream->grains = NULL;
+	stream->count = 0;
+
+	result = walk_markers(stream, filesize);
+	if (IS_ERROR(result)) {
+		free(path);
+		return result;
+	}
+	if (IS_ERROR(save_index(fi, stream, path, filesize, tail))) {
+		/* The extent can still be read, the next open walks again. */
+		LOG_WARNING(stream->logger, "Failed to save the grain index to %s.\n", path);
+	}
+	free(path);
+
+	return NO_ERROR;
+}
+
+/*
+ * Opens the stream optimized extent in file.
+ */
+LDI_ERROR
+vmdkstream_open(struct fileinterface *fi, struct file *file, struct vmdkstream **stream, struct logger logger)
+{
+	char buffer[VMDK_SPARSE_HEADER_SIZE];
+	LDI_ERROR result;
+
+	result = file_read(file, buffer, sizeof(buffer), 0, logger);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+
+	*stream = calloc(1, sizeof(struct vmdkstream));
+	if (*stream == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+	(*stream)->file = file;
+	(*stream)->logger = logger;
+
+	result = vmdksparseheader_new(buffer, &(*stream)->header);
+	if (IS_ERROR(result)) {
+		LOG_ERROR(logger, "The extent is not a stream optimized extent.\n");
+		vmdkstream_destroy(stream);
+		return result;
+	}
+	if (((*stream)->header->flags & VMDK_FLAG_MARKERS) == 0 ||
+	    (*stream)->header->compress_algorithm != COMPRESSION_DEFLATE) {
+		LOG_ERROR(logger, "The extent is not compressed with markers.\n");
+		vmdkstream_destroy(stream);
+		return ERROR(LDI_ERR_FILENOTSUP);
+	}
+	if ((*stream)->header->grain_size == 0 ||
+	    !powerof2((*stream)->header->grain_size)) {
+		LOG_ERROR(logger, "The stream optimized extent header is invalid.\n");
+		vmdkstream_destroy(stream);
+		return ERROR(LDI_ERR_PARSEERROR);
+	}
+	(*stream)->grain_bytes = (*stream)->header->grain_size * SECTOR_SIZE;
+
+	result = read_index(fi, *stream);
+	if (!IS_ERROR(result)) {
+		result = blockcache_create(GRAIN_CACHE_SIZE, &(*stream)->cache);
+	}
+	if (IS_ERROR(result)) {
+		vmdkstream_destroy(stream);
+		return result;
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * Frees the extent and sets the pointer to NULL.
+ */
+void
+vmdkstream_destroy(struct vmdkstream **stream)
+{
+	if ((*stream)->cache != NULL) {
+		blockcache_destroy(&(*stream)->cache);
+	}
+	if ((*stream)->header != NULL) {
+		vmdksparseheader_destroy(&(*stream)->header);
+	}
+	free((*stream)->grains);
+	free(*stream);
+	*stream = NULL;
+}
+
+/*
+ * Returns the index of the first grain in the stream with a number that
+ * is at least grain.
+ */
+static size_t
+find_grain(struct vmdkstream *stream, uint64_t grain)
+{
+	size_t low, high, middle;
+
+	low = 0;
+	high = stream->count;
+	while (low < high) {
+		middle = low + (high - low) / 2;
+		if (stream->grains[middle].grain < grain)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	return low;
+}
+
+/*
+ * Reads and inflates a grain into a new buffer of grain_bytes bytes.
+ */
+static LDI_ERROR
+inflate_grain(struct vmdkstream *stream, struct grain *grain, char **data)
+{
+	char *compressed;
+	uLongf length;
+	int error;
+	LDI_ERROR result;
+
+	compressed = malloc(GRAIN_MARKER_SIZE + (size_t)grain->size);
+	*data = malloc(stream->grain_bytes);
+	if (compressed == NULL || *data == NULL) {
+		free(compressed);
+		free(*data);
+		return ERROR(LDI_ERR_NOMEM);
+	}
+
+	result = file_read(stream->file, compressed, GRAIN_MARKER_SIZE + (size_t)grain->size,
+	    grain->offset, stream->logger);
+	if (IS_ERROR(result)) {
+		free(compressed);
+		free(*data);
+		return result;
+	}
+
+	length = stream->grain_bytes;
+	error = uncompress((Bytef *)*data, &length,
+	    (Bytef *)compressed + GRAIN_MARKER_SIZE, grain->size);
+	free(compressed);
+	if (error != Z_OK) {
+		LOG_ERROR(stream->logger, "Failed to inflate the grain at %ju.\n", (uintmax_t)grain->offset);
+		free(*data);
+		return ERROR(LDI_ERR_PARSEERROR);
+	}
+
+	/* The last grain of the disk may be short. */
+	memset(*data + length, 0, stream->grain_bytes - length);
+
+	return NO_ERROR;
+}
+
+/*
+ * Inflates the grain of a task of the job into the cache.
+ */
+static LDI_ERROR
+inflate_grain_task(void *arg, size_t index, char *buffer)
+{
+	struct inflate_job *job = arg;
+	struct vmdkstream *stream = job->stream;
+	struct inflate_task *task = &job->tasks[index];
+	char *data;
+	LDI_ERROR result;
+
+	result = inflate_grain(stream, task->grain, &data);
+	if (IS_ERROR(result)) {
+		return result;
+	}
+	memcpy(task->dest, data + task->offset, task->length);
+
+	/* The cache takes over the grain. */
+	blockcache_put(stream->cache, task->grain->grain, data, stream->grain_bytes);
+
+	return NO_ERROR;
+}
+
+/*
+ * Reads nbytes at offset in the extent into the buffer. Grains that are
+ * cached are copied right away, and the others are inflated afterwards.
+ */
+LDI_ERROR
+vmdkstream_read(struct vmdkstream *stream, char *buf, size_t nbytes, off_t offset)
+{
+	struct inflate_job job;
+	struct grain *grain;
+	uint64_t number, first, last;
+	size_t index, offset_in_grain, length;
+	LDI_ERROR result;
+
+	if (nbytes == 0) {
+		return NO_ERROR;
+	}
+
+	first = offset / stream->grain_bytes;
+	last = (offset + nbytes - 1) / stream->grain_bytes;
+	job.stream = stream;
+	job.ntasks = 0;
+	job.tasks = malloc((last - first + 1) * sizeof(struct inflate_task));
+	if (job.tasks == NULL) {
+		return ERROR(LDI_ERR_NOMEM);
+	}
+
+	index = find_grain(stream, first);
+	for (number = first; number <= last; number++) {
+		offset_in_grain = offset % stream->grain_bytes;
+		length = MIN(stream->grain_bytes - offset_in_grain, nbytes);
+
+		/* The grains are sorted, so the index only moves forward. */
+		while (index < stream->count && stream->grains[index].grain < number) {
+			index++;
+		}
+		grain = index < stream->count && stream->grains[index].grain == number ?
+		    &stream->grains[index] : NULL;
+
+		if (grain == NULL) {
+			/* Grains that are not in the stream are zeros. */
+			memset(buf, 0, length);
+		} else if (!blockcache_get(stream->cache, number, buf, offset_in_grain, length)) {
+			job.tasks[job.ntasks].grain = grain;
+			job.tasks[job.ntasks].dest = buf;
+			job.tasks[job.ntasks].offset = offset_in_grain;
+			job.tasks[job.ntasks].length = length;
+			job.ntasks++;
+		}
+
+		buf += length;
+		offset += length;
+		nbytes -= length;
+	}
+
+	result = taskpool_run(job.ntasks, job.ntasks >= PARALLEL_GRAINS ? INFLATE_WORKERS : 0,
+	    0, inflate_grain_task, &job);
+	free(job.tasks);
+
+	return result;
+}
@@ -0,0 +1,37 @@
+#ifndef _VMDKSTREAM_H_
+#define _VMDKSTREAM_H_
+
+#include <sys/types.h>
+
+#include "diskimage.h"
+#include "fileinterface.h"
+
+/*
+ * A stream optimized extent, where each grain is compressed and stored
+ * after a marker with its location on the disk. The markers are walked
+ * once to build an index of the grains, which is saved next to the
+ * extent so that later opens can load it instead.
+ */
+struct vmdkstream;
+
+/*
+ * Opens the stream optimized extent in file. The index is loaded from
+ * the file path with ".index" appended if it belongs to the extent, and
+ * otherwise built and saved there. Failing to save the index is not an
+ * error. The file must stay open until the extent is destroyed.
+ */
+LDI_ERROR vmdkstream_open(struct fileinterface *fi, struct file *file, struct vmdkstream **stream, struct logger logger);
+
+/*
+ * Frees the extent and sets the pointer to NULL. Does not close the file.
+ */
+void	vmdkstream_destroy(struct vmdkstream **stream);
+
+/*
+ * Reads nbytes at offset in the extent into the buffer. Grains that are
+ * not in the stream read as zeros. Reads of many grains inflate them on
+ * several threads.
+ */
+LDI_ERROR vmdkstream_read(struct vmdkstream *stream, char *buf, size_t nbytes, off_t offset);
+
+#endif					/* _VMDKSTREAM_H_ */
@@ -0,0 +1,292 @@
+
+#include <atf-c.h>
+
+#include <sys/file.h>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Include the source files to test. */
+#include "blockcache.c"
+#include "bouncepool.c"
+#include "dedupimage.c"
+#include "dedupstore.c"
+#include "filemap.c"
+#include "fileinterface.c"
+#include "kernels.c"
+
+void empty_log_write(int level, void *privarg, char *fmt, ...) { }
+
+struct logger empty_logger = {
+    .write = empty_log_write
+};
+
+#define TEST_BLOCK_SIZE DEDUPSTORE_BLOCK_SIZE
+#define TEST_DISK_SIZE (16 * TEST_BLOCK_SIZE)
+
+/*
+ * Creates a directory for the images and the store, and the paths of
+ * two images in it.
+ */
+static void
+create_testdir(char *directory, char *a, char *b)
+{
+    strcpy(directory, "dedupimage_test.XXXXXX");
+    ATF_REQUIRE(mkdtemp(directory) != NULL);
+    sprintf(a, "%s/a.dedup", directory);
+    sprintf(b, "%s/b.dedup", directory);
+}
+
+/*
+ * Removes the images, the store and the directory.
+ */
+static void
+remove_testdir(char *directory, char *a, char *b)
+{
+    char store[128];
+
+    sprintf(store, "%s/%s", directory, DEDUPIMAGE_STORE_NAME);
+    unlink(a);
+    unlink(b);
+    unlink(store);
+    rmdir(directory);
+}
+
+/*
+ * Creates and opens a new image at path.
+ */
+static struct dedupimage *
+open_new(struct fileinterface *fi, char *path)
+{
+    struct diskimage_options options;
+    struct dedupimage *image;
+
+    bzero(&options, sizeof(options));
+    ATF_REQUIRE(!IS_ERROR(dedupimage_create(fi, path, TEST_DISK_SIZE, empty_logger)));
+    ATF_REQUIRE(!IS_ERROR(dedupimage_open(fi, path, options, &image, empty_logger)));
+
+    return image;
+}
+
+/*
+ * Fills a block with data that depends on value.
+ */
+static void
+fill_block(char *block, int value)
+{
+    int i;
+
+    for (i = 0; i < TEST_BLOCK_SIZE; i++) {
+        block[i] = value + i / 512;
+    }
+}
+
+/*
+ * Returns the number of blocks of the store that are used.
+ */
+static uint64_t
+used_blocks(struct dedupstore *store)
+{
+    return store->chunk_count - store->nfree;
+}
+
+ATF_TC_WITHOUT_HEAD(dedupimage_write__shares_blocks_with_the_same_data);
+ATF_TC_BODY(dedupimage_write__shares_blocks_with_the_same_data, tc)
+{
+    struct fileinterface *fi;
+    struct dedupimage *a, *b;
+    struct diskstats stats;
+    char directory[64], path_a[128], path_b[128];
+    char block[TEST_BLOCK_SIZE], read[TEST_BLOCK_SIZE];
+
+    create_testdir(directory, path_a, path_b);
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(LDI_CACHE_WRITEBACK, &fi)));
+    a = open_new(fi, path_a);
+    b = open_new(fi, path_b);
+
+    /* Both images use the same store. */
+    ATF_CHECK_EQ(a->store, b->store);
+
+    fill_block(block, 1);
+    ATF_REQUIRE(!IS_ERROR(dedupimage_write(a, block, TEST_BLOCK_SIZE, 0)));
+    ATF_REQUIRE(!IS_ERROR(dedupimage_write(b, block, TEST_BLOCK_SIZE, 3 * TEST_BLOCK_SIZE)));
+    ATF_CHECK_EQ(1, used_blocks(a->store));
+    ATF_CHECK_EQ(a->map[0], b->map[3]);
+
+    bzero(&stats, sizeof(stats));
+    dedupimage_stats(b, &stats);
+    ATF_CHECK_EQ(1, stats.deduplicated_blocks);
+
+    /* Blocks with other data get blocks of their own. */
+    fill_block(block, 2);
+    ATF_REQUIRE(!IS_ERROR(dedupimage_write(b, block, TEST_BLOCK_SIZE, 4 * TEST_BLOCK_SIZE)));
+    ATF_CHECK_EQ(2, used_blocks(a->store));
+
+    /* Blocks of zeros are not stored. */
+    bzero(block, sizeof(block));
+    ATF_REQUIRE(!IS_ERROR(dedupimage_write(b, block, TEST_BLOCK_SIZE, 5 * TEST_BLOCK_SIZE)));
+    ATF_CHECK_EQ(0, b->map[5]);
+
+    fill_block(block, 1);
+    ATF_REQUIRE(!IS_ERROR(dedupimage_read(b, read, TEST_BLOCK_SIZE, 3 * TEST_BLOCK_SIZE)));
+    ATF_CHECK(memcmp(block, read, TEST_BLOCK_SIZE) == 0);
+    fill_block(block, 2);
+    ATF_REQUIRE(!IS_ERROR(dedupimage_read(b, read, TEST_BLOCK_SIZE, 4 * TEST_BLOCK_SIZE)));
+    ATF_CHECK(memcmp(block, read, TEST_BLOCK_SIZE) == 0);
+
+    dedupimage_destroy(&a);
+    dedupimage_destroy(&b);
+    ATF_CHECK_EQ(NULL, stores);
+    fileinterface_destroy(&fi);
+    remove_testdir(directory, path_a, path_b);
+}
+
+ATF_TC_WITHOUT_HEAD(dedupimage_flush__releases_overwritten_blocks);
+ATF_TC_BODY(dedupimage_flush__releases_overwritten_blocks, tc)
+{
+    struct diskimage_options options;
+    struct fileinterface *fi;
+    struct dedupimage *a, *b;
+    char directory[64], path_a[128], path_b[128];
+    char block[TEST_BLOCK_SIZE], read[TEST_BLOCK_SIZE];
+    uint64_t first;
+
+    create_testdir(directory, path_a, path_b);
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(LDI_CACHE_WRITEBACK, &fi)));
+    a = open_new(fi, path_a);
+    b = open_new(fi, path_b);
+
+    fill_block(block, 1);
+    ATF_REQUIRE(!IS_ERROR(dedupimage_write(a, block, TEST_BLOCK_SIZE, 0)));
+    ATF_REQUIRE(!IS_ERROR(dedupimage_write(b, block, TEST_BLOCK_SIZE, 0)));
+    ATF_REQUIRE(!IS_ERROR(dedupimage_flush(a)));
+    ATF_REQUIRE(!IS_ERROR(dedupimage_flush(b)));
+    first = a->map[0] - 1;
+    ATF_CHECK_EQ(2, a->store->refcounts[first]);
+
+    /* The old block is only released by the flush. */
+    fill_block(block, 2);
+    ATF_REQUIRE(!IS_ERROR(dedupimage_write(a, block, TEST_BLOCK_SIZE, 0)));
+    ATF_CHECK_EQ(2, a->store->refcounts[first]);
+    ATF_REQUIRE(!IS_ERROR(dedupimage_flush(a)));
+    ATF_CHECK_EQ(1, a->store->refcounts[first]);
+
+    /* Once no image uses a block, it is reused. */
+    fill_block(block, 3);
+    ATF_REQUIRE(!IS_ERROR(dedupimage_write(b, block, TEST_BLOCK_SIZE, 0)));
+    ATF_REQUIRE(!IS_ERROR(dedupimage_flush(b)));
+    ATF_CHECK_EQ(0, a->store->refcounts[first]);
+    fill_block(block, 4);
+    ATF_REQUIRE(!IS_ERROR(dedupimage_write(b, block, TEST_BLOCK_SIZE, TEST_BLOCK_SIZE)));
+    ATF_CHECK_EQ(first + 1, b->map[1]);
+    dedupimage_destroy(&a);
+    dedupimage_destroy(&b);
+
+    /* The data and the references survive reopening. */
+    bzero(&options, sizeof(options));
+    ATF_REQUIRE(!IS_ERROR(dedupimage_open(fi, path_b, options, &b, empty_logger)));
+    ATF_REQUIRE(!IS_ERROR(dedupimage_read(b, read, TEST_BLOCK_SIZE, TEST_BLOCK_SIZE)));
+    ATF_CHECK(memcmp(block, read, TEST_BLOCK_SIZE) == 0);
+    ATF_CHECK_EQ(1, b->store->refcounts[first]);
+    ATF_CHECK_EQ(3, used_blocks(b->store));
+
+    dedupimage_destroy(&b);
+    fileinterface_destroy(&fi);
+    remove_testdir(directory, path_a, path_b);
+}
+
+ATF_TC_WITHOUT_HEAD(dedupimage_open__shares_the_store_across_cache_modes);
+ATF_TC_BODY(dedupimage_open__shares_the_store_across_cache_modes, tc)
+{
+    struct diskimage_options options;
+    struct fileinterface *fi;
+    struct dedupimage *a, *b;
+    char directory[64], path_a[128], path_b[128], store[128];
+    char block[TEST_BLOCK_SIZE];
+    int fd;
+
+    create_testdir(directory, path_a, path_b);
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(LDI_CACHE_WRITEBACK, &fi)));
+    a = open_new(fi, path_a);
+    ATF_REQUIRE(!IS_ERROR(dedupimage_create(fi, path_b, TEST_DISK_SIZE, empty_logger)));
+    bzero(&options, sizeof(options));
+    options.cache_mode = LDI_CACHE_UNSAFE;
+    ATF_REQUIRE(!IS_ERROR(dedupimage_open(fi, path_b, options, &b, empty_logger)));
+
+    /* There is one free list, so both images get different blocks. */
+    ATF_CHECK_EQ(a->store, b->store);
+    fill_block(block, 1);
+    ATF_REQUIRE(!IS_ERROR(dedupimage_write(a, block, TEST_BLOCK_SIZE, 0)));
+    fill_block(block, 2);
+    ATF_REQUIRE(!IS_ERROR(dedupimage_write(b, block, TEST_BLOCK_SIZE, 0)));
+    ATF_CHECK(a->map[0] != b->map[0]);
+
+    /* Other processes can't lock the store while it is open. */
+    sprintf(store, "%s/%s", directory, DEDUPIMAGE_STORE_NAME);
+    fd = open(store, O_RDWR);
+    ATF_REQUIRE(fd != -1);
+    ATF_CHECK_EQ(-1, flock(fd, LOCK_EX | LOCK_NB));
+    dedupimage_destroy(&a);
+    dedupimage_destroy(&b);
+    ATF_CHECK_EQ(0, flock(fd, LOCK_EX | LOCK_NB));
+
+    /* Nor can this one open it while another holds the lock. */
+    bzero(&options, sizeof(options));
+    ATF_CHECK(IS_ERROR(dedupimage_open(fi, path_a, options, &a, empty_logger)));
+    close(fd);
+
+    fileinterface_destroy(&fi);
+    remove_testdir(directory, path_a, path_b);
+}
+
+ATF_TC_WITHOUT_HEAD(dedupimage_discard__zeroes_whole_and_partial_blocks);
+ATF_TC_BODY(dedupimage_discard__zeroes_whole_and_partial_blocks, tc)
+{
+    struct fileinterface *fi;
+    struct dedupimage *a;
+    char directory[64], path_a[128], path_b[128];
+    char *data, *read;
+    size_t length;
+    bool allocated;
+
+    create_testdir(directory, path_a, path_b);
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(LDI_CACHE_WRITEBACK, &fi)));
+    a = open_new(fi, path_a);
+    data = malloc(TEST_DISK_SIZE);
+    read = malloc(TEST_DISK_SIZE);
+    ATF_REQUIRE(data != NULL && read != NULL);
+
+    /* Writes that are not aligned to blocks. */
+    memset(data, 0, TEST_DISK_SIZE);
+    memset(data + 1000, 7, 3 * TEST_BLOCK_SIZE);
+    ATF_REQUIRE(!IS_ERROR(dedupimage_write(a, data + 1000, 3 * TEST_BLOCK_SIZE, 1000)));
+    ATF_REQUIRE(!IS_ERROR(dedupimage_map(a, TEST_DISK_SIZE, 0, &allocated, &length)));
+    ATF_CHECK(allocated);
+    ATF_CHECK_EQ(4 * TEST_BLOCK_SIZE, length);
+
+    /* A discard of the second block and of part of the third. */
+    memset(data + TEST_BLOCK_SIZE, 0, TEST_BLOCK_SIZE + 10);
+    ATF_REQUIRE(!IS_ERROR(dedupimage_discard(a, TEST_BLOCK_SIZE + 10, TEST_BLOCK_SIZE)));
+    ATF_CHECK_EQ(0, a->map[1]);
+    ATF_CHECK(a->map[2] != 0);
+    ATF_REQUIRE(!IS_ERROR(dedupimage_read(a, read, TEST_DISK_SIZE, 0)));
+    ATF_CHECK(memcmp(data, read, TEST_DISK_SIZE) == 0);
+
+    free(data);
+    free(read);
+    dedupimage_destroy(&a);
+    fileinterface_destroy(&fi);
+    remove_testdir(directory, path_a, path_b);
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+    ATF_TP_ADD_TC(tp, dedupimage_write__shares_blocks_with_the_same_data);
+    ATF_TP_ADD_TC(tp, dedupimage_flush__releases_overwritten_blocks);
+    ATF_TP_ADD_TC(tp, dedupimage_open__shares_the_store_across_cache_modes);
+    ATF_TP_ADD_TC(tp, dedupimage_discard__zeroes_whole_and_partial_blocks);
+
+    return 0;
+}
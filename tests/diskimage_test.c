@@ -0,0 +1,216 @@
+#include <atf-c.h>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Include the source files to test. */
+#include "blockcache.c"
+#include "bouncepool.c"
+#include "filemap.c"
+#include "fileinterface.c"
+#include "diskimage.c"
+
+struct logger empty_logger = {
+    .write = empty_log_write
+};
+
+/*
+ * Parsers that recognize files starting with "alpha" and files ending with
+ * "beta".
+ */
+static bool
+alpha_probe(void *head, void *tail)
+{
+    return memcmp(head, "alpha", 5) == 0;
+}
+
+static bool
+beta_probe(void *head, void *tail)
+{
+    return memcmp((char *)tail + LDI_PROBE_SIZE - 4, "beta", 4) == 0;
+}
+
+static int test_state;
+
+static LDI_ERROR
+test_construct(struct fileinterface *fi, char *path, struct diskimage_options options, void **parser, struct logger logger)
+{
+    *parser = &test_state;
+    return NO_ERROR;
+}
+
+static void
+test_destructor(void **parser)
+{
+    *parser = NULL;
+}
+
+static struct diskinfo
+test_diskinfo(void *parser)
+{
+    struct diskinfo info;
+
+    bzero(&info, sizeof(info));
+    return info;
+}
+
+static struct ldi_parser alpha_parser = {
+    .name = "alpha",
+    .probe = alpha_probe,
+    .construct = test_construct,
+    .destructor = test_destructor,
+    .diskinfo = test_diskinfo,
+};
+PARSER_DEFINE(alpha_parser);
+
+static struct ldi_parser beta_parser = {
+    .name = "beta",
+    .probe = beta_probe,
+    .construct = test_construct,
+    .destructor = test_destructor,
+    .diskinfo = test_diskinfo,
+};
+PARSER_DEFINE(beta_parser);
+
+/* A parser that can't be recognized. */
+static struct ldi_parser delta_parser = {
+    .name = "delta",
+    .construct = test_construct,
+    .destructor = test_destructor,
+    .diskinfo = test_diskinfo,
+};
+PARSER_DEFINE(delta_parser);
+
+/*
+ * Writes a file of size bytes of zeros, with head at its start and tail
+ * at its end.
+ */
+static void
+write_file(char *path, size_t size, char *head, char *tail)
+{
+    char *data;
+    int fd;
+
+    data = calloc(1, size);
+    ATF_REQUIRE(data != NULL);
+    memcpy(data, head, strlen(head));
+    memcpy(data + size - strlen(tail), tail, strlen(tail));
+
+    strcpy(path, "diskimage_test.XXXXXX");
+    fd = mkstemp(path);
+    ATF_REQUIRE(fd != -1);
+    ATF_REQUIRE_EQ(size, write(fd, data, size));
+    close(fd);
+    free(data);
+}
+
+/*
+ * Returns the parser that probe_parser finds for the file, or NULL if it
+ * fails.
+ */
+static struct ldi_parser *
+probe_file(char *path)
+{
+    struct fileinterface *fi;
+    struct ldi_parser *parser;
+    LDI_ERROR result;
+
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(LDI_CACHE_WRITEBACK, &fi)));
+    result = probe_parser(fi, path, &parser, empty_logger);
+    fileinterface_destroy(&fi);
+
+    return IS_ERROR(result) ? NULL : parser;
+}
+
+ATF_TC_WITHOUT_HEAD(probe_parser__finds_the_only_matching_parser);
+ATF_TC_BODY(probe_parser__finds_the_only_matching_parser, tc)
+{
+    char path[64];
+
+    write_file(path, 4 * LDI_PROBE_SIZE, "alpha", "");
+    ATF_CHECK_EQ(&alpha_parser, probe_file(path));
+    unlink(path);
+
+    write_file(path, 4 * LDI_PROBE_SIZE, "", "beta");
+    ATF_CHECK_EQ(&beta_parser, probe_file(path));
+    unlink(path);
+}
+
+ATF_TC_WITHOUT_HEAD(probe_parser__reads_the_tail_of_short_files);
+ATF_TC_BODY(probe_parser__reads_the_tail_of_short_files, tc)
+{
+    char path[64];
+
+    /* The whole file is both the head and the tail. */
+    write_file(path, 100, "", "beta");
+    ATF_CHECK_EQ(&beta_parser, probe_file(path));
+    unlink(path);
+}
+
+ATF_TC_WITHOUT_HEAD(probe_parser__fails_without_a_matching_parser);
+ATF_TC_BODY(probe_parser__fails_without_a_matching_parser, tc)
+{
+    char path[64];
+
+    write_file(path, 4 * LDI_PROBE_SIZE, "delta", "");
+    ATF_CHECK(probe_file(path) == NULL);
+    unlink(path);
+
+    /* The magic of a format in the wrong place. */
+    write_file(path, 4 * LDI_PROBE_SIZE, "beta", "alpha");
+    ATF_CHECK(probe_file(path) == NULL);
+    unlink(path);
+}
+
+ATF_TC_WITHOUT_HEAD(probe_parser__fails_if_several_parsers_match);
+ATF_TC_BODY(probe_parser__fails_if_several_parsers_match, tc)
+{
+    char path[64];
+
+    write_file(path, 4 * LDI_PROBE_SIZE, "alpha", "beta");
+    ATF_CHECK(probe_file(path) == NULL);
+    unlink(path);
+
+    write_file(path, 100, "alpha", "beta");
+    ATF_CHECK(probe_file(path) == NULL);
+    unlink(path);
+}
+
+ATF_TC_WITHOUT_HEAD(diskimage_open__probes_the_auto_format);
+ATF_TC_BODY(diskimage_open__probes_the_auto_format, tc)
+{
+    struct diskimage *di;
+    char path[64];
+
+    write_file(path, 4 * LDI_PROBE_SIZE, "alpha", "");
+    ATF_REQUIRE(!IS_ERROR(diskimage_open(path, LDI_FORMAT_AUTO, empty_logger, &di)));
+    ATF_CHECK_EQ(&alpha_parser, di->parser);
+    diskimage_destroy(&di);
+
+    /* Only files of other formats are probed. */
+    ATF_REQUIRE(!IS_ERROR(diskimage_open(path, "delta", empty_logger, &di)));
+    ATF_CHECK_EQ(&delta_parser, di->parser);
+    diskimage_destroy(&di);
+    unlink(path);
+
+    write_file(path, 4 * LDI_PROBE_SIZE, "delta", "");
+    ATF_CHECK(IS_ERROR(diskimage_open(path, LDI_FORMAT_AUTO, empty_logger, &di)));
+    unlink(path);
+
+    write_file(path, 4 * LDI_PROBE_SIZE, "alpha", "beta");
+    ATF_CHECK(IS_ERROR(diskimage_open(path, LDI_FORMAT_AUTO, empty_logger, &di)));
+    unlink(path);
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+    ATF_TP_ADD_TC(tp, probe_parser__finds_the_only_matching_parser);
+    ATF_TP_ADD_TC(tp, probe_parser__reads_the_tail_of_short_files);
+    ATF_TP_ADD_TC(tp, probe_parser__fails_without_a_matching_parser);
+    ATF_TP_ADD_TC(tp, probe_parser__fails_if_several_parsers_match);
+    ATF_TP_ADD_TC(tp, diskimage_open__probes_the_auto_format);
+
+    return 0;
+}
@@ -0,0 +1,310 @@
+
+#include <atf-c.h>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Include the source files to test. */
+#include "blockcache.c"
+#include "bouncepool.c"
+#include "filemap.c"
+#include "fileinterface.c"
+
+void empty_log_write(int level, void *privarg, char *fmt, ...) { }
+
+struct logger empty_logger = {
+    .write = empty_log_write
+};
+
+/*
+ * Creates a temporary file with size bytes of known data, and opens it
+ * through a file interface with the given cache mode.
+ */
+static void
+open_testfile(enum diskimage_cache_mode cache_mode, size_t size, char *path,
+    struct fileinterface **fi, struct file **f)
+{
+    char data[size];
+    size_t i;
+    int fd;
+
+    for (i = 0; i < size; i++) {
+        data[i] = (char)(i * 7 + 1);
+    }
+
+    strcpy(path, "fileinterface_test.XXXXXX");
+    fd = mkstemp(path);
+    ATF_REQUIRE(fd != -1);
+    ATF_REQUIRE_EQ(size, write(fd, data, size));
+    close(fd);
+
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(cache_mode, fi)));
+    ATF_REQUIRE(!IS_ERROR(file_open(*fi, path, f)));
+}
+
+ATF_TC_WITHOUT_HEAD(file_read__handles_unaligned_direct_reads);
+ATF_TC_BODY(file_read__handles_unaligned_direct_reads, tc)
+{
+    struct fileinterface *fi;
+    struct file *f;
+    char path[64];
+    char *buffer;
+    size_t size = 3 * DIRECT_ALIGNMENT + 100;
+    off_t offset;
+    size_t i;
+
+    open_testfile(LDI_CACHE_NONE, size, path, &fi, &f);
+    buffer = malloc(size + 1);
+
+    /* Read unaligned ranges into an unaligned buffer. */
+    for (offset = 0; offset < size; offset += 511) {
+        ATF_REQUIRE(!IS_ERROR(file_read(f, buffer + 1, size - offset, offset, empty_logger)));
+        for (i = 0; i < size - offset; i++) {
+            ATF_REQUIRE_EQ((char)((offset + i) * 7 + 1), buffer[i + 1]);
+        }
+    }
+
+    /* Reading past the end of the file is an error. */
+    ATF_CHECK(IS_ERROR(file_read(f, buffer, 200, size - 100, empty_logger)));
+
+    free(buffer);
+    file_close(&f);
+    fileinterface_destroy(&fi);
+    unlink(path);
+}
+
+ATF_TC_WITHOUT_HEAD(file_write__handles_unaligned_direct_writes);
+ATF_TC_BODY(file_write__handles_unaligned_direct_writes, tc)
+{
+    struct fileinterface *fi;
+    struct file *f;
+    char path[64];
+    char buffer[300];
+    char result[2 * DIRECT_ALIGNMENT];
+    size_t size = DIRECT_ALIGNMENT + 100;
+    size_t newsize;
+    size_t i;
+
+    open_testfile(LDI_CACHE_NONE, size, path, &fi, &f);
+    memset(buffer, 0xAB, sizeof(buffer));
+
+    /* Write across the sector boundary, leaving the rest untouched. */
+    ATF_REQUIRE(!IS_ERROR(file_write(f, buffer + 1, 200, DIRECT_ALIGNMENT - 100, empty_logger)));
+    ATF_REQUIRE(!IS_ERROR(file_read(f, result, size, 0, empty_logger)));
+    for (i = 0; i < size; i++) {
+        if (i >= DIRECT_ALIGNMENT - 100 && i < DIRECT_ALIGNMENT + 100)
+            ATF_REQUIRE_EQ((char)0xAB, result[i]);
+        else
+            ATF_REQUIRE_EQ((char)(i * 7 + 1), result[i]);
+    }
+
+    /* The size only changes when writing past the end. */
+    ATF_REQUIRE(!IS_ERROR(file_getsize(f, &newsize)));
+    ATF_CHECK_EQ(size, newsize);
+    ATF_REQUIRE(!IS_ERROR(file_write(f, buffer, 50, size + 10, empty_logger)));
+    ATF_REQUIRE(!IS_ERROR(file_getsize(f, &newsize)));
+    ATF_CHECK_EQ(size + 60, newsize);
+
+    /* Extending the file fills it with zeros. */
+    ATF_REQUIRE(!IS_ERROR(file_setsize(f, 2 * DIRECT_ALIGNMENT)));
+    ATF_REQUIRE(!IS_ERROR(file_read(f, result, 2 * DIRECT_ALIGNMENT, 0, empty_logger)));
+    for (i = size + 60; i < 2 * DIRECT_ALIGNMENT; i++) {
+        ATF_REQUIRE_EQ(0, result[i]);
+    }
+
+    file_close(&f);
+    fileinterface_destroy(&fi);
+    unlink(path);
+}
+
+ATF_TC_WITHOUT_HEAD(file_write__writes_the_file_in_each_cache_mode);
+ATF_TC_BODY(file_write__writes_the_file_in_each_cache_mode, tc)
+{
+    enum diskimage_cache_mode modes[] = { LDI_CACHE_WRITEBACK, LDI_CACHE_NONE,
+        LDI_CACHE_WRITETHROUGH, LDI_CACHE_UNSAFE };
+    struct fileinterface *fi;
+    struct file *f;
+    char path[64];
+    char *buffer, *result;
+    size_t size = 3 * DIRECT_ALIGNMENT;
+    size_t m;
+    int fd;
+
+    ATF_REQUIRE_EQ(0, posix_memalign((void **)&buffer, DIRECT_ALIGNMENT, DIRECT_ALIGNMENT));
+    ATF_REQUIRE_EQ(0, posix_memalign((void **)&result, DIRECT_ALIGNMENT, DIRECT_ALIGNMENT));
+
+    for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        open_testfile(modes[m], size, path, &fi, &f);
+        ATF_CHECK_EQ(modes[m] == LDI_CACHE_NONE, (fcntl(f->fd, F_GETFL) & O_DIRECT) != 0);
+
+        memset(buffer, 0x10 + m, DIRECT_ALIGNMENT);
+        ATF_REQUIRE(!IS_ERROR(file_write(f, buffer, DIRECT_ALIGNMENT, DIRECT_ALIGNMENT, empty_logger)));
+        ATF_REQUIRE(!IS_ERROR(file_sync(f)));
+        ATF_REQUIRE(!IS_ERROR(file_read(f, result, DIRECT_ALIGNMENT, DIRECT_ALIGNMENT, empty_logger)));
+        ATF_CHECK(memcmp(buffer, result, DIRECT_ALIGNMENT) == 0);
+        file_close(&f);
+        fileinterface_destroy(&fi);
+
+        /* The data is in the file, around the data that was there. */
+        fd = open(path, O_RDONLY);
+        ATF_REQUIRE(fd != -1);
+        ATF_REQUIRE_EQ(DIRECT_ALIGNMENT, pread(fd, result, DIRECT_ALIGNMENT, DIRECT_ALIGNMENT));
+        ATF_CHECK(memcmp(buffer, result, DIRECT_ALIGNMENT) == 0);
+        ATF_REQUIRE_EQ(1, pread(fd, result, 1, DIRECT_ALIGNMENT - 1));
+        ATF_CHECK_EQ((char)((DIRECT_ALIGNMENT - 1) * 7 + 1), result[0]);
+        ATF_REQUIRE_EQ(1, pread(fd, result, 1, 2 * DIRECT_ALIGNMENT));
+        ATF_CHECK_EQ((char)(2 * DIRECT_ALIGNMENT * 7 + 1), result[0]);
+        close(fd);
+        unlink(path);
+    }
+
+    free(buffer);
+    free(result);
+}
+
+static int destroyed_objects;
+
+static void
+destroy_object(void *object)
+{
+    destroyed_objects++;
+}
+
+ATF_TC_WITHOUT_HEAD(file_open_shared__shares_the_file_until_last_close);
+ATF_TC_BODY(file_open_shared__shares_the_file_until_last_close, tc)
+{
+    struct fileinterface *fi, *other_fi;
+    struct file *f, *shared1, *shared2;
+    char path[64];
+    char buffer[SHARED_BLOCK_SIZE + 100];
+    size_t size = SHARED_BLOCK_SIZE + 300;
+    int object;
+    size_t i;
+
+    open_testfile(LDI_CACHE_WRITEBACK, size, path, &fi, &f);
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(LDI_CACHE_WRITEBACK, &other_fi)));
+
+    /* Opening the same file twice gives the same shared file. */
+    ATF_REQUIRE(!IS_ERROR(file_open_shared(fi, path, &shared1)));
+    ATF_REQUIRE(!IS_ERROR(file_open_shared(other_fi, path, &shared2)));
+    ATF_CHECK_EQ(shared1, shared2);
+    ATF_CHECK_EQ(2, shared1->refcount);
+
+    /* The first object attached stays attached. */
+    ATF_CHECK_EQ(NULL, file_shared_object(shared1));
+    ATF_CHECK_EQ(&object, file_share_object(shared1, &object, destroy_object));
+    ATF_CHECK_EQ(&object, file_share_object(shared2, &size, destroy_object));
+
+    /* Reads across a cached block, twice, give the file data. */
+    for (i = 0; i < 2; i++) {
+        ATF_REQUIRE(!IS_ERROR(file_read(shared2, buffer, sizeof(buffer), 100, empty_logger)));
+        ATF_REQUIRE_EQ((char)(100 * 7 + 1), buffer[0]);
+        ATF_REQUIRE_EQ((char)((SHARED_BLOCK_SIZE + 199) * 7 + 1), buffer[sizeof(buffer) - 1]);
+    }
+    ATF_CHECK(IS_ERROR(file_read(shared1, buffer, 400, size - 100, empty_logger)));
+
+    /* The file interfaces can go away before the shared file. */
+    fileinterface_destroy(&other_fi);
+    destroyed_objects = 0;
+    file_close(&shared1);
+    ATF_CHECK_EQ(NULL, shared1);
+    ATF_CHECK_EQ(0, destroyed_objects);
+    file_close(&shared2);
+    ATF_CHECK_EQ(1, destroyed_objects);
+    ATF_CHECK_EQ(NULL, shared_files);
+
+    file_close(&f);
+    fileinterface_destroy(&fi);
+    unlink(path);
+}
+
+ATF_TC_WITHOUT_HEAD(file_open_shared__keeps_cache_modes_apart);
+ATF_TC_BODY(file_open_shared__keeps_cache_modes_apart, tc)
+{
+    struct fileinterface *fi, *direct_fi;
+    struct file *f, *shared, *direct;
+    char path[64];
+    char buffer[100];
+
+    open_testfile(LDI_CACHE_WRITEBACK, DIRECT_ALIGNMENT, path, &fi, &f);
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(LDI_CACHE_NONE, &direct_fi)));
+
+    /* Each cache mode has a file, a cache and an object of its own. */
+    ATF_REQUIRE(!IS_ERROR(file_open_shared(fi, path, &shared)));
+    ATF_REQUIRE(!IS_ERROR(file_open_shared(direct_fi, path, &direct)));
+    ATF_CHECK(shared != direct);
+    ATF_CHECK(shared->cache != direct->cache);
+    ATF_CHECK_EQ(1, shared->refcount);
+    ATF_CHECK_EQ(1, direct->refcount);
+    ATF_CHECK_EQ(LDI_CACHE_NONE, direct->cache_mode);
+    file_share_object(shared, &fi, destroy_object);
+    ATF_CHECK_EQ(NULL, file_shared_object(direct));
+
+    /* Both read the file. */
+    ATF_REQUIRE(!IS_ERROR(file_read(direct, buffer, sizeof(buffer), 10, empty_logger)));
+    ATF_CHECK_EQ((char)(10 * 7 + 1), buffer[0]);
+    ATF_REQUIRE(!IS_ERROR(file_read(shared, buffer, sizeof(buffer), 10, empty_logger)));
+    ATF_CHECK_EQ((char)(10 * 7 + 1), buffer[0]);
+
+    /* Closing one leaves the other shared. */
+    destroyed_objects = 0;
+    file_close(&shared);
+    ATF_CHECK_EQ(1, destroyed_objects);
+    ATF_CHECK_EQ(direct, shared_files);
+    ATF_CHECK_EQ(NULL, direct->next);
+    file_close(&direct);
+    ATF_CHECK_EQ(NULL, shared_files);
+
+    fileinterface_destroy(&direct_fi);
+    file_close(&f);
+    fileinterface_destroy(&fi);
+    unlink(path);
+}
+
+ATF_TC_WITHOUT_HEAD(fileinterface_getrelativepath__walks_up_to_the_common_directory);
+ATF_TC_BODY(fileinterface_getrelativepath__walks_up_to_the_common_directory, tc)
+{
+    struct fileinterface *fi;
+    struct file *f;
+    char *path;
+    LDI_ERROR res;
+
+    ATF_REQUIRE_EQ(0, mkdir("a", 0755));
+    ATF_REQUIRE_EQ(0, mkdir("a/b", 0755));
+    ATF_REQUIRE_EQ(0, mkdir("ab", 0755));
+    fileinterface_create(LDI_CACHE_WRITEBACK, &fi);
+    ATF_REQUIRE_EQ(LDI_ERR_NOERROR, file_create_new(fi, "ab/parent.vhd", &f).code);
+    file_close(&f);
+
+    // Only whole directory names are common.
+    res = fileinterface_getrelativepath(fi, "a/b", "ab/parent.vhd", &path);
+    ATF_REQUIRE_EQ(LDI_ERR_NOERROR, res.code);
+    ATF_CHECK_STREQ("../../ab/parent.vhd", path);
+    free(path);
+
+    fileinterface_getrelativepath(fi, "ab", "ab/parent.vhd", &path);
+    ATF_CHECK_STREQ("parent.vhd", path);
+    free(path);
+
+    fileinterface_getrelativepath(fi, "/", "ab/parent.vhd", &path);
+    ATF_CHECK(path[0] != '/' && strncmp(path, "../", 3) != 0);
+    free(path);
+
+    // New files are not created over existing ones.
+    ATF_CHECK_EQ(LDI_ERR_FILEERROR, file_create_new(fi, "ab/parent.vhd", &f).code);
+
+    fileinterface_destroy(&fi);
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+    ATF_TP_ADD_TC(tp, file_read__handles_unaligned_direct_reads);
+    ATF_TP_ADD_TC(tp, file_write__handles_unaligned_direct_writes);
+    ATF_TP_ADD_TC(tp, file_write__writes_the_file_in_each_cache_mode);
+    ATF_TP_ADD_TC(tp, file_open_shared__shares_the_file_until_last_close);
+    ATF_TP_ADD_TC(tp, file_open_shared__keeps_cache_modes_apart);
+    ATF_TP_ADD_TC(tp, fileinterface_getrelativepath__walks_up_to_the_common_directory);
+    return 0;
+}
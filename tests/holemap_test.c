@@ -0,0 +1,147 @@
+
+#include <atf-c.h>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Include the source files to test. */
+#include "blockcache.c"
+#include "bouncepool.c"
+#include "filemap.c"
+#include "fileinterface.c"
+#include "holemap.c"
+
+void empty_log_write(int level, void *privarg, char *fmt, ...) { }
+
+struct logger empty_logger = {
+    .write = empty_log_write
+};
+
+#define TEST_CHUNK_SIZE (1024 * 1024)
+#define TEST_FILE_SIZE (8 * TEST_CHUNK_SIZE)
+
+/*
+ * Writes a sparse file of 8 MB with data in the second and the fifth MB,
+ * and opens it.
+ */
+static void
+open_testfile(char *path, struct fileinterface **fi, struct file **file)
+{
+    char *data;
+    int fd;
+
+    data = malloc(TEST_CHUNK_SIZE);
+    ATF_REQUIRE(data != NULL);
+    memset(data, 1, TEST_CHUNK_SIZE);
+
+    strcpy(path, "holemap_test.XXXXXX");
+    fd = mkstemp(path);
+    ATF_REQUIRE(fd != -1);
+    ATF_REQUIRE_EQ(0, ftruncate(fd, TEST_FILE_SIZE));
+    ATF_REQUIRE_EQ(TEST_CHUNK_SIZE, pwrite(fd, data, TEST_CHUNK_SIZE, TEST_CHUNK_SIZE));
+    ATF_REQUIRE_EQ(TEST_CHUNK_SIZE, pwrite(fd, data, TEST_CHUNK_SIZE, 4 * TEST_CHUNK_SIZE));
+    ATF_REQUIRE_EQ(0, fsync(fd));
+    close(fd);
+    free(data);
+
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(LDI_CACHE_WRITEBACK, fi)));
+    ATF_REQUIRE(!IS_ERROR(file_open(*fi, path, file)));
+}
+
+/*
+ * Checks what the map says about offset.
+ */
+static void
+check_find(struct holemap *map, off_t offset, bool expected_hole, off_t expected_end)
+{
+    bool hole;
+    off_t end;
+
+    holemap_find(map, offset, &hole, &end);
+    ATF_CHECK_EQ(expected_hole, hole);
+    ATF_CHECK_EQ(expected_end, end);
+}
+
+ATF_TC_WITHOUT_HEAD(holemap_create__finds_the_holes);
+ATF_TC_BODY(holemap_create__finds_the_holes, tc)
+{
+    struct fileinterface *fi;
+    struct file *file;
+    struct holemap *map;
+    char path[64];
+    bool hole;
+    off_t end;
+
+    open_testfile(path, &fi, &file);
+    ATF_REQUIRE(!IS_ERROR(holemap_create(file, TEST_FILE_SIZE, &map)));
+
+    /* File systems without holes report all of the file as data. */
+    holemap_find(map, 0, &hole, &end);
+    if (!hole) {
+        ATF_CHECK_EQ(TEST_FILE_SIZE, end);
+    } else {
+        check_find(map, 0, true, TEST_CHUNK_SIZE);
+        check_find(map, TEST_CHUNK_SIZE + 10, false, 2 * TEST_CHUNK_SIZE);
+        check_find(map, 3 * TEST_CHUNK_SIZE, true, 4 * TEST_CHUNK_SIZE);
+        check_find(map, 4 * TEST_CHUNK_SIZE, false, 5 * TEST_CHUNK_SIZE);
+        check_find(map, 7 * TEST_CHUNK_SIZE, true, TEST_FILE_SIZE);
+    }
+
+    /* The part of the file after the map is data. */
+    check_find(map, TEST_FILE_SIZE + 1, false, TEST_FILE_SIZE + 1);
+
+    holemap_destroy(&map);
+    ATF_CHECK_EQ(NULL, map);
+    file_close(&file);
+    fileinterface_destroy(&fi);
+    unlink(path);
+}
+
+ATF_TC_WITHOUT_HEAD(holemap_fill__removes_written_ranges);
+ATF_TC_BODY(holemap_fill__removes_written_ranges, tc)
+{
+    struct fileinterface *fi;
+    struct file *file;
+    struct holemap *map;
+    char path[64];
+    bool hole;
+    off_t end;
+
+    open_testfile(path, &fi, &file);
+    ATF_REQUIRE(!IS_ERROR(holemap_create(file, TEST_FILE_SIZE, &map)));
+    holemap_find(map, 0, &hole, &end);
+    if (!hole) {
+        atf_tc_skip("The file system does not report holes");
+    }
+
+    /* Split the first hole. */
+    holemap_fill(map, 1000, 1000);
+    check_find(map, 0, true, 1000);
+    check_find(map, 1000, false, 2000);
+    check_find(map, 2000, true, TEST_CHUNK_SIZE);
+
+    /* Cut the end of one hole, all of the next and the start of another. */
+    holemap_fill(map, TEST_CHUNK_SIZE - 100, 6 * TEST_CHUNK_SIZE);
+    check_find(map, 2000, true, TEST_CHUNK_SIZE - 100);
+    check_find(map, TEST_CHUNK_SIZE - 100, false, 7 * TEST_CHUNK_SIZE - 100);
+    check_find(map, 7 * TEST_CHUNK_SIZE - 100, true, TEST_FILE_SIZE);
+
+    /* Fill the rest of the last hole. */
+    holemap_fill(map, 7 * TEST_CHUNK_SIZE - 100, TEST_CHUNK_SIZE + 100);
+    check_find(map, 7 * TEST_CHUNK_SIZE - 100, false, TEST_FILE_SIZE);
+
+    holemap_destroy(&map);
+    file_close(&file);
+    fileinterface_destroy(&fi);
+    unlink(path);
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+    ATF_TP_ADD_TC(tp, holemap_create__finds_the_holes);
+    ATF_TP_ADD_TC(tp, holemap_fill__removes_written_ranges);
+
+    return 0;
+}
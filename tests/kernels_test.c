@@ -0,0 +1,142 @@
+
+#include <atf-c.h>
+
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+/* Include the source file to test. */
+#include "kernels.c"
+
+ATF_TC_WITHOUT_HEAD(kernel_zero_prefix__finds_first_nonzero_byte);
+ATF_TC_BODY(kernel_zero_prefix__finds_first_nonzero_byte, tc)
+{
+    char buffer[1024];
+    int start, i;
+
+    /* Check all positions, with different alignments of the buffer. */
+    for (start = 0; start < 8; start++) {
+        for (i = start; i < 1024; i++) {
+            bzero(buffer, sizeof(buffer));
+            buffer[i] = 1;
+            ATF_CHECK_EQ(i - start, kernel_zero_prefix(buffer + start, 1024 - start));
+        }
+    }
+}
+
+ATF_TC_WITHOUT_HEAD(kernel_zero_suffix__finds_last_nonzero_byte);
+ATF_TC_BODY(kernel_zero_suffix__finds_last_nonzero_byte, tc)
+{
+    char buffer[1024];
+    int end, i;
+
+    /* Check all positions, with different alignments of the buffer end. */
+    for (end = 1017; end <= 1024; end++) {
+        for (i = 0; i < end; i++) {
+            bzero(buffer, sizeof(buffer));
+            buffer[i] = 1;
+            ATF_CHECK_EQ(end - i - 1, kernel_zero_suffix(buffer, end));
+        }
+    }
+}
+
+ATF_TC_WITHOUT_HEAD(kernel_iszero__handles_zero_and_empty_buffers);
+ATF_TC_BODY(kernel_iszero__handles_zero_and_empty_buffers, tc)
+{
+    char buffer[4096];
+
+    bzero(buffer, sizeof(buffer));
+
+    ATF_CHECK(kernel_iszero(buffer, 0));
+    ATF_CHECK(kernel_iszero(buffer, sizeof(buffer)));
+    ATF_CHECK_EQ(sizeof(buffer), kernel_zero_suffix(buffer, sizeof(buffer)));
+
+    buffer[4095] = 1;
+    ATF_CHECK(!kernel_iszero(buffer, sizeof(buffer)));
+    ATF_CHECK(kernel_iszero(buffer, sizeof(buffer) - 1));
+}
+
+ATF_TC_WITHOUT_HEAD(kernel_zero_prefix__is_equal_for_all_isas);
+ATF_TC_BODY(kernel_zero_prefix__is_equal_for_all_isas, tc)
+{
+    char buffer[1024];
+    int isa, start, i;
+
+    /* The vector kernels must give the same results as the scalar one. */
+    for (isa = 0; isa < KERNEL_ISA_COUNT; isa++) {
+        if (!kernel_set_isa(isa))
+            continue;
+        for (start = 0; start < 8; start++) {
+            for (i = start; i < 1024; i += 3) {
+                bzero(buffer, sizeof(buffer));
+                buffer[i] = 1;
+                ATF_CHECK_EQ(i - start, kernel_zero_prefix(buffer + start, 1024 - start));
+                ATF_CHECK_EQ(1024 - i - 1, kernel_zero_suffix(buffer, 1024));
+            }
+        }
+    }
+    kernel_init();
+}
+
+ATF_TC_WITHOUT_HEAD(kernel_bytesum__is_equal_for_all_isas);
+ATF_TC_BODY(kernel_bytesum__is_equal_for_all_isas, tc)
+{
+    uint8_t buffer[1024];
+    uint32_t expected;
+    int isa, i, length;
+
+    for (i = 0; i < 1024; i++) {
+        buffer[i] = 255 - i * 13;
+    }
+
+    for (isa = 0; isa < KERNEL_ISA_COUNT; isa++) {
+        if (!kernel_set_isa(isa))
+            continue;
+        /* The start of the buffer moves with the length. */
+        for (length = 0; length <= 1024; length += 17) {
+            expected = 0;
+            for (i = 1024 - length; i < 1024; i++) {
+                expected += buffer[i];
+            }
+            ATF_CHECK_EQ(expected, kernel_bytesum(buffer + 1024 - length, length));
+        }
+    }
+    kernel_init();
+}
+
+ATF_TC_WITHOUT_HEAD(kernel_be32dec_array__is_equal_for_all_isas);
+ATF_TC_BODY(kernel_be32dec_array__is_equal_for_all_isas, tc)
+{
+    uint8_t source[4 * 67 + 1];
+    uint8_t encoded[4 * 67 + 1];
+    uint32_t decoded[67];
+    int isa, i;
+
+    for (i = 0; i < sizeof(source); i++) {
+        source[i] = i * 7;
+    }
+
+    /* Use an unaligned source, and a count that leaves a tail. */
+    for (isa = 0; isa < KERNEL_ISA_COUNT; isa++) {
+        if (!kernel_set_isa(isa))
+            continue;
+        kernel_be32dec_array(decoded, source + 1, 67);
+        for (i = 0; i < 67; i++) {
+            ATF_CHECK_EQ(be32dec(source + 1 + i * 4), decoded[i]);
+        }
+        kernel_be32enc_array(encoded + 1, decoded, 67);
+        ATF_CHECK(memcmp(source + 1, encoded + 1, 4 * 67) == 0);
+    }
+    kernel_init();
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+    ATF_TP_ADD_TC(tp, kernel_zero_prefix__finds_first_nonzero_byte);
+    ATF_TP_ADD_TC(tp, kernel_zero_suffix__finds_last_nonzero_byte);
+    ATF_TP_ADD_TC(tp, kernel_iszero__handles_zero_and_empty_buffers);
+    ATF_TP_ADD_TC(tp, kernel_zero_prefix__is_equal_for_all_isas);
+    ATF_TP_ADD_TC(tp, kernel_bytesum__is_equal_for_all_isas);
+    ATF_TP_ADD_TC(tp, kernel_be32dec_array__is_equal_for_all_isas);
+    return 0;
+}
@@ -0,0 +1,260 @@
+
+#include <atf-c.h>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Include the source files to test. */
+#include "blockcache.c"
+#include "bouncepool.c"
+#include "filemap.c"
+#include "fileinterface.c"
+#include "kernels.c"
+#include "ldzcreate.c"
+#include "ldzheader.c"
+#include "ldzimage.c"
+#include "taskpool.c"
+
+void empty_log_write(int level, void *privarg, char *fmt, ...) { }
+
+struct logger empty_logger = {
+    .write = empty_log_write
+};
+
+/* A disk of a zero chunk, a random chunk and compressible chunks. */
+#define TEST_DISK_SIZE (40 * CHUNK_SIZE + 1000)
+
+/*
+ * Reads from the disk in memory that is compressed.
+ */
+static LDI_ERROR
+read_memory(void *arg, char *buf, size_t nbytes, off_t offset)
+{
+    memcpy(buf, (char *)arg + offset, nbytes);
+
+    return NO_ERROR;
+}
+
+/*
+ * Fills a new disk with test data and compresses it into a new file.
+ */
+static char *
+create_testimage(char *path, struct fileinterface *fi)
+{
+    char *disk;
+    size_t i;
+    int fd;
+
+    disk = malloc(TEST_DISK_SIZE);
+    ATF_REQUIRE(disk != NULL);
+    bzero(disk, CHUNK_SIZE);
+    srandom(1);
+    for (i = CHUNK_SIZE; i < 2 * CHUNK_SIZE; i++) {
+        disk[i] = random();
+    }
+    for (i = 2 * CHUNK_SIZE; i < TEST_DISK_SIZE; i++) {
+        disk[i] = i / 100;
+    }
+
+    strcpy(path, "ldzimage_test.XXXXXX");
+    fd = mkstemp(path);
+    ATF_REQUIRE(fd != -1);
+    close(fd);
+    unlink(path);
+    ATF_REQUIRE(!IS_ERROR(ldzcreate(fi, path, TEST_DISK_SIZE, read_memory, disk,
+        empty_logger)));
+
+    return disk;
+}
+
+/*
+ * Checks that nbytes at offset read from the image match the disk.
+ */
+static void
+check_read(struct ldzimage *image, char *disk, size_t nbytes, off_t offset)
+{
+    char *buf;
+
+    buf = malloc(nbytes);
+    ATF_REQUIRE(buf != NULL);
+    ATF_REQUIRE(!IS_ERROR(ldzimage_read(image, buf, nbytes, offset)));
+    ATF_CHECK(memcmp(disk + offset, buf, nbytes) == 0);
+    free(buf);
+}
+
+ATF_TC_WITHOUT_HEAD(ldzimage_read__reads_what_was_compressed);
+ATF_TC_BODY(ldzimage_read__reads_what_was_compressed, tc)
+{
+    struct diskimage_options options;
+    struct fileinterface *fi;
+    struct ldzimage *image;
+    uint64_t start;
+    size_t size, length, nbytes;
+    off_t offset;
+    char path[64];
+    char *disk;
+    int i;
+
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(LDI_CACHE_WRITEBACK, &fi)));
+    disk = create_testimage(path, fi);
+
+    bzero(&options, sizeof(options));
+    ATF_REQUIRE(!IS_ERROR(ldzimage_open(fi, path, options, &image, empty_logger)));
+    ATF_CHECK_EQ(TEST_DISK_SIZE, ldzimage_size(image));
+
+    /* Zero chunks have no data, and random chunks are stored as they are. */
+    ATF_REQUIRE(!IS_ERROR(find_chunk(image, 0, &start, &length)));
+    ATF_CHECK_EQ(0, length);
+    ATF_REQUIRE(!IS_ERROR(find_chunk(image, 1, &start, &length)));
+    ATF_CHECK_EQ(CHUNK_SIZE, length);
+    ATF_REQUIRE(!IS_ERROR(find_chunk(image, 2, &start, &length)));
+    ATF_CHECK(is_compressed(image, 2, length));
+    ATF_REQUIRE(!IS_ERROR(file_getsize(image->file, &size)));
+    ATF_CHECK(size < TEST_DISK_SIZE / 4);
+
+    /* The whole disk, with enough chunks to use the workers. */
+    check_read(image, disk, TEST_DISK_SIZE, 0);
+
+    srandom(2);
+    for (i = 0; i < 1000; i++) {
+        offset = random() % TEST_DISK_SIZE;
+        nbytes = 1 + random() % MIN(3 * CHUNK_SIZE, TEST_DISK_SIZE - offset);
+        check_read(image, disk, nbytes, offset);
+    }
+
+    ldzimage_destroy(&image);
+    ATF_CHECK_EQ(NULL, image);
+    fileinterface_destroy(&fi);
+    unlink(path);
+    free(disk);
+}
+
+ATF_TC_WITHOUT_HEAD(ldzimage_read__reads_ahead_when_sequential);
+ATF_TC_BODY(ldzimage_read__reads_ahead_when_sequential, tc)
+{
+    struct diskimage_options options;
+    struct fileinterface *fi;
+    struct ldzimage *image;
+    char path[64];
+    char *disk;
+    char byte;
+
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(LDI_CACHE_WRITEBACK, &fi)));
+    disk = create_testimage(path, fi);
+    bzero(&options, sizeof(options));
+    ATF_REQUIRE(!IS_ERROR(ldzimage_open(fi, path, options, &image, empty_logger)));
+
+    /* A random read only inflates its own chunk. */
+    check_read(image, disk, 4096, 2 * CHUNK_SIZE);
+    ATF_CHECK(blockcache_get(image->cache, 2, &byte, 0, 1));
+    ATF_CHECK(!blockcache_get(image->cache, 3, &byte, 0, 1));
+
+    /* The next read continues it, and inflates the chunks after it too. */
+    check_read(image, disk, CHUNK_SIZE, 2 * CHUNK_SIZE + 4096);
+    wait_read_ahead(image);
+    ATF_CHECK(blockcache_get(image->cache, 3, &byte, 0, 1));
+    ATF_CHECK(blockcache_get(image->cache, 4 + READAHEAD_CHUNKS - 1, &byte, 0, 1));
+    ATF_CHECK(!blockcache_get(image->cache, 4 + READAHEAD_CHUNKS, &byte, 0, 1));
+
+    /* The chunks that were read ahead hold the right data. */
+    check_read(image, disk, 3 * CHUNK_SIZE, 5 * CHUNK_SIZE);
+
+    ldzimage_destroy(&image);
+    fileinterface_destroy(&fi);
+    unlink(path);
+    free(disk);
+}
+
+ATF_TC_WITHOUT_HEAD(ldzimage_read__ignores_errors_reading_ahead);
+ATF_TC_BODY(ldzimage_read__ignores_errors_reading_ahead, tc)
+{
+    struct diskimage_options options;
+    struct fileinterface *fi;
+    struct ldzimage *image;
+    uint64_t start;
+    size_t length;
+    char path[64];
+    char *disk, *buf;
+    char byte;
+    int fd;
+
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(LDI_CACHE_WRITEBACK, &fi)));
+    disk = create_testimage(path, fi);
+    bzero(&options, sizeof(options));
+    ATF_REQUIRE(!IS_ERROR(ldzimage_open(fi, path, options, &image, empty_logger)));
+    ATF_REQUIRE(!IS_ERROR(find_chunk(image, 6, &start, &length)));
+    ldzimage_destroy(&image);
+
+    /* Damage a chunk that a sequential read of chunk 3 reads ahead. */
+    fd = open(path, O_RDWR);
+    ATF_REQUIRE(fd != -1);
+    ATF_REQUIRE_EQ(1, pread(fd, &byte, 1, start + length / 2));
+    byte ^= 0xff;
+    ATF_REQUIRE_EQ(1, pwrite(fd, &byte, 1, start + length / 2));
+    close(fd);
+
+    ATF_REQUIRE(!IS_ERROR(ldzimage_open(fi, path, options, &image, empty_logger)));
+    check_read(image, disk, 4096, 2 * CHUNK_SIZE);
+    check_read(image, disk, CHUNK_SIZE, 2 * CHUNK_SIZE + 4096);
+    wait_read_ahead(image);
+    ATF_CHECK(blockcache_get(image->cache, 5, &byte, 0, 1));
+    ATF_CHECK(!blockcache_get(image->cache, 6, &byte, 0, 1));
+
+    /* The damaged chunk fails when it is read. */
+    buf = malloc(CHUNK_SIZE);
+    ATF_REQUIRE(buf != NULL);
+    ATF_CHECK(IS_ERROR(ldzimage_read(image, buf, CHUNK_SIZE, 6 * CHUNK_SIZE)));
+    free(buf);
+
+    ldzimage_destroy(&image);
+    fileinterface_destroy(&fi);
+    unlink(path);
+    free(disk);
+}
+
+ATF_TC_WITHOUT_HEAD(ldzimage_open__rejects_a_damaged_footer);
+ATF_TC_BODY(ldzimage_open__rejects_a_damaged_footer, tc)
+{
+    struct diskimage_options options;
+    struct fileinterface *fi;
+    struct ldzimage *image;
+    struct stat sb;
+    char path[64];
+    char *disk;
+    char byte;
+    int fd;
+
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(LDI_CACHE_WRITEBACK, &fi)));
+    disk = create_testimage(path, fi);
+
+    /* Creating the image again fails, and leaves the image alone. */
+    ATF_CHECK(IS_ERROR(ldzcreate(fi, path, TEST_DISK_SIZE, read_memory, disk,
+        empty_logger)));
+
+    fd = open(path, O_RDWR);
+    ATF_REQUIRE(fd != -1);
+    ATF_REQUIRE_EQ(0, fstat(fd, &sb));
+    ATF_REQUIRE_EQ(1, pread(fd, &byte, 1, sb.st_size - LDZ_HEADER_SIZE + 20));
+    byte ^= 1;
+    ATF_REQUIRE_EQ(1, pwrite(fd, &byte, 1, sb.st_size - LDZ_HEADER_SIZE + 20));
+    close(fd);
+
+    bzero(&options, sizeof(options));
+    ATF_CHECK(IS_ERROR(ldzimage_open(fi, path, options, &image, empty_logger)));
+
+    fileinterface_destroy(&fi);
+    unlink(path);
+    free(disk);
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+    ATF_TP_ADD_TC(tp, ldzimage_read__reads_what_was_compressed);
+    ATF_TP_ADD_TC(tp, ldzimage_read__reads_ahead_when_sequential);
+    ATF_TP_ADD_TC(tp, ldzimage_read__ignores_errors_reading_ahead);
+    ATF_TP_ADD_TC(tp, ldzimage_open__rejects_a_damaged_footer);
+
+    return 0;
+}
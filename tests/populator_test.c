@@ -0,0 +1,99 @@
+
+#include <atf-c.h>
+
+#include <unistd.h>
+
+/* Include the source file to test. */
+#include "populator.c"
+
+static pthread_mutex_t copied_lock = PTHREAD_MUTEX_INITIALIZER;
+static int copied[8];
+
+static LDI_ERROR
+count_copies(void *arg, uint32_t block, uint64_t *bytes)
+{
+    pthread_mutex_lock(&copied_lock);
+    copied[block]++;
+    pthread_mutex_unlock(&copied_lock);
+    *bytes = 512;
+
+    return NO_ERROR;
+}
+
+/*
+ * Waits up to a second for the worker to copy the expected number of
+ * blocks in total.
+ */
+static int
+wait_for_copies(int expected)
+{
+    int i, total, tries;
+
+    for (tries = 0; tries < 100; tries++) {
+        pthread_mutex_lock(&copied_lock);
+        for (total = 0, i = 0; i < 8; i++)
+            total += copied[i];
+        pthread_mutex_unlock(&copied_lock);
+        if (total >= expected)
+            break;
+        usleep(10000);
+    }
+
+    return total;
+}
+
+ATF_TC_WITHOUT_HEAD(populator_queue__copies_each_queued_block);
+ATF_TC_BODY(populator_queue__copies_each_queued_block, tc)
+{
+    struct populator *populator;
+    LDI_ERROR res;
+
+    memset(copied, 0, sizeof(copied));
+    res = populator_create(8, 512, 0, count_copies, NULL, &populator);
+    ATF_REQUIRE_EQ(LDI_ERR_NOERROR, res.code);
+
+    populator_queue(populator, 1);
+    populator_queue(populator, 7);
+    ATF_CHECK_EQ(2, wait_for_copies(2));
+    ATF_CHECK_EQ(1, copied[1]);
+    ATF_CHECK_EQ(1, copied[7]);
+
+    /* A block can be queued again once it has been copied. */
+    populator_queue(populator, 1);
+    ATF_CHECK_EQ(3, wait_for_copies(3));
+    ATF_CHECK_EQ(2, copied[1]);
+
+    populator_destroy(&populator);
+    ATF_CHECK_EQ(NULL, populator);
+}
+
+ATF_TC_WITHOUT_HEAD(populator_destroy__stops_a_rate_limited_worker);
+ATF_TC_BODY(populator_destroy__stops_a_rate_limited_worker, tc)
+{
+    struct populator *populator;
+    LDI_ERROR res;
+    int i;
+
+    memset(copied, 0, sizeof(copied));
+    /* One block per 100 seconds, after the first. */
+    res = populator_create(8, 512, 5, count_copies, NULL, &populator);
+    ATF_REQUIRE_EQ(LDI_ERR_NOERROR, res.code);
+
+    for (i = 0; i < 8; i++)
+        populator_queue(populator, i);
+    ATF_CHECK_EQ(1, wait_for_copies(1));
+    usleep(100000);
+    ATF_CHECK_EQ(1, wait_for_copies(1));
+
+    /* Destroying doesn't wait for the queued blocks. */
+    populator_destroy(&populator);
+    ATF_CHECK_EQ(1, wait_for_copies(1));
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+    ATF_TP_ADD_TC(tp, populator_queue__copies_each_queued_block);
+    ATF_TP_ADD_TC(tp, populator_destroy__stops_a_rate_limited_worker);
+
+    return 0;
+}
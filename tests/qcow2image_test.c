@@ -0,0 +1,199 @@
+
+#include <atf-c.h>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Include the source files to test. */
+#include "blockcache.c"
+#include "bouncepool.c"
+#include "filemap.c"
+#include "fileinterface.c"
+#include "qcow2header.c"
+#include "qcow2image.c"
+
+void empty_log_write(int level, void *privarg, char *fmt, ...) { }
+
+struct logger empty_logger = {
+    .write = empty_log_write
+};
+
+#define TEST_CLUSTER_BITS 9
+#define TEST_CLUSTER_BYTES (1 << TEST_CLUSTER_BITS)
+#define TEST_CLUSTERS 4
+#define TEST_REFBLOCK 3
+#define TEST_FILE_CLUSTERS 7
+
+/*
+ * Writes a version 3 image with 4 clusters of 512 bytes. The header, L1
+ * table, refcount table, refcount block and L2 table each have a cluster.
+ * Cluster 0 is filled with 1s, cluster 1 is a zero cluster, cluster 2 is
+ * not allocated and cluster 3 is compressed and filled with 4s.
+ */
+static void
+write_testimage(char *path, uint64_t backing_file_offset)
+{
+    struct qcow2header header;
+    z_stream stream;
+    char cluster[TEST_CLUSTER_BYTES];
+    uint8_t *data;
+    uint64_t compressed_offset = 6 * TEST_CLUSTER_BYTES;
+    size_t size = TEST_FILE_CLUSTERS * TEST_CLUSTER_BYTES;
+    int i, fd;
+
+    data = calloc(1, size);
+    ATF_REQUIRE(data != NULL);
+
+    memset(&header, 0, sizeof(header));
+    header.version = 3;
+    header.backing_file_offset = backing_file_offset;
+    header.cluster_bits = TEST_CLUSTER_BITS;
+    header.size = TEST_CLUSTERS * TEST_CLUSTER_BYTES;
+    header.l1_size = 1;
+    header.l1_table_offset = 1 * TEST_CLUSTER_BYTES;
+    header.refcount_table_offset = 2 * TEST_CLUSTER_BYTES;
+    header.refcount_table_clusters = 1;
+    header.refcount_order = 4;
+    header.header_length = QCOW2_HEADER_SIZE;
+    qcow2header_write(&header, data);
+
+    be64enc(data + 1 * TEST_CLUSTER_BYTES, 4 * TEST_CLUSTER_BYTES | ENTRY_COPIED);
+    be64enc(data + 2 * TEST_CLUSTER_BYTES, TEST_REFBLOCK * TEST_CLUSTER_BYTES);
+    for (i = 0; i < TEST_FILE_CLUSTERS; i++) {
+        be16enc(data + TEST_REFBLOCK * TEST_CLUSTER_BYTES + i * 2, 1);
+    }
+
+    memset(data + 5 * TEST_CLUSTER_BYTES, 1, TEST_CLUSTER_BYTES);
+    memset(cluster, 4, sizeof(cluster));
+    memset(&stream, 0, sizeof(stream));
+    ATF_REQUIRE_EQ(Z_OK, deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -12, 8, Z_DEFAULT_STRATEGY));
+    stream.next_in = (Bytef *)cluster;
+    stream.avail_in = sizeof(cluster);
+    stream.next_out = data + compressed_offset;
+    stream.avail_out = TEST_CLUSTER_BYTES;
+    ATF_REQUIRE_EQ(Z_STREAM_END, deflate(&stream, Z_FINISH));
+    deflateEnd(&stream);
+
+    /* With 512 byte clusters, the compressed size is one sector. */
+    be64enc(data + 4 * TEST_CLUSTER_BYTES, 5 * TEST_CLUSTER_BYTES | ENTRY_COPIED);
+    be64enc(data + 4 * TEST_CLUSTER_BYTES + 8, ENTRY_ZERO);
+    be64enc(data + 4 * TEST_CLUSTER_BYTES + 24, compressed_offset | ENTRY_COMPRESSED);
+
+    strcpy(path, "qcow2image_test.XXXXXX");
+    fd = mkstemp(path);
+    ATF_REQUIRE(fd != -1);
+    ATF_REQUIRE_EQ(size, write(fd, data, size));
+    close(fd);
+    free(data);
+}
+
+ATF_TC_WITHOUT_HEAD(qcow2image_read__reads_clusters_through_the_tables);
+ATF_TC_BODY(qcow2image_read__reads_clusters_through_the_tables, tc)
+{
+    struct fileinterface *fi;
+    struct qcow2image *image;
+    char path[64];
+    char expected[TEST_CLUSTERS] = {1, 0, 0, 4};
+    char *buffer;
+    size_t size = TEST_CLUSTERS * TEST_CLUSTER_BYTES;
+    off_t offset;
+    size_t i;
+
+    write_testimage(path, 0);
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(LDI_CACHE_WRITEBACK, &fi)));
+    ATF_REQUIRE(!IS_ERROR(qcow2image_open(fi, path, &image, empty_logger)));
+    ATF_CHECK_EQ(size, qcow2image_size(image));
+
+    buffer = malloc(size);
+
+    /* Reads crossing any number of cluster boundaries see the right clusters. */
+    for (offset = 0; offset < size; offset += 100) {
+        memset(buffer, 0xAA, size);
+        ATF_REQUIRE(!IS_ERROR(qcow2image_read(image, buffer, size - offset, offset)));
+        for (i = 0; i < size - offset; i++) {
+            ATF_REQUIRE_EQ(expected[(offset + i) / TEST_CLUSTER_BYTES], buffer[i]);
+        }
+    }
+
+    free(buffer);
+    qcow2image_destroy(&image);
+    ATF_CHECK_EQ(NULL, image);
+    fileinterface_destroy(&fi);
+    unlink(path);
+}
+
+ATF_TC_WITHOUT_HEAD(qcow2image_write__allocates_counted_clusters_that_survive_reopening);
+ATF_TC_BODY(qcow2image_write__allocates_counted_clusters_that_survive_reopening, tc)
+{
+    struct fileinterface *fi;
+    struct qcow2image *image;
+    char path[64];
+    char expected[2 * TEST_CLUSTERS] = {1, 1, 0, 0, 9, 0, 9, 4};
+    uint8_t refcounts[2 * 2];
+    char *buffer;
+    size_t size = TEST_CLUSTERS * TEST_CLUSTER_BYTES;
+    size_t i;
+    int fd;
+
+    write_testimage(path, 0);
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(LDI_CACHE_WRITEBACK, &fi)));
+    ATF_REQUIRE(!IS_ERROR(qcow2image_open(fi, path, &image, empty_logger)));
+
+    buffer = malloc(size);
+    memset(buffer, 9, TEST_CLUSTER_BYTES);
+
+    /*
+     * Write the first half of the unallocated cluster and of the
+     * compressed cluster, which gets the rest of the old data.
+     */
+    ATF_REQUIRE(!IS_ERROR(qcow2image_write(image, buffer, TEST_CLUSTER_BYTES / 2, 2 * TEST_CLUSTER_BYTES)));
+    ATF_REQUIRE(!IS_ERROR(qcow2image_write(image, buffer, TEST_CLUSTER_BYTES / 2, 3 * TEST_CLUSTER_BYTES)));
+    ATF_REQUIRE(!IS_ERROR(qcow2image_flush(image)));
+    qcow2image_destroy(&image);
+
+    ATF_REQUIRE(!IS_ERROR(qcow2image_open(fi, path, &image, empty_logger)));
+    ATF_REQUIRE(!IS_ERROR(qcow2image_read(image, buffer, size, 0)));
+    for (i = 0; i < size; i++) {
+        ATF_REQUIRE_EQ(expected[i / (TEST_CLUSTER_BYTES / 2)], buffer[i]);
+    }
+    qcow2image_destroy(&image);
+
+    /* The two new clusters at the end of the file are counted. */
+    fd = open(path, O_RDONLY);
+    ATF_REQUIRE(fd != -1);
+    ATF_REQUIRE_EQ(sizeof(refcounts), pread(fd, refcounts, sizeof(refcounts),
+        TEST_REFBLOCK * TEST_CLUSTER_BYTES + TEST_FILE_CLUSTERS * 2));
+    ATF_CHECK_EQ(1, be16dec(refcounts));
+    ATF_CHECK_EQ(1, be16dec(refcounts + 2));
+    close(fd);
+
+    free(buffer);
+    fileinterface_destroy(&fi);
+    unlink(path);
+}
+
+ATF_TC_WITHOUT_HEAD(qcow2image_open__rejects_backing_files);
+ATF_TC_BODY(qcow2image_open__rejects_backing_files, tc)
+{
+    struct fileinterface *fi;
+    struct qcow2image *image;
+    char path[64];
+
+    write_testimage(path, QCOW2_HEADER_SIZE);
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(LDI_CACHE_WRITEBACK, &fi)));
+    ATF_CHECK_EQ(LDI_ERR_FILENOTSUP, qcow2image_open(fi, path, &image, empty_logger).code);
+
+    fileinterface_destroy(&fi);
+    unlink(path);
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+    ATF_TP_ADD_TC(tp, qcow2image_read__reads_clusters_through_the_tables);
+    ATF_TP_ADD_TC(tp, qcow2image_write__allocates_counted_clusters_that_survive_reopening);
+    ATF_TP_ADD_TC(tp, qcow2image_open__rejects_backing_files);
+
+    return 0;
+}
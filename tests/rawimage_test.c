@@ -0,0 +1,171 @@
+
+#include <atf-c.h>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Include the source files to test. */
+#include "blockcache.c"
+#include "bouncepool.c"
+#include "filemap.c"
+#include "fileinterface.c"
+#include "rawimage.c"
+
+void empty_log_write(int level, void *privarg, char *fmt, ...) { }
+
+struct logger empty_logger = {
+    .write = empty_log_write
+};
+
+#define TEST_CHUNK_SIZE (1024 * 1024)
+#define TEST_CHUNKS 4
+#define TEST_FILE_SIZE (TEST_CHUNKS * TEST_CHUNK_SIZE)
+
+/*
+ * Writes a sparse file of 4 MB where the first MB is filled with 1s and
+ * the third with 3s. The rest is holes, where the file system has them.
+ */
+static void
+write_testimage(char *path)
+{
+    char *data;
+    int fd;
+
+    data = malloc(TEST_CHUNK_SIZE);
+    ATF_REQUIRE(data != NULL);
+
+    strcpy(path, "rawimage_test.XXXXXX");
+    fd = mkstemp(path);
+    ATF_REQUIRE(fd != -1);
+    ATF_REQUIRE_EQ(0, ftruncate(fd, TEST_FILE_SIZE));
+    memset(data, 1, TEST_CHUNK_SIZE);
+    ATF_REQUIRE_EQ(TEST_CHUNK_SIZE, pwrite(fd, data, TEST_CHUNK_SIZE, 0));
+    memset(data, 3, TEST_CHUNK_SIZE);
+    ATF_REQUIRE_EQ(TEST_CHUNK_SIZE, pwrite(fd, data, TEST_CHUNK_SIZE, 2 * TEST_CHUNK_SIZE));
+    ATF_REQUIRE_EQ(0, fsync(fd));
+    close(fd);
+    free(data);
+}
+
+/*
+ * Checks that the whole image reads as the expected value for each MB.
+ */
+static void
+check_image(struct rawimage *image, char expected[TEST_CHUNKS])
+{
+    char *buffer;
+    off_t offset;
+    size_t i;
+
+    buffer = malloc(TEST_FILE_SIZE);
+    ATF_REQUIRE(buffer != NULL);
+
+    /* Reads crossing data and holes in any way see the right bytes. */
+    for (offset = 0; offset < TEST_FILE_SIZE; offset += 300000) {
+        memset(buffer, 0xAA, TEST_FILE_SIZE);
+        ATF_REQUIRE(!IS_ERROR(rawimage_read(image, buffer, TEST_FILE_SIZE - offset, offset)));
+        for (i = 0; i < TEST_FILE_SIZE - offset; i++) {
+            ATF_REQUIRE_EQ(expected[(offset + i) / TEST_CHUNK_SIZE], buffer[i]);
+        }
+    }
+
+    free(buffer);
+}
+
+ATF_TC_WITHOUT_HEAD(rawimage_read__reads_holes_as_zeros);
+ATF_TC_BODY(rawimage_read__reads_holes_as_zeros, tc)
+{
+    struct diskimage_options options = { .cache_mode = LDI_CACHE_WRITEBACK };
+    struct fileinterface *fi;
+    struct rawimage *image;
+    char path[64];
+    char expected[TEST_CHUNKS] = {1, 0, 3, 0};
+
+    write_testimage(path);
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(options.cache_mode, &fi)));
+    ATF_REQUIRE(!IS_ERROR(rawimage_open(fi, path, options, &image, empty_logger)));
+    ATF_CHECK_EQ(TEST_FILE_SIZE, rawimage_size(image));
+
+    check_image(image, expected);
+
+    rawimage_destroy(&image);
+    ATF_CHECK_EQ(NULL, image);
+    fileinterface_destroy(&fi);
+    unlink(path);
+}
+
+ATF_TC_WITHOUT_HEAD(rawimage_write__writes_into_holes);
+ATF_TC_BODY(rawimage_write__writes_into_holes, tc)
+{
+    struct diskimage_options options = { .cache_mode = LDI_CACHE_WRITEBACK };
+    struct fileinterface *fi;
+    struct rawimage *image;
+    char path[64];
+    char expected[TEST_CHUNKS] = {1, 9, 3, 0};
+    char *buffer;
+
+    write_testimage(path);
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(options.cache_mode, &fi)));
+    ATF_REQUIRE(!IS_ERROR(rawimage_open(fi, path, options, &image, empty_logger)));
+
+    /* The write is seen before and after it has been flushed. */
+    buffer = malloc(TEST_CHUNK_SIZE);
+    memset(buffer, 9, TEST_CHUNK_SIZE);
+    ATF_REQUIRE(!IS_ERROR(rawimage_write(image, buffer, TEST_CHUNK_SIZE, TEST_CHUNK_SIZE)));
+    check_image(image, expected);
+    ATF_REQUIRE(!IS_ERROR(rawimage_flush(image)));
+    check_image(image, expected);
+    rawimage_destroy(&image);
+
+    ATF_REQUIRE(!IS_ERROR(rawimage_open(fi, path, options, &image, empty_logger)));
+    check_image(image, expected);
+    rawimage_destroy(&image);
+
+    free(buffer);
+    fileinterface_destroy(&fi);
+    unlink(path);
+}
+
+ATF_TC_WITHOUT_HEAD(rawimage_discard__makes_ranges_read_as_zeros);
+ATF_TC_BODY(rawimage_discard__makes_ranges_read_as_zeros, tc)
+{
+    struct diskimage_options options = { .cache_mode = LDI_CACHE_NONE };
+    struct fileinterface *fi;
+    struct rawimage *image;
+    char path[64];
+    char expected[TEST_CHUNKS] = {1, 0, 0, 0};
+    bool allocated;
+    size_t length;
+
+    write_testimage(path);
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(options.cache_mode, &fi)));
+    ATF_REQUIRE(!IS_ERROR(rawimage_open(fi, path, options, &image, empty_logger)));
+
+    ATF_REQUIRE(!IS_ERROR(rawimage_map(image, TEST_CHUNK_SIZE, 2 * TEST_CHUNK_SIZE,
+        &allocated, &length)));
+    ATF_CHECK(allocated);
+    ATF_CHECK_EQ(TEST_CHUNK_SIZE, length);
+
+    ATF_REQUIRE(!IS_ERROR(rawimage_discard(image, TEST_CHUNK_SIZE, 2 * TEST_CHUNK_SIZE)));
+    check_image(image, expected);
+
+    /* Where the file system can't punch holes, the range is still data. */
+    ATF_REQUIRE(!IS_ERROR(rawimage_map(image, TEST_CHUNK_SIZE, 2 * TEST_CHUNK_SIZE,
+        &allocated, &length)));
+    ATF_CHECK(length > 0 && length <= TEST_CHUNK_SIZE);
+
+    rawimage_destroy(&image);
+    fileinterface_destroy(&fi);
+    unlink(path);
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+    ATF_TP_ADD_TC(tp, rawimage_read__reads_holes_as_zeros);
+    ATF_TP_ADD_TC(tp, rawimage_write__writes_into_holes);
+    ATF_TP_ADD_TC(tp, rawimage_discard__makes_ranges_read_as_zeros);
+
+    return 0;
+}
@@ -0,0 +1,182 @@
+
+#include <atf-c.h>
+
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Include the source files to test. */
+#include "blockcache.c"
+#include "bouncepool.c"
+#include "filemap.c"
+#include "fileinterface.c"
+#include "vdiheader.c"
+#include "vdiimage.c"
+
+void empty_log_write(int level, void *privarg, char *fmt, ...) { }
+
+struct logger empty_logger = {
+    .write = empty_log_write
+};
+
+#define TEST_BLOCK_SIZE 4096
+#define TEST_BLOCKS 4
+#define TEST_MAP_OFFSET 512
+#define TEST_DATA_OFFSET 1024
+#define TEST_FILE_SIZE (TEST_DATA_OFFSET + 2 * TEST_BLOCK_SIZE)
+
+/*
+ * Writes an image of the type with 4 blocks of 4 KB. Block 0 is filled
+ * with 1s, block 1 is a zero block, block 2 is not allocated and block 3
+ * is filled with 4s.
+ */
+static void
+write_testimage(char *path, uint32_t type)
+{
+    uint8_t *data;
+    int fd;
+
+    data = calloc(1, TEST_FILE_SIZE);
+    ATF_REQUIRE(data != NULL);
+
+    strcpy((char *)data, "<<< Oracle VM VirtualBox Disk Image >>>\n");
+    le32enc(data + SIGNATURE_OFFSET, VDI_SIGNATURE);
+    le32enc(data + VERSION_OFFSET, VDI_VERSION);
+    le32enc(data + HEADER_SIZE_OFFSET, 0x190);
+    le32enc(data + TYPE_OFFSET, type);
+    le32enc(data + BLOCKS_OFFSET_OFFSET, TEST_MAP_OFFSET);
+    le32enc(data + DATA_OFFSET_OFFSET, TEST_DATA_OFFSET);
+    le64enc(data + DISK_SIZE_OFFSET, TEST_BLOCKS * TEST_BLOCK_SIZE);
+    le32enc(data + BLOCK_SIZE_OFFSET, TEST_BLOCK_SIZE);
+    le32enc(data + BLOCKS_OFFSET, TEST_BLOCKS);
+    le32enc(data + BLOCKS_ALLOCATED_OFFSET, 2);
+
+    le32enc(data + TEST_MAP_OFFSET, 0);
+    le32enc(data + TEST_MAP_OFFSET + 4, VDI_BLOCK_ZERO);
+    le32enc(data + TEST_MAP_OFFSET + 8, VDI_BLOCK_FREE);
+    le32enc(data + TEST_MAP_OFFSET + 12, 1);
+    memset(data + TEST_DATA_OFFSET, 1, TEST_BLOCK_SIZE);
+    memset(data + TEST_DATA_OFFSET + TEST_BLOCK_SIZE, 4, TEST_BLOCK_SIZE);
+
+    strcpy(path, "vdiimage_test.XXXXXX");
+    fd = mkstemp(path);
+    ATF_REQUIRE(fd != -1);
+    ATF_REQUIRE_EQ(TEST_FILE_SIZE, write(fd, data, TEST_FILE_SIZE));
+    close(fd);
+    free(data);
+}
+
+ATF_TC_WITHOUT_HEAD(vdiimage_read__reads_blocks_through_the_block_map);
+ATF_TC_BODY(vdiimage_read__reads_blocks_through_the_block_map, tc)
+{
+    struct fileinterface *fi;
+    struct vdiimage *image;
+    char path[64];
+    char expected[TEST_BLOCKS] = {1, 0, 0, 4};
+    char *buffer;
+    size_t size = TEST_BLOCKS * TEST_BLOCK_SIZE;
+    off_t offset;
+    size_t i;
+
+    write_testimage(path, VDI_TYPE_DYNAMIC);
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(LDI_CACHE_WRITEBACK, &fi)));
+    ATF_REQUIRE(!IS_ERROR(vdiimage_open(fi, path, &image, empty_logger)));
+    ATF_CHECK_EQ(size, vdiimage_size(image));
+
+    buffer = malloc(size);
+
+    /* Reads crossing any number of block boundaries see the right blocks. */
+    for (offset = 0; offset < size; offset += 1000) {
+        memset(buffer, 0xAA, size);
+        ATF_REQUIRE(!IS_ERROR(vdiimage_read(image, buffer, size - offset, offset)));
+        for (i = 0; i < size - offset; i++) {
+            ATF_REQUIRE_EQ(expected[(offset + i) / TEST_BLOCK_SIZE], buffer[i]);
+        }
+    }
+
+    free(buffer);
+    vdiimage_destroy(&image);
+    ATF_CHECK_EQ(NULL, image);
+    fileinterface_destroy(&fi);
+    unlink(path);
+}
+
+ATF_TC_WITHOUT_HEAD(vdiimage_write__allocates_blocks_that_survive_reopening);
+ATF_TC_BODY(vdiimage_write__allocates_blocks_that_survive_reopening, tc)
+{
+    struct fileinterface *fi;
+    struct vdiimage *image;
+    struct stat sb;
+    char path[64];
+    char expected[2 * TEST_BLOCKS] = {1, 1, 0, 9, 9, 0, 4, 4};
+    uint8_t entries[2 * sizeof(uint32_t)];
+    char *buffer;
+    size_t size = TEST_BLOCKS * TEST_BLOCK_SIZE;
+    size_t i;
+    int fd;
+
+    write_testimage(path, VDI_TYPE_DYNAMIC);
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(LDI_CACHE_WRITEBACK, &fi)));
+    ATF_REQUIRE(!IS_ERROR(vdiimage_open(fi, path, &image, empty_logger)));
+
+    /* Write the second half of the zero block and the first half of the next. */
+    buffer = malloc(size);
+    memset(buffer, 9, TEST_BLOCK_SIZE);
+    ATF_REQUIRE(!IS_ERROR(vdiimage_write(image, buffer, TEST_BLOCK_SIZE,
+        TEST_BLOCK_SIZE + TEST_BLOCK_SIZE / 2)));
+    ATF_REQUIRE(!IS_ERROR(vdiimage_flush(image)));
+    vdiimage_destroy(&image);
+
+    ATF_REQUIRE(!IS_ERROR(vdiimage_open(fi, path, &image, empty_logger)));
+    ATF_REQUIRE(!IS_ERROR(vdiimage_read(image, buffer, size, 0)));
+    for (i = 0; i < size; i++) {
+        ATF_REQUIRE_EQ(expected[i / (TEST_BLOCK_SIZE / 2)], buffer[i]);
+    }
+    vdiimage_destroy(&image);
+
+    /*
+     * The two blocks were allocated together after the existing ones, and
+     * the rest of the batch the file was extended with was given back.
+     */
+    fd = open(path, O_RDONLY);
+    ATF_REQUIRE(fd != -1);
+    ATF_REQUIRE_EQ(sizeof(entries), pread(fd, entries, sizeof(entries), TEST_MAP_OFFSET + 4));
+    ATF_CHECK_EQ(2, le32dec(entries));
+    ATF_CHECK_EQ(3, le32dec(entries + 4));
+    ATF_REQUIRE_EQ(sizeof(uint32_t), pread(fd, entries, sizeof(uint32_t), BLOCKS_ALLOCATED_OFFSET));
+    ATF_CHECK_EQ(4, le32dec(entries));
+    ATF_REQUIRE_EQ(0, fstat(fd, &sb));
+    ATF_CHECK_EQ(TEST_DATA_OFFSET + 4 * TEST_BLOCK_SIZE, sb.st_size);
+    close(fd);
+
+    free(buffer);
+    fileinterface_destroy(&fi);
+    unlink(path);
+}
+
+ATF_TC_WITHOUT_HEAD(vdiimage_open__rejects_differencing_images);
+ATF_TC_BODY(vdiimage_open__rejects_differencing_images, tc)
+{
+    struct fileinterface *fi;
+    struct vdiimage *image;
+    char path[64];
+
+    write_testimage(path, VDI_TYPE_DIFF);
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(LDI_CACHE_WRITEBACK, &fi)));
+    ATF_CHECK_EQ(LDI_ERR_FILENOTSUP, vdiimage_open(fi, path, &image, empty_logger).code);
+
+    fileinterface_destroy(&fi);
+    unlink(path);
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+    ATF_TP_ADD_TC(tp, vdiimage_read__reads_blocks_through_the_block_map);
+    ATF_TP_ADD_TC(tp, vdiimage_write__allocates_blocks_that_survive_reopening);
+    ATF_TP_ADD_TC(tp, vdiimage_open__rejects_differencing_images);
+
+    return 0;
+}
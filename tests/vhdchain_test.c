@@ -0,0 +1,133 @@
+
+#include <atf-c.h>
+
+/* Include the source file to test. */
+#include "vhdchain.c"
+
+static int layer1, layer2;
+
+static struct vhdchain_run
+make_run(uint32_t sector, uint32_t count, void *layer, uint64_t file_offset)
+{
+    struct vhdchain_run run;
+
+    run.sector = sector;
+    run.count = count;
+    run.layer = layer;
+    run.file_offset = file_offset;
+
+    return run;
+}
+
+ATF_TC_WITHOUT_HEAD(vhdchain_lookup__returns_null_for_unresolved_block);
+ATF_TC_BODY(vhdchain_lookup__returns_null_for_unresolved_block, tc)
+{
+    struct vhdchain *chain;
+    LDI_ERROR res;
+
+    res = vhdchain_new(4, 16, &chain);
+    ATF_REQUIRE_EQ(LDI_ERR_NOERROR, res.code);
+
+    res = vhdchain_append(chain, 1, make_run(0, 16, &layer1, 0));
+    ATF_CHECK_EQ(LDI_ERR_NOERROR, res.code);
+
+    // The block is not resolved until it is marked as resolved.
+    ATF_CHECK_EQ(NULL, vhdchain_lookup(chain, 1, 0));
+    ATF_CHECK_EQ(NULL, vhdchain_lookup(chain, 2, 0));
+
+    vhdchain_resolved(chain, 1, true);
+    ATF_CHECK(vhdchain_lookup(chain, 1, 0) != NULL);
+
+    vhdchain_destroy(&chain);
+    ATF_CHECK_EQ(NULL, chain);
+}
+
+ATF_TC_WITHOUT_HEAD(vhdchain_append__merges_contiguous_runs);
+ATF_TC_BODY(vhdchain_append__merges_contiguous_runs, tc)
+{
+    struct vhdchain *chain;
+    struct vhdchain_run *run;
+
+    vhdchain_new(1, 16, &chain);
+    vhdchain_append(chain, 0, make_run(0, 4, &layer1, 1024));
+    vhdchain_append(chain, 0, make_run(4, 4, &layer1, 3072));
+    vhdchain_append(chain, 0, make_run(8, 4, &layer1, 8192));
+    vhdchain_append(chain, 0, make_run(12, 2, NULL, 0));
+    vhdchain_append(chain, 0, make_run(14, 2, NULL, 0));
+    vhdchain_resolved(chain, 0, true);
+
+    // The first two runs are contiguous in the file.
+    run = vhdchain_lookup(chain, 0, 7);
+    ATF_REQUIRE(run != NULL);
+    ATF_CHECK_EQ(0, run->sector);
+    ATF_CHECK_EQ(8, run->count);
+    ATF_CHECK_EQ(1024, run->file_offset);
+
+    run = vhdchain_lookup(chain, 0, 8);
+    ATF_REQUIRE(run != NULL);
+    ATF_CHECK_EQ(8, run->sector);
+    ATF_CHECK_EQ(4, run->count);
+    ATF_CHECK_EQ(8192, run->file_offset);
+
+    // Runs of zeros are always merged.
+    run = vhdchain_lookup(chain, 0, 15);
+    ATF_REQUIRE(run != NULL);
+    ATF_CHECK_EQ(12, run->sector);
+    ATF_CHECK_EQ(4, run->count);
+    ATF_CHECK_EQ(NULL, run->layer);
+
+    vhdchain_destroy(&chain);
+}
+
+ATF_TC_WITHOUT_HEAD(vhdchain_assign__splits_overlapped_runs);
+ATF_TC_BODY(vhdchain_assign__splits_overlapped_runs, tc)
+{
+    struct vhdchain *chain;
+    struct vhdchain_run *run;
+    LDI_ERROR res;
+
+    vhdchain_new(1, 16, &chain);
+    vhdchain_append(chain, 0, make_run(0, 8, &layer1, 0));
+    vhdchain_append(chain, 0, make_run(8, 8, NULL, 0));
+    vhdchain_resolved(chain, 0, true);
+
+    res = vhdchain_assign(chain, 0, make_run(6, 4, &layer2, 100 * 512));
+    ATF_CHECK_EQ(LDI_ERR_NOERROR, res.code);
+
+    run = vhdchain_lookup(chain, 0, 0);
+    ATF_REQUIRE(run != NULL);
+    ATF_CHECK_EQ(&layer1, run->layer);
+    ATF_CHECK_EQ(6, run->count);
+
+    run = vhdchain_lookup(chain, 0, 9);
+    ATF_REQUIRE(run != NULL);
+    ATF_CHECK_EQ(&layer2, run->layer);
+    ATF_CHECK_EQ(6, run->sector);
+    ATF_CHECK_EQ(4, run->count);
+
+    run = vhdchain_lookup(chain, 0, 10);
+    ATF_REQUIRE(run != NULL);
+    ATF_CHECK_EQ(NULL, run->layer);
+    ATF_CHECK_EQ(10, run->sector);
+    ATF_CHECK_EQ(6, run->count);
+
+    // A write in the middle of a run keeps the offset of the tail.
+    vhdchain_assign(chain, 0, make_run(2, 1, &layer2, 0));
+    run = vhdchain_lookup(chain, 0, 3);
+    ATF_REQUIRE(run != NULL);
+    ATF_CHECK_EQ(&layer1, run->layer);
+    ATF_CHECK_EQ(3, run->sector);
+    ATF_CHECK_EQ(3, run->count);
+    ATF_CHECK_EQ(3 * 512, run->file_offset);
+
+    vhdchain_destroy(&chain);
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+    ATF_TP_ADD_TC(tp, vhdchain_lookup__returns_null_for_unresolved_block);
+    ATF_TP_ADD_TC(tp, vhdchain_append__merges_contiguous_runs);
+    ATF_TP_ADD_TC(tp, vhdchain_assign__splits_overlapped_runs);
+
+    return 0;
+}
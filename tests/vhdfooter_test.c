@@ -17,6 +17,7 @@ void uuid_to_string_fake(const uuid_t *uuid, char **str, uint32_t *status);
 /* The following are dependencies of vhdfooter that we don't want to stub. */
 #include "vhdserialization.c"
 #include "vhdchecksum.c"
+#include "kernels.c"
 
 
 char valid_footer[512] = {
@@ -207,6 +208,21 @@ ATF_TC_BODY(vhdfooter_getstatus__handles_invalid_cookie, tc)
     check_memory();
 }
 
+ATF_TC_WITHOUT_HEAD(vhdfooter_valid__checks_cookie_and_checksum);
+ATF_TC_BODY(vhdfooter_valid__checks_cookie_and_checksum, tc)
+{
+    char footer[512];
+
+    ATF_CHECK(vhdfooter_valid(valid_footer));
+    ATF_CHECK(!vhdfooter_valid(invalid_footer));
+
+    /* A footer with the right checksum but the wrong cookie. */
+    memcpy(footer, valid_footer, sizeof(footer));
+    footer[3] = 0x64;
+    footer[67] += 1;
+    ATF_CHECK(!vhdfooter_valid(footer));
+}
+
 ATF_TP_ADD_TCS(tp)
 {
     ATF_TP_ADD_TC(tp, vhdfooter_new__correctly_reads_valid_data);
@@ -214,5 +230,6 @@ ATF_TP_ADD_TCS(tp)
     ATF_TP_ADD_TC(tp, vhdfooter_write__correctly_writes_data);
     ATF_TP_ADD_TC(tp, vhdfooter_new__returns_error_on_allocation_failure);
     ATF_TP_ADD_TC(tp, vhdfooter_getstatus__handles_invalid_cookie);
+    ATF_TP_ADD_TC(tp, vhdfooter_valid__checks_cookie_and_checksum);
     return 0;
 }
@@ -0,0 +1,158 @@
+
+#include <atf-c.h>
+#include <stdio.h>
+#include <uuid.h>
+
+#include <string.h>
+
+/* Include the source file to test. */
+#include "vhdheader.c"
+
+/* The following are dependencies of vhdheader that we don't want to stub. */
+#include "vhdserialization.c"
+#include "vhdchecksum.c"
+#include "kernels.c"
+
+void empty_log_write(int level, void *privarg, char *fmt, ...) { }
+
+struct logger empty_logger = {
+    .write = empty_log_write
+};
+
+/*
+ * Encodes an ASCII string as UTF-16 little endian, like the Windows
+ * parent locators. Returns the number of bytes.
+ */
+static uint32_t
+encode_utf16le(const char *source, char *destination)
+{
+    uint32_t i;
+
+    for (i = 0; source[i] != 0; i++) {
+        destination[i * 2] = source[i];
+        destination[i * 2 + 1] = 0;
+    }
+
+    return i * 2;
+}
+
+ATF_TC_WITHOUT_HEAD(vhd_parent_locator_decode__decodes_windows_paths);
+ATF_TC_BODY(vhd_parent_locator_decode__decodes_windows_paths, tc)
+{
+    char data[256];
+    char *path;
+    uint32_t length;
+    bool relative;
+
+    length = encode_utf16le(".\\images\\parent.vhd", data);
+    path = vhd_parent_locator_decode("W2ru", data, length, &relative);
+    ATF_REQUIRE(path != NULL);
+    ATF_CHECK_STREQ("images/parent.vhd", path);
+    ATF_CHECK(relative);
+    free(path);
+
+    length = encode_utf16le("C:\\images\\parent.vhd", data);
+    path = vhd_parent_locator_decode("W2ku", data, length, &relative);
+    ATF_REQUIRE(path != NULL);
+    ATF_CHECK_STREQ("/images/parent.vhd", path);
+    ATF_CHECK(!relative);
+    free(path);
+}
+
+ATF_TC_WITHOUT_HEAD(vhd_parent_locator_decode__decodes_file_urls);
+ATF_TC_BODY(vhd_parent_locator_decode__decodes_file_urls, tc)
+{
+    char data[] = "file://localhost/vm/golden%20image.vhd";
+    char *path;
+    bool relative;
+
+    path = vhd_parent_locator_decode("MacX", data, strlen(data), &relative);
+    ATF_REQUIRE(path != NULL);
+    ATF_CHECK_STREQ("/vm/golden image.vhd", path);
+    ATF_CHECK(!relative);
+    free(path);
+}
+
+ATF_TC_WITHOUT_HEAD(vhd_parent_locator_decode__rejects_unsupported_platforms);
+ATF_TC_BODY(vhd_parent_locator_decode__rejects_unsupported_platforms, tc)
+{
+    char data[] = "alias record";
+    bool relative;
+
+    ATF_CHECK(vhd_parent_locator_decode("Mac ", data, strlen(data), &relative) == NULL);
+    ATF_CHECK(vhd_parent_locator_decode("W2ru", data, 0, &relative) == NULL);
+}
+
+ATF_TC_WITHOUT_HEAD(vhd_parent_locator_encode__is_decoded_to_the_same_path);
+ATF_TC_BODY(vhd_parent_locator_encode__is_decoded_to_the_same_path, tc)
+{
+    char *data, *path;
+    uint32_t length;
+    bool relative;
+
+    data = vhd_parent_locator_encode("W2ru", "../images/parent.vhd", &length);
+    ATF_REQUIRE(data != NULL);
+    ATF_CHECK_EQ(40, length);
+    path = vhd_parent_locator_decode("W2ru", data, length, &relative);
+    ATF_REQUIRE(path != NULL);
+    ATF_CHECK_STREQ("../images/parent.vhd", path);
+    ATF_CHECK(relative);
+    free(path);
+    free(data);
+
+    // Relative paths are written with a leading ".\".
+    data = vhd_parent_locator_encode("W2ru", "parent.vhd", &length);
+    ATF_REQUIRE(data != NULL);
+    ATF_CHECK_EQ(24, length);
+    ATF_CHECK_EQ('.', data[0]);
+    ATF_CHECK_EQ('\\', data[2]);
+    free(data);
+
+    ATF_CHECK(vhd_parent_locator_encode("MacX", "/parent.vhd", &length) == NULL);
+}
+
+ATF_TC_WITHOUT_HEAD(vhd_header_write__writes_a_valid_child_header);
+ATF_TC_BODY(vhd_header_write__writes_a_valid_child_header, tc)
+{
+    struct vhd_header *header, *copy;
+    char buffer[1024];
+    char *code;
+    uint64_t data_offset;
+    uint32_t data_length, status;
+    uuid_t id, parent_id;
+
+    uuid_create(&id, &status);
+    LDI_ERROR res = vhd_header_new_child(1536, 100, 2 * 1024 * 1024, &id,
+        1234, "parent.vhd", &header, empty_logger);
+    ATF_REQUIRE_EQ(LDI_ERR_NOERROR, res.code);
+    vhd_header_set_parent_locator(header, 0, "W2ru", 512, 24, 2048);
+    vhd_header_write(header, buffer);
+
+    vhd_header_new(buffer, &copy, empty_logger);
+    ATF_CHECK(vhd_header_isvalid(copy));
+    ATF_CHECK_EQ(1536, vhd_header_table_offset(copy));
+    ATF_CHECK_EQ(100, vhd_header_max_table_entries(copy));
+    ATF_CHECK_EQ(2 * 1024 * 1024, vhd_header_block_size(copy));
+    ATF_CHECK_STREQ("parent.vhd", vhd_header_parent_name(copy));
+    vhd_header_parent_unique_id(copy, &parent_id);
+    ATF_CHECK(uuid_equal(&id, &parent_id, NULL));
+
+    ATF_REQUIRE(vhd_header_parent_locator(copy, 0, &code, &data_offset, &data_length));
+    ATF_CHECK_STREQ("W2ru", code);
+    ATF_CHECK_EQ(2048, data_offset);
+    ATF_CHECK_EQ(24, data_length);
+    ATF_CHECK(!vhd_header_parent_locator(copy, 1, &code, &data_offset, &data_length));
+
+    vhd_header_destroy(&copy);
+    vhd_header_destroy(&header);
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+    ATF_TP_ADD_TC(tp, vhd_parent_locator_decode__decodes_windows_paths);
+    ATF_TP_ADD_TC(tp, vhd_parent_locator_decode__decodes_file_urls);
+    ATF_TP_ADD_TC(tp, vhd_parent_locator_decode__rejects_unsupported_platforms);
+    ATF_TP_ADD_TC(tp, vhd_parent_locator_encode__is_decoded_to_the_same_path);
+    ATF_TP_ADD_TC(tp, vhd_header_write__writes_a_valid_child_header);
+    return 0;
+}
@@ -0,0 +1,795 @@
+
+#include <atf-c.h>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <uuid.h>
+
+#include "fileinterface.h"
+#include "memorytest.h"
+
+void uuid_to_string_fake(const uuid_t *uuid, char **str, uint32_t *status);
+LDI_ERROR file_sync_fake(struct file *file);
+
+/* Include the source files to test. */
+#include "blockcache.c"
+#include "bouncepool.c"
+#include "filemap.c"
+#include "fileinterface.c"
+#include "holemap.c"
+#include "kernels.c"
+#include "populator.c"
+#include "taskpool.c"
+#include "vhdbat.c"
+#include "vhdchecksum.c"
+#include "vhdserialization.c"
+
+/* vhdfooter.c has static functions and offsets named like others. */
+#define read_footer read_footer_fields
+#define calculate_checksum calculate_footer_checksum
+#define get_uuid_string get_footer_uuid_string
+#include "vhdfooter.c"
+#undef read_footer
+#undef calculate_checksum
+#undef get_uuid_string
+#undef COOKIE_OFFSET
+#undef DATA_OFFSET_OFFSET
+#undef CHECKSUM_OFFSET
+
+#include "vhdheader.c"
+#include "vhdinstance.c"
+/* Defines SECTOR_SIZE, which vhdinstance.c has as a variable. */
+#include "vhdchain.c"
+
+void empty_log_write(int level, void *privarg, char *fmt, ...) { }
+
+struct logger empty_logger = {
+    .write = empty_log_write
+};
+
+#define TEST_BLOCK_SIZE (64 * 1024)
+#define TEST_BLOCKS 16
+#define TEST_DISK_SIZE (TEST_BLOCKS * TEST_BLOCK_SIZE)
+#define TEST_HEADER_OFFSET 512
+#define TEST_BAT_OFFSET 1536
+/* The size of the images before any blocks are allocated. */
+#define TEST_EMPTY_SIZE (TEST_BAT_OFFSET + 512 + 512)
+/* The sector bitmap that starts each block. */
+#define TEST_BITMAP_SIZE 512
+
+/*
+ * Sets the checksum of a footer or a header, which is the one's
+ * complement of the sum of all its bytes.
+ */
+static void
+set_checksum(uint8_t *bytes, size_t size, size_t checksum_offset)
+{
+    uint32_t sum;
+    size_t i;
+
+    be32enc(bytes + checksum_offset, 0);
+    for (sum = 0, i = 0; i < size; i++) {
+        sum += bytes[i];
+    }
+    be32enc(bytes + checksum_offset, ~sum);
+}
+
+/*
+ * Writes an empty disk of the given type with TEST_BLOCKS blocks of
+ * TEST_BLOCK_SIZE to fd, with a unique id made from id. Differencing
+ * disks get the unique id and the name of their parent.
+ */
+static void
+write_image(int fd, uint8_t id, uint32_t type, uint8_t *parent_id, char *parent_name)
+{
+    uint8_t data[TEST_EMPTY_SIZE], *footer, *header;
+    size_t i;
+
+    bzero(data, sizeof(data));
+    footer = data;
+    memcpy(footer, "conectix", 8);
+    be32enc(footer + 8, 2);
+    be32enc(footer + 12, 0x00010000);
+    be64enc(footer + 16, TEST_HEADER_OFFSET);
+    memcpy(footer + 28, "test", 4);
+    be32enc(footer + 36, 0x5769326B);
+    be64enc(footer + 40, TEST_DISK_SIZE);
+    be64enc(footer + 48, TEST_DISK_SIZE);
+    be32enc(footer + 56, 0x00200410);
+    be32enc(footer + 60, type);
+    memset(footer + 68, id, 16);
+    set_checksum(footer, 512, 64);
+    memcpy(data + TEST_EMPTY_SIZE - 512, footer, 512);
+
+    header = data + TEST_HEADER_OFFSET;
+    memcpy(header, "cxsparse", 8);
+    be64enc(header + 8, UINT64_MAX);
+    be64enc(header + 16, TEST_BAT_OFFSET);
+    be32enc(header + 24, 0x00010000);
+    be32enc(header + 28, TEST_BLOCKS);
+    be32enc(header + 32, TEST_BLOCK_SIZE);
+    if (type == VHD_TYPE_DIFFERENCING) {
+        memcpy(header + 40, parent_id, 16);
+        /* The name is UTF-16 big endian. */
+        for (i = 0; parent_name[i] != 0; i++) {
+            header[64 + 2 * i + 1] = parent_name[i];
+        }
+    }
+    set_checksum(header, 1024, 36);
+
+    memset(data + TEST_BAT_OFFSET, 0xFF, TEST_BLOCKS * 4);
+
+    ATF_REQUIRE_EQ(sizeof(data), write(fd, data, sizeof(data)));
+}
+
+/*
+ * Writes an empty dynamic disk of TEST_BLOCKS blocks of TEST_BLOCK_SIZE,
+ * with a unique id made from id.
+ */
+static void
+create_dynamic(char *path, uint8_t id)
+{
+    int fd;
+
+    strcpy(path, "vhdinstance_test.XXXXXX");
+    fd = mkstemp(path);
+    ATF_REQUIRE(fd != -1);
+    write_image(fd, id, VHD_TYPE_DYNAMIC, NULL, NULL);
+    close(fd);
+}
+
+/*
+ * Opens the image at path with the default options.
+ */
+static struct vhdinstance *
+open_image(struct fileinterface *fi, char *path)
+{
+    struct diskimage_options options;
+    struct vhdinstance *instance;
+
+    bzero(&options, sizeof(options));
+    ATF_REQUIRE(!IS_ERROR(vhdinstance_new(fi, path, options, &instance, empty_logger)));
+
+    return instance;
+}
+
+/*
+ * Returns the size of the file at path.
+ */
+static off_t
+file_size(char *path)
+{
+    struct stat sb;
+
+    ATF_REQUIRE(stat(path, &sb) == 0);
+
+    return sb.st_size;
+}
+
+/*
+ * Reads nbytes at offset in the file at path.
+ */
+static void
+read_file(char *path, void *buffer, size_t nbytes, off_t offset)
+{
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    ATF_REQUIRE(fd != -1);
+    ATF_REQUIRE_EQ(nbytes, pread(fd, buffer, nbytes, offset));
+    close(fd);
+}
+
+/*
+ * Returns true if the file at path ends with a footer.
+ */
+static bool
+has_footer(char *path)
+{
+    uint8_t footer[512];
+
+    read_file(path, footer, sizeof(footer), file_size(path) - 512);
+
+    return memcmp(footer, "conectix", 8) == 0;
+}
+
+/*
+ * Returns the entry of the block in the BAT in the file at path.
+ */
+static uint32_t
+bat_entry(char *path, uint32_t block)
+{
+    uint8_t entry[4];
+
+    read_file(path, entry, sizeof(entry), TEST_BAT_OFFSET + block * 4);
+
+    return be32dec(entry);
+}
+
+/*
+ * Creates a differencing disk on top of the image at parent, with the
+ * path of the parent and a suffix.
+ */
+static void
+create_child(struct fileinterface *fi, char *parent, char *child)
+{
+    uint8_t parent_id[16];
+    int fd;
+
+    read_file(parent, parent_id, sizeof(parent_id), file_size(parent) - 512 + 68);
+    sprintf(child, "%s.child", parent);
+    fd = open(child, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ATF_REQUIRE(fd != -1);
+    write_image(fd, parent_id[0] + 1, VHD_TYPE_DIFFERENCING, parent_id, parent);
+    close(fd);
+}
+
+/*
+ * Fills nbytes of buffer with data that depends on value and on the
+ * offset of each sector in the disk.
+ */
+static void
+fill(char *buffer, size_t nbytes, off_t offset, int value)
+{
+    size_t i;
+
+    for (i = 0; i < nbytes; i++) {
+        buffer[i] = value + (offset + i) / 512;
+    }
+}
+
+void
+uuid_to_string_fake(const uuid_t *uuid, char **str, uint32_t *status)
+{
+    uuid_to_string(uuid, str, status);
+}
+
+/* The image that file_sync_fake records the state of. */
+static char *synced_path;
+static int nsyncs;
+static uint32_t synced_bat[3];
+static bool synced_footer[3];
+
+/*
+ * The differencing disk that file_sync_fake writes to, the number of
+ * writes left and the expected data of the disk.
+ */
+static struct vhdinstance *written_child;
+static int nwrites;
+static char *written_data;
+
+/*
+ * Records the BAT entry of block 0 and if there is a footer at the end of
+ * the file at each sync made by a flush. Also writes to written_child, so
+ * that commits see writes between their flushes of the parent.
+ */
+LDI_ERROR
+file_sync_fake(struct file *file)
+{
+    off_t offset;
+
+    if (synced_path != NULL && nsyncs < 3) {
+        synced_bat[nsyncs] = bat_entry(synced_path, 0);
+        synced_footer[nsyncs] = has_footer(synced_path);
+        nsyncs++;
+    }
+    if (written_child != NULL && nwrites > 0) {
+        nwrites--;
+        offset = (nwrites * 5 % TEST_BLOCKS) * TEST_BLOCK_SIZE + nwrites * 1000;
+        fill(written_data + offset, 3000, offset, 100 + nwrites);
+        ATF_REQUIRE(!IS_ERROR(vhdinstance_write(written_child, written_data + offset,
+            3000, offset)));
+    }
+
+    return file_sync(file);
+}
+
+/*
+ * Returns the commit options with the given number of workers and batch
+ * size.
+ */
+static struct diskimage_commit_options
+commit_options(int workers, size_t batch_size)
+{
+    struct diskimage_commit_options options;
+
+    bzero(&options, sizeof(options));
+    options.workers = workers;
+    options.batch_size = batch_size;
+
+    return options;
+}
+
+/*
+ * Returns true if the image at path reads as expected.
+ */
+static bool
+reads_as(struct fileinterface *fi, char *path, char *expected)
+{
+    struct vhdinstance *instance;
+    char *read;
+    bool result;
+
+    read = malloc(TEST_DISK_SIZE);
+    ATF_REQUIRE(read != NULL);
+    instance = open_image(fi, path);
+    ATF_REQUIRE(!IS_ERROR(vhdinstance_read(instance, read, TEST_DISK_SIZE, 0)));
+    result = memcmp(expected, read, TEST_DISK_SIZE) == 0;
+    vhdinstance_destroy(&instance);
+    free(read);
+
+    return result;
+}
+
+/*
+ * Saves a checkpoint of the child as if a commit was interrupted after
+ * copying all data stored before offset in the file.
+ */
+static void
+save_checkpoint(struct vhdinstance *child, uint64_t offset)
+{
+    struct commit *commit;
+
+    ATF_REQUIRE(!IS_ERROR(new_commit(child, &commit)));
+    commit->offset = offset;
+    child->commit = commit;
+    ATF_REQUIRE(!IS_ERROR(write_checkpoint(child)));
+    end_commit(child);
+}
+
+ATF_TC_WITHOUT_HEAD(vhdinstance_flush__writes_data_then_bat_then_footer);
+ATF_TC_BODY(vhdinstance_flush__writes_data_then_bat_then_footer, tc)
+{
+    struct fileinterface *fi;
+    struct vhdinstance *instance;
+    char path[64];
+    char block[TEST_BLOCK_SIZE], read[TEST_BLOCK_SIZE];
+
+    create_dynamic(path, 1);
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(LDI_CACHE_WRITEBACK, &fi)));
+    instance = open_image(fi, path);
+
+    /* The new block takes the place of the footer, which isn't moved yet. */
+    memset(block, 7, sizeof(block));
+    ATF_REQUIRE(!IS_ERROR(vhdinstance_write(instance, block, sizeof(block), 0)));
+    ATF_CHECK_EQ(UINT32_MAX, bat_entry(path, 0));
+    ATF_CHECK(!has_footer(path));
+
+    synced_path = path;
+    ATF_REQUIRE(!IS_ERROR(vhdinstance_flush(instance)));
+    synced_path = NULL;
+
+    /* The data is synced first, then the BAT and last the footer. */
+    ATF_REQUIRE_EQ(3, nsyncs);
+    ATF_CHECK_EQ(UINT32_MAX, synced_bat[0]);
+    ATF_CHECK(!synced_footer[0]);
+    ATF_CHECK_EQ((TEST_EMPTY_SIZE - 512) / 512, synced_bat[1]);
+    ATF_CHECK(!synced_footer[1]);
+    ATF_CHECK(synced_footer[2]);
+    read_file(path, read, sizeof(read), TEST_EMPTY_SIZE - 512 + TEST_BITMAP_SIZE);
+    ATF_CHECK(memcmp(block, read, sizeof(block)) == 0);
+
+    vhdinstance_destroy(&instance);
+    fileinterface_destroy(&fi);
+    unlink(path);
+}
+
+ATF_TC_WITHOUT_HEAD(vhdinstance_open__restores_a_missing_footer);
+ATF_TC_BODY(vhdinstance_open__restores_a_missing_footer, tc)
+{
+    struct fileinterface *fi;
+    struct vhdinstance *instance;
+    char path[64];
+    char block[TEST_BLOCK_SIZE], read[TEST_BLOCK_SIZE];
+    off_t size;
+
+    create_dynamic(path, 1);
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(LDI_CACHE_WRITEBACK, &fi)));
+    instance = open_image(fi, path);
+    memset(block, 7, sizeof(block));
+    ATF_REQUIRE(!IS_ERROR(vhdinstance_write(instance, block, sizeof(block), TEST_BLOCK_SIZE)));
+    ATF_REQUIRE(!IS_ERROR(vhdinstance_flush(instance)));
+    vhdinstance_destroy(&instance);
+    size = file_size(path);
+
+    /* A file extended for a new block, but never flushed. */
+    ATF_REQUIRE(truncate(path, size + TEST_BITMAP_SIZE + TEST_BLOCK_SIZE) == 0);
+    instance = open_image(fi, path);
+    ATF_CHECK(instance->footer_dirty);
+    ATF_REQUIRE(!IS_ERROR(vhdinstance_flush(instance)));
+    vhdinstance_destroy(&instance);
+    ATF_CHECK(has_footer(path));
+
+    instance = open_image(fi, path);
+    ATF_CHECK(!instance->footer_dirty);
+    ATF_REQUIRE(!IS_ERROR(vhdinstance_read(instance, read, sizeof(read), TEST_BLOCK_SIZE)));
+    ATF_CHECK(memcmp(block, read, sizeof(read)) == 0);
+    vhdinstance_destroy(&instance);
+
+    /* A truncated file gets the footer after the data, not over it. */
+    ATF_REQUIRE(truncate(path, size - 512) == 0);
+    instance = open_image(fi, path);
+    ATF_CHECK(instance->footer_dirty);
+    vhdinstance_destroy(&instance);
+    ATF_CHECK_EQ(size, file_size(path));
+    ATF_CHECK(has_footer(path));
+
+    instance = open_image(fi, path);
+    ATF_REQUIRE(!IS_ERROR(vhdinstance_read(instance, read, sizeof(read), TEST_BLOCK_SIZE)));
+    ATF_CHECK(memcmp(block, read, sizeof(read)) == 0);
+    vhdinstance_destroy(&instance);
+
+    fileinterface_destroy(&fi);
+    unlink(path);
+}
+
+ATF_TC_WITHOUT_HEAD(vhdinstance_write__writes_differencing_disks_over_the_parent);
+ATF_TC_BODY(vhdinstance_write__writes_differencing_disks_over_the_parent, tc)
+{
+    struct fileinterface *fi;
+    struct vhdinstance *parent, *child;
+    char parent_path[64], child_path[80];
+    char *expected, *read;
+    uint8_t bitmap[TEST_BLOCK_SIZE / 512 / 8];
+    uint32_t entry;
+    size_t i;
+
+    expected = malloc(TEST_DISK_SIZE);
+    read = malloc(TEST_DISK_SIZE);
+    ATF_REQUIRE(expected != NULL && read != NULL);
+    bzero(expected, TEST_DISK_SIZE);
+
+    /* A parent with blocks 0 and 2. */
+    create_dynamic(parent_path, 1);
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(LDI_CACHE_WRITEBACK, &fi)));
+    parent = open_image(fi, parent_path);
+    fill(expected, TEST_BLOCK_SIZE, 0, 1);
+    fill(expected + 2 * TEST_BLOCK_SIZE, TEST_BLOCK_SIZE, 2 * TEST_BLOCK_SIZE, 2);
+    ATF_REQUIRE(!IS_ERROR(vhdinstance_write(parent, expected, 3 * TEST_BLOCK_SIZE, 0)));
+    vhdinstance_destroy(&parent);
+
+    /* Dynamic disks mark all sectors of their blocks as present. */
+    entry = bat_entry(parent_path, 0);
+    read_file(parent_path, bitmap, sizeof(bitmap), (off_t)entry * 512);
+    for (i = 0; i < sizeof(bitmap); i++) {
+        ATF_CHECK_EQ(0xFF, bitmap[i]);
+    }
+
+    /* An empty child reads as the parent. */
+    create_child(fi, parent_path, child_path);
+    child = open_image(fi, child_path);
+    ATF_REQUIRE(child->parent != NULL);
+    ATF_REQUIRE(!IS_ERROR(vhdinstance_read(child, read, TEST_DISK_SIZE, 0)));
+    ATF_CHECK(memcmp(expected, read, TEST_DISK_SIZE) == 0);
+
+    /*
+     * Part of a sector of block 0, a block that the parent doesn't have,
+     * and sectors across the end of block 2.
+     */
+    fill(expected + 600, 100, 600, 9);
+    fill(expected + TEST_BLOCK_SIZE, TEST_BLOCK_SIZE, TEST_BLOCK_SIZE, 5);
+    fill(expected + 3 * TEST_BLOCK_SIZE - 1024, 2048, 3 * TEST_BLOCK_SIZE - 1024, 7);
+    ATF_REQUIRE(!IS_ERROR(vhdinstance_write(child, expected + 600, 100, 600)));
+    ATF_REQUIRE(!IS_ERROR(vhdinstance_write(child, expected + TEST_BLOCK_SIZE,
+        TEST_BLOCK_SIZE, TEST_BLOCK_SIZE)));
+    ATF_REQUIRE(!IS_ERROR(vhdinstance_write(child, expected + 3 * TEST_BLOCK_SIZE - 1024,
+        2048, 3 * TEST_BLOCK_SIZE - 1024)));
+    ATF_REQUIRE(!IS_ERROR(vhdinstance_read(child, read, TEST_DISK_SIZE, 0)));
+    ATF_CHECK(memcmp(expected, read, TEST_DISK_SIZE) == 0);
+    ATF_REQUIRE(!IS_ERROR(vhdinstance_flush(child)));
+    vhdinstance_destroy(&child);
+
+    /* Only the sectors that were written are present in the child. */
+    entry = bat_entry(child_path, 0);
+    ATF_REQUIRE(entry != UINT32_MAX);
+    read_file(child_path, bitmap, sizeof(bitmap), (off_t)entry * 512);
+    ATF_CHECK_EQ(0x40, bitmap[0]);
+    for (i = 1; i < sizeof(bitmap); i++) {
+        ATF_CHECK_EQ(0, bitmap[i]);
+    }
+
+    /* The writes survive reopening, and the parent is unchanged. */
+    child = open_image(fi, child_path);
+    ATF_REQUIRE(!IS_ERROR(vhdinstance_read(child, read, TEST_DISK_SIZE, 0)));
+    ATF_CHECK(memcmp(expected, read, TEST_DISK_SIZE) == 0);
+    vhdinstance_destroy(&child);
+    parent = open_image(fi, parent_path);
+    ATF_REQUIRE(!IS_ERROR(vhdinstance_read(parent, read, TEST_BLOCK_SIZE, 0)));
+    fill(expected, TEST_BLOCK_SIZE, 0, 1);
+    ATF_CHECK(memcmp(expected, read, TEST_BLOCK_SIZE) == 0);
+    vhdinstance_destroy(&parent);
+
+    free(expected);
+    free(read);
+    fileinterface_destroy(&fi);
+    unlink(child_path);
+    unlink(parent_path);
+}
+
+ATF_TC_WITHOUT_HEAD(vhdinstance_open__leaves_shared_parents_unchanged);
+ATF_TC_BODY(vhdinstance_open__leaves_shared_parents_unchanged, tc)
+{
+    struct fileinterface *fi;
+    struct vhdinstance *parent, *child;
+    char parent_path[64], child_path[80];
+    char block[TEST_BLOCK_SIZE], read[TEST_BLOCK_SIZE];
+    off_t size;
+
+    create_dynamic(parent_path, 1);
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(LDI_CACHE_WRITEBACK, &fi)));
+    parent = open_image(fi, parent_path);
+    fill(block, TEST_BLOCK_SIZE, 0, 1);
+    ATF_REQUIRE(!IS_ERROR(vhdinstance_write(parent, block, TEST_BLOCK_SIZE, 0)));
+    vhdinstance_destroy(&parent);
+    create_child(fi, parent_path, child_path);
+
+    /* A parent without the footer at the end. */
+    size = file_size(parent_path) - 512;
+    ATF_REQUIRE(truncate(parent_path, size) == 0);
+
+    child = open_image(fi, child_path);
+    ATF_REQUIRE(child->parent != NULL);
+    ATF_CHECK(child->parent->shared);
+    ATF_CHECK(!child->parent->footer_dirty);
+    ATF_REQUIRE(!IS_ERROR(vhdinstance_read(child, read, TEST_BLOCK_SIZE, 0)));
+    ATF_CHECK(memcmp(block, read, TEST_BLOCK_SIZE) == 0);
+
+    /* Logging from the parent works after the child is gone. */
+    LOG_VERBOSE(child->parent->logger, "The parent is still open.\n");
+    vhdinstance_destroy(&child);
+
+    /* The parent is destroyed with the child, without being written. */
+    ATF_CHECK_EQ(size, file_size(parent_path));
+    ATF_CHECK(!has_footer(parent_path));
+
+    fileinterface_destroy(&fi);
+    unlink(child_path);
+    unlink(parent_path);
+}
+
+ATF_TC_WITHOUT_HEAD(vhdinstance_commit__writes_the_child_into_the_parent);
+ATF_TC_BODY(vhdinstance_commit__writes_the_child_into_the_parent, tc)
+{
+    struct fileinterface *fi;
+    struct vhdinstance *parent, *child;
+    char parent_path[64], child_path[80], checkpoint[96];
+    char *expected;
+
+    expected = malloc(TEST_DISK_SIZE);
+    ATF_REQUIRE(expected != NULL);
+    bzero(expected, TEST_DISK_SIZE);
+
+    create_dynamic(parent_path, 1);
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(LDI_CACHE_WRITEBACK, &fi)));
+    parent = open_image(fi, parent_path);
+    fill(expected, 2 * TEST_BLOCK_SIZE, 0, 1);
+    ATF_REQUIRE(!IS_ERROR(vhdinstance_write(parent, expected, 2 * TEST_BLOCK_SIZE, 0)));
+    vhdinstance_destroy(&parent);
+
+    /* Parts of sectors over the parent, and blocks it doesn't have. */
+    create_child(fi, parent_path, child_path);
+    child = open_image(fi, child_path);
+    fill(expected + 600, 100, 600, 9);
+    fill(expected + TEST_BLOCK_SIZE - 512, 3 * TEST_BLOCK_SIZE, TEST_BLOCK_SIZE - 512, 5);
+    fill(expected + 9 * TEST_BLOCK_SIZE + 10, 20, 9 * TEST_BLOCK_SIZE + 10, 7);
+    ATF_REQUIRE(!IS_ERROR(vhdinstance_write(child, expected + 600, 100, 600)));
+    ATF_REQUIRE(!IS_ERROR(vhdinstance_write(child, expected + TEST_BLOCK_SIZE - 512,
+        3 * TEST_BLOCK_SIZE, TEST_BLOCK_SIZE - 512)));
+    ATF_REQUIRE(!IS_ERROR(vhdinstance_write(child, expected + 9 * TEST_BLOCK_SIZE + 10,
+        20, 9 * TEST_BLOCK_SIZE + 10)));
+
+    ATF_REQUIRE(!IS_ERROR(vhdinstance_commit(child, commit_options(0, 0))));
+    vhdinstance_destroy(&child);
+
+    /* The parent reads as the child did, and nothing is left to resume. */
+    ATF_CHECK(reads_as(fi, parent_path, expected));
+    ATF_CHECK(reads_as(fi, child_path, expected));
+    sprintf(checkpoint, "%s.commit", child_path);
+    ATF_CHECK(access(checkpoint, F_OK) == -1);
+
+    free(expected);
+    fileinterface_destroy(&fi);
+    unlink(child_path);
+    unlink(parent_path);
+}
+
+ATF_TC_WITHOUT_HEAD(vhdinstance_commit__refuses_parents_shared_with_other_children);
+ATF_TC_BODY(vhdinstance_commit__refuses_parents_shared_with_other_children, tc)
+{
+    struct fileinterface *fi, *other_fi;
+    struct vhdinstance *child, *other;
+    char parent_path[64], child_path[80], other_path[80];
+    char block[TEST_BLOCK_SIZE], read[TEST_BLOCK_SIZE];
+
+    create_dynamic(parent_path, 1);
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(LDI_CACHE_WRITEBACK, &fi)));
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(LDI_CACHE_NONE, &other_fi)));
+    create_child(fi, parent_path, other_path);
+    sprintf(child_path, "%s.other", parent_path);
+    ATF_REQUIRE(rename(other_path, child_path) == 0);
+    strcpy(other_path, child_path);
+    create_child(fi, parent_path, child_path);
+
+    child = open_image(fi, child_path);
+    fill(block, TEST_BLOCK_SIZE, 0, 3);
+    ATF_REQUIRE(!IS_ERROR(vhdinstance_write(child, block, TEST_BLOCK_SIZE, 0)));
+
+    /* Another child uses the parent, even with another cache mode. */
+    other = open_image(other_fi, other_path);
+    ATF_CHECK(IS_ERROR(vhdinstance_commit(child, commit_options(0, 0))));
+    vhdinstance_destroy(&other);
+
+    ATF_REQUIRE(!IS_ERROR(vhdinstance_commit(child, commit_options(0, 0))));
+
+    /* Children opened after the commit don't see the old parent. */
+    other = open_image(fi, other_path);
+    ATF_CHECK(other->parent != child->parent);
+    ATF_REQUIRE(!IS_ERROR(vhdinstance_read(other, read, TEST_BLOCK_SIZE, 0)));
+    ATF_CHECK(memcmp(block, read, TEST_BLOCK_SIZE) == 0);
+    vhdinstance_destroy(&other);
+    vhdinstance_destroy(&child);
+
+    fileinterface_destroy(&other_fi);
+    fileinterface_destroy(&fi);
+    unlink(other_path);
+    unlink(child_path);
+    unlink(parent_path);
+}
+
+ATF_TC_WITHOUT_HEAD(vhdinstance_commit__serializes_the_writes_of_workers);
+ATF_TC_BODY(vhdinstance_commit__serializes_the_writes_of_workers, tc)
+{
+    struct fileinterface *fi;
+    struct vhdinstance *child;
+    char parent_path[64], child_path[80];
+    char *expected;
+    uint32_t random;
+    size_t nbytes;
+    off_t offset;
+    int i;
+
+    expected = malloc(TEST_DISK_SIZE);
+    ATF_REQUIRE(expected != NULL);
+    bzero(expected, TEST_DISK_SIZE);
+
+    /* Every batch allocates a block in the empty, dynamic parent. */
+    create_dynamic(parent_path, 1);
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(LDI_CACHE_WRITEBACK, &fi)));
+    create_child(fi, parent_path, child_path);
+    child = open_image(fi, child_path);
+    random = 1;
+    for (i = 0; i < 2000; i++) {
+        random = random * 1103515245 + 12345;
+        offset = (random >> 8) % TEST_DISK_SIZE;
+        nbytes = MIN(1 + random % 8192, TEST_DISK_SIZE - offset);
+        fill(expected + offset, nbytes, offset, i);
+        ATF_REQUIRE(!IS_ERROR(vhdinstance_write(child, expected + offset, nbytes, offset)));
+    }
+
+    ATF_REQUIRE(!IS_ERROR(vhdinstance_commit(child, commit_options(4, 65536))));
+    vhdinstance_destroy(&child);
+    ATF_CHECK(reads_as(fi, parent_path, expected));
+
+    free(expected);
+    fileinterface_destroy(&fi);
+    unlink(child_path);
+    unlink(parent_path);
+}
+
+ATF_TC_WITHOUT_HEAD(vhdinstance_commit__resumes_from_a_checkpoint);
+ATF_TC_BODY(vhdinstance_commit__resumes_from_a_checkpoint, tc)
+{
+    struct fileinterface *fi;
+    struct vhdinstance *child;
+    char parent_path[64], child_path[80];
+    char *data, *expected;
+    uint32_t second;
+
+    data = malloc(TEST_DISK_SIZE);
+    expected = malloc(TEST_DISK_SIZE);
+    ATF_REQUIRE(data != NULL && expected != NULL);
+    fill(data, TEST_DISK_SIZE, 0, 3);
+
+    create_dynamic(parent_path, 1);
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(LDI_CACHE_WRITEBACK, &fi)));
+    create_child(fi, parent_path, child_path);
+    child = open_image(fi, child_path);
+    ATF_REQUIRE(!IS_ERROR(vhdinstance_write(child, data, TEST_BLOCK_SIZE, 0)));
+    ATF_REQUIRE(!IS_ERROR(vhdinstance_write(child, data + 5 * TEST_BLOCK_SIZE,
+        TEST_BLOCK_SIZE, 5 * TEST_BLOCK_SIZE)));
+    ATF_REQUIRE(!IS_ERROR(vhdinstance_flush(child)));
+    second = vhd_bat_get_block_offset(child->bat, 5);
+
+    /* A commit interrupted after copying block 0 doesn't copy it again. */
+    save_checkpoint(child, (uint64_t)second * 512);
+    vhdinstance_destroy(&child);
+    child = open_image(fi, child_path);
+    ATF_REQUIRE(!IS_ERROR(vhdinstance_commit(child, commit_options(0, 0))));
+    bzero(expected, TEST_DISK_SIZE);
+    memcpy(expected + 5 * TEST_BLOCK_SIZE, data + 5 * TEST_BLOCK_SIZE, TEST_BLOCK_SIZE);
+    ATF_CHECK(reads_as(fi, parent_path, expected));
+
+    /* A write made while no commit runs removes the checkpoint. */
+    save_checkpoint(child, (uint64_t)second * 512);
+    fill(data, 512, 0, 4);
+    ATF_REQUIRE(!IS_ERROR(vhdinstance_write(child, data, 512, 0)));
+    ATF_REQUIRE(!IS_ERROR(vhdinstance_commit(child, commit_options(0, 0))));
+    memcpy(expected, data, TEST_BLOCK_SIZE);
+    ATF_CHECK(reads_as(fi, parent_path, expected));
+
+    /* Blocks allocated after the checkpoint was saved also make it stale. */
+    save_checkpoint(child, (uint64_t)second * 512);
+    child->checkpoint_stale = false;
+    fill(data, 512, 0, 5);
+    ATF_REQUIRE(!IS_ERROR(vhdinstance_write(child, data, 512, 0)));
+    ATF_REQUIRE(!IS_ERROR(vhdinstance_write(child, data + 9 * TEST_BLOCK_SIZE, 512,
+        9 * TEST_BLOCK_SIZE)));
+    ATF_REQUIRE(!IS_ERROR(vhdinstance_commit(child, commit_options(0, 0))));
+    memcpy(expected, data, 512);
+    memcpy(expected + 9 * TEST_BLOCK_SIZE, data + 9 * TEST_BLOCK_SIZE, 512);
+    ATF_CHECK(reads_as(fi, parent_path, expected));
+    vhdinstance_destroy(&child);
+
+    free(data);
+    free(expected);
+    fileinterface_destroy(&fi);
+    unlink(child_path);
+    unlink(parent_path);
+}
+
+ATF_TC_WITHOUT_HEAD(vhdinstance_commit__copies_writes_made_during_the_commit);
+ATF_TC_BODY(vhdinstance_commit__copies_writes_made_during_the_commit, tc)
+{
+    struct fileinterface *fi;
+    struct vhdinstance *child;
+    char parent_path[64], child_path[80];
+    char *expected;
+
+    expected = malloc(TEST_DISK_SIZE);
+    ATF_REQUIRE(expected != NULL);
+    bzero(expected, TEST_DISK_SIZE);
+
+    create_dynamic(parent_path, 1);
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(LDI_CACHE_WRITEBACK, &fi)));
+    create_child(fi, parent_path, child_path);
+    child = open_image(fi, child_path);
+    fill(expected, 2 * TEST_BLOCK_SIZE, 0, 1);
+    ATF_REQUIRE(!IS_ERROR(vhdinstance_write(child, expected, 2 * TEST_BLOCK_SIZE, 0)));
+
+    /*
+     * The child is written each time the parent is synced, which keeps
+     * the commit going for more than COMMIT_PASSES passes.
+     */
+    written_child = child;
+    written_data = expected;
+    nwrites = 8 * COMMIT_PASSES;
+    ATF_REQUIRE(!IS_ERROR(vhdinstance_commit(child, commit_options(2, 65536))));
+    written_child = NULL;
+    ATF_CHECK_EQ(0, nwrites);
+
+    vhdinstance_destroy(&child);
+    ATF_CHECK(reads_as(fi, child_path, expected));
+    ATF_CHECK(reads_as(fi, parent_path, expected));
+
+    free(expected);
+    fileinterface_destroy(&fi);
+    unlink(child_path);
+    unlink(parent_path);
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+    ATF_TP_ADD_TC(tp, vhdinstance_flush__writes_data_then_bat_then_footer);
+    ATF_TP_ADD_TC(tp, vhdinstance_open__restores_a_missing_footer);
+    ATF_TP_ADD_TC(tp, vhdinstance_write__writes_differencing_disks_over_the_parent);
+    ATF_TP_ADD_TC(tp, vhdinstance_open__leaves_shared_parents_unchanged);
+    ATF_TP_ADD_TC(tp, vhdinstance_commit__writes_the_child_into_the_parent);
+    ATF_TP_ADD_TC(tp, vhdinstance_commit__refuses_parents_shared_with_other_children);
+    ATF_TP_ADD_TC(tp, vhdinstance_commit__serializes_the_writes_of_workers);
+    ATF_TP_ADD_TC(tp, vhdinstance_commit__resumes_from_a_checkpoint);
+    ATF_TP_ADD_TC(tp, vhdinstance_commit__copies_writes_made_during_the_commit);
+
+    return 0;
+}
@@ -0,0 +1,493 @@
+
+#include <atf-c.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Include the source files to test. */
+#include "blockcache.c"
+#include "bouncepool.c"
+#include "filemap.c"
+#include "fileinterface.c"
+#include "kernels.c"
+#include "vhdchecksum.c"
+#include "vhdheader.c"
+#include "vhdserialization.c"
+#include "vhdxchecksum.c"
+#include "vhdxheader.c"
+#include "vhdxinstance.c"
+#include "vhdxlog.c"
+#include "vhdxmetadata.c"
+
+void empty_log_write(int level, void *privarg, char *fmt, ...) { }
+
+struct logger empty_logger = {
+    .write = empty_log_write
+};
+
+#define TEST_BLOCK_SIZE MB
+#define TEST_BLOCKS 4
+#define TEST_LOG_OFFSET (1 * MB)
+#define TEST_METADATA_OFFSET (2 * MB)
+#define TEST_BAT_OFFSET (3 * MB)
+#define TEST_FILE_SIZE (6 * MB)
+/* The BAT entry of the sector bitmap block of differencing disks. */
+#define TEST_BITMAP_INDEX 4096
+#define TEST_LINKAGE "5a2e7f0c-3b1d-4c6e-9f8a-1d2c3b4a5e6f"
+
+/*
+ * Adds an item to the metadata table at index, with its data at offset in
+ * the metadata region.
+ */
+static void
+add_metadata_item(uint8_t *metadata, int index, const uuid_t *guid, uint32_t offset, uint32_t length)
+{
+    uint8_t *entry = metadata + TABLE_ENTRIES_OFFSET + index * TABLE_ENTRY_SIZE;
+
+    uuid_enc_le(entry + TABLE_ENTRY_ITEM_ID_OFFSET, guid);
+    le32enc(entry + TABLE_ENTRY_OFFSET_OFFSET, offset);
+    le32enc(entry + TABLE_ENTRY_LENGTH_OFFSET, length);
+    le32enc(entry + TABLE_ENTRY_FLAGS_OFFSET, TABLE_ENTRY_FLAG_REQUIRED);
+}
+
+/*
+ * Adds a region to the region table at index.
+ */
+static void
+add_region(uint8_t *table, int index, const uuid_t *guid, uint64_t offset, uint32_t length)
+{
+    uint8_t *entry = table + REGION_ENTRIES_OFFSET + index * REGION_ENTRY_SIZE;
+
+    uuid_enc_le(entry + REGION_ENTRY_GUID_OFFSET, guid);
+    le64enc(entry + REGION_ENTRY_FILE_OFFSET_OFFSET, offset);
+    le32enc(entry + REGION_ENTRY_LENGTH_OFFSET, length);
+    le32enc(entry + REGION_ENTRY_REQUIRED_OFFSET, 1);
+}
+
+/*
+ * Encodes the string as UTF-16 little endian at target, and returns the
+ * number of bytes written.
+ */
+static uint16_t
+encode_utf16(uint8_t *target, char *string)
+{
+    size_t i;
+
+    for (i = 0; string[i] != 0; i++) {
+        le16enc(target + i * 2, string[i]);
+    }
+
+    return i * 2;
+}
+
+/*
+ * Adds a parent locator with the linkage and the relative path of the
+ * parent to the metadata, with its data at offset in the metadata region.
+ */
+static void
+add_parent_locator(uint8_t *metadata, int index, uint32_t offset, char *parent)
+{
+    char *keys[] = {"parent_linkage", "relative_path"};
+    char value[128];
+    uint8_t *locator, *entry;
+    uint32_t position;
+    uint16_t length;
+    int i;
+
+    locator = metadata + offset;
+    uuid_enc_le(locator + LOCATOR_TYPE_OFFSET, &vhdx_locator_type_guid);
+    le16enc(locator + LOCATOR_COUNT_OFFSET, nitems(keys));
+    position = LOCATOR_ENTRIES_OFFSET + nitems(keys) * LOCATOR_ENTRY_SIZE;
+    for (i = 0; i < (int)nitems(keys); i++) {
+        if (i == 0) {
+            sprintf(value, "{%s}", TEST_LINKAGE);
+        } else {
+            sprintf(value, ".\\%s", parent);
+        }
+        entry = locator + LOCATOR_ENTRIES_OFFSET + i * LOCATOR_ENTRY_SIZE;
+        length = encode_utf16(locator + position, keys[i]);
+        le32enc(entry + LOCATOR_KEY_OFFSET_OFFSET, position);
+        le16enc(entry + LOCATOR_KEY_LENGTH_OFFSET, length);
+        position += length;
+        length = encode_utf16(locator + position, value);
+        le32enc(entry + LOCATOR_VALUE_OFFSET_OFFSET, position);
+        le16enc(entry + LOCATOR_VALUE_LENGTH_OFFSET, length);
+        position += length;
+    }
+    add_metadata_item(metadata, index, &parent_locator_guid, offset, position);
+}
+
+/*
+ * Returns the contents of a disk with 4 blocks of 1 MB and 512 byte
+ * sectors, without any blocks. If extra_region is true, the region table
+ * has a required region that is not known. If parent is set, the disk is
+ * a differencing disk of the file with that name in the same directory.
+ */
+static uint8_t *
+new_testimage(bool extra_region, char *parent)
+{
+    struct vhdx_header header;
+    uint8_t *data, *metadata, *table;
+    uuid_t unknown_guid;
+    uint32_t status;
+    int slot;
+
+    data = calloc(1, TEST_FILE_SIZE);
+    ATF_REQUIRE(data != NULL);
+    memcpy(data, VHDX_FILE_SIGNATURE, VHDX_FILE_SIGNATURE_SIZE);
+
+    /* Children link to the data write GUID of the parent. */
+    memset(&header, 0, sizeof(header));
+    header.version = VHDX_VERSION;
+    header.log_version = VHDX_LOG_VERSION;
+    header.log_offset = TEST_LOG_OFFSET;
+    header.log_length = MB;
+    if (parent == NULL) {
+        uuid_from_string(TEST_LINKAGE, &header.data_write_guid, &status);
+        ATF_REQUIRE_EQ(uuid_s_ok, status);
+    }
+    for (slot = 0; slot < 2; slot++) {
+        header.sequence_number = slot + 1;
+        vhdx_header_write(&header, data + VHDX_HEADER_OFFSET(slot));
+    }
+
+    table = data + VHDX_REGION_TABLE_OFFSET(0);
+    le32enc(table + REGION_SIGNATURE_OFFSET, REGION_TABLE_SIGNATURE);
+    le32enc(table + REGION_ENTRY_COUNT_OFFSET, extra_region ? 3 : 2);
+    add_region(table, 0, &vhdx_metadata_guid, TEST_METADATA_OFFSET, MB);
+    add_region(table, 1, &vhdx_bat_guid, TEST_BAT_OFFSET, MB);
+    if (extra_region) {
+        uuid_create(&unknown_guid, &status);
+        add_region(table, 2, &unknown_guid, TEST_BAT_OFFSET, MB);
+    }
+    le32enc(table + REGION_CHECKSUM_OFFSET,
+        vhdx_checksum(table, VHDX_REGION_TABLE_SIZE, REGION_CHECKSUM_OFFSET));
+    memcpy(data + VHDX_REGION_TABLE_OFFSET(1), table, VHDX_REGION_TABLE_SIZE);
+
+    metadata = data + TEST_METADATA_OFFSET;
+    memcpy(metadata, METADATA_SIGNATURE, METADATA_SIGNATURE_SIZE);
+    le16enc(metadata + TABLE_ENTRY_COUNT_OFFSET, parent != NULL ? 5 : 4);
+    add_metadata_item(metadata, 0, &file_parameters_guid, METADATA_TABLE_SIZE, 8);
+    add_metadata_item(metadata, 1, &disk_size_guid, METADATA_TABLE_SIZE + 8, 8);
+    add_metadata_item(metadata, 2, &logical_sector_size_guid, METADATA_TABLE_SIZE + 16, 4);
+    add_metadata_item(metadata, 3, &physical_sector_size_guid, METADATA_TABLE_SIZE + 20, 4);
+    le32enc(metadata + METADATA_TABLE_SIZE, TEST_BLOCK_SIZE);
+    le32enc(metadata + METADATA_TABLE_SIZE + 4, parent != NULL ? FLAG_HAS_PARENT : 0);
+    le64enc(metadata + METADATA_TABLE_SIZE + 8, TEST_BLOCKS * TEST_BLOCK_SIZE);
+    le32enc(metadata + METADATA_TABLE_SIZE + 16, 512);
+    le32enc(metadata + METADATA_TABLE_SIZE + 20, 4096);
+    if (parent != NULL) {
+        add_parent_locator(metadata, 4, METADATA_TABLE_SIZE + 24, parent);
+    }
+
+    return data;
+}
+
+/*
+ * Writes the contents of a disk to a new file, and sets path to its name.
+ */
+static void
+save_testimage(char *path, uint8_t *data)
+{
+    int fd;
+
+    strcpy(path, "vhdxinstance_test.XXXXXX");
+    fd = mkstemp(path);
+    ATF_REQUIRE(fd != -1);
+    ATF_REQUIRE_EQ(TEST_FILE_SIZE, write(fd, data, TEST_FILE_SIZE));
+    close(fd);
+    free(data);
+}
+
+/*
+ * Writes a dynamic disk. Block 0 is filled with 1s, block 1 is a zero
+ * block, block 2 is not present and block 3 is filled with 4s.
+ */
+static void
+write_testimage(char *path, bool extra_region)
+{
+    uint8_t *data;
+
+    data = new_testimage(extra_region, NULL);
+    le64enc(data + TEST_BAT_OFFSET, 4 * MB | PAYLOAD_FULLY_PRESENT);
+    le64enc(data + TEST_BAT_OFFSET + 8, PAYLOAD_ZERO);
+    le64enc(data + TEST_BAT_OFFSET + 16, PAYLOAD_NOT_PRESENT);
+    le64enc(data + TEST_BAT_OFFSET + 24, 5 * MB | PAYLOAD_FULLY_PRESENT);
+    memset(data + 4 * MB, 1, TEST_BLOCK_SIZE);
+    memset(data + 5 * MB, 4, TEST_BLOCK_SIZE);
+    save_testimage(path, data);
+}
+
+/*
+ * Writes a differencing disk of the test image at parent. Block 0 is
+ * partially present, with 7s in the first, second and last quarter. Block
+ * 1 is a zero block, which hides the parent, and blocks 2 and 3 are read
+ * from the parent. The sector bitmap block is at 5 MB.
+ */
+static void
+write_testchild(char *path, char *parent)
+{
+    uint8_t *data;
+
+    data = new_testimage(false, parent);
+    le64enc(data + TEST_BAT_OFFSET, 4 * MB | PAYLOAD_PARTIALLY_PRESENT);
+    le64enc(data + TEST_BAT_OFFSET + 8, PAYLOAD_ZERO);
+    le64enc(data + TEST_BAT_OFFSET + 16, PAYLOAD_NOT_PRESENT);
+    le64enc(data + TEST_BAT_OFFSET + 24, PAYLOAD_NOT_PRESENT);
+    le64enc(data + TEST_BAT_OFFSET + TEST_BITMAP_INDEX * 8, 5 * MB | BITMAP_PRESENT);
+    memset(data + 4 * MB, 7, TEST_BLOCK_SIZE);
+    memset(data + 5 * MB, 0xff, TEST_BLOCK_SIZE / 512 / 8 / 2);
+    memset(data + 5 * MB + TEST_BLOCK_SIZE / 512 / 8 * 3 / 4, 0xff,
+        TEST_BLOCK_SIZE / 512 / 8 / 4);
+    save_testimage(path, data);
+}
+
+/*
+ * Checks that the disk at path reads as expected, with each byte of
+ * expected giving the value of a part of size bytes.
+ */
+static void
+check_contents(struct fileinterface *fi, char *path, char *expected, size_t size)
+{
+    struct vhdxinstance *instance;
+    char *buffer;
+    size_t disk_size = TEST_BLOCKS * TEST_BLOCK_SIZE;
+    off_t offset;
+    size_t i;
+
+    ATF_REQUIRE(!IS_ERROR(vhdxinstance_open(fi, path, &instance, empty_logger)));
+    ATF_CHECK_EQ(disk_size, vhdxinstance_size(instance));
+    buffer = malloc(disk_size);
+    ATF_REQUIRE(buffer != NULL);
+
+    /* Reads crossing any number of boundaries see the right data. */
+    for (offset = 0; offset < disk_size; offset += 300 * 1024) {
+        memset(buffer, 0xAA, disk_size);
+        ATF_REQUIRE(!IS_ERROR(vhdxinstance_read(instance, buffer, disk_size - offset, offset)));
+        for (i = 0; i < disk_size - offset; i++) {
+            ATF_REQUIRE_EQ(expected[(offset + i) / size], buffer[i]);
+        }
+    }
+
+    free(buffer);
+    vhdxinstance_destroy(&instance);
+    ATF_CHECK_EQ(NULL, instance);
+}
+
+/*
+ * Reads nbytes at offset in the file at path.
+ */
+static void
+read_file(char *path, void *buffer, size_t nbytes, off_t offset)
+{
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    ATF_REQUIRE(fd != -1);
+    ATF_REQUIRE_EQ(nbytes, pread(fd, buffer, nbytes, offset));
+    close(fd);
+}
+
+/*
+ * Writes nbytes from the buffer at offset in the file at path.
+ */
+static void
+write_file(char *path, void *buffer, size_t nbytes, off_t offset)
+{
+    int fd;
+
+    fd = open(path, O_WRONLY);
+    ATF_REQUIRE(fd != -1);
+    ATF_REQUIRE_EQ(nbytes, pwrite(fd, buffer, nbytes, offset));
+    close(fd);
+}
+
+/*
+ * Copies the file at source to a new file at target.
+ */
+static void
+copy_file(char *source, char *target)
+{
+    char *buffer;
+    struct stat sb;
+    int fd;
+
+    ATF_REQUIRE(stat(source, &sb) == 0);
+    buffer = malloc(sb.st_size);
+    ATF_REQUIRE(buffer != NULL);
+    read_file(source, buffer, sb.st_size, 0);
+    fd = open(target, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ATF_REQUIRE(fd != -1);
+    ATF_REQUIRE_EQ(sb.st_size, write(fd, buffer, sb.st_size));
+    close(fd);
+    free(buffer);
+}
+
+ATF_TC_WITHOUT_HEAD(vhdxinstance_read__reads_differencing_disks_through_the_parent);
+ATF_TC_BODY(vhdxinstance_read__reads_differencing_disks_through_the_parent, tc)
+{
+    struct fileinterface *fi;
+    char parent[64], child[64];
+    char parent_blocks[4 * TEST_BLOCKS] = {1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 4, 4, 4, 4};
+    char child_blocks[4 * TEST_BLOCKS] = {7, 7, 1, 7, 0, 0, 0, 0, 0, 0, 0, 0, 4, 4, 4, 4};
+
+    write_testimage(parent, false);
+    write_testchild(child, parent);
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(LDI_CACHE_WRITEBACK, &fi)));
+
+    check_contents(fi, parent, parent_blocks, TEST_BLOCK_SIZE / 4);
+    check_contents(fi, child, child_blocks, TEST_BLOCK_SIZE / 4);
+
+    fileinterface_destroy(&fi);
+    unlink(child);
+    unlink(parent);
+}
+
+/* The sectors that the threads of the concurrent write test write to. */
+#define TEST_SHARED_SECTORS 16
+
+/*
+ * Writes every other byte of the shared sectors, one byte at a time,
+ * starting at the byte given by the thread.
+ */
+static void *
+write_bytes(void *arg)
+{
+    struct vhdxinstance *instance = ((void **)arg)[0];
+    intptr_t first = (intptr_t)((void **)arg)[1];
+    char value;
+    off_t i;
+
+    value = 'a' + first;
+    for (i = first; i < TEST_SHARED_SECTORS * 512; i += 2) {
+        ATF_REQUIRE(!IS_ERROR(vhdxinstance_write(instance, &value, 1,
+            2 * TEST_BLOCK_SIZE + i)));
+    }
+
+    return NULL;
+}
+
+ATF_TC_WITHOUT_HEAD(vhdxinstance_write__keeps_concurrent_writes_to_a_sector);
+ATF_TC_BODY(vhdxinstance_write__keeps_concurrent_writes_to_a_sector, tc)
+{
+    struct fileinterface *fi;
+    struct vhdxinstance *instance;
+    char parent[64], child[64];
+    char read[TEST_SHARED_SECTORS * 512];
+    void *args[2][2];
+    pthread_t threads[2];
+    int i;
+
+    write_testimage(parent, false);
+    write_testchild(child, parent);
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(LDI_CACHE_WRITEBACK, &fi)));
+    ATF_REQUIRE(!IS_ERROR(vhdxinstance_open(fi, child, &instance, empty_logger)));
+
+    /* Each write merges the rest of its sector, which the other changes. */
+    for (i = 0; i < 2; i++) {
+        args[i][0] = instance;
+        args[i][1] = (void *)(intptr_t)i;
+        ATF_REQUIRE_EQ(0, pthread_create(&threads[i], NULL, write_bytes, args[i]));
+    }
+    for (i = 0; i < 2; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    ATF_REQUIRE(!IS_ERROR(vhdxinstance_read(instance, read, sizeof(read),
+        2 * TEST_BLOCK_SIZE)));
+    for (i = 0; i < (int)sizeof(read); i++) {
+        ATF_REQUIRE_EQ('a' + i % 2, read[i]);
+    }
+
+    vhdxinstance_destroy(&instance);
+    fileinterface_destroy(&fi);
+    unlink(child);
+    unlink(parent);
+}
+
+ATF_TC_WITHOUT_HEAD(vhdxinstance_flush__writes_metadata_through_the_log);
+ATF_TC_BODY(vhdxinstance_flush__writes_metadata_through_the_log, tc)
+{
+    struct fileinterface *fi;
+    struct vhdxinstance *instance;
+    char parent[64], child[64], crashed[80];
+    char expected[4 * TEST_BLOCKS] = {7, 7, 1, 7, 0, 0, 0, 0, 9, 9, 0, 0, 4, 4, 4, 4};
+    uint8_t bat[METADATA_PAGE_SIZE], bitmap[METADATA_PAGE_SIZE], signature[4];
+    uint64_t entry;
+    char *buffer;
+
+    write_testimage(parent, false);
+    write_testchild(child, parent);
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(LDI_CACHE_WRITEBACK, &fi)));
+    read_file(child, bat, sizeof(bat), TEST_BAT_OFFSET);
+    read_file(child, bitmap, sizeof(bitmap), 5 * MB);
+
+    /* Half of a block that is read from the parent. */
+    buffer = malloc(TEST_BLOCK_SIZE / 2);
+    ATF_REQUIRE(buffer != NULL);
+    memset(buffer, 9, TEST_BLOCK_SIZE / 2);
+    ATF_REQUIRE(!IS_ERROR(vhdxinstance_open(fi, child, &instance, empty_logger)));
+    ATF_REQUIRE(!IS_ERROR(vhdxinstance_write(instance, buffer, TEST_BLOCK_SIZE / 2,
+        2 * TEST_BLOCK_SIZE)));
+    ATF_REQUIRE(!IS_ERROR(vhdxinstance_flush(instance)));
+    free(buffer);
+    expected[8] = expected[9] = 9;
+
+    /* The BAT and the sector bitmap were written through the log. */
+    read_file(child, signature, sizeof(signature), TEST_LOG_OFFSET);
+    ATF_CHECK_EQ(ENTRY_SIGNATURE, le32dec(signature));
+    read_file(child, &entry, sizeof(entry), TEST_BAT_OFFSET + 16);
+    ATF_CHECK_EQ(PAYLOAD_PARTIALLY_PRESENT, le64toh(entry) & ENTRY_STATE_MASK);
+    ATF_CHECK(TEST_FILE_SIZE <= (le64toh(entry) & ENTRY_OFFSET_MASK));
+
+    /*
+     * A crash before the pages were written in place loses nothing, since
+     * the log is replayed when the disk is opened. The copy is taken before
+     * the disk is closed, which marks the log as applied.
+     */
+    write_file(child, bat, sizeof(bat), TEST_BAT_OFFSET);
+    write_file(child, bitmap, sizeof(bitmap), 5 * MB);
+    sprintf(crashed, "%s.crashed", child);
+    copy_file(child, crashed);
+    vhdxinstance_destroy(&instance);
+    check_contents(fi, crashed, expected, TEST_BLOCK_SIZE / 4);
+
+    /* The parent is unchanged. */
+    expected[8] = expected[9] = 0;
+    expected[0] = expected[1] = expected[3] = 1;
+    check_contents(fi, parent, expected, TEST_BLOCK_SIZE / 4);
+
+    fileinterface_destroy(&fi);
+    unlink(crashed);
+    unlink(child);
+    unlink(parent);
+}
+
+ATF_TC_WITHOUT_HEAD(vhdxinstance_open__rejects_unknown_required_regions);
+ATF_TC_BODY(vhdxinstance_open__rejects_unknown_required_regions, tc)
+{
+    struct fileinterface *fi;
+    struct vhdxinstance *instance;
+    char path[64];
+
+    write_testimage(path, true);
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(LDI_CACHE_WRITEBACK, &fi)));
+    ATF_CHECK_EQ(LDI_ERR_FILENOTSUP, vhdxinstance_open(fi, path, &instance, empty_logger).code);
+
+    fileinterface_destroy(&fi);
+    unlink(path);
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+    ATF_TP_ADD_TC(tp, vhdxinstance_read__reads_differencing_disks_through_the_parent);
+    ATF_TP_ADD_TC(tp, vhdxinstance_write__keeps_concurrent_writes_to_a_sector);
+    ATF_TP_ADD_TC(tp, vhdxinstance_flush__writes_metadata_through_the_log);
+    ATF_TP_ADD_TC(tp, vhdxinstance_open__rejects_unknown_required_regions);
+
+    return 0;
+}
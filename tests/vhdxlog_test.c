@@ -0,0 +1,159 @@
+
+#include <atf-c.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Include the source files to test. */
+#include "blockcache.c"
+#include "bouncepool.c"
+#include "filemap.c"
+#include "fileinterface.c"
+#include "vhdxchecksum.c"
+#include "vhdxheader.c"
+#include "vhdxlog.c"
+
+void empty_log_write(int level, void *privarg, char *fmt, ...) { }
+
+struct logger empty_logger = {
+    .write = empty_log_write
+};
+
+#define TEST_LOG_OFFSET (1024 * 1024)
+#define TEST_LOG_LENGTH (1024 * 1024)
+#define TEST_DATA_OFFSET (2 * 1024 * 1024)
+#define TEST_FILE_SIZE (3 * 1024 * 1024)
+#define TEST_PAGES 3
+
+/*
+ * Creates a file with an empty log and a header that points at it, and
+ * commits three pages, the first two of which are contiguous, filled with
+ * 1s, 2s and 3s.
+ */
+static void
+commit_testpages(char *path, struct fileinterface *fi, struct file **file, struct vhdx_header *header)
+{
+    struct vhdxlog_page pages[TEST_PAGES];
+    uint64_t sequence_number = 1;
+    uint32_t status;
+    int i, fd;
+
+    strcpy(path, "vhdxlog_test.XXXXXX");
+    fd = mkstemp(path);
+    ATF_REQUIRE(fd != -1);
+    close(fd);
+    ATF_REQUIRE(!IS_ERROR(file_open(fi, path, file)));
+    ATF_REQUIRE(!IS_ERROR(file_setsize(*file, TEST_FILE_SIZE)));
+
+    memset(header, 0, sizeof(*header));
+    header->log_offset = TEST_LOG_OFFSET;
+    header->log_length = TEST_LOG_LENGTH;
+    uuid_create(&header->log_guid, &status);
+
+    for (i = 0; i < TEST_PAGES; i++) {
+        pages[i].offset = TEST_DATA_OFFSET + (i == 2 ? 4 : i) * VHDX_LOG_SECTOR_SIZE;
+        pages[i].data = malloc(VHDX_LOG_SECTOR_SIZE);
+        memset(pages[i].data, i + 1, VHDX_LOG_SECTOR_SIZE);
+    }
+    ATF_REQUIRE(!IS_ERROR(vhdxlog_commit(*file, header, &sequence_number, pages,
+        TEST_PAGES, empty_logger)));
+    ATF_CHECK_EQ(2, sequence_number);
+    for (i = 0; i < TEST_PAGES; i++) {
+        free(pages[i].data);
+    }
+}
+
+/*
+ * Zeros the pages in place, as if the file was not written before a crash.
+ */
+static void
+zero_testpages(struct file *file)
+{
+    char *zeros;
+
+    zeros = calloc(1, 5 * VHDX_LOG_SECTOR_SIZE);
+    ATF_REQUIRE(!IS_ERROR(file_write(file, zeros, 5 * VHDX_LOG_SECTOR_SIZE,
+        TEST_DATA_OFFSET, empty_logger)));
+    free(zeros);
+}
+
+ATF_TC_WITHOUT_HEAD(vhdx_crc32c__matches_the_check_value);
+ATF_TC_BODY(vhdx_crc32c__matches_the_check_value, tc)
+{
+    ATF_CHECK_EQ(0xe3069283, vhdx_crc32c("123456789", 9));
+}
+
+ATF_TC_WITHOUT_HEAD(vhdxlog_replay__applies_committed_pages);
+ATF_TC_BODY(vhdxlog_replay__applies_committed_pages, tc)
+{
+    struct fileinterface *fi;
+    struct file *file;
+    struct vhdx_header header;
+    char path[64];
+    char expected[5] = {1, 2, 0, 0, 3};
+    char *buffer;
+    bool replayed;
+    size_t i;
+
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(LDI_CACHE_WRITEBACK, &fi)));
+    commit_testpages(path, fi, &file, &header);
+    zero_testpages(file);
+
+    ATF_REQUIRE(!IS_ERROR(vhdxlog_replay(file, &header, &replayed, empty_logger)));
+    ATF_CHECK(replayed);
+
+    buffer = malloc(5 * VHDX_LOG_SECTOR_SIZE);
+    ATF_REQUIRE(!IS_ERROR(file_read(file, buffer, 5 * VHDX_LOG_SECTOR_SIZE,
+        TEST_DATA_OFFSET, empty_logger)));
+    for (i = 0; i < 5 * VHDX_LOG_SECTOR_SIZE; i++) {
+        ATF_REQUIRE_EQ(expected[i / VHDX_LOG_SECTOR_SIZE], buffer[i]);
+    }
+
+    free(buffer);
+    file_close(&file);
+    fileinterface_destroy(&fi);
+    unlink(path);
+}
+
+ATF_TC_WITHOUT_HEAD(vhdxlog_replay__ignores_entries_of_other_logs);
+ATF_TC_BODY(vhdxlog_replay__ignores_entries_of_other_logs, tc)
+{
+    struct fileinterface *fi;
+    struct file *file;
+    struct vhdx_header header;
+    char path[64];
+    char *buffer;
+    bool replayed;
+    uint32_t status;
+    size_t i;
+
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(LDI_CACHE_WRITEBACK, &fi)));
+    commit_testpages(path, fi, &file, &header);
+    zero_testpages(file);
+
+    uuid_create(&header.log_guid, &status);
+    ATF_REQUIRE(!IS_ERROR(vhdxlog_replay(file, &header, &replayed, empty_logger)));
+    ATF_CHECK(!replayed);
+
+    buffer = malloc(5 * VHDX_LOG_SECTOR_SIZE);
+    ATF_REQUIRE(!IS_ERROR(file_read(file, buffer, 5 * VHDX_LOG_SECTOR_SIZE,
+        TEST_DATA_OFFSET, empty_logger)));
+    for (i = 0; i < 5 * VHDX_LOG_SECTOR_SIZE; i++) {
+        ATF_REQUIRE_EQ(0, buffer[i]);
+    }
+
+    free(buffer);
+    file_close(&file);
+    fileinterface_destroy(&fi);
+    unlink(path);
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+    ATF_TP_ADD_TC(tp, vhdx_crc32c__matches_the_check_value);
+    ATF_TP_ADD_TC(tp, vhdxlog_replay__applies_committed_pages);
+    ATF_TP_ADD_TC(tp, vhdxlog_replay__ignores_entries_of_other_logs);
+
+    return 0;
+}
@@ -4,17 +4,11 @@
 /* Include the source file to test. */
 #include "vmdkdescriptorfile.c"
 
-LDI_ERROR vmdkextentdescriptor_new(char *source, struct vmdkextentdescriptor **descriptor) {
-	*descriptor = malloc(sizeof(struct vmdkextentdescriptor));
-	(*descriptor)->sectors = 44042240;
+LDI_ERROR vmdkextentdescriptor_parse(char *source, size_t length, struct vmdkextentdescriptor *descriptor, char **strings) {
+	descriptor->sectors = 44042240;
 	return NO_ERROR;
 }
 
-void vmdkextentdescriptor_destroy(struct vmdkextentdescriptor **descriptor) {
-	free(*descriptor);
-	*descriptor = NULL;
-}
-
 char *testdata = 
     "# Disk DescriptorFile\n"
     "version=1\n"
@@ -51,6 +45,29 @@ ATF_TC_BODY(vmdkdescriptorfile_new__correctly_reads_data, tc)
     ATF_CHECK_EQ(MONOLITHIC_SPARSE, descriptorfile->filetype);
     ATF_CHECK_EQ(1, descriptorfile->numextents);
     ATF_CHECK_EQ(44042240, descriptorfile->extents[0]->sectors);
+    ATF_CHECK_EQ(NULL, descriptorfile->parentfilenamehint);
+
+    vmdkdescriptorfile_destroy(&descriptorfile);
+}
+
+ATF_TC_WITHOUT_HEAD(vmdkdescriptorfile_new__reads_the_parent_of_delta_disks);
+ATF_TC_BODY(vmdkdescriptorfile_new__reads_the_parent_of_delta_disks, tc)
+{
+    struct vmdkdescriptorfile *descriptorfile;
+    char *delta =
+        "# Disk DescriptorFile\n"
+        "version=1\n"
+        "CID=8d2a93c1\n"
+        "parentCID=1a2b3c4d\n"
+        "createType=\"monolithicSparse\"\n"
+        "parentFileNameHint=\"base.vmdk\"\n"
+        "RW 44042240 SPARSE \"base-000001.vmdk\"\n";
+
+    ATF_REQUIRE(!IS_ERROR(vmdkdescriptorfile_new(delta, &descriptorfile, strlen(delta), empty_logger)));
+
+    ATF_CHECK_EQ(0x8d2a93c1, descriptorfile->cid);
+    ATF_CHECK_EQ(0x1a2b3c4d, descriptorfile->parentcid);
+    ATF_CHECK_STREQ("base.vmdk", descriptorfile->parentfilenamehint);
 
     vmdkdescriptorfile_destroy(&descriptorfile);
 }
@@ -58,5 +75,6 @@ ATF_TC_BODY(vmdkdescriptorfile_new__correctly_reads_data, tc)
 ATF_TP_ADD_TCS(tp)
 {
     ATF_TP_ADD_TC(tp, vmdkdescriptorfile_new__correctly_reads_data);
+    ATF_TP_ADD_TC(tp, vmdkdescriptorfile_new__reads_the_parent_of_delta_disks);
     return 0;
 }
@@ -39,9 +39,55 @@ ATF_TC_BODY(vmdkextentdescriptor_new__does_not_read_invalid_data, tc)
     ATF_CHECK_EQ(NULL, extentdescriptor);
 }
 
+ATF_TC_WITHOUT_HEAD(vmdkextentdescriptor_new__reads_zero_extents_without_filename);
+ATF_TC_BODY(vmdkextentdescriptor_new__reads_zero_extents_without_filename, tc)
+{
+    struct vmdkextentdescriptor *extentdescriptor;
+    LDI_ERROR res;
+
+    res = vmdkextentdescriptor_new("RW 2048 ZERO", &extentdescriptor);
+    ATF_REQUIRE_EQ(LDI_ERR_NOERROR, res.code);
+    ATF_CHECK_EQ(2048, extentdescriptor->sectors);
+    ATF_CHECK_EQ(VMDK_EXTENT_ZERO, extentdescriptor->type);
+    ATF_CHECK_EQ(NULL, extentdescriptor->filename);
+    vmdkextentdescriptor_destroy(&extentdescriptor);
+
+    // Extents other than ZERO must name a file.
+    res = vmdkextentdescriptor_new("RW 2048 FLAT", &extentdescriptor);
+    ATF_CHECK_EQ(LDI_ERR_PARSEERROR, res.code);
+}
+
+ATF_TC_WITHOUT_HEAD(vmdkextentdescriptor_parse__copies_filenames_to_the_arena);
+ATF_TC_BODY(vmdkextentdescriptor_parse__copies_filenames_to_the_arena, tc)
+{
+    struct vmdkextentdescriptor descriptors[2];
+    char *line = "RDONLY 4194304 FLAT \"my disk-f001.vmdk\" 2048\nRW 1 ZERO\n";
+    char arena[64];
+    char *strings = arena;
+
+    // Only the given length of the line is parsed.
+    ATF_REQUIRE(!IS_ERROR(vmdkextentdescriptor_parse(line, 44, &descriptors[0], &strings)));
+    ATF_CHECK_EQ(VMDK_ACCESS_RDONLY, descriptors[0].access);
+    ATF_CHECK_EQ(4194304, descriptors[0].sectors);
+    ATF_CHECK_EQ(VMDK_EXTENT_FLAT, descriptors[0].type);
+    ATF_CHECK_STREQ("my disk-f001.vmdk", descriptors[0].filename);
+    ATF_CHECK_EQ(2048, descriptors[0].offset);
+    ATF_CHECK_EQ(arena + strlen("my disk-f001.vmdk") + 1, strings);
+
+    // Extents without a filename use no space.
+    ATF_REQUIRE(!IS_ERROR(vmdkextentdescriptor_parse(line + 45, 9, &descriptors[1], &strings)));
+    ATF_CHECK_EQ(VMDK_EXTENT_ZERO, descriptors[1].type);
+    ATF_CHECK_EQ(arena + strlen("my disk-f001.vmdk") + 1, strings);
+
+    // An unterminated filename is an error.
+    ATF_CHECK_EQ(LDI_ERR_PARSEERROR, vmdkextentdescriptor_parse(line, 30, &descriptors[0], &strings).code);
+}
+
 ATF_TP_ADD_TCS(tp)
 {
     ATF_TP_ADD_TC(tp, vmdkextentdescriptor_new__correctly_reads_data);
     ATF_TP_ADD_TC(tp, vmdkextentdescriptor_new__does_not_read_invalid_data);
+    ATF_TP_ADD_TC(tp, vmdkextentdescriptor_new__reads_zero_extents_without_filename);
+    ATF_TP_ADD_TC(tp, vmdkextentdescriptor_parse__copies_filenames_to_the_arena);
     return 0;
 }
@@ -0,0 +1,123 @@
+
+#include <atf-c.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Include the source files to test. */
+#include "blockcache.c"
+#include "bouncepool.c"
+#include "filemap.c"
+#include "fileinterface.c"
+#include "kernels.c"
+#include "taskpool.c"
+#include "vmdkdescriptorfile.c"
+#include "vmdkextentdescriptor.c"
+#include "vmdkextents.c"
+#include "vmdksparseheader.c"
+#include "vmdksparse.c"
+#include "vmdkstream.c"
+
+void empty_log_write(int level, void *privarg, char *fmt, ...) { }
+
+struct logger empty_logger = {
+    .write = empty_log_write
+};
+
+/*
+ * Creates extents from a descriptor with the given extent lines.
+ */
+static void
+new_extents(char *lines, struct fileinterface **fi, struct vmdkdescriptorfile **descriptorfile, struct vmdkextents **extents)
+{
+    ATF_REQUIRE(!IS_ERROR(vmdkdescriptorfile_new(lines, descriptorfile, strlen(lines), empty_logger)));
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(LDI_CACHE_WRITEBACK, fi)));
+    ATF_REQUIRE(!IS_ERROR(vmdkextents_new(*fi, ".", *descriptorfile, false, extents, empty_logger)));
+}
+
+ATF_TC_WITHOUT_HEAD(find_extent__skips_empty_extents);
+ATF_TC_BODY(find_extent__skips_empty_extents, tc)
+{
+    struct fileinterface *fi;
+    struct vmdkdescriptorfile *descriptorfile;
+    struct vmdkextents *extents;
+
+    new_extents("RW 0 ZERO\nRW 2 ZERO\nRW 0 ZERO\nRW 0 ZERO\nRW 4 ZERO\nRW 1 ZERO\nRW 0 ZERO\n",
+        &fi, &descriptorfile, &extents);
+
+    ATF_CHECK_EQ(7 * 512, vmdkextents_size(extents));
+    ATF_CHECK_EQ(1, find_extent(extents, 0));
+    ATF_CHECK_EQ(1, find_extent(extents, 1023));
+    ATF_CHECK_EQ(4, find_extent(extents, 1024));
+    ATF_CHECK_EQ(4, find_extent(extents, 3071));
+    ATF_CHECK_EQ(5, find_extent(extents, 3072));
+    ATF_CHECK_EQ(5, find_extent(extents, 3583));
+
+    vmdkextents_destroy(&extents);
+    ATF_CHECK_EQ(NULL, extents);
+    vmdkdescriptorfile_destroy(&descriptorfile);
+    fileinterface_destroy(&fi);
+}
+
+ATF_TC_WITHOUT_HEAD(vmdkextents_read__reads_across_extents);
+ATF_TC_BODY(vmdkextents_read__reads_across_extents, tc)
+{
+    struct fileinterface *fi;
+    struct vmdkdescriptorfile *descriptorfile;
+    struct vmdkextents *extents;
+    char data[3 * 512], buffer[4 * 512];
+    char lines[128];
+    char path[64];
+    int fd, i;
+
+    /* The flat extent skips the first sector of its file. */
+    for (i = 0; i < sizeof(data); i++) {
+        data[i] = (char)(i * 7 + 1);
+    }
+    strcpy(path, "vmdkextents_test.XXXXXX");
+    fd = mkstemp(path);
+    ATF_REQUIRE(fd != -1);
+    ATF_REQUIRE_EQ(sizeof(data), write(fd, data, sizeof(data)));
+    close(fd);
+
+    snprintf(lines, sizeof(lines), "RW 2 FLAT \"%s\" 1\nRW 2 ZERO\n", path);
+    new_extents(lines, &fi, &descriptorfile, &extents);
+
+    memset(buffer, 0xAA, sizeof(buffer));
+    ATF_REQUIRE(!IS_ERROR(vmdkextents_read(extents, buffer, 3 * 512, 100)));
+    ATF_CHECK(memcmp(buffer, data + 512 + 100, 2 * 512 - 100) == 0);
+    for (i = 2 * 512 - 100; i < 3 * 512; i++) {
+        ATF_REQUIRE_EQ(0, buffer[i]);
+    }
+
+    vmdkextents_destroy(&extents);
+    vmdkdescriptorfile_destroy(&descriptorfile);
+    fileinterface_destroy(&fi);
+    unlink(path);
+}
+
+ATF_TC_WITHOUT_HEAD(vmdkextents_new__fails_for_missing_files);
+ATF_TC_BODY(vmdkextents_new__fails_for_missing_files, tc)
+{
+    struct fileinterface *fi;
+    struct vmdkdescriptorfile *descriptorfile;
+    struct vmdkextents *extents;
+    char *lines = "RW 2 FLAT \"vmdkextents_test.missing\"\n";
+
+    ATF_REQUIRE(!IS_ERROR(vmdkdescriptorfile_new(lines, &descriptorfile, strlen(lines), empty_logger)));
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(LDI_CACHE_WRITEBACK, &fi)));
+    ATF_CHECK(IS_ERROR(vmdkextents_new(fi, ".", descriptorfile, false, &extents, empty_logger)));
+
+    vmdkdescriptorfile_destroy(&descriptorfile);
+    fileinterface_destroy(&fi);
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+    ATF_TP_ADD_TC(tp, find_extent__skips_empty_extents);
+    ATF_TP_ADD_TC(tp, vmdkextents_read__reads_across_extents);
+    ATF_TP_ADD_TC(tp, vmdkextents_new__fails_for_missing_files);
+
+    return 0;
+}
@@ -0,0 +1,254 @@
+
+#include <atf-c.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Include the source files to test. */
+#include "blockcache.c"
+#include "bouncepool.c"
+#include "filemap.c"
+#include "fileinterface.c"
+#include "kernels.c"
+#include "taskpool.c"
+#include "vhdchain.c"
+
+/* vmdkcreate.c has a static function named like one of vmdksparse.c. */
+#define write_directory write_child_directory
+#include "vmdkcreate.c"
+#undef write_directory
+
+#include "vmdkdescriptorfile.c"
+#include "vmdkextentdescriptor.c"
+#include "vmdkextents.c"
+#include "vmdkparser.c"
+#include "vmdksparseheader.c"
+#include "vmdksparse.c"
+#include "vmdkstream.c"
+
+void empty_log_write(int level, void *privarg, char *fmt, ...) { }
+
+struct logger empty_logger = {
+    .write = empty_log_write
+};
+
+/* Two blocks of the chain index, of 16 grains each. */
+#define TEST_SECTORS (2 * CHAIN_BLOCK_SECTORS)
+#define TEST_DISK_SIZE (TEST_SECTORS * SECTOR_SIZE)
+#define TEST_GRAIN_BYTES (GRAIN_SIZE * SECTOR_SIZE)
+#define TEST_BASE_CID 0x1a2b3c4d
+
+/* The paths of the files of a chain of a base disk and a delta disk. */
+struct testchain {
+    char directory[64];
+    char base[128];
+    char flat[128];
+    char child[128];
+};
+
+/*
+ * Fills nbytes of buffer with data that depends on value and on the
+ * offset of each sector in the disk.
+ */
+static void
+fill(char *buffer, size_t nbytes, off_t offset, int value)
+{
+    size_t i;
+
+    for (i = 0; i < nbytes; i++) {
+        buffer[i] = value + (offset + i) / SECTOR_SIZE;
+    }
+}
+
+/*
+ * Writes the descriptor of the base disk, which has a single FLAT extent.
+ */
+static void
+write_base_descriptor(struct testchain *chain, uint32_t cid)
+{
+    FILE *f;
+
+    f = fopen(chain->base, "w");
+    ATF_REQUIRE(f != NULL);
+    fprintf(f,
+        "# Disk DescriptorFile\n"
+        "version=1\n"
+        "CID=%08x\n"
+        "parentCID=ffffffff\n"
+        "createType=\"monolithicFlat\"\n"
+        "RW %d FLAT \"base-flat.vmdk\" 0\n", cid, TEST_SECTORS);
+    fclose(f);
+}
+
+/*
+ * Creates a base disk with the data and a delta disk on top of it, in a
+ * new directory.
+ */
+static void
+create_chain(struct fileinterface *fi, struct testchain *chain, char *data)
+{
+    int fd;
+
+    strcpy(chain->directory, "vmdkparser_test.XXXXXX");
+    ATF_REQUIRE(mkdtemp(chain->directory) != NULL);
+    sprintf(chain->base, "%s/base.vmdk", chain->directory);
+    sprintf(chain->flat, "%s/base-flat.vmdk", chain->directory);
+    sprintf(chain->child, "%s/base-000001.vmdk", chain->directory);
+
+    fd = open(chain->flat, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ATF_REQUIRE(fd != -1);
+    ATF_REQUIRE_EQ(TEST_DISK_SIZE, write(fd, data, TEST_DISK_SIZE));
+    close(fd);
+    write_base_descriptor(chain, TEST_BASE_CID);
+
+    ATF_REQUIRE(!IS_ERROR(vmdkcreate_child(fi, chain->base, chain->child, empty_logger)));
+}
+
+/*
+ * Removes the files of the chain and the directory.
+ */
+static void
+remove_chain(struct testchain *chain)
+{
+    unlink(chain->child);
+    unlink(chain->flat);
+    unlink(chain->base);
+    rmdir(chain->directory);
+}
+
+/*
+ * Returns the layer that owns the sector at offset in the chain index.
+ */
+static void *
+owner(struct vmdkparser *parser, off_t offset)
+{
+    struct vhdchain_run *run;
+
+    run = vhdchain_lookup(parser->chain, offset / (CHAIN_BLOCK_SECTORS * SECTOR_SIZE),
+        offset / SECTOR_SIZE % CHAIN_BLOCK_SECTORS);
+    ATF_REQUIRE(run != NULL);
+
+    return run->layer;
+}
+
+ATF_TC_WITHOUT_HEAD(vmdkparser_write__writes_delta_disks_over_the_parent);
+ATF_TC_BODY(vmdkparser_write__writes_delta_disks_over_the_parent, tc)
+{
+    struct diskimage_options options;
+    struct fileinterface *fi;
+    struct vmdkparser *child;
+    struct testchain chain;
+    char *base, *expected, *read;
+    size_t length;
+    bool allocated;
+
+    base = malloc(TEST_DISK_SIZE);
+    expected = malloc(TEST_DISK_SIZE);
+    read = malloc(TEST_DISK_SIZE);
+    ATF_REQUIRE(base != NULL && expected != NULL && read != NULL);
+    fill(base, TEST_DISK_SIZE, 0, 1);
+    memcpy(expected, base, TEST_DISK_SIZE);
+
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(LDI_CACHE_WRITEBACK, &fi)));
+    create_chain(fi, &chain, base);
+    bzero(&options, sizeof(options));
+    ATF_REQUIRE(!IS_ERROR(vmdkparser_new(fi, chain.child, options, (void **)&child,
+        empty_logger)));
+    ATF_REQUIRE(child->parent != NULL);
+    ATF_CHECK_EQ(TEST_BASE_CID, child->parent->descriptorfile->cid);
+    ATF_CHECK_EQ(TEST_DISK_SIZE, vmdkparser_diskinfo(child).disksize);
+
+    /* An empty delta disk reads as the parent, which owns all sectors. */
+    ATF_REQUIRE(!IS_ERROR(vmdkparser_read(child, read, TEST_DISK_SIZE, 0)));
+    ATF_CHECK(memcmp(expected, read, TEST_DISK_SIZE) == 0);
+    ATF_CHECK_EQ(child->parent, owner(child, 0));
+    ATF_CHECK_EQ(child->parent, owner(child, TEST_DISK_SIZE - SECTOR_SIZE));
+
+    /*
+     * Part of a sector in grain 1, and sectors across the end of the
+     * first block of the index.
+     */
+    fill(expected + TEST_GRAIN_BYTES + 1000, 100, TEST_GRAIN_BYTES + 1000, 7);
+    fill(expected + TEST_DISK_SIZE / 2 - 1024, 2048, TEST_DISK_SIZE / 2 - 1024, 9);
+    ATF_REQUIRE(!IS_ERROR(vmdkparser_write(child, expected + TEST_GRAIN_BYTES + 1000, 100,
+        TEST_GRAIN_BYTES + 1000)));
+    ATF_REQUIRE(!IS_ERROR(vmdkparser_write(child, expected + TEST_DISK_SIZE / 2 - 1024,
+        2048, TEST_DISK_SIZE / 2 - 1024)));
+
+    /* The written sectors move to the child in the index. */
+    ATF_CHECK_EQ(child, owner(child, TEST_GRAIN_BYTES + 1000));
+    ATF_CHECK_EQ(child->parent, owner(child, TEST_GRAIN_BYTES));
+    ATF_CHECK_EQ(child, owner(child, TEST_DISK_SIZE / 2));
+    ATF_CHECK_EQ(child->parent, owner(child, TEST_DISK_SIZE / 2 + 1024));
+    ATF_REQUIRE(!IS_ERROR(vmdkparser_read(child, read, TEST_DISK_SIZE, 0)));
+    ATF_CHECK(memcmp(expected, read, TEST_DISK_SIZE) == 0);
+
+    /* The rest of a partially written grain is filled from the parent. */
+    ATF_REQUIRE(!IS_ERROR(vmdkextents_allocated(child->extents, TEST_GRAIN_BYTES,
+        TEST_GRAIN_BYTES, &allocated, &length)));
+    ATF_CHECK(allocated);
+    ATF_CHECK_EQ(TEST_GRAIN_BYTES, length);
+    ATF_REQUIRE(!IS_ERROR(vmdkextents_read(child->extents, read, TEST_GRAIN_BYTES,
+        TEST_GRAIN_BYTES)));
+    ATF_CHECK(memcmp(expected + TEST_GRAIN_BYTES, read, TEST_GRAIN_BYTES) == 0);
+
+    ATF_REQUIRE(!IS_ERROR(vmdkparser_flush(child)));
+    vmdkparser_destroy((void **)&child);
+
+    /* The writes survive reopening, and the parent is unchanged. */
+    ATF_REQUIRE(!IS_ERROR(vmdkparser_new(fi, chain.child, options, (void **)&child,
+        empty_logger)));
+    ATF_REQUIRE(!IS_ERROR(vmdkparser_read(child, read, TEST_DISK_SIZE, 0)));
+    ATF_CHECK(memcmp(expected, read, TEST_DISK_SIZE) == 0);
+    ATF_REQUIRE(!IS_ERROR(vmdkparser_read(child->parent, read, TEST_DISK_SIZE, 0)));
+    ATF_CHECK(memcmp(base, read, TEST_DISK_SIZE) == 0);
+    vmdkparser_destroy((void **)&child);
+
+    free(base);
+    free(expected);
+    free(read);
+    fileinterface_destroy(&fi);
+    remove_chain(&chain);
+}
+
+ATF_TC_WITHOUT_HEAD(vmdkparser_new__rejects_parents_with_another_cid);
+ATF_TC_BODY(vmdkparser_new__rejects_parents_with_another_cid, tc)
+{
+    struct diskimage_options options;
+    struct fileinterface *fi;
+    struct vmdkparser *child;
+    struct testchain chain;
+    char *base;
+
+    base = calloc(1, TEST_DISK_SIZE);
+    ATF_REQUIRE(base != NULL);
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(LDI_CACHE_WRITEBACK, &fi)));
+    create_chain(fi, &chain, base);
+
+    /* The parent was changed after the child was created. */
+    write_base_descriptor(&chain, TEST_BASE_CID + 1);
+    bzero(&options, sizeof(options));
+    ATF_CHECK_EQ(LDI_ERR_PARENTNOTFOUND, vmdkparser_new(fi, chain.child, options,
+        (void **)&child, empty_logger).code);
+
+    /* The chain opens again once the CID matches. */
+    write_base_descriptor(&chain, TEST_BASE_CID);
+    ATF_REQUIRE(!IS_ERROR(vmdkparser_new(fi, chain.child, options, (void **)&child,
+        empty_logger)));
+    vmdkparser_destroy((void **)&child);
+
+    free(base);
+    fileinterface_destroy(&fi);
+    remove_chain(&chain);
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+    ATF_TP_ADD_TC(tp, vmdkparser_write__writes_delta_disks_over_the_parent);
+    ATF_TP_ADD_TC(tp, vmdkparser_new__rejects_parents_with_another_cid);
+
+    return 0;
+}
@@ -0,0 +1,208 @@
+
+#include <atf-c.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Include the source files to test. */
+#include "blockcache.c"
+#include "bouncepool.c"
+#include "filemap.c"
+#include "fileinterface.c"
+#include "vmdkdescriptorfile.c"
+#include "vmdkextentdescriptor.c"
+#include "vmdksparseheader.c"
+#include "vmdksparse.c"
+
+void empty_log_write(int level, void *privarg, char *fmt, ...) { }
+
+struct logger empty_logger = {
+    .write = empty_log_write
+};
+
+#define TEST_GRAIN_SIZE 8
+#define TEST_GRAIN_BYTES (TEST_GRAIN_SIZE * SECTOR_SIZE)
+#define TEST_GRAINS 8
+
+/*
+ * Writes a sparse extent with 8 grains in two grain tables of 4 entries.
+ * Grains 0 and 1 are next to each other in the file, grain 2 is a zero
+ * grain and grain 3 is stored before grain 0. The second grain table is
+ * not allocated. Each allocated grain is filled with its number plus one.
+ */
+static void
+write_testextent(char *path)
+{
+    struct vmdksparseheader header;
+    char *data;
+    uint32_t gd[2] = {htole32(2), 0};
+    uint32_t gt[4] = {htole32(16), htole32(24), htole32(1), htole32(8)};
+    size_t size = 40 * SECTOR_SIZE;
+    int fd;
+
+    data = calloc(1, size);
+    ATF_REQUIRE(data != NULL);
+
+    memset(&header, 0, sizeof(header));
+    header.version = 1;
+    header.flags = VMDK_FLAG_VALID_NEWLINE_TEST;
+    header.capacity = TEST_GRAINS * TEST_GRAIN_SIZE;
+    header.grain_size = TEST_GRAIN_SIZE;
+    header.num_gtes_per_gt = 4;
+    header.gd_offset = 1;
+    header.overhead = 8;
+    vmdksparseheader_write(&header, data);
+
+    memcpy(data + 1 * SECTOR_SIZE, gd, sizeof(gd));
+    memcpy(data + 2 * SECTOR_SIZE, gt, sizeof(gt));
+    memset(data + 16 * SECTOR_SIZE, 1, TEST_GRAIN_BYTES);
+    memset(data + 24 * SECTOR_SIZE, 2, TEST_GRAIN_BYTES);
+    memset(data + 8 * SECTOR_SIZE, 4, TEST_GRAIN_BYTES);
+
+    strcpy(path, "vmdksparse_test.XXXXXX");
+    fd = mkstemp(path);
+    ATF_REQUIRE(fd != -1);
+    ATF_REQUIRE_EQ(size, write(fd, data, size));
+    close(fd);
+    free(data);
+}
+
+ATF_TC_WITHOUT_HEAD(vmdksparse_read__reads_grains_through_the_grain_tables);
+ATF_TC_BODY(vmdksparse_read__reads_grains_through_the_grain_tables, tc)
+{
+    struct fileinterface *fi;
+    struct file *f;
+    struct vmdksparse *sparse;
+    char path[64];
+    char expected[TEST_GRAINS] = {1, 2, 0, 4, 0, 0, 0, 0};
+    char *buffer;
+    size_t size = TEST_GRAINS * TEST_GRAIN_BYTES;
+    off_t offset;
+    size_t i;
+
+    write_testextent(path);
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(LDI_CACHE_WRITEBACK, &fi)));
+    ATF_REQUIRE(!IS_ERROR(file_open(fi, path, &f)));
+    ATF_REQUIRE(!IS_ERROR(vmdksparse_open(f, &sparse, empty_logger)));
+    ATF_CHECK_EQ(size, vmdksparse_size(sparse));
+
+    buffer = malloc(size);
+
+    /* Reads crossing any number of grain boundaries see the right grains. */
+    for (offset = 0; offset < size; offset += 1000) {
+        memset(buffer, 0xAA, size);
+        ATF_REQUIRE(!IS_ERROR(vmdksparse_read(sparse, buffer, size - offset, offset)));
+        for (i = 0; i < size - offset; i++) {
+            ATF_REQUIRE_EQ(expected[(offset + i) / TEST_GRAIN_BYTES], buffer[i]);
+        }
+    }
+
+    /* Reading past the end of the extent is an error. */
+    ATF_CHECK(IS_ERROR(vmdksparse_read(sparse, buffer, 200, size)));
+
+    free(buffer);
+    vmdksparse_destroy(&sparse);
+    ATF_CHECK_EQ(NULL, sparse);
+    file_close(&f);
+    fileinterface_destroy(&fi);
+    unlink(path);
+}
+
+ATF_TC_WITHOUT_HEAD(vmdksparse_write__allocates_grains_that_survive_reopening);
+ATF_TC_BODY(vmdksparse_write__allocates_grains_that_survive_reopening, tc)
+{
+    struct fileinterface *fi;
+    struct file *f;
+    struct vmdksparse *sparse;
+    char path[64];
+    char expected[TEST_GRAINS] = {1, 9, 0, 4, 0, 0, 9, 0};
+    char *buffer;
+    size_t size = TEST_GRAINS * TEST_GRAIN_BYTES;
+    size_t i;
+
+    write_testextent(path);
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(LDI_CACHE_WRITEBACK, &fi)));
+    ATF_REQUIRE(!IS_ERROR(file_open(fi, path, &f)));
+    ATF_REQUIRE(!IS_ERROR(vmdksparse_open(f, &sparse, empty_logger)));
+
+    buffer = malloc(size);
+    memset(buffer, 9, TEST_GRAIN_BYTES);
+
+    /*
+     * Overwrite an allocated grain, and write half of a grain in the table
+     * that was never allocated.
+     */
+    ATF_REQUIRE(!IS_ERROR(vmdksparse_write(sparse, buffer, TEST_GRAIN_BYTES, TEST_GRAIN_BYTES)));
+    ATF_REQUIRE(!IS_ERROR(vmdksparse_write(sparse, buffer, TEST_GRAIN_BYTES / 2, 6 * TEST_GRAIN_BYTES)));
+    expected[6] = 9;
+
+    /* The new data is read back before and after the extent is reopened. */
+    ATF_REQUIRE(!IS_ERROR(vmdksparse_read(sparse, buffer, size, 0)));
+    ATF_CHECK_EQ(9, buffer[6 * TEST_GRAIN_BYTES]);
+    ATF_CHECK_EQ(0, buffer[6 * TEST_GRAIN_BYTES + TEST_GRAIN_BYTES / 2]);
+    ATF_REQUIRE(!IS_ERROR(vmdksparse_flush(sparse)));
+    vmdksparse_destroy(&sparse);
+    file_close(&f);
+
+    ATF_REQUIRE(!IS_ERROR(file_open(fi, path, &f)));
+    ATF_REQUIRE(!IS_ERROR(vmdksparse_open(f, &sparse, empty_logger)));
+    ATF_REQUIRE(!IS_ERROR(vmdksparse_read(sparse, buffer, size, 0)));
+    for (i = 0; i < size; i++) {
+        if (i / TEST_GRAIN_BYTES == 6 && i % TEST_GRAIN_BYTES >= TEST_GRAIN_BYTES / 2)
+            ATF_REQUIRE_EQ(0, buffer[i]);
+        else
+            ATF_REQUIRE_EQ(expected[i / TEST_GRAIN_BYTES], buffer[i]);
+    }
+
+    free(buffer);
+    vmdksparse_destroy(&sparse);
+    file_close(&f);
+    fileinterface_destroy(&fi);
+    unlink(path);
+}
+
+ATF_TC_WITHOUT_HEAD(vmdksparse_open__rejects_compressed_extents);
+ATF_TC_BODY(vmdksparse_open__rejects_compressed_extents, tc)
+{
+    struct fileinterface *fi;
+    struct file *f;
+    struct vmdksparse *sparse;
+    struct vmdksparseheader header;
+    char data[SECTOR_SIZE];
+    char path[64];
+    int fd;
+
+    memset(&header, 0, sizeof(header));
+    header.version = 3;
+    header.flags = VMDK_FLAG_COMPRESSED | VMDK_FLAG_MARKERS;
+    header.capacity = 128;
+    header.grain_size = 128;
+    header.num_gtes_per_gt = 512;
+    header.gd_offset = VMDK_GD_AT_END;
+    memset(data, 0, sizeof(data));
+    vmdksparseheader_write(&header, data);
+
+    strcpy(path, "vmdksparse_test.XXXXXX");
+    fd = mkstemp(path);
+    ATF_REQUIRE(fd != -1);
+    ATF_REQUIRE_EQ(sizeof(data), write(fd, data, sizeof(data)));
+    close(fd);
+
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(LDI_CACHE_WRITEBACK, &fi)));
+    ATF_REQUIRE(!IS_ERROR(file_open(fi, path, &f)));
+    ATF_CHECK_EQ(LDI_ERR_FILENOTSUP, vmdksparse_open(f, &sparse, empty_logger).code);
+
+    file_close(&f);
+    fileinterface_destroy(&fi);
+    unlink(path);
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+    ATF_TP_ADD_TC(tp, vmdksparse_read__reads_grains_through_the_grain_tables);
+    ATF_TP_ADD_TC(tp, vmdksparse_write__allocates_grains_that_survive_reopening);
+    ATF_TP_ADD_TC(tp, vmdksparse_open__rejects_compressed_extents);
+
+    return 0;
+}
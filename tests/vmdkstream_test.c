@@ -0,0 +1,175 @@
+
+#include <atf-c.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+/* Include the source files to test. */
+#include "blockcache.c"
+#include "bouncepool.c"
+#include "filemap.c"
+#include "fileinterface.c"
+#include "taskpool.c"
+#include "vmdksparseheader.c"
+#include "vmdkstream.c"
+
+void empty_log_write(int level, void *privarg, char *fmt, ...) { }
+
+struct logger empty_logger = {
+    .write = empty_log_write
+};
+
+#define TEST_GRAIN_SIZE 8
+#define TEST_GRAIN_BYTES (TEST_GRAIN_SIZE * SECTOR_SIZE)
+#define TEST_GRAINS 8
+
+/*
+ * Appends a marker for the grain, filled with value, to the stream.
+ */
+static size_t
+append_grain(char *data, size_t pos, uint64_t grain, char value)
+{
+    char plain[TEST_GRAIN_BYTES];
+    uLongf length = 2 * TEST_GRAIN_BYTES;
+
+    memset(plain, value, sizeof(plain));
+    ATF_REQUIRE_EQ(Z_OK, compress((Bytef *)data + pos + GRAIN_MARKER_SIZE, &length,
+        (Bytef *)plain, sizeof(plain)));
+    le64enc(data + pos, grain * TEST_GRAIN_SIZE);
+    le32enc(data + pos + 8, length);
+
+    return pos + roundup(GRAIN_MARKER_SIZE + length, SECTOR_SIZE);
+}
+
+/*
+ * Writes a stream optimized extent of 8 grains. Grains 3 and 1 are in the
+ * stream in that order, grain 5 twice, and the others are not stored.
+ */
+static void
+write_teststream(char *path)
+{
+    struct vmdksparseheader header;
+    char *data;
+    size_t pos;
+    int fd;
+
+    data = calloc(1, 64 * SECTOR_SIZE);
+    ATF_REQUIRE(data != NULL);
+
+    memset(&header, 0, sizeof(header));
+    header.version = 3;
+    header.flags = VMDK_FLAG_VALID_NEWLINE_TEST | VMDK_FLAG_COMPRESSED | VMDK_FLAG_MARKERS;
+    header.capacity = TEST_GRAINS * TEST_GRAIN_SIZE;
+    header.grain_size = TEST_GRAIN_SIZE;
+    header.num_gtes_per_gt = 512;
+    header.gd_offset = VMDK_GD_AT_END;
+    header.overhead = 1;
+    header.compress_algorithm = COMPRESSION_DEFLATE;
+    vmdksparseheader_write(&header, data);
+
+    pos = append_grain(data, SECTOR_SIZE, 3, 3);
+    pos = append_grain(data, pos, 5, 4);
+    pos = append_grain(data, pos, 1, 1);
+    pos = append_grain(data, pos, 5, 5);
+
+    /* A grain directory marker and the end-of-stream marker. */
+    le64enc(data + pos, 1);
+    le32enc(data + pos + 12, MARKER_GD);
+    pos += 2 * SECTOR_SIZE;
+    pos += SECTOR_SIZE;
+
+    strcpy(path, "vmdkstream_test.XXXXXX");
+    fd = mkstemp(path);
+    ATF_REQUIRE(fd != -1);
+    ATF_REQUIRE_EQ(pos, write(fd, data, pos));
+    close(fd);
+    free(data);
+}
+
+/*
+ * Opens the stream and checks that all of it reads as expected.
+ */
+static void
+check_teststream(struct fileinterface *fi, char *path)
+{
+    struct file *f;
+    struct vmdkstream *stream;
+    char expected[TEST_GRAINS] = {0, 1, 0, 3, 0, 5, 0, 0};
+    char buffer[TEST_GRAINS * TEST_GRAIN_BYTES];
+    off_t offset;
+    size_t i;
+
+    ATF_REQUIRE(!IS_ERROR(file_open(fi, path, &f)));
+    ATF_REQUIRE(!IS_ERROR(vmdkstream_open(fi, f, &stream, empty_logger)));
+    ATF_CHECK_EQ(3, stream->count);
+
+    /* Both reads of single grains and reads inflating several grains. */
+    for (offset = 0; offset < sizeof(buffer); offset += 1000) {
+        memset(buffer, 0xAA, sizeof(buffer));
+        ATF_REQUIRE(!IS_ERROR(vmdkstream_read(stream, buffer, sizeof(buffer) - offset, offset)));
+        for (i = 0; i < sizeof(buffer) - offset; i++) {
+            ATF_REQUIRE_EQ(expected[(offset + i) / TEST_GRAIN_BYTES], buffer[i]);
+        }
+    }
+
+    vmdkstream_destroy(&stream);
+    ATF_CHECK_EQ(NULL, stream);
+    file_close(&f);
+}
+
+ATF_TC_WITHOUT_HEAD(vmdkstream_read__reads_grains_through_the_index);
+ATF_TC_BODY(vmdkstream_read__reads_grains_through_the_index, tc)
+{
+    struct fileinterface *fi;
+    char path[64], index[80];
+
+    write_teststream(path);
+    snprintf(index, sizeof(index), "%s.index", path);
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(LDI_CACHE_WRITEBACK, &fi)));
+
+    /* The first open walks the markers and saves the index. */
+    check_teststream(fi, path);
+    ATF_CHECK_EQ(0, access(index, F_OK));
+
+    /* The second open loads the index instead. */
+    check_teststream(fi, path);
+
+    fileinterface_destroy(&fi);
+    unlink(index);
+    unlink(path);
+}
+
+ATF_TC_WITHOUT_HEAD(vmdkstream_open__ignores_the_index_of_another_extent);
+ATF_TC_BODY(vmdkstream_open__ignores_the_index_of_another_extent, tc)
+{
+    struct fileinterface *fi;
+    char path[64], index[80];
+    int fd;
+
+    write_teststream(path);
+    snprintf(index, sizeof(index), "%s.index", path);
+
+    /* An index with the right magic, but for a file of another size. */
+    fd = open(index, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    ATF_REQUIRE(fd != -1);
+    ATF_REQUIRE_EQ(8, write(fd, INDEX_MAGIC, 8));
+    ATF_REQUIRE_EQ(0, ftruncate(fd, INDEX_HEADER_SIZE));
+    close(fd);
+
+    ATF_REQUIRE(!IS_ERROR(fileinterface_create(LDI_CACHE_WRITEBACK, &fi)));
+    check_teststream(fi, path);
+
+    fileinterface_destroy(&fi);
+    unlink(index);
+    unlink(path);
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+    ATF_TP_ADD_TC(tp, vmdkstream_read__reads_grains_through_the_index);
+    ATF_TP_ADD_TC(tp, vmdkstream_open__ignores_the_index_of_another_extent);
+
+    return 0;
+}